@@ -0,0 +1,167 @@
+/* ADC Stream Implementation
+ *
+ * A result is one 32-bit word (TYPE2 format) holding the 12-bit reading,
+ * the channel and the unit. The task rewrites each word as the reading,
+ * compacting over any result that is not ours, so the frame becomes an
+ * int32_t array in the DMA buffer itself. PIE vector code runs in the
+ * task only, never in the interrupt.
+ */
+
+#include <string.h>
+#include "adc_stream.h"
+
+#if CONFIG_APP_ADC_STREAM
+
+#include "stats_agg.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *TAG = "adc_stream";
+
+#define FRAME_BYTES     (CONFIG_APP_ADC_STREAM_FRAME_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES)
+#define QUEUE_LEN       3       // Below the driver's ring of DMA frames
+
+_Static_assert(SOC_ADC_DIGI_RESULT_BYTES == sizeof(int32_t), "frames are reduced as int32_t");
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t size;
+} frame_t;
+
+static adc_continuous_handle_t s_adc = NULL;
+static QueueHandle_t s_frames = NULL;
+static TaskHandle_t s_task = NULL;
+static uint8_t s_agg_id = 0;
+static adc_stream_stats_t s_stats;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool IRAM_ATTR on_conv_done(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata,
+                                   void *user_data)
+{
+    frame_t frame = { edata->conv_frame_buffer, edata->size };
+    BaseType_t woken = pdFALSE;
+    if (xQueueSendFromISR(s_frames, &frame, &woken) != pdTRUE) {
+        portENTER_CRITICAL_ISR(&s_lock);
+        s_stats.dropped++;
+        portEXIT_CRITICAL_ISR(&s_lock);
+    }
+    return woken == pdTRUE;
+}
+
+static void stream_task(void *arg)
+{
+    while (1) {
+        frame_t frame;
+        xQueueReceive(s_frames, &frame, portMAX_DELAY);
+
+        // In place: word i is read before value n <= i is written over it
+        const adc_digi_output_data_t *in = (const adc_digi_output_data_t *)frame.buf;
+        int32_t *values = (int32_t *)frame.buf;
+        size_t words = frame.size / SOC_ADC_DIGI_RESULT_BYTES;
+        size_t n = 0;
+        for (size_t i = 0; i < words; i++) {
+            adc_digi_output_data_t word = in[i];
+            if (word.type2.unit == ADC_UNIT_1 && word.type2.channel == CONFIG_APP_ADC_STREAM_CHANNEL) {
+                values[n++] = (int32_t)word.type2.data;
+            }
+        }
+        stats_agg_record_block(s_agg_id, values, n);
+
+        portENTER_CRITICAL(&s_lock);
+        s_stats.frames++;
+        s_stats.samples += n;
+        s_stats.foreign += words - n;
+        portEXIT_CRITICAL(&s_lock);
+    }
+}
+
+/**
+ * @brief Create and configure the driver, callbacks registered
+ */
+static esp_err_t adc_open(void)
+{
+    // The driver also copies each frame into its pool, which nothing reads: keep it one frame and flushed
+    adc_continuous_handle_cfg_t handle_cfg = {
+        .max_store_buf_size = FRAME_BYTES,
+        .conv_frame_size = FRAME_BYTES,
+        .flags.flush_pool = true,
+    };
+    esp_err_t err = adc_continuous_new_handle(&handle_cfg, &s_adc);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    adc_digi_pattern_config_t pattern = {
+        .atten = ADC_ATTEN_DB_12,
+        .channel = CONFIG_APP_ADC_STREAM_CHANNEL,
+        .unit = ADC_UNIT_1,
+        .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+    };
+    adc_continuous_config_t cfg = {
+        .pattern_num = 1,
+        .adc_pattern = &pattern,
+        .sample_freq_hz = CONFIG_APP_ADC_STREAM_RATE_HZ,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
+    };
+    err = adc_continuous_config(s_adc, &cfg);
+    if (err != ESP_OK) {
+        return err;
+    }
+    adc_continuous_evt_cbs_t cbs = {
+        .on_conv_done = on_conv_done,
+    };
+    return adc_continuous_register_event_callbacks(s_adc, &cbs, NULL);
+}
+
+esp_err_t adc_stream_start(uint8_t agg_id)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    s_agg_id = agg_id;
+    s_frames = xQueueCreate(QUEUE_LEN, sizeof(frame_t));
+    if (s_frames == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = adc_open();
+    // Above the MQTT task at its default, so a frame is taken while the DMA is on the next ones
+    if (err == ESP_OK &&
+        xTaskCreate(stream_task, "adc_stream", 3072, NULL, tskIDLE_PRIORITY + 7, &s_task) != pdPASS) {
+        err = ESP_ERR_NO_MEM;
+    }
+    if (err == ESP_OK) {
+        err = adc_continuous_start(s_adc);
+        if (err != ESP_OK) {
+            vTaskDelete(s_task);
+            s_task = NULL;
+        }
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start: %s", esp_err_to_name(err));
+        if (s_adc != NULL) {
+            adc_continuous_deinit(s_adc);
+            s_adc = NULL;
+        }
+        vQueueDelete(s_frames);
+        s_frames = NULL;
+        return err;
+    }
+    ESP_LOGI(TAG, "ADC1 channel %d at %d Hz, %d samples per frame", CONFIG_APP_ADC_STREAM_CHANNEL,
+             CONFIG_APP_ADC_STREAM_RATE_HZ, CONFIG_APP_ADC_STREAM_FRAME_SAMPLES);
+    return ESP_OK;
+}
+
+void adc_stream_get_stats(adc_stream_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+#endif // CONFIG_APP_ADC_STREAM
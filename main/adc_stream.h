@@ -0,0 +1,60 @@
+/* ADC Stream Header
+ *
+ * Continuous sampling of one ADC1 channel for the aggregation engine. The
+ * ADC's DMA fills frames of CONFIG_APP_ADC_STREAM_FRAME_SAMPLES results
+ * at CONFIG_APP_ADC_STREAM_RATE_HZ without the CPU; the frame-complete
+ * interrupt only queues the frame's address. The stream task then turns
+ * the DMA words into raw readings where they lie and hands the frame to
+ * stats_agg_record_block(), whose vector reduce takes it in one pass: a
+ * sample is never copied and costs the CPU a mask and its share of the
+ * reduce.
+ *
+ * Frames the task has not taken by the time the DMA comes round to them
+ * again are lost, and counted; the queue is kept shorter than the
+ * driver's ring of frames so a queued frame is never overwritten. Built
+ * only with CONFIG_APP_ADC_STREAM.
+ */
+
+#ifndef ADC_STREAM_H
+#define ADC_STREAM_H
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if CONFIG_APP_ADC_STREAM
+
+typedef struct {
+    uint32_t frames;        // Frames reduced
+    uint32_t samples;       // Readings recorded
+    uint32_t dropped;       // Frames lost with the queue full
+    uint32_t foreign;       // Results of another channel or unit, skipped
+} adc_stream_stats_t;
+
+/**
+ * @brief Start sampling CONFIG_APP_ADC_STREAM_CHANNEL into aggregated metric agg_id
+ *
+ * Register the metric with stats_agg_register() first. Repeated calls
+ * are no-ops.
+ *
+ * @param agg_id Metric the raw readings are recorded on
+ * @return ESP_OK, ESP_ERR_NO_MEM, or the ADC driver's error
+ */
+esp_err_t adc_stream_start(uint8_t agg_id);
+
+/**
+ * @brief Copy out the counters
+ */
+void adc_stream_get_stats(adc_stream_stats_t *stats);
+
+#endif // CONFIG_APP_ADC_STREAM
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ADC_STREAM_H
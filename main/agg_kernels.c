@@ -0,0 +1,209 @@
+/* Aggregation Kernels Implementation
+ *
+ * The PIE loops in agg_kernels_pie.S take 16-byte aligned pointers and a
+ * count of 128-bit vectors. The wrappers here split each call into a
+ * scalar head up to the alignment boundary, the vector bulk and a scalar
+ * tail, and fold the per-lane results of the bulk into the scalar ones.
+ */
+
+#include <stdbool.h>
+#include "agg_kernels.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_AGG_PIE
+// Below this many vectors the split and the lane folding cost more than they save
+#define PIE_MIN_VECTORS 4
+
+// ACCX holds a 40-bit sum but is read back saturated to 32 bits
+#define PIE_S16_CHUNK_VECTORS 4096
+
+typedef struct {
+    int16_t min[8];
+    int16_t max[8];
+    int16_t ones[8];
+    int32_t sum;
+} __attribute__((aligned(16))) pie_s16_state_t;
+
+void agg_minmax_s32_pie(const int32_t *v, size_t nvec, int32_t *state);
+void agg_reduce_s16_pie(const int16_t *v, size_t nvec, pie_s16_state_t *state);
+void agg_scale_s16_pie(const int16_t *in, int16_t *out, size_t nvec, const int16_t *mul, unsigned shift);
+
+/**
+ * @brief Elements before p reaches a 16-byte boundary
+ */
+static inline size_t head_len(const void *p, size_t elem)
+{
+    return ((16 - ((uintptr_t)p & 15)) & 15) / elem;
+}
+#endif
+
+static void reduce_s32_into(const int32_t *v, size_t n, int64_t *sum, int32_t *min, int32_t *max)
+{
+    int64_t s = *sum;
+    int32_t lo = *min;
+    int32_t hi = *max;
+    for (size_t i = 0; i < n; i++) {
+        s += v[i];
+        lo = v[i] < lo ? v[i] : lo;
+        hi = v[i] > hi ? v[i] : hi;
+    }
+    *sum = s;
+    *min = lo;
+    *max = hi;
+}
+
+static void reduce_s16_into(const int16_t *v, size_t n, int64_t *sum, int16_t *min, int16_t *max)
+{
+    int32_t s = 0;
+    int16_t lo = *min;
+    int16_t hi = *max;
+    // An int32 running sum is exact for chunks of up to 65536 samples
+    for (size_t i = 0; i < n; i++) {
+        s += v[i];
+        lo = v[i] < lo ? v[i] : lo;
+        hi = v[i] > hi ? v[i] : hi;
+        if ((i & 0xFFFF) == 0xFFFF) {
+            *sum += s;
+            s = 0;
+        }
+    }
+    *sum += s;
+    *min = lo;
+    *max = hi;
+}
+
+void agg_reduce_s32_scalar(const int32_t *v, size_t n, int64_t *sum, int32_t *min, int32_t *max)
+{
+    *sum = 0;
+    *min = INT32_MAX;
+    *max = INT32_MIN;
+    reduce_s32_into(v, n, sum, min, max);
+}
+
+void agg_reduce_s16_scalar(const int16_t *v, size_t n, int64_t *sum, int16_t *min, int16_t *max)
+{
+    *sum = 0;
+    *min = INT16_MAX;
+    *max = INT16_MIN;
+    reduce_s16_into(v, n, sum, min, max);
+}
+
+void agg_scale_s16_scalar(const int16_t *in, int16_t *out, size_t n, int16_t mul, unsigned shift)
+{
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (int16_t)(((int32_t)in[i] * mul) >> shift);
+    }
+}
+
+void agg_reduce_s32(const int32_t *v, size_t n, int64_t *sum, int32_t *min, int32_t *max)
+{
+#if CONFIG_APP_AGG_PIE
+    size_t head = head_len(v, sizeof(*v));
+    if (((uintptr_t)v & 3) == 0 && n >= head + 4 * PIE_MIN_VECTORS) {
+        agg_reduce_s32_scalar(v, head, sum, min, max);
+
+        size_t nvec = (n - head) / 4;
+        int32_t state[8] __attribute__((aligned(16)));
+        for (int i = 0; i < 4; i++) {
+            state[i] = *min;
+            state[4 + i] = *max;
+        }
+        agg_minmax_s32_pie(v + head, nvec, state);
+        for (int i = 0; i < 4; i++) {
+            *min = state[i] < *min ? state[i] : *min;
+            *max = state[4 + i] > *max ? state[4 + i] : *max;
+        }
+
+        // PIE has no widening 32-bit add; the sum stays a scalar loop
+        int64_t s = 0;
+        const int32_t *bulk = v + head;
+        for (size_t i = 0; i < nvec * 4; i++) {
+            s += bulk[i];
+        }
+        *sum += s;
+
+        size_t done = head + nvec * 4;
+        reduce_s32_into(v + done, n - done, sum, min, max);
+        return;
+    }
+#endif
+    agg_reduce_s32_scalar(v, n, sum, min, max);
+}
+
+void agg_reduce_s16(const int16_t *v, size_t n, int64_t *sum, int16_t *min, int16_t *max)
+{
+#if CONFIG_APP_AGG_PIE
+    size_t head = head_len(v, sizeof(*v));
+    if (((uintptr_t)v & 1) == 0 && n >= head + 8 * PIE_MIN_VECTORS) {
+        agg_reduce_s16_scalar(v, head, sum, min, max);
+
+        pie_s16_state_t state;
+        for (int i = 0; i < 8; i++) {
+            state.min[i] = *min;
+            state.max[i] = *max;
+            state.ones[i] = 1;
+        }
+        const int16_t *p = v + head;
+        size_t nvec = (n - head) / 8;
+        for (size_t left = nvec; left > 0; ) {
+            size_t chunk = left < PIE_S16_CHUNK_VECTORS ? left : PIE_S16_CHUNK_VECTORS;
+            agg_reduce_s16_pie(p, chunk, &state);
+            *sum += state.sum;
+            p += chunk * 8;
+            left -= chunk;
+        }
+        for (int i = 0; i < 8; i++) {
+            *min = state.min[i] < *min ? state.min[i] : *min;
+            *max = state.max[i] > *max ? state.max[i] : *max;
+        }
+
+        size_t done = head + nvec * 8;
+        reduce_s16_into(v + done, n - done, sum, min, max);
+        return;
+    }
+#endif
+    agg_reduce_s16_scalar(v, n, sum, min, max);
+}
+
+void agg_scale_s16(const int16_t *in, int16_t *out, size_t n, int16_t mul, unsigned shift)
+{
+#if CONFIG_APP_AGG_PIE
+    size_t head = head_len(in, sizeof(*in));
+    bool aligned = (((uintptr_t)in ^ (uintptr_t)out) & 15) == 0 && ((uintptr_t)in & 1) == 0;
+    if (aligned && shift < 16 && n >= head + 8 * PIE_MIN_VECTORS) {
+        agg_scale_s16_scalar(in, out, head, mul, shift);
+
+        int16_t mulv[8] __attribute__((aligned(16)));
+        for (int i = 0; i < 8; i++) {
+            mulv[i] = mul;
+        }
+        size_t nvec = (n - head) / 8;
+        agg_scale_s16_pie(in + head, out + head, nvec, mulv, shift);
+
+        size_t done = head + nvec * 8;
+        agg_scale_s16_scalar(in + done, out + done, n - done, mul, shift);
+        return;
+    }
+#endif
+    agg_scale_s16_scalar(in, out, n, mul, shift);
+}
+
+void agg_delta_s32(const int32_t *in, int32_t *out, size_t n, int32_t prev)
+{
+    uint32_t last = (uint32_t)prev;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t cur = (uint32_t)in[i];
+        out[i] = (int32_t)(cur - last);
+        last = cur;
+    }
+}
+
+void agg_delta_s16(const int16_t *in, int16_t *out, size_t n, int16_t prev)
+{
+    uint16_t last = (uint16_t)prev;
+    for (size_t i = 0; i < n; i++) {
+        uint16_t cur = (uint16_t)in[i];
+        out[i] = (int16_t)(uint16_t)(cur - last);
+        last = cur;
+    }
+}
@@ -0,0 +1,66 @@
+/* Aggregation Kernels Header
+ *
+ * Hot loops of the aggregation and encoding paths. With
+ * CONFIG_APP_AGG_PIE (ESP32-S3 only) the 16-byte aligned bulk of the
+ * reduce and scale kernels runs on the PIE 128-bit vector unit; the
+ * unaligned head, the tail and every other target use the scalar loops,
+ * which give bit-identical results. The *_scalar variants are always the
+ * plain C loops, kept for comparison in the benchmark.
+ *
+ * PIE registers are part of the task context, so the kernels may be used
+ * from any task but not from an ISR.
+ */
+
+#ifndef AGG_KERNELS_H
+#define AGG_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Sum, minimum and maximum of n values
+ *
+ * For n == 0: sum 0, min INT32_MAX, max INT32_MIN.
+ */
+void agg_reduce_s32(const int32_t *v, size_t n, int64_t *sum, int32_t *min, int32_t *max);
+void agg_reduce_s32_scalar(const int32_t *v, size_t n, int64_t *sum, int32_t *min, int32_t *max);
+
+/**
+ * @brief Sum, minimum and maximum of n int16 values
+ *
+ * For n == 0: sum 0, min INT16_MAX, max INT16_MIN.
+ */
+void agg_reduce_s16(const int16_t *v, size_t n, int64_t *sum, int16_t *min, int16_t *max);
+void agg_reduce_s16_scalar(const int16_t *v, size_t n, int64_t *sum, int16_t *min, int16_t *max);
+
+/**
+ * @brief Fixed-point scaling: out[i] = (int16_t)((in[i] * mul) >> shift)
+ *
+ * The product is formed in 32 bits and truncated to 16 after the
+ * arithmetic shift, as the PIE multiply does; pick mul and shift so the
+ * result fits. in and out may be the same buffer.
+ *
+ * @param shift 0 to 15
+ */
+void agg_scale_s16(const int16_t *in, int16_t *out, size_t n, int16_t mul, unsigned shift);
+void agg_scale_s16_scalar(const int16_t *in, int16_t *out, size_t n, int16_t mul, unsigned shift);
+
+/**
+ * @brief Delta encoding: out[i] = in[i] - in[i - 1], with in[-1] = prev
+ *
+ * Wraps modulo 2^32 (2^16), so the decoder reproduces the input exactly.
+ * Scalar on every target: PIE only has saturating subtracts. in and out
+ * may be the same buffer.
+ */
+void agg_delta_s32(const int32_t *in, int32_t *out, size_t n, int32_t prev);
+void agg_delta_s16(const int16_t *in, int16_t *out, size_t n, int16_t prev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AGG_KERNELS_H
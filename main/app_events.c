@@ -0,0 +1,64 @@
+/* Application Event Bus Implementation
+ *
+ * Thin wrapper around a FreeRTOS event group so producers do not need
+ * to know about the state machine that consumes the events.
+ */
+
+#include "app_events.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+static const char *TAG = "app_events";
+
+static EventGroupHandle_t s_app_events = NULL;
+
+esp_err_t app_events_init(void)
+{
+    if (s_app_events != NULL) {
+        return ESP_OK;
+    }
+
+    s_app_events = xEventGroupCreate();
+    if (s_app_events == NULL) {
+        ESP_LOGE(TAG, "Failed to create event group");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void app_events_post(EventBits_t bits)
+{
+    if (s_app_events == NULL) {
+        ESP_LOGW(TAG, "Event 0x%02x dropped (event bus not initialized)", (unsigned int)bits);
+        return;
+    }
+
+    xEventGroupSetBits(s_app_events, bits);
+}
+
+void app_events_post_from_isr(EventBits_t bits)
+{
+    BaseType_t woken = pdFALSE;
+    if (s_app_events != NULL && xEventGroupSetBitsFromISR(s_app_events, bits, &woken) == pdPASS) {
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+void app_events_clear(EventBits_t bits)
+{
+    if (s_app_events != NULL) {
+        xEventGroupClearBits(s_app_events, bits);
+    }
+}
+
+EventBits_t app_events_wait(EventBits_t bits, TickType_t timeout)
+{
+    if (s_app_events == NULL) {
+        vTaskDelay(timeout);
+        return 0;
+    }
+
+    EventBits_t set = xEventGroupWaitBits(s_app_events, bits, pdTRUE, pdFALSE, timeout);
+    return set & bits;
+}
@@ -0,0 +1,89 @@
+/* Application Event Bus Header
+ *
+ * FreeRTOS event group shared by the WiFi, provisioning and MQTT modules
+ * to wake the application state machine as soon as something happens.
+ */
+
+#ifndef APP_EVENTS_H
+#define APP_EVENTS_H
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Event bits consumed by the state machine in main.c
+#define APP_EVENT_WIFI_GOT_IP           BIT0    // STA obtained an IP address
+#define APP_EVENT_WIFI_DISCONNECTED     BIT1    // STA lost association
+#define APP_EVENT_PROVISIONED           BIT2    // Credentials saved via POST /provision
+#define APP_EVENT_PROVISIONING_RESET    BIT3    // Credentials cleared, AP restarted
+#define APP_EVENT_MQTT_CONNECTED        BIT4    // MQTT_EVENT_CONNECTED received
+#define APP_EVENT_MQTT_DISCONNECTED     BIT5    // MQTT_EVENT_DISCONNECTED received
+#define APP_EVENT_PREP_DONE             BIT6    // Startup preparation task finished
+#define APP_EVENT_WIFI_AUTH_FAILED      BIT7    // AP rejected the credentials, reconnecting stopped
+#define APP_EVENT_FACTORY_RESET         BIT8    // Reset button held or remote command received
+#define APP_EVENT_SLEEP                 BIT9    // Duty cycle: reporting window over, back to deep sleep
+
+#define APP_EVENT_ALL (APP_EVENT_WIFI_GOT_IP | APP_EVENT_WIFI_DISCONNECTED | \
+                       APP_EVENT_PROVISIONED | APP_EVENT_PROVISIONING_RESET | \
+                       APP_EVENT_MQTT_CONNECTED | APP_EVENT_MQTT_DISCONNECTED | \
+                       APP_EVENT_PREP_DONE | APP_EVENT_WIFI_AUTH_FAILED | \
+                       APP_EVENT_FACTORY_RESET | APP_EVENT_SLEEP)
+
+/**
+ * @brief Create the application event group
+ *
+ * Must be called before any module posts events. Calling it again is a no-op.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the event group cannot be created
+ */
+esp_err_t app_events_init(void);
+
+/**
+ * @brief Post one or more events to the state machine
+ *
+ * Safe to call from any task, including esp_event and HTTP server handlers.
+ * Events posted before app_events_init() are dropped.
+ *
+ * @param bits Event bits to set
+ */
+void app_events_post(EventBits_t bits);
+
+/**
+ * @brief Post events from an interrupt handler
+ *
+ * The bits are set by the FreeRTOS timer task shortly after.
+ *
+ * @param bits Event bits to set
+ */
+void app_events_post_from_isr(EventBits_t bits);
+
+/**
+ * @brief Discard pending events
+ *
+ * Used on state entry so that stale events from a previous session
+ * do not trigger a transition.
+ *
+ * @param bits Event bits to clear
+ */
+void app_events_clear(EventBits_t bits);
+
+/**
+ * @brief Block until any of the requested events is posted
+ *
+ * The returned bits are cleared from the event group.
+ *
+ * @param bits Event bits to wait for
+ * @param timeout Maximum time to block (portMAX_DELAY to wait forever)
+ * @return Subset of bits that were set, 0 on timeout
+ */
+EventBits_t app_events_wait(EventBits_t bits, TickType_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // APP_EVENTS_H
@@ -0,0 +1,336 @@
+/* Backend HTTP Client Implementation
+ *
+ * A small table of esp_http_client handles keyed by origin
+ * (scheme://host:port). esp_http_client keeps the connection open between
+ * perform() calls to the same host, and save_client_session lets a
+ * reconnect resume the TLS session.
+ *
+ * Streamed bodies bypass perform(): the request is opened with its total
+ * length, or -1 for which esp_http_client only adds the Transfer-Encoding
+ * header, so the chunk framing is written here. The response is then
+ * drained with read(), which raises the same ON_DATA events perform()
+ * would.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "backend_client.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "backend_client";
+
+#define BACKEND_CLIENT_SLOTS 2
+#define BACKEND_ORIGIN_MAX_LEN 128
+
+typedef struct {
+    char origin[BACKEND_ORIGIN_MAX_LEN];
+    esp_http_client_handle_t client;
+    bool used_before;                       // A connection may already be open
+    http_event_handle_cb handler;           // Handler of the request in flight
+    void *user_data;
+} backend_slot_t;
+
+static backend_slot_t s_slots[BACKEND_CLIENT_SLOTS];
+static SemaphoreHandle_t s_mutex = NULL;
+
+// Piece of a streamed body, kept until written so a stale connection can
+// be retried; also drains the response. Used under s_mutex.
+static char s_chunk[BACKEND_STREAM_CHUNK];
+
+/**
+ * @brief Whether a request the server may already have acted on can be sent again
+ */
+static bool method_idempotent(esp_http_client_method_t method)
+{
+    switch (method) {
+    case HTTP_METHOD_GET:
+    case HTTP_METHOD_HEAD:
+    case HTTP_METHOD_PUT:
+    case HTTP_METHOD_DELETE:
+    case HTTP_METHOD_OPTIONS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Copy the scheme://host:port part of a URL
+ */
+static bool url_origin(const char *url, char *origin, size_t origin_size)
+{
+    const char *host = strstr(url, "://");
+    if (host == NULL) {
+        return false;
+    }
+    host += 3;
+
+    size_t len = strcspn(host, "/?#") + (size_t)(host - url);
+    if (len >= origin_size) {
+        return false;
+    }
+    memcpy(origin, url, len);
+    origin[len] = '\0';
+    return true;
+}
+
+/**
+ * @brief Route client events to the handler of the request in flight
+ */
+static esp_err_t slot_event_handler(esp_http_client_event_t *evt)
+{
+    backend_slot_t *slot = evt->user_data;
+
+    if (evt->event_id == HTTP_EVENT_DISCONNECTED) {
+        slot->used_before = false;
+    }
+    if (slot->handler == NULL) {
+        return ESP_OK;
+    }
+    evt->user_data = slot->user_data;
+    return slot->handler(evt);
+}
+
+static void slot_release(backend_slot_t *slot)
+{
+    if (slot->client != NULL) {
+        esp_http_client_cleanup(slot->client);
+    }
+    memset(slot, 0, sizeof(*slot));
+}
+
+static backend_slot_t *slot_get(const backend_request_t *req)
+{
+    char origin[BACKEND_ORIGIN_MAX_LEN];
+    if (!url_origin(req->url, origin, sizeof(origin))) {
+        ESP_LOGE(TAG, "Unsupported URL: %s", req->url);
+        return NULL;
+    }
+
+    backend_slot_t *free_slot = NULL;
+    for (int i = 0; i < BACKEND_CLIENT_SLOTS; i++) {
+        if (s_slots[i].client != NULL && strcmp(s_slots[i].origin, origin) == 0) {
+            return &s_slots[i];
+        }
+        if (s_slots[i].client == NULL && free_slot == NULL) {
+            free_slot = &s_slots[i];
+        }
+    }
+
+    if (free_slot == NULL) {
+        // Table full: evict the first slot, its host will reconnect on next use
+        free_slot = &s_slots[0];
+        ESP_LOGD(TAG, "Evicting client for %s", free_slot->origin);
+        slot_release(free_slot);
+    }
+
+    esp_http_client_config_t config = {
+        .url = req->url,
+        .event_handler = slot_event_handler,
+        .user_data = free_slot,
+        .timeout_ms = req->timeout_ms,
+        .skip_cert_common_name_check = req->skip_cert_common_name_check,
+        .use_global_ca_store = req->use_global_ca_store,
+        .keep_alive_enable = true,
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        .save_client_session = true,
+#endif
+    };
+
+    free_slot->client = esp_http_client_init(&config);
+    if (free_slot->client == NULL) {
+        ESP_LOGE(TAG, "Failed to initialize HTTP client for %s", origin);
+        return NULL;
+    }
+    strcpy(free_slot->origin, origin);
+    ESP_LOGI(TAG, "Created persistent client for %s", origin);
+    return free_slot;
+}
+
+static bool write_all(esp_http_client_handle_t client, const char *data, int len)
+{
+    while (len > 0) {
+        int n = esp_http_client_write(client, data, len);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Write len bytes of s_chunk, chunk-framed for a chunked body
+ *
+ * The empty chunk that ends a chunked body is written for len 0.
+ */
+static esp_err_t stream_write(esp_http_client_handle_t client, const backend_request_t *req, int len, int *sent)
+{
+    bool chunked = req->body_len < 0;
+    if (len < 0) {
+        ESP_LOGW(TAG, "Body producer aborted %s", req->url);
+        return ESP_FAIL;
+    }
+    if (len > (int)sizeof(s_chunk)) {
+        // More than it was given room for: the buffer is already overrun
+        // or the count is wrong, either way nothing past it is sent
+        ESP_LOGE(TAG, "Body producer returned %d of %u bytes for %s", len, (unsigned)sizeof(s_chunk), req->url);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (!chunked && len > req->body_len - *sent) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (chunked) {
+        char size_line[12];
+        int n = snprintf(size_line, sizeof(size_line), "%x\r\n", len);
+        if (!write_all(client, size_line, n)) {
+            return ESP_ERR_HTTP_WRITE_DATA;
+        }
+    }
+    if (!write_all(client, s_chunk, len) || (chunked && !write_all(client, "\r\n", 2))) {
+        return ESP_ERR_HTTP_WRITE_DATA;
+    }
+    *sent += len;
+    return ESP_OK;
+}
+
+/**
+ * @brief Send the headers and the first piece, already in s_chunk
+ */
+static esp_err_t stream_open(esp_http_client_handle_t client, const backend_request_t *req, int len, int *sent)
+{
+    *sent = 0;
+    esp_err_t err = esp_http_client_open(client, req->body_len);
+    if (err == ESP_OK) {
+        err = stream_write(client, req, len, sent);
+    }
+    return err;
+}
+
+/**
+ * @brief Upload a body from its producer and read the response
+ */
+static esp_err_t stream_perform(backend_slot_t *slot, const backend_request_t *req)
+{
+    esp_http_client_handle_t client = slot->client;
+    int sent;
+    int len = req->body_cb(s_chunk, sizeof(s_chunk), req->body_ctx);
+    if (len < 0) {
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = stream_open(client, req, len, &sent);
+    if (slot->used_before && err == ESP_ERR_HTTP_WRITE_DATA) {
+        ESP_LOGW(TAG, "Kept-alive connection to %s was closed, retrying", slot->origin);
+        esp_http_client_close(client);
+        err = stream_open(client, req, len, &sent);
+    }
+    while (err == ESP_OK && len > 0) {
+        len = req->body_cb(s_chunk, sizeof(s_chunk), req->body_ctx);
+        err = stream_write(client, req, len, &sent);
+    }
+    if (err == ESP_OK && req->body_len >= 0 && sent != req->body_len) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (esp_http_client_fetch_headers(client) < 0) {
+        return ESP_ERR_HTTP_FETCH_HEADER;
+    }
+    int n;
+    while ((n = esp_http_client_read(client, s_chunk, sizeof(s_chunk))) > 0) {
+        // Delivered to the handler as HTTP_EVENT_ON_DATA
+    }
+    if (n < 0 || !esp_http_client_is_complete_data_received(client)) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t backend_client_perform(const backend_request_t *req, int *status_code, int64_t *content_length)
+{
+    if (s_mutex == NULL) {
+        s_mutex = xSemaphoreCreateMutex();
+        if (s_mutex == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+
+    esp_err_t err = ESP_ERR_NO_MEM;
+    backend_slot_t *slot = slot_get(req);
+    if (slot == NULL) {
+        goto cleanup;
+    }
+    esp_http_client_handle_t client = slot->client;
+
+    esp_http_client_set_url(client, req->url);
+    esp_http_client_set_method(client, req->method);
+    esp_http_client_set_timeout_ms(client, req->timeout_ms);
+    if (req->content_type != NULL) {
+        esp_http_client_set_header(client, "Content-Type", req->content_type);
+    }
+    slot->handler = req->event_handler;
+    slot->user_data = req->user_data;
+
+    bool reused = slot->used_before;
+    if (req->body_cb != NULL) {
+        err = stream_perform(slot, req);
+    } else {
+        esp_http_client_set_post_field(client, req->body, req->body ? req->body_len : 0);
+        err = esp_http_client_perform(client);
+    }
+    // A failed write means the request never arrived whole. Without response
+    // headers it may have: a POST such as sign-csr is not sent twice then.
+    if (req->body_cb == NULL && reused &&
+        (err == ESP_ERR_HTTP_WRITE_DATA || (err == ESP_ERR_HTTP_FETCH_HEADER && method_idempotent(req->method)))) {
+        // The server closed the idle connection
+        ESP_LOGW(TAG, "Kept-alive connection to %s was closed, retrying", slot->origin);
+        esp_http_client_close(client);
+        err = esp_http_client_perform(client);
+    }
+
+    if (err == ESP_OK) {
+        slot->used_before = true;
+        if (status_code) {
+            *status_code = esp_http_client_get_status_code(client);
+        }
+        if (content_length) {
+            *content_length = esp_http_client_get_content_length(client);
+        }
+    } else {
+        esp_http_client_close(client);
+        slot->used_before = false;
+    }
+
+    // Request-specific state must not leak into the next call on this host
+    if (req->content_type != NULL) {
+        esp_http_client_delete_header(client, "Content-Type");
+    }
+    esp_http_client_set_post_field(client, NULL, 0);
+    slot->handler = NULL;
+    slot->user_data = NULL;
+
+cleanup:
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+void backend_client_close_all(void)
+{
+    if (s_mutex == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    for (int i = 0; i < BACKEND_CLIENT_SLOTS; i++) {
+        slot_release(&s_slots[i]);
+    }
+    xSemaphoreGive(s_mutex);
+}
@@ -0,0 +1,85 @@
+/* Backend HTTP Client Header
+ *
+ * Keeps one esp_http_client per host alive between requests so sequential
+ * backend calls reuse the TCP connection (HTTP/1.1 keep-alive) and the TLS
+ * session instead of paying DNS, TCP and TLS setup every time.
+ *
+ * A body is either one buffer or, for payloads too large to hold in RAM,
+ * streamed: a producer callback fills BACKEND_STREAM_CHUNK bytes at a
+ * time and each piece is written before the next is asked for.
+ */
+
+#ifndef BACKEND_CLIENT_H
+#define BACKEND_CLIENT_H
+
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BACKEND_STREAM_CHUNK 1024
+
+/**
+ * @brief Produce the next piece of a streamed request body
+ *
+ * @param buf Where to write it
+ * @param size Room in buf, BACKEND_STREAM_CHUNK
+ * @param ctx body_ctx of the request
+ * @return Bytes written, 0 at the end of the body, or -1 to abort the request
+ */
+typedef int (*backend_body_cb_t)(char *buf, int size, void *ctx);
+
+/**
+ * @brief One HTTP request
+ */
+typedef struct {
+    const char *url;                        // Full URL; the scheme://host:port part selects the client
+    esp_http_client_method_t method;
+    const char *content_type;               // Content-Type header, NULL for none
+    const char *body;                       // Request body, NULL for none
+    int body_len;                           // Its length; with body_cb the total, or -1 to send it chunked
+    backend_body_cb_t body_cb;              // Streams the body instead of body when set
+    void *body_ctx;                         // Passed to body_cb
+    int timeout_ms;
+    bool skip_cert_common_name_check;       // Applied when the host's client is first created
+    bool use_global_ca_store;               // Verify with the esp-tls global CA store (same rule)
+    http_event_handle_cb event_handler;     // Receives the response events, may be NULL
+    void *user_data;                        // Passed to event_handler as evt->user_data
+} backend_request_t;
+
+/**
+ * @brief Perform a request on the persistent client for its host
+ *
+ * Calls are serialized. A request that fails on a reused connection the
+ * server had already closed is retried once on a fresh connection.
+ *
+ * A streamed body is retried that way only if the first piece could not
+ * be written, since the producer cannot rewind; its response reaches the
+ * event handler as HTTP_EVENT_ON_HEADER and HTTP_EVENT_ON_DATA events, and
+ * redirects and authentication challenges are not followed.
+ *
+ * @param req Request description
+ * @param status_code Output: HTTP status (may be NULL)
+ * @param content_length Output: Content-Length of the response, -1 if unknown (may be NULL)
+ * @return Result of esp_http_client_perform(); for a streamed body, ESP_FAIL
+ *         if the producer aborted and ESP_ERR_INVALID_SIZE if it did not
+ *         produce exactly body_len bytes
+ */
+esp_err_t backend_client_perform(const backend_request_t *req, int *status_code, int64_t *content_length);
+
+/**
+ * @brief Close every cached connection and free the clients
+ *
+ * Call when the network goes away; the next request reconnects.
+ */
+void backend_client_close_all(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BACKEND_CLIENT_H
@@ -0,0 +1,265 @@
+/* MQTT Core Benchmark Implementation
+ *
+ * The esp-mqtt host test project is part of the vendored component and
+ * only checks behaviour, so the cost of the publish path is measured on
+ * the target instead. esp_mqtt_client_enqueue() runs the same
+ * mqtt_msg_publish(), fini_message() and outbox_enqueue() as a publish on
+ * a live connection, without the socket write.
+ *
+ * Enqueued messages can only leave the outbox through an ack, so every
+ * sample gets a fresh client: it is prefilled to the case's depth, one
+ * enqueue is timed in CPU cycles, and the client is destroyed. Only the
+ * timed call is counted.
+ *
+ * The aggregation kernels are timed against their scalar loops on the
+ * same data, and their results compared, before the MQTT cases.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench_core.h"
+#include "agg_kernels.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "mqtt_client.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "bench_core";
+
+#define BENCH_SAMPLES       64
+#define BENCH_TOPIC         "bench/core"
+#define BENCH_KERNEL_LEN    4096    // Samples per kernel call
+
+#if CONFIG_APP_AGG_PIE
+#define BENCH_KERNEL_PIE    "true"
+#else
+#define BENCH_KERNEL_PIE    "false"
+#endif
+
+#if CONFIG_COMPILER_OPTIMIZATION_PERF
+#define BENCH_OPT           "O2"
+#elif CONFIG_COMPILER_OPTIMIZATION_SIZE
+#define BENCH_OPT           "Os"
+#elif CONFIG_COMPILER_OPTIMIZATION_NONE
+#define BENCH_OPT           "O0"
+#else
+#define BENCH_OPT           "Og"
+#endif
+
+#if CONFIG_APP_PERF_IRAM
+#define BENCH_IRAM          "true"
+#else
+#define BENCH_IRAM          "false"
+#endif
+
+#if CONFIG_MQTT_CUSTOM_OUTBOX
+#define BENCH_POOL_SLOTS    CONFIG_MQTT_OUTBOX_POOL_SLOTS
+#else
+#define BENCH_POOL_SLOTS    16
+#endif
+
+// Small, slot-sized, larger than a pool slot (heap fallback)
+static const int s_sizes[] = { 16, 256, 1024 };
+// Empty, half the pool in use, pool exhausted
+static const int s_depths[] = { 0, BENCH_POOL_SLOTS / 2, BENCH_POOL_SLOTS };
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t cycles_to_ns(uint32_t cycles)
+{
+    return (uint32_t)((uint64_t)cycles * 1000 / CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+}
+
+/**
+ * @brief Time one enqueue on a client holding depth messages
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM if the client could not be created,
+ *         ESP_FAIL if the enqueue itself was rejected
+ */
+static esp_err_t sample_once(int qos, const char *payload, int len, int depth, uint32_t *cycles)
+{
+    const esp_mqtt_client_config_t cfg = {
+        .broker.address.uri = "mqtt://127.0.0.1",
+    };
+    esp_mqtt_client_handle_t client = esp_mqtt_client_init(&cfg);
+    if (client == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < depth; i++) {
+        if (esp_mqtt_client_enqueue(client, BENCH_TOPIC, payload, len, qos, 0, true) < 0) {
+            err = ESP_FAIL;
+            goto cleanup;
+        }
+    }
+
+    uint32_t start = esp_cpu_get_cycle_count();
+    int msg_id = esp_mqtt_client_enqueue(client, BENCH_TOPIC, payload, len, qos, 0, true);
+    *cycles = esp_cpu_get_cycle_count() - start;
+    if (msg_id < 0) {
+        err = ESP_FAIL;
+    }
+
+cleanup:
+    esp_mqtt_client_destroy(client);
+    return err;
+}
+
+static esp_err_t run_case(int qos, int size, int depth, const char *payload, uint32_t *samples)
+{
+    int n = 0;
+    int failed = 0;
+    uint64_t total = 0;
+
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        uint32_t cycles;
+        esp_err_t err = sample_once(qos, payload, size, depth, &cycles);
+        if (err == ESP_ERR_NO_MEM) {
+            return err;
+        }
+        if (err != ESP_OK) {
+            failed++;
+            continue;
+        }
+        samples[n++] = cycles_to_ns(cycles);
+        total += samples[n - 1];
+    }
+
+    if (n == 0) {
+        ESP_LOGW(TAG, "qos=%d size=%d depth=%d: every enqueue failed", qos, size, depth);
+        return ESP_OK;
+    }
+
+    qsort(samples, n, sizeof(samples[0]), cmp_u32);
+    uint32_t mean = (uint32_t)(total / n);
+    printf("BENCH {\"bench\":\"core\",\"op\":\"enqueue\",\"qos\":%d,\"size\":%d,\"depth\":%d,"
+           "\"n\":%d,\"failed\":%d,\"msgs_per_s\":%lu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"max_ns\":%lu}\n",
+           qos, size, depth, n, failed,
+           (unsigned long)(mean ? 1000000000UL / mean : 0),
+           (unsigned long)samples[n / 2],
+           (unsigned long)samples[(n * 99) / 100],
+           (unsigned long)samples[n - 1]);
+    return ESP_OK;
+}
+
+/**
+ * @brief Median cycles of one kernel call over BENCH_SAMPLES calls
+ */
+#define TIME_KERNEL(samples, call) ({                           \
+        for (int i_ = 0; i_ < BENCH_SAMPLES; i_++) {            \
+            uint32_t start_ = esp_cpu_get_cycle_count();        \
+            call;                                               \
+            (samples)[i_] = esp_cpu_get_cycle_count() - start_; \
+        }                                                       \
+        qsort((samples), BENCH_SAMPLES, sizeof(uint32_t), cmp_u32); \
+        (samples)[BENCH_SAMPLES / 2];                           \
+    })
+
+static void report_kernel(const char *op, uint32_t scalar, uint32_t kernel, bool match)
+{
+    printf("BENCH {\"bench\":\"core\",\"op\":\"%s\",\"n\":%d,\"pie\":%s,\"scalar_ns\":%lu,"
+           "\"kernel_ns\":%lu,\"speedup_x100\":%lu,\"match\":%s}\n",
+           op, BENCH_KERNEL_LEN, BENCH_KERNEL_PIE,
+           (unsigned long)cycles_to_ns(scalar), (unsigned long)cycles_to_ns(kernel),
+           (unsigned long)(kernel ? (uint64_t)scalar * 100 / kernel : 0), match ? "true" : "false");
+}
+
+/**
+ * @brief Compare the aggregation kernels with their scalar loops
+ */
+static esp_err_t bench_kernels(uint32_t *samples)
+{
+    int32_t *v32 = heap_caps_aligned_alloc(16, BENCH_KERNEL_LEN * sizeof(int32_t), MALLOC_CAP_DEFAULT);
+    int16_t *v16 = heap_caps_aligned_alloc(16, BENCH_KERNEL_LEN * sizeof(int16_t), MALLOC_CAP_DEFAULT);
+    int16_t *o16 = heap_caps_aligned_alloc(16, 2 * BENCH_KERNEL_LEN * sizeof(int16_t), MALLOC_CAP_DEFAULT);
+    esp_err_t err = ESP_OK;
+    if (v32 == NULL || v16 == NULL || o16 == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+
+    uint32_t x = 0x12345678;
+    for (int i = 0; i < BENCH_KERNEL_LEN; i++) {
+        x = x * 1664525 + 1013904223;
+        v32[i] = (int32_t)x;
+        v16[i] = (int16_t)(x >> 16);
+    }
+
+    int64_t sum_a, sum_b;
+    int32_t min_a, max_a, min_b, max_b;
+    uint32_t scalar = TIME_KERNEL(samples, agg_reduce_s32_scalar(v32, BENCH_KERNEL_LEN, &sum_a, &min_a, &max_a));
+    uint32_t kernel = TIME_KERNEL(samples, agg_reduce_s32(v32, BENCH_KERNEL_LEN, &sum_b, &min_b, &max_b));
+    report_kernel("reduce_s32", scalar, kernel, sum_a == sum_b && min_a == min_b && max_a == max_b);
+
+    int16_t min16_a, max16_a, min16_b, max16_b;
+    scalar = TIME_KERNEL(samples, agg_reduce_s16_scalar(v16, BENCH_KERNEL_LEN, &sum_a, &min16_a, &max16_a));
+    kernel = TIME_KERNEL(samples, agg_reduce_s16(v16, BENCH_KERNEL_LEN, &sum_b, &min16_b, &max16_b));
+    report_kernel("reduce_s16", scalar, kernel, sum_a == sum_b && min16_a == min16_b && max16_a == max16_b);
+
+    int16_t *out_a = o16;
+    int16_t *out_b = o16 + BENCH_KERNEL_LEN;
+    scalar = TIME_KERNEL(samples, agg_scale_s16_scalar(v16, out_a, BENCH_KERNEL_LEN, 23170, 15));
+    kernel = TIME_KERNEL(samples, agg_scale_s16(v16, out_b, BENCH_KERNEL_LEN, 23170, 15));
+    report_kernel("scale_s16", scalar, kernel, memcmp(out_a, out_b, BENCH_KERNEL_LEN * sizeof(int16_t)) == 0);
+
+cleanup:
+    heap_caps_free(o16);
+    heap_caps_free(v16);
+    heap_caps_free(v32);
+    return err;
+}
+
+esp_err_t bench_core_run(void)
+{
+    int max_size = s_sizes[sizeof(s_sizes) / sizeof(s_sizes[0]) - 1];
+    char *payload = malloc(max_size);
+    uint32_t *samples = malloc(BENCH_SAMPLES * sizeof(uint32_t));
+    esp_err_t err = ESP_OK;
+
+    if (payload == NULL || samples == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    memset(payload, 'x', max_size);
+
+    ESP_LOGI(TAG, "Running %d samples per case, free heap %lu", BENCH_SAMPLES,
+             (unsigned long)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    // Build settings, so runs of the default and performance profiles can be told apart
+    printf("BENCH {\"bench\":\"core\",\"op\":\"config\",\"cpu_mhz\":%d,\"opt\":\"%s\","
+           "\"flash\":\"%s\",\"iram\":%s}\n",
+           CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, BENCH_OPT, CONFIG_ESPTOOLPY_FLASHMODE, BENCH_IRAM);
+
+    if (bench_kernels(samples) != ESP_OK) {
+        ESP_LOGW(TAG, "Not enough memory for the kernel cases");
+    }
+
+    for (int qos = 0; qos <= 2; qos++) {
+        for (size_t s = 0; s < sizeof(s_sizes) / sizeof(s_sizes[0]); s++) {
+            for (size_t d = 0; d < sizeof(s_depths) / sizeof(s_depths[0]); d++) {
+                err = run_case(qos, s_sizes[s], s_depths[d], payload, samples);
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "Could not create a client, stopping");
+                    goto cleanup;
+                }
+            }
+        }
+    }
+
+    ESP_LOGI(TAG, "Done, free heap %lu, minimum %lu",
+             (unsigned long)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+             (unsigned long)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+
+cleanup:
+    free(samples);
+    free(payload);
+    return err;
+}
@@ -0,0 +1,34 @@
+/* MQTT Core Benchmark Header
+ *
+ * Boot-time microbenchmark of the publish path through the esp-mqtt
+ * client: message serialization and the outbox enqueue, measured for each
+ * QoS level across payload sizes and outbox depths, plus the aggregation
+ * kernels against their scalar loops. Built only with
+ * CONFIG_APP_BENCH_CORE.
+ */
+
+#ifndef BENCH_CORE_H
+#define BENCH_CORE_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Run every case and print one result line per case
+ *
+ * Needs no network: each sample uses a client that is initialized but
+ * never started, so the message stays in the outbox. Results go to the
+ * console as lines starting with "BENCH " followed by a JSON object.
+ *
+ * @return ESP_OK, or ESP_ERR_NO_MEM if a client could not be created
+ */
+esp_err_t bench_core_run(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BENCH_CORE_H
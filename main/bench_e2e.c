@@ -0,0 +1,326 @@
+/* End-to-End Benchmark Implementation
+ *
+ * The load task publishes CONFIG_APP_BENCH_RATE_HZ messages per second,
+ * paced against esp_timer so rates above the tick rate send several
+ * messages per wakeup. Each QoS 1/2 publish is stamped in a small table
+ * indexed by msg_id; the ack hook on the MQTT task looks the stamp up and
+ * stores the round trip. Either side may get there first (the ack can
+ * beat the return of the publish call), so whichever comes second
+ * computes the sample. Both only hold a spinlock for a few stores.
+ *
+ * CPU load is the share of the window each core's idle task did not run,
+ * from the FreeRTOS run time counters (esp_timer based, in us).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench_e2e.h"
+#include "stack_prof.h"
+#include "mqtt_handler.h"
+#include "net_impair.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_BENCH_E2E
+
+static const char *TAG = "bench_e2e";
+
+#define BENCH_RATE_HZ       CONFIG_APP_BENCH_RATE_HZ
+#define BENCH_PAYLOAD_SIZE  CONFIG_APP_BENCH_PAYLOAD_SIZE
+#define BENCH_QOS           CONFIG_APP_BENCH_QOS
+#define BENCH_TOPIC         CONFIG_APP_BENCH_TOPIC
+#define BENCH_REPORT_TOPIC  CONFIG_APP_BENCH_TOPIC "/report"
+#define BENCH_CORES         CONFIG_FREERTOS_NUMBER_OF_CORES
+
+#define BENCH_INFLIGHT      128         // Unacked messages tracked, indexed by msg_id
+#define BENCH_RTT_SAMPLES   256         // RTT samples kept per report window
+#define BENCH_BURST_MAX     32          // Publishes per wakeup before yielding
+#define BENCH_REPORT_LEN    576
+
+typedef struct {
+    int msg_id;                         // 0 = free
+    int64_t sent_us;                    // 0 until the publish returned
+    int64_t acked_us;                   // 0 until the ack arrived
+} bench_stamp_t;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static bench_stamp_t s_stamps[BENCH_INFLIGHT];
+static uint32_t s_rtt_us[BENCH_RTT_SAMPLES];
+static uint32_t s_rtt_count = 0;        // Samples in s_rtt_us this window
+static uint32_t s_acked = 0;            // Acks matched this window
+static uint32_t s_lost = 0;             // Stamps overwritten before their ack (more in flight than tracked)
+static int64_t s_first_ack_us = 0;
+static int64_t s_first_publish_us = 0;
+
+static void rtt_add_locked(int64_t rtt_us)
+{
+    s_acked++;
+    if (s_rtt_count < BENCH_RTT_SAMPLES) {
+        s_rtt_us[s_rtt_count++] = (uint32_t)rtt_us;
+    }
+}
+
+static void on_ack(int msg_id, void *ctx)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_lock);
+    bench_stamp_t *st = &s_stamps[msg_id % BENCH_INFLIGHT];
+    if (st->msg_id == msg_id && st->sent_us != 0) {
+        rtt_add_locked(now - st->sent_us);
+        st->msg_id = 0;
+        if (s_first_ack_us == 0) {
+            s_first_ack_us = now;
+        }
+    } else if (st->msg_id == 0 || st->sent_us == 0) {
+        // Ack ahead of the stamp, or for a message published by someone else
+        *st = (bench_stamp_t){ .msg_id = msg_id, .acked_us = now };
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void stamp_sent(int msg_id, int64_t sent_us)
+{
+    portENTER_CRITICAL(&s_lock);
+    bench_stamp_t *st = &s_stamps[msg_id % BENCH_INFLIGHT];
+    if (st->msg_id == msg_id && st->acked_us != 0) {
+        rtt_add_locked(st->acked_us - sent_us);
+        st->msg_id = 0;
+        if (s_first_ack_us == 0) {
+            s_first_ack_us = st->acked_us;
+        }
+    } else {
+        if (st->msg_id != 0 && st->sent_us != 0) {
+            s_lost++;
+        }
+        *st = (bench_stamp_t){ .msg_id = msg_id, .sent_us = sent_us };
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void idle_runtime(uint32_t idle[BENCH_CORES])
+{
+    for (int core = 0; core < BENCH_CORES; core++) {
+        idle[core] = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+    }
+}
+
+/**
+ * @brief Print a line and, while connected, publish it on the report topic
+ */
+static void emit(const char *json, size_t len)
+{
+    printf("BENCH %s\n", json);
+    if (mqtt_handler_is_connected()) {
+        mqtt_handler_publish(BENCH_REPORT_TOPIC, json, (int)len, 0);
+    }
+}
+
+typedef struct {
+    int64_t start_us;
+    uint32_t sent;
+    uint32_t failed;
+    uint32_t idle[BENCH_CORES];
+} bench_window_t;
+
+static void report(const char *event, bench_window_t *w, uint32_t sent, uint32_t failed)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t window_us = (uint32_t)(now - w->start_us);
+    uint32_t idle[BENCH_CORES];
+    idle_runtime(idle);
+
+    static uint32_t rtt[BENCH_RTT_SAMPLES];
+    portENTER_CRITICAL(&s_lock);
+    uint32_t n = s_rtt_count;
+    uint32_t acked = s_acked;
+    uint32_t lost = s_lost;
+    memcpy(rtt, s_rtt_us, n * sizeof(rtt[0]));
+    s_rtt_count = 0;
+    s_acked = 0;
+    s_lost = 0;
+    portEXIT_CRITICAL(&s_lock);
+    qsort(rtt, n, sizeof(rtt[0]), cmp_u32);
+
+    mqtt_handler_stats_t stats;
+    mqtt_handler_get_stats(&stats);
+
+    char json[BENCH_REPORT_LEN];
+    int len = snprintf(json, sizeof(json),
+                       "{\"bench\":\"e2e\",\"event\":\"%s\",\"t_ms\":%lu,\"window_ms\":%lu,"
+                       "\"target_hz\":%d,\"size\":%d,\"qos\":%d,\"sent\":%lu,\"failed\":%lu,"
+                       "\"rate_hz\":%lu,\"acked\":%lu,\"lost\":%lu,\"ack_p50_us\":%lu,"
+                       "\"ack_p99_us\":%lu,\"ack_max_us\":%lu,\"heap_free\":%lu,\"heap_min\":%lu,"
+                       "\"outbox\":%d,\"disconnects\":%lu,\"tcp\":\"%s\",\"write_us\":%lu,\"cpu\":[",
+                       event, (unsigned long)(now / 1000), (unsigned long)(window_us / 1000),
+                       BENCH_RATE_HZ, BENCH_PAYLOAD_SIZE, BENCH_QOS,
+                       (unsigned long)(sent - w->sent), (unsigned long)(failed - w->failed),
+                       (unsigned long)(window_us ? (uint64_t)(sent - w->sent) * 1000000 / window_us : 0),
+                       (unsigned long)acked, (unsigned long)lost,
+                       (unsigned long)(n ? rtt[n / 2] : 0),
+                       (unsigned long)(n ? rtt[(n * 99) / 100] : 0),
+                       (unsigned long)(n ? rtt[n - 1] : 0),
+                       (unsigned long)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                       (unsigned long)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                       stats.outbox_size, (unsigned long)stats.disconnects,
+                       stats.tcp_profile ? "throughput" : "latency", (unsigned long)stats.write_us);
+    for (int core = 0; core < BENCH_CORES && len > 0 && len < (int)sizeof(json); core++) {
+        uint32_t idle_us = idle[core] - w->idle[core];
+        uint32_t busy = idle_us < window_us ? window_us - idle_us : 0;
+        len += snprintf(json + len, sizeof(json) - len, "%s%lu", core ? "," : "",
+                        (unsigned long)(window_us ? (uint64_t)busy * 100 / window_us : 0));
+    }
+    const char *tail = "]}";
+#if CONFIG_APP_NET_IMPAIR
+    net_impair_stats_t impair;
+    net_impair_get_stats(&impair);
+    if (len > 0 && len < (int)sizeof(json)) {
+        len += snprintf(json + len, sizeof(json) - len,
+                        "],\"retransmits\":%lu,\"impair\":{\"delayed_ms\":%lu,\"stalls\":%lu,\"cuts\":%lu",
+                        (unsigned long)stats.retransmits, (unsigned long)impair.delayed_ms,
+                        (unsigned long)impair.stalls, (unsigned long)impair.cuts);
+    }
+    tail = "}}";
+#endif
+    if (len > 0 && len < (int)sizeof(json)) {
+        len += snprintf(json + len, sizeof(json) - len, "%s", tail);
+    }
+    if (len <= 0 || len >= (int)sizeof(json)) {
+        ESP_LOGW(TAG, "Report truncated");
+        return;
+    }
+    emit(json, len);
+
+    w->start_us = now;
+    w->sent = sent;
+    w->failed = failed;
+    memcpy(w->idle, idle, sizeof(idle));
+}
+
+static void bench_task(void *arg)
+{
+    static char payload[BENCH_PAYLOAD_SIZE];
+    memset(payload, 'x', sizeof(payload));
+
+    int64_t start_us = esp_timer_get_time();
+    int64_t end_us = CONFIG_APP_BENCH_DURATION_S > 0 ?
+                     start_us + (int64_t)CONFIG_APP_BENCH_DURATION_S * 1000000 : INT64_MAX;
+    int64_t report_us = start_us + (int64_t)CONFIG_APP_BENCH_REPORT_S * 1000000;
+    uint64_t due_base = 0;              // Messages due before the current pacing origin
+    int64_t pace_us = start_us;
+    uint32_t sent = 0;
+    uint32_t failed = 0;
+
+    mqtt_handler_topic_t topic;
+    ESP_ERROR_CHECK(mqtt_handler_topic_prepare(&topic, BENCH_TOPIC, BENCH_QOS));
+
+    bench_window_t w = { .start_us = start_us };
+    idle_runtime(w.idle);
+    ESP_LOGI(TAG, "Load: %d msg/s, %d bytes, QoS %d", BENCH_RATE_HZ, BENCH_PAYLOAD_SIZE, BENCH_QOS);
+
+    while (1) {
+        int64_t now = esp_timer_get_time();
+        if (now >= end_us) {
+            break;
+        }
+        if (now >= report_us) {
+            report("report", &w, sent, failed);
+            report_us += (int64_t)CONFIG_APP_BENCH_REPORT_S * 1000000;
+        }
+
+        if (!mqtt_handler_is_connected()) {
+            // Restart the pacing at the reconnect instead of bursting the backlog;
+            // wake at least once a second to keep reporting
+            mqtt_handler_wait_connected(pdMS_TO_TICKS(1000));
+            due_base = sent + failed;
+            pace_us = esp_timer_get_time();
+            continue;
+        }
+
+        uint64_t due = due_base + (uint64_t)(now - pace_us) * BENCH_RATE_HZ / 1000000;
+        for (int burst = 0; sent + failed < due && burst < BENCH_BURST_MAX; burst++) {
+            // Sequence number up front so a subscriber can check ordering and loss
+            char seq[9];
+            snprintf(seq, sizeof(seq), "%08lx", (unsigned long)(sent + failed));
+            memcpy(payload, seq, 8);
+
+            int msg_id = 0;
+            int64_t t0 = esp_timer_get_time();
+            if (mqtt_handler_publish_prepared(&topic, payload, sizeof(payload), &msg_id) != ESP_OK) {
+                failed++;
+                continue;
+            }
+            if (s_first_publish_us == 0) {
+                s_first_publish_us = t0;
+                char json[96];
+                int len = snprintf(json, sizeof(json),
+                                   "{\"bench\":\"e2e\",\"event\":\"first_publish\",\"t_ms\":%lu}",
+                                   (unsigned long)(t0 / 1000));
+                emit(json, len);
+            }
+            if (msg_id > 0) {
+                stamp_sent(msg_id, t0);
+            }
+            sent++;
+        }
+        vTaskDelay(1);
+    }
+
+    report("done", &w, sent, failed);
+#if CONFIG_APP_STACK_PROFILE
+    // Peaks under the full load
+    stack_prof_report();
+#endif
+    if (s_first_ack_us != 0) {
+        ESP_LOGI(TAG, "First ack %lld ms after boot", s_first_ack_us / 1000);
+    }
+    mqtt_handler_set_ack_cb(NULL, NULL);
+    ESP_LOGI(TAG, "Finished: %lu sent, %lu failed", (unsigned long)sent, (unsigned long)failed);
+    vTaskDelete(NULL);
+}
+
+void bench_e2e_state(const char *name)
+{
+    printf("BENCH {\"bench\":\"e2e\",\"event\":\"state\",\"state\":\"%s\",\"t_ms\":%lu}\n",
+           name, (unsigned long)(esp_timer_get_time() / 1000));
+}
+
+void bench_e2e_connected(void)
+{
+    static bool started = false;
+    mqtt_handler_stats_t stats;
+    mqtt_handler_get_stats(&stats);
+
+    char json[128];
+    int len = snprintf(json, sizeof(json),
+                       "{\"bench\":\"e2e\",\"event\":\"connected\",\"t_ms\":%lu,\"handshake_ms\":%lu,"
+                       "\"connects\":%lu}",
+                       (unsigned long)(esp_timer_get_time() / 1000),
+                       (unsigned long)stats.last_connect_ms, (unsigned long)stats.connects);
+    emit(json, len);
+
+    if (started) {
+        return;
+    }
+    started = true;
+    mqtt_handler_set_ack_cb(on_ack, NULL);
+    // Lowest application priority: the load must not starve the tasks it measures
+    if (xTaskCreate(bench_task, "bench_e2e", 4096, NULL, tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start the load task");
+        mqtt_handler_set_ack_cb(NULL, NULL);
+    }
+}
+
+#endif // CONFIG_APP_BENCH_E2E
@@ -0,0 +1,39 @@
+/* End-to-End Benchmark Header
+ *
+ * Qualification build of the whole stack: timestamps every application
+ * state transition and the MQTT handshake, then publishes at a fixed rate
+ * and reports the achieved rate, broker ack round trip, heap minimum and
+ * CPU load per core. Built only with CONFIG_APP_BENCH_E2E.
+ *
+ * Every record is one console line starting with "BENCH " followed by a
+ * JSON object; periodic reports are also published on
+ * CONFIG_APP_BENCH_TOPIC "/report".
+ */
+
+#ifndef BENCH_E2E_H
+#define BENCH_E2E_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Record an application state transition
+ *
+ * @param name State name, printed as is
+ */
+void bench_e2e_state(const char *name);
+
+/**
+ * @brief Record an MQTT connection and start the load on the first one
+ *
+ * Call from the state machine once per connection. The load pauses while
+ * the client is disconnected and resumes after the reconnect.
+ */
+void bench_e2e_connected(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BENCH_E2E_H
@@ -0,0 +1,365 @@
+/* Broker Race Implementation
+ *
+ * The race only decides which broker to use: esp-tls opens its own
+ * socket, so the winning TCP connection is closed and the TLS connect
+ * that follows repeats the handshake to a host known to be answering,
+ * with its address already in the lwIP DNS cache.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "broker_race.h"
+#include "remote_config.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+
+static const char *TAG = "broker_race";
+
+#define CANDIDATES BROKER_RACE_MAX_CANDIDATES
+#define STAGGER_US ((int64_t)CONFIG_MQTT_RACE_STAGGER_MS * 1000)
+#define TIMEOUT_US ((int64_t)CONFIG_MQTT_RACE_TIMEOUT_MS * 1000)
+#define HOST_MAX_LEN 128
+
+typedef struct {
+    char uri[REMOTE_CONFIG_STR_MAX];
+    uint32_t srtt_ms;               // Smoothed TCP connect time, 0: never measured
+    uint8_t fails;                  // Consecutive failed races or connects
+} candidate_t;
+
+typedef struct {
+    int sock;
+    int idx;
+    int64_t start_us;
+} attempt_t;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t len;
+} resolved_t;
+
+static candidate_t s_cand[CANDIDATES];
+static int s_count = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Split scheme://host[:port][/path]; the port defaults to the scheme's
+ */
+static esp_err_t uri_host_port(const char *uri, char *host, size_t host_size, char *port, size_t port_size)
+{
+    const char *start = strstr(uri, "://");
+    start = start ? start + 3 : uri;
+
+    size_t len = strcspn(start, ":/");
+    if (len == 0 || len >= host_size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(host, start, len);
+    host[len] = '\0';
+
+    if (start[len] == ':') {
+        const char *p = start + len + 1;
+        size_t plen = strcspn(p, "/");
+        if (plen == 0 || plen >= port_size) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        memcpy(port, p, plen);
+        port[plen] = '\0';
+    } else {
+        snprintf(port, port_size, "%s", strncmp(uri, "mqtts", 5) == 0 ? "8883" : "1883");
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Add a URI unless it is empty or already listed, keeping its ranking
+ */
+static void add_candidate(candidate_t *list, int *count, const char *uri, size_t len)
+{
+    while (len > 0 && *uri == ' ') {
+        uri++;
+        len--;
+    }
+    while (len > 0 && uri[len - 1] == ' ') {
+        len--;
+    }
+    if (len == 0 || len >= REMOTE_CONFIG_STR_MAX || *count >= CANDIDATES) {
+        return;
+    }
+    for (int i = 0; i < *count; i++) {
+        if (strncmp(list[i].uri, uri, len) == 0 && list[i].uri[len] == '\0') {
+            return;
+        }
+    }
+    candidate_t *c = &list[(*count)++];
+    memcpy(c->uri, uri, len);
+    c->uri[len] = '\0';
+    c->srtt_ms = 0;
+    c->fails = 0;
+    // A URI that was listed before keeps what was learned about it
+    for (int i = 0; i < s_count; i++) {
+        if (strcmp(s_cand[i].uri, c->uri) == 0) {
+            c->srtt_ms = s_cand[i].srtt_ms;
+            c->fails = s_cand[i].fails;
+            break;
+        }
+    }
+}
+
+esp_err_t broker_race_load(void)
+{
+    char primary[REMOTE_CONFIG_STR_MAX];
+    char fallbacks[REMOTE_CONFIG_STR_MAX];
+    if (remote_config_get_str(REMOTE_CONFIG_BROKER_URI, primary, sizeof(primary)) != ESP_OK) {
+        primary[0] = '\0';
+    }
+    if (remote_config_get_str(REMOTE_CONFIG_BROKER_FALLBACKS, fallbacks, sizeof(fallbacks)) != ESP_OK) {
+        fallbacks[0] = '\0';
+    }
+
+    candidate_t list[CANDIDATES];
+    int count = 0;
+    portENTER_CRITICAL(&s_lock);
+    add_candidate(list, &count, primary, strlen(primary));
+    for (const char *p = fallbacks; *p != '\0'; ) {
+        size_t len = strcspn(p, ",");
+        add_candidate(list, &count, p, len);
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    memcpy(s_cand, list, count * sizeof(list[0]));
+    s_count = count;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (count == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    ESP_LOGI(TAG, "%d broker candidate(s)", count);
+    return ESP_OK;
+}
+
+/**
+ * @brief Candidate indices, best first: fewest failures, then fastest, then as configured
+ */
+static void rank(const candidate_t *list, int count, int *order)
+{
+    for (int i = 0; i < count; i++) {
+        int j = i;
+        while (j > 0) {
+            const candidate_t *a = &list[order[j - 1]];
+            const candidate_t *b = &list[i];
+            uint32_t a_rtt = a->srtt_ms ? a->srtt_ms : UINT32_MAX;
+            uint32_t b_rtt = b->srtt_ms ? b->srtt_ms : UINT32_MAX;
+            if (a->fails < b->fails || (a->fails == b->fails && a_rtt <= b_rtt)) {
+                break;
+            }
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+}
+
+/**
+ * @brief Look up a candidate's address
+ *
+ * @return true with addr filled in, false if the URI or the lookup failed
+ */
+static bool resolve(const char *uri, resolved_t *addr)
+{
+    char host[HOST_MAX_LEN];
+    char port[8];
+    if (uri_host_port(uri, host, sizeof(host), port, sizeof(port)) != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot extract host from %s", uri);
+        return false;
+    }
+
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0 || res == NULL) {
+        ESP_LOGW(TAG, "DNS lookup for %s failed: %d", host, err);
+        return false;
+    }
+    bool ok = res->ai_addrlen <= sizeof(addr->addr);
+    if (ok) {
+        memcpy(&addr->addr, res->ai_addr, res->ai_addrlen);
+        addr->len = res->ai_addrlen;
+    }
+    freeaddrinfo(res);
+    return ok;
+}
+
+/**
+ * @brief Open a non-blocking TCP connection to a resolved candidate
+ *
+ * @return Socket with the connect in progress (or done), -1 on failure
+ */
+static int attempt_start(const char *uri, const resolved_t *addr)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock >= 0) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(sock, (const struct sockaddr *)&addr->addr, addr->len) != 0 && errno != EINPROGRESS) {
+            ESP_LOGW(TAG, "Connect to %s failed: errno %d", uri, errno);
+            close(sock);
+            sock = -1;
+        }
+    }
+    return sock;
+}
+
+esp_err_t broker_race_pick(char *uri, size_t size)
+{
+    candidate_t list[CANDIDATES];
+    portENTER_CRITICAL(&s_lock);
+    int count = s_count;
+    memcpy(list, s_cand, count * sizeof(list[0]));
+    portEXIT_CRITICAL(&s_lock);
+    if (count == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int order[CANDIDATES];
+    rank(list, count, order);
+    if (count == 1) {
+        strlcpy(uri, list[0].uri, size);
+        return ESP_OK;
+    }
+
+    // Look every candidate up first: a slow lookup then neither delays the
+    // staggered starts nor counts towards a candidate's connect time
+    resolved_t addr[CANDIDATES];
+    bool failed[CANDIDATES] = { false };
+    for (int i = 0; i < count; i++) {
+        failed[i] = !resolve(list[i].uri, &addr[i]);
+    }
+
+    attempt_t live[CANDIDATES];
+    int nlive = 0;
+    int started = 0;
+    int winner = -1;
+    uint32_t winner_ms = 0;
+    int64_t now = esp_timer_get_time();
+    int64_t deadline = now + TIMEOUT_US;
+    int64_t next_start = now;
+
+    while (winner < 0) {
+        now = esp_timer_get_time();
+        if (now >= deadline) {
+            break;
+        }
+        // Start the next candidate on schedule, or right away when nothing is in flight
+        if (started < count && (now >= next_start || nlive == 0)) {
+            int idx = order[started++];
+            int sock = failed[idx] ? -1 : attempt_start(list[idx].uri, &addr[idx]);
+            if (sock >= 0) {
+                live[nlive++] = (attempt_t) { .sock = sock, .idx = idx, .start_us = now };
+                next_start = now + STAGGER_US;
+            } else {
+                failed[idx] = true;
+                next_start = now;
+            }
+            continue;
+        }
+        if (nlive == 0) {
+            break;
+        }
+
+        fd_set wr;
+        FD_ZERO(&wr);
+        int maxfd = -1;
+        for (int i = 0; i < nlive; i++) {
+            FD_SET(live[i].sock, &wr);
+            maxfd = live[i].sock > maxfd ? live[i].sock : maxfd;
+        }
+        int64_t until = (started < count && next_start < deadline) ? next_start : deadline;
+        int64_t wait_us = until > now ? until - now : 0;
+        struct timeval tv = {
+            .tv_sec = wait_us / 1000000,
+            .tv_usec = wait_us % 1000000,
+        };
+        if (select(maxfd + 1, NULL, &wr, NULL, &tv) < 0) {
+            ESP_LOGW(TAG, "select failed: errno %d", errno);
+            break;
+        }
+
+        now = esp_timer_get_time();
+        for (int i = 0; i < nlive; ) {
+            if (!FD_ISSET(live[i].sock, &wr)) {
+                i++;
+                continue;
+            }
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(live[i].sock, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            if (so_error == 0) {
+                winner = live[i].idx;
+                winner_ms = (uint32_t)((now - live[i].start_us) / 1000);
+                break;
+            }
+            // Refused or unreachable: give the next candidate its turn now
+            failed[live[i].idx] = true;
+            close(live[i].sock);
+            live[i] = live[--nlive];
+            next_start = now;
+        }
+    }
+    for (int i = 0; i < nlive; i++) {
+        close(live[i].sock);
+    }
+
+    // Learn from the race; candidates still pending at the end are left as they were
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < s_count; i++) {
+        for (int j = 0; j < count; j++) {
+            if (strcmp(s_cand[i].uri, list[j].uri) != 0) {
+                continue;
+            }
+            if (j == winner) {
+                uint32_t sample = winner_ms > 0 ? winner_ms : 1;
+                s_cand[i].fails = 0;
+                s_cand[i].srtt_ms = s_cand[i].srtt_ms ? (7 * s_cand[i].srtt_ms + sample) / 8 : sample;
+            } else if (failed[j] && s_cand[i].fails < UINT8_MAX) {
+                s_cand[i].fails++;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (winner < 0) {
+        ESP_LOGW(TAG, "No broker answered within %d ms", CONFIG_MQTT_RACE_TIMEOUT_MS);
+        strlcpy(uri, list[order[0]].uri, size);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Broker %s won the race (%lu ms)", list[winner].uri, (unsigned long)winner_ms);
+    strlcpy(uri, list[winner].uri, size);
+    return ESP_OK;
+}
+
+void broker_race_report(const char *uri, bool connected)
+{
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < s_count; i++) {
+        if (strcmp(s_cand[i].uri, uri) != 0) {
+            continue;
+        }
+        if (connected) {
+            s_cand[i].fails = 0;
+        } else if (s_cand[i].fails < UINT8_MAX) {
+            s_cand[i].fails++;
+        }
+        break;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
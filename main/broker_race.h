@@ -0,0 +1,64 @@
+/* Broker Race Header
+ *
+ * Picks the MQTT broker for the next connect from a short candidate list
+ * (the "broker_uri" remote configuration key plus the comma-separated
+ * "broker_fallbacks"). Candidates are ranked by consecutive failures, then
+ * by their smoothed TCP connect time. A race looks up every candidate,
+ * then opens non-blocking TCP connections in rank order, starting the next one every
+ * CONFIG_MQTT_RACE_STAGGER_MS (or at once when one fails), in the manner
+ * of Happy Eyeballs; the first to complete wins and the others are
+ * closed. The mTLS handshake then goes to the winner.
+ *
+ * With a single candidate there is no race and no extra connection.
+ */
+
+#ifndef BROKER_RACE_H
+#define BROKER_RACE_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BROKER_RACE_MAX_CANDIDATES 4
+
+/**
+ * @brief Load the candidate list from the remote configuration
+ *
+ * Rankings of URIs that stay in the list are kept. Call before each
+ * new client, like the broker URI itself.
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if no URI is configured
+ */
+esp_err_t broker_race_load(void);
+
+/**
+ * @brief Choose the broker for the next connect
+ *
+ * Blocks for the race, at most CONFIG_MQTT_RACE_TIMEOUT_MS. When no
+ * candidate answers, uri gets the best ranked one so the connect still
+ * reports its own error.
+ *
+ * @param uri Output for the chosen URI
+ * @param size Size of uri
+ * @return ESP_OK if a candidate accepted a TCP connection (or the list has
+ *         one entry), ESP_FAIL if none did, ESP_ERR_INVALID_STATE before
+ *         broker_race_load()
+ */
+esp_err_t broker_race_pick(char *uri, size_t size);
+
+/**
+ * @brief Feed back the outcome of the MQTT connect to a picked broker
+ *
+ * A failure moves the broker behind the others until it connects again.
+ */
+void broker_race_report(const char *uri, bool connected);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BROKER_RACE_H
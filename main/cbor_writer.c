@@ -0,0 +1,142 @@
+/* CBOR Writer Implementation
+ *
+ * Every item starts with a head byte: major type in the top 3 bits and
+ * either the value itself (< 24) or the size of the big-endian argument
+ * that follows.
+ */
+
+#include <string.h>
+#include "cbor_writer.h"
+
+#define CBOR_MAJOR_UINT     0
+#define CBOR_MAJOR_NEGINT   1
+#define CBOR_MAJOR_BYTES    2
+#define CBOR_MAJOR_TEXT     3
+#define CBOR_MAJOR_ARRAY    4
+#define CBOR_MAJOR_MAP      5
+#define CBOR_MAJOR_SIMPLE   7
+
+#define CBOR_FALSE          0xf4
+#define CBOR_TRUE           0xf5
+#define CBOR_NULL           0xf6
+#define CBOR_FLOAT32        0xfa
+
+void cbor_writer_init(cbor_writer_t *w, uint8_t *buf, size_t cap)
+{
+    w->buf = buf;
+    w->cap = cap;
+    w->len = 0;
+    w->overflow = false;
+}
+
+static void put_raw(cbor_writer_t *w, const void *data, size_t len)
+{
+    if (w->overflow || len > w->cap - w->len) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void put_head(cbor_writer_t *w, uint8_t major, uint64_t arg)
+{
+    uint8_t head[9];
+    size_t n;
+
+    major <<= 5;
+    if (arg < 24) {
+        head[0] = major | (uint8_t)arg;
+        n = 1;
+    } else if (arg <= UINT8_MAX) {
+        head[0] = major | 24;
+        n = 2;
+    } else if (arg <= UINT16_MAX) {
+        head[0] = major | 25;
+        n = 3;
+    } else if (arg <= UINT32_MAX) {
+        head[0] = major | 26;
+        n = 5;
+    } else {
+        head[0] = major | 27;
+        n = 9;
+    }
+    for (size_t i = n - 1; i > 0; i--) {
+        head[i] = (uint8_t)arg;
+        arg >>= 8;
+    }
+    put_raw(w, head, n);
+}
+
+void cbor_put_map(cbor_writer_t *w, size_t count)
+{
+    put_head(w, CBOR_MAJOR_MAP, count);
+}
+
+void cbor_put_array(cbor_writer_t *w, size_t count)
+{
+    put_head(w, CBOR_MAJOR_ARRAY, count);
+}
+
+void cbor_put_uint(cbor_writer_t *w, uint64_t value)
+{
+    put_head(w, CBOR_MAJOR_UINT, value);
+}
+
+void cbor_put_int(cbor_writer_t *w, int64_t value)
+{
+    if (value >= 0) {
+        put_head(w, CBOR_MAJOR_UINT, (uint64_t)value);
+    } else {
+        // Negative integers encode -1 - value
+        put_head(w, CBOR_MAJOR_NEGINT, (uint64_t)(-1 - value));
+    }
+}
+
+void cbor_put_bool(cbor_writer_t *w, bool value)
+{
+    uint8_t b = value ? CBOR_TRUE : CBOR_FALSE;
+    put_raw(w, &b, 1);
+}
+
+void cbor_put_null(cbor_writer_t *w)
+{
+    uint8_t b = CBOR_NULL;
+    put_raw(w, &b, 1);
+}
+
+void cbor_put_float(cbor_writer_t *w, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint8_t out[5] = {
+        CBOR_FLOAT32,
+        (uint8_t)(bits >> 24),
+        (uint8_t)(bits >> 16),
+        (uint8_t)(bits >> 8),
+        (uint8_t)bits,
+    };
+    put_raw(w, out, sizeof(out));
+}
+
+void cbor_put_text(cbor_writer_t *w, const char *text)
+{
+    size_t len = strlen(text);
+    put_head(w, CBOR_MAJOR_TEXT, len);
+    put_raw(w, text, len);
+}
+
+void cbor_put_bytes(cbor_writer_t *w, const void *data, size_t len)
+{
+    put_head(w, CBOR_MAJOR_BYTES, len);
+    put_raw(w, data, len);
+}
+
+esp_err_t cbor_writer_finish(const cbor_writer_t *w, size_t *len)
+{
+    if (len) {
+        *len = w->len;
+    }
+    return w->overflow ? ESP_ERR_NO_MEM : ESP_OK;
+}
@@ -4,38 +4,221 @@
  */
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include "certificate_manager.h"
+#include "json_stream.h"
+#include "http_response.h"
+#include "backend_client.h"
+#include "device_config.h"
+#include "remote_config.h"
 #include "wifi_provisioning.h"
 #include "device_keys.h"
+#include "mqtt_tls_transport.h"
 #include "esp_log.h"
 #include "esp_http_client.h"
 #include "esp_tls.h"
 #include "nvs_flash.h"
 #include "nvs.h"
-#include "cJSON.h"
+#include "json_emit.h"
+#include "mbedtls/pem.h"
+#include "mbedtls/x509_crt.h"
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+#include "mbedtls/pk.h"
+#include "mbedtls/ecp.h"
+#include "mbedtls/x509_csr.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/platform_util.h"
+#endif
+#if CONFIG_APP_DEVICE_KEY_DS
+#include "rsa_sign_alt.h"
+#endif
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
 
 static const char *TAG = "cert_mgr";
 
 // NVS keys
-#define NVS_NAMESPACE "device_config"
 #define NVS_KEY_DEVICE_CERT "device_cert"
 #define NVS_KEY_CA_CERT "ca_cert"
+#define NVS_KEY_DEVICE_KEY "device_key"
+
+// Certificates are double-buffered in two key slots ("device_cert" and
+// "device_cert2", ...). Renewal fills the inactive slot and records it in
+// cert_next; the swap is the single cert_slot write, so a reset never
+// leaves a mixed set behind.
+#define NVS_KEY_CERT_SLOT "cert_slot"
+#define NVS_KEY_CERT_NEXT "cert_next"
+#define SLOT_KEY_LEN 16
+
+// DS parameters written at the factory by configure_ds.py
+#define NVS_DS_NAMESPACE "esp_ds_ns"
+#define NVS_KEY_DS_KEY_ID "esp_ds_key_id"
+#define NVS_KEY_DS_RSA_LEN "esp_ds_rsa_len"
+#define NVS_KEY_DS_C "esp_ds_c"
+#define NVS_KEY_DS_IV "esp_ds_iv"
+
+// Upper bound for a single extracted PEM field (device cert or CA chain)
+#define CERT_FIELD_MAX_LEN 16384
+
+// Bytes of a non-2xx response body kept for the error log
+#define ERROR_BODY_LEN 256
+
+// The body around its runtime values; the built-in CSR is escaped at compile time
+#define CSR_BODY_HEAD "{\"device_id\":"
+#define CSR_BODY_CSR ",\"csr\":"
+#define CSR_BODY_TOKEN ",\"provisioning_token\":"
+#define CSR_BODY_TAIL "}"
+#if !CONFIG_APP_DEVICE_KEY_ONBOARD
+static const char s_csr_body_mid[] = CSR_BODY_CSR "\"" DEVICE_CSR_JSON "\"" CSR_BODY_TOKEN;
+#endif
+
+// The CA has been parsed into the esp-tls global CA store
+static bool s_ca_store_ready = false;
+
+// Retry-After of the last sign-csr response in ms, 0 when it had none
+static uint32_t s_retry_after_ms = 0;
+
+// Active certificate slot, -1 until read from NVS
+static int s_slot = -1;
+
+// notAfter of the active device certificate (Unix time), 0 until parsed
+static int64_t s_not_after = 0;
 
-// Configuration from Kconfig
-#define BACKEND_URL CONFIG_BACKEND_URL
+/**
+ * @brief NVS key of a credential in the given slot
+ */
+static const char *slot_key(const char *base, int slot, char *buf)
+{
+    if (slot == 0) {
+        return base;
+    }
+    snprintf(buf, SLOT_KEY_LEN, "%s2", base);
+    return buf;
+}
+
+static int active_slot(void)
+{
+    if (s_slot < 0) {
+        uint8_t slot = 0;
+        device_config_get_u8(NVS_KEY_CERT_SLOT, &slot);
+        s_slot = (slot == 1) ? 1 : 0;
+    }
+    return s_slot;
+}
+
+/**
+ * @brief Forget everything derived from the active certificates
+ */
+static void invalidate_active(void)
+{
+    // A new CA replaces the parsed one; the next load rebuilds it
+    esp_tls_free_global_ca_store();
+    s_ca_store_ready = false;
+    s_not_after = 0;
+}
+
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+// A P-256 CSR PEM is about 450 bytes, its DER key about 120
+#define CSR_PEM_MAX_LEN 1024
+#define KEY_DER_MAX_LEN 160
+#endif
+
+// sign-csr request body, sized for the longest device_id and token. A PEM
+// only escapes its newlines and a printable token at most doubles (quotes,
+// backslashes); one with control characters is refused as too long.
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+#define REQUEST_CSR_SIZE (sizeof(CSR_BODY_CSR) + 2 * CSR_PEM_MAX_LEN + 2 + sizeof(CSR_BODY_TOKEN))
+#else
+#define REQUEST_CSR_SIZE sizeof(s_csr_body_mid)
+#endif
+#define REQUEST_BODY_SIZE (sizeof(CSR_BODY_HEAD) + 6 * PROVISION_DEVICE_ID_MAX + 2 + REQUEST_CSR_SIZE + \
+                           2 * PROVISION_TOKEN_MAX + 2 + sizeof(CSR_BODY_TAIL))
+static char s_request_body[REQUEST_BODY_SIZE];
+
+// Fields extracted from the sign-csr response
+enum {
+    CSR_FIELD_DEVICE_CERT,
+    CSR_FIELD_CA_CERT,
+    CSR_FIELD_COUNT,
+};
+
+static const char *const s_csr_field_paths[CSR_FIELD_COUNT] = {
+    [CSR_FIELD_DEVICE_CERT] = "certificate.content",
+    [CSR_FIELD_CA_CERT] = "ca_certificate.content",
+};
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    bool complete;
+} pem_field_t;
+
+// Per-request response state, passed to the HTTP client as user_data
+typedef struct {
+    json_stream_t parser;
+    pem_field_t fields[CSR_FIELD_COUNT];
+    size_t body_len;
+    http_response_t error_body;     // Start of the body, fixed to its arena
+    char error_arena[ERROR_BODY_LEN];
+} csr_response_t;
+
+/**
+ * @brief Append an extracted value piece to its PEM buffer (NUL-terminated)
+ */
+static esp_err_t csr_field_cb(void *ctx, int field, const char *data, size_t len, bool done)
+{
+    pem_field_t *f = &((csr_response_t *)ctx)->fields[field];
+
+    if (done) {
+        f->complete = (f->len > 0);
+        return ESP_OK;
+    }
+
+    if (f->len + len + 1 > f->cap) {
+        size_t cap = f->cap ? f->cap : 1024;
+        while (cap < f->len + len + 1) {
+            cap *= 2;
+        }
+        if (cap > CERT_FIELD_MAX_LEN) {
+            ESP_LOGE(TAG, "%s exceeds %d bytes", s_csr_field_paths[field], CERT_FIELD_MAX_LEN);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        char *grown = realloc(f->data, cap);
+        if (grown == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        f->data = grown;
+        f->cap = cap;
+    }
+
+    memcpy(f->data + f->len, data, len);
+    f->len += len;
+    f->data[f->len] = '\0';
+    return ESP_OK;
+}
 
-// Buffer for HTTP response
-static char *s_http_response_buffer = NULL;
-static size_t s_http_response_len = 0;
+static void csr_response_free(csr_response_t *resp)
+{
+    for (int i = 0; i < CSR_FIELD_COUNT; i++) {
+        free(resp->fields[i].data);
+    }
+    free(resp);
+}
 
 /**
  * @brief HTTP event handler for esp_http_client
+ *
+ * The body is fed to the streaming extractor as it arrives (chunked or not),
+ * so only the two PEM fields are ever held in memory.
  */
 static esp_err_t http_event_handler(esp_http_client_event_t *evt)
 {
+    csr_response_t *resp = evt->user_data;
+
     switch (evt->event_id) {
     case HTTP_EVENT_ERROR:
         ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
@@ -48,35 +231,24 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt)
         break;
     case HTTP_EVENT_ON_HEADER:
         ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-        break;
-    case HTTP_EVENT_ON_DATA:
-        if (!esp_http_client_is_chunked_response(evt->client)) {
-            // Allocate buffer for response
-            if (s_http_response_buffer == NULL) {
-                s_http_response_len = esp_http_client_get_content_length(evt->client);
-                if (s_http_response_len > 0 && s_http_response_len < 8192) {
-                    s_http_response_buffer = malloc(s_http_response_len + 1);
-                    if (s_http_response_buffer) {
-                        s_http_response_buffer[0] = '\0';
-                    }
-                } else {
-                    s_http_response_len = 8192;
-                    s_http_response_buffer = malloc(s_http_response_len + 1);
-                }
-                if (s_http_response_buffer == NULL) {
-                    ESP_LOGE(TAG, "Failed to allocate response buffer");
-                    return ESP_ERR_NO_MEM;
-                }
-            }
-            // Append data to buffer
-            size_t data_len = evt->data_len;
-            size_t current_len = strlen(s_http_response_buffer);
-            if (current_len + data_len < s_http_response_len) {
-                memcpy(s_http_response_buffer + current_len, evt->data, data_len);
-                s_http_response_buffer[current_len + data_len] = '\0';
+        if (strcasecmp(evt->header_key, "Retry-After") == 0) {
+            // Only delta-seconds; an HTTP-date is left to the caller's backoff
+            char *end = NULL;
+            unsigned long secs = strtoul(evt->header_value, &end, 10);
+            if (end != evt->header_value && *end == '\0') {
+                s_retry_after_ms = secs > 3600 ? 3600000 : (uint32_t)secs * 1000;
             }
         }
         break;
+    case HTTP_EVENT_ON_DATA:
+        resp->body_len += evt->data_len;
+
+        // Keep the start of the body for error reporting
+        http_response_on_event(&resp->error_body, evt);
+
+        // A parse error is reported after the request, keep draining the body
+        json_stream_feed(&resp->parser, evt->data, evt->data_len);
+        break;
     case HTTP_EVENT_ON_FINISH:
         ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
         break;
@@ -89,37 +261,167 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
+#define PEM_BEGIN_CRT "-----BEGIN CERTIFICATE-----"
+#define PEM_END_CRT "-----END CERTIFICATE-----"
+
 /**
  * @brief Save certificate to NVS
+ *
+ * A single PEM certificate is decoded once and stored as a DER blob, so the
+ * base64 decode is not repeated on every TLS handshake. A chain is stored as
+ * PEM (including the NUL terminator), because a DER buffer holds only one
+ * certificate as far as mbedTLS is concerned.
  */
 static esp_err_t save_certificate_to_nvs(const char *key, const char *cert_pem)
 {
-    nvs_handle_t nvs_handle;
     esp_err_t err;
+    mbedtls_pem_context pem;
+    size_t pem_used = 0;
+
+    mbedtls_pem_init(&pem);
+    int ret = mbedtls_pem_read_buffer(&pem, PEM_BEGIN_CRT, PEM_END_CRT,
+                                      (const unsigned char *)cert_pem, NULL, 0, &pem_used);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Invalid PEM certificate for %s: -0x%x", key, (unsigned int)-ret);
+        mbedtls_pem_free(&pem);
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
-        return err;
+    const void *data;
+    size_t data_len;
+    bool is_chain = (strstr(cert_pem + pem_used, PEM_BEGIN_CRT) != NULL);
+    if (is_chain) {
+        data = cert_pem;
+        data_len = strlen(cert_pem) + 1;
+    } else {
+        data = mbedtls_pem_get_buffer(&pem, &data_len);
+    }
+
+    err = device_config_set_blob(key, data, data_len);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Saved %s to NVS (%s, %d bytes)", key, is_chain ? "PEM chain" : "DER", data_len);
     }
 
-    err = nvs_set_str(nvs_handle, key, cert_pem);
+    mbedtls_pem_free(&pem);
+    return err;
+}
+
+/**
+ * @brief Parse a CA certificate (DER or PEM with NUL) into the global CA store
+ *
+ * esp-tls keeps the parsed chain and hands it to every connection that
+ * sets use_global_ca_store, so the CA is not parsed again per handshake.
+ */
+static esp_err_t set_ca_store(const unsigned char *ca, size_t ca_len)
+{
+    esp_tls_free_global_ca_store();
+    s_ca_store_ready = false;
+
+    esp_err_t err = esp_tls_set_global_ca_store(ca, ca_len);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error saving %s to NVS: %s", key, esp_err_to_name(err));
-        nvs_close(nvs_handle);
+        ESP_LOGE(TAG, "Failed to set global CA store: %s", esp_err_to_name(err));
         return err;
     }
+    s_ca_store_ready = true;
+    ESP_LOGI(TAG, "CA parsed into the global CA store (%d bytes)", ca_len);
+    return ESP_OK;
+}
 
-    err = nvs_commit(nvs_handle);
-    nvs_close(nvs_handle);
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+/**
+ * @brief Generate a P-256 keypair and a CSR for it
+ *
+ * The big-number and SHA work runs on the MPI and SHA accelerators. The
+ * key is returned as DER in key_der (the last *key_len bytes are written
+ * by mbedTLS at the end of the buffer and moved to the front here).
+ */
+static esp_err_t generate_device_key(const char *device_id, char *csr_pem, size_t csr_size,
+                                     unsigned char *key_der, size_t *key_len)
+{
+    mbedtls_pk_context key;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_x509write_csr csr;
+    static const char pers[] = "device_key";
+    char subject[96];
+    esp_err_t err = ESP_FAIL;
+    int ret;
+
+    mbedtls_pk_init(&key);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_x509write_csr_init(&csr);
+
+    int64_t start = esp_timer_get_time();
+    ret = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                                (const unsigned char *)pers, sizeof(pers) - 1);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "DRBG seed failed: -0x%x", (unsigned int)-ret);
+        goto cleanup;
+    }
 
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "Saved %s to NVS", key);
+    ret = mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
+    if (ret == 0) {
+        ret = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(key),
+                                  mbedtls_ctr_drbg_random, &drbg);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Key generation failed: -0x%x", (unsigned int)-ret);
+        goto cleanup;
+    }
+
+    snprintf(subject, sizeof(subject), "CN=%s", device_id);
+    mbedtls_x509write_csr_set_md_alg(&csr, MBEDTLS_MD_SHA256);
+    mbedtls_x509write_csr_set_key(&csr, &key);
+    ret = mbedtls_x509write_csr_set_subject_name(&csr, subject);
+    if (ret == 0) {
+        ret = mbedtls_x509write_csr_pem(&csr, (unsigned char *)csr_pem, csr_size,
+                                        mbedtls_ctr_drbg_random, &drbg);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "CSR generation failed: -0x%x", (unsigned int)-ret);
+        goto cleanup;
     }
 
+    ret = mbedtls_pk_write_key_der(&key, key_der, *key_len);
+    if (ret <= 0) {
+        ESP_LOGE(TAG, "Key export failed: -0x%x", (unsigned int)-ret);
+        goto cleanup;
+    }
+    memmove(key_der, key_der + *key_len - ret, ret);
+    mbedtls_platform_zeroize(key_der + ret, *key_len - ret);
+    *key_len = ret;
+
+    ESP_LOGI(TAG, "Generated P-256 key and CSR in %lld ms",
+             (long long)((esp_timer_get_time() - start) / 1000));
+    err = ESP_OK;
+
+cleanup:
+    mbedtls_x509write_csr_free(&csr);
+    mbedtls_pk_free(&key);
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
     return err;
 }
 
+/**
+ * @brief Store the generated private key next to its certificate
+ */
+static esp_err_t save_device_key_to_nvs(const char *key, const unsigned char *key_der, size_t key_len)
+{
+    esp_err_t err = device_config_set_blob(key, key_der, key_len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error saving %s to NVS: %s", key, esp_err_to_name(err));
+        return err;
+    }
+#if !CONFIG_NVS_ENCRYPTION
+    ESP_LOGW(TAG, "NVS encryption is disabled, the device key is stored in plain text");
+#endif
+    ESP_LOGI(TAG, "Saved %s to NVS (DER, %d bytes)", key, key_len);
+    return ESP_OK;
+}
+#endif // CONFIG_APP_DEVICE_KEY_ONBOARD
+
 /**
  * @brief Submit CSR to backend
  * 
@@ -131,9 +433,15 @@ static esp_err_t save_certificate_to_nvs(const char *key, const char *cert_pem)
  * - device_id: Device identifier
  * - csr: Certificate Signing Request
  * - provisioning_token: Token containing userId (server extracts it)
+ *
+ * With CONFIG_APP_DEVICE_KEY_ONBOARD the keypair and CSR are generated
+ * here; the key is only stored once the signed certificates are saved.
+ * The result goes to the given certificate slot.
  */
-esp_err_t certificate_manager_submit_csr(const char *device_id, const char *prov_token)
+static esp_err_t sign_csr(const char *device_id, const char *prov_token, int slot)
 {
+    char name[SLOT_KEY_LEN];
+
     ESP_LOGI(TAG, "========================================");
     ESP_LOGI(TAG, "CSR Submission to Backend");
     ESP_LOGI(TAG, "========================================");
@@ -143,26 +451,53 @@ esp_err_t certificate_manager_submit_csr(const char *device_id, const char *prov
     // The provisioning_token contains all necessary information for server validation
 
     // Build request URL (correct endpoint path: /api/v1/sign-csr)
+    char backend_url[REMOTE_CONFIG_STR_MAX];
+    remote_config_get_str(REMOTE_CONFIG_BACKEND_URL, backend_url, sizeof(backend_url));
     char url[256];
-    snprintf(url, sizeof(url), "%s/api/v1/sign-csr", BACKEND_URL);
+    snprintf(url, sizeof(url), "%s/api/v1/sign-csr", backend_url);
     ESP_LOGI(TAG, "Endpoint: %s", url);
 
     // Build JSON request body with CSR, device_id, and provisioning_token
     // Note: Server extracts userId from provisioning_token and validates user-device association
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "device_id", device_id);
-    cJSON_AddStringToObject(root, "csr", DEVICE_CSR_PEM);
-    cJSON_AddStringToObject(root, "provisioning_token", prov_token);
-    
-    ESP_LOGI(TAG, "Payload includes: device_id, csr, provisioning_token");
-    ESP_LOGI(TAG, "Server will extract userId from provisioning_token for validation");
-
-    char *json_string = cJSON_Print(root);
-    if (json_string == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON string");
-        cJSON_Delete(root);
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+    char *csr_pem = malloc(CSR_PEM_MAX_LEN);
+    unsigned char key_der[KEY_DER_MAX_LEN];
+    size_t key_len = sizeof(key_der);
+    if (csr_pem == NULL) {
         return ESP_ERR_NO_MEM;
     }
+    esp_err_t key_err = generate_device_key(device_id, csr_pem, CSR_PEM_MAX_LEN, key_der, &key_len);
+    if (key_err != ESP_OK) {
+        free(csr_pem);
+        return key_err;
+    }
+#endif
+
+    // Filled in place: no tree, no copy of the CSR, no heap
+    esp_err_t err;
+    char *json_string = s_request_body;
+    size_t body_len = 0;
+    bool body_ok = json_emit_raw(s_request_body, sizeof(s_request_body), &body_len, CSR_BODY_HEAD) &&
+                   json_emit_string(s_request_body, sizeof(s_request_body), &body_len, device_id);
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+    body_ok = body_ok &&
+              json_emit_raw(s_request_body, sizeof(s_request_body), &body_len, CSR_BODY_CSR) &&
+              json_emit_string(s_request_body, sizeof(s_request_body), &body_len, csr_pem) &&
+              json_emit_raw(s_request_body, sizeof(s_request_body), &body_len, CSR_BODY_TOKEN);
+#else
+    body_ok = body_ok && json_emit_raw(s_request_body, sizeof(s_request_body), &body_len, s_csr_body_mid);
+#endif
+    body_ok = body_ok &&
+              json_emit_string(s_request_body, sizeof(s_request_body), &body_len, prov_token) &&
+              json_emit_raw(s_request_body, sizeof(s_request_body), &body_len, CSR_BODY_TAIL);
+    if (!body_ok) {
+        ESP_LOGE(TAG, "Request body exceeds %u bytes", (unsigned)sizeof(s_request_body));
+        err = ESP_ERR_INVALID_SIZE;
+        goto cleanup;
+    }
+
+    ESP_LOGI(TAG, "Payload includes: device_id, csr, provisioning_token");
+    ESP_LOGI(TAG, "Server will extract userId from provisioning_token for validation");
 
     ESP_LOGI(TAG, "Request body prepared (device_id + csr + provisioning_token)");
     ESP_LOGD(TAG, "Request body: %s", json_string);
@@ -170,48 +505,42 @@ esp_err_t certificate_manager_submit_csr(const char *device_id, const char *prov
     // Note: Authorization header not required - server extracts userId from provisioning_token
     // But we can optionally include it if needed for other server-side processing
 
-    // Configure HTTP client
-    esp_http_client_config_t config = {
+    csr_response_t *resp = calloc(1, sizeof(csr_response_t));
+    if (resp == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate response state");
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    json_stream_init(&resp->parser, s_csr_field_paths, CSR_FIELD_COUNT, csr_field_cb, resp);
+    http_response_init(&resp->error_body, resp->error_arena, sizeof(resp->error_arena), 0);
+
+    // Sent on the persistent backend client (connection and TLS session are reused)
+    backend_request_t request = {
         .url = url,
-        .event_handler = http_event_handler,
+        .method = HTTP_METHOD_POST,
+        .use_global_ca_store = s_ca_store_ready,
+        .content_type = "application/json",
+        .body = json_string,
+        .body_len = body_len,
         .timeout_ms = 30000,
         .skip_cert_common_name_check = false,
+        .event_handler = http_event_handler,
+        .user_data = resp,
     };
 
     // For HTTPS, we can use certificate bundle or skip verification for development
     // In production, you should verify the backend certificate
     #ifdef CONFIG_ESP_TLS_SKIP_SERVER_CERT_VERIFY
-    config.skip_cert_common_name_check = true;
+    request.skip_cert_common_name_check = true;
     #endif
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize HTTP client");
-        free(json_string);
-        cJSON_Delete(root);
-        return ESP_ERR_NO_MEM;
-    }
-
-    // Set headers
-    esp_http_client_set_method(client, HTTP_METHOD_POST);
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-    // Authorization header removed - server extracts userId from provisioning_token
-    esp_http_client_set_post_field(client, json_string, strlen(json_string));
-
-    // Free response buffer if exists
-    if (s_http_response_buffer) {
-        free(s_http_response_buffer);
-        s_http_response_buffer = NULL;
-        s_http_response_len = 0;
-    }
-
     // Log outgoing request
     ESP_LOGI(TAG, "========================================");
     ESP_LOGI(TAG, "📤 OUTGOING HTTP REQUEST (Backend)");
     ESP_LOGI(TAG, "========================================");
     ESP_LOGI(TAG, "Method: POST");
     ESP_LOGI(TAG, "URL: %s", url);
-    ESP_LOGI(TAG, "Request Body (length: %d):", strlen(json_string));
+    ESP_LOGI(TAG, "Request Body (length: %d):", body_len);
     ESP_LOGD(TAG, "Request Body: %s", json_string);
     ESP_LOGI(TAG, "Headers:");
     ESP_LOGI(TAG, "  Content-Type: application/json");
@@ -219,68 +548,71 @@ esp_err_t certificate_manager_submit_csr(const char *device_id, const char *prov
     ESP_LOGI(TAG, "========================================");
     
     // Perform request
-    esp_err_t err = esp_http_client_perform(client);
+    int status_code = 0;
+    s_retry_after_ms = 0;
+    err = backend_client_perform(&request, &status_code, NULL);
     if (err == ESP_OK) {
-        int status_code = esp_http_client_get_status_code(client);
         ESP_LOGI(TAG, "========================================");
         ESP_LOGI(TAG, "📥 INCOMING HTTP RESPONSE (Backend)");
         ESP_LOGI(TAG, "========================================");
         ESP_LOGI(TAG, "Status Code: %d", status_code);
 
         if (status_code == 200 || status_code == 201) {
-            // Parse response
-            if (s_http_response_buffer) {
-                ESP_LOGI(TAG, "Response Body (length: %d):", strlen(s_http_response_buffer));
-                ESP_LOGD(TAG, "Response Body: %s", s_http_response_buffer);
-
-                cJSON *response = cJSON_Parse(s_http_response_buffer);
-                if (response) {
-                    cJSON *cert_obj = cJSON_GetObjectItem(response, "certificate");
-                    cJSON *ca_obj = cJSON_GetObjectItem(response, "ca_certificate");
-
-                    if (cert_obj && ca_obj) {
-                        cJSON *cert_content = cJSON_GetObjectItem(cert_obj, "content");
-                        cJSON *ca_content = cJSON_GetObjectItem(ca_obj, "content");
-
-                        if (cJSON_IsString(cert_content) && cJSON_IsString(ca_content)) {
-                            // Save certificates to NVS
-                            err = save_certificate_to_nvs(NVS_KEY_DEVICE_CERT, cert_content->valuestring);
-                            if (err == ESP_OK) {
-                                err = save_certificate_to_nvs(NVS_KEY_CA_CERT, ca_content->valuestring);
-                            }
-
-                            if (err == ESP_OK) {
-                                ESP_LOGI(TAG, "✅ Successfully saved certificates");
-                                ESP_LOGI(TAG, "========================================");
-                            } else {
-                                ESP_LOGE(TAG, "✗ Failed to save certificates: %s", esp_err_to_name(err));
-                                ESP_LOGI(TAG, "========================================");
-                            }
-                        } else {
-                            ESP_LOGE(TAG, "✗ Invalid certificate format in response");
-                            ESP_LOGI(TAG, "========================================");
-                            err = ESP_ERR_INVALID_RESPONSE;
-                        }
-                    } else {
-                        ESP_LOGE(TAG, "✗ Missing certificate fields in response");
-                        ESP_LOGI(TAG, "========================================");
-                        err = ESP_ERR_INVALID_RESPONSE;
-                    }
-                    cJSON_Delete(response);
-                } else {
-                    ESP_LOGE(TAG, "✗ Failed to parse JSON response");
-                    ESP_LOGI(TAG, "========================================");
-                    err = ESP_ERR_INVALID_RESPONSE;
-                }
-            } else {
+            pem_field_t *cert = &resp->fields[CSR_FIELD_DEVICE_CERT];
+            pem_field_t *ca = &resp->fields[CSR_FIELD_CA_CERT];
+            esp_err_t parse_err = json_stream_finish(&resp->parser);
+
+            ESP_LOGI(TAG, "Response Body (length: %d):", resp->body_len);
+            ESP_LOGD(TAG, "Response Body (start): %s", resp->error_body.data);
+
+            if (resp->body_len == 0) {
                 ESP_LOGE(TAG, "✗ No response data received");
                 ESP_LOGI(TAG, "========================================");
                 err = ESP_ERR_INVALID_RESPONSE;
+            } else if (parse_err != ESP_OK) {
+                ESP_LOGE(TAG, "✗ Failed to parse JSON response: %s", esp_err_to_name(parse_err));
+                ESP_LOGI(TAG, "========================================");
+                err = ESP_ERR_INVALID_RESPONSE;
+            } else if (!cert->complete || !ca->complete) {
+                ESP_LOGE(TAG, "✗ Missing certificate fields in response");
+                ESP_LOGI(TAG, "========================================");
+                err = ESP_ERR_INVALID_RESPONSE;
+            } else {
+                // Save certificates to NVS
+                // One transaction and one commit for the whole set
+                device_config_begin();
+                err = save_certificate_to_nvs(slot_key(NVS_KEY_DEVICE_CERT, slot, name), cert->data);
+                if (err == ESP_OK) {
+                    err = save_certificate_to_nvs(slot_key(NVS_KEY_CA_CERT, slot, name), ca->data);
+                }
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+                if (err == ESP_OK) {
+                    err = save_device_key_to_nvs(slot_key(NVS_KEY_DEVICE_KEY, slot, name), key_der, key_len);
+                }
+#endif
+                esp_err_t commit_err = device_config_commit();
+                if (err == ESP_OK) {
+                    err = commit_err;
+                }
+                if (err == ESP_OK && slot == active_slot()) {
+                    invalidate_active();
+                }
+
+                if (err == ESP_OK) {
+                    ESP_LOGI(TAG, "✅ Successfully saved certificates");
+                    ESP_LOGI(TAG, "========================================");
+                } else {
+                    ESP_LOGE(TAG, "✗ Failed to save certificates: %s", esp_err_to_name(err));
+                    ESP_LOGI(TAG, "========================================");
+                }
             }
         } else {
             ESP_LOGE(TAG, "✗ HTTP request failed with status %d", status_code);
-            if (s_http_response_buffer && strlen(s_http_response_buffer) > 0) {
-                ESP_LOGE(TAG, "Error Response: %s", s_http_response_buffer);
+            if (s_retry_after_ms > 0) {
+                ESP_LOGW(TAG, "Server asked to retry after %lu s", (unsigned long)(s_retry_after_ms / 1000));
+            }
+            if (resp->error_body.len > 0) {
+                ESP_LOGE(TAG, "Error Response: %s", resp->error_body.data);
             }
             ESP_LOGI(TAG, "========================================");
             err = ESP_FAIL;
@@ -292,17 +624,72 @@ esp_err_t certificate_manager_submit_csr(const char *device_id, const char *prov
     }
 
     // Cleanup
-    esp_http_client_cleanup(client);
-    free(json_string);
-    cJSON_Delete(root);
+    csr_response_free(resp);
+
+cleanup:
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+    mbedtls_platform_zeroize(key_der, sizeof(key_der));
+    free(csr_pem);
+#endif
+    return err;
+}
+
+esp_err_t certificate_manager_submit_csr(const char *device_id, const char *prov_token)
+{
+    return sign_csr(device_id, prov_token, active_slot());
+}
+
+esp_err_t certificate_manager_renew(const char *device_id, const char *prov_token)
+{
+    int next = 1 - active_slot();
 
-    if (s_http_response_buffer) {
-        free(s_http_response_buffer);
-        s_http_response_buffer = NULL;
-        s_http_response_len = 0;
+    ESP_LOGI(TAG, "Renewing certificates into slot %d", next);
+    esp_err_t err = sign_csr(device_id, prov_token, next);
+    if (err != ESP_OK) {
+        return err;
     }
 
-    return err;
+    return device_config_set_u8(NVS_KEY_CERT_NEXT, next);
+}
+
+uint32_t certificate_manager_retry_after_ms(void)
+{
+    return s_retry_after_ms;
+}
+
+esp_err_t certificate_manager_activate_renewed(void)
+{
+    uint8_t next = 0;
+    int slot = active_slot();
+
+    if (device_config_get_u8(NVS_KEY_CERT_NEXT, &next) != ESP_OK) {
+        return ESP_OK;
+    }
+
+    if (next != slot) {
+        // Committed on its own: this write is the swap
+        esp_err_t err = device_config_set_u8(NVS_KEY_CERT_SLOT, next);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to activate slot %d: %s", next, esp_err_to_name(err));
+            return err;
+        }
+        s_slot = next;
+        invalidate_active();
+        // A resumed session would keep presenting the old identity
+        mqtt_tls_transport_forget_session();
+        ESP_LOGI(TAG, "Renewed certificates active (slot %d)", next);
+    }
+
+    // Also reached when a reset hit between the two writes
+    device_config_erase(NVS_KEY_CERT_NEXT);
+    return ESP_OK;
+}
+
+esp_err_t certificate_manager_erase(void)
+{
+    s_slot = -1;
+    invalidate_active();
+    return device_config_erase_identity();
 }
 
 /**
@@ -310,63 +697,266 @@ esp_err_t certificate_manager_submit_csr(const char *device_id, const char *prov
  */
 bool certificate_manager_has_certificates(void)
 {
-    nvs_handle_t nvs_handle;
     size_t required_size = 0;
 
-    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
-        return false;
+    // Check if device cert exists (DER blob, or PEM string from older firmware)
+    char name[SLOT_KEY_LEN];
+    int slot = active_slot();
+    const char *key = slot_key(NVS_KEY_DEVICE_CERT, slot, name);
+    esp_err_t err1 = device_config_get_blob(key, NULL, &required_size);
+    if (err1 != ESP_OK) {
+        err1 = device_config_get_str(key, NULL, &required_size);
     }
 
-    // Check if device cert exists
-    esp_err_t err1 = nvs_get_str(nvs_handle, NVS_KEY_DEVICE_CERT, NULL, &required_size);
-    
     // Check if CA cert exists
     required_size = 0;
-    esp_err_t err2 = nvs_get_str(nvs_handle, NVS_KEY_CA_CERT, NULL, &required_size);
-
-    nvs_close(nvs_handle);
+    key = slot_key(NVS_KEY_CA_CERT, slot, name);
+    esp_err_t err2 = device_config_get_blob(key, NULL, &required_size);
+    if (err2 != ESP_OK) {
+        err2 = device_config_get_str(key, NULL, &required_size);
+    }
 
     return (err1 == ESP_OK && err2 == ESP_OK);
 }
 
 /**
- * @brief Load certificate from NVS
+ * @brief Convert a PEM string stored by older firmware into the blob format
  */
-static esp_err_t load_certificate_from_nvs(const char *key, char *cert_buffer, size_t buffer_size)
+static esp_err_t migrate_legacy_certificate(const char *key)
 {
-    nvs_handle_t nvs_handle;
-    size_t required_size = buffer_size;
-
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    size_t required_size = 0;
+    esp_err_t err = device_config_get_str(key, NULL, &required_size);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
         return err;
     }
 
-    err = nvs_get_str(nvs_handle, key, cert_buffer, &required_size);
-    nvs_close(nvs_handle);
+    char *pem = malloc(required_size);
+    if (pem == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    err = device_config_get_str(key, pem, &required_size);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Migrating %s from PEM string to blob storage", key);
+        err = save_certificate_to_nvs(key, pem);
+    }
+    free(pem);
+    return err;
+}
+
+/**
+ * @brief Load certificate from NVS into an exactly sized heap buffer
+ */
+static esp_err_t load_certificate_from_nvs(const char *key, unsigned char **cert, size_t *cert_len)
+{
+    size_t required_size = 0;
+    unsigned char *buffer = NULL;
+
+    esp_err_t err = device_config_get_blob(key, NULL, &required_size);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = migrate_legacy_certificate(key);
+        if (err == ESP_OK) {
+            err = device_config_get_blob(key, NULL, &required_size);
+        }
+    }
+    if (err != ESP_OK) goto cleanup;
+
+    buffer = malloc(required_size);
+    if (buffer == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+
+    err = device_config_get_blob(key, buffer, &required_size);
+
+cleanup:
 
     if (err == ESP_OK) {
         ESP_LOGI(TAG, "Loaded %s from NVS (%d bytes)", key, required_size);
+        *cert = buffer;
+        *cert_len = required_size;
     } else {
         ESP_LOGE(TAG, "Failed to load %s from NVS: %s", key, esp_err_to_name(err));
+        free(buffer);
     }
 
     return err;
 }
 
-esp_err_t certificate_manager_load_device_cert(char *cert_buffer, size_t buffer_size)
+esp_err_t certificate_manager_load_device_cert(unsigned char **cert, size_t *cert_len)
 {
-    return load_certificate_from_nvs(NVS_KEY_DEVICE_CERT, cert_buffer, buffer_size);
+    char name[SLOT_KEY_LEN];
+    return load_certificate_from_nvs(slot_key(NVS_KEY_DEVICE_CERT, active_slot(), name), cert, cert_len);
 }
 
-esp_err_t certificate_manager_load_ca_cert(char *cert_buffer, size_t buffer_size)
+esp_err_t certificate_manager_load_ca_cert(unsigned char **cert, size_t *cert_len)
 {
-    return load_certificate_from_nvs(NVS_KEY_CA_CERT, cert_buffer, buffer_size);
+    char name[SLOT_KEY_LEN];
+    return load_certificate_from_nvs(slot_key(NVS_KEY_CA_CERT, active_slot(), name), cert, cert_len);
 }
 
-const char* certificate_manager_get_private_key(void)
+/**
+ * @brief Days since 1970-01-01 of a proleptic Gregorian date
+ */
+static int64_t days_from_civil(int y, int m, int d)
+{
+    y -= (m <= 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+esp_err_t certificate_manager_get_expiry(int64_t *not_after)
+{
+    if (s_not_after != 0) {
+        *not_after = s_not_after;
+        return ESP_OK;
+    }
+
+    unsigned char *cert = NULL;
+    size_t cert_len = 0;
+    esp_err_t err = certificate_manager_load_device_cert(&cert, &cert_len);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // The device certificate is the first one of a chain
+    mbedtls_x509_crt crt;
+    mbedtls_x509_crt_init(&crt);
+    int ret = mbedtls_x509_crt_parse(&crt, cert, cert_len);
+    free(cert);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to parse device certificate: -0x%x", (unsigned int)-ret);
+        mbedtls_x509_crt_free(&crt);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const mbedtls_x509_time *t = &crt.valid_to;
+    s_not_after = days_from_civil(t->year, t->mon, t->day) * 86400 +
+                  t->hour * 3600 + t->min * 60 + t->sec;
+    ESP_LOGI(TAG, "Device certificate valid until %04d-%02d-%02d",
+             t->year, t->mon, t->day);
+    mbedtls_x509_crt_free(&crt);
+
+    *not_after = s_not_after;
+    return ESP_OK;
+}
+
+esp_err_t certificate_manager_init_ca_store(void)
+{
+    if (s_ca_store_ready) {
+        return ESP_OK;
+    }
+
+    unsigned char *ca = NULL;
+    size_t ca_len = 0;
+    esp_err_t err = load_certificate_from_nvs(NVS_KEY_CA_CERT, &ca, &ca_len);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = set_ca_store(ca, ca_len);
+    free(ca);
+    return err;
+}
+
+esp_err_t certificate_manager_load_private_key(unsigned char **key, size_t *key_len)
+{
+#if CONFIG_APP_DEVICE_KEY_DS
+    return ESP_ERR_NOT_SUPPORTED;
+#else
+#if CONFIG_APP_DEVICE_KEY_ONBOARD
+    size_t required_size = 0;
+    char name[SLOT_KEY_LEN];
+    const char *key_name = slot_key(NVS_KEY_DEVICE_KEY, active_slot(), name);
+
+    esp_err_t err = device_config_get_blob(key_name, NULL, &required_size);
+    if (err == ESP_OK) {
+        unsigned char *buffer = malloc(required_size);
+        err = (buffer != NULL) ? device_config_get_blob(key_name, buffer, &required_size)
+                               : ESP_ERR_NO_MEM;
+        if (err == ESP_OK) {
+            *key = buffer;
+            *key_len = required_size;
+        } else {
+            free(buffer);
+        }
+    }
+    if (err != ESP_ERR_NVS_NOT_FOUND) {
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to load %s from NVS: %s", key_name, esp_err_to_name(err));
+        }
+        return err;
+    }
+    // Provisioned by older firmware: the certificate was issued for the embedded key
+    ESP_LOGW(TAG, "No generated key in NVS, using the embedded key");
+#endif
+
+    size_t len = sizeof(DEVICE_PRIVATE_KEY_PEM);
+    unsigned char *buffer = malloc(len);
+    if (buffer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(buffer, DEVICE_PRIVATE_KEY_PEM, len);
+    *key = buffer;
+    *key_len = len;
+    return ESP_OK;
+#endif // CONFIG_APP_DEVICE_KEY_DS
+}
+
+esp_err_t certificate_manager_load_ds_data(void **ds_data)
 {
-    return DEVICE_PRIVATE_KEY_PEM;
+#if CONFIG_APP_DEVICE_KEY_DS
+    nvs_handle_t nvs_handle;
+    uint16_t rsa_len_bits = 0;
+    size_t len;
+
+    // The context and the parameters it points to live in one allocation
+    esp_ds_data_ctx_t *ctx = calloc(1, sizeof(esp_ds_data_ctx_t) + sizeof(esp_ds_data_t));
+    if (ctx == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    ctx->esp_ds_data = (esp_ds_data_t *)(ctx + 1);
+
+    esp_err_t err = nvs_open(NVS_DS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "DS parameters not provisioned: %s", esp_err_to_name(err));
+        free(ctx);
+        return err;
+    }
+
+    err = nvs_get_u8(nvs_handle, NVS_KEY_DS_KEY_ID, &ctx->efuse_key_id);
+    if (err != ESP_OK) goto cleanup;
+
+    err = nvs_get_u16(nvs_handle, NVS_KEY_DS_RSA_LEN, &rsa_len_bits);
+    if (err != ESP_OK) goto cleanup;
+    if (rsa_len_bits == 0 || rsa_len_bits % 32 != 0) {
+        err = ESP_ERR_INVALID_SIZE;
+        goto cleanup;
+    }
+    ctx->rsa_length_bits = rsa_len_bits;
+    ctx->esp_ds_data->rsa_length = (esp_digital_signature_length_t)(rsa_len_bits / 32 - 1);
+
+    len = ESP_DS_C_LEN;
+    err = nvs_get_blob(nvs_handle, NVS_KEY_DS_C, ctx->esp_ds_data->c, &len);
+    if (err != ESP_OK) goto cleanup;
+
+    len = ESP_DS_IV_LEN;
+    err = nvs_get_blob(nvs_handle, NVS_KEY_DS_IV, ctx->esp_ds_data->iv, &len);
+
+cleanup:
+    nvs_close(nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to load DS parameters: %s", esp_err_to_name(err));
+        free(ctx);
+        return err;
+    }
+    ESP_LOGI(TAG, "DS key: eFuse key %d, RSA-%d", ctx->efuse_key_id, rsa_len_bits);
+    *ds_data = ctx;
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
 }
 
@@ -9,6 +9,7 @@
 #include "esp_err.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -27,6 +28,61 @@ extern "C" {
  */
 esp_err_t certificate_manager_submit_csr(const char *device_id, const char *token);
 
+/**
+ * @brief Request new certificates while the current ones stay in use
+ *
+ * Same request as certificate_manager_submit_csr(), but the result is
+ * stored in the inactive certificate slot. It becomes active at the next
+ * certificate_manager_activate_renewed().
+ *
+ * @param device_id Device identifier
+ * @param token Provisioning token for authentication
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t certificate_manager_renew(const char *device_id, const char *token);
+
+/**
+ * @brief Retry-After of the last sign-csr response
+ *
+ * Set by certificate_manager_submit_csr() and certificate_manager_renew()
+ * when the backend sends a delta-seconds Retry-After (typically with 429 or
+ * 503), capped at an hour. Use it as the floor for the next attempt.
+ *
+ * @return Milliseconds to wait, 0 when the last response had no hint
+ */
+uint32_t certificate_manager_retry_after_ms(void);
+
+/**
+ * @brief Swap in certificates stored by certificate_manager_renew()
+ *
+ * Call before loading the certificates for a new connection. Does nothing
+ * when no renewal is pending; a swap also drops the cached TLS session.
+ *
+ * @return ESP_OK on success or when nothing was pending
+ */
+esp_err_t certificate_manager_activate_renewed(void);
+
+/**
+ * @brief Erase the device identity: ID, tokens, both certificate slots and keys
+ *
+ * For a factory reset or a device provisioned under a new ID; a change of
+ * Wi-Fi network keeps them. Part of the enclosing device_config
+ * transaction, if any.
+ *
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t certificate_manager_erase(void);
+
+/**
+ * @brief Get the notAfter time of the active device certificate
+ *
+ * The certificate is parsed on the first call only.
+ *
+ * @param not_after Output: expiry as Unix time (seconds)
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t certificate_manager_get_expiry(int64_t *not_after);
+
 /**
  * @brief Check if certificates are stored in NVS
  * 
@@ -36,28 +92,68 @@ bool certificate_manager_has_certificates(void);
 
 /**
  * @brief Load device certificate from NVS
- * 
- * @param cert_buffer Output buffer for certificate (PEM format)
- * @param buffer_size Size of the buffer
+ *
+ * The certificate is returned as DER, or as a NUL-terminated PEM chain if
+ * the backend returned more than one certificate. Either form can be passed
+ * to esp-tls together with its length. PEM strings written by older firmware
+ * are converted on first load.
+ *
+ * @param cert Output: heap buffer holding the certificate, release with free()
+ * @param cert_len Output: length of the certificate in bytes
  * @return ESP_OK on success, error code otherwise
  */
-esp_err_t certificate_manager_load_device_cert(char *cert_buffer, size_t buffer_size);
+esp_err_t certificate_manager_load_device_cert(unsigned char **cert, size_t *cert_len);
 
 /**
  * @brief Load CA certificate from NVS
- * 
- * @param cert_buffer Output buffer for CA certificate (PEM format)
- * @param buffer_size Size of the buffer
+ *
+ * Same format and ownership rules as certificate_manager_load_device_cert().
+ *
+ * @param cert Output: heap buffer holding the CA certificate, release with free()
+ * @param cert_len Output: length of the certificate in bytes
  * @return ESP_OK on success, error code otherwise
  */
-esp_err_t certificate_manager_load_ca_cert(char *cert_buffer, size_t buffer_size);
+esp_err_t certificate_manager_load_ca_cert(unsigned char **cert, size_t *cert_len);
 
 /**
- * @brief Get device private key (from device_keys.h)
- * 
- * @return Pointer to private key string (PEM format)
+ * @brief Parse the stored CA certificate into the esp-tls global CA store
+ *
+ * The parsed CA is kept for the lifetime of the application and shared by
+ * every esp-tls connection that sets use_global_ca_store (the MQTT
+ * transport and the backend client). Calling it again is a no-op until
+ * certificate_manager_submit_csr() stores a new CA.
+ *
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t certificate_manager_init_ca_store(void);
+
+/**
+ * @brief Load the device private key
+ *
+ * Returns the P-256 key generated at provisioning time (DER) when
+ * CONFIG_APP_DEVICE_KEY_ONBOARD is set and a key is stored, otherwise a
+ * copy of the embedded PEM key from device_keys.h (including its NUL).
+ * With CONFIG_APP_DEVICE_KEY_DS there is no key to load and
+ * ESP_ERR_NOT_SUPPORTED is returned; use certificate_manager_load_ds_data().
+ *
+ * @param key Output: heap buffer holding the key, wipe and release with free()
+ * @param key_len Output: length of the key in bytes
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t certificate_manager_load_private_key(unsigned char **key, size_t *key_len);
+
+/**
+ * @brief Load the Digital Signature peripheral context for the device key
+ *
+ * Only available with CONFIG_APP_DEVICE_KEY_DS. The returned context holds
+ * the encrypted key parameters from NVS and can be passed to esp-tls as
+ * ds_data in place of a private key. The plaintext key never leaves the
+ * peripheral.
+ *
+ * @param ds_data Output: heap esp_ds_data_ctx_t, release with free()
+ * @return ESP_OK, ESP_ERR_NOT_SUPPORTED without DS, NVS error if not provisioned
  */
-const char* certificate_manager_get_private_key(void);
+esp_err_t certificate_manager_load_ds_data(void **ds_data);
 
 #ifdef __cplusplus
 }
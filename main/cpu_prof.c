@@ -0,0 +1,327 @@
+/* CPU Profiler Implementation
+ *
+ * A level-1 interrupt never nests in another one, so when the alarm fires
+ * the interrupted context is a task: the port has saved its exception
+ * frame on the task stack and stored that stack pointer in the TCB, whose
+ * first member is pxTopOfStack. The frame's PC is the sample.
+ *
+ * Each ring has one producer, the timer interrupt of its core, and one
+ * consumer, the profiler task, so head and tail need no lock. The table is
+ * only touched by the profiler task.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_prof.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_CPU_PROF
+
+#include "json_view.h"
+#include "mqtt_handler.h"
+#include "driver/gptimer.h"
+#include "esp_app_desc.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "xtensa_context.h"
+
+static const char *TAG = "cpu_prof";
+
+#define CORES           portNUM_PROCESSORS
+#define RING_LEN        512             // Per core, a power of two
+#define DRAIN_MS        20
+#define SLOTS           CONFIG_APP_CPU_PROF_SLOTS
+#define MAX_PROBES      16
+#define TIMER_HZ        1000000
+#define TOPIC_MAX       80
+#define CMD_TOKENS      8
+#define HEADER_LEN      (1 + 1 + 2 + 4 + 32 + 4 * CORES + 4 + 4 + 2)
+#define ENTRY_LEN       8
+
+typedef struct {
+    uint32_t key;                       // Block address | core
+    uint32_t count;                     // 0: free
+} slot_t;
+
+static uint32_t s_ring[CORES][RING_LEN];
+static volatile uint32_t s_head[CORES];
+static volatile uint32_t s_tail[CORES];
+static volatile uint32_t s_samples[CORES];
+static volatile uint32_t s_dropped[CORES];
+
+static slot_t s_slots[SLOTS];
+static uint32_t s_used = 0;
+static uint32_t s_unplaced = 0;
+
+static gptimer_handle_t s_timer[CORES];
+static esp_err_t s_setup_err[CORES];
+static TaskHandle_t s_setup_waiter = NULL;
+static TaskHandle_t s_task = NULL;
+static volatile bool s_running = false;
+static char s_data_topic[TOPIC_MAX];
+
+static bool IRAM_ATTR on_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg)
+{
+    int core = (int)(intptr_t)arg;
+    const XtExcFrame *frame = *(XtExcFrame *const *)xTaskGetCurrentTaskHandleForCore(core);
+
+    s_samples[core]++;
+    uint32_t head = s_head[core];
+    if (head - s_tail[core] >= RING_LEN) {
+        s_dropped[core]++;
+        return false;
+    }
+    s_ring[core][head % RING_LEN] = (uint32_t)frame->pc;
+    s_head[core] = head + 1;
+    return false;
+}
+
+/**
+ * @brief Create the timer of one core, from a task pinned to it
+ *
+ * The interrupt is allocated on the core that registers the callbacks.
+ */
+static void timer_setup_task(void *arg)
+{
+    int core = (int)(intptr_t)arg;
+    const gptimer_config_t config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = TIMER_HZ,
+        .intr_priority = 1,
+    };
+    const gptimer_alarm_config_t alarm = {
+        .alarm_count = TIMER_HZ / CONFIG_APP_CPU_PROF_HZ,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    const gptimer_event_callbacks_t cbs = {
+        .on_alarm = on_alarm,
+    };
+
+    esp_err_t err = gptimer_new_timer(&config, &s_timer[core]);
+    if (err == ESP_OK) {
+        err = gptimer_set_alarm_action(s_timer[core], &alarm);
+    }
+    if (err == ESP_OK) {
+        err = gptimer_register_event_callbacks(s_timer[core], &cbs, (void *)(intptr_t)core);
+    }
+    if (err == ESP_OK) {
+        err = gptimer_enable(s_timer[core]);
+    }
+    s_setup_err[core] = err;
+    xTaskNotifyGive(s_setup_waiter);
+    vTaskDelete(NULL);
+}
+
+static void add_sample(uint32_t key)
+{
+    uint32_t i = ((key >> CPU_PROF_BLOCK_LOG2) * 2654435761u) % SLOTS;
+    for (int probe = 0; probe < MAX_PROBES; probe++) {
+        slot_t *slot = &s_slots[i];
+        if (slot->count == 0) {
+            slot->key = key;
+            slot->count = 1;
+            s_used++;
+            return;
+        }
+        if (slot->key == key) {
+            slot->count++;
+            return;
+        }
+        i = (i + 1) % SLOTS;
+    }
+    s_unplaced++;
+}
+
+static void drain(void)
+{
+    for (int core = 0; core < CORES; core++) {
+        uint32_t head = s_head[core];
+        for (uint32_t tail = s_tail[core]; tail != head; tail++) {
+            uint32_t pc = s_ring[core][tail % RING_LEN];
+            add_sample((pc & ~(uint32_t)(CPU_PROF_BLOCK - 1)) | (uint32_t)core);
+        }
+        s_tail[core] = head;
+    }
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    return p + 2;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+    return p + 4;
+}
+
+static void publish(uint32_t duration_ms)
+{
+    size_t len = HEADER_LEN + (size_t)s_used * ENTRY_LEN;
+    uint8_t *buf = malloc(len);
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "No memory for a %u-byte profile", (unsigned)len);
+        return;
+    }
+
+    uint32_t total = 0;
+    uint8_t *p = buf;
+    *p++ = CPU_PROF_VERSION;
+    *p++ = CPU_PROF_BLOCK_LOG2;
+    p = put_u16(p, CONFIG_APP_CPU_PROF_HZ);
+    p = put_u32(p, duration_ms);
+    memcpy(p, esp_app_get_description()->app_elf_sha256, 32);
+    p += 32;
+    for (int core = 0; core < CORES; core++) {
+        p = put_u32(p, s_samples[core]);
+        total += s_samples[core];
+    }
+    uint32_t dropped = 0;
+    for (int core = 0; core < CORES; core++) {
+        dropped += s_dropped[core];
+    }
+    p = put_u32(p, dropped);
+    p = put_u32(p, s_unplaced);
+    p = put_u16(p, (uint16_t)s_used);
+    for (int i = 0; i < SLOTS; i++) {
+        if (s_slots[i].count > 0) {
+            p = put_u32(p, s_slots[i].key);
+            p = put_u32(p, s_slots[i].count);
+        }
+    }
+
+    esp_err_t err = mqtt_handler_publish(s_data_topic, (const char *)buf, (int)len, 1);
+    free(buf);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Profile not published: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Profile published: %lu samples in %lu blocks, %lu dropped, %lu unplaced, %u bytes",
+             (unsigned long)total, (unsigned long)s_used, (unsigned long)dropped,
+             (unsigned long)s_unplaced, (unsigned)len);
+}
+
+static void profile(uint32_t seconds)
+{
+    memset(s_slots, 0, sizeof(s_slots));
+    s_used = 0;
+    s_unplaced = 0;
+    for (int core = 0; core < CORES; core++) {
+        s_tail[core] = s_head[core];
+        s_samples[core] = 0;
+        s_dropped[core] = 0;
+    }
+
+    ESP_LOGI(TAG, "Profiling for %lu s at %d Hz", (unsigned long)seconds, CONFIG_APP_CPU_PROF_HZ);
+    int64_t start_us = esp_timer_get_time();
+    for (int core = 0; core < CORES; core++) {
+        gptimer_set_raw_count(s_timer[core], 0);
+        gptimer_start(s_timer[core]);
+    }
+    while (esp_timer_get_time() - start_us < (int64_t)seconds * 1000000) {
+        vTaskDelay(pdMS_TO_TICKS(DRAIN_MS));
+        drain();
+    }
+    for (int core = 0; core < CORES; core++) {
+        gptimer_stop(s_timer[core]);
+    }
+    drain();
+
+    publish((uint32_t)((esp_timer_get_time() - start_us) / 1000));
+}
+
+static void prof_task(void *arg)
+{
+    while (1) {
+        uint32_t seconds;
+        xTaskNotifyWait(0, UINT32_MAX, &seconds, portMAX_DELAY);
+        profile(seconds);
+        s_running = false;
+    }
+}
+
+esp_err_t cpu_prof_request(uint32_t seconds)
+{
+    if (s_task == NULL || s_running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (seconds < 1) {
+        seconds = 1;
+    } else if (seconds > CONFIG_APP_CPU_PROF_MAX_S) {
+        seconds = CONFIG_APP_CPU_PROF_MAX_S;
+    }
+    s_running = true;
+    xTaskNotify(s_task, seconds, eSetValueWithOverwrite);
+    return ESP_OK;
+}
+
+static esp_err_t cmd_message(const mqtt_handler_msg_t *msg, void *ctx)
+{
+    if (msg->offset != 0 || msg->len != msg->total_len) {
+        ESP_LOGW(TAG, "Request of %d bytes ignored", msg->total_len);
+        return ESP_FAIL;
+    }
+    json_view_tok_t toks[CMD_TOKENS];
+    json_view_t view;
+    int64_t seconds;
+    if (json_view_parse(&view, msg->data, msg->len, toks, CMD_TOKENS) != ESP_OK ||
+        json_view_int(&view, json_view_get(&view, 0, "seconds"), &seconds) != ESP_OK) {
+        ESP_LOGW(TAG, "Malformed request ignored");
+        return ESP_OK;
+    }
+    if (cpu_prof_request(seconds < 0 ? 0 : (uint32_t)seconds) != ESP_OK) {
+        ESP_LOGW(TAG, "Profile already running, request ignored");
+    }
+    return ESP_OK;
+}
+
+esp_err_t cpu_prof_start_remote(const char *device_id)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    char cmd_topic[TOPIC_MAX];
+    int n = snprintf(s_data_topic, sizeof(s_data_topic), "prof/%s/data", device_id);
+    if (n < 0 || (size_t)n >= sizeof(s_data_topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    snprintf(cmd_topic, sizeof(cmd_topic), "prof/%s", device_id);
+
+    s_setup_waiter = xTaskGetCurrentTaskHandle();
+    for (int core = 0; core < CORES; core++) {
+        if (s_timer[core] != NULL && s_setup_err[core] == ESP_OK) {
+            continue;           // Set up by an earlier, failed call
+        }
+        if (xTaskCreatePinnedToCore(timer_setup_task, "prof_setup", 2048, (void *)(intptr_t)core,
+                                    tskIDLE_PRIORITY + 5, NULL, core) != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (s_setup_err[core] != ESP_OK) {
+            ESP_LOGE(TAG, "Timer for core %d: %s", core, esp_err_to_name(s_setup_err[core]));
+            return s_setup_err[core];
+        }
+    }
+
+    if (xTaskCreate(prof_task, "cpu_prof", 3072, NULL, tskIDLE_PRIORITY + 2, &s_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = mqtt_handler_subscribe(cmd_topic, 1, cmd_message, NULL);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Profiles on request at %s", cmd_topic);
+    }
+    return err;
+}
+
+#endif // CONFIG_APP_CPU_PROF
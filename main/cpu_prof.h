@@ -0,0 +1,65 @@
+/* CPU Profiler Header
+ *
+ * Sampling profiler for units in the field, where no debugger can be
+ * attached. While a profile runs, a gptimer on each core interrupts
+ * CONFIG_APP_CPU_PROF_HZ times a second and records the program counter
+ * of the interrupted task into a ring of that core; a background task
+ * drains the rings into a table of sample counts per code block of
+ * CPU_PROF_BLOCK bytes and core. At the end the table is published as
+ * one binary message. The backend maps each block to its function with
+ * the ELF of the build, identified by the SHA-256 in the header, and
+ * folds the counts per function.
+ *
+ * A profile is requested with {"seconds":N} on prof/<device_id> and
+ * published on prof/<device_id>/data, little-endian:
+ *
+ *   u8 version | u8 log2 of CPU_PROF_BLOCK | u16 rate, Hz | u32 duration, ms
+ *   u8[32] ELF SHA-256 of the running app
+ *   u32 samples, per core | u32 dropped (ring full) | u32 unplaced (table full)
+ *   u16 entries, then per entry: u32 block address | core, u32 samples
+ *
+ * The timer interrupt is at level 1, so code running with interrupts
+ * masked is charged to the instruction that unmasks them, and interrupt
+ * handlers are not sampled at all.
+ *
+ * Built only with CONFIG_APP_CPU_PROF, on Xtensa targets.
+ */
+
+#ifndef CPU_PROF_H
+#define CPU_PROF_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CPU_PROF_VERSION    1
+#define CPU_PROF_BLOCK_LOG2 4
+#define CPU_PROF_BLOCK      (1 << CPU_PROF_BLOCK_LOG2)
+
+/**
+ * @brief Set up the timers and the profiler task, subscribe to requests
+ *
+ * Call once MQTT is up; repeated calls are no-ops.
+ *
+ * @param device_id Device ID for the topics
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for an ID too long, or a timer,
+ *         task or subscription error
+ */
+esp_err_t cpu_prof_start_remote(const char *device_id);
+
+/**
+ * @brief Start a profile in the background
+ *
+ * @param seconds Duration, clamped to 1..CONFIG_APP_CPU_PROF_MAX_S
+ * @return ESP_OK, or ESP_ERR_INVALID_STATE if not started or a profile runs
+ */
+esp_err_t cpu_prof_request(uint32_t seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CPU_PROF_H
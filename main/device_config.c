@@ -0,0 +1,561 @@
+/* Device Configuration Store Implementation
+ *
+ * Every module used to open and close the namespace around each access,
+ * and boot read the same keys several times (certificate checks probe
+ * sizes and then load). Here the handle stays open, init walks the
+ * namespace once and keeps each value up to CONFIG_CACHE_VALUE_MAX bytes
+ * in RAM. Larger values (certificates) keep only their size. While the
+ * table holds every key of the namespace, a miss is answered without
+ * touching flash.
+ *
+ * Identity keys (see s_identity_keys) live in a namespace of their own,
+ * picked by key name, so callers never name a namespace. Both share the
+ * cache. Firmware that kept them in "device_config" has them moved over
+ * by init, once.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "device_config.h"
+#include "trace_marks.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "device_config";
+
+#define NVS_NAMESPACE "device_config"
+#define NVS_NAMESPACE_IDENTITY "identity"
+
+enum { NS_CONFIG, NS_IDENTITY, NS_COUNT };
+
+static const char *const s_namespaces[NS_COUNT] = { NVS_NAMESPACE, NVS_NAMESPACE_IDENTITY };
+
+// Key prefixes of the identity namespace; slot 2 keys carry a suffix
+static const char *const s_identity_keys[] = {
+    "device_id", "prov_token", "bearer_token",
+    "device_cert", "ca_cert", "device_key", "cert_slot", "cert_next",
+};
+
+#define CONFIG_CACHE_ENTRIES 24
+#define CONFIG_CACHE_VALUE_MAX 256      // Tokens fit, certificates do not
+
+typedef struct {
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    nvs_type_t type;
+    bool used;
+    bool present;                       // false: known to be absent
+    size_t len;                         // Strings include the NUL terminator
+    uint8_t *value;                     // NULL when larger than CONFIG_CACHE_VALUE_MAX
+} config_entry_t;
+
+static nvs_handle_t s_handles[NS_COUNT];
+static SemaphoreHandle_t s_mutex = NULL;
+static config_entry_t s_cache[CONFIG_CACHE_ENTRIES];
+static int s_evict = 0;
+static bool s_complete = false;         // Every key of the namespace is in the cache
+
+// Transaction state, owned by the task holding s_mutex
+static int s_depth = 0;
+static esp_err_t s_txn_err = ESP_OK;
+static uint8_t s_dirty = 0;             // Namespaces written since the last commit
+
+static int key_ns(const char *key)
+{
+    for (size_t i = 0; i < sizeof(s_identity_keys) / sizeof(s_identity_keys[0]); i++) {
+        if (strncmp(key, s_identity_keys[i], strlen(s_identity_keys[i])) == 0) {
+            return NS_IDENTITY;
+        }
+    }
+    return NS_CONFIG;
+}
+
+static nvs_handle_t key_handle(const char *key)
+{
+    return s_handles[key_ns(key)];
+}
+
+static config_entry_t *cache_find(const char *key, nvs_type_t type)
+{
+    for (int i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+        if (s_cache[i].used && s_cache[i].type == type && strcmp(s_cache[i].key, key) == 0) {
+            return &s_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static void entry_clear(config_entry_t *e)
+{
+    free(e->value);
+    memset(e, 0, sizeof(*e));
+}
+
+/**
+ * @brief Forget every cached type of a key
+ */
+static void cache_drop(const char *key)
+{
+    for (int i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+        if (s_cache[i].used && strcmp(s_cache[i].key, key) == 0) {
+            entry_clear(&s_cache[i]);
+        }
+    }
+}
+
+static config_entry_t *cache_alloc(const char *key, nvs_type_t type)
+{
+    config_entry_t *e = NULL;
+    for (int i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+        if (!s_cache[i].used) {
+            e = &s_cache[i];
+            break;
+        }
+    }
+    if (e == NULL) {
+        // Table full: a miss may now be a key that is in flash only
+        e = &s_cache[s_evict];
+        s_evict = (s_evict + 1) % CONFIG_CACHE_ENTRIES;
+        entry_clear(e);
+        s_complete = false;
+    }
+
+    strlcpy(e->key, key, sizeof(e->key));
+    e->type = type;
+    e->used = true;
+    return e;
+}
+
+/**
+ * @brief Store a known value (copied when small enough)
+ */
+static void cache_store(const char *key, nvs_type_t type, const void *value, size_t len)
+{
+    config_entry_t *e = cache_alloc(key, type);
+    e->present = true;
+    e->len = len;
+    if (len <= CONFIG_CACHE_VALUE_MAX) {
+        e->value = malloc(len);
+        if (e->value != NULL) {
+            memcpy(e->value, value, len);
+        }
+    }
+}
+
+/**
+ * @brief Read a key from flash into the cache
+ */
+static esp_err_t cache_load(const char *key, nvs_type_t type, config_entry_t **out)
+{
+    nvs_handle_t handle = key_handle(key);
+    uint8_t small[CONFIG_CACHE_VALUE_MAX];
+    size_t len = 0;
+    esp_err_t err;
+
+    switch (type) {
+    case NVS_TYPE_U8:
+        len = 1;
+        err = nvs_get_u8(handle, key, small);
+        break;
+    case NVS_TYPE_STR:
+        err = nvs_get_str(handle, key, NULL, &len);
+        if (err == ESP_OK && len <= sizeof(small)) {
+            err = nvs_get_str(handle, key, (char *)small, &len);
+        }
+        break;
+    case NVS_TYPE_BLOB:
+        err = nvs_get_blob(handle, key, NULL, &len);
+        if (err == ESP_OK && len <= sizeof(small)) {
+            err = nvs_get_blob(handle, key, small, &len);
+        }
+        break;
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        config_entry_t *e = cache_alloc(key, type);
+        e->present = false;
+        *out = e;
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    config_entry_t *e = cache_alloc(key, type);
+    e->present = true;
+    e->len = len;
+    if (len <= sizeof(small)) {
+        e->value = malloc(len);
+        if (e->value != NULL) {
+            memcpy(e->value, small, len);
+        }
+    }
+    *out = e;
+    return ESP_OK;
+}
+
+static esp_err_t cached_read(const char *key, nvs_type_t type, void *value, size_t *len)
+{
+    if (s_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTakeRecursive(s_mutex, portMAX_DELAY);
+
+    esp_err_t err = ESP_OK;
+    config_entry_t *e = cache_find(key, type);
+    if (e == NULL) {
+        if (s_complete) {
+            err = ESP_ERR_NVS_NOT_FOUND;
+            goto done;
+        }
+        err = cache_load(key, type, &e);
+        if (err != ESP_OK) goto done;
+    }
+
+    if (!e->present) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (value == NULL) {
+        *len = e->len;
+    } else if (*len < e->len) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else if (e->value != NULL) {
+        memcpy(value, e->value, e->len);
+        *len = e->len;
+    } else if (type == NVS_TYPE_STR) {
+        err = nvs_get_str(key_handle(key), key, value, len);
+    } else {
+        err = nvs_get_blob(key_handle(key), key, value, len);
+    }
+
+done:
+    xSemaphoreGiveRecursive(s_mutex);
+    return err;
+}
+
+// nvs_commit() of the written namespaces inside a trace span
+static esp_err_t commit(void)
+{
+    esp_err_t err = ESP_OK;
+    TRACE_SPAN_BEGIN(TRACE_ID_NVS_COMMIT);
+    for (int ns = 0; ns < NS_COUNT; ns++) {
+        if (s_dirty & (1 << ns)) {
+            esp_err_t ns_err = nvs_commit(s_handles[ns]);
+            if (err == ESP_OK) {
+                err = ns_err;
+            }
+        }
+    }
+    s_dirty = 0;
+    TRACE_SPAN_END(TRACE_ID_NVS_COMMIT);
+    return err;
+}
+
+/**
+ * @brief Commit now, or leave it to the enclosing transaction
+ */
+static esp_err_t finish_write(esp_err_t err)
+{
+    if (s_depth > 0) {
+        if (s_txn_err == ESP_OK) {
+            s_txn_err = err;
+        }
+        return err;
+    }
+    if (err == ESP_OK) {
+        err = commit();
+    }
+    return err;
+}
+
+static esp_err_t cached_write(const char *key, nvs_type_t type, const void *value, size_t len)
+{
+    if (s_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTakeRecursive(s_mutex, portMAX_DELAY);
+
+    esp_err_t err;
+    config_entry_t *e = cache_find(key, type);
+    if (e != NULL && e->present && e->value != NULL && e->len == len && memcmp(e->value, value, len) == 0) {
+        // Unchanged: no flash write at all
+        err = ESP_OK;
+        goto done;
+    }
+
+    int ns = key_ns(key);
+    switch (type) {
+    case NVS_TYPE_U8:
+        err = nvs_set_u8(s_handles[ns], key, *(const uint8_t *)value);
+        break;
+    case NVS_TYPE_STR:
+        err = nvs_set_str(s_handles[ns], key, value);
+        break;
+    default:
+        err = nvs_set_blob(s_handles[ns], key, value, len);
+        break;
+    }
+    s_dirty |= 1 << ns;
+
+    cache_drop(key);
+    if (err == ESP_OK) {
+        cache_store(key, type, value, len);
+    } else {
+        ESP_LOGE(TAG, "Error saving %s: %s", key, esp_err_to_name(err));
+    }
+    err = finish_write(err);
+
+done:
+    xSemaphoreGiveRecursive(s_mutex);
+    return err;
+}
+
+/**
+ * @brief Copy one key between handles, whatever its type
+ */
+static esp_err_t copy_key(nvs_handle_t from, nvs_handle_t to, const nvs_entry_info_t *info)
+{
+    size_t len = 0;
+    esp_err_t err;
+
+    if (info->type == NVS_TYPE_U8) {
+        uint8_t v;
+        err = nvs_get_u8(from, info->key, &v);
+        return err == ESP_OK ? nvs_set_u8(to, info->key, v) : err;
+    }
+    if (info->type != NVS_TYPE_STR && info->type != NVS_TYPE_BLOB) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    bool str = info->type == NVS_TYPE_STR;
+    err = str ? nvs_get_str(from, info->key, NULL, &len) : nvs_get_blob(from, info->key, NULL, &len);
+    if (err != ESP_OK) {
+        return err;
+    }
+    void *buf = malloc(len);
+    if (buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    err = str ? nvs_get_str(from, info->key, buf, &len) : nvs_get_blob(from, info->key, buf, &len);
+    if (err == ESP_OK) {
+        err = str ? nvs_set_str(to, info->key, buf) : nvs_set_blob(to, info->key, buf, len);
+    }
+    free(buf);
+    return err;
+}
+
+/**
+ * @brief Move identity keys left in "device_config" by older firmware
+ *
+ * The copy is committed before the originals go, so a reset in between
+ * only repeats the move on the next boot.
+ */
+static void migrate_identity(void)
+{
+    char moved[16][NVS_KEY_NAME_MAX_SIZE];
+    int count = 0;
+    bool more = false;
+
+    nvs_iterator_t it = NULL;
+    esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, NVS_NAMESPACE, NVS_TYPE_ANY, &it);
+    while (res == ESP_OK) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        if (key_ns(info.key) == NS_IDENTITY) {
+            if (count == sizeof(moved) / sizeof(moved[0])) {
+                more = true;
+            } else if (copy_key(s_handles[NS_CONFIG], s_handles[NS_IDENTITY], &info) == ESP_OK) {
+                strlcpy(moved[count++], info.key, sizeof(moved[0]));
+            } else {
+                ESP_LOGW(TAG, "Could not move %s to the identity namespace", info.key);
+            }
+        }
+        res = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+
+    if (count == 0 || nvs_commit(s_handles[NS_IDENTITY]) != ESP_OK) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        nvs_erase_key(s_handles[NS_CONFIG], moved[i]);
+    }
+    nvs_commit(s_handles[NS_CONFIG]);
+    ESP_LOGI(TAG, "Moved %d identity keys to \"%s\"", count, NVS_NAMESPACE_IDENTITY);
+    if (more) {
+        migrate_identity();
+    }
+}
+
+esp_err_t device_config_init(void)
+{
+    if (s_mutex != NULL) {
+        return ESP_OK;
+    }
+
+    esp_err_t err = ESP_OK;
+    int opened = 0;
+    while (opened < NS_COUNT && err == ESP_OK) {
+        err = nvs_open(s_namespaces[opened], NVS_READWRITE, &s_handles[opened]);
+        if (err == ESP_OK) {
+            opened++;
+        }
+    }
+    if (err == ESP_OK) {
+        s_mutex = xSemaphoreCreateRecursiveMutex();
+        if (s_mutex == NULL) {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
+        while (opened > 0) {
+            nvs_close(s_handles[--opened]);
+        }
+        return err;
+    }
+
+    migrate_identity();
+
+    // One pass over each namespace replaces the per-key lookups at boot
+    int count = 0;
+    s_complete = true;
+    for (int ns = 0; ns < NS_COUNT; ns++) {
+        nvs_iterator_t it = NULL;
+        esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, s_namespaces[ns], NVS_TYPE_ANY, &it);
+        while (res == ESP_OK) {
+            nvs_entry_info_t info;
+            config_entry_t *e;
+            nvs_entry_info(it, &info);
+            if (key_ns(info.key) == ns && cache_load(info.key, info.type, &e) == ESP_OK) {
+                count++;
+            } else {
+                s_complete = false;
+            }
+            res = nvs_entry_next(&it);
+        }
+        nvs_release_iterator(it);
+        if (res != ESP_ERR_NVS_NOT_FOUND) {
+            s_complete = false;
+        }
+    }
+
+    ESP_LOGI(TAG, "Loaded %d keys%s", count, s_complete ? "" : " (partial cache)");
+    return ESP_OK;
+}
+
+esp_err_t device_config_get_str(const char *key, char *value, size_t *len)
+{
+    return cached_read(key, NVS_TYPE_STR, value, len);
+}
+
+esp_err_t device_config_get_blob(const char *key, void *value, size_t *len)
+{
+    return cached_read(key, NVS_TYPE_BLOB, value, len);
+}
+
+esp_err_t device_config_get_u8(const char *key, uint8_t *value)
+{
+    size_t len = sizeof(*value);
+    return cached_read(key, NVS_TYPE_U8, value, &len);
+}
+
+esp_err_t device_config_set_str(const char *key, const char *value)
+{
+    return cached_write(key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t device_config_set_blob(const char *key, const void *value, size_t len)
+{
+    return cached_write(key, NVS_TYPE_BLOB, value, len);
+}
+
+esp_err_t device_config_set_u8(const char *key, uint8_t value)
+{
+    return cached_write(key, NVS_TYPE_U8, &value, sizeof(value));
+}
+
+esp_err_t device_config_erase(const char *key)
+{
+    if (s_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTakeRecursive(s_mutex, portMAX_DELAY);
+
+    esp_err_t err = ESP_OK;
+    bool known = false;
+    for (int i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+        if (s_cache[i].used && s_cache[i].present && strcmp(s_cache[i].key, key) == 0) {
+            known = true;
+        }
+    }
+
+    // A complete cache knows the key is not in flash
+    if (known || !s_complete) {
+        int ns = key_ns(key);
+        err = nvs_erase_key(s_handles[ns], key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+        s_dirty |= 1 << ns;
+        cache_drop(key);
+        err = finish_write(err);
+    }
+
+    xSemaphoreGiveRecursive(s_mutex);
+    return err;
+}
+
+void device_config_begin(void)
+{
+    if (s_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTakeRecursive(s_mutex, portMAX_DELAY);
+    if (s_depth++ == 0) {
+        s_txn_err = ESP_OK;
+    }
+}
+
+esp_err_t device_config_commit(void)
+{
+    if (s_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = s_txn_err;
+    if (--s_depth == 0) {
+        esp_err_t commit_err = commit();
+        if (err == ESP_OK) {
+            err = commit_err;
+        }
+    }
+    xSemaphoreGiveRecursive(s_mutex);
+    return err;
+}
+
+esp_err_t device_config_erase_identity(void)
+{
+    if (s_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTakeRecursive(s_mutex, portMAX_DELAY);
+
+    esp_err_t err = nvs_erase_all(s_handles[NS_IDENTITY]);
+    s_dirty |= 1 << NS_IDENTITY;
+    for (int i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+        if (s_cache[i].used && key_ns(s_cache[i].key) == NS_IDENTITY) {
+            entry_clear(&s_cache[i]);
+        }
+    }
+    err = finish_write(err);
+
+    xSemaphoreGiveRecursive(s_mutex);
+    return err;
+}
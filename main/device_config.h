@@ -0,0 +1,106 @@
+/* Device Configuration Store Header
+ *
+ * Single owner of the "device_config" and "identity" NVS namespaces. Keeps
+ * their handles open for the lifetime of the application, caches small
+ * values in RAM and groups related writes into one transaction with a
+ * single commit.
+ *
+ * "identity" holds what the backend issued to the device: device ID,
+ * provisioning and bearer tokens, certificates and keys. It outlives a
+ * change of Wi-Fi network, which only touches "device_config", and goes
+ * with a factory reset or a new device ID. Keys are routed by name.
+ */
+
+#ifndef DEVICE_CONFIG_H
+#define DEVICE_CONFIG_H
+
+#include "esp_err.h"
+#include "nvs.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Open the namespace and load every small value into the cache
+ *
+ * Call once after nvs_flash_init(). Values larger than the cache limit
+ * are not loaded, but their size is, so size probes never touch flash.
+ *
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t device_config_init(void);
+
+/**
+ * @brief Read a string
+ *
+ * Same contract as nvs_get_str(): with value NULL only *len is set, and
+ * the length includes the NUL terminator.
+ *
+ * @return ESP_OK, ESP_ERR_NVS_NOT_FOUND, ESP_ERR_NVS_INVALID_LENGTH
+ */
+esp_err_t device_config_get_str(const char *key, char *value, size_t *len);
+
+/**
+ * @brief Read a blob, same contract as nvs_get_blob()
+ */
+esp_err_t device_config_get_blob(const char *key, void *value, size_t *len);
+
+/**
+ * @brief Read a uint8_t value
+ */
+esp_err_t device_config_get_u8(const char *key, uint8_t *value);
+
+/**
+ * @brief Write a string; unchanged values are not rewritten
+ *
+ * Outside a transaction the change is committed right away.
+ */
+esp_err_t device_config_set_str(const char *key, const char *value);
+
+/**
+ * @brief Write a blob; unchanged values are not rewritten
+ */
+esp_err_t device_config_set_blob(const char *key, const void *value, size_t len);
+
+/**
+ * @brief Write a uint8_t value; unchanged values are not rewritten
+ */
+esp_err_t device_config_set_u8(const char *key, uint8_t value);
+
+/**
+ * @brief Erase a key, missing keys are not an error
+ */
+esp_err_t device_config_erase(const char *key);
+
+/**
+ * @brief Erase every key of the "identity" namespace
+ *
+ * Part of the enclosing transaction, if any.
+ */
+esp_err_t device_config_erase_identity(void);
+
+/**
+ * @brief Start a transaction
+ *
+ * Blocks other tasks' reads and writes until device_config_commit(), so
+ * they see either none or all of the transaction's changes. Writes in the
+ * transaction share one nvs_commit(). Transactions may nest; the
+ * outermost commit is the one that reaches flash.
+ */
+void device_config_begin(void);
+
+/**
+ * @brief Commit and end the transaction started by device_config_begin()
+ *
+ * @return First error seen by a write in the transaction, or the commit result
+ */
+esp_err_t device_config_commit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEVICE_CONFIG_H
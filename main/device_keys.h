@@ -48,21 +48,28 @@
 
 // Certificate Signing Request (CSR) - for device_0070
 // This will be submitted to the backend for signing
-#define DEVICE_CSR_PEM \
-    "-----BEGIN CERTIFICATE REQUEST-----\n" \
-    "MIICWzCCAUMCAQAwFjEUMBIGA1UEAwwLZGV2aWNlXzAwNzAwggEiMA0GCSqGSIb3\n" \
-    "DQEBAQUAA4IBDwAwggEKAoIBAQCvai7foAdfiX6WhZ3l0BX1o78NeTKs5No+c9uA\n" \
-    "gH8tZHUAXYQX/NPVeJJhROmmFz73KUIF8frUjbY/2ZL8K9ifwd/mt9B9JtpsBmkE\n" \
-    "YlwmUGlYJR1LNbd+MmzRKvEmSxQsPIoUtcqQe+oDvAlLkoTqXfJeYSzvoRY/TlGo\n" \
-    "OAaQfEYDiLn4Qplzvof/8/vgTLf+cFETToIpt/vrn+e/XdbLiO//AHGNJzXOGp4g\n" \
-    "WcToMG+MkBYukhT8iWemMBRfPcGHVKarpXHp5NkrTKHrsq1IatXZ+VY5XxCStSvE\n" \
-    "A2wHKlVnHChTbIM4LwHpPQ+P+zCpWTk9mPuFLMMMaCBdw0U7AgMBAAGgADANBgkq\n" \
-    "hkiG9w0BAQsFAAOCAQEAGbE0ErYkwV8kQl9DjAcwqXOJFRm33yy3mRuToeqKzz19\n" \
-    "E8WKCh/Wh0Y9XcxlQEqFs2l5Akt8vOwsiFhimxID9iLP9ZzIw37fqHwdnvQ+7Tti\n" \
-    "LbBARf3rMsCKk2jmzt5xOZ+Uw82KtltwN156O8DYnd/dOvbLpfmV3A2qcJPO0UTe\n" \
-    "5CHycQnU8P6e62CITMkZsxrOdSGIMHw7O3kGJt3HY1daglfuL/Kh57bd7PYswvmt\n" \
-    "s1dRYlauOQ9ihbfYVt8Q7/zNMfu3VaX2xDsDYx+z+p67z1AxTYD7/Rd8qpACkupK\n" \
-    "YxpRKDOk2M5F3dPYXt/nAw7rxpFvVO4jGjnV8nPOpg==\n" \
-    "-----END CERTIFICATE REQUEST-----\n"
+#define DEVICE_CSR_LINES(LINE) \
+    LINE("-----BEGIN CERTIFICATE REQUEST-----") \
+    LINE("MIICWzCCAUMCAQAwFjEUMBIGA1UEAwwLZGV2aWNlXzAwNzAwggEiMA0GCSqGSIb3") \
+    LINE("DQEBAQUAA4IBDwAwggEKAoIBAQCvai7foAdfiX6WhZ3l0BX1o78NeTKs5No+c9uA") \
+    LINE("gH8tZHUAXYQX/NPVeJJhROmmFz73KUIF8frUjbY/2ZL8K9ifwd/mt9B9JtpsBmkE") \
+    LINE("YlwmUGlYJR1LNbd+MmzRKvEmSxQsPIoUtcqQe+oDvAlLkoTqXfJeYSzvoRY/TlGo") \
+    LINE("OAaQfEYDiLn4Qplzvof/8/vgTLf+cFETToIpt/vrn+e/XdbLiO//AHGNJzXOGp4g") \
+    LINE("WcToMG+MkBYukhT8iWemMBRfPcGHVKarpXHp5NkrTKHrsq1IatXZ+VY5XxCStSvE") \
+    LINE("A2wHKlVnHChTbIM4LwHpPQ+P+zCpWTk9mPuFLMMMaCBdw0U7AgMBAAGgADANBgkq") \
+    LINE("hkiG9w0BAQsFAAOCAQEAGbE0ErYkwV8kQl9DjAcwqXOJFRm33yy3mRuToeqKzz19") \
+    LINE("E8WKCh/Wh0Y9XcxlQEqFs2l5Akt8vOwsiFhimxID9iLP9ZzIw37fqHwdnvQ+7Tti") \
+    LINE("LbBARf3rMsCKk2jmzt5xOZ+Uw82KtltwN156O8DYnd/dOvbLpfmV3A2qcJPO0UTe") \
+    LINE("5CHycQnU8P6e62CITMkZsxrOdSGIMHw7O3kGJt3HY1daglfuL/Kh57bd7PYswvmt") \
+    LINE("s1dRYlauOQ9ihbfYVt8Q7/zNMfu3VaX2xDsDYx+z+p67z1AxTYD7/Rd8qpACkupK") \
+    LINE("YxpRKDOk2M5F3dPYXt/nAw7rxpFvVO4jGjnV8nPOpg==") \
+    LINE("-----END CERTIFICATE REQUEST-----")
+
+// The CSR as a C string, and pre-escaped for a JSON string value: PEM is
+// base64 and dashes, so each line break is the only character to escape
+#define DEVICE_CSR_PEM_LINE(text) text "\n"
+#define DEVICE_CSR_JSON_LINE(text) text "\\n"
+#define DEVICE_CSR_PEM DEVICE_CSR_LINES(DEVICE_CSR_PEM_LINE)
+#define DEVICE_CSR_JSON DEVICE_CSR_LINES(DEVICE_CSR_JSON_LINE)
 
 #endif // DEVICE_KEYS_H
@@ -0,0 +1,121 @@
+/* Diagnostic Log Implementation
+ *
+ * Byte ring of '\n'-terminated lines prefixed with the uptime in ms. Only
+ * the copy into the ring runs in the critical section; formatting happens
+ * on the caller's stack beforehand.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "diag_log.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#if CONFIG_APP_DIAG_RING_SIZE > 0
+
+static const char *TAG = "diag";
+
+#define DIAG_RING_SIZE CONFIG_APP_DIAG_RING_SIZE
+#define DIAG_LINE_MAX  96
+
+static char s_ring[DIAG_RING_SIZE];
+static size_t s_head = 0;           // Next write position
+static bool s_wrapped = false;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void diag_log_record(const char *fmt, ...)
+{
+    char line[DIAG_LINE_MAX];
+    int n = snprintf(line, sizeof(line), "%lu ", (unsigned long)(esp_timer_get_time() / 1000));
+
+    va_list args;
+    va_start(args, fmt);
+    int m = vsnprintf(line + n, sizeof(line) - n, fmt, args);
+    va_end(args);
+
+    size_t len = n + ((m < 0) ? 0 : (size_t)m);
+    if (len > sizeof(line) - 2) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+
+    // A ring shorter than the line keeps its tail
+    const char *src = line;
+    if (len > DIAG_RING_SIZE) {
+        src += len - DIAG_RING_SIZE;
+        len = DIAG_RING_SIZE;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    size_t first = DIAG_RING_SIZE - s_head;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(s_ring + s_head, src, first);
+    memcpy(s_ring, src + first, len - first);
+    if (s_head + len >= DIAG_RING_SIZE) {
+        s_wrapped = true;
+    }
+    s_head = (s_head + len) % DIAG_RING_SIZE;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+size_t diag_log_read(char *out, size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+    // Oldest first: the span from the head to the end, then the one before it
+    portENTER_CRITICAL(&s_lock);
+    size_t start = s_wrapped ? s_head : 0;
+    size_t len = s_wrapped ? DIAG_RING_SIZE : s_head;
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    size_t first = DIAG_RING_SIZE - start;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(out, s_ring + start, first);
+    memcpy(out + first, s_ring, len - first);
+    portEXIT_CRITICAL(&s_lock);
+    out[len] = '\0';
+
+    // After a wrap the oldest line is partial; start at the next full one
+    if (s_wrapped) {
+        char *nl = memchr(out, '\n', len);
+        if (nl != NULL) {
+            size_t skip = nl + 1 - out;
+            memmove(out, nl + 1, len - skip + 1);
+            len -= skip;
+        }
+    }
+    return len;
+}
+
+void diag_log_dump(void)
+{
+    static char buf[DIAG_RING_SIZE + 1];
+    size_t len = diag_log_read(buf, sizeof(buf));
+
+    ESP_LOGI(TAG, "---- diagnostic ring (%d bytes) ----", len);
+    char *line = buf;
+    while (line < buf + len) {
+        char *nl = strchr(line, '\n');
+        if (nl) {
+            *nl = '\0';
+        }
+        ESP_LOGI(TAG, "%s", line);
+        if (!nl) {
+            break;
+        }
+        line = nl + 1;
+    }
+    ESP_LOGI(TAG, "---- end of diagnostic ring ----");
+}
+
+#endif // CONFIG_APP_DIAG_RING_SIZE > 0
@@ -0,0 +1,53 @@
+/* Diagnostic Log Header
+ *
+ * Compact in-RAM trace of recent events for builds that compile the verbose
+ * banner logging out (CONFIG_APP_DIAG_VERBOSE=n). Records are one short
+ * line each and never touch the UART until dumped.
+ */
+
+#ifndef DIAG_LOG_H
+#define DIAG_LOG_H
+
+#include "sdkconfig.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if CONFIG_APP_DIAG_RING_SIZE > 0
+
+/**
+ * @brief Append a line to the ring, overwriting the oldest entries
+ *
+ * printf-style; lines are truncated to 96 bytes. Safe from any task.
+ */
+void diag_log_record(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief Copy the ring, oldest line first
+ *
+ * @param out Destination buffer
+ * @param size Size of out
+ * @return Number of bytes written (out is NUL-terminated)
+ */
+size_t diag_log_read(char *out, size_t size);
+
+/**
+ * @brief Print the ring to the console
+ */
+void diag_log_dump(void);
+
+#else
+
+#define diag_log_record(fmt, ...) do { } while (0)
+static inline size_t diag_log_read(char *out, size_t size) { if (size) out[0] = '\0'; return 0; }
+static inline void diag_log_dump(void) { }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DIAG_LOG_H
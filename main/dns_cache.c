@@ -0,0 +1,359 @@
+/* DNS Cache Implementation
+ *
+ * lwIP runs the external-resolve hook in the calling task before its own
+ * resolver. A hit answers there; a miss or a stale entry falls through or
+ * is served as is, and the name is queued for the refresh task, whose own
+ * lookups bypass the hook. That second lookup usually comes straight from
+ * lwIP's DNS table, which the first one just filled.
+ *
+ * lwIP does not pass record TTLs up to getaddrinfo(), so entries expire
+ * after the fixed CONFIG_APP_DNS_CACHE_TTL_S. Ages are kept in wall-clock
+ * seconds to stay meaningful across power cycles; an entry resolved
+ * before SNTP set the clock has no age and is refreshed on first use.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "dns_cache.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_DNS_CACHE
+
+#include "device_config.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "lwip/dns.h"
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/netdb.h"
+
+static const char *TAG = "dns_cache";
+
+#define NVS_KEY "dns_cache"
+#define CACHE_MAGIC 0x444e5331          // "DNS1"
+#define QUEUE_LEN 4
+#define CLOCK_VALID_AFTER 1700000000    // Earlier wall-clock times: SNTP has not run yet
+
+typedef struct {
+    char host[DNS_CACHE_HOST_MAX];      // Empty: free slot
+    uint32_t addr;                      // IPv4, network byte order
+    uint32_t resolved_at;               // Wall-clock seconds, 0: unknown
+    uint32_t used;                      // LRU stamp
+} entry_t;
+
+typedef struct {
+    uint32_t magic;
+    entry_t entries[DNS_CACHE_ENTRIES];
+    uint32_t crc;
+} cache_image_t;
+
+// Survives every reset but power loss; NVS holds the same image for that
+RTC_NOINIT_ATTR static cache_image_t s_rtc;
+
+static entry_t s_entries[DNS_CACHE_ENTRIES];
+static bool s_pending[DNS_CACHE_ENTRIES];   // Refresh queued, per slot
+static uint32_t s_use_clock = 0;
+static bool s_nvs_dirty = false;            // The address set differs from NVS
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t s_queue = NULL;
+static TaskHandle_t s_task = NULL;
+
+static uint32_t now_s(void)
+{
+    time_t now = time(NULL);
+    return now >= CLOCK_VALID_AFTER ? (uint32_t)now : 0;
+}
+
+static uint32_t image_crc(const cache_image_t *img)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)img->entries, sizeof(img->entries));
+}
+
+static bool image_valid(const cache_image_t *img)
+{
+    if (img->magic != CACHE_MAGIC || img->crc != image_crc(img)) {
+        return false;
+    }
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+        if (memchr(img->entries[i].host, '\0', DNS_CACHE_HOST_MAX) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Snapshot the entries into an image; caller holds s_lock
+ */
+static void image_fill_locked(cache_image_t *img)
+{
+    img->magic = CACHE_MAGIC;
+    memcpy(img->entries, s_entries, sizeof(s_entries));
+    img->crc = image_crc(img);
+}
+
+static int find_locked(const char *host)
+{
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+        if (s_entries[i].host[0] != '\0' && strcmp(s_entries[i].host, host) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Slot for a new host: a free one, otherwise the least recently used
+ */
+static int victim_locked(void)
+{
+    int best = 0;
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+        if (s_entries[i].host[0] == '\0') {
+            return i;
+        }
+        if (s_entries[i].used < s_entries[best].used) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Write the cache to NVS if its address set changed; refresh task only
+ */
+static void persist(void)
+{
+    cache_image_t img;
+    portENTER_CRITICAL(&s_lock);
+    bool dirty = s_nvs_dirty;
+    s_nvs_dirty = false;
+    if (dirty) {
+        image_fill_locked(&img);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    if (!dirty) {
+        return;
+    }
+    esp_err_t err = device_config_set_blob(NVS_KEY, &img, sizeof(img));
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Saving cache failed: %s", esp_err_to_name(err));
+        portENTER_CRITICAL(&s_lock);
+        s_nvs_dirty = true;
+        portEXIT_CRITICAL(&s_lock);
+    }
+}
+
+static void refresh(const char *host)
+{
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(host, NULL, &hints, &res);
+    uint32_t addr = 0;
+    if (err == 0 && res != NULL) {
+        addr = ((const struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    }
+    if (res != NULL) {
+        freeaddrinfo(res);
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    int i = find_locked(host);
+    if (i >= 0) {
+        s_pending[i] = false;
+    }
+    if (addr != 0) {
+        if (i < 0) {
+            i = victim_locked();
+            strlcpy(s_entries[i].host, host, DNS_CACHE_HOST_MAX);
+            s_entries[i].addr = 0;
+            s_entries[i].used = ++s_use_clock;
+            s_pending[i] = false;
+        }
+        if (s_entries[i].addr != addr) {
+            s_entries[i].addr = addr;
+            s_nvs_dirty = true;
+        }
+        s_entries[i].resolved_at = now_s();
+        image_fill_locked(&s_rtc);
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (addr == 0) {
+        // The stale address, if any, beats no address at all
+        ESP_LOGW(TAG, "Refreshing %s failed: %d", host, err);
+    } else {
+        char text[IP4ADDR_STRLEN_MAX];
+        ESP_LOGD(TAG, "%s is %s", host, ip4addr_ntoa_r((const ip4_addr_t *)&addr, text, sizeof(text)));
+    }
+}
+
+static void dns_cache_task(void *arg)
+{
+    char host[DNS_CACHE_HOST_MAX];
+    for (;;) {
+        if (xQueueReceive(s_queue, host, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        refresh(host);
+        persist();
+    }
+}
+
+/**
+ * @brief Queue a lookup; never blocks, a full queue is retried on the next use
+ */
+static void queue_refresh(const char *host)
+{
+    char name[DNS_CACHE_HOST_MAX];
+    strlcpy(name, host, sizeof(name));
+    if (xQueueSend(s_queue, name, 0) != pdTRUE) {
+        portENTER_CRITICAL(&s_lock);
+        int i = find_locked(name);
+        if (i >= 0) {
+            s_pending[i] = false;
+        }
+        portEXIT_CRITICAL(&s_lock);
+    }
+}
+
+int lwip_hook_netconn_external_resolve(const char *name, ip_addr_t *addr, u8_t addrtype, err_t *err)
+{
+    ip4_addr_t literal;
+    if (s_task == NULL || xTaskGetCurrentTaskHandle() == s_task || addrtype == LWIP_DNS_ADDRTYPE_IPV6 ||
+        name == NULL || strlen(name) >= DNS_CACHE_HOST_MAX || ip4addr_aton(name, &literal)) {
+        return 0;
+    }
+
+    uint32_t now = now_s();
+    bool queue = false;
+    uint32_t cached = 0;
+    portENTER_CRITICAL(&s_lock);
+    int i = find_locked(name);
+    if (i < 0) {
+        queue = true;
+    } else {
+        entry_t *e = &s_entries[i];
+        cached = e->addr;
+        e->used = ++s_use_clock;
+        bool stale = e->resolved_at == 0 || now == 0 || now - e->resolved_at >= CONFIG_APP_DNS_CACHE_TTL_S;
+        if (stale && !s_pending[i]) {
+            s_pending[i] = true;
+            queue = true;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (queue) {
+        queue_refresh(name);
+    }
+    if (cached == 0) {
+        return 0;
+    }
+    ip_addr_set_ip4_u32(addr, cached);
+    *err = ERR_OK;
+    return 1;
+}
+
+void dns_cache_invalidate(const char *host)
+{
+    if (host == NULL || s_task == NULL) {
+        return;
+    }
+    const char *start = strstr(host, "://");
+    start = start ? start + 3 : host;
+    size_t len = strcspn(start, ":/");
+    if (len == 0 || len >= DNS_CACHE_HOST_MAX) {
+        return;
+    }
+    char name[DNS_CACHE_HOST_MAX];
+    memcpy(name, start, len);
+    name[len] = '\0';
+
+    portENTER_CRITICAL(&s_lock);
+    int i = find_locked(name);
+    if (i >= 0) {
+        memset(&s_entries[i], 0, sizeof(s_entries[i]));
+        s_pending[i] = false;
+        s_nvs_dirty = true;
+        image_fill_locked(&s_rtc);
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    // Resolve afresh; the refresh task also writes the removal to NVS
+    if (i >= 0) {
+        ESP_LOGI(TAG, "Dropped cached address of %s", name);
+        queue_refresh(name);
+    }
+}
+
+esp_err_t dns_cache_init(void)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+
+    const char *source = "RTC memory";
+    if (!image_valid(&s_rtc)) {
+        size_t len = sizeof(s_rtc);
+        if (device_config_get_blob(NVS_KEY, &s_rtc, &len) != ESP_OK || len != sizeof(s_rtc) ||
+            !image_valid(&s_rtc)) {
+            memset(&s_rtc, 0, sizeof(s_rtc));
+            image_fill_locked(&s_rtc);
+        }
+        source = "NVS";
+    }
+    memcpy(s_entries, s_rtc.entries, sizeof(s_entries));
+    int count = 0;
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+        if (s_entries[i].host[0] != '\0') {
+            count++;
+        }
+        if (s_entries[i].used > s_use_clock) {
+            s_use_clock = s_entries[i].used;
+        }
+    }
+
+    s_queue = xQueueCreate(QUEUE_LEN, DNS_CACHE_HOST_MAX);
+    if (s_queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(dns_cache_task, "dns_cache", 3072, NULL, tskIDLE_PRIORITY + 1, &s_task) != pdPASS) {
+        vQueueDelete(s_queue);
+        s_queue = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "%d cached host(s) from %s", count, count > 0 ? source : "nowhere");
+    return ESP_OK;
+}
+
+#else // CONFIG_APP_DNS_CACHE
+
+esp_err_t dns_cache_init(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void dns_cache_invalidate(const char *host)
+{
+}
+
+#if CONFIG_LWIP_HOOK_NETCONN_EXT_RESOLVE_CUSTOM
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+
+// The hook is linked in whenever lwIP is configured for it
+int lwip_hook_netconn_external_resolve(const char *name, ip_addr_t *addr, u8_t addrtype, err_t *err)
+{
+    return 0;
+}
+#endif
+
+#endif // CONFIG_APP_DNS_CACHE
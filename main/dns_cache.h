@@ -0,0 +1,49 @@
+/* DNS Cache Header
+ *
+ * Persistent cache of the IPv4 addresses of the hosts this device talks
+ * to (broker, backend, probe). It sits in front of lwIP's resolver through
+ * the netconn external-resolve hook, so getaddrinfo() from esp-tls,
+ * esp_http_client and our own code answers from the cache without a DNS
+ * round trip. An entry older than CONFIG_APP_DNS_CACHE_TTL_S is still
+ * served, and refreshed by a background task for the next lookup.
+ *
+ * Entries survive resets in RTC memory and power cycles in NVS; NVS is
+ * written only when an address changes. Names are cached the first time
+ * they are resolved normally.
+ */
+
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DNS_CACHE_ENTRIES 4
+#define DNS_CACHE_HOST_MAX 48           // Including the terminator; longer names are not cached
+
+/**
+ * @brief Load the cache and start the refresh task
+ *
+ * Call once after device_config_init(). Until then lookups go straight to
+ * lwIP.
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM, or ESP_ERR_NOT_SUPPORTED when
+ *         CONFIG_APP_DNS_CACHE is disabled
+ */
+esp_err_t dns_cache_init(void);
+
+/**
+ * @brief Drop the entry for a host, e.g. after its cached address failed
+ *
+ * @param host Host name, or a URI (scheme://host[:port][/path])
+ */
+void dns_cache_invalidate(const char *host);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DNS_CACHE_H
@@ -0,0 +1,302 @@
+/* Duty Cycle Implementation
+ *
+ * Everything that must outlive a deep sleep is in one RTC_DATA_ATTR
+ * struct. RTC data is loaded from the image on every boot except a wake
+ * from deep sleep, so after any other reset it is back to zero; the magic
+ * only guards against an image with a different layout.
+ *
+ * The period is kept from wake to wake: each sleep is the period minus the
+ * time this wake has been running. Time spent in the ROM and the
+ * bootloader before the application starts is not counted, so the real
+ * cadence is a few tens of milliseconds longer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "duty_cycle.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_DUTY_CYCLE
+
+#include "app_events.h"
+#include "log_defer.h"
+#include "mqtt_handler.h"
+#include "mqtt_tls_transport.h"
+#include "time_sync.h"
+#include "wifi_conn.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+
+static const char *TAG = "duty_cycle";
+
+#define RTC_MAGIC           0x44435931      // "DCY1"
+#define SESSION_MAX         1024            // Serialized TLS session, without the peer certificate
+#define BACKOFF_MAX         16              // Periods between report attempts, at most
+#define MIN_SLEEP_US        100000LL
+#define BLOCK_SAMPLES       CONFIG_APP_DUTY_REPORT_SAMPLES
+
+typedef struct {
+    uint32_t magic;
+    uint32_t cycles;
+    uint32_t reports;
+    uint32_t report_failed;
+    uint32_t dropped;
+    uint32_t last_awake_ms;
+    uint32_t last_radio_ms;
+    uint32_t radio_cycles;              // Reporting wakes, acknowledged or not
+    uint64_t radio_ms;                  // Totals since the last full boot
+    uint64_t awake_ms;
+    uint64_t sleep_ms;
+    uint8_t backoff;                    // Periods between attempts after a failed report
+    uint8_t skip;                       // Wakes still to pass before the next attempt
+    uint16_t session_len;               // 0: no session saved
+    uint8_t session[SESSION_MAX];
+    ts_block_t block;
+} rtc_state_t;
+
+RTC_DATA_ATTR static rtc_state_t s_rtc;
+
+static const duty_cycle_series_t *s_series = NULL;
+static int s_count = 0;
+static bool s_reporting = false;        // This wake takes the connection path
+static bool s_published = false;
+static bool s_forced = false;
+static int64_t s_radio_on_us = 0;
+static esp_timer_handle_t s_deadline = NULL;
+static uint8_t s_out[TS_BLOCK_ENCODED_MAX(DUTY_CYCLE_MAX_SERIES, BLOCK_SAMPLES)];
+
+static void deadline_cb(void *arg)
+{
+    app_events_post(APP_EVENT_SLEEP);
+}
+
+static esp_err_t block_init(void)
+{
+    ts_block_enc_t enc[DUTY_CYCLE_MAX_SERIES];
+    for (int i = 0; i < s_count; i++) {
+        enc[i] = s_series[i].enc;
+    }
+    return ts_block_init(&s_rtc.block, (uint8_t)s_count, BLOCK_SAMPLES, enc);
+}
+
+static void take_sample(void)
+{
+    ts_block_t *b = &s_rtc.block;
+    if (ts_block_full(b)) {
+        s_rtc.dropped++;
+        return;
+    }
+
+    // One kind of timestamp per block; the system clock runs on through deep sleep
+    uint8_t flags = time_sync_valid() ? TS_BLOCK_FLAG_UTC : 0;
+    if (flags != b->flags) {
+        s_rtc.dropped += b->samples;
+        ts_block_reset(b);
+        b->flags = flags;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    uint32_t values[DUTY_CYCLE_MAX_SERIES];
+    for (int i = 0; i < s_count; i++) {
+        int32_t v;
+        if (!s_series[i].read(s_series[i].ctx, &v)) {
+            // Unavailable this time: repeat the previous value, which costs one bit
+            v = b->samples > 0 ? (int32_t)b->v[i][b->samples - 1] : 0;
+        }
+        values[i] = (uint32_t)v;
+    }
+    ts_block_add(b, (uint32_t)tv.tv_sec, values);
+}
+
+esp_err_t duty_cycle_boot(const duty_cycle_series_t *series, int count)
+{
+    if (series == NULL || count < 1 || count > DUTY_CYCLE_MAX_SERIES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_series = series;
+    s_count = count;
+
+    bool wake = (esp_reset_reason() == ESP_RST_DEEPSLEEP && s_rtc.magic == RTC_MAGIC &&
+                 s_rtc.block.series == count);
+    if (!wake) {
+        memset(&s_rtc, 0, sizeof(s_rtc));
+        esp_err_t err = block_init();
+        if (err != ESP_OK) {
+            return err;
+        }
+        s_rtc.magic = RTC_MAGIC;
+    }
+    s_rtc.cycles++;
+    take_sample();
+
+    if (!wake) {
+        // Provisioning or a CSR may take a while: no deadline, report once connected
+        ESP_LOGI(TAG, "Full boot, reporting every %d wakes of %d s", BLOCK_SAMPLES, CONFIG_APP_DUTY_PERIOD_S);
+        s_reporting = true;
+        return ESP_OK;
+    }
+    if (!s_forced && !ts_block_full(&s_rtc.block)) {
+        duty_cycle_sleep(false);
+    }
+    if (!s_forced && s_rtc.skip > 0) {
+        s_rtc.skip--;
+        duty_cycle_sleep(false);
+    }
+
+    if (s_rtc.session_len > 0) {
+        mqtt_tls_transport_import_session(s_rtc.session, s_rtc.session_len);
+    }
+    ESP_LOGI(TAG, "Wake %lu: reporting %d samples", (unsigned long)s_rtc.cycles, s_rtc.block.samples);
+    s_reporting = true;
+
+    const esp_timer_create_args_t args = {
+        .callback = deadline_cb,
+        .name = "duty_deadline",
+    };
+    esp_err_t err = esp_timer_create(&args, &s_deadline);
+    if (err == ESP_OK) {
+        err = esp_timer_start_once(s_deadline, (uint64_t)CONFIG_APP_DUTY_REPORT_TIMEOUT_S * 1000000);
+    }
+    return err;
+}
+
+void duty_cycle_force_report(void)
+{
+    s_forced = true;
+}
+
+void duty_cycle_radio_on(void)
+{
+    if (s_radio_on_us == 0) {
+        s_radio_on_us = esp_timer_get_time();
+    }
+}
+
+esp_err_t duty_cycle_publish(const char *topic)
+{
+    if (!s_reporting || s_published) {
+        return ESP_OK;
+    }
+    if (s_rtc.block.samples == 0) {
+        s_published = true;
+        return ESP_OK;
+    }
+
+    size_t len;
+    esp_err_t err = ts_block_encode(&s_rtc.block, s_out, sizeof(s_out), &len);
+    if (err != ESP_OK) {
+        return err;
+    }
+    char full_topic[96];
+    int n = snprintf(full_topic, sizeof(full_topic), "%s" DUTY_CYCLE_TOPIC_SUFFIX, topic);
+    if (n < 0 || n >= (int)sizeof(full_topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    err = mqtt_handler_publish(full_topic, (const char *)s_out, (int)len, 1);
+    if (err != ESP_OK) {
+        return err;
+    }
+    s_published = true;
+    ESP_LOGI(TAG, "Published %d samples in %u bytes", s_rtc.block.samples, (unsigned)len);
+
+    // Counters as of the previous wake; a lost one is superseded by the next report
+    duty_cycle_stats_t stats;
+    uint8_t rec[TELEMETRY_DUTY_STATS_BIN_MAX];
+    duty_cycle_get_stats(&stats);
+    len = telemetry_duty_stats_encode(&stats, rec);
+    n = snprintf(full_topic, sizeof(full_topic), "%s" DUTY_CYCLE_STATS_TOPIC_SUFFIX, topic);
+    if (n < 0 || n >= (int)sizeof(full_topic) ||
+        mqtt_handler_publish(full_topic, (const char *)rec, (int)len, 1) != ESP_OK) {
+        ESP_LOGW(TAG, "Cycle counters not published");
+    }
+    return ESP_OK;
+}
+
+bool duty_cycle_flushed(void)
+{
+    if (!s_published) {
+        return false;
+    }
+    mqtt_handler_stats_t stats;
+    mqtt_handler_get_stats(&stats);
+    return stats.inflight == 0 && stats.outbox_size == 0 && stats.spooled == 0;
+}
+
+void duty_cycle_sleep(bool reported)
+{
+    if (s_deadline != NULL) {
+        esp_timer_stop(s_deadline);
+    }
+
+    if (s_reporting) {
+        if (reported) {
+            ts_block_reset(&s_rtc.block);
+            s_rtc.reports++;
+            s_rtc.backoff = 0;
+            s_rtc.skip = 0;
+        } else {
+            s_rtc.report_failed++;
+            s_rtc.backoff = s_rtc.backoff == 0 ? 1 : s_rtc.backoff * 2;
+            if (s_rtc.backoff > BACKOFF_MAX) {
+                s_rtc.backoff = BACKOFF_MAX;
+            }
+            s_rtc.skip = s_rtc.backoff - 1;
+            ESP_LOGW(TAG, "Report not acknowledged, next attempt in %d wakes", s_rtc.backoff);
+        }
+        size_t len = 0;
+        if (mqtt_tls_transport_export_session(s_rtc.session, sizeof(s_rtc.session), &len) != ESP_OK) {
+            len = 0;
+        }
+        s_rtc.session_len = (uint16_t)len;
+    }
+
+    if (s_radio_on_us != 0) {
+        // DISCONNECT first, so the broker does not wait out the keepalive and fire the will
+        mqtt_handler_stop();
+        wifi_conn_stop();
+        esp_wifi_stop();
+        uint32_t radio_ms = (uint32_t)((esp_timer_get_time() - s_radio_on_us) / 1000);
+        s_rtc.last_radio_ms = radio_ms;
+        s_rtc.radio_ms += radio_ms;
+        s_rtc.radio_cycles++;
+        ESP_LOGI(TAG, "Radio on %lu ms, average %lu ms over %lu reports", (unsigned long)radio_ms,
+                 (unsigned long)(s_rtc.radio_ms / s_rtc.radio_cycles), (unsigned long)s_rtc.radio_cycles);
+    }
+
+    int64_t awake_us = esp_timer_get_time();
+    int64_t sleep_us = (int64_t)CONFIG_APP_DUTY_PERIOD_S * 1000000 - awake_us;
+    if (sleep_us < MIN_SLEEP_US) {
+        sleep_us = MIN_SLEEP_US;
+    }
+    s_rtc.last_awake_ms = (uint32_t)(awake_us / 1000);
+    s_rtc.awake_ms += s_rtc.last_awake_ms;
+    s_rtc.sleep_ms += (uint64_t)(sleep_us / 1000);
+
+    ESP_LOGI(TAG, "Wake %lu took %lu ms, sleeping %lld ms", (unsigned long)s_rtc.cycles,
+             (unsigned long)s_rtc.last_awake_ms, sleep_us / 1000);
+    log_defer_flush(100);
+    esp_deep_sleep((uint64_t)sleep_us);
+}
+
+void duty_cycle_get_stats(duty_cycle_stats_t *stats)
+{
+    uint64_t total_ms = s_rtc.awake_ms + s_rtc.sleep_ms;
+    *stats = (duty_cycle_stats_t){
+        .cycles = s_rtc.cycles,
+        .reports = s_rtc.reports,
+        .report_failed = s_rtc.report_failed,
+        .dropped = s_rtc.dropped,
+        .last_awake_ms = s_rtc.last_awake_ms,
+        .last_radio_ms = s_rtc.last_radio_ms,
+        .radio_avg_ms = s_rtc.radio_cycles > 0 ? (uint32_t)(s_rtc.radio_ms / s_rtc.radio_cycles) : 0,
+        .awake_permille = total_ms > 0 ? (uint32_t)(s_rtc.awake_ms * 1000 / total_ms) : 0,
+    };
+}
+
+#endif // CONFIG_APP_DUTY_CYCLE
@@ -0,0 +1,130 @@
+/* Duty Cycle Header
+ *
+ * Battery operation: the device spends most of its time in deep sleep and
+ * wakes on a timer every CONFIG_APP_DUTY_PERIOD_S. Each wake reads the
+ * registered series once into a time-series block kept in RTC memory,
+ * which survives deep sleep, and goes straight back to sleep without
+ * starting the radio. The wake that fills the block takes the normal
+ * connection path instead (warm boot to the cached AP, TLS session resumed
+ * from RTC memory, persistent MQTT session), publishes the block at QoS 1
+ * on <topic>/duty/ts, waits until the broker has acknowledged everything
+ * in the outbox and sleeps again. The cycle counters go along as a
+ * duty_stats record (telemetry_schema.h) on <topic>/duty/stats.
+ *
+ * A reporting wake that does not get there within
+ * CONFIG_APP_DUTY_REPORT_TIMEOUT_S keeps the block and sleeps anyway; the
+ * next attempts are spaced out, doubling up to 16 periods, and the samples
+ * of the wakes in between are dropped and counted.
+ *
+ * Radio-on time, from the WiFi start to the sleep, is measured on every
+ * reporting wake and kept with the other cycle counters in RTC memory.
+ * Any other reset (power-on, restart, OTA) starts over with an empty block
+ * and a full boot that reports once the broker is reached.
+ *
+ * Built only with CONFIG_APP_DUTY_CYCLE.
+ */
+
+#ifndef DUTY_CYCLE_H
+#define DUTY_CYCLE_H
+
+#include "esp_err.h"
+#include "sampler.h"
+#include "telemetry.h"
+#include "ts_block.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Appended to the topic passed to duty_cycle_publish()
+#define DUTY_CYCLE_TOPIC_SUFFIX "/duty" TS_BLOCK_TOPIC_SUFFIX
+#define DUTY_CYCLE_STATS_TOPIC_SUFFIX "/duty/stats"
+
+#define DUTY_CYCLE_MAX_SERIES   8
+#define DUTY_CYCLE_POLL_MS      50      // Acknowledgement check interval while reporting
+
+/**
+ * @brief One value read on every wake
+ */
+typedef struct {
+    sampler_read_t read;            // Called once per wake, before the network exists
+    void *ctx;
+    ts_block_enc_t enc;
+} duty_cycle_series_t;
+
+/**
+ * @brief Cycle counters, kept through deep sleep
+ *
+ * The fields are declared with the duty_stats record in telemetry_schema.h.
+ */
+typedef telemetry_duty_stats_t duty_cycle_stats_t;
+
+/**
+ * @brief Take this wake's sample and decide whether it reports
+ *
+ * Call once in app_main(), after time_sync_init() and before NVS and the
+ * network are brought up. Does not return on a wake that only samples.
+ *
+ * @param series Array of count series, must stay valid
+ * @param count 1 to DUTY_CYCLE_MAX_SERIES; changing it discards the block
+ * @return ESP_OK when the boot continues to report, ESP_ERR_INVALID_ARG,
+ *         or an esp_timer error (the wake still reports, without a deadline)
+ */
+esp_err_t duty_cycle_boot(const duty_cycle_series_t *series, int count);
+
+/**
+ * @brief Make the coming duty_cycle_boot() report whatever the block holds
+ *
+ * For alarms seen before the boot decision, e.g. raised by the ULP. Also
+ * overrides the spacing after failed reports.
+ */
+void duty_cycle_force_report(void);
+
+/**
+ * @brief Note that the WiFi radio is being started
+ *
+ * Starts the radio-on measurement; later calls in the same wake are
+ * ignored.
+ */
+void duty_cycle_radio_on(void);
+
+/**
+ * @brief Publish the block and the cycle counters at QoS 1, once per wake
+ *
+ * The block is kept until duty_cycle_sleep(true), so a report that is not
+ * acknowledged is sent again on the next reporting wake.
+ *
+ * @param topic Base topic, DUTY_CYCLE_TOPIC_SUFFIX is appended
+ * @return ESP_OK (also when already published or empty), or the publish error
+ */
+esp_err_t duty_cycle_publish(const char *topic);
+
+/**
+ * @brief True once the block is published and nothing is left unacknowledged
+ *
+ * Counts the whole outbox and the flash spool, not only the block.
+ */
+bool duty_cycle_flushed(void);
+
+/**
+ * @brief Power the radio down and deep-sleep until the next period
+ *
+ * Saves the TLS session and the counters to RTC memory first. Call from
+ * the state machine task.
+ *
+ * @param reported The block was acknowledged and may be discarded
+ */
+void duty_cycle_sleep(bool reported) __attribute__((noreturn));
+
+/**
+ * @brief Snapshot of the cycle counters
+ */
+void duty_cycle_get_stats(duty_cycle_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DUTY_CYCLE_H
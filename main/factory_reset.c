@@ -0,0 +1,113 @@
+/* Factory Reset Implementation
+ *
+ * The button is timed between its edges in the GPIO interrupt, so nothing
+ * polls it and light sleep is not held off. Contact bounce only restarts
+ * the measurement; a release shorter than the hold time is ignored.
+ */
+
+#include <stdio.h>
+#include "factory_reset.h"
+#include "app_events.h"
+#include "json_view.h"
+#include "mqtt_handler.h"
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "factory_reset";
+
+#define RESET_GPIO      CONFIG_APP_FACTORY_RESET_GPIO
+#define RESET_HOLD_US   ((int64_t)CONFIG_APP_FACTORY_RESET_HOLD_S * 1000000)
+#define CMD_TOKENS      16
+
+#if RESET_GPIO >= 0
+static volatile int64_t s_pressed_us = 0;   // 0 while released
+
+static void button_isr(void *arg)
+{
+    int64_t now = esp_timer_get_time();
+    if (gpio_get_level(RESET_GPIO) == 0) {
+        s_pressed_us = now;
+    } else if (s_pressed_us != 0) {
+        if (now - s_pressed_us >= RESET_HOLD_US) {
+            app_events_post_from_isr(APP_EVENT_FACTORY_RESET);
+        }
+        s_pressed_us = 0;
+    }
+}
+#endif
+
+esp_err_t factory_reset_init(void)
+{
+#if RESET_GPIO >= 0
+    const gpio_config_t io = {
+        .pin_bit_mask = 1ULL << RESET_GPIO,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .intr_type = GPIO_INTR_ANYEDGE,
+    };
+    esp_err_t err = gpio_config(&io);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        return err;
+    }
+    err = gpio_isr_handler_add(RESET_GPIO, button_isr, NULL);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Hold GPIO %d for %d s to factory reset", RESET_GPIO, CONFIG_APP_FACTORY_RESET_HOLD_S);
+    }
+    return err;
+#else
+    return ESP_OK;
+#endif
+}
+
+#if CONFIG_APP_FACTORY_RESET_REMOTE
+static esp_err_t cmd_message(const mqtt_handler_msg_t *msg, void *ctx)
+{
+    // Commands are a few bytes; one chunk is all json_view can index
+    if (msg->offset != 0 || msg->len != msg->total_len) {
+        ESP_LOGW(TAG, "Command of %d bytes ignored", msg->total_len);
+        return ESP_FAIL;
+    }
+    json_view_tok_t toks[CMD_TOKENS];
+    json_view_t view;
+    if (json_view_parse(&view, msg->data, msg->len, toks, CMD_TOKENS) != ESP_OK) {
+        ESP_LOGW(TAG, "Malformed command ignored");
+        return ESP_OK;
+    }
+    int action = json_view_get(&view, 0, "action");
+    if (action >= 0 && json_view_str_eq(&view, action, "factory_reset")) {
+        ESP_LOGW(TAG, "Factory reset requested over MQTT");
+        app_events_post(APP_EVENT_FACTORY_RESET);
+    } else {
+        ESP_LOGW(TAG, "Unknown command ignored");
+    }
+    return ESP_OK;
+}
+#endif
+
+esp_err_t factory_reset_start_remote(const char *device_id)
+{
+#if CONFIG_APP_FACTORY_RESET_REMOTE
+    static bool started = false;
+    if (started) {
+        return ESP_OK;
+    }
+    char topic[80];
+    int n = snprintf(topic, sizeof(topic), "cmd/%s", device_id);
+    if (n < 0 || (size_t)n >= sizeof(topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = mqtt_handler_subscribe(topic, 1, cmd_message, NULL);
+    if (err == ESP_OK) {
+        started = true;
+    }
+    return err;
+#else
+    return ESP_OK;
+#endif
+}
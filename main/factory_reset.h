@@ -0,0 +1,46 @@
+/* Factory Reset Header
+ *
+ * Two triggers for returning a deployed device to its unprovisioned state:
+ * holding the button on CONFIG_APP_FACTORY_RESET_GPIO (active low) for
+ * CONFIG_APP_FACTORY_RESET_HOLD_S and releasing it, and, with
+ * CONFIG_APP_FACTORY_RESET_REMOTE, the message {"action":"factory_reset"}
+ * on "cmd/<device_id>". Both only post APP_EVENT_FACTORY_RESET; the state
+ * machine erases the stored data and restarts.
+ *
+ * The command must not be published retained: a device reprovisioned
+ * under the same ID would receive it again on its first connect.
+ */
+
+#ifndef FACTORY_RESET_H
+#define FACTORY_RESET_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Configure the reset button; a no-op when the GPIO is -1
+ *
+ * Call once after app_events_init().
+ *
+ * @return ESP_OK or a GPIO driver error
+ */
+esp_err_t factory_reset_init(void);
+
+/**
+ * @brief Subscribe to "cmd/<device_id>"
+ *
+ * May be called before MQTT connects. Later calls are no-ops, as is every
+ * call without CONFIG_APP_FACTORY_RESET_REMOTE.
+ *
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t factory_reset_start_remote(const char *device_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FACTORY_RESET_H
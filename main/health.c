@@ -0,0 +1,182 @@
+/* System Health Collector Implementation
+ *
+ * Runs on the esp_timer task. Loads are per mille of one core: a task's
+ * run-time delta over the elapsed run-time clock, and a core is busy for
+ * the share its idle task did not get. Tasks are matched to the previous
+ * sample by handle; a new one is measured from its creation, as its
+ * counter starts at zero.
+ */
+
+#include <string.h>
+#include "health.h"
+
+#if CONFIG_APP_HEALTH
+
+#include "mqtt_handler.h"
+#include "telemetry.h"
+#include "wifi_conn.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mbedtls/base64.h"
+#if CONFIG_LWIP_STATS
+#include "lwip/stats.h"
+#endif
+
+static const char *TAG = "health";
+
+#define MAX_TASKS       32
+#define HEALTH_CORES    portNUM_PROCESSORS
+#define B64_LEN(n)      (4 * (((n) + 2) / 3) + 1)
+#define REC_MAX         TELEMETRY_HEALTH_BIN_MAX
+
+_Static_assert((int)TELEMETRY_HEALTH_TASK_BIN_MAX <= (int)REC_MAX, "one buffer for both records");
+
+typedef struct {
+    TaskHandle_t handle;
+    uint32_t runtime;
+} prev_t;
+
+static TaskStatus_t s_status[MAX_TASKS];
+static prev_t s_prev[MAX_TASKS];
+static int s_prev_count = 0;
+static uint32_t s_prev_total = 0;
+static uint32_t s_cost_us = 0;
+static esp_timer_handle_t s_timer = NULL;
+
+static uint32_t prev_runtime(TaskHandle_t handle)
+{
+    for (int i = 0; i < s_prev_count; i++) {
+        if (s_prev[i].handle == handle) {
+            return s_prev[i].runtime;
+        }
+    }
+    return 0;
+}
+
+static uint16_t permille(uint32_t part, uint32_t whole)
+{
+    if (whole == 0) {
+        return 0;
+    }
+    uint64_t v = (uint64_t)part * 1000 / whole;
+    return v > 1000 ? 1000 : (uint16_t)v;
+}
+
+static void emit(const uint8_t *rec, size_t len)
+{
+    char line[B64_LEN(REC_MAX)];
+    size_t n;
+    if (mbedtls_base64_encode((unsigned char *)line, sizeof(line), &n, rec, len) == 0) {
+        mqtt_handler_batch_add(CONFIG_APP_HEALTH_TOPIC, line, (int)n, 0);
+    }
+}
+
+static void lwip_usage(telemetry_health_t *rec)
+{
+#if CONFIG_LWIP_STATS
+    rec->socks = lwip_stats.memp[MEMP_NETCONN]->used;
+    rec->tcp = lwip_stats.memp[MEMP_TCP_PCB]->used;
+    rec->pbufs = lwip_stats.memp[MEMP_PBUF]->used;
+#endif
+}
+
+static void sample_cb(void *arg)
+{
+    int64_t start_us = esp_timer_get_time();
+
+    uint32_t total;
+    UBaseType_t count = uxTaskGetSystemState(s_status, MAX_TASKS, &total);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %d tasks, sample skipped", MAX_TASKS);
+        return;
+    }
+    uint32_t elapsed = total - s_prev_total;
+
+    telemetry_health_t rec = {
+        .t = (uint32_t)(start_us / 1000000),
+        .heap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+        .heap_min = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+        .heap_big = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL),
+        .dma = heap_caps_get_free_size(MALLOC_CAP_DMA),
+        .psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM),
+        .reconnects = wifi_conn_reconnects(),
+        .tasks = (uint8_t)count,
+        .cost_us = s_cost_us > UINT16_MAX ? UINT16_MAX : (uint16_t)s_cost_us,
+    };
+    uint16_t *busy[] = { &rec.cpu0, &rec.cpu1 };
+    for (int core = 0; core < HEALTH_CORES && core < 2; core++) {
+        TaskHandle_t idle = xTaskGetIdleTaskHandleForCore(core);
+        for (UBaseType_t i = 0; i < count; i++) {
+            if (s_status[i].xHandle == idle) {
+                *busy[core] = 1000 - permille(s_status[i].ulRunTimeCounter - prev_runtime(idle), elapsed);
+                break;
+            }
+        }
+    }
+    int rssi;
+    if (esp_wifi_sta_get_rssi(&rssi) == ESP_OK) {
+        rec.rssi = rssi;
+        wifi_phy_mode_t phy;
+        if (esp_wifi_sta_get_negotiated_phymode(&phy) == ESP_OK) {
+            rec.phy = (uint8_t)phy;
+        }
+    }
+    lwip_usage(&rec);
+    mqtt_handler_stats_t mqtt;
+    mqtt_handler_get_stats(&mqtt);
+    rec.outbox = mqtt.outbox_size > 0 ? (uint32_t)mqtt.outbox_size : 0;
+    rec.inflight = mqtt.inflight;
+
+    uint8_t bin[REC_MAX];
+    emit(bin, telemetry_health_encode(&rec, bin));
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        const TaskStatus_t *st = &s_status[i];
+        const telemetry_health_task_t task = {
+            .name = st->pcTaskName,
+            .core = st->xCoreID < HEALTH_CORES ? (uint8_t)st->xCoreID : UINT8_MAX,
+            .prio = (uint8_t)st->uxCurrentPriority,
+            .cpu = permille(st->ulRunTimeCounter - prev_runtime(st->xHandle), elapsed),
+            // The high-water mark is in bytes on ESP-IDF (StackType_t is uint8_t)
+            .stack = st->usStackHighWaterMark,
+        };
+        emit(bin, telemetry_health_task_encode(&task, bin));
+    }
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        s_prev[i] = (prev_t){ s_status[i].xHandle, s_status[i].ulRunTimeCounter };
+    }
+    s_prev_count = count;
+    s_prev_total = total;
+    s_cost_us = (uint32_t)(esp_timer_get_time() - start_us);
+}
+
+esp_err_t health_start(void)
+{
+    if (s_timer != NULL) {
+        return ESP_OK;
+    }
+    const esp_timer_create_args_t args = {
+        .callback = sample_cb,
+        .name = "health",
+        .skip_unhandled_events = true,
+    };
+    esp_err_t err = esp_timer_create(&args, &s_timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = esp_timer_start_periodic(s_timer, (uint64_t)CONFIG_APP_HEALTH_PERIOD_S * 1000000);
+    if (err != ESP_OK) {
+        esp_timer_delete(s_timer);
+        s_timer = NULL;
+        return err;
+    }
+    ESP_LOGI(TAG, "Sampling every %d s on %s", CONFIG_APP_HEALTH_PERIOD_S, CONFIG_APP_HEALTH_TOPIC);
+    return ESP_OK;
+}
+
+#endif // CONFIG_APP_HEALTH
@@ -0,0 +1,46 @@
+/* System Health Collector Header
+ *
+ * Every CONFIG_APP_HEALTH_PERIOD_S a timer takes one "health" record
+ * (core load, heap per capability, Wi-Fi, LwIP pools, MQTT outbox) and
+ * one "health_task" record per task (CPU share, stack headroom), laid out
+ * as in telemetry_schema.h. The records are binary; each is base64 on its
+ * own line of the CONFIG_APP_HEALTH_TOPIC batch, so the newline-framed
+ * batcher carries them unchanged.
+ *
+ * Counters are read where they are kept: the FreeRTOS run-time counters
+ * through uxTaskGetSystemState(), without the text formatting of
+ * vTaskGetRunTimeStats, and loads are differences from the previous
+ * sample. The time a sample took is in the next one (cost_us); a few
+ * hundred microseconds every ten seconds is a few hundredths of a percent
+ * of one core. Built only with CONFIG_APP_HEALTH.
+ */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if CONFIG_APP_HEALTH
+
+/**
+ * @brief Start sampling every CONFIG_APP_HEALTH_PERIOD_S
+ *
+ * Records taken before MQTT is up wait in the batch. Repeated calls are
+ * no-ops.
+ *
+ * @return ESP_OK or an esp_timer error
+ */
+esp_err_t health_start(void);
+
+#endif // CONFIG_APP_HEALTH
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HEALTH_H
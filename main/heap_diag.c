@@ -0,0 +1,288 @@
+/* Heap Diagnostics Implementation
+ *
+ * State snapshots are taken by the state machine task and connect snapshots
+ * by the MQTT client task; readers take an unlocked snapshot like the rest
+ * of the metrics. heap_trace is started and stopped only from the MQTT
+ * task, at connect boundaries, so the traced window is one whole session:
+ * TLS handshake, traffic and teardown.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "heap_diag.h"
+#include "metrics.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_HEAP_DIAG
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#if CONFIG_APP_HEAP_DIAG_TRACE
+#include "esp_heap_trace.h"
+#endif
+
+static const char *TAG = "heap_diag";
+
+static const uint32_t s_caps[] = {
+    MALLOC_CAP_INTERNAL,
+    MALLOC_CAP_DMA,
+#if CONFIG_SPIRAM
+    MALLOC_CAP_SPIRAM,
+#endif
+};
+static const char *const s_cap_names[] = {"internal", "dma", "psram"};
+
+#define CAP_COUNT (sizeof(s_caps) / sizeof(s_caps[0]))
+
+typedef struct {
+    uint32_t free;
+    uint32_t largest;
+} heap_diag_cap_t;
+
+typedef struct {
+    heap_diag_cap_t cap[CAP_COUNT];
+} heap_diag_snap_t;
+
+typedef struct {
+    uint32_t visits;
+    heap_diag_snap_t in;        // Entry of the last visit
+    heap_diag_snap_t out;       // Exit of the last visit (zero while in it)
+} heap_diag_state_t;
+
+static heap_diag_state_t s_states[METRICS_MAX_STATES];
+
+static uint32_t s_connects = 0;             // Attempts started
+static uint32_t s_connected = 0;            // Attempts accepted by the broker
+static bool s_connect_open = false;
+static heap_diag_snap_t s_first;            // After the first accepted attempt
+static heap_diag_snap_t s_before;           // Last attempt
+static heap_diag_snap_t s_after;
+static uint32_t s_min_largest[CAP_COUNT];   // Lowest largest block after any attempt
+
+#if CONFIG_APP_HEAP_DIAG_TRACE
+typedef enum {
+    TRACE_ARMED,
+    TRACE_RUNNING,
+    TRACE_DONE,
+    TRACE_FAILED,
+} trace_state_t;
+
+static const char *const s_trace_names[] = {"armed", "running", "done", "failed"};
+
+static heap_trace_record_t s_trace_records[CONFIG_APP_HEAP_DIAG_TRACE_RECORDS];
+static trace_state_t s_trace = TRACE_ARMED;
+static uint32_t s_trace_allocs = 0;         // Still held when the window closed
+static uint32_t s_trace_bytes = 0;
+static bool s_trace_overflow = false;
+#endif
+
+static void snapshot(heap_diag_snap_t *snap)
+{
+    for (size_t i = 0; i < CAP_COUNT; i++) {
+        snap->cap[i].free = heap_caps_get_free_size(s_caps[i]);
+        snap->cap[i].largest = heap_caps_get_largest_free_block(s_caps[i]);
+    }
+}
+
+void heap_diag_state_change(int from, int to)
+{
+    heap_diag_snap_t now;
+    snapshot(&now);
+    if (from >= 0 && from < METRICS_MAX_STATES) {
+        s_states[from].out = now;
+    }
+    if (to >= 0 && to < METRICS_MAX_STATES) {
+        s_states[to].visits++;
+        s_states[to].in = now;
+        memset(&s_states[to].out, 0, sizeof(s_states[to].out));
+    }
+}
+
+#if CONFIG_APP_HEAP_DIAG_TRACE
+static void trace_start(void)
+{
+    esp_err_t err = heap_trace_init_standalone(s_trace_records, CONFIG_APP_HEAP_DIAG_TRACE_RECORDS);
+    if (err == ESP_OK) {
+        err = heap_trace_start(HEAP_TRACE_LEAKS);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot start heap trace: %s", esp_err_to_name(err));
+        s_trace = TRACE_FAILED;
+        return;
+    }
+    ESP_LOGI(TAG, "Tracing allocations until the next connect");
+    s_trace = TRACE_RUNNING;
+}
+
+/**
+ * @brief Close the window; what the session left allocated is still recorded
+ */
+static void trace_stop(void)
+{
+    heap_trace_stop();
+    s_trace = TRACE_DONE;
+
+    heap_trace_summary_t summary;
+    if (heap_trace_summary(&summary) == ESP_OK) {
+        s_trace_overflow = summary.has_overflowed;
+    }
+    size_t count = heap_trace_get_count();
+    s_trace_allocs = count;
+    s_trace_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        heap_trace_record_t rec;
+        if (heap_trace_get(i, &rec) == ESP_OK) {
+            s_trace_bytes += rec.size;
+        }
+    }
+    ESP_LOGW(TAG, "Session left %lu allocations (%lu bytes)%s",
+             (unsigned long)s_trace_allocs, (unsigned long)s_trace_bytes,
+             s_trace_overflow ? ", record buffer overflowed" : "");
+    heap_trace_dump();
+}
+#endif // CONFIG_APP_HEAP_DIAG_TRACE
+
+void heap_diag_connect_begin(void)
+{
+    s_connects++;
+#if CONFIG_APP_HEAP_DIAG_TRACE
+    // Before the snapshot, so the window closes on a torn-down session
+    if (s_trace == TRACE_RUNNING) {
+        trace_stop();
+    }
+#endif
+    snapshot(&s_before);
+    s_connect_open = true;
+#if CONFIG_APP_HEAP_DIAG_TRACE
+    if (s_trace == TRACE_ARMED && s_connects == CONFIG_APP_HEAP_DIAG_TRACE_RECONNECT) {
+        trace_start();
+    }
+#endif
+}
+
+void heap_diag_connect_end(bool connected)
+{
+    if (!s_connect_open) {
+        return;
+    }
+    s_connect_open = false;
+    snapshot(&s_after);
+    for (size_t i = 0; i < CAP_COUNT; i++) {
+        if (s_min_largest[i] == 0 || s_after.cap[i].largest < s_min_largest[i]) {
+            s_min_largest[i] = s_after.cap[i].largest;
+        }
+    }
+    if (!connected) {
+        return;
+    }
+    if (s_connected++ == 0) {
+        s_first = s_after;
+    }
+    const heap_diag_cap_t *internal = &s_after.cap[0];
+    ESP_LOGI(TAG, "Connect %lu: internal free %lu (%+ld since first), largest %lu (%+ld), handshake used %ld",
+             (unsigned long)s_connected, (unsigned long)internal->free,
+             (long)internal->free - (long)s_first.cap[0].free, (unsigned long)internal->largest,
+             (long)internal->largest - (long)s_first.cap[0].largest,
+             (long)s_before.cap[0].free - (long)internal->free);
+}
+
+/**
+ * @brief Append [[free,largest],...] for every capability
+ */
+static int snap_json(char *buf, size_t size, const heap_diag_snap_t *snap)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < CAP_COUNT; i++) {
+        int n = snprintf(buf + pos, size - pos, "%s[%lu,%lu]", i ? "," : "[",
+                         (unsigned long)snap->cap[i].free, (unsigned long)snap->cap[i].largest);
+        if (n < 0 || (size_t)n >= size - pos) {
+            return -1;
+        }
+        pos += n;
+    }
+    int n = snprintf(buf + pos, size - pos, "]");
+    return (n < 0 || (size_t)n >= size - pos) ? -1 : (int)(pos + n);
+}
+
+size_t heap_diag_to_json(char *buf, size_t size, const char *const *names, int count)
+{
+    size_t pos = 0;
+    int n;
+
+#define APPEND(...) do { \
+        n = snprintf(buf + pos, size - pos, __VA_ARGS__); \
+        if (n < 0 || (size_t)n >= size - pos) return 0; \
+        pos += n; \
+    } while (0)
+#define APPEND_SNAP(snap) do { \
+        n = snap_json(buf + pos, size - pos, (snap)); \
+        if (n < 0) return 0; \
+        pos += n; \
+    } while (0)
+
+    APPEND(",\"heap_diag\":{\"caps\":[");
+    for (size_t i = 0; i < CAP_COUNT; i++) {
+        APPEND("%s\"%s\"", i ? "," : "", s_cap_names[i]);
+    }
+    APPEND("],\"states\":{");
+    bool first = true;
+    for (int i = 0; i < count && i < METRICS_MAX_STATES; i++) {
+        if (s_states[i].visits == 0) {
+            continue;
+        }
+        APPEND("%s\"%s\":{\"visits\":%lu,\"in\":", first ? "" : ",", names ? names[i] : "?",
+               (unsigned long)s_states[i].visits);
+        APPEND_SNAP(&s_states[i].in);
+        APPEND(",\"out\":");
+        APPEND_SNAP(&s_states[i].out);
+        APPEND("}");
+        first = false;
+    }
+    APPEND("},\"connects\":{\"attempts\":%lu,\"ok\":%lu,\"first\":",
+           (unsigned long)s_connects, (unsigned long)s_connected);
+    APPEND_SNAP(&s_first);
+    APPEND(",\"before\":");
+    APPEND_SNAP(&s_before);
+    APPEND(",\"after\":");
+    APPEND_SNAP(&s_after);
+    APPEND(",\"min_largest\":[");
+    for (size_t i = 0; i < CAP_COUNT; i++) {
+        APPEND("%s%lu", i ? "," : "", (unsigned long)s_min_largest[i]);
+    }
+    APPEND("]}");
+#if CONFIG_APP_HEAP_DIAG_TRACE
+    APPEND(",\"trace\":{\"state\":\"%s\",\"connect\":%d,\"allocs\":%lu,\"bytes\":%lu,\"overflow\":%s}",
+           s_trace_names[s_trace], CONFIG_APP_HEAP_DIAG_TRACE_RECONNECT,
+           (unsigned long)s_trace_allocs, (unsigned long)s_trace_bytes,
+           s_trace_overflow ? "true" : "false");
+#endif
+    APPEND("}");
+
+#undef APPEND_SNAP
+#undef APPEND
+    return pos;
+}
+
+void heap_diag_to_cbor(cbor_writer_t *w)
+{
+    // Internal heap only, to fit the periodic publish:
+    // [attempts, ok, first free, first largest, after free, after largest, min largest,
+    //  trace allocs, trace bytes]
+    cbor_put_array(w, 9);
+    cbor_put_uint(w, s_connects);
+    cbor_put_uint(w, s_connected);
+    cbor_put_uint(w, s_first.cap[0].free);
+    cbor_put_uint(w, s_first.cap[0].largest);
+    cbor_put_uint(w, s_after.cap[0].free);
+    cbor_put_uint(w, s_after.cap[0].largest);
+    cbor_put_uint(w, s_min_largest[0]);
+#if CONFIG_APP_HEAP_DIAG_TRACE
+    cbor_put_uint(w, s_trace_allocs);
+    cbor_put_uint(w, s_trace_bytes);
+#else
+    cbor_put_uint(w, 0);
+    cbor_put_uint(w, 0);
+#endif
+}
+
+#endif // CONFIG_APP_HEAP_DIAG
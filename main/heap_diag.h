@@ -0,0 +1,68 @@
+/* Heap Diagnostics Header
+ *
+ * Follows heap fragmentation across the application lifecycle: free size
+ * and largest free block per capability (internal, DMA, and PSRAM when
+ * present) are recorded on entering and leaving every application state
+ * and around every MQTT connect. A state whose visits keep ending with less
+ * free memory, or a largest block that shrinks from one reconnect to the
+ * next while the free size holds, points at the leak or the fragmentation
+ * that eventually fails a TLS allocation.
+ *
+ * With CONFIG_APP_HEAP_DIAG_TRACE, heap_trace runs in leak mode over one
+ * full MQTT session (from connect number CONFIG_APP_HEAP_DIAG_TRACE_RECONNECT
+ * to the next one); the allocations still held at the end are dumped to
+ * the console and summarised in the metrics.
+ *
+ * Reported under "heap_diag" in GET /metrics and "hd" in the CBOR metrics.
+ */
+
+#ifndef HEAP_DIAG_H
+#define HEAP_DIAG_H
+
+#include "cbor_writer.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Record a state transition: exit snapshot for from, entry for to
+ *
+ * @param from Previous state, or -1 at the first transition
+ * @param to New state
+ */
+void heap_diag_state_change(int from, int to);
+
+/**
+ * @brief Snapshot before an MQTT connect attempt (MQTT_EVENT_BEFORE_CONNECT)
+ */
+void heap_diag_connect_begin(void);
+
+/**
+ * @brief Snapshot once the attempt started by heap_diag_connect_begin() ends
+ *
+ * @param connected Whether the broker accepted the connection
+ */
+void heap_diag_connect_end(bool connected);
+
+/**
+ * @brief Append the report as a JSON member (,"heap_diag":{...}) to buf
+ *
+ * @param names State names (index = state value), as given to metrics
+ * @param count Number of names
+ * @return Length written (excluding NUL), or 0 if buf was too small
+ */
+size_t heap_diag_to_json(char *buf, size_t size, const char *const *names, int count);
+
+/**
+ * @brief Encode the internal-heap connect summary as a CBOR array
+ */
+void heap_diag_to_cbor(cbor_writer_t *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HEAP_DIAG_H
@@ -0,0 +1,106 @@
+/* HTTP Response Buffer Implementation
+ *
+ * Linear-time accumulation: the append offset is tracked, never recomputed
+ * with strlen(). Capacity doubles when the body leaves the arena.
+ */
+
+#include <string.h>
+#include "http_response.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+static const char *TAG = "http_resp";
+
+#if CONFIG_SPIRAM
+#define HTTP_RESPONSE_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define HTTP_RESPONSE_CAPS (MALLOC_CAP_DEFAULT)
+#endif
+
+void http_response_init(http_response_t *resp, char *arena, size_t arena_size, size_t max_len)
+{
+    memset(resp, 0, sizeof(*resp));
+    resp->arena = arena;
+    resp->arena_size = arena_size;
+    resp->max_len = max_len ? max_len : arena_size - 1;
+    resp->data = arena;
+    resp->cap = arena_size;
+    resp->data[0] = '\0';
+}
+
+static esp_err_t grow(http_response_t *resp, size_t needed)
+{
+    size_t cap = resp->cap;
+    while (cap < needed) {
+        cap *= 2;
+    }
+    if (cap > resp->max_len + 1) {
+        cap = resp->max_len + 1;
+    }
+
+    char *grown;
+    if (resp->data == resp->arena) {
+        grown = heap_caps_malloc(cap, HTTP_RESPONSE_CAPS);
+        if (grown != NULL) {
+            memcpy(grown, resp->data, resp->len + 1);
+        }
+    } else {
+        grown = heap_caps_realloc(resp->data, cap, HTTP_RESPONSE_CAPS);
+    }
+    if (grown == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    resp->data = grown;
+    resp->cap = cap;
+    return ESP_OK;
+}
+
+esp_err_t http_response_append(http_response_t *resp, const void *data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+    size_t keep = len;
+
+    if (resp->len + keep > resp->max_len) {
+        keep = resp->max_len - resp->len;
+    }
+
+    if (resp->len + keep + 1 > resp->cap) {
+        err = grow(resp, resp->len + keep + 1);
+        if (err != ESP_OK) {
+            keep = resp->cap - 1 - resp->len;
+        }
+    }
+
+    memcpy(resp->data + resp->len, data, keep);
+    resp->len += keep;
+    resp->data[resp->len] = '\0';
+
+    if (keep < len) {
+        if (resp->dropped == 0) {
+            ESP_LOGD(TAG, "Response body truncated at %d bytes", resp->len);
+        }
+        resp->dropped += len - keep;
+    }
+    return err;
+}
+
+esp_err_t http_response_on_event(http_response_t *resp, const esp_http_client_event_t *evt)
+{
+    if (evt->event_id != HTTP_EVENT_ON_DATA || evt->data_len <= 0) {
+        return ESP_OK;
+    }
+    return http_response_append(resp, evt->data, evt->data_len);
+}
+
+void http_response_reset(http_response_t *resp)
+{
+    if (resp->data != resp->arena) {
+        heap_caps_free(resp->data);
+    }
+    resp->data = resp->arena;
+    resp->cap = resp->arena_size;
+    resp->len = 0;
+    resp->dropped = 0;
+    resp->data[0] = '\0';
+}
@@ -0,0 +1,74 @@
+/* HTTP Response Buffer Header
+ *
+ * Accumulates an esp_http_client response body with a tracked length.
+ * Starts in a caller-provided arena and only moves to the heap when the
+ * body outgrows it.
+ */
+
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Response body buffer
+ *
+ * data is always NUL-terminated. Bytes beyond max_len are counted in
+ * dropped instead of being silently lost.
+ */
+typedef struct {
+    char *data;         // Body bytes (arena or heap)
+    size_t len;         // Bytes stored
+    size_t cap;         // Capacity of data, including the terminator
+    size_t max_len;     // Upper bound for len, 0 = arena size only
+    size_t dropped;     // Bytes discarded because max_len was reached
+    char *arena;        // Caller-provided initial storage
+    size_t arena_size;
+} http_response_t;
+
+/**
+ * @brief Prepare a response buffer
+ *
+ * @param resp Buffer to initialize
+ * @param arena Initial storage, typically a static array (must outlive resp)
+ * @param arena_size Size of arena in bytes (at least 1)
+ * @param max_len Maximum body length kept; 0 limits the body to the arena
+ */
+void http_response_init(http_response_t *resp, char *arena, size_t arena_size, size_t max_len);
+
+/**
+ * @brief Append body bytes
+ *
+ * Grows into the heap (PSRAM when available) once the arena is full.
+ *
+ * @return ESP_OK, or ESP_ERR_NO_MEM if growing failed (data is dropped)
+ */
+esp_err_t http_response_append(http_response_t *resp, const void *data, size_t len);
+
+/**
+ * @brief Forward HTTP_EVENT_ON_DATA to the buffer
+ *
+ * Call from an esp_http_client event handler. Works for both chunked and
+ * Content-Length responses; other events are ignored.
+ */
+esp_err_t http_response_on_event(http_response_t *resp, const esp_http_client_event_t *evt);
+
+/**
+ * @brief Empty the buffer and return to the arena
+ *
+ * Frees any heap storage, so it also serves as the release function.
+ */
+void http_response_reset(http_response_t *resp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HTTP_RESPONSE_H
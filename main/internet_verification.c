@@ -1,163 +1,221 @@
 /* Internet Verification Implementation
  *
- * Verifies internet connectivity by making an HTTPS request to a test endpoint.
+ * Verifies internet connectivity with a lightweight probe selected in
+ * menuconfig: a DNS lookup of the MQTT broker, a TCP connect to the broker
+ * port, or a plain HTTP request to a 204 endpoint. None of them negotiate
+ * TLS, so a check costs one or two round trips instead of a full handshake.
  * This confirms that the provisioning flow is 100% complete.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "internet_verification.h"
+#include "remote_config.h"
 #include "esp_log.h"
-#include "esp_http_client.h"
-#include "esp_tls.h"
+#include "esp_timer.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#if CONFIG_INET_PROBE_HTTP204
+#include "backend_client.h"
+#endif
 
 static const char *TAG = "inet_verify";
 
-// Test endpoint URL
-#define TEST_ENDPOINT_URL "https://mqtt-test-puf8.onrender.com/api/"
-
-// Buffer for HTTP response
-static char *s_response_buffer = NULL;
-static size_t s_response_len = 0;
+#define PROBE_TIMEOUT_MS CONFIG_INET_PROBE_TIMEOUT_MS
+#define BROKER_HOST_MAX_LEN 128
 
 /**
- * @brief HTTP event handler for internet verification
+ * @brief Split the configured broker URI into host and port
+ *
+ * The URI is scheme://host[:port][/path]; the port defaults to the
+ * scheme's standard one.
  */
-static esp_err_t http_event_handler(esp_http_client_event_t *evt)
+static esp_err_t broker_host_port(char *host, size_t host_size, char *port, size_t port_size)
 {
-    switch (evt->event_id) {
-    case HTTP_EVENT_ERROR:
-        ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
-        break;
-    case HTTP_EVENT_ON_CONNECTED:
-        ESP_LOGI(TAG, "Connected to test endpoint");
-        break;
-    case HTTP_EVENT_HEADER_SENT:
-        ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
-        break;
-    case HTTP_EVENT_ON_HEADER:
-        ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-        break;
-    case HTTP_EVENT_ON_DATA:
-        if (!esp_http_client_is_chunked_response(evt->client)) {
-            // Allocate buffer for response
-            if (s_response_buffer == NULL) {
-                s_response_len = esp_http_client_get_content_length(evt->client);
-                if (s_response_len > 0 && s_response_len < 4096) {
-                    s_response_buffer = malloc(s_response_len + 1);
-                    if (s_response_buffer) {
-                        s_response_buffer[0] = '\0';
-                    }
-                } else {
-                    s_response_len = 4096;
-                    s_response_buffer = malloc(s_response_len + 1);
-                }
-                if (s_response_buffer == NULL) {
-                    ESP_LOGE(TAG, "Failed to allocate response buffer");
-                    return ESP_ERR_NO_MEM;
-                }
-            }
-            // Append data to buffer
-            size_t data_len = evt->data_len;
-            size_t current_len = strlen(s_response_buffer);
-            if (current_len + data_len < s_response_len) {
-                memcpy(s_response_buffer + current_len, evt->data, data_len);
-                s_response_buffer[current_len + data_len] = '\0';
-            }
+    char uri[REMOTE_CONFIG_STR_MAX];
+    esp_err_t err = remote_config_get_str(REMOTE_CONFIG_BROKER_URI, uri, sizeof(uri));
+    if (err != ESP_OK) {
+        return err;
+    }
+    const char *start = strstr(uri, "://");
+    start = start ? start + 3 : uri;
+
+    size_t len = strcspn(start, ":/");
+    if (len == 0 || len >= host_size) {
+        ESP_LOGE(TAG, "Cannot extract host from %s", uri);
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(host, start, len);
+    host[len] = '\0';
+
+    if (start[len] == ':') {
+        const char *p = start + len + 1;
+        size_t plen = strcspn(p, "/");
+        if (plen == 0 || plen >= port_size) {
+            return ESP_ERR_INVALID_ARG;
         }
-        break;
-    case HTTP_EVENT_ON_FINISH:
-        ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-        break;
-    case HTTP_EVENT_DISCONNECTED:
-        ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
-        break;
-    default:
-        break;
+        memcpy(port, p, plen);
+        port[plen] = '\0';
+    } else {
+        snprintf(port, port_size, "%s", strncmp(uri, "mqtts", 5) == 0 ? "8883" : "1883");
     }
     return ESP_OK;
 }
 
+#if CONFIG_INET_PROBE_DNS || CONFIG_INET_PROBE_TCP
 /**
- * @brief Verify internet connectivity by accessing test endpoint
+ * @brief Resolve the broker; the answer stays in the lwIP DNS cache for MQTT
+ */
+static esp_err_t probe_resolve(struct addrinfo **res)
+{
+    char host[BROKER_HOST_MAX_LEN];
+    char port[8];
+    esp_err_t err = broker_host_port(host, sizeof(host), port, sizeof(port));
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Probing broker %s:%s", host, port);
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    int ret = getaddrinfo(host, port, &hints, res);
+    if (ret != 0 || *res == NULL) {
+        ESP_LOGE(TAG, "DNS lookup for %s failed: %d", host, ret);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+#endif
+
+#if CONFIG_INET_PROBE_TCP
+/**
+ * @brief Open and close a TCP connection to the broker port
+ */
+static esp_err_t probe_tcp(void)
+{
+    struct addrinfo *res = NULL;
+    esp_err_t err = probe_resolve(&res);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = ESP_FAIL;
+    int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        goto cleanup;
+    }
+
+    // Non-blocking connect so the probe timeout applies to the handshake
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
+        err = ESP_OK;
+        goto cleanup;
+    }
+    if (errno != EINPROGRESS) {
+        ESP_LOGE(TAG, "TCP connect failed: errno %d", errno);
+        goto cleanup;
+    }
+
+    fd_set wfds;
+    FD_ZERO(&wfds);
+    FD_SET(sock, &wfds);
+    struct timeval tv = {
+        .tv_sec = PROBE_TIMEOUT_MS / 1000,
+        .tv_usec = (PROBE_TIMEOUT_MS % 1000) * 1000,
+    };
+    int ready = select(sock + 1, NULL, &wfds, NULL, &tv);
+    if (ready <= 0) {
+        ESP_LOGE(TAG, "TCP connect timed out");
+        goto cleanup;
+    }
+
+    int so_error = 0;
+    socklen_t optlen = sizeof(so_error);
+    getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &optlen);
+    if (so_error != 0) {
+        ESP_LOGE(TAG, "TCP connect failed: errno %d", so_error);
+        goto cleanup;
+    }
+    err = ESP_OK;
+
+cleanup:
+    if (sock >= 0) {
+        close(sock);
+    }
+    freeaddrinfo(res);
+    return err;
+}
+#endif
+
+#if CONFIG_INET_PROBE_HTTP204
+/**
+ * @brief GET the 204 endpoint; any other status means a captive portal or proxy
+ */
+static esp_err_t probe_http204(void)
+{
+    ESP_LOGI(TAG, "Probing endpoint: %s", CONFIG_INET_PROBE_URL);
+
+    backend_request_t request = {
+        .url = CONFIG_INET_PROBE_URL,
+        .method = HTTP_METHOD_GET,
+        .timeout_ms = PROBE_TIMEOUT_MS,
+    };
+
+    int status_code = 0;
+    esp_err_t err = backend_client_perform(&request, &status_code, NULL);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "HTTP request failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    if (status_code != 204) {
+        ESP_LOGE(TAG, "Unexpected HTTP status %d (captive portal?)", status_code);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+#endif
+
+/**
+ * @brief Verify internet connectivity with the configured probe
  */
 esp_err_t internet_verification_test(void)
 {
     ESP_LOGI(TAG, "========================================");
     ESP_LOGI(TAG, "Internet Connectivity Verification");
     ESP_LOGI(TAG, "========================================");
-    ESP_LOGI(TAG, "Testing endpoint: %s", TEST_ENDPOINT_URL);
-    
-    // Reset response buffer
-    if (s_response_buffer) {
-        free(s_response_buffer);
-        s_response_buffer = NULL;
-    }
-    s_response_len = 0;
-    
-    // Configure HTTP client
-    esp_http_client_config_t config = {
-        .url = TEST_ENDPOINT_URL,
-        .event_handler = http_event_handler,
-        .timeout_ms = 15000,  // 15 second timeout
-        .skip_cert_common_name_check = true,  // Skip cert check for development
-    };
-    
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize HTTP client");
-        return ESP_FAIL;
-    }
-    
-    // Perform GET request
-    ESP_LOGI(TAG, "Sending HTTPS GET request...");
-    esp_err_t err = esp_http_client_perform(client);
-    
+
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err;
+
+#if CONFIG_INET_PROBE_DNS
+    struct addrinfo *res = NULL;
+    err = probe_resolve(&res);
     if (err == ESP_OK) {
-        int status_code = esp_http_client_get_status_code(client);
-        int content_length = esp_http_client_get_content_length(client);
-        
-        ESP_LOGI(TAG, "HTTP Status Code: %d", status_code);
-        ESP_LOGI(TAG, "Content Length: %d", content_length);
-        
-        if (status_code == 200) {
-            ESP_LOGI(TAG, "========================================");
-            ESP_LOGI(TAG, "✓ INTERNET CONNECTIVITY VERIFIED!");
-            ESP_LOGI(TAG, "✓ Provisioning flow 100%% complete!");
-            ESP_LOGI(TAG, "========================================");
-            
-            if (s_response_buffer && strlen(s_response_buffer) > 0) {
-                ESP_LOGI(TAG, "Response from endpoint:");
-                ESP_LOGI(TAG, "%s", s_response_buffer);
-            } else {
-                ESP_LOGW(TAG, "No response body received");
-            }
-            
-            esp_http_client_cleanup(client);
-            if (s_response_buffer) {
-                free(s_response_buffer);
-                s_response_buffer = NULL;
-            }
-            return ESP_OK;
-        } else {
-            ESP_LOGE(TAG, "HTTP request failed with status code: %d", status_code);
-            if (s_response_buffer && strlen(s_response_buffer) > 0) {
-                ESP_LOGE(TAG, "Error response: %s", s_response_buffer);
-            }
-        }
-    } else {
-        ESP_LOGE(TAG, "HTTP request failed: %s", esp_err_to_name(err));
+        freeaddrinfo(res);
     }
-    
-    esp_http_client_cleanup(client);
-    if (s_response_buffer) {
-        free(s_response_buffer);
-        s_response_buffer = NULL;
+#elif CONFIG_INET_PROBE_TCP
+    err = probe_tcp();
+#else
+    err = probe_http204();
+#endif
+
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "========================================");
+        ESP_LOGI(TAG, "✓ INTERNET CONNECTIVITY VERIFIED! (%lld ms)",
+                 (esp_timer_get_time() - start_us) / 1000);
+        ESP_LOGI(TAG, "✓ Provisioning flow 100%% complete!");
+        ESP_LOGI(TAG, "========================================");
+        return ESP_OK;
     }
-    
+
     ESP_LOGE(TAG, "========================================");
     ESP_LOGE(TAG, "✗ Internet connectivity verification failed");
     ESP_LOGE(TAG, "========================================");
     return ESP_FAIL;
 }
-
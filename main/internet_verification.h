@@ -8,10 +8,11 @@ extern "C" {
 #endif
 
 /**
- * @brief Verify internet connectivity by accessing test endpoint
+ * @brief Verify internet connectivity with a lightweight probe
  * 
- * Makes an HTTPS GET request to https://mqtt-test-puf8.onrender.com/api/
- * to verify the device has internet access after WiFi connection.
+ * Runs the probe chosen in menuconfig (Connectivity Check): DNS lookup of
+ * the MQTT broker, TCP connect to the broker port, or an HTTP 204 endpoint.
+ * Each attempt is bounded by CONFIG_INET_PROBE_TIMEOUT_MS.
  * 
  * @return ESP_OK if internet access is confirmed, ESP_FAIL otherwise
  */
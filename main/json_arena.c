@@ -0,0 +1,95 @@
+/* cJSON Arena Implementation
+ *
+ * cJSON_InitHooks() is global, so the hooks are installed once and decide
+ * per call: the owning task of an open scope bumps through the block,
+ * everything else goes to malloc(). free() of an arena pointer is a no-op.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "json_arena.h"
+#include "cJSON.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "json_arena";
+
+#define JSON_ARENA_ALIGN 8     // cJSON nodes hold a double
+
+static uint8_t *s_base = NULL;
+static size_t s_size = 0;
+static size_t s_used = 0;
+static size_t s_fallbacks = 0;
+static TaskHandle_t s_owner = NULL;
+static bool s_hooks_installed = false;
+
+static bool in_arena(const void *ptr)
+{
+    const uint8_t *p = ptr;
+    return s_base != NULL && p >= s_base && p < s_base + s_size;
+}
+
+static void *arena_malloc(size_t size)
+{
+    if (s_owner == NULL || s_owner != xTaskGetCurrentTaskHandle()) {
+        return malloc(size);
+    }
+
+    size_t offset = (s_used + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1);
+    if (offset > s_size || size > s_size - offset) {
+        s_fallbacks++;
+        return malloc(size);
+    }
+    s_used = offset + size;
+    return s_base + offset;
+}
+
+static void arena_free(void *ptr)
+{
+    if (!in_arena(ptr)) {
+        free(ptr);
+    }
+}
+
+esp_err_t json_arena_begin(size_t size)
+{
+    if (!s_hooks_installed) {
+        cJSON_Hooks hooks = {
+            .malloc_fn = arena_malloc,
+            .free_fn = arena_free,
+        };
+        cJSON_InitHooks(&hooks);
+        s_hooks_installed = true;
+    }
+
+    if (s_owner != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    s_base = malloc(size);
+    if (s_base == NULL) {
+        ESP_LOGW(TAG, "Failed to allocate %d byte arena, using heap", size);
+        return ESP_ERR_NO_MEM;
+    }
+    s_size = size;
+    s_used = 0;
+    s_fallbacks = 0;
+    s_owner = xTaskGetCurrentTaskHandle();
+    return ESP_OK;
+}
+
+void json_arena_end(void)
+{
+    if (s_owner != xTaskGetCurrentTaskHandle()) {
+        return;
+    }
+
+    ESP_LOGD(TAG, "Arena used %d/%d bytes, %d heap fallbacks", s_used, s_size, s_fallbacks);
+    s_owner = NULL;
+    free(s_base);
+    s_base = NULL;
+    s_size = 0;
+    s_used = 0;
+}
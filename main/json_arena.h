@@ -0,0 +1,44 @@
+/* cJSON Arena Header
+ *
+ * Scoped bump allocator for cJSON. Inside a scope every cJSON allocation
+ * made by the owning task comes from one block that is released in O(1)
+ * when the scope ends, so building and parsing request trees does not
+ * fragment internal RAM.
+ */
+
+#ifndef JSON_ARENA_H
+#define JSON_ARENA_H
+
+#include "esp_err.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Open an arena scope for the calling task
+ *
+ * Allocates one block of size bytes and routes the task's cJSON
+ * allocations into it. Other tasks keep using the heap. Allocations that
+ * do not fit fall back to the heap transparently.
+ *
+ * @param size Arena size in bytes
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if a scope is already open,
+ *         ESP_ERR_NO_MEM if the block cannot be allocated (cJSON then uses the heap)
+ */
+esp_err_t json_arena_begin(size_t size);
+
+/**
+ * @brief Close the scope and free the block
+ *
+ * Every cJSON tree and string created inside the scope must be released
+ * (or no longer used) before this call.
+ */
+void json_arena_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JSON_ARENA_H
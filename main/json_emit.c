@@ -0,0 +1,204 @@
+/* JSON Emit Helper Implementation
+ *
+ * Compact output only: responses and request bodies are read by programs,
+ * so the indentation cJSON_Print() adds is pure overhead on the wire.
+ *
+ * With CONFIG_APP_JSON_FAST_NUMBERS the tree is walked here instead of by
+ * cJSON, so numbers go through json_number_format() rather than cJSON's
+ * sprintf("%1.15g") / sscanf / "%1.17g" sequence. Strings are escaped
+ * exactly as cJSON does, so the output is byte-for-byte the same apart
+ * from how non-integral numbers are spelled.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_emit.h"
+#include "json_number.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "json_emit";
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+} emit_t;
+
+static bool put(emit_t *e, const char *s, size_t n)
+{
+    if (e->len + n >= e->size) {
+        return false;
+    }
+    memcpy(e->buf + e->len, s, n);
+    e->len += n;
+    return true;
+}
+
+static bool put_string(emit_t *e, const char *s)
+{
+    if (s == NULL) {
+        return put(e, "\"\"", 2);
+    }
+    if (!put(e, "\"", 1)) {
+        return false;
+    }
+
+    const char *run = s;
+    for (const unsigned char *p = (const unsigned char *)s; ; p++) {
+        if (*p >= 32 && *p != '"' && *p != '\\') {
+            continue;
+        }
+        // Flush the unescaped run before this character
+        if (!put(e, run, (const char *)p - run)) {
+            return false;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        char esc[7] = { '\\', 0 };
+        size_t n = 2;
+        switch (*p) {
+        case '"':  esc[1] = '"';  break;
+        case '\\': esc[1] = '\\'; break;
+        case '\b': esc[1] = 'b';  break;
+        case '\f': esc[1] = 'f';  break;
+        case '\n': esc[1] = 'n';  break;
+        case '\r': esc[1] = 'r';  break;
+        case '\t': esc[1] = 't';  break;
+        default:
+            n = snprintf(esc, sizeof(esc), "\\u%04x", *p);
+            break;
+        }
+        if (!put(e, esc, n)) {
+            return false;
+        }
+        run = (const char *)p + 1;
+    }
+    return put(e, "\"", 1);
+}
+
+/**
+ * @brief Drop what a failed append wrote after len, keeping buf terminated
+ */
+static void truncate_at(char *buf, size_t size, size_t len)
+{
+    if (len < size) {
+        buf[len] = '\0';
+    } else if (size > 0) {
+        buf[size - 1] = '\0';
+    }
+}
+
+bool json_emit_raw(char *buf, size_t size, size_t *len, const char *s)
+{
+    emit_t e = { .buf = buf, .size = size, .len = *len };
+    if (!put(&e, s, strlen(s))) {
+        truncate_at(buf, size, *len);
+        return false;
+    }
+    buf[e.len] = '\0';
+    *len = e.len;
+    return true;
+}
+
+bool json_emit_string(char *buf, size_t size, size_t *len, const char *s)
+{
+    emit_t e = { .buf = buf, .size = size, .len = *len };
+    if (!put_string(&e, s)) {
+        truncate_at(buf, size, *len);
+        return false;
+    }
+    buf[e.len] = '\0';
+    *len = e.len;
+    return true;
+}
+
+#if CONFIG_APP_JSON_FAST_NUMBERS
+
+// Deeper trees are left to cJSON; keeps the recursion off the stack limit
+#define EMIT_MAX_DEPTH 16
+
+static bool put_item(emit_t *e, const cJSON *item, int depth)
+{
+    switch (item->type & 0xFF) {
+    case cJSON_NULL:
+        return put(e, "null", 4);
+    case cJSON_False:
+        return put(e, "false", 5);
+    case cJSON_True:
+        return put(e, "true", 4);
+    case cJSON_Number: {
+        char num[JSON_NUMBER_MAX];
+        return put(e, num, json_number_format(item->valuedouble, num));
+    }
+    case cJSON_String:
+        return put_string(e, item->valuestring);
+    case cJSON_Raw:
+        return item->valuestring != NULL && put(e, item->valuestring, strlen(item->valuestring));
+    case cJSON_Array:
+    case cJSON_Object: {
+        bool object = (item->type & 0xFF) == cJSON_Object;
+        if (depth >= EMIT_MAX_DEPTH || !put(e, object ? "{" : "[", 1)) {
+            return false;
+        }
+        for (const cJSON *child = item->child; child != NULL; child = child->next) {
+            if (child != item->child && !put(e, ",", 1)) {
+                return false;
+            }
+            if (object && !(put_string(e, child->string) && put(e, ":", 1))) {
+                return false;
+            }
+            if (!put_item(e, child, depth + 1)) {
+                return false;
+            }
+        }
+        return put(e, object ? "}" : "]", 1);
+    }
+    default:
+        return false;
+    }
+}
+
+static bool print_into(const cJSON *item, char *buf, size_t size)
+{
+    emit_t e = { .buf = buf, .size = size, .len = 0 };
+    if (!put_item(&e, item, 0)) {
+        return false;
+    }
+    buf[e.len] = '\0';
+    return true;
+}
+
+#else
+
+static bool print_into(const cJSON *item, char *buf, size_t size)
+{
+    // cJSON_PrintPreallocated() fails cleanly when the buffer is too small
+    return cJSON_PrintPreallocated((cJSON *)item, buf, (int)size, false);
+}
+
+#endif
+
+char *json_emit(const cJSON *item, char *scratch, size_t scratch_size)
+{
+    if (item == NULL) {
+        return NULL;
+    }
+
+    if (scratch != NULL && scratch_size > 0 && print_into(item, scratch, scratch_size)) {
+        return scratch;
+    }
+
+    ESP_LOGD(TAG, "Document exceeds %d byte scratch buffer, using heap", scratch_size);
+    return cJSON_PrintUnformatted(item);
+}
+
+void json_emit_free(char *json, const char *scratch)
+{
+    if (json != NULL && json != scratch) {
+        cJSON_free(json);
+    }
+}
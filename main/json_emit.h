@@ -0,0 +1,65 @@
+/* JSON Emit Helper Header
+ *
+ * Renders a cJSON tree unformatted into a caller-provided scratch buffer
+ * in a single pass, instead of cJSON_Print()'s formatted output grown
+ * through repeated reallocs. Documents of a fixed shape can skip the tree
+ * altogether: json_emit_raw() and json_emit_string() fill a template
+ * straight into a buffer.
+ */
+
+#ifndef JSON_EMIT_H
+#define JSON_EMIT_H
+
+#include "cJSON.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Render item as compact JSON
+ *
+ * Prints into scratch with cJSON_PrintPreallocated(). Only if the document
+ * does not fit does it fall back to one heap allocation.
+ *
+ * @param item Tree to render
+ * @param scratch Reusable buffer, typically a static array
+ * @param scratch_size Size of scratch in bytes
+ * @return NUL-terminated JSON (scratch or heap), NULL on failure;
+ *         release with json_emit_free()
+ */
+char *json_emit(const cJSON *item, char *scratch, size_t scratch_size);
+
+/**
+ * @brief Release the result of json_emit()
+ *
+ * Frees json only when it is not the scratch buffer.
+ */
+void json_emit_free(char *json, const char *scratch);
+
+/**
+ * @brief Append text as is at buf + *len, for templates of fixed JSON
+ *
+ * @param buf Output buffer, kept NUL-terminated
+ * @param size Size of buf
+ * @param len Current length, advanced on success
+ * @param s Text to append
+ * @return false, leaving *len unchanged and buf terminated there, if it
+ *         does not fit
+ */
+bool json_emit_raw(char *buf, size_t size, size_t *len, const char *s);
+
+/**
+ * @brief Append s as a quoted JSON string, escaped as cJSON does
+ *
+ * Same contract as json_emit_raw(); NULL is written as "".
+ */
+bool json_emit_string(char *buf, size_t size, size_t *len, const char *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JSON_EMIT_H
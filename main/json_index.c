@@ -0,0 +1,101 @@
+/* JSON Key Index Implementation
+ *
+ * FNV-1a over the key (ASCII-folded in case-insensitive mode) into a
+ * linear-probing table sized to at most half full. Only pointers to the
+ * members are stored, so the index costs 2-4 pointers per key.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include "json_index.h"
+
+static inline unsigned char fold(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+static uint32_t key_hash(const char *key, bool case_sensitive)
+{
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)key;
+
+    if (case_sensitive) {
+        for (; *p != '\0'; p++) {
+            h = (h ^ *p) * 16777619u;
+        }
+    } else {
+        for (; *p != '\0'; p++) {
+            h = (h ^ fold(*p)) * 16777619u;
+        }
+    }
+    return h;
+}
+
+static bool key_equal(const char *a, const char *b, bool case_sensitive)
+{
+    return case_sensitive ? strcmp(a, b) == 0 : strcasecmp(a, b) == 0;
+}
+
+esp_err_t json_index_build(json_index_t *idx, const cJSON *object, bool case_sensitive)
+{
+    memset(idx, 0, sizeof(*idx));
+    if (!cJSON_IsObject(object)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t count = 0;
+    for (const cJSON *child = object->child; child != NULL; child = child->next) {
+        count++;
+    }
+    size_t slots = 4;
+    while (slots < count * 2) {
+        slots <<= 1;
+    }
+
+    idx->slots = calloc(slots, sizeof(idx->slots[0]));
+    if (idx->slots == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    idx->mask = slots - 1;
+    idx->case_sensitive = case_sensitive;
+
+    for (const cJSON *child = object->child; child != NULL; child = child->next) {
+        if (child->string == NULL) {
+            continue;
+        }
+        size_t i = key_hash(child->string, case_sensitive) & idx->mask;
+        while (idx->slots[i] != NULL &&
+               !key_equal(idx->slots[i]->string, child->string, case_sensitive)) {
+            i = (i + 1) & idx->mask;
+        }
+        // An occupied slot here is an earlier duplicate, which stays
+        if (idx->slots[i] == NULL) {
+            idx->slots[i] = child;
+        }
+    }
+    return ESP_OK;
+}
+
+const cJSON *json_index_get(const json_index_t *idx, const char *key)
+{
+    if (idx->slots == NULL || key == NULL) {
+        return NULL;
+    }
+
+    size_t i = key_hash(key, idx->case_sensitive) & idx->mask;
+    while (idx->slots[i] != NULL) {
+        if (key_equal(idx->slots[i]->string, key, idx->case_sensitive)) {
+            return idx->slots[i];
+        }
+        i = (i + 1) & idx->mask;
+    }
+    return NULL;
+}
+
+void json_index_free(json_index_t *idx)
+{
+    free(idx->slots);
+    memset(idx, 0, sizeof(*idx));
+}
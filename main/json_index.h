@@ -0,0 +1,65 @@
+/* JSON Key Index Header
+ *
+ * Hash index over the members of one parsed cJSON object, for documents
+ * with many keys that are looked up repeatedly (remote configuration).
+ * cJSON_GetObjectItem() walks the member list with a case-insensitive
+ * compare on every call; an index makes each lookup one hash and,
+ * usually, one compare.
+ */
+
+#ifndef JSON_INDEX_H
+#define JSON_INDEX_H
+
+#include "cJSON.h"
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Index over one object, treat as opaque
+ *
+ * Holds pointers into the tree: the object must outlive the index and
+ * must not gain or lose members while it is in use.
+ */
+typedef struct {
+    const cJSON **slots;        // Open addressing, NULL = empty
+    size_t mask;                // Slot count - 1 (a power of two)
+    bool case_sensitive;
+} json_index_t;
+
+/**
+ * @brief Build the index for object's members
+ *
+ * As with cJSON_GetObjectItem(), the first of duplicate keys wins.
+ *
+ * @param idx Index to fill
+ * @param object Object to index
+ * @param case_sensitive true to match keys exactly
+ *        (cJSON_GetObjectItemCaseSensitive semantics) and skip the
+ *        per-character case folding
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if object is not an object,
+ *         ESP_ERR_NO_MEM
+ */
+esp_err_t json_index_build(json_index_t *idx, const cJSON *object, bool case_sensitive);
+
+/**
+ * @brief Look up a member by key
+ *
+ * @return The member, or NULL if there is none (or idx was not built)
+ */
+const cJSON *json_index_get(const json_index_t *idx, const char *key);
+
+/**
+ * @brief Release the index; the tree is not touched
+ */
+void json_index_free(json_index_t *idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JSON_INDEX_H
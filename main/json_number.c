@@ -0,0 +1,319 @@
+/* JSON Number Formatter Implementation
+ *
+ * Grisu2 after Loitsch, "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers" (PLDI 2010), in the layout used by RapidJSON.
+ * All arithmetic is on 64-bit integers; the only double operations are
+ * the integral check and the bit copy, so none of it goes through the
+ * soft-float routines a %g conversion does on the S3.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "json_number.h"
+
+#define DP_SIGNIFICAND_BITS 52
+#define DP_EXPONENT_BIAS    (0x3FF + DP_SIGNIFICAND_BITS)
+#define DP_MIN_EXPONENT     (-DP_EXPONENT_BIAS)
+#define DP_HIDDEN_BIT       (1ULL << DP_SIGNIFICAND_BITS)
+#define DP_SIGNIFICAND_MASK (DP_HIDDEN_BIT - 1)
+#define DP_EXPONENT_MASK    0x7FF0000000000000ULL
+#define DP_SIGN_MASK        0x8000000000000000ULL
+
+// Integral values below this are printed exactly by the integer path
+#define EXACT_INT_LIMIT     9007199254740992.0  // 2^53
+
+typedef struct {
+    uint64_t f;
+    int e;
+} diy_fp_t;
+
+// 10^k for k = -348, -340, ..., 340, normalized to a 64-bit significand
+static const uint64_t s_cached_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t s_cached_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066,
+};
+
+static const uint64_t s_pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+static diy_fp_t fp_mul(diy_fp_t x, diy_fp_t y)
+{
+    const uint64_t m32 = 0xFFFFFFFFULL;
+    uint64_t a = x.f >> 32, b = x.f & m32;
+    uint64_t c = y.f >> 32, d = y.f & m32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+    tmp += 1ULL << 31;      // Round the discarded low half
+    return (diy_fp_t){ ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64 };
+}
+
+static diy_fp_t fp_normalize(diy_fp_t x)
+{
+    int s = __builtin_clzll(x.f);
+    return (diy_fp_t){ x.f << s, x.e - s };
+}
+
+/**
+ * @brief Boundaries halfway to the neighbouring doubles, sharing one exponent
+ */
+static void fp_boundaries(diy_fp_t v, diy_fp_t *minus, diy_fp_t *plus)
+{
+    diy_fp_t pl = { (v.f << 1) + 1, v.e - 1 };
+    while (!(pl.f & (DP_HIDDEN_BIT << 1))) {
+        pl.f <<= 1;
+        pl.e--;
+    }
+    pl.f <<= 64 - DP_SIGNIFICAND_BITS - 2;
+    pl.e -= 64 - DP_SIGNIFICAND_BITS - 2;
+
+    // The lower neighbour is closer when v is a power of two
+    diy_fp_t mi = (v.f == DP_HIDDEN_BIT) ? (diy_fp_t){ (v.f << 2) - 1, v.e - 2 }
+                                         : (diy_fp_t){ (v.f << 1) - 1, v.e - 1 };
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+    *minus = mi;
+    *plus = pl;
+}
+
+/**
+ * @brief Cached power that brings a product with exponent e into [-60, -32]
+ *
+ * @param K Set to the negated decimal exponent of the power
+ */
+static diy_fp_t cached_power(int e, int *K)
+{
+    // ceil((-61 - e) * log10(2)) + 347, with log10(2) as 78913 / 2^18;
+    // the spacing of 8 decimal exponents absorbs the approximation
+    int dk = -((-(-61 - e) * 78913) >> 18) + 347;
+    unsigned index = (unsigned)((dk >> 3) + 1);
+    *K = -(-348 + (int)(index << 3));
+    return (diy_fp_t){ s_cached_f[index], s_cached_e[index] };
+}
+
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int count_digits32(uint32_t n)
+{
+    int digits = 1;
+    while (digits < 10 && n >= s_pow10[digits]) {
+        digits++;
+    }
+    return digits;
+}
+
+static void digit_gen(diy_fp_t w, diy_fp_t mp, uint64_t delta, char *buf, int *len, int *K)
+{
+    const diy_fp_t one = { 1ULL << -mp.e, mp.e };
+    const uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = count_digits32(p1);
+    *len = 0;
+
+    while (kappa > 0) {
+        uint32_t div = (uint32_t)s_pow10[kappa - 1];
+        uint32_t d = p1 / div;
+        p1 %= div;
+        if (d || *len) {
+            buf[(*len)++] = (char)('0' + d);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *K += kappa;
+            grisu_round(buf, *len, delta, rest, s_pow10[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || *len) {
+            buf[(*len)++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            int index = -kappa;
+            grisu_round(buf, *len, delta, p2, one.f, wp_w * (index < 20 ? s_pow10[index] : 0));
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Shortest digits of a positive finite value: value = digits * 10^K
+ */
+static void grisu2(uint64_t bits, char *buf, int *len, int *K)
+{
+    int biased_e = (int)((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_BITS);
+    uint64_t significand = bits & DP_SIGNIFICAND_MASK;
+    diy_fp_t v = (biased_e != 0) ? (diy_fp_t){ significand + DP_HIDDEN_BIT, biased_e - DP_EXPONENT_BIAS }
+                                 : (diy_fp_t){ significand, DP_MIN_EXPONENT + 1 };
+
+    diy_fp_t w_m, w_p;
+    fp_boundaries(v, &w_m, &w_p);
+    diy_fp_t c_mk = cached_power(w_p.e, K);
+    diy_fp_t w = fp_mul(fp_normalize(v), c_mk);
+    diy_fp_t wp = fp_mul(w_p, c_mk);
+    diy_fp_t wm = fp_mul(w_m, c_mk);
+    wm.f++;
+    wp.f--;
+    digit_gen(w, wp, wp.f - wm.f, buf, len, K);
+}
+
+static char *write_exponent(int k, char *p)
+{
+    if (k < 0) {
+        *p++ = '-';
+        k = -k;
+    }
+    if (k >= 100) {
+        *p++ = (char)('0' + k / 100);
+        k %= 100;
+        *p++ = (char)('0' + k / 10);
+    } else if (k >= 10) {
+        *p++ = (char)('0' + k / 10);
+    }
+    *p++ = (char)('0' + k % 10);
+    return p;
+}
+
+/**
+ * @brief Lay out digits * 10^k as plain decimal or d.ddde[-]x
+ */
+static char *prettify(char *buf, int len, int k)
+{
+    const int kk = len + k;     // 10^(kk-1) <= value < 10^kk
+
+    if (k >= 0 && kk <= 21) {
+        // 1234e7 -> 12340000000
+        memset(buf + len, '0', k);
+        return buf + kk;
+    }
+    if (kk > 0 && kk <= 21) {
+        // 1234e-2 -> 12.34
+        memmove(buf + kk + 1, buf + kk, len - kk);
+        buf[kk] = '.';
+        return buf + len + 1;
+    }
+    if (kk > -6 && kk <= 0) {
+        // 1234e-6 -> 0.001234
+        const int offset = 2 - kk;
+        memmove(buf + offset, buf, len);
+        buf[0] = '0';
+        buf[1] = '.';
+        memset(buf + 2, '0', offset - 2);
+        return buf + len + offset;
+    }
+    if (len == 1) {
+        // 1e30
+        buf[1] = 'e';
+        return write_exponent(kk - 1, buf + 2);
+    }
+    // 1234e30 -> 1.234e33
+    memmove(buf + 2, buf + 1, len - 1);
+    buf[1] = '.';
+    buf[len + 1] = 'e';
+    return write_exponent(kk - 1, buf + len + 2);
+}
+
+static size_t format_uint(uint64_t u, char *out)
+{
+    char tmp[20];
+    size_t n = 0;
+    do {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+size_t json_number_format(double value, char *out)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    if ((bits & DP_EXPONENT_MASK) == DP_EXPONENT_MASK) {
+        memcpy(out, "null", 5);
+        return 4;
+    }
+
+    char *p = out;
+    if (bits & DP_SIGN_MASK) {
+        value = -value;
+        bits &= ~DP_SIGN_MASK;
+        if (bits != 0) {
+            *p++ = '-';     // -0 prints as 0, as with cJSON's %d path
+        }
+    }
+
+    // Counters, sizes, RSSI and the like: no digit generation at all
+    if (value < EXACT_INT_LIMIT && value == (double)(uint64_t)value) {
+        p += format_uint((uint64_t)value, p);
+        *p = '\0';
+        return p - out;
+    }
+
+    int len, K;
+    grisu2(bits, p, &len, &K);
+    p = prettify(p, len, K);
+    *p = '\0';
+    return p - out;
+}
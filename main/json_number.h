@@ -0,0 +1,36 @@
+/* JSON Number Formatter Header
+ *
+ * Shortest round-trip formatting of doubles for JSON output, without the
+ * printf family. Integral values take an integer-only path; everything
+ * else uses Grisu2, whose output always parses back to the same double
+ * and is the shortest such string for all but a tiny fraction of inputs.
+ */
+
+#ifndef JSON_NUMBER_H
+#define JSON_NUMBER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JSON_NUMBER_MAX 32          // Longest output including the terminator
+
+/**
+ * @brief Format value as a JSON number
+ *
+ * NaN and infinities have no JSON representation and are written as
+ * "null", as cJSON does.
+ *
+ * @param value Number to format
+ * @param out Buffer of at least JSON_NUMBER_MAX bytes, NUL-terminated
+ * @return Length written, excluding the terminator
+ */
+size_t json_number_format(double value, char *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JSON_NUMBER_H
@@ -0,0 +1,257 @@
+/* Streaming JSON Field Extractor Implementation
+ *
+ * Byte-at-a-time scanner: tracks the object key at every nesting level and
+ * forwards the characters of string values whose key path was requested.
+ * At an array level the key is the element index in decimal. Numbers and
+ * literals are skipped without validation.
+ */
+
+#include <string.h>
+#include "json_stream.h"
+
+void json_stream_init(json_stream_t *js, const char *const *paths, size_t path_count,
+                      json_stream_value_cb_t cb, void *ctx)
+{
+    memset(js, 0, sizeof(*js));
+    js->paths = paths;
+    js->path_count = path_count;
+    js->cb = cb;
+    js->ctx = ctx;
+    js->field = -1;
+}
+
+/**
+ * @brief Find the requested path matching the current key stack
+ */
+static int match_path(const json_stream_t *js)
+{
+    for (size_t i = 0; i < js->path_count; i++) {
+        const char *p = js->paths[i];
+        bool match = true;
+
+        for (uint8_t level = 0; level < js->depth && match; level++) {
+            size_t len = strlen(js->key[level]);
+            if (strncmp(p, js->key[level], len) != 0) {
+                match = false;
+                break;
+            }
+            p += len;
+            if (level + 1 < js->depth) {
+                if (*p != '.') {
+                    match = false;
+                }
+                p++;
+            }
+        }
+        if (match && *p == '\0') {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Name the current element of the array at level by its index
+ */
+static void set_index_key(json_stream_t *js, uint8_t level)
+{
+    char *k = js->key[level];
+    uint8_t i = js->index[level];
+    if (i >= 100) {
+        *k++ = (char)('0' + i / 100);
+    }
+    if (i >= 10) {
+        *k++ = (char)('0' + i / 10 % 10);
+    }
+    *k++ = (char)('0' + i % 10);
+    *k = '\0';
+}
+
+static void flush_out(json_stream_t *js, bool done)
+{
+    if (js->error == ESP_OK && js->out_len > 0) {
+        js->error = js->cb(js->ctx, js->field, js->out, js->out_len, false);
+    }
+    js->out_len = 0;
+    if (js->error == ESP_OK && done) {
+        js->error = js->cb(js->ctx, js->field, NULL, 0, true);
+    }
+}
+
+static void emit_char(json_stream_t *js, char c)
+{
+    if (js->string_is_key) {
+        uint8_t level = js->depth - 1;
+        if (js->key_len < JSON_STREAM_MAX_KEY - 1) {
+            js->key[level][js->key_len] = c;
+        } else {
+            // Too long to ever match; keep it distinct from any real key
+            js->key[level][0] = '\x01';
+        }
+        if (js->key_len < UINT8_MAX) {
+            js->key_len++;
+        }
+        return;
+    }
+
+    if (js->field < 0) {
+        return;
+    }
+    js->out[js->out_len++] = c;
+    if (js->out_len == sizeof(js->out)) {
+        flush_out(js, false);
+    }
+}
+
+static void emit_codepoint(json_stream_t *js, uint32_t cp)
+{
+    if (cp < 0x80) {
+        emit_char(js, (char)cp);
+    } else if (cp < 0x800) {
+        emit_char(js, (char)(0xC0 | (cp >> 6)));
+        emit_char(js, (char)(0x80 | (cp & 0x3F)));
+    } else {
+        emit_char(js, (char)(0xE0 | (cp >> 12)));
+        emit_char(js, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        emit_char(js, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static esp_err_t string_char(json_stream_t *js, char c)
+{
+    if (js->unicode_left > 0) {
+        uint32_t v;
+        if (c >= '0' && c <= '9') {
+            v = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            v = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            v = c - 'A' + 10;
+        } else {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        js->unicode = (js->unicode << 4) | v;
+        if (--js->unicode_left == 0) {
+            emit_codepoint(js, js->unicode);
+        }
+        return ESP_OK;
+    }
+
+    if (js->escape) {
+        js->escape = false;
+        switch (c) {
+        case 'n': emit_char(js, '\n'); break;
+        case 'r': emit_char(js, '\r'); break;
+        case 't': emit_char(js, '\t'); break;
+        case 'b': emit_char(js, '\b'); break;
+        case 'f': emit_char(js, '\f'); break;
+        case 'u':
+            js->unicode = 0;
+            js->unicode_left = 4;
+            break;
+        default:
+            emit_char(js, c);   // \" \\ \/
+            break;
+        }
+        return ESP_OK;
+    }
+
+    if (c == '\\') {
+        js->escape = true;
+    } else if (c == '"') {
+        js->in_string = false;
+        if (js->string_is_key) {
+            uint8_t level = js->depth - 1;
+            js->key[level][js->key_len < JSON_STREAM_MAX_KEY ? js->key_len : JSON_STREAM_MAX_KEY - 1] = '\0';
+            js->string_is_key = false;
+        } else if (js->field >= 0) {
+            flush_out(js, true);
+            js->field = -1;
+        }
+    } else {
+        emit_char(js, c);
+    }
+    return ESP_OK;
+}
+
+esp_err_t json_stream_feed(json_stream_t *js, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len && js->error == ESP_OK; i++) {
+        char c = data[i];
+
+        if (js->in_string) {
+            esp_err_t err = string_char(js, c);
+            if (err != ESP_OK) {
+                js->error = err;
+            }
+            continue;
+        }
+
+        switch (c) {
+        case '{':
+        case '[':
+            if (js->depth >= JSON_STREAM_MAX_DEPTH) {
+                js->error = ESP_ERR_INVALID_RESPONSE;
+                break;
+            }
+            js->is_object[js->depth] = (c == '{');
+            js->key[js->depth][0] = '\0';
+            if (c == '[') {
+                js->index[js->depth] = 0;
+                set_index_key(js, js->depth);
+            }
+            js->depth++;
+            js->expect_key = (c == '{');
+            break;
+        case '}':
+        case ']':
+            if (js->depth == 0 || js->is_object[js->depth - 1] != (c == '}')) {
+                js->error = ESP_ERR_INVALID_RESPONSE;
+                break;
+            }
+            js->depth--;
+            js->expect_key = false;
+            break;
+        case ',':
+            js->expect_key = (js->depth > 0 && js->is_object[js->depth - 1]);
+            if (js->depth > 0 && !js->is_object[js->depth - 1]) {
+                uint8_t level = js->depth - 1;
+                if (js->index[level] < UINT8_MAX - 1) {
+                    js->index[level]++;
+                    set_index_key(js, level);
+                } else {
+                    js->key[level][0] = '\x01';    // Out of range, matches nothing
+                }
+            }
+            break;
+        case ':':
+            js->expect_key = false;
+            break;
+        case '"':
+            js->in_string = true;
+            js->string_is_key = js->expect_key;
+            if (js->string_is_key) {
+                js->key_len = 0;
+            } else {
+                js->field = match_path(js);
+            }
+            break;
+        default:
+            // Whitespace, numbers and literals are not extracted
+            break;
+        }
+    }
+
+    return js->error;
+}
+
+esp_err_t json_stream_finish(json_stream_t *js)
+{
+    if (js->error != ESP_OK) {
+        return js->error;
+    }
+    if (js->depth != 0 || js->in_string) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,104 @@
+/* Streaming JSON Field Extractor Header
+ *
+ * Pulls selected string values out of a JSON document while it is still
+ * arriving, without buffering the document or building a cJSON tree.
+ */
+
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JSON_STREAM_MAX_DEPTH   8
+#define JSON_STREAM_MAX_KEY     32
+
+/**
+ * @brief Receives the unescaped bytes of a matched string value
+ *
+ * Called any number of times per value with consecutive pieces, then once
+ * with done set (and len 0) when the closing quote is seen.
+ *
+ * @param ctx User context passed to json_stream_init()
+ * @param field Index of the matched entry in the paths array
+ * @param data Unescaped value bytes (not NUL-terminated)
+ * @param len Number of bytes in data
+ * @param done true on the final call for this value
+ * @return ESP_OK to continue, any error aborts the parse
+ */
+typedef esp_err_t (*json_stream_value_cb_t)(void *ctx, int field, const char *data, size_t len, bool done);
+
+/**
+ * @brief Parser state, treat as opaque
+ */
+typedef struct {
+    const char *const *paths;       // Dotted object paths, e.g. "certificate.content"
+    size_t path_count;
+    json_stream_value_cb_t cb;
+    void *ctx;
+
+    uint8_t depth;
+    bool is_object[JSON_STREAM_MAX_DEPTH];
+    char key[JSON_STREAM_MAX_DEPTH][JSON_STREAM_MAX_KEY];
+    uint8_t index[JSON_STREAM_MAX_DEPTH];   // Element of the array at each level
+    uint8_t key_len;
+
+    bool expect_key;
+    bool in_string;
+    bool string_is_key;
+    bool escape;
+    uint8_t unicode_left;
+    uint32_t unicode;
+    int field;                      // Matched path index for the current string, -1 if none
+
+    char out[64];
+    size_t out_len;
+    esp_err_t error;
+} json_stream_t;
+
+/**
+ * @brief Prepare a parser
+ *
+ * Array elements are addressed by their index, e.g. "networks.1.ssid"
+ * for the ssid of the second object in networks; elements from 255 on never
+ * match. Keys longer than JSON_STREAM_MAX_KEY - 1 never match.
+ *
+ * @param js Parser state
+ * @param paths Dotted paths to extract, must outlive the parser
+ * @param path_count Number of entries in paths
+ * @param cb Callback receiving matched values
+ * @param ctx User context for cb
+ */
+void json_stream_init(json_stream_t *js, const char *const *paths, size_t path_count,
+                      json_stream_value_cb_t cb, void *ctx);
+
+/**
+ * @brief Feed the next piece of the document
+ *
+ * @param js Parser state
+ * @param data Document bytes
+ * @param len Number of bytes
+ * @return ESP_OK, ESP_ERR_INVALID_RESPONSE on malformed input, or the
+ *         error returned by the callback
+ */
+esp_err_t json_stream_feed(json_stream_t *js, const char *data, size_t len);
+
+/**
+ * @brief Check that the document ended cleanly
+ *
+ * @param js Parser state
+ * @return ESP_OK if all containers and strings were closed
+ */
+esp_err_t json_stream_finish(json_stream_t *js);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JSON_STREAM_H
@@ -0,0 +1,473 @@
+/* JSON View Implementation
+ *
+ * Recursive descent over the buffer, bounded by JSON_VIEW_MAX_DEPTH. The
+ * parse validates the full grammar (string escapes included) so that the
+ * accessors can decode without further checks.
+ */
+
+#include <string.h>
+#include "json_view.h"
+
+typedef struct {
+    const char *s;
+    size_t len;
+    size_t pos;
+    json_view_tok_t *toks;
+    size_t cap;
+    size_t count;
+    esp_err_t err;
+} parser_t;
+
+static bool fail(parser_t *p, esp_err_t err)
+{
+    if (p->err == ESP_OK) {
+        p->err = err;
+    }
+    return false;
+}
+
+static void skip_ws(parser_t *p)
+{
+    while (p->pos < p->len &&
+           (p->s[p->pos] == ' ' || p->s[p->pos] == '\t' || p->s[p->pos] == '\n' || p->s[p->pos] == '\r')) {
+        p->pos++;
+    }
+}
+
+static int new_tok(parser_t *p, json_view_type_t type, size_t start)
+{
+    if (p->count >= p->cap) {
+        fail(p, ESP_ERR_NO_MEM);
+        return -1;
+    }
+    json_view_tok_t *t = &p->toks[p->count];
+    memset(t, 0, sizeof(*t));
+    t->type = type;
+    t->start = start;
+    return (int)p->count++;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool parse_string(parser_t *p)
+{
+    int t = new_tok(p, JSON_VIEW_STRING, ++p->pos);     // Past the opening quote
+    if (t < 0) {
+        return false;
+    }
+    while (p->pos < p->len) {
+        unsigned char c = p->s[p->pos];
+        if (c == '"') {
+            p->toks[t].len = p->pos - p->toks[t].start;
+            p->toks[t].next = p->count;
+            p->pos++;
+            return true;
+        }
+        if (c < 0x20) {
+            break;
+        }
+        if (c == '\\') {
+            p->toks[t].escaped = true;
+            if (++p->pos >= p->len) {
+                break;
+            }
+            c = p->s[p->pos];
+            if (c == 'u') {
+                if (p->pos + 4 >= p->len) {
+                    break;
+                }
+                for (int i = 1; i <= 4; i++) {
+                    if (hex_value(p->s[p->pos + i]) < 0) {
+                        return fail(p, ESP_ERR_INVALID_RESPONSE);
+                    }
+                }
+                p->pos += 4;
+            } else if (strchr("\"\\/bfnrt", c) == NULL || c == '\0') {
+                break;
+            }
+        }
+        p->pos++;
+    }
+    return fail(p, ESP_ERR_INVALID_RESPONSE);
+}
+
+static bool parse_digits(parser_t *p)
+{
+    size_t start = p->pos;
+    while (p->pos < p->len && p->s[p->pos] >= '0' && p->s[p->pos] <= '9') {
+        p->pos++;
+    }
+    return p->pos > start;
+}
+
+static bool parse_number(parser_t *p)
+{
+    size_t start = p->pos;
+    if (p->s[p->pos] == '-') {
+        p->pos++;
+    }
+    if (p->pos < p->len && p->s[p->pos] == '0') {
+        p->pos++;
+    } else if (!parse_digits(p)) {
+        return fail(p, ESP_ERR_INVALID_RESPONSE);
+    }
+    if (p->pos < p->len && p->s[p->pos] == '.') {
+        p->pos++;
+        if (!parse_digits(p)) {
+            return fail(p, ESP_ERR_INVALID_RESPONSE);
+        }
+    }
+    if (p->pos < p->len && (p->s[p->pos] == 'e' || p->s[p->pos] == 'E')) {
+        p->pos++;
+        if (p->pos < p->len && (p->s[p->pos] == '+' || p->s[p->pos] == '-')) {
+            p->pos++;
+        }
+        if (!parse_digits(p)) {
+            return fail(p, ESP_ERR_INVALID_RESPONSE);
+        }
+    }
+
+    int t = new_tok(p, JSON_VIEW_NUMBER, start);
+    if (t < 0) {
+        return false;
+    }
+    p->toks[t].len = p->pos - start;
+    p->toks[t].next = p->count;
+    return true;
+}
+
+static bool parse_literal(parser_t *p, const char *word, json_view_type_t type)
+{
+    size_t n = strlen(word);
+    if (p->len - p->pos < n || memcmp(p->s + p->pos, word, n) != 0) {
+        return fail(p, ESP_ERR_INVALID_RESPONSE);
+    }
+    int t = new_tok(p, type, p->pos);
+    if (t < 0) {
+        return false;
+    }
+    p->toks[t].len = n;
+    p->toks[t].next = p->count;
+    p->pos += n;
+    return true;
+}
+
+static bool parse_value(parser_t *p, int depth);
+
+/**
+ * @brief Object or array: members are a key string, ':' and a value
+ */
+static bool parse_container(parser_t *p, int depth, bool object)
+{
+    if (depth >= JSON_VIEW_MAX_DEPTH) {
+        return fail(p, ESP_ERR_INVALID_RESPONSE);
+    }
+    int t = new_tok(p, object ? JSON_VIEW_OBJECT : JSON_VIEW_ARRAY, p->pos);
+    if (t < 0) {
+        return false;
+    }
+    const char close = object ? '}' : ']';
+    p->pos++;
+    skip_ws(p);
+
+    if (p->pos < p->len && p->s[p->pos] == close) {
+        p->pos++;
+    } else {
+        while (1) {
+            skip_ws(p);
+            if (object) {
+                if (p->pos >= p->len || p->s[p->pos] != '"' || !parse_string(p)) {
+                    return fail(p, ESP_ERR_INVALID_RESPONSE);
+                }
+                skip_ws(p);
+                if (p->pos >= p->len || p->s[p->pos] != ':') {
+                    return fail(p, ESP_ERR_INVALID_RESPONSE);
+                }
+                p->pos++;
+            }
+            if (!parse_value(p, depth + 1)) {
+                return false;
+            }
+            if (p->toks[t].count == UINT16_MAX) {
+                return fail(p, ESP_ERR_NO_MEM);
+            }
+            p->toks[t].count++;
+            skip_ws(p);
+            if (p->pos < p->len && p->s[p->pos] == ',') {
+                p->pos++;
+                continue;
+            }
+            if (p->pos < p->len && p->s[p->pos] == close) {
+                p->pos++;
+                break;
+            }
+            return fail(p, ESP_ERR_INVALID_RESPONSE);
+        }
+    }
+
+    p->toks[t].len = p->pos - p->toks[t].start;
+    p->toks[t].next = p->count;
+    return true;
+}
+
+static bool parse_value(parser_t *p, int depth)
+{
+    skip_ws(p);
+    if (p->pos >= p->len) {
+        return fail(p, ESP_ERR_INVALID_RESPONSE);
+    }
+    switch (p->s[p->pos]) {
+    case '{':
+        return parse_container(p, depth, true);
+    case '[':
+        return parse_container(p, depth, false);
+    case '"':
+        return parse_string(p);
+    case 't':
+        return parse_literal(p, "true", JSON_VIEW_TRUE);
+    case 'f':
+        return parse_literal(p, "false", JSON_VIEW_FALSE);
+    case 'n':
+        return parse_literal(p, "null", JSON_VIEW_NULL);
+    default:
+        if (p->s[p->pos] == '-' || (p->s[p->pos] >= '0' && p->s[p->pos] <= '9')) {
+            return parse_number(p);
+        }
+        return fail(p, ESP_ERR_INVALID_RESPONSE);
+    }
+}
+
+esp_err_t json_view_parse(json_view_t *view, const char *json, size_t len,
+                          json_view_tok_t *toks, size_t tok_cap)
+{
+    parser_t p = {
+        .s = json,
+        .len = len,
+        .toks = toks,
+        .cap = tok_cap < UINT16_MAX ? tok_cap : UINT16_MAX,
+        .err = ESP_OK,
+    };
+
+    memset(view, 0, sizeof(*view));
+    if (json == NULL || toks == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (parse_value(&p, 0)) {
+        skip_ws(&p);
+        if (p.pos != p.len) {
+            fail(&p, ESP_ERR_INVALID_RESPONSE);
+        }
+    }
+    if (p.err != ESP_OK) {
+        return p.err;
+    }
+
+    view->json = json;
+    view->len = len;
+    view->toks = toks;
+    view->tok_count = p.count;
+    return ESP_OK;
+}
+
+static bool is_type(const json_view_t *view, int tok, json_view_type_t type)
+{
+    return tok >= 0 && (size_t)tok < view->tok_count && view->toks[tok].type == type;
+}
+
+static unsigned read_hex4(const char *s)
+{
+    return (hex_value(s[0]) << 12) | (hex_value(s[1]) << 8) | (hex_value(s[2]) << 4) | hex_value(s[3]);
+}
+
+/**
+ * @brief Decode the next character of a validated string as UTF-8
+ *
+ * @return Bytes written to out (1-4)
+ */
+static size_t decode_next(const char **pp, const char *end, char out[4])
+{
+    const char *p = *pp;
+    if (*p != '\\') {
+        out[0] = *p;
+        *pp = p + 1;
+        return 1;
+    }
+
+    char c = p[1];
+    *pp = p + 2;
+    switch (c) {
+    case 'b': out[0] = '\b'; return 1;
+    case 'f': out[0] = '\f'; return 1;
+    case 'n': out[0] = '\n'; return 1;
+    case 'r': out[0] = '\r'; return 1;
+    case 't': out[0] = '\t'; return 1;
+    case 'u': break;
+    default:  out[0] = c;    return 1;     // \" \\ and \/
+    }
+
+    unsigned cp = read_hex4(p + 2);
+    *pp = p + 6;
+    if (cp >= 0xD800 && cp <= 0xDBFF) {
+        // A high surrogate is only meaningful with its low half
+        if (end - *pp >= 6 && (*pp)[0] == '\\' && (*pp)[1] == 'u') {
+            unsigned lo = read_hex4(*pp + 2);
+            if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                *pp += 6;
+            } else {
+                cp = 0xFFFD;
+            }
+        } else {
+            cp = 0xFFFD;
+        }
+    } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+        cp = 0xFFFD;
+    }
+
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+bool json_view_str_eq(const json_view_t *view, int tok, const char *s)
+{
+    if (!is_type(view, tok, JSON_VIEW_STRING) || s == NULL) {
+        return false;
+    }
+    const json_view_tok_t *t = &view->toks[tok];
+    const char *p = view->json + t->start;
+    const char *end = p + t->len;
+
+    if (!t->escaped) {
+        return strlen(s) == t->len && memcmp(p, s, t->len) == 0;
+    }
+    size_t rem = strlen(s);
+    while (p < end) {
+        char ch[4];
+        size_t n = decode_next(&p, end, ch);
+        if (rem < n || memcmp(s, ch, n) != 0) {
+            return false;
+        }
+        s += n;
+        rem -= n;
+    }
+    return rem == 0;
+}
+
+int json_view_str_copy(const json_view_t *view, int tok, char *out, size_t size)
+{
+    if (!is_type(view, tok, JSON_VIEW_STRING) || size == 0) {
+        return -1;
+    }
+    const json_view_tok_t *t = &view->toks[tok];
+    const char *p = view->json + t->start;
+    const char *end = p + t->len;
+    size_t len = 0;
+
+    while (p < end) {
+        char ch[4];
+        size_t n = decode_next(&p, end, ch);
+        if (len + n >= size) {
+            out[0] = '\0';
+            return -1;
+        }
+        memcpy(out + len, ch, n);
+        len += n;
+    }
+    out[len] = '\0';
+    return (int)len;
+}
+
+int json_view_get(const json_view_t *view, int object, const char *key)
+{
+    if (!is_type(view, object, JSON_VIEW_OBJECT)) {
+        return -1;
+    }
+    int child = object + 1;
+    for (unsigned i = 0; i < view->toks[object].count; i++) {
+        int value = child + 1;
+        if (json_view_str_eq(view, child, key)) {
+            return value;
+        }
+        child = view->toks[value].next;
+    }
+    return -1;
+}
+
+int json_view_at(const json_view_t *view, int array, size_t index)
+{
+    if (!is_type(view, array, JSON_VIEW_ARRAY) || index >= view->toks[array].count) {
+        return -1;
+    }
+    int child = array + 1;
+    while (index-- > 0) {
+        child = view->toks[child].next;
+    }
+    return child;
+}
+
+esp_err_t json_view_int(const json_view_t *view, int tok, int64_t *out)
+{
+    if (!is_type(view, tok, JSON_VIEW_NUMBER)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const char *p = view->json + view->toks[tok].start;
+    const char *end = p + view->toks[tok].len;
+    bool negative = (*p == '-');
+    uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t v = 0;
+
+    for (p += negative; p < end; p++) {
+        if (*p < '0' || *p > '9') {
+            return ESP_ERR_INVALID_ARG;     // Fraction or exponent
+        }
+        unsigned d = *p - '0';
+        if (v > (limit - d) / 10) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        v = v * 10 + d;
+    }
+    *out = negative ? (int64_t)(0 - v) : (int64_t)v;
+    return ESP_OK;
+}
+
+esp_err_t json_view_bool(const json_view_t *view, int tok, bool *out)
+{
+    if (is_type(view, tok, JSON_VIEW_TRUE)) {
+        *out = true;
+    } else if (is_type(view, tok, JSON_VIEW_FALSE)) {
+        *out = false;
+    } else {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
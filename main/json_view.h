@@ -0,0 +1,123 @@
+/* JSON View Header
+ *
+ * Read-only, in-situ JSON parser for inbound MQTT payloads. The document
+ * is validated once into a caller-provided token array; every token is an
+ * offset and length into the original buffer, so nothing is allocated or
+ * copied. String escapes are decoded only when a value is compared or
+ * copied out.
+ *
+ * The buffer must stay valid and unchanged while the view is used. For
+ * MQTT_EVENT_DATA that is the duration of the callback, and only for
+ * messages that arrive in one chunk (offset 0, len == total_len).
+ */
+
+#ifndef JSON_VIEW_H
+#define JSON_VIEW_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JSON_VIEW_MAX_DEPTH 16
+
+typedef enum {
+    JSON_VIEW_OBJECT,
+    JSON_VIEW_ARRAY,
+    JSON_VIEW_STRING,
+    JSON_VIEW_NUMBER,
+    JSON_VIEW_TRUE,
+    JSON_VIEW_FALSE,
+    JSON_VIEW_NULL,
+} json_view_type_t;
+
+/**
+ * @brief One value (or object key) in the document
+ *
+ * Object members are stored as a key token followed by the value's
+ * tokens. For strings, start/len cover the text between the quotes.
+ */
+typedef struct {
+    uint8_t type;               // json_view_type_t
+    bool escaped;               // String contains backslash escapes
+    uint16_t count;             // Members (object) or elements (array)
+    uint16_t next;              // Index of the token after this subtree
+    uint32_t start;
+    uint32_t len;
+} json_view_tok_t;
+
+typedef struct {
+    const char *json;
+    size_t len;
+    json_view_tok_t *toks;
+    size_t tok_count;
+} json_view_t;
+
+/**
+ * @brief Validate json and index it into toks
+ *
+ * Token 0 is the root value. An object needs 1 + 2 tokens per member
+ * plus its values' own tokens; an array 1 plus its elements'.
+ *
+ * @param view View to fill
+ * @param json Document, need not be NUL-terminated
+ * @param len Document length
+ * @param toks Token storage
+ * @param tok_cap Number of entries in toks (at most 65535)
+ * @return ESP_OK, ESP_ERR_INVALID_RESPONSE for malformed JSON or nesting
+ *         beyond JSON_VIEW_MAX_DEPTH, ESP_ERR_NO_MEM if toks is too small
+ */
+esp_err_t json_view_parse(json_view_t *view, const char *json, size_t len,
+                          json_view_tok_t *toks, size_t tok_cap);
+
+/**
+ * @brief Value token of an object member, matched case-sensitively
+ *
+ * @return Token index, or -1 if object is not an object or has no such key
+ */
+int json_view_get(const json_view_t *view, int object, const char *key);
+
+/**
+ * @brief Token of an array element
+ *
+ * @return Token index, or -1 if array is not an array or is too short
+ */
+int json_view_at(const json_view_t *view, int array, size_t index);
+
+/**
+ * @brief Compare a string token with s, decoding escapes on the fly
+ */
+bool json_view_str_eq(const json_view_t *view, int tok, const char *s);
+
+/**
+ * @brief Decode a string token into out
+ *
+ * @param out Buffer, always NUL-terminated when size > 0
+ * @return Decoded length, or -1 if tok is not a string or out is too small
+ */
+int json_view_str_copy(const json_view_t *view, int tok, char *out, size_t size);
+
+/**
+ * @brief Read a number token as an integer
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if tok is not an integral number
+ *         that fits in int64_t
+ */
+esp_err_t json_view_int(const json_view_t *view, int tok, int64_t *out);
+
+/**
+ * @brief Read a true/false token
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if tok is not a boolean
+ */
+esp_err_t json_view_bool(const json_view_t *view, int tok, bool *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JSON_VIEW_H
@@ -0,0 +1,306 @@
+/* KLL Quantile Sketch Implementation
+ *
+ * All levels share one buffer, level 0 lowest and the free space below
+ * it, so an update is a single store and a compaction only moves the
+ * levels under the one being compacted. Levels are sorted when they are
+ * compacted, queried or encoded, never on insert.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "kll_sketch.h"
+#include "esp_random.h"
+
+#define CAPACITY KLL_SKETCH_CAPACITY
+
+static inline uint16_t level_size(const kll_sketch_t *s, int h)
+{
+    return s->levels[h + 1] - s->levels[h];
+}
+
+/**
+ * @brief Capacity of level h: k at the top, 2/3 of that per level below, at least 2
+ */
+static uint16_t level_capacity(const kll_sketch_t *s, int h)
+{
+    uint32_t cap = KLL_SKETCH_K;
+    for (int depth = s->num_levels - 1 - h; depth > 0 && cap > 2; depth--) {
+        cap = cap * 2 / 3;
+    }
+    return cap < 2 ? 2 : cap;
+}
+
+static void sort_items(int32_t *v, size_t n)
+{
+    // Insertion sort: levels are small and often partly sorted already
+    for (size_t i = 1; i < n; i++) {
+        int32_t x = v[i];
+        size_t j = i;
+        while (j > 0 && v[j - 1] > x) {
+            v[j] = v[j - 1];
+            j--;
+        }
+        v[j] = x;
+    }
+}
+
+static void sort_levels(kll_sketch_t *s)
+{
+    for (int h = 0; h < s->num_levels; h++) {
+        sort_items(&s->items[s->levels[h]], level_size(s, h));
+    }
+}
+
+static void add_level(kll_sketch_t *s)
+{
+    s->num_levels++;
+    s->levels[s->num_levels] = CAPACITY;
+}
+
+/**
+ * @brief Level to compact when the buffer is full, or -1 if none can be
+ *
+ * The lowest level at its capacity, otherwise the lowest holding a pair.
+ * The top level cannot be promoted once KLL_SKETCH_MAX_LEVELS exist.
+ */
+static int pick_level(const kll_sketch_t *s)
+{
+    int top = s->num_levels < KLL_SKETCH_MAX_LEVELS ? s->num_levels : s->num_levels - 1;
+    for (int h = 0; h < top; h++) {
+        if (level_size(s, h) >= level_capacity(s, h)) {
+            return h;
+        }
+    }
+    for (int h = 0; h < top; h++) {
+        if (level_size(s, h) >= 2) {
+            return h;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Promote every other item of level h to level h + 1
+ *
+ * With an odd count the smallest item stays behind. Frees half of the
+ * promoted pairs' slots, which the levels below move up into.
+ */
+static void compact_level(kll_sketch_t *s, int h)
+{
+    if (h + 1 == s->num_levels) {
+        add_level(s);
+    }
+    int32_t *it = s->items;
+    uint16_t a = s->levels[h];
+    uint16_t b = s->levels[h + 1];
+    uint16_t size = b - a;
+    sort_items(&it[a], size);
+
+    uint16_t odd = size & 1;
+    uint16_t m = (size - odd) / 2;
+    uint16_t offset = esp_random() & 1;
+    // Survivors go to the top of level h's old range; each lands at or above where it is read
+    for (int i = m - 1; i >= 0; i--) {
+        it[b - m + i] = it[a + odd + 2 * i + offset];
+    }
+    if (odd) {
+        it[b - m - 1] = it[a];
+    }
+
+    uint16_t low = s->levels[0];
+    memmove(&it[low + m], &it[low], (a - low) * sizeof(int32_t));
+    for (int i = 0; i < h; i++) {
+        s->levels[i] += m;
+    }
+    s->levels[h] = b - m - odd;
+    s->levels[h + 1] = b - m;
+}
+
+/**
+ * @brief Make room for at least one item
+ */
+static bool make_room(kll_sketch_t *s)
+{
+    if (s->levels[0] > 0) {
+        return true;
+    }
+    int h = pick_level(s);
+    if (h < 0) {
+        return false;
+    }
+    compact_level(s, h);
+    return true;
+}
+
+void kll_sketch_init(kll_sketch_t *s)
+{
+    s->n = 0;
+    s->min = INT32_MAX;
+    s->max = INT32_MIN;
+    s->num_levels = 1;
+    s->levels[0] = CAPACITY;
+    s->levels[1] = CAPACITY;
+}
+
+void kll_sketch_update(kll_sketch_t *s, int32_t value)
+{
+    if (!make_room(s)) {
+        return;
+    }
+    s->items[--s->levels[0]] = value;
+    s->n++;
+    if (value < s->min) {
+        s->min = value;
+    }
+    if (value > s->max) {
+        s->max = value;
+    }
+}
+
+void kll_sketch_merge(kll_sketch_t *dst, const kll_sketch_t *src)
+{
+    if (src->n == 0) {
+        return;
+    }
+    while (dst->num_levels < src->num_levels) {
+        add_level(dst);
+    }
+
+    for (int h = src->num_levels - 1; h >= 0; h--) {
+        const int32_t *from = &src->items[src->levels[h]];
+        uint16_t left = level_size(src, h);
+        while (left > 0) {
+            if (!make_room(dst)) {
+                return;
+            }
+            // Move the levels below h down by `chunk` and fill the gap at the bottom of level h
+            uint16_t chunk = left < dst->levels[0] ? left : dst->levels[0];
+            uint16_t low = dst->levels[0];
+            memmove(&dst->items[low - chunk], &dst->items[low], (dst->levels[h] - low) * sizeof(int32_t));
+            for (int i = 0; i <= h; i++) {
+                dst->levels[i] -= chunk;
+            }
+            memcpy(&dst->items[dst->levels[h]], from, chunk * sizeof(int32_t));
+            from += chunk;
+            left -= chunk;
+        }
+    }
+
+    dst->n += src->n;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+esp_err_t kll_sketch_quantiles(kll_sketch_t *s, const float *q, size_t n, int32_t *out)
+{
+    if (s->n == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!(q[i] >= 0.0f && q[i] <= 1.0f) || (i > 0 && q[i] < q[i - 1])) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    sort_levels(s);
+
+    // Weighted merge of the sorted levels, smallest item first
+    uint64_t total = 0;
+    uint16_t cursor[KLL_SKETCH_MAX_LEVELS];
+    for (int h = 0; h < s->num_levels; h++) {
+        total += (uint64_t)level_size(s, h) << h;
+        cursor[h] = s->levels[h];
+    }
+    uint64_t rank = 0;
+    size_t qi = 0;
+    while (qi < n && q[qi] <= 0.0f) {
+        out[qi++] = s->min;
+    }
+    while (qi < n && q[qi] < 1.0f) {
+        int best = -1;
+        for (int h = 0; h < s->num_levels; h++) {
+            if (cursor[h] < s->levels[h + 1] &&
+                (best < 0 || s->items[cursor[h]] < s->items[cursor[best]])) {
+                best = h;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        int32_t value = s->items[cursor[best]++];
+        rank += (uint64_t)1 << best;
+        while (qi < n && q[qi] < 1.0f && (double)rank >= (double)q[qi] * (double)total) {
+            out[qi++] = value;
+        }
+    }
+    // The extremes are tracked exactly
+    while (qi < n) {
+        out[qi++] = s->max;
+    }
+    return ESP_OK;
+}
+
+typedef struct {
+    uint8_t *out;
+    size_t size;
+    size_t len;
+    bool overflow;
+} byte_writer_t;
+
+static void put_varint(byte_writer_t *w, uint32_t v)
+{
+    do {
+        uint8_t byte = v & 0x7F;
+        v >>= 7;
+        if (v != 0) {
+            byte |= 0x80;
+        }
+        if (w->len < w->size) {
+            w->out[w->len++] = byte;
+        } else {
+            w->overflow = true;
+        }
+    } while (v != 0);
+}
+
+static inline uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+esp_err_t kll_sketch_encode(kll_sketch_t *s, uint8_t *out, size_t size, size_t *len)
+{
+    if (size < 4) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    sort_levels(s);
+
+    out[0] = KLL_SKETCH_VERSION;
+    out[1] = KLL_SKETCH_K;
+    out[2] = s->num_levels;
+    out[3] = 0;
+    byte_writer_t w = { .out = out, .size = size, .len = 4 };
+    put_varint(&w, s->n);
+    put_varint(&w, zigzag(s->min));
+    put_varint(&w, zigzag(s->max));
+    for (int h = 0; h < s->num_levels; h++) {
+        put_varint(&w, level_size(s, h));
+    }
+    for (int h = 0; h < s->num_levels; h++) {
+        for (uint16_t i = s->levels[h]; i < s->levels[h + 1]; i++) {
+            if (i == s->levels[h]) {
+                put_varint(&w, zigzag(s->items[i]));
+            } else {
+                put_varint(&w, (uint32_t)s->items[i] - (uint32_t)s->items[i - 1]);
+            }
+        }
+    }
+    if (w.overflow) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *len = w.len;
+    return ESP_OK;
+}
@@ -0,0 +1,110 @@
+/* KLL Quantile Sketch Header
+ *
+ * Fixed-size streaming quantile sketch after Karnin, Lang and Liberty
+ * (KLL). Samples are kept in levels; an item at level h stands for 2^h
+ * samples. When the buffer is full the lowest level over its capacity is
+ * sorted and every other item (from a random offset) is promoted to the
+ * level above, halving the space it takes. Capacities shrink by 2/3 per
+ * level below the top, so the whole sketch stays within
+ * KLL_SKETCH_CAPACITY items however many samples it sees. The rank error
+ * is roughly 3 / KLL_SKETCH_K of n; up to about KLL_SKETCH_CAPACITY
+ * samples the sketch is exact.
+ *
+ * Two sketches merge level by level into one with the same guarantees,
+ * which is what makes them usable across windows and across devices.
+ *
+ * Encoded layout:
+ *   u8 version (1) | u8 k | u8 levels | u8 0 |
+ *   varint n | zigzag varint min | zigzag varint max |
+ *   varint item count per level, level 0 first |
+ *   items level by level, each level sorted ascending: the first as a
+ *   zigzag varint, the rest as varint differences to the previous one
+ * Varints are LEB128 (7 bits per byte, low group first).
+ */
+
+#ifndef KLL_SKETCH_H
+#define KLL_SKETCH_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KLL_SKETCH_VERSION 1
+#define KLL_SKETCH_K CONFIG_APP_AGG_SKETCH_K
+#define KLL_SKETCH_MAX_LEVELS 32
+// Sum of the level capacities at any height, with slack for the two-item floor
+#define KLL_SKETCH_CAPACITY (3 * KLL_SKETCH_K + 16)
+
+// Worst case encoded size: 5-byte varints for every item
+#define KLL_SKETCH_ENCODED_MAX (4 + 3 * 5 + KLL_SKETCH_MAX_LEVELS * 2 + KLL_SKETCH_CAPACITY * 5)
+
+/**
+ * @brief Sketch state, plain data that may be copied with memcpy
+ *
+ * Level h holds items[levels[h]] to items[levels[h + 1] - 1]; the free
+ * space is below levels[0].
+ */
+typedef struct {
+    uint32_t n;                     // Samples seen
+    int32_t min;                    // Only meaningful when n > 0
+    int32_t max;
+    uint8_t num_levels;
+    uint16_t levels[KLL_SKETCH_MAX_LEVELS + 1];
+    int32_t items[KLL_SKETCH_CAPACITY];
+} kll_sketch_t;
+
+/**
+ * @brief Empty the sketch
+ */
+void kll_sketch_init(kll_sketch_t *s);
+
+/**
+ * @brief Add one sample
+ *
+ * Constant time except when the buffer is full, which compacts one level
+ * (a sort of at most KLL_SKETCH_CAPACITY items).
+ */
+void kll_sketch_update(kll_sketch_t *s, int32_t value);
+
+/**
+ * @brief Merge src into dst; src is left unchanged
+ */
+void kll_sketch_merge(kll_sketch_t *dst, const kll_sketch_t *src);
+
+/**
+ * @brief Estimate several quantiles in one pass
+ *
+ * Sorts each level in place, which does not change what the sketch
+ * represents.
+ *
+ * @param q Quantiles in [0, 1], ascending
+ * @param n Number of quantiles
+ * @param out One value per quantile: the smallest item whose weighted
+ *            rank reaches q * n
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if the sketch is empty,
+ *         ESP_ERR_INVALID_ARG for quantiles out of range or order
+ */
+esp_err_t kll_sketch_quantiles(kll_sketch_t *s, const float *q, size_t n, int32_t *out);
+
+/**
+ * @brief Serialize the sketch for merging elsewhere
+ *
+ * Sorts each level in place, like kll_sketch_quantiles().
+ *
+ * @param out Output buffer; KLL_SKETCH_ENCODED_MAX bytes always suffice
+ * @param size Size of out
+ * @param len Encoded length on success
+ * @return ESP_OK, or ESP_ERR_INVALID_SIZE if out is too small
+ */
+esp_err_t kll_sketch_encode(kll_sketch_t *s, uint8_t *out, size_t size, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KLL_SKETCH_H
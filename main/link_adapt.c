@@ -0,0 +1,128 @@
+/* Link Adaptation Implementation
+ *
+ * A metric that has no sample yet (no AP, no acknowledged PUBLISH, no
+ * write on this boot) does not vote. Retransmits vote too: any since the
+ * last sample keep the link from rating good, and a burst of them rates
+ * it poor even while the averages still look fine.
+ */
+
+#include "link_adapt.h"
+
+#if CONFIG_MQTT_BATCH_ADAPTIVE
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "mqtt_outbox_pool.h"
+#include "mqtt_tls_transport.h"
+
+static const char *TAG = "link_adapt";
+
+#define WRITE_GOOD_US       20000
+#define WRITE_POOR_US       250000
+#define POOR_RETRANSMITS    4
+#define MAX_FLUSH_MS        60000
+
+static const char *const s_quality_names[] = { "good", "fair", "poor" };
+
+static int64_t s_next_us = 0;
+static uint32_t s_retransmits = 0;
+static link_quality_t s_candidate = LINK_QUALITY_FAIR;
+static int s_better = 0;
+
+static link_quality_t worse(link_quality_t a, link_quality_t b)
+{
+    return a > b ? a : b;
+}
+
+static link_quality_t rate(int value, int good, int poor)
+{
+    return value <= good ? LINK_QUALITY_GOOD : value >= poor ? LINK_QUALITY_POOR : LINK_QUALITY_FAIR;
+}
+
+static void apply(link_adapt_profile_t *profile, link_quality_t quality)
+{
+    profile->quality = quality;
+    switch (quality) {
+    case LINK_QUALITY_GOOD:
+        profile->flush_ms = LINK_ADAPT_MIN_FLUSH_MS;
+        profile->flush_bytes = CONFIG_MQTT_BATCH_BUFFER_SIZE / 4;
+        profile->compress = false;
+        break;
+    case LINK_QUALITY_FAIR:
+        profile->flush_ms = CONFIG_MQTT_BATCH_INTERVAL_MS;
+        profile->flush_bytes = CONFIG_MQTT_BATCH_BUFFER_SIZE;
+        profile->compress = true;
+        break;
+    case LINK_QUALITY_POOR:
+        profile->flush_ms = CONFIG_MQTT_BATCH_INTERVAL_MS * 4 < MAX_FLUSH_MS ?
+                            CONFIG_MQTT_BATCH_INTERVAL_MS * 4 : MAX_FLUSH_MS;
+        profile->flush_bytes = CONFIG_MQTT_BATCH_BUFFER_SIZE;
+        profile->compress = true;
+        break;
+    }
+#if !CONFIG_MQTT_BATCH_COMPRESS
+    profile->compress = false;
+#endif
+}
+
+void link_adapt_init(link_adapt_profile_t *profile)
+{
+    apply(profile, LINK_QUALITY_FAIR);
+}
+
+bool link_adapt_update(link_adapt_profile_t *profile)
+{
+    int64_t now = esp_timer_get_time();
+    if (now < s_next_us) {
+        return false;
+    }
+    s_next_us = now + (int64_t)LINK_ADAPT_PERIOD_MS * 1000;
+
+    link_quality_t q = LINK_QUALITY_GOOD;
+    wifi_ap_record_t ap;
+    int rssi = 0;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        rssi = ap.rssi;
+        // Higher is better for RSSI, so rate its negation
+        q = worse(q, rate(-rssi, -CONFIG_MQTT_BATCH_ADAPT_RSSI_GOOD, -CONFIG_MQTT_BATCH_ADAPT_RSSI_POOR));
+    }
+    mqtt_outbox_rtt_t rtt;
+    mqtt_outbox_pool_get_rtt(&rtt);
+    if (rtt.samples > 0) {
+        q = worse(q, rate(rtt.srtt_ms, CONFIG_MQTT_BATCH_ADAPT_RTT_GOOD_MS, CONFIG_MQTT_BATCH_ADAPT_RTT_POOR_MS));
+    }
+    uint32_t write_us = mqtt_tls_transport_get_write_us();
+    if (write_us > 0) {
+        q = worse(q, rate(write_us, WRITE_GOOD_US, WRITE_POOR_US));
+    }
+    uint32_t retransmits = rtt.retransmits - s_retransmits;
+    s_retransmits = rtt.retransmits;
+    if (retransmits > 0) {
+        q = worse(q, retransmits >= POOR_RETRANSMITS ? LINK_QUALITY_POOR : LINK_QUALITY_FAIR);
+    }
+
+    if (q >= profile->quality) {
+        s_better = 0;
+        if (q == profile->quality) {
+            return false;
+        }
+    } else {
+        // Only rise to the worst rating seen over the run of better samples
+        s_candidate = s_better == 0 ? q : worse(s_candidate, q);
+        if (++s_better < LINK_ADAPT_RAISE_AFTER) {
+            return false;
+        }
+        q = s_candidate;
+        s_better = 0;
+    }
+
+    apply(profile, q);
+    ESP_LOGI(TAG, "Link %s (RSSI %d dBm, RTT %lu ms, write %lu us, %lu resent): flush after %lu ms or %lu bytes%s",
+             s_quality_names[q], rssi, (unsigned long)rtt.srtt_ms, (unsigned long)write_us,
+             (unsigned long)retransmits, (unsigned long)profile->flush_ms,
+             (unsigned long)profile->flush_bytes, profile->compress ? ", compressed" : "");
+    return true;
+}
+
+#endif // CONFIG_MQTT_BATCH_ADAPTIVE
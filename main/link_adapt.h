@@ -0,0 +1,97 @@
+/* Link Adaptation Header
+ *
+ * Picks the telemetry batching cadence from how the link behaves instead
+ * of one fixed setting for every site. The signal strength of the AP, the
+ * time a socket write takes (which grows when the TCP send buffer backs
+ * up) and the PUBLISH to acknowledgement round trip are sampled every
+ * LINK_ADAPT_PERIOD_MS and the link is rated by its worst one:
+ *
+ *   good   flush after a quarter of CONFIG_MQTT_BATCH_INTERVAL_MS or a
+ *          quarter of CONFIG_MQTT_BATCH_BUFFER_SIZE, uncompressed
+ *   fair   the configured interval and size, compressed if enabled
+ *   poor   four times the interval, the full buffer, compressed if enabled
+ *
+ * Weak links thus send fewer, fuller packets that the broker acknowledges
+ * in fewer round trips, and strong links keep their latency low. A rating
+ * drops at once but only rises after LINK_ADAPT_RAISE_AFTER better
+ * samples in a row, so a marginal link does not flap between settings.
+ *
+ * Heatshrink's window and lookahead are built in, so "compression level"
+ * is whether a batch is compressed at all. Built only with
+ * CONFIG_MQTT_BATCH_ADAPTIVE; otherwise the profile is the fixed
+ * configuration. Not thread-safe: the batcher calls it under its mutex.
+ */
+
+#ifndef LINK_ADAPT_H
+#define LINK_ADAPT_H
+
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LINK_ADAPT_PERIOD_MS    5000
+#define LINK_ADAPT_RAISE_AFTER  3
+
+typedef enum {
+    LINK_QUALITY_GOOD,
+    LINK_QUALITY_FAIR,
+    LINK_QUALITY_POOR,
+} link_quality_t;
+
+/**
+ * @brief Batching settings for the current link
+ */
+typedef struct {
+    link_quality_t quality;
+    uint32_t flush_ms;          // Age of the oldest sample that flushes a batch
+    uint32_t flush_bytes;       // Batch length that flushes it, at most CONFIG_MQTT_BATCH_BUFFER_SIZE
+    bool compress;              // Try heatshrink on the batch
+} link_adapt_profile_t;
+
+#if CONFIG_MQTT_BATCH_ADAPTIVE
+
+// Shortest flush interval any rating uses
+#define LINK_ADAPT_MIN_FLUSH_MS (CONFIG_MQTT_BATCH_INTERVAL_MS / 4 > 10 ? CONFIG_MQTT_BATCH_INTERVAL_MS / 4 : 10)
+
+/**
+ * @brief Sample the link if LINK_ADAPT_PERIOD_MS has passed and re-rate it
+ *
+ * @param profile Updated in place when the rating changes
+ * @return true if the rating changed
+ */
+bool link_adapt_update(link_adapt_profile_t *profile);
+
+/**
+ * @brief Profile to start with, the fair one
+ */
+void link_adapt_init(link_adapt_profile_t *profile);
+
+#else
+
+#define LINK_ADAPT_MIN_FLUSH_MS CONFIG_MQTT_BATCH_INTERVAL_MS
+
+static inline bool link_adapt_update(link_adapt_profile_t *profile) { return false; }
+
+static inline void link_adapt_init(link_adapt_profile_t *profile)
+{
+    profile->quality = LINK_QUALITY_FAIR;
+    profile->flush_ms = CONFIG_MQTT_BATCH_INTERVAL_MS;
+    profile->flush_bytes = CONFIG_MQTT_BATCH_BUFFER_SIZE;
+#if CONFIG_MQTT_BATCH_COMPRESS
+    profile->compress = true;
+#else
+    profile->compress = false;
+#endif
+}
+
+#endif // CONFIG_MQTT_BATCH_ADAPTIVE
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LINK_ADAPT_H
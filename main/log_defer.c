@@ -0,0 +1,610 @@
+/* Deferred Log Implementation
+ *
+ * esp_log hands every line to the function installed with
+ * esp_log_set_vprintf(). Ours walks the format string once and copies the
+ * arguments it names into a record on the stack: integers, doubles and
+ * pointers by value, strings by content (truncated), since the caller's
+ * buffers are gone by the time the line is written. Format strings must
+ * live in flash so that the pointer stays valid; anything else, and any
+ * conversion the encoder does not know, is formatted on the spot instead.
+ *
+ * Records are [header][arguments] in a byte ring. Only the copy into the
+ * ring runs under the spinlock. Three positions move through it: tail
+ * (oldest retained), emit (next to write out) and head (next free). Space
+ * behind emit is reclaimed from the tail as needed; a record that would
+ * need space ahead of emit is dropped.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "log_defer.h"
+#include "esp_log.h"
+#include "esp_memory_utils.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#define LOG_RING_SIZE   CONFIG_APP_LOG_RING_SIZE
+#define LOG_RECORD_MAX  256     // Header plus arguments of one line
+#define LOG_STR_MAX     120     // Longest %s argument kept
+#define LOG_SPEC_MAX    16      // Longest conversion, "%-08.3lld" and the like
+
+#if LOG_RING_SIZE > 0
+
+#if LOG_RING_SIZE < 4 * LOG_RECORD_MAX
+#error "CONFIG_APP_LOG_RING_SIZE must be 0 or at least 1024"
+#endif
+
+static const char *TAG = "log_defer";
+
+typedef struct {
+    uint16_t len;           // Header plus arguments
+    uint16_t reserved;
+    uint32_t seq;
+    const char *fmt;        // NULL: NUL-terminated text follows
+} log_record_hdr_t;
+
+typedef enum {
+    ARG_NONE,               // "%%"
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_PTR,
+    ARG_STR,
+} arg_type_t;
+
+typedef struct {
+    size_t len;             // Characters from '%' through the conversion
+    int stars;              // '*' width and precision, each an int argument
+    int prec;               // Literal precision, -1 if none
+    bool prec_star;         // Precision is the last '*' argument
+    arg_type_t type;
+} log_spec_t;
+
+static uint8_t s_ring[LOG_RING_SIZE];
+static size_t s_head = 0;
+static size_t s_emit = 0;
+static size_t s_tail = 0;
+static size_t s_used = 0;           // Bytes from tail to head
+static size_t s_pending = 0;        // Bytes from emit to head
+static uint32_t s_seq = 1;
+static uint32_t s_dropped = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t s_task = NULL;
+static vprintf_like_t s_uart_vprintf = NULL;
+
+/**
+ * @brief Parse one conversion starting at '%'
+ *
+ * @return false for conversions the encoder does not copy (%n, %ls,
+ *         long double, anything unknown)
+ */
+static bool parse_spec(const char *p, log_spec_t *s)
+{
+    const char *start = p++;
+    s->stars = 0;
+    s->prec = -1;
+    s->prec_star = false;
+
+    if (*p == '%') {
+        s->len = 2;
+        s->type = ARG_NONE;
+        return true;
+    }
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+        p++;
+    }
+    if (*p == '*') {
+        s->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            s->stars++;
+            s->prec_star = true;
+            p++;
+        } else {
+            // A bare '.' is precision 0
+            s->prec = 0;
+            while (*p >= '0' && *p <= '9') {
+                if (s->prec < LOG_STR_MAX) {
+                    s->prec = s->prec * 10 + (*p - '0');
+                }
+                p++;
+            }
+        }
+    }
+
+    arg_type_t int_type = ARG_INT;
+    if (p[0] == 'h') {
+        p += (p[1] == 'h') ? 2 : 1;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        int_type = ARG_LLONG;
+        p += 2;
+    } else if (p[0] == 'l') {
+        int_type = ARG_LONG;
+        p++;
+    } else if (p[0] == 'j') {
+        int_type = ARG_LLONG;
+        p++;
+    } else if (p[0] == 'z') {
+        int_type = ARG_SIZE;
+        p++;
+    } else if (p[0] == 't') {
+        int_type = ARG_PTRDIFF;
+        p++;
+    } else if (p[0] == 'L' || p[0] == 'q') {
+        return false;
+    }
+    bool plain = (int_type == ARG_INT);
+
+    switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        s->type = int_type;
+        break;
+    case 'c':
+        s->type = ARG_INT;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        s->type = ARG_DOUBLE;
+        break;
+    case 'p':
+        s->type = ARG_PTR;
+        break;
+    case 's':
+        if (!plain) {
+            return false;
+        }
+        s->type = ARG_STR;
+        break;
+    default:
+        return false;
+    }
+
+    s->len = p + 1 - start;
+    return s->len < LOG_SPEC_MAX;
+}
+
+static bool put(uint8_t *rec, size_t *len, const void *v, size_t n)
+{
+    if (*len + n > LOG_RECORD_MAX) {
+        return false;
+    }
+    memcpy(rec + *len, v, n);
+    *len += n;
+    return true;
+}
+
+/**
+ * @brief Copy the arguments fmt names into rec after the header
+ *
+ * @return Record length, or 0 if the line has to be formatted now
+ */
+static size_t encode_args(uint8_t *rec, const char *fmt, va_list args)
+{
+    size_t len = sizeof(log_record_hdr_t);
+
+    for (const char *p = fmt; *p != '\0'; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        log_spec_t s;
+        if (!parse_spec(p, &s)) {
+            return 0;
+        }
+        p += s.len - 1;
+
+        int star = 0;
+        for (int i = 0; i < s.stars; i++) {
+            star = va_arg(args, int);
+            if (!put(rec, &len, &star, sizeof(star))) {
+                return 0;
+            }
+        }
+
+        bool ok = true;
+        switch (s.type) {
+        case ARG_NONE:
+            break;
+        case ARG_INT: {
+            int v = va_arg(args, int);
+            ok = put(rec, &len, &v, sizeof(v));
+            break;
+        }
+        case ARG_LONG: {
+            long v = va_arg(args, long);
+            ok = put(rec, &len, &v, sizeof(v));
+            break;
+        }
+        case ARG_LLONG: {
+            long long v = va_arg(args, long long);
+            ok = put(rec, &len, &v, sizeof(v));
+            break;
+        }
+        case ARG_SIZE: {
+            size_t v = va_arg(args, size_t);
+            ok = put(rec, &len, &v, sizeof(v));
+            break;
+        }
+        case ARG_PTRDIFF: {
+            ptrdiff_t v = va_arg(args, ptrdiff_t);
+            ok = put(rec, &len, &v, sizeof(v));
+            break;
+        }
+        case ARG_DOUBLE: {
+            double v = va_arg(args, double);
+            ok = put(rec, &len, &v, sizeof(v));
+            break;
+        }
+        case ARG_PTR: {
+            void *v = va_arg(args, void *);
+            ok = put(rec, &len, &v, sizeof(v));
+            break;
+        }
+        case ARG_STR: {
+            const char *v = va_arg(args, const char *);
+            if (v == NULL) {
+                v = "(null)";
+            }
+            // %.*s may point at a buffer without a NUL: read no further than the precision
+            int prec = s.prec_star ? star : s.prec;
+            size_t max = LOG_STR_MAX;
+            if (prec >= 0 && (size_t)prec < max) {
+                max = prec;
+            }
+            uint16_t n = strnlen(v, max);
+            ok = put(rec, &len, &n, sizeof(n)) && put(rec, &len, v, n);
+            break;
+        }
+        }
+        if (!ok) {
+            return 0;
+        }
+    }
+    return len;
+}
+
+static bool get(const uint8_t **a, const uint8_t *end, void *v, size_t n)
+{
+    if (*a + n > end) {
+        return false;
+    }
+    memcpy(v, *a, n);
+    *a += n;
+    return true;
+}
+
+// Every case passes its value in the type the encoder read it as
+#define FORMAT_ARG(v) \
+    ((s.stars == 0) ? snprintf(out + pos, size - pos, spec, (v)) : \
+     (s.stars == 1) ? snprintf(out + pos, size - pos, spec, star[0], (v)) : \
+                      snprintf(out + pos, size - pos, spec, star[0], star[1], (v)))
+
+#define DECODE_ARG(type) do { \
+        type v; \
+        if (!get(&a, end, &v, sizeof(v))) { \
+            goto done; \
+        } \
+        n = FORMAT_ARG(v); \
+    } while (0)
+
+/**
+ * @brief Format one record into out, which is always NUL-terminated
+ */
+static size_t format_record(const uint8_t *rec, size_t rec_len, char *out, size_t size)
+{
+    log_record_hdr_t hdr;
+    memcpy(&hdr, rec, sizeof(hdr));
+    const uint8_t *a = rec + sizeof(hdr);
+    const uint8_t *end = rec + rec_len;
+    size_t pos = 0;
+
+    if (hdr.fmt == NULL) {
+        size_t n = strnlen((const char *)a, end - a);
+        if (n > size - 1) {
+            n = size - 1;
+        }
+        memcpy(out, a, n);
+        out[n] = '\0';
+        return n;
+    }
+
+    for (const char *p = hdr.fmt; *p != '\0' && pos < size - 1; ) {
+        if (*p != '%') {
+            out[pos++] = *p++;
+            continue;
+        }
+        log_spec_t s;
+        parse_spec(p, &s);      // Accepted once already by encode_args()
+        char spec[LOG_SPEC_MAX];
+        memcpy(spec, p, s.len);
+        spec[s.len] = '\0';
+        p += s.len;
+
+        int star[2] = { 0, 0 };
+        for (int i = 0; i < s.stars; i++) {
+            if (!get(&a, end, &star[i], sizeof(star[i]))) {
+                goto done;
+            }
+        }
+
+        int n = 0;
+        switch (s.type) {
+        case ARG_NONE:
+            out[pos] = '%';
+            n = 1;
+            break;
+        case ARG_INT:
+            DECODE_ARG(int);
+            break;
+        case ARG_LONG:
+            DECODE_ARG(long);
+            break;
+        case ARG_LLONG:
+            DECODE_ARG(long long);
+            break;
+        case ARG_SIZE:
+            DECODE_ARG(size_t);
+            break;
+        case ARG_PTRDIFF:
+            DECODE_ARG(ptrdiff_t);
+            break;
+        case ARG_DOUBLE:
+            DECODE_ARG(double);
+            break;
+        case ARG_PTR:
+            DECODE_ARG(void *);
+            break;
+        case ARG_STR: {
+            uint16_t len;
+            char str[LOG_STR_MAX + 1];
+            if (!get(&a, end, &len, sizeof(len)) || len > LOG_STR_MAX ||
+                !get(&a, end, str, len)) {
+                goto done;
+            }
+            str[len] = '\0';
+            n = FORMAT_ARG(str);
+            break;
+        }
+        }
+        if (n > 0) {
+            pos += n;
+        }
+        if (pos > size - 1) {
+            pos = size - 1;
+        }
+    }
+
+done:
+    out[pos] = '\0';
+    return pos;
+}
+
+static void ring_write(size_t at, const uint8_t *src, size_t len)
+{
+    size_t first = LOG_RING_SIZE - at;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(s_ring + at, src, first);
+    memcpy(s_ring, src + first, len - first);
+}
+
+static void ring_read(size_t at, uint8_t *dst, size_t len)
+{
+    size_t first = LOG_RING_SIZE - at;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dst, s_ring + at, first);
+    memcpy(dst + first, s_ring, len - first);
+}
+
+static uint16_t ring_record_len(size_t at)
+{
+    uint8_t b[sizeof(uint16_t)];
+    ring_read(at, b, sizeof(b));
+    uint16_t len;
+    memcpy(&len, b, sizeof(len));
+    return len;
+}
+
+static int log_defer_vprintf(const char *fmt, va_list args)
+{
+    uint8_t rec[LOG_RECORD_MAX];
+    log_record_hdr_t hdr = { .fmt = fmt };
+    size_t len = 0;
+
+    if (esp_ptr_in_drom(fmt)) {
+        va_list copy;
+        va_copy(copy, args);
+        len = encode_args(rec, fmt, copy);
+        va_end(copy);
+    }
+    if (len == 0) {
+        hdr.fmt = NULL;
+        size_t room = LOG_RECORD_MAX - sizeof(hdr);
+        int n = vsnprintf((char *)rec + sizeof(hdr), room, fmt, args);
+        len = sizeof(hdr) + ((n < 0) ? 0 : ((size_t)n < room ? (size_t)n : room - 1)) + 1;
+    }
+    hdr.len = len;
+
+    bool queued = false;
+    portENTER_CRITICAL(&s_lock);
+    if (s_pending + len <= LOG_RING_SIZE) {
+        while (s_used + len > LOG_RING_SIZE) {
+            uint16_t old = ring_record_len(s_tail);
+            s_tail = (s_tail + old) % LOG_RING_SIZE;
+            s_used -= old;
+        }
+        hdr.seq = s_seq++;
+        memcpy(rec, &hdr, sizeof(hdr));
+        ring_write(s_head, rec, len);
+        s_head = (s_head + len) % LOG_RING_SIZE;
+        s_used += len;
+        s_pending += len;
+        queued = true;
+    } else {
+        s_dropped++;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (queued) {
+        xTaskNotifyGive(s_task);
+    }
+    return (int)len;
+}
+
+static bool pop_record(uint8_t *rec, size_t *len)
+{
+    bool found = false;
+    portENTER_CRITICAL(&s_lock);
+    if (s_pending > 0) {
+        *len = ring_record_len(s_emit);
+        ring_read(s_emit, rec, *len);
+        s_emit = (s_emit + *len) % LOG_RING_SIZE;
+        s_pending -= *len;
+        found = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return found;
+}
+
+static int uart_printf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = s_uart_vprintf(fmt, args);
+    va_end(args);
+    return n;
+}
+
+static void log_defer_task(void *arg)
+{
+    // Only this task touches them
+    static uint8_t rec[LOG_RECORD_MAX];
+    static char line[LOG_DEFER_LINE_MAX];
+    uint32_t reported = 0;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        size_t len;
+        while (pop_record(rec, &len)) {
+            format_record(rec, len, line, sizeof(line));
+            uart_printf("%s", line);
+        }
+
+        uint32_t dropped = log_defer_dropped();
+        if (dropped != reported) {
+            ESP_LOGW(TAG, "%lu lines dropped", (unsigned long)(dropped - reported));
+            reported = dropped;
+        }
+    }
+}
+
+esp_err_t log_defer_init(void)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    if (xTaskCreate(log_defer_task, "log_defer", 3072, NULL, tskIDLE_PRIORITY + 1, &s_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_uart_vprintf = esp_log_set_vprintf(log_defer_vprintf);
+    return ESP_OK;
+}
+
+bool log_defer_next(uint32_t *seq, char *line, size_t size)
+{
+    uint8_t rec[LOG_RECORD_MAX];
+    size_t len = 0;
+
+    if (size == 0) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    size_t at = s_tail;
+    for (size_t walked = 0; walked < s_used; ) {
+        uint16_t n = ring_record_len(at);
+        uint8_t b[sizeof(log_record_hdr_t)];
+        ring_read(at, b, sizeof(b));
+        log_record_hdr_t hdr;
+        memcpy(&hdr, b, sizeof(hdr));
+        if (hdr.seq >= *seq) {
+            ring_read(at, rec, n);
+            len = n;
+            *seq = hdr.seq + 1;
+            break;
+        }
+        at = (at + n) % LOG_RING_SIZE;
+        walked += n;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (len == 0) {
+        return false;
+    }
+    format_record(rec, len, line, size < LOG_DEFER_LINE_MAX ? size : LOG_DEFER_LINE_MAX);
+    return true;
+}
+
+uint32_t log_defer_dropped(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    uint32_t dropped = s_dropped;
+    portEXIT_CRITICAL(&s_lock);
+    return dropped;
+}
+
+bool log_defer_flush(uint32_t timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        portENTER_CRITICAL(&s_lock);
+        size_t pending = s_pending;
+        portEXIT_CRITICAL(&s_lock);
+        // One more tick in either case: the last record popped may still be printing
+        vTaskDelay(1);
+        if (pending == 0) {
+            return true;
+        }
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(timeout_ms)) {
+            return false;
+        }
+    }
+}
+
+#else // LOG_RING_SIZE == 0
+
+esp_err_t log_defer_init(void)
+{
+    return ESP_OK;
+}
+
+bool log_defer_next(uint32_t *seq, char *line, size_t size)
+{
+    return false;
+}
+
+uint32_t log_defer_dropped(void)
+{
+    return 0;
+}
+
+bool log_defer_flush(uint32_t timeout_ms)
+{
+    return true;
+}
+
+#endif
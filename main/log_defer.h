@@ -0,0 +1,68 @@
+/* Deferred Log Header
+ *
+ * Console backend for the ESP_LOGx macros. The calling task only copies
+ * the format string pointer and its arguments into a byte ring; a
+ * low-priority task formats the record and writes it to the UART. A
+ * record that would overwrite lines not yet written is dropped and
+ * counted instead of blocking the caller. Written lines stay in the ring
+ * until newer ones need the space and are served by GET /logs.
+ */
+
+#ifndef LOG_DEFER_H
+#define LOG_DEFER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOG_DEFER_LINE_MAX 256      // Longer lines are truncated
+
+/**
+ * @brief Create the writer task and route esp_log output through the ring
+ *
+ * Before this is called, and with CONFIG_APP_LOG_RING_SIZE 0, lines are
+ * written synchronously by the caller as usual.
+ *
+ * @return ESP_OK, or ESP_ERR_NO_MEM
+ */
+esp_err_t log_defer_init(void);
+
+/**
+ * @brief Format the oldest retained line at or after a sequence number
+ *
+ * Start with *seq = 0 and call until it returns false; *seq is advanced
+ * past the returned line. Lines evicted between calls are skipped.
+ *
+ * @param seq  Cursor, updated on success
+ * @param line Output buffer, always NUL-terminated
+ * @param size Size of line, at most LOG_DEFER_LINE_MAX is used
+ * @return true if a line was written to line
+ */
+bool log_defer_next(uint32_t *seq, char *line, size_t size);
+
+/**
+ * @brief Lines dropped because the ring was full of unwritten lines
+ */
+uint32_t log_defer_dropped(void);
+
+/**
+ * @brief Wait until the lines queued so far have been written out
+ *
+ * For callers about to power down (deep sleep), whose last lines would
+ * otherwise be lost with the ring.
+ *
+ * @param timeout_ms Longest wait
+ * @return true if the ring was emptied in time
+ */
+bool log_defer_flush(uint32_t timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LOG_DEFER_H
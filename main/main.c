@@ -12,21 +12,88 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_event.h"
+#include "esp_heap_caps.h"
 #include "esp_netif.h"
 #include "esp_wifi.h"
+#include "esp_system.h"
+#if CONFIG_APP_LOW_POWER
+#include "esp_pm.h"
+#endif
 #include "nvs_flash.h"
-#include "nvs.h"
+#include "device_config.h"
+#include "remote_config.h"
+#include "dns_cache.h"
+#if CONFIG_APP_CERT_RENEWAL
+#include <time.h>
+#include "esp_random.h"
+#endif
 #include "wifi_provisioning.h"
 #include "certificate_manager.h"
 #include "internet_verification.h"
 #include "mqtt_handler.h"
+#include "app_events.h"
+#include "warm_boot.h"
+#include "sta_ip.h"
+#include "wifi_conn.h"
+#include "wifi_networks.h"
+#include "factory_reset.h"
+#include "backend_client.h"
 #include "device_keys.h"
+#include "metrics.h"
+#include "stats_agg.h"
+#include "sampler.h"
+#include "log_defer.h"
+#include "retry_policy.h"
+#include "time_sync.h"
+#include "telemetry.h"
+#include "trace_marks.h"
+#if CONFIG_APP_BENCH_CORE
+#include "bench_core.h"
+#endif
+#if CONFIG_APP_BENCH_E2E
+#include "bench_e2e.h"
+#endif
+#if CONFIG_APP_STACK_PROFILE
+#include "stack_prof.h"
+#endif
+#if CONFIG_APP_PROV_RELAY
+#include "prov_relay.h"
+#endif
+#if CONFIG_APP_OTA
+#include "ota_update.h"
+#endif
+#if CONFIG_APP_CPU_PROF
+#include "cpu_prof.h"
+#endif
+#if CONFIG_MQTT_RPC
+#include "mqtt_rpc.h"
+#endif
+#if CONFIG_APP_MQTT_PROBE
+#include "mqtt_probe.h"
+#endif
+#if CONFIG_APP_ADC_STREAM
+#include "adc_stream.h"
+#endif
+#if CONFIG_APP_HEALTH
+#include "health.h"
+#endif
+#if CONFIG_APP_DUTY_CYCLE
+#include "duty_cycle.h"
+#endif
+#if CONFIG_APP_ULP_SAMPLER
+#include "agg_kernels.h"
+#include "ulp_sampler.h"
+#endif
 
 static const char *TAG = "main";
 
+// Task placement: see the "Task Placement" Kconfig menu
+#define APP_TASK_CORE (CONFIG_APP_TASK_CORE < 0 ? tskNO_AFFINITY : CONFIG_APP_TASK_CORE)
+#define APP_TASK_PRIORITY CONFIG_APP_TASK_PRIORITY
+
 // NVS keys
-#define NVS_NAMESPACE "device_config"
 #define NVS_KEY_DEVICE_ID "device_id"
 #define NVS_KEY_PROV_TOKEN "prov_token"
 
@@ -46,59 +113,421 @@ typedef enum {
 
 static app_state_t s_app_state = APP_STATE_INIT;
 
+// Names for the metrics report, indexed by app_state_t
+static const char *const s_state_names[] = {
+    "init", "check_provisioning", "ap_mode", "wifi_connecting", "wifi_connected",
+    "check_certificates", "submit_csr", "mqtt_connecting", "mqtt_connected", "error",
+};
+
+// Warm boot: reconnect to the last good AP and skip the internet probe
+static bool s_warm_boot = false;
+static warm_boot_ap_t s_warm_ap;
+
+// AP seen by the provisioning scan, tried once after new credentials arrive
+static bool s_use_hint = false;
+static warm_boot_ap_t s_hint_ap;
+
+// Startup preparation running alongside internet verification
+static volatile bool s_prep_running = false;
+static volatile bool s_prep_has_certs = false;
+
+/**
+ * @brief Prepare the MQTT connection while the state machine verifies internet access
+ *
+ * None of these steps depend on the verification result: resolving the
+ * broker only needs an IP, and loading certificates only needs NVS.
+ */
+static void startup_prep_task(void *pvParameters)
+{
+    int64_t start_us = esp_timer_get_time();
+
+    mqtt_handler_resolve_broker();
+
+    s_prep_has_certs = certificate_manager_has_certificates();
+    if (s_prep_has_certs && mqtt_handler_prepare() != ESP_OK) {
+        // mqtt_handler_start() retries the preparation on its own
+        ESP_LOGW(TAG, "MQTT preparation failed, will retry at connect");
+    }
+
+    ESP_LOGI(TAG, "Startup preparation done in %lld ms", (esp_timer_get_time() - start_us) / 1000);
+    s_prep_running = false;
+    app_events_post(APP_EVENT_PREP_DONE);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Kick off startup preparation once per connection
+ */
+static void start_prep_pipeline(void)
+{
+    if (s_prep_running) {
+        return;
+    }
+
+    app_events_clear(APP_EVENT_PREP_DONE);
+    s_prep_running = true;
+    if (xTaskCreatePinnedToCore(startup_prep_task, "startup_prep", CONFIG_APP_PREP_TASK_STACK, NULL,
+                                APP_TASK_PRIORITY, NULL, APP_TASK_CORE) != pdPASS) {
+        ESP_LOGW(TAG, "Failed to start preparation task, continuing sequentially");
+        s_prep_running = false;
+        s_prep_has_certs = certificate_manager_has_certificates();
+    }
+}
+
+// Provisioning token for CSR submission and renewal; only the state machine task reads it
+static char s_prov_token[PROVISION_TOKEN_MAX + 1];
+
 /**
  * @brief Get device ID and provisioning token from NVS
  */
 static esp_err_t get_provisioning_credentials(char *device_id, size_t id_len,
                                               char *token, size_t token_len)
 {
-    nvs_handle_t nvs_handle;
-    size_t required_size;
-
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    size_t required_size = id_len;
+    esp_err_t err = device_config_get_str(NVS_KEY_DEVICE_ID, device_id, &required_size);
     if (err != ESP_OK) {
         return err;
     }
 
-    required_size = id_len;
-    err = nvs_get_str(nvs_handle, NVS_KEY_DEVICE_ID, device_id, &required_size);
+    required_size = token_len;
+    return device_config_get_str(NVS_KEY_PROV_TOKEN, token, &required_size);
+}
+
+/**
+ * @brief Subscribe to configuration patches and commands for the provisioned device ID
+ */
+static void start_remote_config(void)
+{
+    char device_id[PROVISION_DEVICE_ID_MAX + 1] = {0};
+    size_t len = sizeof(device_id);
+    if (device_config_get_str(NVS_KEY_DEVICE_ID, device_id, &len) != ESP_OK) {
+        strlcpy(device_id, DEVICE_ID, sizeof(device_id));
+    }
+    esp_err_t err = remote_config_start(device_id);
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-        return err;
+        ESP_LOGW(TAG, "Remote configuration unavailable: %s", esp_err_to_name(err));
+    }
+    err = factory_reset_start_remote(device_id);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Remote factory reset unavailable: %s", esp_err_to_name(err));
+    }
+#if CONFIG_APP_OTA
+    err = ota_update_start_remote(device_id);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "OTA updates unavailable: %s", esp_err_to_name(err));
     }
+#endif
+#if CONFIG_APP_CPU_PROF
+    err = cpu_prof_start_remote(device_id);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "CPU profiler unavailable: %s", esp_err_to_name(err));
+    }
+#endif
+#if CONFIG_MQTT_RPC
+    err = mqtt_rpc_start(device_id);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "RPC unavailable: %s", esp_err_to_name(err));
+    }
+#endif
+#if CONFIG_APP_MQTT_PROBE
+    err = mqtt_probe_start(device_id);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Latency probe unavailable: %s", esp_err_to_name(err));
+    }
+#endif
+}
 
-    required_size = token_len;
-    err = nvs_get_str(nvs_handle, NVS_KEY_PROV_TOKEN, token, &required_size);
-    nvs_close(nvs_handle);
+/**
+ * @brief Erase provisioning, credentials and cached session data
+ *
+ * The identity (device ID, tokens, certificates and keys) goes too unless
+ * keep_identity is set. Keys generated or written at the factory (the DS
+ * key parameters live in their own namespace) are kept.
+ */
+static esp_err_t erase_device_data(bool keep_identity)
+{
+    ESP_LOGI(TAG, "Clearing %s provisioning data...", keep_identity ? "network" : "all");
+    device_config_begin();
 
+    // Erase all provisioning-related keys
+    device_config_erase("provisioned");        // Provisioning status flag
+    device_config_erase("wifi_ssid");          // WiFi SSID
+    device_config_erase("wifi_pass");          // WiFi password
+    wifi_networks_erase();                     // Network list and its history
+    sta_ip_save(NULL);                         // Static IP settings
+    warm_boot_invalidate();                    // Cached AP
+    remote_config_erase_stored();              // Configuration overrides
+    if (!keep_identity) {
+        certificate_manager_erase();           // Device ID, tokens, certificates, keys
+    }
+
+    // One commit for the whole set
+    esp_err_t err = device_config_commit();
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "✓ All provisioning data cleared");
+    } else {
+        ESP_LOGW(TAG, "Failed to clear provisioning data: %s", esp_err_to_name(err));
+    }
     return err;
 }
 
+// Aggregated metrics, see stats_agg_register()
+enum {
+    AGG_HEAP_FREE,
+    AGG_WIFI_RSSI,
+    AGG_PUBLISH_US,
+    AGG_ADC_RAW,
+};
+
+// Sampler sources, see sampler_register()
+enum {
+    SRC_HEAP_FREE,
+    SRC_WIFI_RSSI,
+};
+
+static bool read_heap_free(void *ctx, int32_t *value)
+{
+    *value = (int32_t)heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    return true;
+}
+
+static bool read_wifi_rssi(void *ctx, int32_t *value)
+{
+    int rssi;
+    if (esp_wifi_sta_get_rssi(&rssi) != ESP_OK) {
+        return false;
+    }
+    *value = rssi;
+    return true;
+}
+
+#if CONFIG_APP_DUTY_CYCLE
+static bool read_last_awake_ms(void *ctx, int32_t *value)
+{
+    duty_cycle_stats_t stats;
+    duty_cycle_get_stats(&stats);
+    *value = (int32_t)stats.last_awake_ms;
+    return true;
+}
+
+static bool read_last_radio_ms(void *ctx, int32_t *value)
+{
+    duty_cycle_stats_t stats;
+    duty_cycle_get_stats(&stats);
+    *value = (int32_t)stats.last_radio_ms;
+    return true;
+}
+
+#if CONFIG_APP_ULP_SAMPLER
+// Reduction of the ULP block taken on this wake
+static int32_t s_ulp_mean, s_ulp_min, s_ulp_max, s_ulp_count;
+
 /**
- * @brief WiFi event handler for STA connection
+ * @brief Start or rejoin the ULP and reduce what it sampled during the sleep
+ *
+ * An alarm raised by the ULP makes this wake report right away.
  */
-static void wifi_sta_event_handler(void* arg, esp_event_base_t event_base,
-                                   int32_t event_id, void* event_data)
+static void ulp_collect(void)
+{
+    if (ulp_sampler_init() != ESP_OK) {
+        return;
+    }
+    static int32_t samples[ULP_SAMPLER_RING_LEN];
+    bool alarm;
+    size_t n = ulp_sampler_drain(samples, ULP_SAMPLER_RING_LEN, &alarm);
+    int64_t sum;
+    agg_reduce_s32(samples, n, &sum, &s_ulp_min, &s_ulp_max);
+    s_ulp_count = (int32_t)n;
+    s_ulp_mean = n > 0 ? (int32_t)(sum / (int64_t)n) : 0;
+    if (alarm) {
+        ESP_LOGW(TAG, "ULP alarm: reading out of range, reporting now");
+        duty_cycle_force_report();
+    }
+}
+
+static bool read_ulp_value(void *ctx, int32_t *value)
 {
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
-        ESP_LOGI(TAG, "WiFi STA connected");
-        s_app_state = APP_STATE_WIFI_CONNECTED;
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
-        s_app_state = APP_STATE_WIFI_CONNECTED;
+    if (s_ulp_count == 0) {
+        return false;
     }
+    *value = *(const int32_t *)ctx;
+    return true;
+}
+
+static bool read_ulp_count(void *ctx, int32_t *value)
+{
+    *value = s_ulp_count;
+    return true;
 }
+#endif
+
+// Read once per wake, see duty_cycle_boot()
+static const duty_cycle_series_t s_duty_series[] = {
+    { read_heap_free, NULL, TS_BLOCK_XOR },
+    { read_last_awake_ms, NULL, TS_BLOCK_XOR },
+    { read_last_radio_ms, NULL, TS_BLOCK_XOR },
+#if CONFIG_APP_ULP_SAMPLER
+    { read_ulp_count, NULL, TS_BLOCK_XOR },
+    { read_ulp_value, &s_ulp_mean, TS_BLOCK_XOR },
+    { read_ulp_value, &s_ulp_min, TS_BLOCK_XOR },
+    { read_ulp_value, &s_ulp_max, TS_BLOCK_XOR },
+#endif
+};
+#endif
+
+/**
+ * @brief Start the aggregation engine with the built-in gauges
+ *
+ * The gauges are read by the sampling scheduler and drained into the
+ * engine, so their period does not depend on the state machine.
+ */
+static void start_stats_agg(void)
+{
+    if (stats_agg_init(CONFIG_APP_AGG_TOPIC) != ESP_OK) {
+        ESP_LOGW(TAG, "Stats aggregation unavailable");
+        return;
+    }
+    // Tumbling minute for the heap, five-minute window sliding by a minute for RSSI
+    if (sampler_register(SRC_HEAP_FREE, "heap_free", CONFIG_APP_SAMPLER_PERIOD_MS, read_heap_free, NULL) == ESP_OK &&
+        stats_agg_register(AGG_HEAP_FREE, "heap_free", 60, 60, NULL) == ESP_OK) {
+        stats_agg_bind_source(AGG_HEAP_FREE, SRC_HEAP_FREE);
+    }
+    if (sampler_register(SRC_WIFI_RSSI, "wifi_rssi", CONFIG_APP_SAMPLER_PERIOD_MS, read_wifi_rssi, NULL) == ESP_OK &&
+        stats_agg_register(AGG_WIFI_RSSI, "wifi_rssi", 300, 60, NULL) == ESP_OK) {
+        stats_agg_bind_source(AGG_WIFI_RSSI, SRC_WIFI_RSSI);
+    }
+#if CONFIG_APP_AGG_RBE
+    // Gauges that sit still most of the time: only changes and a heartbeat
+    stats_agg_set_filter(AGG_HEAP_FREE, &(rbe_filter_cfg_t){
+        .deadband = CONFIG_APP_AGG_RBE_HEAP_DEADBAND,
+        .roc_per_s = CONFIG_APP_AGG_RBE_HEAP_RATE,
+        .heartbeat_s = CONFIG_APP_AGG_RBE_HEARTBEAT_S,
+    });
+    stats_agg_set_filter(AGG_WIFI_RSSI, &(rbe_filter_cfg_t){
+        .deadband = CONFIG_APP_AGG_RBE_RSSI_DEADBAND,
+        .heartbeat_s = CONFIG_APP_AGG_RBE_HEARTBEAT_S,
+    });
+#endif
+    // Metrics publish call time, with its tail, per hour
+    if (stats_agg_register(AGG_PUBLISH_US, "publish_us", 3600, 3600, NULL) == ESP_OK) {
+        stats_agg_enable_quantiles(AGG_PUBLISH_US);
+    }
+#if CONFIG_APP_ADC_STREAM
+    // Raw readings in frames straight from the DMA, per minute
+    if (stats_agg_register(AGG_ADC_RAW, "adc_raw", 60, 60, NULL) == ESP_OK) {
+        adc_stream_start(AGG_ADC_RAW);
+    }
+#endif
+}
+
+#if CONFIG_APP_CERT_RENEWAL
+// Unix time at which this device renews, 0 until computed
+static int64_t s_renew_at = 0;
+static int64_t s_renew_retry_us = 0;
+
+/**
+ * @brief Renew the certificates ahead of expiry, called while MQTT is up
+ *
+ * Each device picks a random point in a CONFIG_APP_CERT_RENEW_SPREAD_DAYS
+ * window before the renewal margin, so a fleet issued on the same day does
+ * not renew (and reconnect) at the same moment. The session keeps running
+ * during the backend request; the new certificates are swapped in by a
+ * planned reconnect once they are stored.
+ */
+static void cert_renewal_check(void)
+{
+    time_t now = time(NULL);
+    if (now < TIME_SYNC_VALID_AFTER || esp_timer_get_time() < s_renew_retry_us) {
+        return;
+    }
+
+    if (s_renew_at == 0) {
+        int64_t not_after;
+        if (certificate_manager_get_expiry(&not_after) != ESP_OK) {
+            s_renew_retry_us = esp_timer_get_time() + (int64_t)CONFIG_APP_CERT_RENEW_RETRY_MIN * 60 * 1000000;
+            return;
+        }
+        int64_t spread_s = (int64_t)CONFIG_APP_CERT_RENEW_SPREAD_DAYS * 86400;
+        s_renew_at = not_after - (int64_t)CONFIG_APP_CERT_RENEW_BEFORE_DAYS * 86400 -
+                     (spread_s > 0 ? esp_random() % spread_s : 0);
+        ESP_LOGI(TAG, "Certificate renewal in %lld h", (long long)(s_renew_at - now) / 3600);
+    }
+    if (now < s_renew_at) {
+        return;
+    }
+
+    char device_id[PROVISION_DEVICE_ID_MAX + 1] = {0};
+    esp_err_t ret = get_provisioning_credentials(device_id, sizeof(device_id),
+                                                 s_prov_token, sizeof(s_prov_token));
+    if (ret == ESP_OK) {
+        ret = certificate_manager_renew(device_id, s_prov_token);
+    }
+    // The backend is not needed again until the next renewal
+    backend_client_close_all();
+
+    if (ret != ESP_OK) {
+        // Retry with jitter so a backend outage does not synchronize the fleet
+        int64_t retry_us = (int64_t)CONFIG_APP_CERT_RENEW_RETRY_MIN * 60 * 1000000;
+        retry_us = retry_us / 2 + esp_random() % (retry_us / 2 + 1);
+        int64_t hint_us = (int64_t)certificate_manager_retry_after_ms() * 1000;
+        if (hint_us > retry_us) {
+            retry_us = hint_us + esp_random() % (hint_us / 4 + 1);
+        }
+        s_renew_retry_us = esp_timer_get_time() + retry_us;
+        ESP_LOGW(TAG, "Certificate renewal failed: %s", esp_err_to_name(ret));
+        return;
+    }
+
+    // Planned reconnect: the handler picks up the renewed slot while preparing
+    ESP_LOGI(TAG, "Certificates renewed, reconnecting with the new ones");
+    s_renew_at = 0;
+    mqtt_handler_stop();
+    ret = mqtt_handler_start();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to restart MQTT handler: %s", esp_err_to_name(ret));
+        s_app_state = APP_STATE_ERROR;
+    }
+}
+#endif // CONFIG_APP_CERT_RENEWAL
 
 /**
  * @brief Main application state machine task
+ *
+ * Each iteration runs the handler for the current state. A handler that
+ * changes s_app_state is followed immediately by the next one; otherwise the
+ * task blocks on the event bus until one of wait_bits is posted or timeout
+ * expires (used for retry back-off); a factory reset request wakes every
+ * state. Events that woke the task are passed to the next handler in
+ * `events`.
  */
 static void app_state_machine_task(void *pvParameters)
 {
     ESP_LOGI(TAG, "Application state machine started");
 
+    EventBits_t events = 0;
+    int metrics_state = -1;
+
+    metrics_set_state_names(s_state_names, sizeof(s_state_names) / sizeof(s_state_names[0]));
+    metrics_watch_task(xTaskGetCurrentTaskHandle());
+
     while (1) {
-        switch (s_app_state) {
+        app_state_t state = s_app_state;
+        EventBits_t wait_bits = 0;
+        TickType_t timeout = portMAX_DELAY;
+
+        if ((int)state != metrics_state) {
+            if (metrics_state >= 0) {
+                TRACE_SPAN_END(TRACE_ID_STATE(metrics_state));
+            }
+            TRACE_SPAN_BEGIN(TRACE_ID_STATE(state));
+            metrics_state_enter(state);
+            metrics_state = state;
+#if CONFIG_APP_BENCH_E2E
+            bench_e2e_state(s_state_names[state]);
+#endif
+        }
+
+        switch (state) {
         case APP_STATE_INIT:
             ESP_LOGI(TAG, "State: INIT");
             s_app_state = APP_STATE_CHECK_PROVISIONING;
@@ -108,147 +537,185 @@ static void app_state_machine_task(void *pvParameters)
             ESP_LOGI(TAG, "State: CHECK_PROVISIONING");
             if (wifi_provisioning_is_provisioned()) {
                 ESP_LOGI(TAG, "Device is provisioned, connecting to WiFi...");
+                s_warm_boot = warm_boot_begin(&s_warm_ap);
                 s_app_state = APP_STATE_WIFI_CONNECTING;
             } else {
                 ESP_LOGI(TAG, "Device not provisioned, starting AP mode...");
+                warm_boot_invalidate();
                 s_app_state = APP_STATE_AP_MODE;
             }
             break;
 
         case APP_STATE_AP_MODE:
             ESP_LOGI(TAG, "State: AP_MODE");
+            if (wifi_provisioning_is_provisioned()) {
+                // Credentials arrived via POST /provision
+                ESP_LOGI(TAG, "Device is provisioned, moving to WiFi connecting state");
+                s_use_hint = wifi_provisioning_get_connect_hint(s_hint_ap.bssid, &s_hint_ap.channel);
+                s_app_state = APP_STATE_WIFI_CONNECTING;
+                break;
+            }
+
             {
-                // Check if provisioning is already active
-                // If not, start it (handles both initial start and restart after failure)
-                if (!wifi_provisioning_is_provisioned()) {
-                    // Try to start provisioning if not already active
-                    // wifi_provisioning_start() checks internally if already active
-                    esp_err_t ret = wifi_provisioning_start();
-                    if (ret != ESP_OK) {
-                        ESP_LOGE(TAG, "Failed to start provisioning: %s", esp_err_to_name(ret));
-                        ESP_LOGE(TAG, "Retrying in 5 seconds...");
-                        vTaskDelay(pdMS_TO_TICKS(5000));
-                    } else {
-                        ESP_LOGI(TAG, "Provisioning AP active. Waiting for credentials via HTTP POST /provision...");
-                    }
+                // wifi_provisioning_start() checks internally if already active
+                wait_bits = APP_EVENT_PROVISIONED;
+                esp_err_t ret = wifi_provisioning_start();
+                if (ret != ESP_OK) {
+                    ESP_LOGE(TAG, "Failed to start provisioning: %s", esp_err_to_name(ret));
+                    ESP_LOGE(TAG, "Retrying in 5 seconds...");
+                    timeout = pdMS_TO_TICKS(5000);
                 } else {
-                    // Device is provisioned, move to connecting state
-                    ESP_LOGI(TAG, "Device is provisioned, moving to WiFi connecting state");
-                    s_app_state = APP_STATE_WIFI_CONNECTING;
-                    break;
+                    ESP_LOGI(TAG, "Provisioning AP active. Waiting for credentials via HTTP POST /provision...");
+#if CONFIG_APP_PROV_RELAY
+                    prov_relay_request_start();
+#endif
                 }
-                
-                // Wait in AP mode for credentials
-                vTaskDelay(pdMS_TO_TICKS(2000));
             }
             break;
 
         case APP_STATE_WIFI_CONNECTING:
-            ESP_LOGI(TAG, "State: WIFI_CONNECTING");
-            {
-                static bool connection_attempted = false;
-                
-                if (!connection_attempted) {
-                    // Read WiFi credentials from NVS and connect
-                    nvs_handle_t nvs_handle;
-                    if (nvs_open("device_config", NVS_READONLY, &nvs_handle) == ESP_OK) {
-                        char ssid[33] = {0};
-                        char password[65] = {0};
-                        size_t required_size;
-                        
-                        required_size = sizeof(ssid);
-                        if (nvs_get_str(nvs_handle, "wifi_ssid", ssid, &required_size) == ESP_OK) {
-                            required_size = sizeof(password);
-                            nvs_get_str(nvs_handle, "wifi_password", password, &required_size);
-                            
-                            // Configure and connect to WiFi
-                            wifi_config_t wifi_config = {0};
-                            strncpy((char*)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid) - 1);
-                            strncpy((char*)wifi_config.sta.password, password, sizeof(wifi_config.sta.password) - 1);
-                            
-                            ESP_LOGI(TAG, "Connecting to WiFi: %s", ssid);
-                            esp_wifi_set_mode(WIFI_MODE_STA);
-                            esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
-                            esp_wifi_start();
-                            esp_wifi_connect();
-                            
-                            connection_attempted = true;
-                        }
-                        nvs_close(nvs_handle);
-                    }
+            if (events & APP_EVENT_WIFI_GOT_IP) {
+                s_use_hint = false;
+                metrics_mark(METRICS_MARK_WIFI_GOT_IP);
+                s_app_state = APP_STATE_WIFI_CONNECTED;
+                break;
+            }
+
+            if ((events & APP_EVENT_PROVISIONING_RESET) || !wifi_provisioning_is_provisioned()) {
+                // Credentials were cleared and the AP restarted
+                wifi_conn_stop();
+                s_warm_boot = false;
+                s_use_hint = false;
+                warm_boot_invalidate();
+                s_app_state = APP_STATE_AP_MODE;
+                break;
+            }
+
+            if ((events & APP_EVENT_WIFI_DISCONNECTED) && (s_warm_boot || s_use_hint)) {
+                // Cached AP is gone or moved; wifi_conn retries with a full scan
+                ESP_LOGW(TAG, "Connection to %s AP failed, falling back to full scan",
+                         s_warm_boot ? "cached" : "scanned");
+                if (s_warm_boot) {
+                    s_warm_boot = false;
+                    warm_boot_invalidate();
                 }
-                
-                // Wait for connection event (handled by wifi_sta_event_handler)
-                vTaskDelay(pdMS_TO_TICKS(1000));
+                s_use_hint = false;
             }
+
+            if (!wifi_conn_is_active()) {
+                ESP_LOGI(TAG, "State: WIFI_CONNECTING");
+                const warm_boot_ap_t *direct_ap = s_warm_boot ? &s_warm_ap :
+                                                  s_use_hint ? &s_hint_ap : NULL;
+                app_events_clear(APP_EVENT_PROVISIONING_RESET);
+#if CONFIG_APP_DUTY_CYCLE
+                duty_cycle_radio_on();
+#endif
+                if (wifi_conn_start(direct_ap) != ESP_OK) {
+                    ESP_LOGE(TAG, "No usable WiFi credentials in NVS, retrying in 5 seconds...");
+                    wait_bits = APP_EVENT_PROVISIONING_RESET;
+                    timeout = pdMS_TO_TICKS(5000);
+                    break;
+                }
+            }
+
+            // wifi_conn reconnects by itself; wait for the address
+            wait_bits = APP_EVENT_WIFI_GOT_IP | APP_EVENT_WIFI_DISCONNECTED |
+                        APP_EVENT_PROVISIONING_RESET;
             break;
 
         case APP_STATE_WIFI_CONNECTED:
             ESP_LOGI(TAG, "State: WIFI_CONNECTED");
             {
-                static bool verification_done = false;
                 static int verification_retries = 0;
+                static retry_policy_t verify_retry = RETRY_POLICY_INIT(1000, 8000);
                 const int MAX_VERIFICATION_RETRIES = 2; // Try 2 times before giving up
-                
+
                 // Reset verification state if we're not provisioned (means we returned to AP mode)
                 if (!wifi_provisioning_is_provisioned()) {
-                    verification_done = false;
                     verification_retries = 0;
+                    retry_policy_reset(&verify_retry);
+                    s_warm_boot = false;
+                    warm_boot_invalidate();
                     s_app_state = APP_STATE_AP_MODE;
                     break;
                 }
-                
-                if (!verification_done) {
-                    // Verify internet connectivity after WiFi connection
-                    ESP_LOGI(TAG, "WiFi connected - verifying internet access...");
-                    vTaskDelay(pdMS_TO_TICKS(2000)); // Wait 2 seconds for network to stabilize
-                    
-                    esp_err_t ret = internet_verification_test();
-                    if (ret == ESP_OK) {
-                        ESP_LOGI(TAG, "✓ Internet connectivity verified!");
-                        ESP_LOGI(TAG, "✓ Provisioning flow 100%% complete!");
-                        verification_done = true;
-                        verification_retries = 0; // Reset retry counter
-                    } else {
-                        verification_retries++;
-                        ESP_LOGE(TAG, "========================================");
-                        ESP_LOGE(TAG, "✗ Internet verification failed!");
-                        ESP_LOGE(TAG, "✗ Retry attempt: %d/%d", verification_retries, MAX_VERIFICATION_RETRIES);
-                        ESP_LOGE(TAG, "========================================");
-                        
-                        if (verification_retries >= MAX_VERIFICATION_RETRIES) {
-                            ESP_LOGE(TAG, "Maximum retries reached. Credentials may be incorrect.");
-                            ESP_LOGE(TAG, "WiFi may be connected but has no internet access.");
-                            ESP_LOGI(TAG, "Clearing credentials and returning to AP mode...");
-                            ESP_LOGI(TAG, "Please send new credentials via HTTP POST /provision");
-                            
-                            // Clear credentials and return to AP mode
-                            wifi_provisioning_clear_and_restart();
-                            
-                            // Reset state machine to AP mode
-                            verification_done = false;
-                            verification_retries = 0;
-                            s_app_state = APP_STATE_AP_MODE;
-                            break;
-                        } else {
-                            ESP_LOGW(TAG, "Retrying internet verification in 5 seconds...");
-                            vTaskDelay(pdMS_TO_TICKS(5000));
-                        }
-                        break;
-                    }
+
+                // DNS and certificate loading overlap with the verification below
+                if (verification_retries == 0) {
+                    start_prep_pipeline();
                 }
-                
-                if (verification_done) {
+                // Timestamps and the certificate expiry check need wall-clock time
+                time_sync_start();
+
+                if (s_warm_boot) {
+                    // Last session reached the broker over this same AP
+                    ESP_LOGI(TAG, "Warm boot: skipping internet verification");
+#if CONFIG_APP_PROV_RELAY
+                    prov_relay_serve_start();
+#endif
+                    s_app_state = APP_STATE_CHECK_CERTIFICATES;
+                    break;
+                }
+
+                // Verify internet connectivity after WiFi connection
+                ESP_LOGI(TAG, "WiFi connected - verifying internet access...");
+                esp_err_t ret = internet_verification_test();
+                if (ret == ESP_OK) {
+                    ESP_LOGI(TAG, "✓ Internet connectivity verified!");
+                    ESP_LOGI(TAG, "✓ Provisioning flow 100%% complete!");
+                    verification_retries = 0; // Reset retry counter
+                    retry_policy_reset(&verify_retry);
+#if CONFIG_APP_PROV_RELAY
+                    prov_relay_serve_start();
+#endif
                     s_app_state = APP_STATE_CHECK_CERTIFICATES;
+                    break;
                 }
+
+                verification_retries++;
+                ESP_LOGE(TAG, "========================================");
+                ESP_LOGE(TAG, "✗ Internet verification failed!");
+                ESP_LOGE(TAG, "✗ Retry attempt: %d/%d", verification_retries, MAX_VERIFICATION_RETRIES);
+                ESP_LOGE(TAG, "========================================");
+
+                if (verification_retries >= MAX_VERIFICATION_RETRIES) {
+                    ESP_LOGE(TAG, "Maximum retries reached. Credentials may be incorrect.");
+                    ESP_LOGE(TAG, "WiFi may be connected but has no internet access.");
+                    ESP_LOGI(TAG, "Clearing credentials and returning to AP mode...");
+                    ESP_LOGI(TAG, "Please send new credentials via HTTP POST /provision");
+
+                    // Clear credentials and return to AP mode
+                    wifi_provisioning_clear_and_restart();
+                    warm_boot_invalidate();
+
+                    // Reset state machine to AP mode
+                    verification_retries = 0;
+                    retry_policy_reset(&verify_retry);
+                    s_app_state = APP_STATE_AP_MODE;
+                    break;
+                }
+
+                // The probe is cheap; a short pause covers DHCP/DNS settling.
+                // Jittered so a site recovering from an outage does not probe in step.
+                uint32_t delay_ms = retry_policy_next(&verify_retry);
+                ESP_LOGW(TAG, "Retrying internet verification in %lu ms...", (unsigned long)delay_ms);
+                timeout = pdMS_TO_TICKS(delay_ms);
             }
             break;
 
         case APP_STATE_CHECK_CERTIFICATES:
+            if (s_prep_running) {
+                // Join the preparation task before deciding
+                ESP_LOGI(TAG, "State: CHECK_CERTIFICATES (waiting for startup preparation)");
+                wait_bits = APP_EVENT_PREP_DONE;
+                timeout = pdMS_TO_TICKS(1000);
+                break;
+            }
             ESP_LOGI(TAG, "State: CHECK_CERTIFICATES");
-            if (certificate_manager_has_certificates()) {
+            if (s_prep_has_certs) {
                 ESP_LOGI(TAG, "✓ Certificates found in NVS");
                 ESP_LOGI(TAG, "Proceeding to MQTT connection...");
+                metrics_mark(METRICS_MARK_CERTS_READY);
                 s_app_state = APP_STATE_MQTT_CONNECTING;
             } else {
                 ESP_LOGI(TAG, "Certificates not found, submitting CSR...");
@@ -259,74 +726,90 @@ static void app_state_machine_task(void *pvParameters)
         case APP_STATE_SUBMIT_CSR:
             ESP_LOGI(TAG, "State: SUBMIT_CSR");
             {
-                char device_id[64] = {0};
-                char token[256] = {0};
+                static retry_policy_t csr_retry =
+                    RETRY_POLICY_INIT(CONFIG_APP_CSR_RETRY_MIN_MS, CONFIG_APP_CSR_RETRY_MAX_MS);
+                char device_id[PROVISION_DEVICE_ID_MAX + 1] = {0};
 
                 esp_err_t ret = get_provisioning_credentials(device_id, sizeof(device_id),
-                                                             token, sizeof(token));
+                                                             s_prov_token, sizeof(s_prov_token));
                 if (ret != ESP_OK) {
                     ESP_LOGE(TAG, "Failed to get provisioning credentials: %s", esp_err_to_name(ret));
                     s_app_state = APP_STATE_ERROR;
                     break;
                 }
 
-                ret = certificate_manager_submit_csr(device_id, token);
+                ret = certificate_manager_submit_csr(device_id, s_prov_token);
                 if (ret == ESP_OK) {
                     ESP_LOGI(TAG, "CSR submitted successfully, certificates saved");
+                    retry_policy_reset(&csr_retry);
+                    metrics_mark(METRICS_MARK_CERTS_READY);
                     s_app_state = APP_STATE_MQTT_CONNECTING;
                 } else {
-                    ESP_LOGE(TAG, "Failed to submit CSR: %s", esp_err_to_name(ret));
-                    // Retry after delay
-                    vTaskDelay(pdMS_TO_TICKS(5000));
+                    // Backs off from the backend, or as long as it asked for
+                    uint32_t delay_ms = retry_policy_next_hint(&csr_retry, certificate_manager_retry_after_ms());
+                    ESP_LOGE(TAG, "Failed to submit CSR: %s, retrying in %lu ms", esp_err_to_name(ret),
+                             (unsigned long)delay_ms);
+                    timeout = pdMS_TO_TICKS(delay_ms);
                 }
             }
             break;
 
         case APP_STATE_MQTT_CONNECTING:
-            ESP_LOGI(TAG, "State: MQTT_CONNECTING");
             {
                 static int mqtt_connect_retries = 0;
+                static bool mqtt_started = false;
+                static bool waiting = false;
                 const int MAX_MQTT_RETRIES = 3;
-                
-                esp_err_t ret = mqtt_handler_start();
-                if (ret == ESP_OK) {
-                    ESP_LOGI(TAG, "MQTT handler started, waiting for connection...");
-                    
-                    // Wait for connection with timeout
-                    int wait_count = 0;
-                    while (!mqtt_handler_is_connected() && wait_count < 30) {
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                        wait_count++;
-                        if (wait_count % 5 == 0) {
-                            ESP_LOGI(TAG, "Waiting for MQTT connection... (%d seconds)", wait_count);
-                        }
+
+                // The state as well as the event: a reconnect that completed while the
+                // disconnect was still being handled has already consumed its event
+                if ((events & APP_EVENT_MQTT_CONNECTED) || (mqtt_started && mqtt_handler_is_connected())) {
+                    ESP_LOGI(TAG, "✓ MQTT connected successfully!");
+                    mqtt_connect_retries = 0;
+                    waiting = false;
+                    static bool timeline_logged = false;
+                    if (!timeline_logged) {
+                        metrics_mark(METRICS_MARK_MQTT_CONNECTED);
+                        metrics_log_timeline();
+                        timeline_logged = true;
                     }
-                    
-                    if (mqtt_handler_is_connected()) {
-                        ESP_LOGI(TAG, "✓ MQTT connected successfully!");
-                        mqtt_connect_retries = 0;
-                        s_app_state = APP_STATE_MQTT_CONNECTED;
+                    s_app_state = APP_STATE_MQTT_CONNECTED;
+                    break;
+                }
+
+                if (mqtt_started) {
+                    // The client stays alive and reconnects on its own with backoff
+                    if (waiting) {
+                        ESP_LOGW(TAG, "MQTT still not connected, client keeps retrying");
                     } else {
-                        ESP_LOGW(TAG, "MQTT connection timeout");
-                        mqtt_handler_stop();
-                        mqtt_connect_retries++;
-                        
-                        if (mqtt_connect_retries >= MAX_MQTT_RETRIES) {
-                            ESP_LOGE(TAG, "MQTT connection failed after %d retries", MAX_MQTT_RETRIES);
-                            s_app_state = APP_STATE_ERROR;
-                        } else {
-                            ESP_LOGI(TAG, "Retrying MQTT connection... (%d/%d)", mqtt_connect_retries, MAX_MQTT_RETRIES);
-                            vTaskDelay(pdMS_TO_TICKS(5000));
-                        }
+                        ESP_LOGI(TAG, "State: MQTT_CONNECTING (waiting for reconnect)");
+                        waiting = true;
                     }
+                    wait_bits = APP_EVENT_MQTT_CONNECTED;
+                    timeout = pdMS_TO_TICKS(30000);
+                    break;
+                }
+
+                ESP_LOGI(TAG, "State: MQTT_CONNECTING");
+                // Backend calls are done: free their kept-alive TLS connections before the MQTT handshake
+                backend_client_close_all();
+                app_events_clear(APP_EVENT_MQTT_CONNECTED | APP_EVENT_MQTT_DISCONNECTED);
+                start_remote_config();
+                esp_err_t ret = mqtt_handler_start();
+                if (ret == ESP_OK) {
+                    ESP_LOGI(TAG, "MQTT handler started, waiting for connection...");
+                    mqtt_started = true;
+                    waiting = true;
+                    wait_bits = APP_EVENT_MQTT_CONNECTED;
+                    timeout = pdMS_TO_TICKS(30000);
                 } else {
                     ESP_LOGE(TAG, "Failed to start MQTT handler: %s", esp_err_to_name(ret));
                     mqtt_connect_retries++;
-                    
+
                     if (mqtt_connect_retries >= MAX_MQTT_RETRIES) {
                         s_app_state = APP_STATE_ERROR;
                     } else {
-                        vTaskDelay(pdMS_TO_TICKS(5000));
+                        timeout = pdMS_TO_TICKS(5000);
                     }
                 }
             }
@@ -335,7 +818,16 @@ static void app_state_machine_task(void *pvParameters)
         case APP_STATE_MQTT_CONNECTED:
             {
                 static bool connected_msg_shown = false;
-                
+                static bool session_recorded = false;
+
+                // Check if still connected
+                if ((events & APP_EVENT_MQTT_DISCONNECTED) || !mqtt_handler_is_connected()) {
+                    ESP_LOGW(TAG, "MQTT connection lost, reconnecting...");
+                    connected_msg_shown = false;
+                    s_app_state = APP_STATE_MQTT_CONNECTING;
+                    break;
+                }
+
                 if (!connected_msg_shown) {
                     ESP_LOGI(TAG, "========================================");
                     ESP_LOGI(TAG, "State: MQTT_CONNECTED");
@@ -345,55 +837,185 @@ static void app_state_machine_task(void *pvParameters)
                     ESP_LOGI(TAG, "✓ Device is fully operational!");
                     ESP_LOGI(TAG, "========================================");
                     connected_msg_shown = true;
+#if CONFIG_APP_BENCH_E2E
+                    bench_e2e_connected();
+#endif
+
+                    // Tell the backend which configuration this session runs with
+                    remote_config_report();
+
+                    // And, once per boot, how to decode the records it sends
+                    static bool schema_announced = false;
+                    if (!schema_announced && telemetry_publish_schema(CONFIG_APP_AGG_TOPIC) == ESP_OK) {
+                        schema_announced = true;
+                    }
+
+                    // Allow the next boot to take the warm path
+                    // and to prefer the network that got here
+                    if (!session_recorded && warm_boot_mark_clean() == ESP_OK) {
+                        wifi_networks_mark_success();
+                        session_recorded = true;
+                    }
+#if CONFIG_APP_OTA
+                    // A freshly updated image has proven itself
+                    ota_update_mark_valid();
+#endif
+                } else {
+#if !CONFIG_APP_DUTY_CYCLE
+                    // Woke up on the heartbeat timeout
+                    ESP_LOGI(TAG, "MQTT connection healthy - device operational");
+#endif
                 }
-                
-                // Check if still connected
-                if (!mqtt_handler_is_connected()) {
-                    ESP_LOGW(TAG, "MQTT connection lost, reconnecting...");
-                    connected_msg_shown = false;
-                    mqtt_handler_stop();
-                    s_app_state = APP_STATE_MQTT_CONNECTING;
-                    break;
+
+                // Checked on every heartbeat, so the period is rounded up to 30 s
+                static int64_t metrics_published_us = 0;
+                int64_t now_us = esp_timer_get_time();
+                int metrics_interval_s = remote_config_get_int(REMOTE_CONFIG_METRICS_INTERVAL);
+                if (metrics_interval_s > 0 && (metrics_published_us == 0 ||
+                    now_us - metrics_published_us >= (int64_t)metrics_interval_s * 1000000)) {
+                    uint8_t cbor[METRICS_CBOR_MAX];
+                    cbor_writer_t w;
+                    size_t cbor_len;
+                    cbor_writer_init(&w, cbor, sizeof(cbor));
+                    metrics_to_cbor(&w);
+                    if (cbor_writer_finish(&w, &cbor_len) == ESP_OK) {
+                        int64_t start_us = esp_timer_get_time();
+                        if (mqtt_handler_publish_cbor(CONFIG_APP_METRICS_TOPIC, cbor, cbor_len, 0) == ESP_OK) {
+                            stats_agg_record(AGG_PUBLISH_US, (int32_t)(esp_timer_get_time() - start_us));
+                        }
+                    }
+                    metrics_published_us = now_us;
                 }
-                
+
+#if CONFIG_APP_CERT_RENEWAL
+                cert_renewal_check();
+#endif
+
+#if CONFIG_APP_DUTY_CYCLE
+                // Report, then sleep as soon as the broker has confirmed everything
+                duty_cycle_publish(CONFIG_APP_METRICS_TOPIC);
+                if (duty_cycle_flushed()) {
+                    duty_cycle_sleep(true);
+                }
+                wait_bits = APP_EVENT_MQTT_DISCONNECTED;
+                timeout = pdMS_TO_TICKS(DUTY_CYCLE_POLL_MS);
+#else
+                // One sample per heartbeat, published as a block once full
+                metrics_ts_sample(CONFIG_APP_METRICS_TOPIC);
+
                 // Application is fully operational - can publish/subscribe here
                 // For now, just heartbeat log every 30 seconds
-                static int heartbeat_counter = 0;
-                heartbeat_counter++;
-                if (heartbeat_counter >= 30) {
-                    ESP_LOGI(TAG, "MQTT connection healthy - device operational");
-                    heartbeat_counter = 0;
-                }
+                wait_bits = APP_EVENT_MQTT_DISCONNECTED;
+                timeout = pdMS_TO_TICKS(30000);
+#endif
             }
-            vTaskDelay(pdMS_TO_TICKS(1000));
             break;
 
         case APP_STATE_ERROR:
             ESP_LOGE(TAG, "State: ERROR - Application in error state");
             // Could implement error recovery here
-            vTaskDelay(pdMS_TO_TICKS(10000));
+            timeout = pdMS_TO_TICKS(10000);
             break;
 
         default:
             ESP_LOGW(TAG, "Unknown state: %d", s_app_state);
-            vTaskDelay(pdMS_TO_TICKS(1000));
+            timeout = pdMS_TO_TICKS(1000);
             break;
         }
 
-        vTaskDelay(pdMS_TO_TICKS(100)); // Small delay to prevent tight loop
+        // Run the next state's handler right away on a transition,
+        // otherwise block (at zero CPU) until an event or the retry timeout
+        events = 0;
+        if (s_app_state == state) {
+            // Rejected credentials end the session whatever the state
+            if (wait_bits != 0 && state != APP_STATE_AP_MODE) {
+                wait_bits |= APP_EVENT_WIFI_AUTH_FAILED;
+            }
+            events = app_events_wait(wait_bits | APP_EVENT_FACTORY_RESET | APP_EVENT_SLEEP, timeout);
+        }
+
+#if CONFIG_APP_DUTY_CYCLE
+        if (events & APP_EVENT_SLEEP) {
+            ESP_LOGW(TAG, "Reporting window over in state %s", s_state_names[state]);
+            duty_cycle_sleep(false);
+        }
+#endif
+
+        if (events & APP_EVENT_FACTORY_RESET) {
+            ESP_LOGW(TAG, "========================================");
+            ESP_LOGW(TAG, "FACTORY RESET");
+            ESP_LOGW(TAG, "========================================");
+            mqtt_handler_stop();
+            wifi_conn_stop();
+            erase_device_data(false);
+            esp_restart();
+        }
+
+        if (events & APP_EVENT_WIFI_AUTH_FAILED) {
+            ESP_LOGI(TAG, "Clearing invalid credentials, returning to AP mode...");
+            ESP_LOGI(TAG, "Please send new credentials via HTTP POST /provision");
+            mqtt_handler_stop();
+            wifi_provisioning_clear_and_restart();
+            warm_boot_invalidate();
+            s_warm_boot = false;
+            s_use_hint = false;
+            s_app_state = APP_STATE_AP_MODE;
+            events = 0;
+        }
     }
 }
 
+#if CONFIG_APP_LOW_POWER
+/**
+ * @brief Enable frequency scaling and automatic light sleep
+ */
+static void power_configure(void)
+{
+    const esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_APP_PM_MIN_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Power management not enabled: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Light sleep enabled (%d-%d MHz)", CONFIG_APP_PM_MIN_FREQ_MHZ,
+             CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+    err = metrics_sleep_init();
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Sleep residency not measured: %s", esp_err_to_name(err));
+    }
+}
+#endif
+
 /**
  * @brief Main application entry point
  */
 void app_main(void)
 {
+    metrics_mark(METRICS_MARK_APP_MAIN);
     ESP_LOGI(TAG, "=== WiFi Provisioning with mTLS MQTT ===");
+    // ESP_LOGx goes through the deferred ring from here on
+    ESP_ERROR_CHECK(log_defer_init());
     ESP_LOGI(TAG, "Device ID: %s", DEVICE_ID);
+    esp_err_t ret;
+
+    time_sync_init();
+#if CONFIG_APP_ULP_SAMPLER
+    ulp_collect();
+#endif
+#if CONFIG_APP_DUTY_CYCLE
+    // A wake that only samples goes back to sleep in here, before NVS is mounted
+    ret = duty_cycle_boot(s_duty_series, sizeof(s_duty_series) / sizeof(s_duty_series[0]));
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Duty cycle reporting deadline unavailable: %s", esp_err_to_name(ret));
+    }
+#endif
 
     // Initialize NVS
-    esp_err_t ret = nvs_flash_init();
+    ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
@@ -401,35 +1023,44 @@ void app_main(void)
     ESP_ERROR_CHECK(ret);
     ESP_LOGI(TAG, "NVS initialized");
 
-    // DEVELOPMENT MODE: Clear all provisioning data on every boot
-    // This ensures a fresh start for development/testing
+    // Every later NVS access goes through the cached store
+    ESP_ERROR_CHECK(device_config_init());
+    ESP_ERROR_CHECK(remote_config_init());
+#if CONFIG_APP_DNS_CACHE
+    ESP_ERROR_CHECK(dns_cache_init());
+#endif
+#if CONFIG_APP_OTA
+    ret = ota_update_init();
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "OTA verification timer unavailable: %s", esp_err_to_name(ret));
+    }
+#endif
+
+#if CONFIG_APP_STACK_PROFILE
+    // Before the application tasks exist, so their first samples are taken
+    stack_prof_start();
+#endif
+
+#if CONFIG_APP_BENCH_CORE
+    // Before power management so the CPU runs at the nominal frequency
+    bench_core_run();
+#endif
+
+#if CONFIG_APP_LOW_POWER
+    power_configure();
+#endif
+
+#if CONFIG_APP_BOOT_PROFILE_DEV
+    // Fresh start on every boot for development/testing; the certificates
+    // stay, so each boot exercises provisioning without a backend signing
     ESP_LOGI(TAG, "========================================");
     ESP_LOGI(TAG, "DEVELOPMENT MODE: Clearing provisioning");
     ESP_LOGI(TAG, "========================================");
-    nvs_handle_t nvs_handle;
-    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle) == ESP_OK) {
-        ESP_LOGI(TAG, "Clearing all provisioning data...");
-        
-        // Erase all provisioning-related keys
-        nvs_erase_key(nvs_handle, "provisioned");  // Provisioning status flag
-        nvs_erase_key(nvs_handle, "wifi_ssid");     // WiFi SSID
-        nvs_erase_key(nvs_handle, "wifi_pass");     // WiFi password
-        nvs_erase_key(nvs_handle, NVS_KEY_DEVICE_ID);  // Device ID
-        nvs_erase_key(nvs_handle, NVS_KEY_PROV_TOKEN); // Provisioning token
-        nvs_erase_key(nvs_handle, "bearer_token");  // Bearer token
-        nvs_erase_key(nvs_handle, "device_cert");   // Device certificate
-        nvs_erase_key(nvs_handle, "ca_cert");       // CA certificate
-        
-        // Commit changes
-        nvs_commit(nvs_handle);
-        nvs_close(nvs_handle);
-        
-        ESP_LOGI(TAG, "✓ All provisioning data cleared");
+    if (erase_device_data(true) == ESP_OK) {
         ESP_LOGI(TAG, "✓ Device will start in AP mode");
         ESP_LOGI(TAG, "========================================");
-    } else {
-        ESP_LOGW(TAG, "Failed to open NVS for clearing (may be first boot)");
     }
+#endif
 
     // Initialize network interface
     ESP_ERROR_CHECK(esp_netif_init());
@@ -439,22 +1070,37 @@ void app_main(void)
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     ESP_LOGI(TAG, "Event loop created");
 
-    // Register WiFi event handlers
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &wifi_sta_event_handler,
-                                                        NULL,
-                                                        NULL));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &wifi_sta_event_handler,
-                                                        NULL,
-                                                        NULL));
+    // Create the event bus before any handler can post to it
+    ESP_ERROR_CHECK(app_events_init());
+
+    // WiFi driver, station interface and reconnection
+    ESP_ERROR_CHECK(wifi_conn_init());
+
+    ret = factory_reset_init();
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Factory reset button unavailable: %s", esp_err_to_name(ret));
+    }
+#if CONFIG_APP_PROV_RELAY
+    ret = prov_relay_init();
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Provisioning relay unavailable: %s", esp_err_to_name(ret));
+    }
+#endif
     ESP_LOGI(TAG, "Event handlers registered");
 
+    start_stats_agg();
+#if CONFIG_APP_HEALTH
+    ret = health_start();
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Health records unavailable: %s", esp_err_to_name(ret));
+    }
+#endif
+
     // Start state machine task
-    xTaskCreate(app_state_machine_task, "app_state_machine", 8192, NULL, 5, NULL);
+    xTaskCreatePinnedToCore(app_state_machine_task, "app_state_machine", CONFIG_APP_STATE_TASK_STACK, NULL,
+                            APP_TASK_PRIORITY, NULL, APP_TASK_CORE);
     ESP_LOGI(TAG, "State machine task started");
 
+    metrics_mark(METRICS_MARK_INIT_DONE);
     ESP_LOGI(TAG, "Application initialization complete");
 }
@@ -0,0 +1,443 @@
+/* Runtime Metrics Implementation
+ *
+ * Recording is a few stores per event and happens from the state machine
+ * task; readers take an unlocked snapshot (word-sized fields, small skew
+ * is acceptable for diagnostics).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "metrics.h"
+#include "heap_diag.h"
+#include "mqtt_loop_prof.h"
+#include "mqtt_probe.h"
+#include "adc_stream.h"
+#include "mqtt_handler.h"
+#include "mqtt_worker.h"
+#include "time_sync.h"
+#include "ts_block.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#if CONFIG_APP_LOW_POWER && CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+#include "esp_attr.h"
+#include "esp_pm.h"
+#define METRICS_SLEEP 1
+#else
+#define METRICS_SLEEP 0
+#endif
+
+static const char *TAG = "metrics";
+
+static const char *const s_mark_names[METRICS_MARK_COUNT] = {
+    "wifi_got_ip",
+    "certs_ready",
+    "mqtt_connected",
+    "app_main",
+    "init_done",
+};
+
+static const char *const *s_state_names = NULL;
+static int s_state_count = 0;
+static int s_state = -1;
+static int64_t s_state_since_us = 0;
+static uint32_t s_state_ms[METRICS_MAX_STATES];
+static uint32_t s_mark_ms[METRICS_MARK_COUNT];     // 0 = not reached yet
+static TaskHandle_t s_tasks[METRICS_MAX_TASKS];
+static int s_task_count = 0;
+
+#if METRICS_SLEEP
+// Light sleep residency; kept in word-sized fields so readers see no torn values
+static uint32_t s_sleep_ms = 0;
+static uint32_t s_sleep_rem_us = 0;
+static uint32_t s_sleeps = 0;
+
+// Runs on wakeup with interrupts disabled
+static IRAM_ATTR esp_err_t sleep_exit_cb(int64_t sleep_time_us, void *arg)
+{
+    uint64_t us = (uint64_t)s_sleep_rem_us + (uint64_t)sleep_time_us;
+    s_sleep_ms += (uint32_t)(us / 1000);
+    s_sleep_rem_us = (uint32_t)(us % 1000);
+    s_sleeps++;
+    return ESP_OK;
+}
+#endif
+
+esp_err_t metrics_sleep_init(void)
+{
+#if METRICS_SLEEP
+    esp_pm_sleep_cbs_register_config_t cbs = {
+        .exit_cb = sleep_exit_cb,
+    };
+    return esp_pm_light_sleep_register_cbs(&cbs);
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void metrics_set_state_names(const char *const *names, int count)
+{
+    s_state_names = names;
+    s_state_count = count < METRICS_MAX_STATES ? count : METRICS_MAX_STATES;
+}
+
+void metrics_state_enter(int state)
+{
+    int64_t now = esp_timer_get_time();
+#if CONFIG_APP_HEAP_DIAG
+    heap_diag_state_change(s_state, state);
+#endif
+    if (s_state >= 0 && s_state < METRICS_MAX_STATES) {
+        s_state_ms[s_state] += (uint32_t)((now - s_state_since_us) / 1000);
+    }
+    s_state = state;
+    s_state_since_us = now;
+}
+
+void metrics_mark(metrics_mark_t mark)
+{
+    if (mark < METRICS_MARK_COUNT && s_mark_ms[mark] == 0) {
+        s_mark_ms[mark] = (uint32_t)(esp_timer_get_time() / 1000);
+    }
+}
+
+void metrics_log_timeline(void)
+{
+    char line[160];
+    int len = 0;
+    for (int i = 0; i < METRICS_MARK_COUNT && len < (int)sizeof(line); i++) {
+        if (s_mark_ms[i] != 0) {
+            len += snprintf(line + len, sizeof(line) - len, " %s=%lu", s_mark_names[i], (unsigned long)s_mark_ms[i]);
+        }
+    }
+    ESP_LOGI(TAG, "Boot timeline (ms):%s", len > 0 ? line : " none");
+}
+
+void metrics_watch_task(TaskHandle_t task)
+{
+    if (task != NULL && s_task_count < METRICS_MAX_TASKS) {
+        s_tasks[s_task_count++] = task;
+    }
+}
+
+/**
+ * @brief Time spent in a state, including the current visit
+ */
+static uint32_t state_ms(int state)
+{
+    uint32_t ms = s_state_ms[state];
+    if (state == s_state) {
+        ms += (uint32_t)((esp_timer_get_time() - s_state_since_us) / 1000);
+    }
+    return ms;
+}
+
+static const char *state_name(int state)
+{
+    return (s_state_names && state < s_state_count) ? s_state_names[state] : "?";
+}
+
+size_t metrics_to_json(char *buf, size_t size)
+{
+    mqtt_handler_stats_t mqtt;
+    mqtt_handler_get_stats(&mqtt);
+
+    size_t pos = 0;
+    int n;
+
+#define APPEND(...) do { \
+        n = snprintf(buf + pos, size - pos, __VA_ARGS__); \
+        if (n < 0 || (size_t)n >= size - pos) return 0; \
+        pos += n; \
+    } while (0)
+
+    APPEND("{\"uptime_ms\":%lu,\"states\":{", (unsigned long)(esp_timer_get_time() / 1000));
+    for (int i = 0; i < s_state_count; i++) {
+        APPEND("%s\"%s\":%lu", i ? "," : "", state_name(i), (unsigned long)state_ms(i));
+    }
+    APPEND("},\"timeline\":{");
+    for (int i = 0; i < METRICS_MARK_COUNT; i++) {
+        APPEND("%s\"%s\":%lu", i ? "," : "", s_mark_names[i], (unsigned long)s_mark_ms[i]);
+    }
+    APPEND("},\"mqtt\":{\"connects\":%lu,\"disconnects\":%lu,\"connect_ms\":%lu,"
+           "\"published\":%lu,\"failed\":%lu,\"dropped\":%lu,\"expired\":%lu,\"outbox\":%d,"
+           "\"spooled\":%lu,\"wakeups\":%lu,\"async_lat_avg_us\":%lu,\"async_lat_max_us\":%lu,"
+           "\"rx_fragments_max\":%lu,\"tx_fragments_max\":%lu,\"rx_duplicates\":%lu,"
+           "\"evicted\":%lu,\"spilled\":%lu,\"refused\":%lu}",
+           (unsigned long)mqtt.connects, (unsigned long)mqtt.disconnects,
+           (unsigned long)mqtt.last_connect_ms, (unsigned long)mqtt.published,
+           (unsigned long)mqtt.publish_failed, (unsigned long)mqtt.dropped,
+           (unsigned long)mqtt.expired, mqtt.outbox_size, (unsigned long)mqtt.spooled,
+           (unsigned long)mqtt.wakeups, (unsigned long)mqtt.async_latency_avg_us,
+           (unsigned long)mqtt.async_latency_max_us, (unsigned long)mqtt.rx_fragments_max,
+           (unsigned long)mqtt.tx_fragments_max, (unsigned long)mqtt.rx_duplicates,
+           (unsigned long)mqtt.evicted, (unsigned long)mqtt.spilled, (unsigned long)mqtt.refused);
+    APPEND(",\"heap\":{\"internal_free\":%u,\"internal_min\":%u,\"internal_largest\":%u",
+           (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+           (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+           (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+#if CONFIG_SPIRAM
+    APPEND(",\"psram_free\":%u,\"psram_min\":%u",
+           (unsigned)heap_caps_get_free_size(MALLOC_CAP_SPIRAM),
+           (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+#endif
+    APPEND("},\"stack_free\":{");
+    for (int i = 0; i < s_task_count; i++) {
+        APPEND("%s\"%s\":%u", i ? "," : "", pcTaskGetName(s_tasks[i]),
+               (unsigned)uxTaskGetStackHighWaterMark(s_tasks[i]));
+    }
+    APPEND("}");
+#if CONFIG_APP_HEAP_DIAG
+    n = heap_diag_to_json(buf + pos, size - pos, s_state_names, s_state_count);
+    if (n == 0) {
+        return 0;
+    }
+    pos += n;
+#endif
+#if CONFIG_APP_MQTT_LOOP_PROF
+    n = mqtt_loop_prof_to_json(buf + pos, size - pos);
+    if (n == 0) {
+        return 0;
+    }
+    pos += n;
+#endif
+#if CONFIG_APP_MQTT_PROBE
+    n = mqtt_probe_to_json(buf + pos, size - pos);
+    if (n == 0) {
+        return 0;
+    }
+    pos += n;
+#endif
+#if CONFIG_APP_ADC_STREAM
+    adc_stream_stats_t adc;
+    adc_stream_get_stats(&adc);
+    APPEND(",\"adc\":{\"frames\":%lu,\"samples\":%lu,\"dropped\":%lu,\"foreign\":%lu}",
+           (unsigned long)adc.frames, (unsigned long)adc.samples,
+           (unsigned long)adc.dropped, (unsigned long)adc.foreign);
+#endif
+#if CONFIG_MQTT_WORKER
+    mqtt_worker_stats_t wk;
+    mqtt_worker_get_stats(&wk);
+    APPEND(",\"workers\":{\"handled\":%lu,\"dropped\":%lu,\"oversized\":%lu,\"wait_max_us\":%lu,\"run_max_us\":%lu}",
+           (unsigned long)wk.handled, (unsigned long)wk.dropped, (unsigned long)wk.oversized,
+           (unsigned long)wk.wait_max_us, (unsigned long)wk.run_max_us);
+#endif
+#if METRICS_SLEEP
+    APPEND(",\"sleep\":{\"light_ms\":%lu,\"wakes\":%lu}",
+           (unsigned long)s_sleep_ms, (unsigned long)s_sleeps);
+#endif
+    APPEND("}");
+
+#undef APPEND
+    return pos;
+}
+
+void metrics_to_cbor(cbor_writer_t *w)
+{
+    mqtt_handler_stats_t mqtt;
+    mqtt_handler_get_stats(&mqtt);
+
+    int members = 6;
+#if CONFIG_APP_HEAP_DIAG
+    members++;
+#endif
+#if CONFIG_APP_MQTT_LOOP_PROF
+    members++;
+#endif
+#if CONFIG_APP_MQTT_PROBE
+    members++;
+#endif
+#if CONFIG_APP_ADC_STREAM
+    members++;
+#endif
+#if CONFIG_MQTT_WORKER
+    members++;
+#endif
+#if METRICS_SLEEP
+    members++;
+#endif
+    cbor_put_map(w, members);
+
+    cbor_put_text(w, "up");
+    cbor_put_uint(w, esp_timer_get_time() / 1000);
+
+    cbor_put_text(w, "st");
+    cbor_put_array(w, s_state_count);
+    for (int i = 0; i < s_state_count; i++) {
+        cbor_put_uint(w, state_ms(i));
+    }
+
+    cbor_put_text(w, "tl");
+    cbor_put_array(w, METRICS_MARK_COUNT);
+    for (int i = 0; i < METRICS_MARK_COUNT; i++) {
+        cbor_put_uint(w, s_mark_ms[i]);
+    }
+
+    // [connects, disconnects, connect_ms, published, failed, dropped, expired, outbox, spooled, wakeups,
+    //  async latency avg/max (us), rx/tx fragments max, rx duplicates, evicted, spilled, refused]
+    cbor_put_text(w, "mq");
+    cbor_put_array(w, 18);
+    cbor_put_uint(w, mqtt.connects);
+    cbor_put_uint(w, mqtt.disconnects);
+    cbor_put_uint(w, mqtt.last_connect_ms);
+    cbor_put_uint(w, mqtt.published);
+    cbor_put_uint(w, mqtt.publish_failed);
+    cbor_put_uint(w, mqtt.dropped);
+    cbor_put_uint(w, mqtt.expired);
+    cbor_put_int(w, mqtt.outbox_size);
+    cbor_put_uint(w, mqtt.spooled);
+    cbor_put_uint(w, mqtt.wakeups);
+    cbor_put_uint(w, mqtt.async_latency_avg_us);
+    cbor_put_uint(w, mqtt.async_latency_max_us);
+    cbor_put_uint(w, mqtt.rx_fragments_max);
+    cbor_put_uint(w, mqtt.tx_fragments_max);
+    cbor_put_uint(w, mqtt.rx_duplicates);
+    cbor_put_uint(w, mqtt.evicted);
+    cbor_put_uint(w, mqtt.spilled);
+    cbor_put_uint(w, mqtt.refused);
+
+    // [internal_free, internal_min, psram_free, psram_min]
+    cbor_put_text(w, "hp");
+    cbor_put_array(w, 4);
+    cbor_put_uint(w, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    cbor_put_uint(w, heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+#if CONFIG_SPIRAM
+    cbor_put_uint(w, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    cbor_put_uint(w, heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+#else
+    cbor_put_uint(w, 0);
+    cbor_put_uint(w, 0);
+#endif
+
+    cbor_put_text(w, "sk");
+    cbor_put_array(w, s_task_count);
+    for (int i = 0; i < s_task_count; i++) {
+        cbor_put_uint(w, uxTaskGetStackHighWaterMark(s_tasks[i]));
+    }
+
+#if CONFIG_APP_HEAP_DIAG
+    cbor_put_text(w, "hd");
+    heap_diag_to_cbor(w);
+#endif
+#if CONFIG_APP_MQTT_LOOP_PROF
+    // [samples, max cycles] per phase: events, expiry, receive, resend, keepalive, pass, api
+    cbor_put_text(w, "ml");
+    mqtt_loop_prof_to_cbor(w);
+#endif
+#if CONFIG_APP_MQTT_PROBE
+    // [sent, returned, lost, last rtt, max rtt, max send] (us)
+    cbor_put_text(w, "pr");
+    mqtt_probe_to_cbor(w);
+#endif
+#if CONFIG_APP_ADC_STREAM
+    // [frames, samples, dropped, foreign]
+    adc_stream_stats_t adc;
+    adc_stream_get_stats(&adc);
+    cbor_put_text(w, "ad");
+    cbor_put_array(w, 4);
+    cbor_put_uint(w, adc.frames);
+    cbor_put_uint(w, adc.samples);
+    cbor_put_uint(w, adc.dropped);
+    cbor_put_uint(w, adc.foreign);
+#endif
+#if CONFIG_MQTT_WORKER
+    // [handled, dropped, oversized, max wait, max run] (us)
+    mqtt_worker_stats_t wk;
+    mqtt_worker_get_stats(&wk);
+    cbor_put_text(w, "wk");
+    cbor_put_array(w, 5);
+    cbor_put_uint(w, wk.handled);
+    cbor_put_uint(w, wk.dropped);
+    cbor_put_uint(w, wk.oversized);
+    cbor_put_uint(w, wk.wait_max_us);
+    cbor_put_uint(w, wk.run_max_us);
+#endif
+#if METRICS_SLEEP
+    // [light sleep ms, wakes]
+    cbor_put_text(w, "sl");
+    cbor_put_array(w, 2);
+    cbor_put_uint(w, s_sleep_ms);
+    cbor_put_uint(w, s_sleeps);
+#endif
+}
+
+#if CONFIG_APP_METRICS_TS
+// Series of the time-series block, in block order
+static const ts_block_enc_t s_ts_enc[] = {
+    TS_BLOCK_DELTA,     // connects
+    TS_BLOCK_DELTA,     // disconnects
+    TS_BLOCK_DELTA,     // published
+    TS_BLOCK_DELTA,     // publish_failed
+    TS_BLOCK_DELTA,     // dropped
+    TS_BLOCK_DELTA,     // expired
+    TS_BLOCK_DELTA,     // spooled
+    TS_BLOCK_DELTA,     // wakeups
+    TS_BLOCK_XOR,       // outbox bytes
+    TS_BLOCK_XOR,       // internal heap free
+    TS_BLOCK_DELTA,     // internal heap minimum
+};
+
+#define TS_SERIES (sizeof(s_ts_enc) / sizeof(s_ts_enc[0]))
+
+static ts_block_t s_ts_block;
+static uint8_t s_ts_out[TS_BLOCK_ENCODED_MAX(TS_SERIES, CONFIG_APP_METRICS_TS_SAMPLES)];
+static bool s_ts_ready = false;
+
+esp_err_t metrics_ts_sample(const char *topic)
+{
+    if (!s_ts_ready) {
+        esp_err_t err = ts_block_init(&s_ts_block, TS_SERIES, CONFIG_APP_METRICS_TS_SAMPLES, s_ts_enc);
+        if (err != ESP_OK) {
+            return err;
+        }
+        s_ts_ready = true;
+    }
+
+    mqtt_handler_stats_t mqtt;
+    mqtt_handler_get_stats(&mqtt);
+    const uint32_t values[TS_SERIES] = {
+        mqtt.connects,
+        mqtt.disconnects,
+        mqtt.published,
+        mqtt.publish_failed,
+        mqtt.dropped,
+        mqtt.expired,
+        mqtt.spooled,
+        mqtt.wakeups,
+        (uint32_t)mqtt.outbox_size,
+        heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+        heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+    };
+    // One kind of timestamp per block: start over when SNTP first sets the clock
+    bool utc = time_sync_valid();
+    if (utc != ((s_ts_block.flags & TS_BLOCK_FLAG_UTC) != 0)) {
+        ts_block_reset(&s_ts_block);
+        s_ts_block.flags = utc ? TS_BLOCK_FLAG_UTC : 0;
+    }
+    uint32_t t = utc ? (uint32_t)(time_sync_now_ms() / 1000) : (uint32_t)(esp_timer_get_time() / 1000000);
+    ts_block_add(&s_ts_block, t, values);
+    if (!ts_block_full(&s_ts_block)) {
+        return ESP_OK;
+    }
+
+    size_t len;
+    esp_err_t err = ts_block_encode(&s_ts_block, s_ts_out, sizeof(s_ts_out), &len);
+    // Telemetry: a block that cannot be sent is not kept
+    ts_block_reset(&s_ts_block);
+    if (err != ESP_OK) {
+        return err;
+    }
+    char full_topic[96];
+    int n = snprintf(full_topic, sizeof(full_topic), "%s" TS_BLOCK_TOPIC_SUFFIX, topic);
+    if (n < 0 || n >= (int)sizeof(full_topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ESP_LOGD(TAG, "Time-series block: %d samples in %d bytes", CONFIG_APP_METRICS_TS_SAMPLES, len);
+    return mqtt_handler_publish(full_topic, (const char *)s_ts_out, (int)len, 0);
+}
+#else
+esp_err_t metrics_ts_sample(const char *topic)
+{
+    return ESP_OK;
+}
+#endif
@@ -0,0 +1,119 @@
+/* Runtime Metrics Header
+ *
+ * Field numbers for where boot time and memory go: time spent in each
+ * application state, boot-to-milestone timeline, MQTT counters, heap and
+ * task stack watermarks. Rendered as JSON for GET /metrics and as CBOR for
+ * the periodic MQTT publish.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "cbor_writer.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METRICS_MAX_STATES  12
+#define METRICS_MAX_TASKS   4
+
+// Buffer for metrics_to_cbor()
+#if CONFIG_APP_MQTT_LOOP_PROF
+#define METRICS_CBOR_MAX    352
+#else
+#define METRICS_CBOR_MAX    256
+#endif
+
+/**
+ * @brief Boot timeline milestones (first occurrence only)
+ */
+typedef enum {
+    METRICS_MARK_WIFI_GOT_IP,
+    METRICS_MARK_CERTS_READY,
+    METRICS_MARK_MQTT_CONNECTED,
+    METRICS_MARK_APP_MAIN,          // Entry of app_main(), after bootloader and startup
+    METRICS_MARK_INIT_DONE,         // app_main() returned, state machine running
+    METRICS_MARK_COUNT
+} metrics_mark_t;
+
+/**
+ * @brief Name the application states (index = state value)
+ *
+ * @param names Array of count static strings
+ * @param count Number of states (at most METRICS_MAX_STATES)
+ */
+void metrics_set_state_names(const char *const *names, int count);
+
+/**
+ * @brief Record a state transition; time is charged to the previous state
+ */
+void metrics_state_enter(int state);
+
+/**
+ * @brief Record the time since boot of a milestone, if not seen yet
+ */
+void metrics_mark(metrics_mark_t mark);
+
+/**
+ * @brief Log the milestones reached so far on one line, in ms since boot
+ */
+void metrics_log_timeline(void);
+
+/**
+ * @brief Include a task in the stack high-water mark report
+ */
+void metrics_watch_task(TaskHandle_t task);
+
+/**
+ * @brief Render all metrics as a JSON object
+ *
+ * @return Length written (excluding NUL), or 0 if buf was too small
+ */
+size_t metrics_to_json(char *buf, size_t size);
+
+/**
+ * @brief Encode all metrics as a CBOR map
+ */
+void metrics_to_cbor(cbor_writer_t *w);
+
+/**
+ * @brief Start counting time spent in automatic light sleep
+ *
+ * Call once esp_pm is configured. The total and the number of wakes are
+ * reported as "sleep" in the JSON and "sl" in the CBOR metrics, which is
+ * how a change to the periodic timers can be checked for its effect on
+ * residency.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_SUPPORTED without APP_LOW_POWER and
+ *         PM_LIGHT_SLEEP_CALLBACKS, or the esp_pm error
+ */
+esp_err_t metrics_sleep_init(void);
+
+/**
+ * @brief Record one sample of the MQTT counters and internal heap
+ *
+ * Samples are collected into a ts_block; every
+ * CONFIG_APP_METRICS_TS_SAMPLES samples the encoded block is published to
+ * topic + TS_BLOCK_TOPIC_SUFFIX as a single binary payload. Call on a fixed period. A no-op
+ * without CONFIG_APP_METRICS_TS.
+ *
+ * Series, in block order: connects, disconnects, published, failed,
+ * dropped, expired, spooled, wakeups (delta), outbox bytes, internal
+ * heap free (XOR), internal heap minimum (delta). Timestamps are seconds
+ * since boot.
+ *
+ * @return ESP_OK, or the encode or publish error
+ */
+esp_err_t metrics_ts_sample(const char *topic);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // METRICS_H
@@ -3,234 +3,2567 @@
  * Handles mTLS MQTT connection to the broker.
  */
 
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "mqtt_handler.h"
 #include "certificate_manager.h"
+#include "app_events.h"
+#include "mqtt_tls_transport.h"
+#include "broker_race.h"
+#include "dns_cache.h"
+#include "wifi_roam.h"
+#include "heap_diag.h"
+#include "mqtt_loop_prof.h"
+#include "mqtt_outbox_pool.h"
+#include "mqtt_spool.h"
+#include "net_impair.h"
+#include "cbor_writer.h"
+#include "payload_compress.h"
+#include "link_adapt.h"
+#include "diag_log.h"
+#include "remote_config.h"
+#include "retry_policy.h"
+#include "time_sync.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "lwip/netdb.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "mqtt_client.h"  // ESP-IDF MQTT client
 #include "nvs_flash.h"
 #include "nvs.h"
 
 static const char *TAG = "mqtt_handler";
 
-// Configuration from Kconfig
-#define MQTT_BROKER_URI CONFIG_MQTT_BROKER_URI
-
-// Certificate buffer sizes
-#define CERT_BUFFER_SIZE 4096
+// Broker of the current client, read from remote_config when it is created
+static char s_broker_uri[REMOTE_CONFIG_STR_MAX];
 
 // Global MQTT client handle
 static esp_mqtt_client_handle_t s_mqtt_client = NULL;
-static bool s_mqtt_connected = false;
+static bool s_mqtt_started = false;
+
+// Connection state: the flag for cheap checks on the publish path, the
+// event group (MQTT_HANDLER_EVENT_*) for tasks waiting on a change. Both
+// are written by set_state() only.
+static atomic_bool s_mqtt_connected = false;
+static EventGroupHandle_t s_state_group = NULL;
+static StaticEventGroup_t s_state_group_buf;
+
+// TLS transport owned by s_mqtt_client (destroyed together with it)
+static esp_transport_handle_t s_tls_transport = NULL;
+
+#if CONFIG_MQTT_HANDLER_KEEP_CLIENT
+// Built once and kept across mqtt_handler_stop(); the two above point at
+// them while the handler is prepared or running
+static esp_mqtt_client_handle_t s_kept_client = NULL;
+static esp_transport_handle_t s_kept_transport = NULL;
+#endif
+
+// Keepalive, also used by the transport to sleep through idle periods
+#define MQTT_KEEPALIVE_S CONFIG_MQTT_KEEPALIVE_S
+
+// How MQTT reaches the broker; WebSocket over 443 gets through HTTPS-only networks
+#if CONFIG_MQTT_TRANSPORT_PROFILE_WSS
+#define MQTT_TRANSPORT_PROFILE MQTT_TLS_PROFILE_WSS
+#elif CONFIG_MQTT_TRANSPORT_PROFILE_AUTO
+#define MQTT_TRANSPORT_PROFILE MQTT_TLS_PROFILE_AUTO
+#else
+#define MQTT_TRANSPORT_PROFILE MQTT_TLS_PROFILE_MQTTS
+#endif
+
+// Broker-side session lifetime after a disconnect, 0 for clean sessions
+#define MQTT_SESSION_EXPIRY_S CONFIG_MQTT_SESSION_EXPIRY_S
+
+// Reconnect backoff (the client is kept alive, only the connection is retried)
+#define MQTT_BACKOFF_MIN_MS CONFIG_MQTT_BACKOFF_MIN_MS
+#define MQTT_BACKOFF_MAX_MS CONFIG_MQTT_BACKOFF_MAX_MS
+static esp_timer_handle_t s_reconnect_timer = NULL;
+static retry_policy_t s_retry = RETRY_POLICY_INIT(MQTT_BACKOFF_MIN_MS, MQTT_BACKOFF_MAX_MS);
+static bool s_server_busy = false;          // Broker refused or dropped us for load
+
+// Connection and message counters for mqtt_handler_get_stats()
+static mqtt_handler_stats_t s_stats = {0};
+static int64_t s_connect_start_us = 0;
+
+// Event counts, summarized on one line per CONFIG_MQTT_EVENT_SUMMARY_S
+// instead of a log line per event. Written by the MQTT task only.
+typedef struct {
+    uint32_t connects;
+    uint32_t disconnects;
+    uint32_t subscribed;
+    uint32_t unsubscribed;
+    uint32_t acked;
+    uint32_t deleted;
+    uint32_t errors;
+    uint32_t data;
+    uint32_t data_bytes;
+} mqtt_event_counts_t;
+
+static mqtt_event_counts_t s_events = {0};
+#if CONFIG_MQTT_EVENT_SUMMARY_S > 0
+static esp_timer_handle_t s_summary_timer = NULL;
+#endif
+
+// Fragments of the current inbound message (MQTT task only)
+static uint32_t s_rx_fragments = 0;
+
+// Broker acknowledgement hook, see mqtt_handler_set_ack_cb()
+static mqtt_handler_ack_cb_t s_ack_cb = NULL;
+static void *s_ack_ctx = NULL;
+
+// Certificates loaded from NVS, referenced by the TLS transport while the client exists
+static unsigned char *s_device_cert = NULL;
+static size_t s_device_cert_len = 0;
+static unsigned char *s_device_key = NULL;
+static size_t s_device_key_len = 0;
+static void *s_ds_data = NULL;
+
+// Client buffers; larger messages are split into fragments
+#define MQTT_RX_BUFFER_SIZE CONFIG_MQTT_RX_BUFFER_SIZE
+#define MQTT_TX_BUFFER_SIZE CONFIG_MQTT_TX_BUFFER_SIZE
+#define MQTT_PUBLISH_OVERHEAD 7     // Fixed header (up to 4 length bytes), topic length, msg_id
+
+// Queues and batches follow the outbox into PSRAM when configured
+#if CONFIG_MQTT_HANDLER_BUFFERS_SPIRAM
+#define MQTT_HANDLER_MEMORY MALLOC_CAP_SPIRAM
+#else
+#define MQTT_HANDLER_MEMORY MALLOC_CAP_DEFAULT
+#endif
+
+// Telemetry batching: samples are packed per topic and flushed as one PUBLISH
+#define MQTT_BATCH_TOPICS CONFIG_MQTT_BATCH_MAX_TOPICS
+#define MQTT_BATCH_SIZE CONFIG_MQTT_BATCH_BUFFER_SIZE
+#define MQTT_BATCH_INTERVAL_MS CONFIG_MQTT_BATCH_INTERVAL_MS
+#define MQTT_BATCH_TOPIC_LEN 64
+#define MQTT_BATCH_IDLE_MS 60000        // An empty topic slot is freed after this long without samples
+// Check at a quarter of the shortest interval so a batch waits at most 1.25x the threshold
+#define MQTT_BATCH_TICK_US ((uint64_t)LINK_ADAPT_MIN_FLUSH_MS * 250)
+#if CONFIG_MQTT_BATCH_TIMESTAMPS
+#define MQTT_BATCH_HEADER_MAX 24        // {"up0":<ms>} line
+#define MQTT_BATCH_DT_MAX 18            // "dt":<ms>, added to a sample, plus snprintf's NUL
+#else
+#define MQTT_BATCH_HEADER_MAX 0
+#define MQTT_BATCH_DT_MAX 0
+#endif
+
+typedef struct {
+    char topic[MQTT_BATCH_TOPIC_LEN];
+    int qos;
+    size_t len;
+    uint32_t samples;
+    int64_t first_sample_us;        // Enqueue time of the oldest sample in buf
+    int64_t last_sample_us;         // Enqueue time of the newest sample, for idle slots
+    char buf[MQTT_BATCH_SIZE];
+} mqtt_batch_t;
+
+static mqtt_batch_t *s_batches = NULL;  // Allocated by the first mqtt_handler_prepare()
+static SemaphoreHandle_t s_batch_mutex = NULL;
+static esp_timer_handle_t s_batch_timer = NULL;
+static mqtt_batch_stats_t s_batch_stats = {0};
+static link_adapt_profile_t s_link;     // Flush thresholds, under the batch mutex
+static esp_err_t batch_init(void);
+static void batch_release_idle_locked(int64_t now, int64_t idle_us);
+
+#if CONFIG_MQTT_BATCH_COMPRESS
+// Compressed batches go to topic + COMPRESS_TOPIC_SUFFIX; the output buffer
+// is only used under the batch mutex
+#define COMPRESS_TOPIC_SUFFIX "/hs"
+static uint8_t s_compress_buf[MQTT_BATCH_SIZE];
+#endif
+
+// Async publish: single-producer/single-consumer ring drained by the MQTT task
+#define MQTT_ASYNC_QUEUE_LEN CONFIG_MQTT_ASYNC_QUEUE_LEN
+#define MQTT_ASYNC_MAX_PAYLOAD CONFIG_MQTT_ASYNC_MAX_PAYLOAD
+
+typedef struct {
+    char topic[MQTT_BATCH_TOPIC_LEN];
+    uint16_t len;
+    uint8_t qos;
+    uint32_t commit_us;             // Low 32 bits of esp_timer_get_time() at commit
+    char data[MQTT_ASYNC_MAX_PAYLOAD];
+} mqtt_async_entry_t;
+
+// The client dispatches its own events with a blocking post from its task,
+// the only one running the loop; with a one-entry queue a doorbell waiting
+// there would block that post for good. The doorbell keeps at most one event
+// of ours queued, so two entries already suffice and the rest is headroom.
+#if !defined(CONFIG_MQTT_EVENT_QUEUE_SIZE) || CONFIG_MQTT_EVENT_QUEUE_SIZE < 2
+#error "CONFIG_MQTT_EVENT_QUEUE_SIZE must be at least 2 (enable CONFIG_MQTT_USE_CUSTOM_CONFIG)"
+#endif
+
+static mqtt_async_entry_t *s_async_ring = NULL;    // Allocated on first use
+static atomic_uint s_async_head = 0;                // Written by the producer only
+static atomic_uint s_async_tail = 0;                // Written by the MQTT task only
+static atomic_bool s_async_doorbell = false;        // A drain request is queued
+static atomic_uint s_doorbells = 0;                 // Drain requests posted
+static atomic_uint s_doorbell_coalesced = 0;        // Rings folded into a queued request
+static atomic_uint s_event_queue_full = 0;          // Drain requests the event queue refused
+static atomic_uint s_async_dropped = 0;
+static bool s_async_reserved = false;               // Producer holds the slot at head
+
+#if CONFIG_MQTT_CONFLATE_TOPICS > 0
+// Latest-value topics: one slot per topic holds the newest unsent sample,
+// overwritten by the next one. The MQTT task sends dirty slots on its
+// doorbell, so a slow link costs freshness, not queue space.
+#define MQTT_CONFLATE_TOPICS CONFIG_MQTT_CONFLATE_TOPICS
+#define MQTT_CONFLATE_MAX_PAYLOAD CONFIG_MQTT_CONFLATE_MAX_PAYLOAD
+
+typedef struct {
+    char topic[MQTT_BATCH_TOPIC_LEN];
+    uint16_t len;
+    bool dirty;                     // Holds a sample not sent yet
+    char data[MQTT_CONFLATE_MAX_PAYLOAD];
+} mqtt_latest_slot_t;
+
+static mqtt_latest_slot_t s_latest[MQTT_CONFLATE_TOPICS];
+static int s_latest_count = 0;
+static char s_latest_out[MQTT_CONFLATE_MAX_PAYLOAD];   // MQTT task only
+static portMUX_TYPE s_latest_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+// In-flight window: QoS 1/2 messages handed to the client and not yet
+// acknowledged (or expired). Background publishes wait while it is full.
+#define MQTT_INFLIGHT_WINDOW CONFIG_MQTT_INFLIGHT_WINDOW
+static atomic_uint s_inflight = 0;
+static unsigned int s_inflight_limit = MQTT_INFLIGHT_WINDOW;   // Capped by the broker on connect
+
+#if CONFIG_MQTT_SPOOL_ENABLE
+// Spool drain: records handed to the outbox, retired in order once acknowledged
+#define MQTT_SPOOL_WINDOW_LEN CONFIG_MQTT_SPOOL_WINDOW
+#define MQTT_SPOOL_OUTBOX_HIGH 8192    // Stop draining while the outbox holds this much
+
+typedef struct {
+    int msg_id;
+    uint32_t addr;
+    bool acked;
+} spool_inflight_t;
+
+static spool_inflight_t s_spool_window[MQTT_SPOOL_WINDOW_LEN];
+static unsigned int s_spool_head = 0;
+static unsigned int s_spool_inflight = 0;
+static mqtt_spool_record_t s_spool_rec;     // MQTT task only
+#endif
+
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+// Topic aliases for hot topics, alias = index + 1. An alias is bound again
+// on every connection; until then the topic is sent together with it.
+#define MQTT_ALIAS_MAX CONFIG_MQTT_TOPIC_ALIAS_MAX
+#define MQTT_ALIAS_PREFIX CONFIG_MQTT_TOPIC_ALIAS_PREFIX
+
+typedef struct {
+    char topic[MQTT_BATCH_TOPIC_LEN];
+    uint32_t bound;                 // Connection the broker learnt the alias on, 0: none
+} mqtt_alias_t;
+
+static mqtt_alias_t s_aliases[MQTT_ALIAS_MAX];
+static int s_alias_count = 0;
+static esp_mqtt5_publish_property_config_t s_alias_property;
+static const esp_mqtt5_publish_property_config_t s_no_property = {0};
+static atomic_uint s_alias_conn = 1;            // Counts connections, so bindings expire with theirs
+
+// Publish properties are consumed by the next publish or enqueue call of
+// any task, so setting them and publishing must not interleave. The outbox
+// lane is kept per task and needs no lock. Publishers wait for the
+// client's API lock with the mutex held, and the MQTT task holds that lock
+// while it handles events: there the mutex is only tried, and a holder
+// that made it fail rings the doorbell when it lets go.
+static SemaphoreHandle_t s_publish_mutex = NULL;
+static StaticSemaphore_t s_publish_mutex_buf;
+static atomic_bool s_publish_deferred = false;  // The MQTT task found the mutex taken
+static TaskHandle_t s_mqtt_task = NULL;         // Set by the event handler
+#endif
+
+_Static_assert((int)MQTT_HANDLER_PRIO_CRITICAL == (int)MQTT_OUTBOX_LANE_CRITICAL &&
+               (int)MQTT_HANDLER_PRIO_BULK == (int)MQTT_OUTBOX_LANE_BULK, "priorities are outbox lanes");
+
+// Subscriptions: topic filters compiled into a trie of '/'-separated levels.
+// Nodes are never freed; a removed subscription only clears its bit.
+#define MQTT_SUB_MAX 8
+#define MQTT_SUB_FILTER_LEN 64
+#define MQTT_TRIE_NODES 32
+#define MQTT_TRIE_LEVEL_LEN 24
+#define MQTT_RX_TOPIC_LEN 128
+#define MQTT_RX_DEDUP_DEPTH 16
+
+typedef struct {
+    char filter[MQTT_SUB_FILTER_LEN];
+    int qos;                        // -1: routing only, not subscribed at the broker
+    int pending_id;                 // SUBSCRIBE awaiting its SUBACK, 0 if none
+    bool in_session;                // Granted in the broker's current session
+    mqtt_handler_msg_cb_t cb;
+    void *ctx;
+} mqtt_sub_t;
+
+typedef struct {
+    char level[MQTT_TRIE_LEVEL_LEN];    // Literal level, "+" or "#"
+    int8_t child;                       // First child, -1 if none
+    int8_t next;                        // Next sibling, -1 if none
+    uint8_t subs;                       // Bitmask of subscriptions ending here
+} trie_node_t;
+
+static mqtt_sub_t s_subs[MQTT_SUB_MAX];
+static trie_node_t s_trie[MQTT_TRIE_NODES];
+static int s_trie_used = 0;                     // Node 0 is the root once used
+static SemaphoreHandle_t s_sub_mutex = NULL;
+
+// Message being received (MQTT task only)
+static uint8_t s_rx_subs = 0;
+static char s_rx_topic[MQTT_RX_TOPIC_LEN];
+static int s_rx_topic_len = 0;
+static bool s_rx_dup = false;                   // Redelivery, swallowed
+
+// Last QoS 1/2 messages delivered, to recognise redeliveries (MQTT task only)
+typedef struct {
+    uint16_t msg_id;                // 0: empty, packet identifiers start at 1
+    uint32_t key;                   // Topic hash mixed with the payload length
+} rx_seen_t;
+
+static rx_seen_t s_rx_seen[MQTT_RX_DEDUP_DEPTH];
+static uint8_t s_rx_seen_next = 0;
+
+/**
+ * @brief Free the certificates loaded by mqtt_handler_start()
+ */
+static void release_certificates(void)
+{
+    free(s_device_cert);
+    s_device_cert = NULL;
+    s_device_cert_len = 0;
+    if (s_device_key != NULL) {
+        memset(s_device_key, 0, s_device_key_len);
+        free(s_device_key);
+    }
+    s_device_key = NULL;
+    s_device_key_len = 0;
+    free(s_ds_data);
+    s_ds_data = NULL;
+}
+
+/**
+ * @brief Idle check for the transport: nothing to retransmit or expire
+ *
+ * Everything else that gives the client work wakes the transport.
+ */
+static bool client_idle(void)
+{
+    return esp_mqtt_client_get_outbox_size(s_mqtt_client) == 0;
+}
+
+/**
+ * @brief Reconnect timer callback (esp_timer task)
+ */
+static void reconnect_timer_cb(void *arg)
+{
+    if (s_mqtt_client != NULL && esp_mqtt_client_reconnect(s_mqtt_client) != ESP_OK) {
+        ESP_LOGW(TAG, "Reconnect request ignored by MQTT client");
+    }
+}
+
+/**
+ * @brief Broker reason codes that mean "come back later" rather than "no"
+ */
+static bool reason_is_busy(int code)
+{
+    switch (code) {
+    case MQTT_CONNECTION_REFUSE_SERVER_UNAVAILABLE:
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    case MQTT5_SERVER_UNAVAILABLE:
+    case MQTT5_SERVER_BUSY:
+    case MQTT5_QUOTA_EXCEEDED:
+    case MQTT5_CONNECTION_RATE_EXCEEDED:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Schedule the next reconnect attempt with decorrelated jitter
+ *
+ * See retry_policy.h. A broker that said it is busy gets at least half the
+ * maximum backoff before this device tries again.
+ */
+static void schedule_reconnect(void)
+{
+    uint32_t delay_ms = retry_policy_next_hint(&s_retry, s_server_busy ? MQTT_BACKOFF_MAX_MS / 2 : 0);
+    s_server_busy = false;
+
+    esp_timer_stop(s_reconnect_timer);
+    esp_err_t err = esp_timer_start_once(s_reconnect_timer, (uint64_t)delay_ms * 1000);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to schedule reconnect: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Reconnecting in %lu ms (attempt %lu)", (unsigned long)delay_ms, (unsigned long)s_retry.attempts);
+}
+
+/**
+ * @brief Wake the MQTT task to drain the async ring and the spool
+ *
+ * Posts at most one event per drain and never waits for the event queue.
+ * Every ring until the MQTT task takes the event joins it, so one event
+ * run moves the whole burst into the client.
+ */
+static void ring_doorbell(void)
+{
+    if (s_mqtt_client == NULL) {
+        return;
+    }
+    if (atomic_exchange(&s_async_doorbell, true)) {
+        // The queued request drains this work too
+        atomic_fetch_add(&s_doorbell_coalesced, 1);
+        return;
+    }
+    esp_mqtt_event_t doorbell = {
+        .event_id = MQTT_USER_EVENT,
+    };
+    if (esp_mqtt_dispatch_custom_event(s_mqtt_client, &doorbell) != ESP_OK) {
+        // Event queue full: the next publish retries the doorbell
+        atomic_store(&s_async_doorbell, false);
+        atomic_fetch_add(&s_event_queue_full, 1);
+        return;
+    }
+    atomic_fetch_add(&s_doorbells, 1);
+    mqtt_tls_transport_wake(s_tls_transport);
+}
+
+/**
+ * @brief Take the publish mutex; on the MQTT task only when it is free
+ *
+ * Recursive, so a drain holding it can publish through the helpers that
+ * take it themselves.
+ *
+ * @return false on the MQTT task if another publisher holds it
+ */
+static bool publish_lock(void)
+{
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    if (s_publish_mutex == NULL) {
+        return true;
+    }
+    if (xTaskGetCurrentTaskHandle() != s_mqtt_task) {
+        xSemaphoreTakeRecursive(s_publish_mutex, portMAX_DELAY);
+        return true;
+    }
+    // Set before trying: a holder letting go after a failed try sees it
+    atomic_store(&s_publish_deferred, true);
+    if (xSemaphoreTakeRecursive(s_publish_mutex, 0) != pdTRUE) {
+        return false;
+    }
+    atomic_store(&s_publish_deferred, false);
+#endif
+    return true;
+}
+
+static void publish_unlock(void)
+{
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    if (s_publish_mutex == NULL) {
+        return;
+    }
+    xSemaphoreGiveRecursive(s_publish_mutex);
+    if (xTaskGetCurrentTaskHandle() != s_mqtt_task && atomic_exchange(&s_publish_deferred, false)) {
+        // The MQTT task skipped a drain for us
+        ring_doorbell();
+    }
+#endif
+}
+
+static bool inflight_full(void)
+{
+    return atomic_load(&s_inflight) >= s_inflight_limit;
+}
+
+static void inflight_add(int qos)
+{
+    if (qos > 0) {
+        atomic_fetch_add(&s_inflight, 1);
+    }
+}
+
+/**
+ * @brief A QoS 1/2 message left the outbox (MQTT task)
+ */
+static void inflight_release(void)
+{
+    unsigned int n = atomic_load(&s_inflight);
+    while (n > 0 && !atomic_compare_exchange_weak(&s_inflight, &n, n - 1)) {
+    }
+}
+
+/**
+ * @brief Drop any count that went astray once nothing is left to acknowledge
+ *
+ * Entries expired without MQTT_REPORT_DELETED_MESSAGES leave no event.
+ */
+static void inflight_resync(void)
+{
+    if (esp_mqtt_client_get_outbox_size(s_mqtt_client) == 0) {
+        atomic_store(&s_inflight, 0);
+    }
+}
+
+/**
+ * @brief Window size for a new connection: ours, or the broker's Receive
+ *        Maximum if that is smaller
+ */
+static void inflight_connected(void)
+{
+    unsigned int limit = MQTT_INFLIGHT_WINDOW;
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    uint16_t broker = mqtt_tls_transport_get_receive_maximum(s_tls_transport);
+    if (broker != 0 && broker < limit) {
+        ESP_LOGI(TAG, "Broker Receive Maximum %u, in-flight window reduced from %u", broker, limit);
+        limit = broker;
+    }
+#endif
+    s_inflight_limit = limit;
+    inflight_resync();
+}
+
+/**
+ * @brief Hand a message to the outbox, or to the flash spool while offline
+ *
+ * Once anything is spooled, later messages follow it into the spool so
+ * the broker still sees them in order. A QoS 1/2 message that finds the
+ * in-flight window full is spooled too, and sent as acknowledgements free
+ * the window. Critical messages always go to the outbox, ahead of the
+ * backlog.
+ *
+ * A message the outbox refuses (full, or the heap at its reserve) is
+ * spooled as well.
+ *
+ * @return msg_id (0 when spooled), or -1 on failure
+ */
+static int store_message(const char *topic, const char *data, int len, int qos, mqtt_handler_prio_t prio)
+{
+    if (prio != MQTT_HANDLER_PRIO_CRITICAL &&
+        (!atomic_load(&s_mqtt_connected) || mqtt_spool_pending() > 0 || (qos > 0 && inflight_full())) &&
+        mqtt_spool_append(topic, data, len, qos) == ESP_OK) {
+        return 0;
+    }
+    if (s_mqtt_client == NULL) {
+        return -1;
+    }
+    int msg_id = -1;
+    if (publish_lock()) {
+        mqtt_outbox_pool_set_lane((mqtt_outbox_lane_t)prio);
+        int64_t api_us = mqtt_loop_prof_api_start();
+        msg_id = esp_mqtt_client_enqueue(s_mqtt_client, topic, data, len, qos, 0, true);
+        mqtt_loop_prof_api(api_us);
+        // Not consumed if the client refused the message
+        mqtt_outbox_pool_set_lane(MQTT_OUTBOX_LANE_NORMAL);
+        publish_unlock();
+    }
+    if (msg_id < 0 && prio != MQTT_HANDLER_PRIO_CRITICAL && mqtt_spool_append(topic, data, len, qos) == ESP_OK) {
+        // Outbox full or short of heap: flash holds it until there is room
+        return 0;
+    }
+    if (msg_id >= 0) {
+        inflight_add(qos);
+        // Sent on the client's next loop pass, which this starts now
+        mqtt_tls_transport_wake(s_tls_transport);
+    }
+    return msg_id;
+}
+
+#if CONFIG_MQTT_SPOOL_ENABLE
+/**
+ * @brief Consume acknowledged records at the front of the window
+ */
+static void spool_retire(void)
+{
+    while (s_spool_inflight > 0 && s_spool_window[s_spool_head].acked) {
+        mqtt_spool_consume(s_spool_window[s_spool_head].addr);
+        s_spool_head = (s_spool_head + 1) % MQTT_SPOOL_WINDOW_LEN;
+        s_spool_inflight--;
+    }
+}
+
+/**
+ * @brief Move spooled records into the outbox (MQTT task)
+ *
+ * QoS 0 records count as delivered once queued; QoS 1/2 records stay in
+ * the window until MQTT_EVENT_PUBLISHED. Draining also stops while the
+ * in-flight window is full, and resumes with the next acknowledgement.
+ */
+static void spool_drain(void)
+{
+    while (atomic_load(&s_mqtt_connected) && s_spool_inflight < MQTT_SPOOL_WINDOW_LEN && !inflight_full() &&
+           esp_mqtt_client_get_outbox_size(s_mqtt_client) < MQTT_SPOOL_OUTBOX_HIGH) {
+        if (mqtt_spool_peek(&s_spool_rec) != ESP_OK) {
+            break;
+        }
+        if (!publish_lock()) {
+            // Drained again when the publisher holding it lets go
+            break;
+        }
+        mqtt_outbox_pool_set_lane(MQTT_OUTBOX_LANE_BULK);
+        // QoS 0 records are consumed below, so only QoS 1/2 ones remain in flash
+        mqtt_outbox_pool_set_spooled(s_spool_rec.qos > 0);
+        int64_t api_us = mqtt_loop_prof_api_start();
+        int msg_id = esp_mqtt_client_enqueue(s_mqtt_client, s_spool_rec.topic, (const char *)s_spool_rec.data,
+                                             s_spool_rec.len, s_spool_rec.qos, 0, true);
+        mqtt_loop_prof_api(api_us);
+        mqtt_outbox_pool_set_lane(MQTT_OUTBOX_LANE_NORMAL);
+        mqtt_outbox_pool_set_spooled(false);
+        publish_unlock();
+        if (msg_id < 0) {
+            // Retried on the next ack or spool timer tick
+            break;
+        }
+        inflight_add(s_spool_rec.qos);
+        mqtt_tls_transport_wake(s_tls_transport);
+        mqtt_spool_advance();
+        s_stats.published++;
+
+        spool_inflight_t *slot = &s_spool_window[(s_spool_head + s_spool_inflight) % MQTT_SPOOL_WINDOW_LEN];
+        slot->msg_id = msg_id;
+        slot->addr = s_spool_rec.addr;
+        slot->acked = s_spool_rec.qos == 0;
+        s_spool_inflight++;
+        spool_retire();
+    }
+}
+
+static void spool_ack(int msg_id)
+{
+    for (unsigned int i = 0; i < s_spool_inflight; i++) {
+        spool_inflight_t *slot = &s_spool_window[(s_spool_head + i) % MQTT_SPOOL_WINDOW_LEN];
+        if (slot->msg_id == msg_id) {
+            slot->acked = true;
+            spool_retire();
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Forget the window and resend from the oldest undelivered record
+ */
+static void spool_restart(void)
+{
+    s_spool_head = 0;
+    s_spool_inflight = 0;
+    mqtt_spool_rewind();
+}
+
+/**
+ * @brief A spooled record whose outbox entry expired is sent again
+ */
+static void spool_expired(int msg_id)
+{
+    for (unsigned int i = 0; i < s_spool_inflight; i++) {
+        if (s_spool_window[(s_spool_head + i) % MQTT_SPOOL_WINDOW_LEN].msg_id == msg_id) {
+            spool_restart();
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Keep a message the outbox evicted to save heap (client lock held)
+ */
+static esp_err_t spool_spill(const char *topic, size_t topic_len, const char *data, size_t len, int qos)
+{
+    char name[MQTT_SPOOL_TOPIC_MAX];
+    if (topic_len >= sizeof(name)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(name, topic, topic_len);
+    name[topic_len] = '\0';
+    return mqtt_spool_append(name, data, len, qos);
+}
+
+/**
+ * @brief Spool timer: keep draining while connected (esp_timer task)
+ */
+static void spool_on_backlog(void)
+{
+    if (atomic_load(&s_mqtt_connected)) {
+        ring_doorbell();
+    }
+}
+#else
+static void spool_drain(void) {}
+static void spool_ack(int msg_id) {}
+static void spool_restart(void) {}
+static void spool_expired(int msg_id) {}
+#define spool_on_backlog NULL
+#define spool_spill NULL
+#endif
+
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+/**
+ * @brief Alias slot of a topic, assigned on first use (publish mutex held)
+ *
+ * @return Index into s_aliases, -1 if the topic is not aliased
+ */
+static int alias_get(const char *topic)
+{
+    if (strncmp(topic, MQTT_ALIAS_PREFIX, strlen(MQTT_ALIAS_PREFIX)) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < s_alias_count; i++) {
+        if (strcmp(s_aliases[i].topic, topic) == 0) {
+            return i;
+        }
+    }
+    if (s_alias_count == MQTT_ALIAS_MAX || strlen(topic) >= MQTT_BATCH_TOPIC_LEN) {
+        return -1;
+    }
+    strcpy(s_aliases[s_alias_count].topic, topic);
+    s_aliases[s_alias_count].bound = 0;
+    return s_alias_count++;
+}
+
+/**
+ * @brief Publish immediately with alias slot a (-1 for none), publish mutex held
+ *
+ * Only QoS 0 publishes drop the topic string: they are written once on the
+ * current connection, while QoS 1/2 messages may be resent on a later one
+ * where the alias is not bound.
+ */
+static int publish_aliased(const char *topic, int a, const char *data, int len, int qos)
+{
+    // Read first: a reconnect meanwhile leaves the binding with the old connection
+    uint32_t conn = atomic_load(&s_alias_conn);
+    if (a >= 0) {
+        s_alias_property.topic_alias = a + 1;
+        if (esp_mqtt5_client_set_publish_property(s_mqtt_client, &s_alias_property) != ESP_OK) {
+            // Above the broker's maximum
+            a = -1;
+        }
+    }
+
+    bool short_form = a >= 0 && s_aliases[a].bound == conn && qos == 0;
+    int64_t api_us = mqtt_loop_prof_api_start();
+    int msg_id = esp_mqtt_client_publish(s_mqtt_client, short_form ? "" : topic, data, len, qos, 0);
+    mqtt_loop_prof_api(api_us);
+    if (a >= 0 && msg_id < 0) {
+        // Not consumed: keep it away from the next publish
+        esp_mqtt5_client_set_publish_property(s_mqtt_client, &s_no_property);
+    } else if (a >= 0 && atomic_load(&s_mqtt_connected)) {
+        s_aliases[a].bound = conn;
+    }
+    return msg_id;
+}
+
+static int publish_direct(const char *topic, const char *data, int len, int qos)
+{
+    if (!publish_lock()) {
+        return -1;
+    }
+    int msg_id = publish_aliased(topic, alias_get(topic), data, len, qos);
+    publish_unlock();
+    return msg_id;
+}
+
+/**
+ * @brief Publish on a prepared topic; the alias lookup runs once per handle
+ */
+static int publish_prepared(mqtt_handler_topic_t *t, const char *data, int len)
+{
+    if (!publish_lock()) {
+        return -1;
+    }
+    if (t->alias == MQTT_TOPIC_ALIAS_UNRESOLVED) {
+        t->alias = (int8_t)alias_get(t->topic);
+    }
+    int msg_id = publish_aliased(t->topic, t->alias, data, len, t->qos);
+    publish_unlock();
+    return msg_id;
+}
 
-// Certificate buffers
-static char s_device_cert[CERT_BUFFER_SIZE] = {0};
-static char s_ca_cert[CERT_BUFFER_SIZE] = {0};
+/**
+ * @brief Forget the bindings of the last connection (MQTT task, no lock)
+ */
+static void alias_reset(void)
+{
+    atomic_fetch_add(&s_alias_conn, 1);
+}
+#else
+static int publish_direct(const char *topic, const char *data, int len, int qos)
+{
+    int64_t api_us = mqtt_loop_prof_api_start();
+    int msg_id = esp_mqtt_client_publish(s_mqtt_client, topic, data, len, qos, 0);
+    mqtt_loop_prof_api(api_us);
+    return msg_id;
+}
+
+static int publish_prepared(mqtt_handler_topic_t *t, const char *data, int len)
+{
+    int64_t api_us = mqtt_loop_prof_api_start();
+    int msg_id = esp_mqtt_client_publish(s_mqtt_client, t->topic, data, len, t->qos, 0);
+    mqtt_loop_prof_api(api_us);
+    return msg_id;
+}
+
+static void alias_reset(void) {}
+#endif
+
+/**
+ * @brief Move queued async publishes into the client outbox (MQTT task)
+ */
+static void async_drain(void)
+{
+    // Clear first: a producer that fills the ring after this point rings again
+    atomic_store(&s_async_doorbell, false);
+
+    if (s_async_ring == NULL || s_mqtt_client == NULL || !publish_lock()) {
+        return;
+    }
+
+    unsigned int tail = atomic_load_explicit(&s_async_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&s_async_head, memory_order_acquire);
+    while (tail != head) {
+        mqtt_async_entry_t *e = &s_async_ring[tail % MQTT_ASYNC_QUEUE_LEN];
+#if !CONFIG_MQTT_SPOOL_ENABLE
+        if (e->qos > 0 && atomic_load(&s_mqtt_connected) && inflight_full()) {
+            // Left in the ring until an acknowledgement frees the window
+            break;
+        }
+#endif
+
+        // Commit-to-drain latency: how long producers wait for the MQTT task
+        uint32_t latency_us = (uint32_t)esp_timer_get_time() - e->commit_us;
+        s_stats.async_latency_avg_us += ((int32_t)latency_us - (int32_t)s_stats.async_latency_avg_us) / 8;
+        if (latency_us > s_stats.async_latency_max_us) {
+            s_stats.async_latency_max_us = latency_us;
+        }
+
+        if (store_message(e->topic, e->data, e->len, e->qos, MQTT_HANDLER_PRIO_NORMAL) < 0) {
+            atomic_fetch_add(&s_async_dropped, 1);
+            s_stats.publish_failed++;
+        } else {
+            s_stats.published++;
+        }
+        tail++;
+        atomic_store_explicit(&s_async_tail, tail, memory_order_release);
+    }
+    publish_unlock();
+}
+
+#if CONFIG_MQTT_CONFLATE_TOPICS > 0
+/**
+ * @brief Send the newest sample of every latest-value topic (MQTT task)
+ *
+ * Each publish may wait for the link; samples arriving meanwhile replace
+ * the ones still in their slots.
+ */
+static void latest_drain(void)
+{
+    if (!atomic_load(&s_mqtt_connected) || !publish_lock()) {
+        return;
+    }
+    for (int i = 0; i < s_latest_count; i++) {
+        mqtt_latest_slot_t *slot = &s_latest[i];
+        portENTER_CRITICAL(&s_latest_lock);
+        bool dirty = slot->dirty;
+        uint16_t len = slot->len;
+        if (dirty) {
+            memcpy(s_latest_out, slot->data, len);
+            slot->dirty = false;
+        }
+        portEXIT_CRITICAL(&s_latest_lock);
+
+        if (!dirty) {
+            continue;
+        }
+        // The topic of a claimed slot never changes
+        if (publish_direct(slot->topic, s_latest_out, len, 0) < 0) {
+            s_stats.publish_failed++;
+        } else {
+            s_stats.published++;
+        }
+    }
+    publish_unlock();
+}
+#else
+static void latest_drain(void) {}
+#endif
+
+static int trie_new_node(const char *level, size_t len)
+{
+    if (s_trie_used == MQTT_TRIE_NODES || len >= MQTT_TRIE_LEVEL_LEN) {
+        return -1;
+    }
+    trie_node_t *n = &s_trie[s_trie_used];
+    memcpy(n->level, level, len);
+    n->level[len] = '\0';
+    n->child = -1;
+    n->next = -1;
+    n->subs = 0;
+    return s_trie_used++;
+}
+
+/**
+ * @brief Find or create the node of a filter (subscription mutex held)
+ *
+ * @return Node index, -1 if the trie is full or a level is too long
+ */
+static int trie_insert(const char *filter)
+{
+    if (s_trie_used == 0 && trie_new_node("", 0) < 0) {
+        return -1;
+    }
+
+    int node = 0;
+    const char *level = filter;
+    while (true) {
+        size_t len = strcspn(level, "/");
+        int c = s_trie[node].child;
+        while (c >= 0 && (strlen(s_trie[c].level) != len || memcmp(s_trie[c].level, level, len) != 0)) {
+            c = s_trie[c].next;
+        }
+        if (c < 0) {
+            c = trie_new_node(level, len);
+            if (c < 0) {
+                return -1;
+            }
+            s_trie[c].next = s_trie[node].child;
+            s_trie[node].child = c;
+        }
+        node = c;
+        if (level[len] == '\0') {
+            return node;
+        }
+        level += len + 1;
+    }
+}
+
+/**
+ * @brief Collect the subscriptions whose filter matches the rest of a topic
+ *
+ * @param node Node matched so far; its children are tried against the next level
+ * @param level Start of the next topic level
+ * @param end End of the topic
+ * @param first True at the root, where wildcards do not match "$" topics
+ */
+static uint8_t trie_match(int node, const char *level, const char *end, bool first)
+{
+    const char *slash = memchr(level, '/', end - level);
+    size_t len = (slash ? slash : end) - level;
+    bool wildcards = !(first && len > 0 && level[0] == '$');
+    uint8_t subs = 0;
+
+    for (int c = s_trie[node].child; c >= 0; c = s_trie[c].next) {
+        const char *l = s_trie[c].level;
+        if (l[0] == '#' && l[1] == '\0') {
+            if (wildcards) {
+                subs |= s_trie[c].subs;
+            }
+            continue;
+        }
+        bool plus = (l[0] == '+' && l[1] == '\0');
+        if ((plus && !wildcards) || (!plus && (strlen(l) != len || memcmp(l, level, len) != 0))) {
+            continue;
+        }
+        if (slash != NULL) {
+            subs |= trie_match(c, slash + 1, end, false);
+            continue;
+        }
+        subs |= s_trie[c].subs;
+        // "a/#" also matches "a"
+        for (int h = s_trie[c].child; h >= 0; h = s_trie[h].next) {
+            if (s_trie[h].level[0] == '#' && s_trie[h].level[1] == '\0') {
+                subs |= s_trie[h].subs;
+            }
+        }
+    }
+    return subs;
+}
+
+/**
+ * @brief Whether a first chunk repeats a recently delivered message
+ *
+ * A QoS 1 PUBLISH is sent again with DUP set when the broker missed our
+ * PUBACK, often after a reconnect. Packet identifiers are reused once
+ * acknowledged, so a match also needs the same topic and length, and only
+ * a DUP message is ever suppressed. Every QoS 1/2 message is remembered.
+ */
+static bool rx_duplicate(esp_mqtt_event_handle_t event)
+{
+    if (event->qos == 0 || event->msg_id <= 0) {
+        return false;
+    }
+    uint32_t key = 2166136261u;
+    for (int i = 0; i < event->topic_len; i++) {
+        key = (key ^ (uint8_t)event->topic[i]) * 16777619u;
+    }
+    key ^= (uint32_t)event->total_data_len * 2654435761u;
+
+    if (event->dup) {
+        for (int i = 0; i < MQTT_RX_DEDUP_DEPTH; i++) {
+            if (s_rx_seen[i].msg_id == event->msg_id && s_rx_seen[i].key == key) {
+                return true;
+            }
+        }
+    }
+    s_rx_seen[s_rx_seen_next] = (rx_seen_t){ .msg_id = (uint16_t)event->msg_id, .key = key };
+    s_rx_seen_next = (s_rx_seen_next + 1) % MQTT_RX_DEDUP_DEPTH;
+    return false;
+}
+
+/**
+ * @brief Route a MQTT_EVENT_DATA chunk to the matching subscriptions
+ *
+ * Only the first chunk of a message carries the topic; it is kept for the
+ * following ones, which go to the subscriptions selected by it.
+ *
+ * @return true if at least one subscription took the chunk
+ */
+static bool sub_deliver(esp_mqtt_event_handle_t event)
+{
+    if (event->current_data_offset == 0) {
+        s_rx_subs = 0;
+        s_rx_dup = false;
+        if (event->topic == NULL || s_sub_mutex == NULL) {
+            return false;
+        }
+        if (rx_duplicate(event)) {
+            s_stats.rx_duplicates++;
+            ESP_LOGW(TAG, "Redelivered message %d on %.*s ignored", event->msg_id, event->topic_len, event->topic);
+            s_rx_dup = true;
+            return true;
+        }
+        s_rx_topic_len = event->topic_len < MQTT_RX_TOPIC_LEN - 1 ? event->topic_len : MQTT_RX_TOPIC_LEN - 1;
+        memcpy(s_rx_topic, event->topic, s_rx_topic_len);
+        s_rx_topic[s_rx_topic_len] = '\0';
+
+        xSemaphoreTake(s_sub_mutex, portMAX_DELAY);
+        if (s_trie_used > 0) {
+            s_rx_subs = trie_match(0, event->topic, event->topic + event->topic_len, true);
+        }
+        xSemaphoreGive(s_sub_mutex);
+    }
+    if (s_rx_subs == 0) {
+        return s_rx_dup;
+    }
+
+    mqtt_handler_msg_t msg = {
+        .topic = s_rx_topic,
+        .topic_len = s_rx_topic_len,
+        .data = event->data,
+        .len = event->data_len,
+        .offset = event->current_data_offset,
+        .total_len = event->total_data_len,
+    };
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    // The client reuses the property block, so it only describes the first chunk
+    if (event->current_data_offset == 0 && event->protocol_ver == MQTT_PROTOCOL_V_5 && event->property != NULL) {
+        msg.response_topic = event->property->response_topic;
+        msg.response_topic_len = event->property->response_topic_len;
+        msg.correlation = event->property->correlation_data;
+        msg.correlation_len = event->property->correlation_data_len;
+    }
+#endif
+    for (int i = 0; i < MQTT_SUB_MAX; i++) {
+        if ((s_rx_subs & (1u << i)) == 0 || s_subs[i].cb == NULL) {
+            continue;
+        }
+        if (s_subs[i].cb(&msg, s_subs[i].ctx) != ESP_OK) {
+            ESP_LOGW(TAG, "Handler for %s rejected chunk at %d, dropping message",
+                     s_subs[i].filter, event->current_data_offset);
+            s_rx_subs &= ~(1u << i);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Subscribe the filters missing from the session, in one SUBSCRIBE
+ *
+ * A resumed session still holds what the broker granted before, so only
+ * filters added since (or never acknowledged) go out; a new session gets
+ * them all. Either way reconnect-to-ready is at most one round trip.
+ *
+ * @param session_present CONNACK flag of this connection
+ */
+static void sub_renew(bool session_present)
+{
+    if (s_sub_mutex == NULL) {
+        return;
+    }
+    esp_mqtt_topic_t list[MQTT_SUB_MAX];
+    int count = 0;
+
+    xSemaphoreTake(s_sub_mutex, portMAX_DELAY);
+    for (int i = 0; i < MQTT_SUB_MAX; i++) {
+        s_subs[i].pending_id = 0;
+        if (!session_present) {
+            s_subs[i].in_session = false;
+        }
+        if (s_subs[i].cb != NULL && s_subs[i].qos >= 0 && !s_subs[i].in_session) {
+            list[count++] = (esp_mqtt_topic_t){ .filter = s_subs[i].filter, .qos = s_subs[i].qos };
+        }
+    }
+    if (count > 0) {
+        int msg_id = esp_mqtt_client_subscribe(s_mqtt_client, list, count);
+        if (msg_id < 0) {
+            ESP_LOGW(TAG, "Failed to subscribe to %d filters", count);
+        }
+        for (int i = 0; msg_id > 0 && i < MQTT_SUB_MAX; i++) {
+            if (s_subs[i].cb != NULL && s_subs[i].qos >= 0 && !s_subs[i].in_session) {
+                s_subs[i].pending_id = msg_id;
+            }
+        }
+    }
+    xSemaphoreGive(s_sub_mutex);
+    ESP_LOGI(TAG, "Session %s, %d filters subscribed", session_present ? "resumed" : "new", count);
+}
+
+/**
+ * @brief Record the filters a SUBACK granted (MQTT task)
+ *
+ * The return codes follow the filters of the SUBSCRIBE, which lists the
+ * slots in index order.
+ */
+static void sub_acked(const esp_mqtt_event_t *event)
+{
+    if (s_sub_mutex == NULL) {
+        return;
+    }
+    int code = 0;
+    xSemaphoreTake(s_sub_mutex, portMAX_DELAY);
+    for (int i = 0; i < MQTT_SUB_MAX; i++) {
+        if (s_subs[i].pending_id != event->msg_id || s_subs[i].cb == NULL) {
+            continue;
+        }
+        s_subs[i].pending_id = 0;
+        if (code < event->data_len && (uint8_t)event->data[code] < 0x80) {
+            s_subs[i].in_session = true;
+        } else {
+            ESP_LOGW(TAG, "Broker refused %s", s_subs[i].filter);
+        }
+        code++;
+    }
+    xSemaphoreGive(s_sub_mutex);
+}
+
+/**
+ * @brief MQTT_EVENT_DATA handler
+ *
+ * Registered for this id alone so inbound messages do not go through the
+ * general handler below.
+ */
+static void mqtt_data_handler(void *handler_args, esp_event_base_t base,
+                              int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+
+    s_rx_fragments = event->current_data_offset == 0 ? 1 : s_rx_fragments + 1;
+    if (s_rx_fragments > s_stats.rx_fragments_max) {
+        s_stats.rx_fragments_max = s_rx_fragments;
+    }
+
+    if (event->current_data_offset == 0) {
+        s_events.data++;
+    }
+    s_events.data_bytes += event->data_len;
+
+#if CONFIG_APP_DIAG_VERBOSE
+    ESP_LOGI(TAG, "DATA %.*s: %.*s", event->topic_len, event->topic, event->data_len, event->data);
+#endif
+    if (sub_deliver(event)) {
+        return;
+    }
+    diag_log_record("mqtt< %.*s (%d bytes)", event->topic_len, event->topic, event->data_len);
+}
+
+#if CONFIG_MQTT_EVENT_SUMMARY_S > 0
+/**
+ * @brief Log what happened since the last summary, if anything (esp_timer task)
+ */
+static void summary_timer_cb(void *arg)
+{
+    static mqtt_event_counts_t last;
+    mqtt_event_counts_t now = s_events;
+
+    if (memcmp(&now, &last, sizeof(now)) == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "Last %ds: %lu acked, %lu received (%lu bytes), %lu deleted, %lu errors, "
+             "%lu connects, %lu disconnects, %lu (un)subscribes",
+             CONFIG_MQTT_EVENT_SUMMARY_S,
+             (unsigned long)(now.acked - last.acked), (unsigned long)(now.data - last.data),
+             (unsigned long)(now.data_bytes - last.data_bytes),
+             (unsigned long)(now.deleted - last.deleted), (unsigned long)(now.errors - last.errors),
+             (unsigned long)(now.connects - last.connects),
+             (unsigned long)(now.disconnects - last.disconnects),
+             (unsigned long)(now.subscribed - last.subscribed + now.unsubscribed - last.unsubscribed));
+    last = now;
+}
+#endif
+
+/**
+ * @brief Point the client at the broker that wins the race (MQTT task)
+ *
+ * Runs just before the client reads the host and port for its transport
+ * connect, so a different winner takes effect on this attempt.
+ */
+static void broker_pick(void)
+{
+    char uri[REMOTE_CONFIG_STR_MAX];
+    if (broker_race_pick(uri, sizeof(uri)) == ESP_ERR_INVALID_STATE || strcmp(uri, s_broker_uri) == 0) {
+        return;
+    }
+    if (esp_mqtt_client_set_uri(s_mqtt_client, uri) != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot switch to broker %s", uri);
+        return;
+    }
+    strlcpy(s_broker_uri, uri, sizeof(s_broker_uri));
+    ESP_LOGI(TAG, "Switched to broker %s", s_broker_uri);
+}
+
+/**
+ * @brief Move to one MQTT_HANDLER_EVENT_* state and wake its waiters
+ */
+static void set_state(EventBits_t state)
+{
+    atomic_store(&s_mqtt_connected, state == MQTT_HANDLER_EVENT_CONNECTED);
+    if (s_state_group != NULL) {
+        // Clear first so a waiter never sees two states at once
+        xEventGroupClearBits(s_state_group, ~state & (MQTT_HANDLER_EVENT_CONNECTED |
+                                                      MQTT_HANDLER_EVENT_DISCONNECTED |
+                                                      MQTT_HANDLER_EVENT_STOPPED));
+        xEventGroupSetBits(s_state_group, state);
+    }
+}
+
+/**
+ * @brief MQTT event handler
+ */
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
+                               int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    // The client's task, which holds its API lock while in here
+    s_mqtt_task = xTaskGetCurrentTaskHandle();
+#endif
+
+    switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+#if CONFIG_APP_HEAP_DIAG
+        heap_diag_connect_begin();
+#endif
+        s_connect_start_us = esp_timer_get_time();
+        broker_pick();
+        mqtt_tls_transport_set_tcp_profile(s_tls_transport,
+                                           remote_config_get_int(REMOTE_CONFIG_TCP_PROFILE) == 1 ?
+                                           MQTT_TLS_TCP_THROUGHPUT : MQTT_TLS_TCP_LATENCY);
+        break;
+
+    case MQTT_EVENT_CONNECTED:
+        alias_reset();
+        broker_race_report(s_broker_uri, true);
+        set_state(MQTT_HANDLER_EVENT_CONNECTED);
+        retry_policy_reset(&s_retry);
+        s_stats.connects++;
+        s_events.connects++;
+        s_stats.last_connect_ms = (uint32_t)((esp_timer_get_time() - s_connect_start_us) / 1000);
+        ESP_LOGI(TAG, "Connected to broker (mTLS%s), %lu ms",
+                 mqtt_tls_transport_is_ws(s_tls_transport) ? " over WebSocket" : "",
+                 (unsigned long)s_stats.last_connect_ms);
+#if CONFIG_APP_HEAP_DIAG
+        heap_diag_connect_end(true);
+#endif
+        mqtt_tls_transport_save_session(s_tls_transport);
+        app_events_post(APP_EVENT_MQTT_CONNECTED);
+        inflight_connected();
+        mqtt_outbox_pool_connected();
+        sub_renew(event->session_present != 0);
+        async_drain();
+        latest_drain();
+        spool_drain();
+        break;
+
+    case MQTT_EVENT_DISCONNECTED:
+        ESP_LOGW(TAG, "Disconnected from broker");
+        bool link_down = false;
+#if CONFIG_APP_WIFI_ROAM
+        // A connect cut off by a roam says nothing about the broker
+        link_down = wifi_roam_in_progress();
+#endif
+        if (!atomic_load(&s_mqtt_connected) && !link_down) {
+            // The connect itself failed: rank this broker behind the others
+            // and stop trusting its cached address
+            broker_race_report(s_broker_uri, false);
+            dns_cache_invalidate(s_broker_uri);
+        }
+#if CONFIG_APP_HEAP_DIAG
+        heap_diag_connect_end(false);
+#endif
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+        // A DISCONNECT from the broker carries its reason
+        if (atomic_load(&s_mqtt_connected) && event->error_handle != NULL && reason_is_busy(event->error_handle->disconnect_return_code)) {
+            s_server_busy = true;
+        }
+#endif
+        set_state(MQTT_HANDLER_EVENT_DISCONNECTED);
+        s_stats.disconnects++;
+        s_events.disconnects++;
+        schedule_reconnect();
+        app_events_post(APP_EVENT_MQTT_DISCONNECTED);
+        break;
+
+    case MQTT_EVENT_SUBSCRIBED:
+        s_events.subscribed++;
+        sub_acked(event);
+        break;
+
+    case MQTT_EVENT_UNSUBSCRIBED:
+        s_events.unsubscribed++;
+        break;
+
+    case MQTT_EVENT_PUBLISHED:
+        s_events.acked++;
+        inflight_release();
+        inflight_resync();
+        spool_ack(event->msg_id);
+        async_drain();
+        spool_drain();
+        if (s_ack_cb != NULL) {
+            s_ack_cb(event->msg_id, s_ack_ctx);
+        }
+        break;
+
+    case MQTT_EVENT_DELETED:
+        // Outbox entry expired, or was evicted to save heap, before the
+        // broker acknowledged it; a spooled record is sent again either way
+        if (mqtt_outbox_pool_delete_reason(event->msg_id) == MQTT_OUTBOX_DELETED_EXPIRED) {
+            s_stats.expired++;
+        }
+        s_events.deleted++;
+        // QoS 0 entries carry msg_id 0: they never took a place in the
+        // window, and spooled ones were consumed when handed over
+        if (event->msg_id != 0) {
+            inflight_release();
+            spool_expired(event->msg_id);
+        }
+        async_drain();
+        spool_drain();
+        break;
+
+    case MQTT_EVENT_ERROR:
+        s_events.errors++;
+        if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
+            ESP_LOGE(TAG, "Transport error: %s", strerror(event->error_handle->esp_transport_sock_errno));
+        } else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+            ESP_LOGE(TAG, "Connection refused: 0x%x", event->error_handle->connect_return_code);
+            // Reported before the DISCONNECTED that schedules the retry
+            if (reason_is_busy(event->error_handle->connect_return_code)) {
+                s_server_busy = true;
+            }
+        } else {
+            ESP_LOGE(TAG, "Client error type %d", event->error_handle->error_type);
+        }
+        break;
+
+    case MQTT_USER_EVENT:
+        // Doorbell from mqtt_handler_publish_async(), _publish_latest() or the spool timer
+        async_drain();
+        latest_drain();
+        spool_drain();
+        break;
+
+    default:
+        ESP_LOGD(TAG, "Other event id:%d", event->event_id);
+        break;
+    }
+}
+
+/**
+ * @brief Resolve the broker hostname ahead of the first connect
+ */
+esp_err_t mqtt_handler_resolve_broker(void)
+{
+    char uri[REMOTE_CONFIG_STR_MAX];
+    esp_err_t ret = remote_config_get_str(REMOTE_CONFIG_BROKER_URI, uri, sizeof(uri));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // The URI is scheme://host[:port][/path]
+    const char *host = strstr(uri, "://");
+    host = host ? host + 3 : uri;
+
+    char hostname[128];
+    size_t len = strcspn(host, ":/");
+    if (len == 0 || len >= sizeof(hostname)) {
+        ESP_LOGE(TAG, "Cannot extract host from %s", uri);
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(hostname, host, len);
+    hostname[len] = '\0';
+
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(hostname, NULL, &hints, &res);
+    if (err != 0 || res == NULL) {
+        ESP_LOGW(TAG, "DNS lookup for %s failed: %d", hostname, err);
+        return ESP_FAIL;
+    }
+
+    // The answer stays in the lwIP DNS cache for the TLS connect
+    ESP_LOGI(TAG, "Broker %s resolved", hostname);
+    freeaddrinfo(res);
+    return ESP_OK;
+}
+
+/**
+ * @brief Load certificates and create the MQTT client without connecting
+ */
+esp_err_t mqtt_handler_prepare(void)
+{
+    if (s_state_group == NULL) {
+        s_state_group = xEventGroupCreateStatic(&s_state_group_buf);
+        xEventGroupSetBits(s_state_group, MQTT_HANDLER_EVENT_STOPPED);
+    }
+    // Batching is optional: without it mqtt_handler_batch_add() refuses samples
+    if (s_batches == NULL) {
+        batch_init();
+    }
+    if (s_mqtt_client != NULL) {
+        return ESP_OK;
+    }
+
+    ESP_LOGI(TAG, "========================================");
+    ESP_LOGI(TAG, "Preparing MQTT Handler with mTLS");
+    ESP_LOGI(TAG, "========================================");
+
+    // A reconnect we start ourselves is where renewed certificates take over
+    certificate_manager_activate_renewed();
+
+    // Check if certificates exist
+    if (!certificate_manager_has_certificates()) {
+        ESP_LOGE(TAG, "Certificates not found. Cannot start MQTT handler.");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Load certificates from NVS
+    ESP_LOGI(TAG, "Loading device certificate from NVS...");
+    esp_err_t ret = certificate_manager_load_device_cert(&s_device_cert, &s_device_cert_len);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to load device certificate: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    ESP_LOGI(TAG, "✓ Device certificate loaded");
+
+    // Parsed once and kept in the esp-tls global CA store across reconnects
+    ESP_LOGI(TAG, "Loading CA certificate from NVS...");
+    ret = certificate_manager_init_ca_store();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to load CA certificate: %s", esp_err_to_name(ret));
+        release_certificates();
+        return ret;
+    }
+    ESP_LOGI(TAG, "✓ CA certificate loaded");
+
+    // Get private key (or the DS peripheral context that replaces it)
+#if CONFIG_APP_DEVICE_KEY_DS
+    ret = certificate_manager_load_ds_data(&s_ds_data);
+#else
+    ret = certificate_manager_load_private_key(&s_device_key, &s_device_key_len);
+#endif
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to get private key: %s", esp_err_to_name(ret));
+        release_certificates();
+        return ret;
+    }
+    ESP_LOGI(TAG, "✓ Private key available");
+
+    if (s_reconnect_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = reconnect_timer_cb,
+            .name = "mqtt_reconnect",
+        };
+        ret = esp_timer_create(&timer_args, &s_reconnect_timer);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create reconnect timer: %s", esp_err_to_name(ret));
+            release_certificates();
+            return ret;
+        }
+    }
+    retry_policy_reset(&s_retry);
+    s_server_busy = false;
+
+#if CONFIG_MQTT_EVENT_SUMMARY_S > 0
+    if (s_summary_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = summary_timer_cb,
+            .name = "mqtt_summary",
+            .skip_unhandled_events = true,
+        };
+        if (esp_timer_create(&timer_args, &s_summary_timer) == ESP_OK) {
+            esp_timer_start_periodic(s_summary_timer, (uint64_t)CONFIG_MQTT_EVENT_SUMMARY_S * 1000000);
+        }
+    }
+#endif
+
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    if (s_publish_mutex == NULL) {
+        s_publish_mutex = xSemaphoreCreateRecursiveMutexStatic(&s_publish_mutex_buf);
+    }
+#endif
+
+    // Messages left in the spool by an earlier session are sent after connecting
+    mqtt_spool_init(spool_on_backlog);
+    // Where the outbox puts messages it evicts when the heap runs low
+    mqtt_outbox_pool_set_spill_cb(spool_spill);
+
+    // A broker changed by a config patch is picked up here, on the next client
+    remote_config_get_str(REMOTE_CONFIG_BROKER_URI, s_broker_uri, sizeof(s_broker_uri));
+    broker_race_load();
+
+    // TLS is handled by our own transport so the session can be resumed on reconnect
+    mqtt_tls_credentials_t creds = {
+        .ca_cert = NULL,                // Global CA store
+        .client_cert = s_device_cert,
+        .client_cert_len = s_device_cert_len,
+        .client_key = s_device_key,
+        .client_key_len = s_device_key_len,
+        .ds_data = s_ds_data,
+    };
+
+#if CONFIG_MQTT_HANDLER_KEEP_CLIENT
+    if (s_kept_client != NULL) {
+        // Buffers, outbox, event loop and handlers are the ones of the last
+        // session; only the credentials and the broker may have changed
+        mqtt_tls_transport_set_credentials(s_kept_transport, &creds);
+        if (esp_mqtt_client_set_uri(s_kept_client, s_broker_uri) != ESP_OK) {
+            ESP_LOGE(TAG, "Invalid broker URI: %s", s_broker_uri);
+            release_certificates();
+            return ESP_ERR_INVALID_ARG;
+        }
+        s_tls_transport = s_kept_transport;
+        s_mqtt_client = s_kept_client;
+        ESP_LOGI(TAG, "MQTT client prepared (kept)");
+        return ESP_OK;
+    }
+#endif
+
+    s_tls_transport = mqtt_tls_transport_init(&creds);
+    if (s_tls_transport == NULL) {
+        ESP_LOGE(TAG, "Failed to create TLS transport");
+        release_certificates();
+        return ESP_ERR_NO_MEM;
+    }
+    mqtt_tls_transport_set_idle_wait(s_tls_transport, MQTT_KEEPALIVE_S, client_idle);
+#if CONFIG_MQTT_TCP_KEEPALIVE_IDLE_S > 0
+    // Half-open connections are closed by TCP rather than found by the next ping
+    const esp_transport_keep_alive_t keep_alive = {
+        .keep_alive_enable = true,
+        .keep_alive_idle = CONFIG_MQTT_TCP_KEEPALIVE_IDLE_S,
+        .keep_alive_interval = CONFIG_MQTT_TCP_KEEPALIVE_INTERVAL_S,
+        .keep_alive_count = CONFIG_MQTT_TCP_KEEPALIVE_COUNT,
+    };
+    mqtt_tls_transport_set_keep_alive(s_tls_transport, &keep_alive);
+#endif
+#if CONFIG_MQTT_LINK_PROBE_MS > 0
+    mqtt_tls_transport_set_link_probe(s_tls_transport, CONFIG_MQTT_LINK_PROBE_MS, CONFIG_MQTT_LINK_STALL_MS);
+#endif
+#if !CONFIG_MQTT_TRANSPORT_PROFILE_MQTTS
+    mqtt_tls_transport_set_profile(s_tls_transport, MQTT_TRANSPORT_PROFILE, CONFIG_MQTT_WSS_PORT, CONFIG_MQTT_WSS_PATH);
+#endif
+
+    // Configure MQTT client with mTLS
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .broker = {
+            .address = {
+                .uri = s_broker_uri,
+            },
+        },
+        .network = {
+            .transport = net_impair_wrap(s_tls_transport),  // s_tls_transport itself unless impaired
+            .disable_auto_reconnect = true,  // Reconnects are scheduled by schedule_reconnect()
+        },
+        .task = {
+            // Core: MQTT_TASK_CORE_SELECTION_ENABLED in the component config
+            .priority = CONFIG_MQTT_HANDLER_TASK_PRIORITY,
+            .stack_size = CONFIG_MQTT_HANDLER_TASK_STACK,
+        },
+        .buffer = {
+            .size = MQTT_RX_BUFFER_SIZE,
+            .out_size = MQTT_TX_BUFFER_SIZE,
+        },
+        .session = {
+            .keepalive = MQTT_KEEPALIVE_S,
+#if MQTT_SESSION_EXPIRY_S > 0
+            // The broker keeps subscriptions and queued QoS 1/2 messages
+            // while the device is away
+            .disable_clean_session = true,
+#endif
+#if CONFIG_MQTT_CUSTOM_OUTBOX
+            // How often the client looks for retransmissions; the outbox
+            // decides which message is due by its measured timeout
+            .message_retransmit_timeout = CONFIG_MQTT_RTO_MIN_MS,
+#endif
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+            .protocol_ver = MQTT_PROTOCOL_V_5,
+#endif
+        },
+    };
+
+    // Initialize MQTT client
+    s_mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+    if (s_mqtt_client == NULL) {
+        ESP_LOGE(TAG, "Failed to initialize MQTT client");
+        // esp_mqtt_client_init() already destroyed the transport on its failure path
+        s_tls_transport = NULL;
+        release_certificates();
+        return ESP_ERR_NO_MEM;
+    }
+
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5 && MQTT_SESSION_EXPIRY_S > 0
+    // MQTT 5 ends the session on disconnect unless it is given an expiry
+    esp_mqtt5_connection_property_config_t connect_property = {
+        .session_expiry_interval = MQTT_SESSION_EXPIRY_S,
+    };
+    if (esp_mqtt5_client_set_connect_property(s_mqtt_client, &connect_property) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to set the session expiry");
+    }
+#endif
+
+    // Register event handlers: one per id, so each event runs exactly one handler
+    static const esp_mqtt_event_id_t events[] = {
+        MQTT_EVENT_BEFORE_CONNECT, MQTT_EVENT_CONNECTED, MQTT_EVENT_DISCONNECTED,
+        MQTT_EVENT_SUBSCRIBED, MQTT_EVENT_UNSUBSCRIBED, MQTT_EVENT_PUBLISHED,
+        MQTT_EVENT_DELETED, MQTT_EVENT_ERROR, MQTT_USER_EVENT,
+    };
+    for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+        esp_mqtt_client_register_event(s_mqtt_client, events[i], mqtt_event_handler, NULL);
+    }
+    esp_mqtt_client_register_event(s_mqtt_client, MQTT_EVENT_DATA, mqtt_data_handler, NULL);
+
+#if CONFIG_MQTT_HANDLER_KEEP_CLIENT
+    s_kept_client = s_mqtt_client;
+    s_kept_transport = s_tls_transport;
+#endif
+    ESP_LOGI(TAG, "MQTT client prepared");
+    return ESP_OK;
+}
+
+/**
+ * @brief Start MQTT handler with mTLS
+ */
+esp_err_t mqtt_handler_start(void)
+{
+    if (s_mqtt_started) {
+        ESP_LOGW(TAG, "MQTT handler already started");
+        return ESP_OK;
+    }
+
+    esp_err_t ret = mqtt_handler_prepare();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Connecting to MQTT broker: %s", s_broker_uri);
+
+    // Before the client task runs, so its CONNECTED cannot be overwritten
+    set_state(MQTT_HANDLER_EVENT_DISCONNECTED);
+
+    // Start MQTT client
+    ret = esp_mqtt_client_start(s_mqtt_client);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start MQTT client: %s", esp_err_to_name(ret));
+        mqtt_handler_stop();
+        return ret;
+    }
+
+    s_mqtt_started = true;
+    ESP_LOGI(TAG, "MQTT handler started, waiting for connection...");
+    return ESP_OK;
+}
+
+/**
+ * @brief Stop MQTT handler
+ */
+void mqtt_handler_stop(void)
+{
+    if (s_mqtt_client == NULL) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Stopping MQTT handler");
+    if (s_mqtt_started) {
+        // The client task may be asleep until its next keepalive
+        mqtt_tls_transport_wake(s_tls_transport);
+        esp_mqtt_client_stop(s_mqtt_client);
+    }
+#if !CONFIG_MQTT_HANDLER_KEEP_CLIENT
+    esp_mqtt_client_destroy(s_mqtt_client);
+#endif
+    // A kept client is idle now: its task emptied the outbox on the way out
+    s_mqtt_client = NULL;
+    // After the client is gone: stopping it may have scheduled a reconnect
+    esp_timer_stop(s_reconnect_timer);
+    s_tls_transport = NULL;
+    release_certificates();
+    s_mqtt_started = false;
+    set_state(MQTT_HANDLER_EVENT_STOPPED);
+    // Undelivered spooled records went down with the outbox
+    spool_restart();
+    atomic_store(&s_inflight, 0);
+    // Topics with samples still pending keep their slot for the next session
+    if (s_batches != NULL) {
+        xSemaphoreTake(s_batch_mutex, portMAX_DELAY);
+        batch_release_idle_locked(esp_timer_get_time(), 0);
+        xSemaphoreGive(s_batch_mutex);
+    }
+}
+
+/**
+ * @brief Check if MQTT handler is connected
+ */
+bool mqtt_handler_is_connected(void)
+{
+    return atomic_load(&s_mqtt_connected);
+}
+
+bool mqtt_handler_wait_connected(TickType_t timeout)
+{
+    return mqtt_handler_wait_event(MQTT_HANDLER_EVENT_CONNECTED, timeout) != 0;
+}
+
+EventBits_t mqtt_handler_wait_event(EventBits_t mask, TickType_t timeout)
+{
+    if (s_state_group == NULL) {
+        vTaskDelay(timeout);
+        return 0;
+    }
+    return xEventGroupWaitBits(s_state_group, mask, pdFALSE, pdFALSE, timeout) & mask;
+}
+
+/**
+ * @brief Count a publish and wake the transport for outbox messages
+ */
+static esp_err_t publish_account(int msg_id, int qos, size_t topic_len, int data_len)
+{
+    if (msg_id < 0) {
+        s_stats.publish_failed++;
+        ESP_LOGE(TAG, "Failed to publish message");
+        return ESP_FAIL;
+    }
+    s_stats.published++;
+    inflight_add(qos);
+
+    uint32_t fragments = (topic_len + data_len + MQTT_PUBLISH_OVERHEAD + MQTT_TX_BUFFER_SIZE - 1) /
+                         MQTT_TX_BUFFER_SIZE;
+    if (fragments > s_stats.tx_fragments_max) {
+        s_stats.tx_fragments_max = fragments;
+    }
+    if (qos > 0) {
+        // Now in the outbox: the client must stop sleeping until the next ping
+        mqtt_tls_transport_wake(s_tls_transport);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Publish message to MQTT topic
+ */
+esp_err_t mqtt_handler_publish(const char *topic, const char *data, int data_len, int qos)
+{
+    return mqtt_handler_publish_tracked(topic, data, data_len, qos, NULL);
+}
+
+/**
+ * @brief Publish and report the message id
+ */
+esp_err_t mqtt_handler_publish_tracked(const char *topic, const char *data, int data_len, int qos,
+                                       int *msg_id_out)
+{
+    if (s_mqtt_client == NULL || !atomic_load(&s_mqtt_connected)) {
+        ESP_LOGE(TAG, "MQTT handler not connected");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (data != NULL && data_len <= 0) {
+        data_len = strlen(data);
+    }
+
+    int msg_id = publish_direct(topic, data, data_len, qos);
+    if (publish_account(msg_id, qos, strlen(topic), data_len) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (msg_id_out != NULL) {
+        *msg_id_out = msg_id;
+    }
+
+    ESP_LOGD(TAG, "Published message to %s, msg_id=%d", topic, msg_id);
+    return ESP_OK;
+}
+
+/**
+ * @brief Publish with the correlation data of the request it answers
+ */
+esp_err_t mqtt_handler_publish_response(const char *topic, const char *data, int data_len, int qos,
+                                        const char *correlation, int correlation_len)
+{
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    if (topic == NULL || correlation_len < 0 || correlation_len > UINT16_MAX ||
+        (correlation == NULL && correlation_len > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_mqtt_client == NULL || !atomic_load(&s_mqtt_connected)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (data != NULL && data_len <= 0) {
+        data_len = strlen(data);
+    }
+
+    const esp_mqtt5_publish_property_config_t property = {
+        .correlation_data = correlation,
+        .correlation_data_len = (uint16_t)correlation_len,
+    };
+    int msg_id = -1;
+    if (publish_lock()) {
+        if (esp_mqtt5_client_set_publish_property(s_mqtt_client, &property) == ESP_OK) {
+            int64_t api_us = mqtt_loop_prof_api_start();
+            msg_id = esp_mqtt_client_publish(s_mqtt_client, topic, data, data_len, qos, 0);
+            mqtt_loop_prof_api(api_us);
+            // The property lives on this stack: never leave it to the next publish
+            esp_mqtt5_client_set_publish_property(s_mqtt_client, &s_no_property);
+        }
+        publish_unlock();
+    }
+    return publish_account(msg_id, qos, strlen(topic), data_len);
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * @brief Queue a message in the outbox lane of its priority
+ */
+esp_err_t mqtt_handler_publish_prio(const char *topic, const char *data, int data_len, int qos,
+                                    mqtt_handler_prio_t prio)
+{
+    if (topic == NULL || (data == NULL && data_len > 0) || qos < 0 || qos > 2 ||
+        prio > MQTT_HANDLER_PRIO_BULK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_mqtt_client == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (data != NULL && data_len <= 0) {
+        data_len = strlen(data);
+    }
+
+    if (store_message(topic, data, data_len, qos, prio) < 0) {
+        s_stats.publish_failed++;
+        ESP_LOGE(TAG, "Failed to queue message for %s", topic);
+        return ESP_FAIL;
+    }
+    s_stats.published++;
+    return ESP_OK;
+}
+
+/**
+ * @brief Build a prepared topic handle
+ */
+esp_err_t mqtt_handler_topic_prepare(mqtt_handler_topic_t *t, const char *topic, int qos)
+{
+    size_t len = strlen(topic);
+    if (len == 0 || len >= sizeof(t->topic) || qos < 0 || qos > 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(t->topic, topic, len + 1);
+    t->len = (uint16_t)len;
+    t->qos = (uint8_t)qos;
+    t->alias = MQTT_TOPIC_ALIAS_UNRESOLVED;
+    return ESP_OK;
+}
+
+/**
+ * @brief Publish on a prepared topic
+ */
+esp_err_t mqtt_handler_publish_prepared(mqtt_handler_topic_t *t, const char *data, int data_len,
+                                        int *msg_id_out)
+{
+    if (s_mqtt_client == NULL || !atomic_load(&s_mqtt_connected)) {
+        ESP_LOGE(TAG, "MQTT handler not connected");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (data != NULL && data_len <= 0) {
+        data_len = strlen(data);
+    }
+
+    int msg_id = publish_prepared(t, data, data_len);
+    if (publish_account(msg_id, t->qos, t->len, data_len) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (msg_id_out != NULL) {
+        *msg_id_out = msg_id;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Publish a CBOR payload on topic + CBOR_TOPIC_SUFFIX
+ */
+esp_err_t mqtt_handler_publish_cbor(const char *topic, const uint8_t *data, size_t len, int qos)
+{
+    char full_topic[MQTT_BATCH_TOPIC_LEN + sizeof(CBOR_TOPIC_SUFFIX)];
+    int n = snprintf(full_topic, sizeof(full_topic), "%s" CBOR_TOPIC_SUFFIX, topic);
+    if (n < 0 || n >= (int)sizeof(full_topic) || len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return mqtt_handler_publish(full_topic, (const char *)data, (int)len, qos);
+}
 
 /**
- * @brief MQTT event handler
+ * @brief Add or replace a subscription in the registry
  */
-static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
-                               int32_t event_id, void *event_data)
+static esp_err_t sub_register(const char *topic, int qos, mqtt_handler_msg_cb_t cb, void *ctx)
 {
-    esp_mqtt_event_handle_t event = event_data;
+    if (topic == NULL || cb == NULL || topic[0] == '\0' || strlen(topic) >= MQTT_SUB_FILTER_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_sub_mutex == NULL) {
+        s_sub_mutex = xSemaphoreCreateMutex();
+        if (s_sub_mutex == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
 
-    switch ((esp_mqtt_event_id_t)event_id) {
-    case MQTT_EVENT_CONNECTED:
-        ESP_LOGI(TAG, "========================================");
-        ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        ESP_LOGI(TAG, "✓ mTLS handshake successful!");
-        ESP_LOGI(TAG, "✓ Connected to MQTT broker");
-        ESP_LOGI(TAG, "========================================");
-        s_mqtt_connected = true;
-        break;
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(s_sub_mutex, portMAX_DELAY);
 
-    case MQTT_EVENT_DISCONNECTED:
-        ESP_LOGW(TAG, "MQTT_EVENT_DISCONNECTED");
-        s_mqtt_connected = false;
-        break;
+    int slot = -1;
+    for (int i = 0; i < MQTT_SUB_MAX; i++) {
+        if (s_subs[i].cb != NULL && strcmp(s_subs[i].filter, topic) == 0) {
+            slot = i;
+            break;
+        }
+        if (s_subs[i].cb == NULL && slot < 0) {
+            slot = i;
+        }
+    }
+    int node = trie_insert(topic);
+    if (slot < 0 || node < 0) {
+        ESP_LOGE(TAG, "No room to register %s", topic);
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
 
-    case MQTT_EVENT_SUBSCRIBED:
-        ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-        break;
+    strcpy(s_subs[slot].filter, topic);
+    s_subs[slot].qos = qos;
+    s_subs[slot].pending_id = 0;
+    s_subs[slot].in_session = false;
+    s_subs[slot].ctx = ctx;
+    s_subs[slot].cb = cb;
+    s_trie[node].subs |= 1u << slot;
 
-    case MQTT_EVENT_UNSUBSCRIBED:
-        ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
-        break;
+cleanup:
+    xSemaphoreGive(s_sub_mutex);
+    return err;
+}
 
-    case MQTT_EVENT_PUBLISHED:
-        ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-        break;
+/**
+ * @brief Register a filter, and subscribe it right away when connected
+ *
+ * Otherwise sub_renew() subscribes it with the others on the next
+ * MQTT_EVENT_CONNECTED.
+ */
+esp_err_t mqtt_handler_subscribe(const char *topic, int qos, mqtt_handler_msg_cb_t cb, void *ctx)
+{
+    if (qos < 0 || qos > 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = sub_register(topic, qos, cb, ctx);
+    if (err != ESP_OK || s_mqtt_client == NULL || !atomic_load(&s_mqtt_connected)) {
+        // Subscribed on the next MQTT_EVENT_CONNECTED
+        return err;
+    }
 
-    case MQTT_EVENT_DATA:
-        ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        ESP_LOGI(TAG, "TOPIC=%.*s", event->topic_len, event->topic);
-        ESP_LOGI(TAG, "DATA=%.*s", event->data_len, event->data);
-        break;
+    int msg_id = esp_mqtt_client_subscribe(s_mqtt_client, topic, qos);
+    if (msg_id < 0) {
+        ESP_LOGE(TAG, "Failed to subscribe to topic");
+        return ESP_FAIL;
+    }
+    mqtt_tls_transport_wake(s_tls_transport);
 
-    case MQTT_EVENT_ERROR:
-        ESP_LOGE(TAG, "MQTT_EVENT_ERROR");
-        if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
-            ESP_LOGE(TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
-        } else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
-            ESP_LOGE(TAG, "Connection refused error: 0x%x", event->error_handle->connect_return_code);
+    // Not under the registry mutex while subscribing: the MQTT task takes it
+    // with the client lock held. A SUBACK that beats this leaves the filter
+    // outside the session, and the next reconnect subscribes it again.
+    xSemaphoreTake(s_sub_mutex, portMAX_DELAY);
+    for (int i = 0; i < MQTT_SUB_MAX; i++) {
+        if (s_subs[i].cb != NULL && strcmp(s_subs[i].filter, topic) == 0) {
+            s_subs[i].pending_id = msg_id;
         }
-        break;
+    }
+    xSemaphoreGive(s_sub_mutex);
 
-    default:
-        ESP_LOGD(TAG, "Other event id:%d", event->event_id);
-        break;
+    ESP_LOGI(TAG, "Subscribed to %s, msg_id=%d", topic, msg_id);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_handler_unsubscribe(const char *topic)
+{
+    if (topic == NULL || s_sub_mutex == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    int slot = -1;
+    xSemaphoreTake(s_sub_mutex, portMAX_DELAY);
+    for (int i = 0; i < MQTT_SUB_MAX; i++) {
+        if (s_subs[i].cb != NULL && strcmp(s_subs[i].filter, topic) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= 0) {
+        for (int n = 0; n < s_trie_used; n++) {
+            s_trie[n].subs &= ~(1u << slot);
+        }
+        s_rx_subs &= ~(1u << slot);
+    }
+    bool subscribed = slot >= 0 && s_subs[slot].qos >= 0;
+    if (slot >= 0) {
+        memset(&s_subs[slot], 0, sizeof(s_subs[slot]));
+    }
+    xSemaphoreGive(s_sub_mutex);
+
+    if (slot < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (subscribed && s_mqtt_client != NULL && atomic_load(&s_mqtt_connected)) {
+        esp_mqtt_client_unsubscribe(s_mqtt_client, topic);
+        mqtt_tls_transport_wake(s_tls_transport);
+    }
+    return ESP_OK;
+}
+
+esp_err_t mqtt_handler_register_sink(const char *topic, mqtt_handler_msg_cb_t cb, void *ctx)
+{
+    if (cb == NULL) {
+        esp_err_t err = mqtt_handler_unsubscribe(topic);
+        return err == ESP_ERR_NOT_FOUND ? ESP_OK : err;
     }
+    return sub_register(topic, -1, cb, ctx);
 }
 
 /**
- * @brief Start MQTT handler with mTLS
+ * @brief Hand a batch to the MQTT client and reset it (batch mutex held)
+ *
+ * Uses esp_mqtt_client_enqueue() so the caller never waits for TLS; the
+ * MQTT task sends the payload, and QoS>0 batches survive a reconnect.
+ * While offline the batch goes to the flash spool instead.
  */
-esp_err_t mqtt_handler_start(void)
+static esp_err_t batch_flush_locked(mqtt_batch_t *b)
 {
-    if (s_mqtt_client != NULL) {
-        ESP_LOGW(TAG, "MQTT handler already started");
+    if (b->len == 0) {
         return ESP_OK;
     }
 
-    ESP_LOGI(TAG, "========================================");
-    ESP_LOGI(TAG, "Starting MQTT Handler with mTLS");
-    ESP_LOGI(TAG, "========================================");
+    const char *topic = b->topic;
+    const char *data = b->buf;
+    size_t len = b->len;
+#if CONFIG_MQTT_BATCH_COMPRESS
+    // Sent as is unless compression saves at least one byte
+    char hs_topic[MQTT_BATCH_TOPIC_LEN + sizeof(COMPRESS_TOPIC_SUFFIX)];
+    size_t hs_len;
+    if (s_link.compress &&
+        payload_compress((const uint8_t *)b->buf, b->len, s_compress_buf, b->len - 1, &hs_len) == ESP_OK) {
+        snprintf(hs_topic, sizeof(hs_topic), "%s" COMPRESS_TOPIC_SUFFIX, b->topic);
+        topic = hs_topic;
+        data = (const char *)s_compress_buf;
+        len = hs_len;
+    }
+#endif
 
-    // Check if certificates exist
-    if (!certificate_manager_has_certificates()) {
-        ESP_LOGE(TAG, "Certificates not found. Cannot start MQTT handler.");
-        return ESP_ERR_NOT_FOUND;
+    int msg_id = store_message(topic, data, len, b->qos, MQTT_HANDLER_PRIO_BULK);
+    if (msg_id < 0 && s_mqtt_client == NULL) {
+        // Nowhere to put it yet: keep the batch
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (msg_id < 0) {
+        s_stats.publish_failed++;
+        s_batch_stats.samples_dropped += b->samples;
+        ESP_LOGW(TAG, "Dropped batch of %lu samples for %s", (unsigned long)b->samples, b->topic);
+    } else {
+        uint32_t latency_ms = (uint32_t)((esp_timer_get_time() - b->first_sample_us) / 1000);
+        s_stats.published++;
+        s_batch_stats.flushes++;
+        s_batch_stats.samples_published += b->samples;
+        s_batch_stats.bytes_in += b->len;
+        s_batch_stats.bytes_out += len;
+        s_batch_stats.last_flush_latency_ms = latency_ms;
+        if (latency_ms > s_batch_stats.max_flush_latency_ms) {
+            s_batch_stats.max_flush_latency_ms = latency_ms;
+        }
+        ESP_LOGD(TAG, "Flushed %lu samples (%d bytes) to %s after %lu ms",
+                 (unsigned long)b->samples, len, topic, (unsigned long)latency_ms);
     }
 
-    // Load certificates from NVS
-    ESP_LOGI(TAG, "Loading device certificate from NVS...");
-    esp_err_t ret = certificate_manager_load_device_cert(s_device_cert, sizeof(s_device_cert));
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to load device certificate: %s", esp_err_to_name(ret));
-        return ret;
+    b->len = 0;
+    b->samples = 0;
+    return msg_id < 0 ? ESP_FAIL : ESP_OK;
+}
+
+/**
+ * @brief Give back the slots of topics with nothing pending for idle_us (batch mutex held)
+ */
+static void batch_release_idle_locked(int64_t now, int64_t idle_us)
+{
+    for (int i = 0; i < MQTT_BATCH_TOPICS; i++) {
+        mqtt_batch_t *b = &s_batches[i];
+        if (b->topic[0] != '\0' && b->len == 0 && now - b->last_sample_us >= idle_us) {
+            b->topic[0] = '\0';
+        }
     }
-    ESP_LOGI(TAG, "✓ Device certificate loaded");
+}
 
-    ESP_LOGI(TAG, "Loading CA certificate from NVS...");
-    ret = certificate_manager_load_ca_cert(s_ca_cert, sizeof(s_ca_cert));
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to load CA certificate: %s", esp_err_to_name(ret));
-        return ret;
+/**
+ * @brief Periodic check for batches that reached the time threshold
+ *
+ * Runs on the esp_timer task, which every other timer shares: a tick
+ * that finds the mutex taken is skipped rather than waited out. The timer
+ * only runs while a batch holds samples, so it does not wake the chip
+ * out of light sleep when there is nothing to flush; batch_add() starts it
+ * again with the first sample.
+ */
+static void batch_timer_cb(void *arg)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (xSemaphoreTake(s_batch_mutex, 0) != pdTRUE) {
+        return;
     }
-    ESP_LOGI(TAG, "✓ CA certificate loaded");
+    if (link_adapt_update(&s_link)) {
+        s_batch_stats.link_changes++;
+    }
+    bool pending = false;
+    for (int i = 0; i < MQTT_BATCH_TOPICS; i++) {
+        mqtt_batch_t *b = &s_batches[i];
+        if (b->len > 0 && now - b->first_sample_us >= (int64_t)s_link.flush_ms * 1000) {
+            batch_flush_locked(b);
+        }
+        pending |= b->len > 0;
+    }
+    batch_release_idle_locked(now, (int64_t)MQTT_BATCH_IDLE_MS * 1000);
+    if (!pending) {
+        esp_timer_stop(s_batch_timer);
+    }
+    xSemaphoreGive(s_batch_mutex);
+}
 
-    // Get private key
-    const char *private_key = certificate_manager_get_private_key();
-    if (private_key == NULL) {
-        ESP_LOGE(TAG, "Failed to get private key");
-        return ESP_ERR_NOT_FOUND;
+/**
+ * @brief Create the batches, their mutex and the flush timer, once
+ *
+ * s_batches is set last, so a producer that sees it finds the rest ready.
+ * The timer is left stopped until the first sample arrives.
+ */
+static esp_err_t batch_init(void)
+{
+    mqtt_batch_t *batches = heap_caps_calloc(MQTT_BATCH_TOPICS, sizeof(mqtt_batch_t), MQTT_HANDLER_MEMORY);
+    s_batch_mutex = xSemaphoreCreateMutex();
+    if (s_batch_mutex == NULL || batches == NULL) {
+        goto fail;
     }
-    ESP_LOGI(TAG, "✓ Private key available");
+    link_adapt_init(&s_link);
 
-    // Configure MQTT client with mTLS
-    esp_mqtt_client_config_t mqtt_cfg = {
-        .broker = {
-            .address = {
-                .uri = MQTT_BROKER_URI,
-            },
-            .verification = {
-                .certificate = s_ca_cert,  // CA cert to verify broker
-            },
-        },
-        .credentials = {
-            .authentication = {
-                .certificate = s_device_cert,  // Client certificate
-                .key = private_key,            // Client private key
-            },
-        },
+    const esp_timer_create_args_t timer_args = {
+        .callback = batch_timer_cb,
+        .name = "mqtt_batch",
+        .skip_unhandled_events = true,
     };
+    if (esp_timer_create(&timer_args, &s_batch_timer) != ESP_OK) {
+        goto fail;
+    }
+    s_batches = batches;
+    return ESP_OK;
+
+fail:
+    ESP_LOGE(TAG, "Failed to initialize telemetry batching");
+    if (s_batch_timer != NULL) {
+        esp_timer_delete(s_batch_timer);
+        s_batch_timer = NULL;
+    }
+    free(batches);
+    if (s_batch_mutex != NULL) {
+        vSemaphoreDelete(s_batch_mutex);
+        s_batch_mutex = NULL;
+    }
+    return ESP_ERR_NO_MEM;
+}
 
-    ESP_LOGI(TAG, "Connecting to MQTT broker: %s", MQTT_BROKER_URI);
+#if CONFIG_MQTT_BATCH_TIMESTAMPS
+/**
+ * @brief Write the base time line of a new batch
+ */
+static size_t batch_put_header(char *out, int64_t now_us)
+{
+    int n;
+    if (time_sync_valid()) {
+        n = snprintf(out, MQTT_BATCH_HEADER_MAX, "{\"t0\":%lld}", (long long)time_sync_utc_ms(now_us));
+    } else {
+        n = snprintf(out, MQTT_BATCH_HEADER_MAX, "{\"up0\":%lld}", (long long)(now_us / 1000));
+    }
+    return n > 0 && n < MQTT_BATCH_HEADER_MAX ? (size_t)n : 0;
+}
 
-    // Initialize MQTT client
-    s_mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
-    if (s_mqtt_client == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize MQTT client");
-        return ESP_ERR_NO_MEM;
+/**
+ * @brief Copy a sample, adding its offset from the batch base to a JSON object
+ */
+static size_t batch_put_sample(char *out, const char *sample, int len, uint32_t dt_ms)
+{
+    if (dt_ms == 0 || len < 2 || sample[0] != '{') {
+        memcpy(out, sample, len);
+        return len;
     }
+    int n = snprintf(out, MQTT_BATCH_DT_MAX, "{\"dt\":%lu%s", (unsigned long)dt_ms, sample[1] == '}' ? "" : ",");
+    memcpy(out + n, sample + 1, len - 1);
+    return n + len - 1;
+}
+#endif
 
-    // Register event handler
-    esp_mqtt_client_register_event(s_mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+/**
+ * @brief Add a telemetry sample to the batch for its topic
+ */
+int mqtt_handler_batch_sample_max(void)
+{
+    return MQTT_BATCH_SIZE - 1 - MQTT_BATCH_DT_MAX - MQTT_BATCH_HEADER_MAX;
+}
 
-    // Start MQTT client
-    ret = esp_mqtt_client_start(s_mqtt_client);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to start MQTT client: %s", esp_err_to_name(ret));
-        esp_mqtt_client_destroy(s_mqtt_client);
-        s_mqtt_client = NULL;
-        return ret;
+esp_err_t mqtt_handler_batch_add(const char *topic, const char *sample, int sample_len, int qos)
+{
+    if (topic == NULL || sample == NULL || strlen(topic) >= MQTT_BATCH_TOPIC_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (sample_len <= 0) {
+        sample_len = strlen(sample);
+    }
+    // Room for the sample plus its separator, timestamp and the batch header
+    if (sample_len + 1 + MQTT_BATCH_DT_MAX + MQTT_BATCH_HEADER_MAX > MQTT_BATCH_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (s_batches == NULL) {
+        return ESP_ERR_INVALID_STATE;
     }
 
-    ESP_LOGI(TAG, "MQTT handler started, waiting for connection...");
-    return ESP_OK;
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(s_batch_mutex, portMAX_DELAY);
+
+    mqtt_batch_t *b = NULL;
+    mqtt_batch_t *unused = NULL;
+    for (int i = 0; i < MQTT_BATCH_TOPICS; i++) {
+        if (s_batches[i].topic[0] == '\0') {
+            if (unused == NULL) {
+                unused = &s_batches[i];
+            }
+        } else if (strcmp(s_batches[i].topic, topic) == 0) {
+            b = &s_batches[i];
+            break;
+        }
+    }
+    int64_t now = esp_timer_get_time();
+    if (b == NULL) {
+        if (unused == NULL) {
+            // The timer may have been stopped before an idle slot came due
+            batch_release_idle_locked(now, (int64_t)MQTT_BATCH_IDLE_MS * 1000);
+            for (int i = 0; i < MQTT_BATCH_TOPICS && unused == NULL; i++) {
+                if (s_batches[i].topic[0] == '\0') {
+                    unused = &s_batches[i];
+                }
+            }
+        }
+        if (unused == NULL) {
+            s_batch_stats.samples_dropped++;
+            err = ESP_ERR_NO_MEM;
+            goto cleanup;
+        }
+        b = unused;
+        strcpy(b->topic, topic);
+        b->qos = qos;
+    }
+
+    // Size threshold: flush first if the sample would not fit
+    if (b->len + sample_len + 1 + MQTT_BATCH_DT_MAX > MQTT_BATCH_SIZE) {
+        batch_flush_locked(b);
+        if (b->len > 0) {
+            // Could not hand the batch over (client not created yet)
+            s_batch_stats.samples_dropped++;
+            err = ESP_ERR_INVALID_STATE;
+            goto cleanup;
+        }
+    }
+
+    b->last_sample_us = now;
+    if (b->len == 0) {
+        b->first_sample_us = now;
+        if (!esp_timer_is_active(s_batch_timer)) {
+            // Idle since the last flush: refresh the link profile before sizing this batch
+            if (link_adapt_update(&s_link)) {
+                s_batch_stats.link_changes++;
+            }
+            esp_timer_start_periodic(s_batch_timer, MQTT_BATCH_TICK_US);
+        }
+#if CONFIG_MQTT_BATCH_TIMESTAMPS
+        b->len = batch_put_header(b->buf, now);
+#endif
+    }
+    if (b->len > 0) {
+        b->buf[b->len++] = '\n';
+    }
+#if CONFIG_MQTT_BATCH_TIMESTAMPS
+    b->len += batch_put_sample(b->buf + b->len, sample, sample_len, (uint32_t)((now - b->first_sample_us) / 1000));
+#else
+    memcpy(b->buf + b->len, sample, sample_len);
+    b->len += sample_len;
+#endif
+    b->samples++;
+    if (b->len >= s_link.flush_bytes) {
+        batch_flush_locked(b);
+    }
+
+cleanup:
+    xSemaphoreGive(s_batch_mutex);
+    return err;
 }
 
 /**
- * @brief Stop MQTT handler
+ * @brief Flush every pending batch now
  */
-void mqtt_handler_stop(void)
+esp_err_t mqtt_handler_batch_flush(void)
 {
-    if (s_mqtt_client == NULL) {
-        return;
+    if (s_batches == NULL) {
+        return ESP_OK;
     }
 
-    ESP_LOGI(TAG, "Stopping MQTT handler");
-    esp_mqtt_client_stop(s_mqtt_client);
-    esp_mqtt_client_destroy(s_mqtt_client);
-    s_mqtt_client = NULL;
-    s_mqtt_connected = false;
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(s_batch_mutex, portMAX_DELAY);
+    for (int i = 0; i < MQTT_BATCH_TOPICS; i++) {
+        if (batch_flush_locked(&s_batches[i]) != ESP_OK) {
+            err = ESP_FAIL;
+        }
+    }
+    xSemaphoreGive(s_batch_mutex);
+    return err;
 }
 
 /**
- * @brief Check if MQTT handler is connected
+ * @brief Get batching counters
  */
-bool mqtt_handler_is_connected(void)
+void mqtt_handler_batch_get_stats(mqtt_batch_stats_t *stats)
 {
-    return s_mqtt_connected;
+    if (s_batch_mutex != NULL) {
+        xSemaphoreTake(s_batch_mutex, portMAX_DELAY);
+        *stats = s_batch_stats;
+        stats->link_quality = s_link.quality;
+        stats->flush_ms = s_link.flush_ms;
+        stats->flush_bytes = s_link.flush_bytes;
+        xSemaphoreGive(s_batch_mutex);
+    } else {
+        link_adapt_profile_t profile;
+        link_adapt_init(&profile);
+        *stats = s_batch_stats;
+        stats->link_quality = profile.quality;
+        stats->flush_ms = profile.flush_ms;
+        stats->flush_bytes = profile.flush_bytes;
+    }
 }
 
 /**
- * @brief Publish message to MQTT topic
+ * @brief Queue a message for publishing without touching the network
  */
-esp_err_t mqtt_handler_publish(const char *topic, const char *data, int data_len, int qos)
+esp_err_t mqtt_handler_publish_async(const char *topic, const char *data, int data_len, int qos)
 {
-    if (s_mqtt_client == NULL || !s_mqtt_connected) {
-        ESP_LOGE(TAG, "MQTT handler not connected");
+    if (topic == NULL || strlen(topic) >= MQTT_BATCH_TOPIC_LEN || (data == NULL && data_len > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (data != NULL && data_len <= 0) {
+        data_len = strlen(data);
+    }
+    if (data_len > MQTT_ASYNC_MAX_PAYLOAD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (s_mqtt_client == NULL) {
         return ESP_ERR_INVALID_STATE;
     }
 
-    int msg_id = esp_mqtt_client_publish(s_mqtt_client, topic, data, data_len, qos, 0);
-    if (msg_id < 0) {
-        ESP_LOGE(TAG, "Failed to publish message");
-        return ESP_FAIL;
+    char *slot = mqtt_handler_async_reserve(NULL);
+    if (slot == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (data_len > 0) {
+        memcpy(slot, data, data_len);
     }
+    return mqtt_handler_async_commit(topic, data_len, qos);
+}
 
-    ESP_LOGI(TAG, "Published message to %s, msg_id=%d", topic, msg_id);
-    return ESP_OK;
+/**
+ * @brief Reserve the next async ring slot for an in-place payload
+ */
+char *mqtt_handler_async_reserve(size_t *capacity)
+{
+    if (s_mqtt_client == NULL) {
+        return NULL;
+    }
+    if (s_async_ring == NULL) {
+        // First call comes from the producer before any other ring access
+        s_async_ring = heap_caps_calloc(MQTT_ASYNC_QUEUE_LEN, sizeof(mqtt_async_entry_t),
+                                        MQTT_HANDLER_MEMORY);
+        if (s_async_ring == NULL) {
+            return NULL;
+        }
+    }
+
+    unsigned int head = atomic_load_explicit(&s_async_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&s_async_tail, memory_order_acquire);
+    if (head - tail >= MQTT_ASYNC_QUEUE_LEN) {
+        atomic_fetch_add(&s_async_dropped, 1);
+        return NULL;
+    }
+
+    // The slot is invisible to the MQTT task until head moves past it
+    s_async_reserved = true;
+    if (capacity) {
+        *capacity = MQTT_ASYNC_MAX_PAYLOAD;
+    }
+    return s_async_ring[head % MQTT_ASYNC_QUEUE_LEN].data;
 }
 
 /**
- * @brief Subscribe to MQTT topic
+ * @brief Publish the reserved ring slot
  */
-esp_err_t mqtt_handler_subscribe(const char *topic, int qos)
+esp_err_t mqtt_handler_async_commit(const char *topic, size_t len, int qos)
 {
-    if (s_mqtt_client == NULL || !s_mqtt_connected) {
-        ESP_LOGE(TAG, "MQTT handler not connected");
+    if (!s_async_reserved) {
         return ESP_ERR_INVALID_STATE;
     }
-
-    int msg_id = esp_mqtt_client_subscribe(s_mqtt_client, topic, qos);
-    if (msg_id < 0) {
-        ESP_LOGE(TAG, "Failed to subscribe to topic");
-        return ESP_FAIL;
+    if (topic == NULL || strlen(topic) >= MQTT_BATCH_TOPIC_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (len > MQTT_ASYNC_MAX_PAYLOAD) {
+        return ESP_ERR_INVALID_SIZE;
     }
 
-    ESP_LOGI(TAG, "Subscribed to %s, msg_id=%d", topic, msg_id);
+    unsigned int head = atomic_load_explicit(&s_async_head, memory_order_relaxed);
+    mqtt_async_entry_t *e = &s_async_ring[head % MQTT_ASYNC_QUEUE_LEN];
+    strcpy(e->topic, topic);
+    e->len = len;
+    e->qos = qos;
+    e->commit_us = (uint32_t)esp_timer_get_time();
+    s_async_reserved = false;
+    atomic_store_explicit(&s_async_head, head + 1, memory_order_release);
+
+    ring_doorbell();
     return ESP_OK;
 }
+
+#if CONFIG_MQTT_CONFLATE_TOPICS > 0
+/**
+ * @brief Replace the pending sample of a latest-value topic
+ */
+esp_err_t mqtt_handler_publish_latest(const char *topic, const char *data, int data_len)
+{
+    if (topic == NULL || strlen(topic) >= MQTT_BATCH_TOPIC_LEN || (data == NULL && data_len > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (data != NULL && data_len <= 0) {
+        data_len = strlen(data);
+    }
+    if (data_len > MQTT_CONFLATE_MAX_PAYLOAD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t err = ESP_OK;
+    bool ring = false;
+    portENTER_CRITICAL(&s_latest_lock);
+    mqtt_latest_slot_t *slot = NULL;
+    for (int i = 0; i < s_latest_count; i++) {
+        if (strcmp(s_latest[i].topic, topic) == 0) {
+            slot = &s_latest[i];
+            break;
+        }
+    }
+    if (slot == NULL && s_latest_count < MQTT_CONFLATE_TOPICS) {
+        slot = &s_latest[s_latest_count];
+        strcpy(slot->topic, topic);
+        s_latest_count++;
+    }
+    if (slot == NULL) {
+        err = ESP_ERR_NO_MEM;
+    } else {
+        if (slot->dirty) {
+            s_stats.conflated++;
+        }
+        memcpy(slot->data, data, data_len);
+        slot->len = (uint16_t)data_len;
+        ring = !slot->dirty;
+        slot->dirty = true;
+    }
+    portEXIT_CRITICAL(&s_latest_lock);
+
+    if (ring) {
+        // Only a clean slot needs the MQTT task; a dirty one is already due
+        ring_doorbell();
+    }
+    return err;
+}
+#else
+esp_err_t mqtt_handler_publish_latest(const char *topic, const char *data, int data_len)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
+
+/**
+ * @brief Number of async messages dropped because of back-pressure
+ */
+uint32_t mqtt_handler_async_dropped(void)
+{
+    return atomic_load(&s_async_dropped);
+}
+
+/**
+ * @brief Install the broker acknowledgement hook
+ */
+void mqtt_handler_set_ack_cb(mqtt_handler_ack_cb_t cb, void *ctx)
+{
+    s_ack_ctx = ctx;
+    s_ack_cb = cb;
+}
+
+/**
+ * @brief Snapshot of the connection and message counters
+ */
+void mqtt_handler_get_stats(mqtt_handler_stats_t *stats)
+{
+    *stats = s_stats;
+    stats->dropped = atomic_load(&s_async_dropped) + s_batch_stats.samples_dropped;
+    stats->outbox_size = s_mqtt_client ? esp_mqtt_client_get_outbox_size(s_mqtt_client) : 0;
+    stats->spooled = mqtt_spool_pending();
+    stats->wakeups = mqtt_tls_transport_get_polls();
+    stats->doorbells = atomic_load(&s_doorbells);
+    stats->doorbell_coalesced = atomic_load(&s_doorbell_coalesced);
+    stats->event_queue_full = atomic_load(&s_event_queue_full);
+    stats->inflight = atomic_load(&s_inflight);
+    stats->inflight_limit = s_inflight_limit;
+    mqtt_outbox_pressure_t pressure;
+    mqtt_outbox_pool_get_pressure(&pressure);
+    stats->evicted = pressure.evicted;
+    stats->spilled = pressure.spilled;
+    stats->refused = pressure.refused;
+
+    mqtt_outbox_rtt_t rtt;
+    mqtt_outbox_pool_get_rtt(&rtt);
+    stats->srtt_ms = rtt.srtt_ms;
+    stats->rto_ms = rtt.rto_ms;
+    stats->retransmits = rtt.retransmits;
+    mqtt_tls_transport_get_link_stats(&stats->link_probes, &stats->dead_links);
+    stats->write_us = mqtt_tls_transport_get_write_us();
+    stats->tcp_profile = s_tls_transport ? mqtt_tls_transport_get_tcp_profile(s_tls_transport) : 0;
+}
@@ -7,17 +7,45 @@
 #define MQTT_HANDLER_H
 
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief Resolve the broker hostname
+ *
+ * Warms the lwIP DNS cache so the first connect does not wait for DNS.
+ * Safe to call while other startup steps run.
+ *
+ * @return ESP_OK if the host resolved, error code otherwise
+ */
+esp_err_t mqtt_handler_resolve_broker(void);
+
+/**
+ * @brief Load certificates and create the MQTT client without connecting
+ *
+ * Lets the NVS reads and client setup overlap with other startup work.
+ * mqtt_handler_start() calls it itself if it has not run yet. Calling it
+ * again once prepared is a no-op.
+ *
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t mqtt_handler_prepare(void);
+
 /**
  * @brief Start MQTT handler with mTLS
  * 
  * Loads certificates from NVS and private key from device_keys.h,
  * then connects to the MQTT broker using mTLS authentication.
+ * Once started, the client is kept across connection drops and reconnects
+ * with exponential backoff (CONFIG_MQTT_BACKOFF_MIN_MS..MAX_MS); queued
+ * QoS1/2 messages survive the reconnect.
  * 
  * @return ESP_OK on success, error code otherwise
  */
@@ -26,7 +54,9 @@ esp_err_t mqtt_handler_start(void);
 /**
  * @brief Stop MQTT handler
  * 
- * Disconnects from the broker and cleans up resources.
+ * Disconnects from the broker and frees the certificates. With
+ * CONFIG_MQTT_HANDLER_KEEP_CLIENT the client itself is kept for the next
+ * mqtt_handler_start(); otherwise it is destroyed.
  */
 void mqtt_handler_stop(void);
 
@@ -37,6 +67,36 @@ void mqtt_handler_stop(void);
  */
 bool mqtt_handler_is_connected(void);
 
+// Connection state bits for mqtt_handler_wait_event(); exactly one is set at a time
+#define MQTT_HANDLER_EVENT_CONNECTED    BIT0    // CONNACK received, until the connection drops
+#define MQTT_HANDLER_EVENT_DISCONNECTED BIT1    // Client started, not connected (yet or again)
+#define MQTT_HANDLER_EVENT_STOPPED      BIT2    // No client running
+
+/**
+ * @brief Block until the client is connected
+ *
+ * Returns as soon as MQTT_EVENT_CONNECTED is handled, or at once if the
+ * client is already connected.
+ *
+ * @param timeout Maximum time to block (portMAX_DELAY to wait forever)
+ * @return true if connected
+ */
+bool mqtt_handler_wait_connected(TickType_t timeout);
+
+/**
+ * @brief Block until the connection is in any of the given states
+ *
+ * The bits are states, not events: they are not cleared by waiting, so a
+ * state reached before the call returns at once. Before the first
+ * mqtt_handler_prepare() or mqtt_handler_start() this just sleeps for
+ * timeout and returns 0.
+ *
+ * @param mask MQTT_HANDLER_EVENT_* bits to wait for
+ * @param timeout Maximum time to block (portMAX_DELAY to wait forever)
+ * @return The bits of mask that are set, 0 on timeout
+ */
+EventBits_t mqtt_handler_wait_event(EventBits_t mask, TickType_t timeout);
+
 /**
  * @brief Publish message to MQTT topic
  * 
@@ -49,13 +109,367 @@ bool mqtt_handler_is_connected(void);
 esp_err_t mqtt_handler_publish(const char *topic, const char *data, int data_len, int qos);
 
 /**
- * @brief Subscribe to MQTT topic
- * 
- * @param topic Topic name
- * @param qos Quality of Service (0, 1, or 2)
+ * @brief Publish like mqtt_handler_publish() and return the message id
+ *
+ * The id is the one passed to the acknowledgement hook (see
+ * mqtt_handler_set_ack_cb()) when the broker confirms a QoS 1/2 message.
+ *
+ * @param msg_id_out Output: message id, 0 for QoS 0 (may be NULL)
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t mqtt_handler_publish_tracked(const char *topic, const char *data, int data_len, int qos,
+                                       int *msg_id_out);
+
+/**
+ * @brief Outbox priority of a queued message
+ */
+typedef enum {
+    MQTT_HANDLER_PRIO_CRITICAL,     // Alarms: sent before any backlog, never spooled
+    MQTT_HANDLER_PRIO_NORMAL,
+    MQTT_HANDLER_PRIO_BULK,         // Telemetry that may wait (batches, spool drain)
+} mqtt_handler_prio_t;
+
+/**
+ * @brief Queue a message in the outbox lane of its priority
+ *
+ * Does not wait for the network and may be called from any task, also
+ * while disconnected. Critical messages skip the spool and the in-flight
+ * window and are sent ahead of everything queued, so their latency stays
+ * bounded while a backlog drains; they expire after
+ * CONFIG_MQTT_OUTBOX_EXPIRY_CRITICAL_S. Normal and bulk messages follow
+ * the spool rules of batches.
+ *
+ * @return ESP_OK when queued or spooled, ESP_ERR_INVALID_ARG,
+ *         ESP_ERR_INVALID_STATE before the client exists, ESP_FAIL if the
+ *         client refused it
+ */
+esp_err_t mqtt_handler_publish_prio(const char *topic, const char *data, int data_len, int qos,
+                                    mqtt_handler_prio_t prio);
+
+#define MQTT_HANDLER_TOPIC_MAX      64  // Including the terminator
+#define MQTT_TOPIC_ALIAS_UNRESOLVED (-2)
+
+/**
+ * @brief Topic prepared once for repeated publishing
+ *
+ * Holds the topic with its length and QoS, and (with MQTT 5) the topic
+ * alias, looked up on the first publish instead of on every one. Owned by
+ * the caller; fill it with mqtt_handler_topic_prepare().
+ */
+typedef struct {
+    char topic[MQTT_HANDLER_TOPIC_MAX];
+    uint16_t len;
+    uint8_t qos;
+    int8_t alias;                   // Alias slot, -1 none, MQTT_TOPIC_ALIAS_UNRESOLVED before use
+} mqtt_handler_topic_t;
+
+/**
+ * @brief Prepare a fixed topic for mqtt_handler_publish_prepared()
+ *
+ * @param t Handle to fill
+ * @param topic Topic name (shorter than MQTT_HANDLER_TOPIC_MAX)
+ * @param qos Quality of Service (0, 1, or 2) for every publish on it
+ * @return ESP_OK, or ESP_ERR_INVALID_ARG for an empty or too long topic
+ *         or a bad QoS
+ */
+esp_err_t mqtt_handler_topic_prepare(mqtt_handler_topic_t *t, const char *topic, int qos);
+
+/**
+ * @brief Publish on a prepared topic
+ *
+ * Same behaviour as mqtt_handler_publish() without the per-message topic
+ * handling: no topic copy or length scan on our side, and with MQTT 5 no
+ * alias search. Not for use from several tasks on the same handle.
+ *
+ * @param msg_id_out Output: message id as for mqtt_handler_publish_tracked() (may be NULL)
  * @return ESP_OK on success, error code otherwise
  */
-esp_err_t mqtt_handler_subscribe(const char *topic, int qos);
+esp_err_t mqtt_handler_publish_prepared(mqtt_handler_topic_t *t, const char *data, int data_len,
+                                        int *msg_id_out);
+
+/**
+ * @brief Called from the MQTT task when the broker acknowledges a message
+ */
+typedef void (*mqtt_handler_ack_cb_t)(int msg_id, void *ctx);
+
+/**
+ * @brief Install a hook for broker acknowledgements of QoS 1/2 publishes
+ *
+ * One hook at a time; NULL removes it. The hook runs on the MQTT task and
+ * must not block.
+ */
+void mqtt_handler_set_ack_cb(mqtt_handler_ack_cb_t cb, void *ctx);
+
+/**
+ * @brief Queue a message for publishing without blocking on the network
+ *
+ * Copies the message into a lock-free single-producer/single-consumer ring
+ * that the MQTT task drains into the client outbox. Intended for one hot
+ * producer task; other tasks should use mqtt_handler_publish(). Messages
+ * queued while disconnected are sent after the reconnect.
+ *
+ * @param topic Topic name (shorter than 64 characters)
+ * @param data Message data
+ * @param data_len Message length, or 0 to use strlen(data)
+ * @param qos Quality of Service (0, 1, or 2)
+ * @return ESP_OK if queued, ESP_ERR_NO_MEM if the ring is full (counted as
+ *         dropped), ESP_ERR_INVALID_SIZE if the message exceeds
+ *         CONFIG_MQTT_ASYNC_MAX_PAYLOAD, ESP_ERR_INVALID_STATE before
+ *         the client exists
+ */
+esp_err_t mqtt_handler_publish_async(const char *topic, const char *data, int data_len, int qos);
+
+/**
+ * @brief Reserve the next async ring slot to build a payload in place
+ *
+ * Saves the copy mqtt_handler_publish_async() makes: the producer writes
+ * the payload straight into the slot the MQTT task will send from, then
+ * calls mqtt_handler_async_commit(). Same single-producer rule as
+ * mqtt_handler_publish_async(); at most one slot is reserved at a time.
+ *
+ * @param capacity Output: usable bytes in the slot (may be NULL)
+ * @return Slot buffer, or NULL if the ring is full (counted as dropped)
+ *         or the client does not exist yet
+ */
+char *mqtt_handler_async_reserve(size_t *capacity);
+
+/**
+ * @brief Queue the reserved slot for publishing
+ *
+ * @param topic Topic name (shorter than 64 characters)
+ * @param len Bytes written into the slot
+ * @param qos Quality of Service (0, 1, or 2)
+ * @return ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_INVALID_SIZE (the slot
+ *         stays reserved), ESP_ERR_INVALID_STATE without a reservation
+ */
+esp_err_t mqtt_handler_async_commit(const char *topic, size_t len, int qos);
+
+/**
+ * @brief Publish a gauge sample at QoS 0, keeping only the newest per topic
+ *
+ * The sample replaces one of the same topic that has not been sent yet
+ * instead of queueing behind it; the MQTT task sends whatever is newest
+ * when it gets to the topic. Memory is bounded by the number of topics,
+ * not the sample rate. Safe from any task; samples taken while
+ * disconnected leave the last one to be sent after the reconnect.
+ *
+ * @param topic Topic name (shorter than 64 characters); the first
+ *        CONFIG_MQTT_CONFLATE_TOPICS distinct topics get a slot
+ * @param data Sample data
+ * @param data_len Sample length, or 0 to use strlen(data)
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_INVALID_SIZE above
+ *         CONFIG_MQTT_CONFLATE_MAX_PAYLOAD, ESP_ERR_NO_MEM when every slot
+ *         belongs to another topic, ESP_ERR_NOT_SUPPORTED with
+ *         CONFIG_MQTT_CONFLATE_TOPICS 0
+ */
+esp_err_t mqtt_handler_publish_latest(const char *topic, const char *data, int data_len);
+
+/**
+ * @brief Number of async messages dropped because the ring or outbox was full
+ */
+uint32_t mqtt_handler_async_dropped(void);
+
+/**
+ * @brief Connection and message counters since boot
+ */
+typedef struct {
+    uint32_t connects;              // MQTT_EVENT_CONNECTED count
+    uint32_t disconnects;           // MQTT_EVENT_DISCONNECTED count
+    uint32_t last_connect_ms;       // TCP + TLS + CONNECT duration of the last connection
+    uint32_t published;             // Messages accepted by the client
+    uint32_t publish_failed;        // Messages the client refused
+    uint32_t dropped;               // Async and batched messages lost to back-pressure
+    uint32_t expired;               // Outbox entries deleted before acknowledgement
+    uint32_t evicted;               // Outbox entries dropped to keep the heap reserve
+    uint32_t spilled;               // Of those, moved to the flash spool
+    uint32_t refused;               // Messages the outbox would not store for lack of heap
+    int outbox_size;                // Bytes currently held in the outbox
+    uint32_t spooled;               // Messages waiting in the flash spool
+    uint32_t wakeups;               // MQTT task wakeups from its idle wait
+    uint32_t doorbells;             // Drain requests run by the MQTT task, each a batch
+    uint32_t doorbell_coalesced;    // Publishes that joined an already queued drain request
+    uint32_t event_queue_full;      // Drain requests refused by a full event queue
+    uint32_t conflated;             // Gauge samples replaced before they were sent
+    uint32_t async_latency_avg_us;  // Async publish commit-to-drain latency, moving average
+    uint32_t async_latency_max_us;  // Same, worst case since boot
+    uint32_t rx_fragments_max;      // Most chunks an inbound message arrived in
+    uint32_t rx_duplicates;         // QoS 1/2 redeliveries not passed to subscriptions
+    uint32_t tx_fragments_max;      // Most buffer-sized pieces a publish was written in
+    uint32_t inflight;              // QoS 1/2 messages awaiting acknowledgement
+    uint32_t inflight_limit;        // In-flight window of the current connection
+    uint32_t srtt_ms;               // Smoothed PUBLISH to acknowledgement time
+    uint32_t rto_ms;                // Current retransmission timeout
+    uint32_t retransmits;           // QoS 1/2 messages sent again (DUP)
+    uint32_t link_probes;           // PINGREQs sent on a stall or an overdue acknowledgement
+    uint32_t dead_links;            // Connections dropped because a probe went unanswered
+    uint32_t write_us;              // Socket write time, waiting for send buffer included, moving average
+    uint32_t tcp_profile;           // Socket profile of the connection, 0 latency, 1 throughput
+} mqtt_handler_stats_t;
+
+/**
+ * @brief Read the connection and message counters
+ *
+ * @param stats Output snapshot
+ */
+void mqtt_handler_get_stats(mqtt_handler_stats_t *stats);
+
+/**
+ * @brief Telemetry batching counters
+ */
+typedef struct {
+    uint32_t flushes;               // Batches handed to the MQTT client
+    uint32_t samples_published;     // Samples contained in those batches
+    uint32_t samples_dropped;       // Samples lost (no topic slot, client missing, outbox full)
+    uint32_t last_flush_latency_ms; // Age of the oldest sample in the last flushed batch
+    uint32_t max_flush_latency_ms;  // Largest such age seen
+    uint32_t bytes_in;              // Payload bytes of those batches
+    uint32_t bytes_out;             // Bytes handed to the client, after compression
+    uint32_t link_changes;          // Times the link rating changed the flush thresholds
+    uint32_t link_quality;          // Current link_quality_t
+    uint32_t flush_ms;              // Current age threshold
+    uint32_t flush_bytes;           // Current size threshold
+} mqtt_batch_stats_t;
+
+/**
+ * @brief Add a telemetry sample to the batch for its topic
+ *
+ * Samples for the same topic are packed newline-separated into one payload,
+ * which is published when it reaches CONFIG_MQTT_BATCH_BUFFER_SIZE or when
+ * its oldest sample is CONFIG_MQTT_BATCH_INTERVAL_MS old; with
+ * CONFIG_MQTT_BATCH_ADAPTIVE both thresholds follow the link quality
+ * (link_adapt.h). Does not block
+ * on the network. With CONFIG_MQTT_BATCH_TIMESTAMPS the batch starts with
+ * its base time and each JSON object sample gets its offset from it as
+ * "dt" (ms). With CONFIG_MQTT_BATCH_COMPRESS, a batch that gets
+ * smaller is published heatshrink-compressed on topic + "/hs" instead.
+ *
+ * @param topic Topic name (shorter than 64 characters)
+ * @param sample Sample data
+ * @param sample_len Sample length, or 0 to use strlen(sample)
+ * @param qos QoS for the batch (taken from the first sample of a topic)
+ * A topic's slot is given back once it has had nothing pending for a
+ * minute, and when the handler stops.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if all topic slots are in use,
+ *         ESP_ERR_INVALID_SIZE if the sample exceeds the batch buffer,
+ *         ESP_ERR_INVALID_STATE before the first mqtt_handler_prepare()
+ */
+esp_err_t mqtt_handler_batch_add(const char *topic, const char *sample, int sample_len, int qos);
+
+/**
+ * @brief Longest sample mqtt_handler_batch_add() accepts, in bytes
+ */
+int mqtt_handler_batch_sample_max(void);
+
+/**
+ * @brief Publish all pending batches immediately
+ *
+ * @return ESP_OK if every non-empty batch was handed to the client
+ */
+esp_err_t mqtt_handler_batch_flush(void);
+
+/**
+ * @brief Get batching counters, including flush latency
+ *
+ * @param stats Output for the counters
+ */
+void mqtt_handler_batch_get_stats(mqtt_batch_stats_t *stats);
+
+/**
+ * @brief Publish a CBOR-encoded payload
+ *
+ * Appends CBOR_TOPIC_SUFFIX to topic so subscribers can tell the encoding
+ * apart from JSON. Build the payload with cbor_writer.h.
+ *
+ * @param topic Base topic name
+ * @param data Encoded payload
+ * @param len Payload length in bytes
+ * @param qos Quality of Service (0, 1, or 2)
+ * @return ESP_OK on success
+ */
+esp_err_t mqtt_handler_publish_cbor(const char *topic, const uint8_t *data, size_t len, int qos);
+
+/**
+ * @brief One chunk of an inbound message
+ *
+ * Messages larger than the client's receive buffer arrive in several
+ * chunks; offset + len equals total_len on the last one.
+ */
+typedef struct {
+    const char *topic;              // NUL-terminated, truncated to 127 characters
+    int topic_len;
+    const char *data;               // Only valid during the callback
+    int len;
+    int offset;                     // Position of this chunk in the payload
+    int total_len;                  // Payload length of the whole message
+    const char *response_topic;     // MQTT 5 Response Topic, first chunk only, else NULL; not NUL-terminated
+    int response_topic_len;
+    const char *correlation;        // MQTT 5 Correlation Data, first chunk only, else NULL
+    int correlation_len;
+} mqtt_handler_msg_t;
+
+/**
+ * @brief Receives inbound messages, called from the MQTT task
+ *
+ * @return ESP_OK to continue, anything else drops the rest of the message
+ */
+typedef esp_err_t (*mqtt_handler_msg_cb_t)(const mqtt_handler_msg_t *msg, void *ctx);
+
+/**
+ * @brief Subscribe to a topic filter and route its messages to a callback
+ *
+ * Filters may use the "+" and "#" wildcards and are compiled into a trie,
+ * so an inbound message is matched in time proportional to its topic
+ * depth. Every matching callback is called. After each reconnect the
+ * registered filters the broker's session does not hold are subscribed
+ * again, together in one SUBSCRIBE; if the client is not connected the
+ * subscription is only registered.
+ *
+ * @param topic Topic filter
+ * @param qos Quality of Service (0, 1, or 2)
+ * @param cb Message callback
+ * @param ctx Passed to cb
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the registry is full
+ */
+esp_err_t mqtt_handler_subscribe(const char *topic, int qos, mqtt_handler_msg_cb_t cb, void *ctx);
+
+/**
+ * @brief Remove a filter registered with mqtt_handler_subscribe() or
+ *        mqtt_handler_register_sink()
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if the filter is not registered
+ */
+esp_err_t mqtt_handler_unsubscribe(const char *topic);
+
+/**
+ * @brief Route messages on a topic filter to a callback without subscribing
+ *
+ * For topics the broker delivers anyway (e.g. subscribed by the session).
+ * Registering the same filter again replaces its callback.
+ *
+ * @param topic Topic filter
+ * @param cb Callback, or NULL to unregister
+ * @param ctx Passed to cb
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if the filter is too long,
+ *         ESP_ERR_NO_MEM if the registry is full
+ */
+esp_err_t mqtt_handler_register_sink(const char *topic, mqtt_handler_msg_cb_t cb, void *ctx);
+
+/**
+ * @brief Publish the response to a request, echoing its correlation data
+ *
+ * Sent at once like mqtt_handler_publish(), with the MQTT 5 Correlation
+ * Data property set to the request's so the caller can match the answer.
+ *
+ * @param topic Response topic of the request
+ * @param correlation Correlation data of the request, NULL for none
+ * @param correlation_len Its length, at most 65535
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if not connected, ESP_ERR_INVALID_ARG,
+ *         ESP_ERR_NOT_SUPPORTED without CONFIG_MQTT_HANDLER_PROTOCOL_5, or
+ *         ESP_FAIL if the client refused the message
+ */
+esp_err_t mqtt_handler_publish_response(const char *topic, const char *data, int data_len, int qos,
+                                        const char *correlation, int correlation_len);
 
 #ifdef __cplusplus
 }
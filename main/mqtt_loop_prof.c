@@ -0,0 +1,151 @@
+/* MQTT Loop Profiler Implementation
+ *
+ * The client task is pinned (CONFIG_MQTT_TASK_CORE_SELECTION), so the
+ * cycle counter of its core is read without cross-core skew. At 160 MHz
+ * the 32-bit counter wraps after about 27 s, far above any single phase.
+ * Counts are cycles at the configured CPU frequency; with dynamic
+ * frequency scaling a slowed-down phase shows as fewer cycles, not more.
+ */
+
+#include <stdio.h>
+#include "mqtt_loop_prof.h"
+
+#if CONFIG_APP_MQTT_LOOP_PROF
+
+#include "esp_cpu.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define IDLE -1
+
+typedef struct {
+    uint32_t count;
+    uint32_t max;
+    uint32_t bucket[MQTT_LOOP_PROF_BUCKETS];
+} hist_t;
+
+static const char *const s_phase_names[MQTT_LOOP_PHASES] = {
+    "events",
+    "expiry",
+    "receive",
+    "resend",
+    "keepalive",
+    "pass",
+    "api",
+};
+
+static hist_t s_hist[MQTT_LOOP_PHASES];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Owned by the client task
+static TaskHandle_t s_task = NULL;
+static int s_phase = IDLE;
+static uint32_t s_phase_start = 0;
+static uint32_t s_pass_start = 0;
+
+static void record(int phase, uint32_t cycles)
+{
+    int b = 31 - __builtin_clz(cycles | 1);
+    hist_t *h = &s_hist[phase];
+    portENTER_CRITICAL(&s_lock);
+    h->count++;
+    h->bucket[b]++;
+    if (cycles > h->max) {
+        h->max = cycles;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_loop_prof_pass_begin(void)
+{
+    s_task = xTaskGetCurrentTaskHandle();
+    s_phase = MQTT_LOOP_PHASE_EVENTS;
+    s_phase_start = esp_cpu_get_cycle_count();
+    s_pass_start = s_phase_start;
+}
+
+void mqtt_loop_prof_pass_end(void)
+{
+    if (s_phase == IDLE || xTaskGetCurrentTaskHandle() != s_task) {
+        return;
+    }
+    uint32_t now = esp_cpu_get_cycle_count();
+    record(s_phase, now - s_phase_start);
+    record(MQTT_LOOP_PHASE_PASS, now - s_pass_start);
+    s_phase = IDLE;
+}
+
+void mqtt_loop_prof_enter(mqtt_loop_phase_t phase)
+{
+    if (s_phase == IDLE || (int)phase == s_phase || xTaskGetCurrentTaskHandle() != s_task) {
+        return;
+    }
+    uint32_t now = esp_cpu_get_cycle_count();
+    record(s_phase, now - s_phase_start);
+    s_phase = phase;
+    s_phase_start = now;
+}
+
+void mqtt_loop_prof_api(int64_t start_us)
+{
+    int64_t cycles = (esp_timer_get_time() - start_us) * CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+    record(MQTT_LOOP_PHASE_API, cycles > UINT32_MAX ? UINT32_MAX : (uint32_t)cycles);
+}
+
+static void snapshot(int phase, hist_t *out)
+{
+    portENTER_CRITICAL(&s_lock);
+    *out = s_hist[phase];
+    portEXIT_CRITICAL(&s_lock);
+}
+
+size_t mqtt_loop_prof_to_json(char *buf, size_t size)
+{
+    size_t pos = 0;
+    int n;
+
+#define APPEND(...) do { \
+        n = snprintf(buf + pos, size - pos, __VA_ARGS__); \
+        if (n < 0 || (size_t)n >= size - pos) return 0; \
+        pos += n; \
+    } while (0)
+
+    APPEND(",\"mqtt_loop\":{\"mhz\":%d", CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+    for (int i = 0; i < MQTT_LOOP_PHASES; i++) {
+        hist_t h;
+        snapshot(i, &h);
+        // Buckets from the lowest to the highest non-empty one, "lo" being the first
+        int lo = 0;
+        int hi = MQTT_LOOP_PROF_BUCKETS - 1;
+        while (lo < hi && h.bucket[lo] == 0) {
+            lo++;
+        }
+        while (hi > lo && h.bucket[hi] == 0) {
+            hi--;
+        }
+        APPEND(",\"%s\":{\"n\":%lu,\"max\":%lu,\"lo\":%d,\"h\":[", s_phase_names[i],
+               (unsigned long)h.count, (unsigned long)h.max, lo);
+        for (int b = lo; b <= hi; b++) {
+            APPEND("%s%lu", b > lo ? "," : "", (unsigned long)h.bucket[b]);
+        }
+        APPEND("]}");
+    }
+    APPEND("}");
+
+#undef APPEND
+    return pos;
+}
+
+void mqtt_loop_prof_to_cbor(cbor_writer_t *w)
+{
+    cbor_put_array(w, MQTT_LOOP_PHASES);
+    for (int i = 0; i < MQTT_LOOP_PHASES; i++) {
+        hist_t h;
+        snapshot(i, &h);
+        cbor_put_array(w, 2);
+        cbor_put_uint(w, h.count);
+        cbor_put_uint(w, h.max);
+    }
+}
+
+#endif // CONFIG_APP_MQTT_LOOP_PROF
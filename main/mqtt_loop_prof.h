@@ -0,0 +1,116 @@
+/* MQTT Loop Profiler Header
+ *
+ * Splits every pass of the MQTT client task, from one socket poll to the
+ * next, into the phases of esp_mqtt_task and keeps a log2 histogram of
+ * CPU cycles per phase, so publish latency spikes can be pinned on the
+ * event loop, the expiry scan, TLS reads, resends or keepalive rather than
+ * guessed at. The client loop itself is in the managed component; the
+ * phase boundaries are taken from the calls it makes into the transport
+ * (mqtt_tls_transport.c) and the outbox (mqtt_outbox_pool.c):
+ *
+ *   events     poll return to the first expiry call: MQTT_API_LOCK and run_event_loop
+ *   expiry     mqtt_delete_expired_messages
+ *   receive    first transport read on: mqtt_process_receive and its event handlers
+ *   resend     first outbox dequeue on: resending queued and unacknowledged messages
+ *   keepalive  PINGREQ written, to the next poll
+ *   pass       the whole pass
+ *
+ * A phase that does not happen in a pass is folded into the previous one.
+ * The api histogram times publish and enqueue calls on the caller's side,
+ * waiting for MQTT_API_LOCK included, converted from microseconds.
+ *
+ * Bucket b counts samples of 2^b to 2^(b+1) - 1 cycles. Reported under
+ * "mqtt_loop" in GET /metrics and "ml" in the CBOR metrics. Built only
+ * with CONFIG_APP_MQTT_LOOP_PROF; the hooks are empty otherwise.
+ */
+
+#ifndef MQTT_LOOP_PROF_H
+#define MQTT_LOOP_PROF_H
+
+#include "cbor_writer.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_LOOP_PROF_BUCKETS 32
+
+typedef enum {
+    MQTT_LOOP_PHASE_EVENTS,
+    MQTT_LOOP_PHASE_EXPIRY,
+    MQTT_LOOP_PHASE_RECEIVE,
+    MQTT_LOOP_PHASE_RESEND,
+    MQTT_LOOP_PHASE_KEEPALIVE,
+    MQTT_LOOP_PHASE_PASS,       // Histograms only, not entered
+    MQTT_LOOP_PHASE_API,
+    MQTT_LOOP_PHASES,
+} mqtt_loop_phase_t;
+
+#if CONFIG_APP_MQTT_LOOP_PROF
+
+/**
+ * @brief A poll has returned: start a pass in the events phase
+ *
+ * Call from the client task only; it is remembered as the task to profile.
+ */
+void mqtt_loop_prof_pass_begin(void);
+
+/**
+ * @brief End the pass, if one is running
+ *
+ * Call on entering a poll and on connect and close, so reconnects are not
+ * counted as a pass.
+ */
+void mqtt_loop_prof_pass_end(void);
+
+/**
+ * @brief Move the running pass to a later phase
+ *
+ * No-op outside a pass, from other tasks, or when already in that phase.
+ */
+void mqtt_loop_prof_enter(mqtt_loop_phase_t phase);
+
+/**
+ * @brief Start timing a publish or enqueue call
+ */
+static inline int64_t mqtt_loop_prof_api_start(void)
+{
+    return esp_timer_get_time();
+}
+
+/**
+ * @brief Record the call timed from mqtt_loop_prof_api_start()
+ */
+void mqtt_loop_prof_api(int64_t start_us);
+
+/**
+ * @brief Append the histograms as a JSON member (,"mqtt_loop":{...}) to buf
+ *
+ * @return Length written (excluding NUL), or 0 if buf was too small
+ */
+size_t mqtt_loop_prof_to_json(char *buf, size_t size);
+
+/**
+ * @brief Encode [samples, max cycles] per phase as a CBOR array
+ */
+void mqtt_loop_prof_to_cbor(cbor_writer_t *w);
+
+#else
+
+static inline void mqtt_loop_prof_pass_begin(void) {}
+static inline void mqtt_loop_prof_pass_end(void) {}
+static inline void mqtt_loop_prof_enter(mqtt_loop_phase_t phase) {}
+static inline int64_t mqtt_loop_prof_api_start(void) { return 0; }
+static inline void mqtt_loop_prof_api(int64_t start_us) {}
+
+#endif // CONFIG_APP_MQTT_LOOP_PROF
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_LOOP_PROF_H
@@ -0,0 +1,989 @@
+/* MQTT Outbox Pool Implementation
+ *
+ * Replacement for the esp-mqtt default outbox (CONFIG_MQTT_CUSTOM_OUTBOX).
+ * The default one does a calloc for the item and a malloc for the payload
+ * copy on every enqueue and frees both on delete. Here items and their
+ * payload slots come from one region allocated in outbox_init(), handed
+ * out and returned through a free list, so the MQTT task does no allocator
+ * calls for messages that fit a slot.
+ *
+ * Messages larger than a slot, or enqueued while every slot is in use,
+ * fall back to the heap and are counted so the sizes can be tuned.
+ *
+ * Acks and retransmit bookkeeping look items up by msg_id. An
+ * open-addressing index (linear probing, backward-shift deletion) maps
+ * msg_id to an item with that id, so these stay O(1) however many
+ * messages are in flight. Items the index cannot hold (duplicate ids,
+ * table full, QoS 0 messages with id 0) are found by walking the lists.
+ *
+ * Items live in one list per pending_state_t and lane, ordered by tick.
+ * Picking the next message to send or retransmit reads list heads, and
+ * expiry stops at the first item of each list that has not timed out.
+ *
+ * Lanes (mqtt_outbox_lane_t) keep alarms from waiting behind a backlog.
+ * Critical messages are sent first; normal and bulk ones share what is
+ * left, LANE_NORMAL_RUN normal messages for each bulk one while both
+ * wait. Each lane has its own expiry: the client's timeout for normal
+ * messages, CONFIG_MQTT_OUTBOX_EXPIRY_CRITICAL_S and _BULK_S otherwise.
+ * The lane of a PUBLISH is set with mqtt_outbox_pool_set_lane() just
+ * before it is enqueued. The client enqueues in the task that calls it,
+ * so the lane is kept per task and each enqueue takes the one its own
+ * task set; publishers need no lock between setting it and publishing.
+ *
+ * The client retransmits on one fixed timeout. Instead, every exchange is
+ * timed from its transmission to the broker's answer (PUBACK, PUBREC or
+ * PUBCOMP) and the samples feed an RFC 6298 estimator: SRTT and RTTVAR
+ * with gains 1/8 and 1/4, RTO = SRTT + 4 * RTTVAR, doubled on each
+ * retransmission until the next sample. Karn's rule applies: exchanges
+ * that were retransmitted give no sample. The client is configured to
+ * look for retransmissions every CONFIG_MQTT_RTO_MIN_MS, and
+ * outbox_dequeue() only returns an item once its own timeout has passed.
+ *
+ * The heap is only used while it keeps CONFIG_MQTT_OUTBOX_HEAP_RESERVE
+ * bytes of internal RAM free (and CONFIG_MQTT_OUTBOX_PSRAM_RESERVE of
+ * PSRAM when the outbox lives there) for TLS and Wi-Fi. A message that
+ * would go below evicts the oldest unacknowledged bulk message, then
+ * normal one, until it fits; critical messages and QoS 2 exchanges past
+ * PUBREC are never evicted. If nothing is left to evict the message is
+ * refused. Evicted PUBLISHes are handed to the spill callback (the flash
+ * spool) unless they came from it, and the ids of QoS 1/2 ones are
+ * returned by the next outbox_delete_single_expired() calls, so the
+ * client reports them as MQTT_EVENT_DELETED like expired ones. While
+ * EVICT_RING ids wait to be reported no further QoS 1/2 item is evicted,
+ * so none goes unreported.
+ *
+ * This file is compiled into the mqtt component (see the project
+ * CMakeLists.txt), which is why it sees the library's private headers.
+ */
+
+#include "mqtt_outbox.h"
+#include "mqtt_outbox_pool.h"
+#include "mqtt_loop_prof.h"
+#include "mqtt_tls_transport.h"
+#include "trace_marks.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_config.h"
+#include "mqtt_msg.h"
+#include "sys/queue.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if CONFIG_MQTT_CUSTOM_OUTBOX
+static const char *TAG = "outbox_pool";
+
+#define POOL_SLOTS      CONFIG_MQTT_OUTBOX_POOL_SLOTS
+#define POOL_SLOT_SIZE  CONFIG_MQTT_OUTBOX_POOL_SLOT_SIZE
+#define OUTBOX_STATES   (CONFIRMED + 1)
+#define NEXT_TAGS       8               // Tasks with a lane set at the same time
+#define RTO_INITIAL_MS  1000            // RFC 6298 2.1, before the first sample
+#define RTO_MIN_MS      CONFIG_MQTT_RTO_MIN_MS
+#define RTO_MAX_MS      CONFIG_MQTT_RTO_MAX_MS
+#define LANE_NORMAL_RUN 4               // Normal messages per bulk one while both wait
+#define EVICT_RING      8               // Evicted ids awaiting their MQTT_EVENT_DELETED
+#define REPORTED_RING   MQTT_EVENT_QUEUE_SIZE   // Evicted ids whose event may still be queued
+#define HEAP_RESERVE    CONFIG_MQTT_OUTBOX_HEAP_RESERVE
+#ifdef CONFIG_MQTT_OUTBOX_PSRAM_RESERVE
+#define PSRAM_RESERVE   CONFIG_MQTT_OUTBOX_PSRAM_RESERVE
+#else
+#define PSRAM_RESERVE   0
+#endif
+
+typedef struct outbox_item {
+    char *buffer;                           // Slot storage, or heap when heap_buffer
+    int len;
+    int msg_id;
+    int msg_type;
+    int msg_qos;
+    outbox_tick_t tick;
+    outbox_tick_t sent;                     // Last transmission, for the retransmission timeout
+    uint8_t resends;                        // Nonzero: no round-trip sample (Karn)
+    uint8_t lane;                           // mqtt_outbox_lane_t
+    pending_state_t pending;
+    bool spooled;                           // A copy is in the flash spool, do not spill
+    bool pooled;                            // Item header belongs to the pool
+    bool heap_buffer;                       // buffer was malloc'd (oversized payload)
+    bool indexed;                           // Present in the msg_id index
+    TAILQ_ENTRY(outbox_item) next;
+    struct outbox_item *free_next;
+} outbox_item_t;
+
+TAILQ_HEAD(outbox_list_t, outbox_item);
+
+struct outbox_t {
+    _Atomic uint64_t size;
+    struct outbox_list_t lists[OUTBOX_STATES][MQTT_OUTBOX_LANES]; // By pending state and lane, oldest tick first
+    int normal_run;                         // Normal messages sent since the last bulk one
+    outbox_item_t *items;                   // POOL_SLOTS item headers
+    uint8_t *slab;                          // POOL_SLOTS * POOL_SLOT_SIZE payload bytes
+    outbox_item_t *free_list;
+    uint32_t heap_fallbacks;
+    outbox_item_t **index;                  // msg_id -> item with that id
+    uint32_t index_mask;                    // Index size - 1 (power of two)
+    uint32_t index_count;
+    uint32_t unindexed;                     // Items with msg_id != 0 missing from the index
+    int evicted[EVICT_RING];                // Ids of evicted items not reported yet, oldest first
+    uint8_t evicted_head;
+    uint8_t evicted_count;
+};
+
+// Lane and spool flag for the next PUBLISH a task enqueues; a free entry
+// has no task. Entries holding the defaults are freed again.
+typedef struct {
+    TaskHandle_t task;
+    uint8_t lane;
+    bool spooled;
+} next_tag_t;
+
+static next_tag_t s_next_tags[NEXT_TAGS];
+static portMUX_TYPE s_next_tags_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Round-trip estimator of the one client connection: srtt in 1/8 ms,
+// rttvar in 1/4 ms (Jacobson's scaling, so the gains are shifts)
+static int32_t s_srtt8 = 0;
+static int32_t s_rttvar4 = 0;
+static uint32_t s_rto_ms = RTO_INITIAL_MS;
+static uint32_t s_samples = 0;
+static uint32_t s_retransmits = 0;
+static outbox_tick_t s_backoff_at = 0;      // Last RTO doubling; older sends share its loss
+static atomic_bool s_reconnected = false;   // Resend everything on the next scan
+static mqtt_outbox_spill_cb_t s_spill_cb = NULL;
+// Ids reported as evicted, oldest overwritten first: the client queues its
+// events, so the handler sees a DELETED after later ones were reported.
+// 0 marks a free entry (evicted ids are QoS 1/2 ones). MQTT task only.
+static int s_reported_evicted[REPORTED_RING];
+static uint8_t s_reported_next = 0;
+static mqtt_outbox_pressure_t s_pressure;
+
+static uint32_t index_home(const struct outbox_t *outbox, int msg_id)
+{
+    return ((uint32_t)msg_id * 2654435761u) & outbox->index_mask;
+}
+
+static outbox_item_t *index_find(const struct outbox_t *outbox, int msg_id)
+{
+    for (uint32_t i = index_home(outbox, msg_id); outbox->index[i] != NULL; i = (i + 1) & outbox->index_mask) {
+        if (outbox->index[i]->msg_id == msg_id) {
+            return outbox->index[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Add an item whose msg_id is not indexed yet
+ *
+ * @return false if the table is at its load limit (3/4)
+ */
+static bool index_insert(struct outbox_t *outbox, outbox_item_t *item)
+{
+    if ((outbox->index_count + 1) * 4 > (outbox->index_mask + 1) * 3) {
+        return false;
+    }
+    uint32_t i = index_home(outbox, item->msg_id);
+    while (outbox->index[i] != NULL) {
+        i = (i + 1) & outbox->index_mask;
+    }
+    outbox->index[i] = item;
+    outbox->index_count++;
+    item->indexed = true;
+    return true;
+}
+
+static void index_remove(struct outbox_t *outbox, outbox_item_t *item)
+{
+    uint32_t mask = outbox->index_mask;
+    uint32_t i = index_home(outbox, item->msg_id);
+    while (outbox->index[i] != item) {
+        if (outbox->index[i] == NULL) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    outbox->index[i] = NULL;
+    outbox->index_count--;
+    item->indexed = false;
+
+    // Backward shift: pull later entries of the probe run into the hole,
+    // unless their home slot lies cyclically in (hole, j]
+    for (uint32_t j = (i + 1) & mask; outbox->index[j] != NULL; j = (j + 1) & mask) {
+        uint32_t home = index_home(outbox, outbox->index[j]->msg_id);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            outbox->index[i] = outbox->index[j];
+            outbox->index[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/**
+ * @brief Link an item into its state's list, keeping tick order
+ *
+ * Ticks only grow, so this normally stops at the tail.
+ */
+static void list_insert(struct outbox_t *outbox, outbox_item_t *item)
+{
+    struct outbox_list_t *list = &outbox->lists[item->pending][item->lane];
+    outbox_item_t *after = TAILQ_LAST(list, outbox_list_t);
+    while (after != NULL && after->tick > item->tick) {
+        after = TAILQ_PREV(after, outbox_list_t, next);
+    }
+    if (after != NULL) {
+        TAILQ_INSERT_AFTER(list, after, item, next);
+    } else {
+        TAILQ_INSERT_HEAD(list, item, next);
+    }
+}
+
+static void list_remove(struct outbox_t *outbox, outbox_item_t *item)
+{
+    TAILQ_REMOVE(&outbox->lists[item->pending][item->lane], item, next);
+}
+
+/**
+ * @brief Walk every list for msg_id (and msg_type unless it is -1)
+ */
+static outbox_item_t *scan_find(struct outbox_t *outbox, int msg_id, int msg_type)
+{
+    for (int state = 0; state < OUTBOX_STATES; state++) {
+        for (int lane = 0; lane < MQTT_OUTBOX_LANES; lane++) {
+            outbox_item_t *item;
+            TAILQ_FOREACH(item, &outbox->lists[state][lane], next) {
+                if (item->msg_id == msg_id && (msg_type < 0 || (0xFF & (item->msg_type)) == msg_type)) {
+                    return item;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Item with msg_id, or NULL
+ */
+static outbox_item_t *item_find(struct outbox_t *outbox, int msg_id)
+{
+    if (msg_id != 0) {
+        outbox_item_t *item = index_find(outbox, msg_id);
+        if (item != NULL || outbox->unindexed == 0) {
+            return item;
+        }
+    }
+    return scan_find(outbox, msg_id, -1);
+}
+
+static uint32_t rto_clamp(uint32_t rto)
+{
+    return rto < RTO_MIN_MS ? RTO_MIN_MS : rto > RTO_MAX_MS ? RTO_MAX_MS : rto;
+}
+
+/**
+ * @brief Feed one round trip to the estimator
+ */
+static void rtt_sample(outbox_tick_t rtt)
+{
+    int32_t r = rtt > RTO_MAX_MS ? RTO_MAX_MS : (int32_t)rtt;
+    if (s_samples++ == 0) {
+        s_srtt8 = r << 3;
+        s_rttvar4 = r << 1;
+    } else {
+        int32_t delta = r - (s_srtt8 >> 3);
+        s_srtt8 += delta;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        s_rttvar4 += delta - (s_rttvar4 >> 2);
+    }
+    // A fresh sample also ends any backoff
+    int32_t var = s_rttvar4 > 1 ? s_rttvar4 : 1;
+    s_rto_ms = rto_clamp((uint32_t)((s_srtt8 >> 3) + var));
+}
+
+/**
+ * @brief Oldest item of a list whose retransmission timeout has passed
+ */
+static outbox_item_t *due_item(struct outbox_t *outbox, pending_state_t pending, outbox_tick_t now)
+{
+    if (atomic_exchange(&s_reconnected, false)) {
+        // Unanswered on the old connection: due right away, never sampled
+        for (int state = TRANSMITTED; state <= ACKNOWLEDGED; state++) {
+            for (int lane = 0; lane < MQTT_OUTBOX_LANES; lane++) {
+                outbox_item_t *item;
+                TAILQ_FOREACH(item, &outbox->lists[state][lane], next) {
+                    item->sent = 0;
+                    item->resends = 1;
+                }
+            }
+        }
+    }
+
+    for (int lane = 0; lane < MQTT_OUTBOX_LANES; lane++) {
+        outbox_item_t *item;
+        TAILQ_FOREACH(item, &outbox->lists[pending][lane], next) {
+            if (now - item->sent > s_rto_ms) {
+                return item;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Next message to send: critical first, then normal and bulk by weight
+ */
+static outbox_item_t *next_queued(struct outbox_t *outbox)
+{
+    outbox_item_t *critical = TAILQ_FIRST(&outbox->lists[QUEUED][MQTT_OUTBOX_LANE_CRITICAL]);
+    if (critical != NULL) {
+        return critical;
+    }
+    outbox_item_t *normal = TAILQ_FIRST(&outbox->lists[QUEUED][MQTT_OUTBOX_LANE_NORMAL]);
+    outbox_item_t *bulk = TAILQ_FIRST(&outbox->lists[QUEUED][MQTT_OUTBOX_LANE_BULK]);
+    if (normal != NULL && (bulk == NULL || outbox->normal_run < LANE_NORMAL_RUN)) {
+        if (bulk != NULL) {
+            outbox->normal_run++;
+        }
+        return normal;
+    }
+    outbox->normal_run = 0;
+    return bulk;
+}
+
+/**
+ * @brief How long an item of a lane may stay in the outbox
+ */
+static outbox_tick_t lane_expiry(int lane, outbox_tick_t timeout)
+{
+    switch (lane) {
+    case MQTT_OUTBOX_LANE_CRITICAL:
+        return (outbox_tick_t)CONFIG_MQTT_OUTBOX_EXPIRY_CRITICAL_S * 1000;
+    case MQTT_OUTBOX_LANE_BULK:
+        return (outbox_tick_t)CONFIG_MQTT_OUTBOX_EXPIRY_BULK_S * 1000;
+    default:
+        return timeout;
+    }
+}
+
+/**
+ * @brief Entry of the calling task, s_next_tags_lock held
+ *
+ * @param claim Take a free entry if the task has none
+ * @return NULL if the task has none (and none was free)
+ */
+static next_tag_t *next_tag(bool claim)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    next_tag_t *unused = NULL;
+    for (int i = 0; i < NEXT_TAGS; i++) {
+        if (s_next_tags[i].task == self) {
+            return &s_next_tags[i];
+        }
+        if (unused == NULL && s_next_tags[i].task == NULL) {
+            unused = &s_next_tags[i];
+        }
+    }
+    if (claim && unused != NULL) {
+        *unused = (next_tag_t){.task = self, .lane = MQTT_OUTBOX_LANE_NORMAL};
+        return unused;
+    }
+    // Every entry taken: this task's message goes out as a normal one
+    return NULL;
+}
+
+static void next_tag_release_idle(next_tag_t *tag)
+{
+    if (tag->lane == MQTT_OUTBOX_LANE_NORMAL && !tag->spooled) {
+        tag->task = NULL;
+    }
+}
+
+void mqtt_outbox_pool_set_lane(mqtt_outbox_lane_t lane)
+{
+    if (lane >= MQTT_OUTBOX_LANES) {
+        lane = MQTT_OUTBOX_LANE_NORMAL;
+    }
+    portENTER_CRITICAL(&s_next_tags_lock);
+    next_tag_t *tag = next_tag(lane != MQTT_OUTBOX_LANE_NORMAL);
+    if (tag != NULL) {
+        tag->lane = lane;
+        next_tag_release_idle(tag);
+    }
+    portEXIT_CRITICAL(&s_next_tags_lock);
+}
+
+void mqtt_outbox_pool_set_spooled(bool spooled)
+{
+    portENTER_CRITICAL(&s_next_tags_lock);
+    next_tag_t *tag = next_tag(spooled);
+    if (tag != NULL) {
+        tag->spooled = spooled;
+        next_tag_release_idle(tag);
+    }
+    portEXIT_CRITICAL(&s_next_tags_lock);
+}
+
+/**
+ * @brief Take the lane and spool flag the calling task set for this PUBLISH
+ */
+static void next_tag_take(uint8_t *lane, bool *spooled)
+{
+    *lane = MQTT_OUTBOX_LANE_NORMAL;
+    *spooled = false;
+    portENTER_CRITICAL(&s_next_tags_lock);
+    next_tag_t *tag = next_tag(false);
+    if (tag != NULL) {
+        *lane = tag->lane;
+        *spooled = tag->spooled;
+        tag->task = NULL;
+    }
+    portEXIT_CRITICAL(&s_next_tags_lock);
+}
+
+void mqtt_outbox_pool_set_spill_cb(mqtt_outbox_spill_cb_t cb)
+{
+    s_spill_cb = cb;
+}
+
+mqtt_outbox_delete_reason_t mqtt_outbox_pool_delete_reason(int msg_id)
+{
+    for (int i = 0; i < REPORTED_RING; i++) {
+        if (msg_id != 0 && s_reported_evicted[i] == msg_id) {
+            s_reported_evicted[i] = 0;
+            return MQTT_OUTBOX_DELETED_EVICTED;
+        }
+    }
+    return MQTT_OUTBOX_DELETED_EXPIRED;
+}
+
+void mqtt_outbox_pool_get_pressure(mqtt_outbox_pressure_t *pressure)
+{
+    *pressure = s_pressure;
+}
+
+void mqtt_outbox_pool_connected(void)
+{
+    s_srtt8 = 0;
+    s_rttvar4 = 0;
+    s_rto_ms = RTO_INITIAL_MS;
+    s_samples = 0;
+    s_backoff_at = 0;
+    atomic_store(&s_reconnected, true);
+}
+
+void mqtt_outbox_pool_get_rtt(mqtt_outbox_rtt_t *rtt)
+{
+    rtt->srtt_ms = (uint32_t)(s_srtt8 >> 3);
+    rtt->rttvar_ms = (uint32_t)(s_rttvar4 >> 2);
+    rtt->rto_ms = s_rto_ms;
+    rtt->samples = s_samples;
+    rtt->retransmits = s_retransmits;
+}
+
+outbox_handle_t outbox_init(void)
+{
+    outbox_handle_t outbox = calloc(1, sizeof(struct outbox_t));
+    ESP_MEM_CHECK(TAG, outbox, return NULL);
+    outbox->items = calloc(POOL_SLOTS, sizeof(outbox_item_t));
+    outbox->slab = heap_caps_malloc((size_t)POOL_SLOTS * POOL_SLOT_SIZE, MQTT_OUTBOX_MEMORY);
+    ESP_MEM_CHECK(TAG, outbox->items && outbox->slab, {
+        free(outbox->items);
+        heap_caps_free(outbox->slab);
+        free(outbox);
+        return NULL;
+    });
+
+    uint32_t index_size = 4;
+    while (index_size < 2 * POOL_SLOTS) {
+        index_size <<= 1;
+    }
+    outbox->index = calloc(index_size, sizeof(outbox_item_t *));
+    ESP_MEM_CHECK(TAG, outbox->index, {
+        free(outbox->items);
+        heap_caps_free(outbox->slab);
+        free(outbox);
+        return NULL;
+    });
+    outbox->index_mask = index_size - 1;
+
+    for (int state = 0; state < OUTBOX_STATES; state++) {
+        for (int lane = 0; lane < MQTT_OUTBOX_LANES; lane++) {
+            TAILQ_INIT(&outbox->lists[state][lane]);
+        }
+    }
+    for (int i = 0; i < POOL_SLOTS; i++) {
+        outbox_item_t *item = &outbox->items[i];
+        item->pooled = true;
+        item->free_next = outbox->free_list;
+        outbox->free_list = item;
+    }
+    outbox->size = 0;
+    ESP_LOGI(TAG, "Outbox pool: %d slots of %d bytes", POOL_SLOTS, POOL_SLOT_SIZE);
+    return outbox;
+}
+
+/**
+ * @brief Whether storing len bytes on the heap would eat into a reserve
+ *
+ * @param header The item header is needed from the heap too
+ */
+static bool heap_low(bool header, int len)
+{
+    size_t internal = header ? sizeof(outbox_item_t) : 0;
+    if (MQTT_OUTBOX_MEMORY == MALLOC_CAP_SPIRAM) {
+        if (heap_caps_get_free_size(MALLOC_CAP_SPIRAM) < (size_t)PSRAM_RESERVE + len ||
+            heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) < (size_t)len) {
+            return true;
+        }
+    } else {
+        internal += len;
+    }
+    return heap_caps_get_free_size(MALLOC_CAP_INTERNAL) < (size_t)HEAP_RESERVE + internal;
+}
+
+/**
+ * @brief Topic and payload of a stored PUBLISH
+ *
+ * @return false if the packet cannot be parsed or names no topic (MQTT 5 alias)
+ */
+static bool publish_fields(const outbox_item_t *item, const char **topic, size_t *topic_len,
+                           const char **data, size_t *data_len)
+{
+    const uint8_t *p = (const uint8_t *)item->buffer;
+    int i = 1;
+    // Remaining length, 1 to 4 bytes
+    while (i < 5 && i < item->len && (p[i] & 0x80) != 0) {
+        i++;
+    }
+    i++;
+    if (i + 2 > item->len) {
+        return false;
+    }
+    size_t tlen = (size_t)p[i] << 8 | p[i + 1];
+    i += 2;
+    if (tlen == 0 || i + (int)tlen > item->len) {
+        return false;
+    }
+    *topic = (const char *)p + i;
+    *topic_len = tlen;
+    i += tlen;
+    if (item->msg_qos > 0) {
+        i += 2;
+    }
+#if CONFIG_MQTT_HANDLER_PROTOCOL_5
+    // Property length, a variable byte integer, then the properties. The
+    // library's MQTT_PROTOCOL_5 only means v5 is available: the packet
+    // has them only when the handler connects with it
+    size_t props = 0;
+    for (int shift = 0; shift < 28 && i < item->len; shift += 7) {
+        props |= (size_t)(p[i] & 0x7F) << shift;
+        if ((p[i++] & 0x80) == 0) {
+            break;
+        }
+    }
+    i += props;
+#endif
+    if (i > item->len) {
+        return false;
+    }
+    *data = (const char *)p + i;
+    *data_len = item->len - i;
+    return true;
+}
+
+static void item_release(outbox_handle_t outbox, outbox_item_t *item);
+
+/**
+ * @brief Drop the oldest unacknowledged bulk, else normal, item to free memory
+ *
+ * @return false if there was none, or its deletion could not be reported yet
+ */
+static bool evict_one(outbox_handle_t outbox)
+{
+    for (int lane = MQTT_OUTBOX_LANE_BULK; lane > MQTT_OUTBOX_LANE_CRITICAL; lane--) {
+        outbox_item_t *queued = TAILQ_FIRST(&outbox->lists[QUEUED][lane]);
+        outbox_item_t *sent = TAILQ_FIRST(&outbox->lists[TRANSMITTED][lane]);
+        outbox_item_t *item = queued == NULL || (sent != NULL && sent->tick < queued->tick) ? sent : queued;
+        if (item == NULL) {
+            continue;
+        }
+        if (item->msg_id != 0 && outbox->evicted_count == EVICT_RING) {
+            // Its MQTT_EVENT_DELETED could not be reported, and the spool
+            // window waits for that event to resend the record
+            return false;
+        }
+
+        const char *topic;
+        const char *data;
+        size_t topic_len;
+        size_t data_len;
+        if (!item->spooled && s_spill_cb != NULL && (0xFF & item->msg_type) == MQTT_MSG_TYPE_PUBLISH &&
+            publish_fields(item, &topic, &topic_len, &data, &data_len) &&
+            s_spill_cb(topic, topic_len, data, data_len, item->msg_qos) == ESP_OK) {
+            s_pressure.spilled++;
+        }
+        if (item->msg_id != 0) {
+            // QoS 0 items hold no place in the in-flight or spool windows
+            outbox->evicted[(outbox->evicted_head + outbox->evicted_count++) % EVICT_RING] = item->msg_id;
+        }
+        if (s_pressure.evicted++ == 0) {
+            ESP_LOGW(TAG, "Heap low, evicting outbox messages (msgid=%d, lane %d, len=%d)",
+                     item->msg_id, lane, item->len);
+        }
+        item_release(outbox, item);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Take an item with room for len payload bytes
+ */
+static outbox_item_t *item_alloc(outbox_handle_t outbox, int len)
+{
+    // Make room before the heap goes below its reserve; evicting a pooled
+    // item may also free the slot this message needs
+    while ((HEAP_RESERVE > 0 || PSRAM_RESERVE > 0) && (outbox->free_list == NULL || len > POOL_SLOT_SIZE) &&
+           heap_low(outbox->free_list == NULL, len)) {
+        if (!evict_one(outbox)) {
+            if (s_pressure.refused++ == 0) {
+                ESP_LOGW(TAG, "Heap low, outbox refusing messages (len=%d)", len);
+            }
+            return NULL;
+        }
+    }
+
+    outbox_item_t *item = outbox->free_list;
+    if (item != NULL) {
+        outbox->free_list = item->free_next;
+        int slot = item - outbox->items;
+        item->buffer = (char *)outbox->slab + (size_t)slot * POOL_SLOT_SIZE;
+        item->heap_buffer = false;
+    } else {
+        item = calloc(1, sizeof(outbox_item_t));
+        if (item == NULL) {
+            return NULL;
+        }
+        item->buffer = NULL;
+    }
+
+    if (len > POOL_SLOT_SIZE || item->buffer == NULL) {
+        if (outbox->heap_fallbacks++ == 0) {
+            ESP_LOGW(TAG, "Outbox pool fallback to heap (len=%d)", len);
+        }
+        item->buffer = heap_caps_malloc(len, MQTT_OUTBOX_MEMORY);
+        item->heap_buffer = true;
+        if (item->buffer == NULL) {
+            item->heap_buffer = false;
+            if (item->pooled) {
+                item->free_next = outbox->free_list;
+                outbox->free_list = item;
+            } else {
+                free(item);
+            }
+            return NULL;
+        }
+    }
+    return item;
+}
+
+/**
+ * @brief Unlink an item and give its storage back
+ */
+static void item_release(outbox_handle_t outbox, outbox_item_t *item)
+{
+    list_remove(outbox, item);
+    outbox->size -= item->len;
+
+    if (item->indexed) {
+        index_remove(outbox, item);
+        if (outbox->unindexed > 0) {
+            // Hand the index entry to another item with this id, if any
+            outbox_item_t *other = scan_find(outbox, item->msg_id, -1);
+            if (other != NULL && !other->indexed && index_insert(outbox, other)) {
+                outbox->unindexed--;
+            }
+        }
+    } else if (item->msg_id != 0) {
+        outbox->unindexed--;
+    }
+    if (item->heap_buffer) {
+        heap_caps_free(item->buffer);
+    }
+    if (item->pooled) {
+        item->free_next = outbox->free_list;
+        outbox->free_list = item;
+    } else {
+        free(item);
+    }
+}
+
+outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    int len = message->len + message->remaining_len;
+    outbox_item_handle_t item = item_alloc(outbox, len);
+    ESP_MEM_CHECK(TAG, item, return NULL);
+    item->msg_id = message->msg_id;
+    item->msg_type = message->msg_type;
+    item->msg_qos = message->msg_qos;
+    item->tick = tick;
+    item->sent = tick;
+    item->resends = 0;
+    // Consumed by the PUBLISH it was set for; other packets are normal
+    item->lane = MQTT_OUTBOX_LANE_NORMAL;
+    item->spooled = false;
+    if ((0xFF & message->msg_type) == MQTT_MSG_TYPE_PUBLISH) {
+        next_tag_take(&item->lane, &item->spooled);
+    }
+    item->len = len;
+    item->pending = QUEUED;
+    item->indexed = false;
+    if (item->msg_id != 0 && (index_find(outbox, item->msg_id) != NULL || !index_insert(outbox, item))) {
+        outbox->unindexed++;
+    }
+    memcpy(item->buffer, message->data, message->len);
+    if (message->remaining_data) {
+        memcpy(item->buffer + message->len, message->remaining_data, message->remaining_len);
+    }
+    list_insert(outbox, item);
+    outbox->size += item->len;
+    TRACE_MARK(TRACE_ID_OUTBOX_ENQUEUE);
+    ESP_LOGD(TAG, "ENQUEUE msgid=%d, msg_type=%d, len=%d, size=%"PRIu64, message->msg_id, message->msg_type, len, outbox_get_size(outbox));
+    return item;
+}
+
+outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
+{
+    return item_find(outbox, msg_id);
+}
+
+outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick)
+{
+    mqtt_loop_prof_enter(MQTT_LOOP_PHASE_RESEND);
+    if ((unsigned)pending >= OUTBOX_STATES) {
+        return NULL;
+    }
+    if (pending == QUEUED) {
+        outbox_item_handle_t item = next_queued(outbox);
+        if (item && tick) {
+            *tick = item->tick;
+        }
+        return item;
+    }
+    if (pending != TRANSMITTED && pending != ACKNOWLEDGED) {
+        for (int lane = 0; lane < MQTT_OUTBOX_LANES; lane++) {
+            outbox_item_handle_t item = TAILQ_FIRST(&outbox->lists[pending][lane]);
+            if (item != NULL) {
+                if (tick) {
+                    *tick = item->tick;
+                }
+                return item;
+            }
+        }
+        return NULL;
+    }
+
+    // Retransmission scan: the caller sends the item again
+    outbox_tick_t now = platform_tick_get_ms();
+    outbox_item_handle_t item = due_item(outbox, pending, now);
+    if (item != NULL) {
+        outbox_tick_t last = item->sent;
+        item->sent = now;
+        if (item->resends < UINT8_MAX) {
+            item->resends++;
+        }
+        s_retransmits++;
+        // Back off once per timeout, not once per item: the client dequeues
+        // the due items one by one, and everything sent before the last
+        // doubling timed out in the same outage
+        if (last >= s_backoff_at) {
+            s_backoff_at = now;
+            s_rto_ms = rto_clamp(s_rto_ms * 2);
+            // No answer within the RTO: ask the transport whether the link is still up
+            mqtt_tls_transport_suspect();
+        }
+        if (tick) {
+            // The client compares this with its own fixed timeout; the
+            // decision is already made here
+            *tick = 0;
+        }
+    }
+    return item;
+}
+
+esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item_to_delete)
+{
+    if (item_to_delete == NULL) {
+        return ESP_FAIL;
+    }
+    ESP_LOGD(TAG, "DELETE_ITEM msgid=%d, msg_type=%d", item_to_delete->msg_id, item_to_delete->msg_type);
+    item_release(outbox, item_to_delete);
+    return ESP_OK;
+}
+
+uint8_t *outbox_item_get_data(outbox_item_handle_t item,  size_t *len, uint16_t *msg_id, int *msg_type, int *qos)
+{
+    if (item) {
+        *len = item->len;
+        *msg_id = item->msg_id;
+        *msg_type = item->msg_type;
+        *qos = item->msg_qos;
+        return (uint8_t *)item->buffer;
+    }
+    return NULL;
+}
+
+esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type)
+{
+    outbox_item_handle_t item = item_find(outbox, msg_id);
+    if (item != NULL && (0xFF & (item->msg_type)) == msg_type) {
+        ESP_LOGD(TAG, "DELETE msgid=%d, msg_type=%d", msg_id, msg_type);
+        if (item->pending != QUEUED && item->resends == 0) {
+            rtt_sample(platform_tick_get_ms() - item->sent);
+        }
+        if (msg_type == MQTT_MSG_TYPE_PUBLISH) {
+            TRACE_MARK(TRACE_ID_PUBACK);
+        }
+        item_release(outbox, item);
+        return ESP_OK;
+    }
+    if (item == NULL || (msg_id != 0 && outbox->unindexed == 0)) {
+        return ESP_FAIL;
+    }
+
+    // Another item may share the id with a different type
+    item = scan_find(outbox, msg_id, msg_type);
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+    ESP_LOGD(TAG, "DELETE msgid=%d, msg_type=%d", msg_id, msg_type);
+    item_release(outbox, item);
+    return ESP_OK;
+}
+
+esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending)
+{
+    outbox_item_handle_t item = outbox_get(outbox, msg_id);
+    if (item == NULL || (unsigned)pending >= OUTBOX_STATES) {
+        return ESP_FAIL;
+    }
+    if (item->pending != pending) {
+        outbox_tick_t now = platform_tick_get_ms();
+        if (pending == ACKNOWLEDGED && item->pending == TRANSMITTED && item->resends == 0) {
+            // PUBREC: the PUBLISH round trip is complete
+            rtt_sample(now - item->sent);
+        }
+        if (pending == TRANSMITTED || pending == ACKNOWLEDGED) {
+            // Set right after the write (PUBLISH, or PUBREL in reply to PUBREC)
+            item->sent = now;
+            item->resends = 0;
+        }
+        list_remove(outbox, item);
+        item->pending = pending;
+        list_insert(outbox, item);
+    }
+    return ESP_OK;
+}
+
+pending_state_t outbox_item_get_pending(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->pending;
+    }
+    return QUEUED;
+}
+
+esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick)
+{
+    outbox_item_handle_t item = outbox_get(outbox, msg_id);
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+    list_remove(outbox, item);
+    item->tick = tick;
+    list_insert(outbox, item);
+    return ESP_OK;
+}
+
+int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    mqtt_loop_prof_enter(MQTT_LOOP_PHASE_EXPIRY);
+    if (outbox->evicted_count > 0) {
+        // Already released, reported here so the client emits MQTT_EVENT_DELETED
+        int msg_id = outbox->evicted[outbox->evicted_head];
+        outbox->evicted_head = (outbox->evicted_head + 1) % EVICT_RING;
+        outbox->evicted_count--;
+        s_reported_evicted[s_reported_next] = msg_id;
+        s_reported_next = (s_reported_next + 1) % REPORTED_RING;
+        return msg_id;
+    }
+    // Only list heads can be the oldest item of their lane
+    for (int state = 0; state < OUTBOX_STATES; state++) {
+        for (int lane = 0; lane < MQTT_OUTBOX_LANES; lane++) {
+            outbox_item_handle_t head = TAILQ_FIRST(&outbox->lists[state][lane]);
+            if (head && current_tick - head->tick > lane_expiry(lane, timeout)) {
+                int msg_id = head->msg_id;
+                item_release(outbox, head);
+                ESP_LOGD(TAG, "DELETE_SINGLE_EXPIRED msgid=%d, lane %d, remain size=%"PRIu64,
+                         msg_id, lane, outbox_get_size(outbox));
+                return msg_id;
+            }
+        }
+    }
+    return -1;
+}
+
+int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    mqtt_loop_prof_enter(MQTT_LOOP_PHASE_EXPIRY);
+    // Nobody to report evictions to
+    outbox->evicted_count = 0;
+    int deleted_items = 0;
+    for (int state = 0; state < OUTBOX_STATES; state++) {
+        for (int lane = 0; lane < MQTT_OUTBOX_LANES; lane++) {
+            outbox_tick_t expiry = lane_expiry(lane, timeout);
+            outbox_item_handle_t item;
+            while ((item = TAILQ_FIRST(&outbox->lists[state][lane])) != NULL && current_tick - item->tick > expiry) {
+                ESP_LOGD(TAG, "DELETE_EXPIRED msgid=%d", item->msg_id);
+                item_release(outbox, item);
+                deleted_items++;
+            }
+        }
+    }
+    return deleted_items;
+}
+
+uint64_t outbox_get_size(outbox_handle_t outbox)
+{
+    return outbox->size;
+}
+
+void outbox_delete_all_items(outbox_handle_t outbox)
+{
+    for (int state = 0; state < OUTBOX_STATES; state++) {
+        for (int lane = 0; lane < MQTT_OUTBOX_LANES; lane++) {
+            outbox_item_handle_t item;
+            while ((item = TAILQ_FIRST(&outbox->lists[state][lane])) != NULL) {
+                item_release(outbox, item);
+            }
+        }
+    }
+}
+
+void outbox_destroy(outbox_handle_t outbox)
+{
+    outbox_delete_all_items(outbox);
+    if (outbox->heap_fallbacks) {
+        ESP_LOGI(TAG, "Outbox pool used the heap for %"PRIu32" messages", outbox->heap_fallbacks);
+    }
+    heap_caps_free(outbox->slab);
+    free(outbox->items);
+    free(outbox->index);
+    free(outbox);
+}
+
+#endif /* CONFIG_MQTT_CUSTOM_OUTBOX */
@@ -0,0 +1,150 @@
+/* MQTT Outbox Pool Header
+ *
+ * Hooks into the replacement outbox (mqtt_outbox_pool.c) for the MQTT
+ * handler. Besides storage, the outbox times each QoS 1/2 exchange from
+ * its transmission to the broker's answer and derives an RFC 6298
+ * retransmission timeout from the samples; a message is sent again only
+ * once it has gone unanswered for that long, with the timeout doubling on
+ * every retransmission until a fresh sample arrives.
+ *
+ * Queued messages wait in one of three lanes. Critical ones are sent
+ * before anything else, normal and bulk ones share the rest by weight,
+ * and each lane expires on its own timeout.
+ *
+ * When the heap runs low the outbox evicts bulk, then normal, messages
+ * instead of growing into the memory TLS and Wi-Fi need, and refuses
+ * messages once nothing is left to evict. Evictions are reported as
+ * MQTT_EVENT_DELETED; mqtt_outbox_pool_delete_reason() tells them from
+ * expiries.
+ */
+
+#ifndef MQTT_OUTBOX_POOL_H
+#define MQTT_OUTBOX_POOL_H
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Outbox lane of a PUBLISH, in sending order
+ */
+typedef enum {
+    MQTT_OUTBOX_LANE_CRITICAL,  // Alarms: first out, longest expiry
+    MQTT_OUTBOX_LANE_NORMAL,    // Everything not marked otherwise
+    MQTT_OUTBOX_LANE_BULK,      // Backlog and batched telemetry
+    MQTT_OUTBOX_LANES,
+} mqtt_outbox_lane_t;
+
+/**
+ * @brief Round-trip estimate of the current connection
+ */
+typedef struct {
+    uint32_t srtt_ms;           // Smoothed PUBLISH to PUBACK/PUBREC time, 0 before the first sample
+    uint32_t rttvar_ms;         // Its mean deviation
+    uint32_t rto_ms;            // Retransmission timeout, backoff included
+    uint32_t samples;           // Round trips measured on this connection
+    uint32_t retransmits;       // Messages sent again, since boot
+} mqtt_outbox_rtt_t;
+
+/**
+ * @brief Why the outbox gave up a message reported as MQTT_EVENT_DELETED
+ */
+typedef enum {
+    MQTT_OUTBOX_DELETED_EXPIRED,    // Its lane's expiry passed
+    MQTT_OUTBOX_DELETED_EVICTED,    // Made room while the heap was low
+} mqtt_outbox_delete_reason_t;
+
+/**
+ * @brief Memory pressure counters, since boot
+ */
+typedef struct {
+    uint32_t evicted;           // Messages dropped to keep the heap reserve
+    uint32_t spilled;           // Of those, handed to the spill callback
+    uint32_t refused;           // Messages not stored, nothing being left to evict
+} mqtt_outbox_pressure_t;
+
+/**
+ * @brief Takes an evicted PUBLISH, called with the client's lock held
+ *
+ * @param topic Topic, not NUL-terminated
+ * @param topic_len Its length
+ * @param data Payload
+ * @param len Its length
+ * @param qos QoS it was published with
+ * @return ESP_OK if the message was kept
+ */
+typedef esp_err_t (*mqtt_outbox_spill_cb_t)(const char *topic, size_t topic_len,
+                                            const char *data, size_t len, int qos);
+
+#if CONFIG_MQTT_CUSTOM_OUTBOX
+
+/**
+ * @brief Start a new estimate and resend everything unanswered
+ *
+ * Call on MQTT_EVENT_CONNECTED, from the MQTT task.
+ */
+void mqtt_outbox_pool_connected(void);
+
+/**
+ * @brief Snapshot of the round-trip estimate
+ */
+void mqtt_outbox_pool_get_rtt(mqtt_outbox_rtt_t *rtt);
+
+/**
+ * @brief Lane of the next PUBLISH put into the outbox
+ *
+ * Kept for the calling task and consumed by the next PUBLISH that task
+ * enqueues, after which its lane is normal again. Other tasks publishing
+ * in between do not see it.
+ */
+void mqtt_outbox_pool_set_lane(mqtt_outbox_lane_t lane);
+
+/**
+ * @brief Whether the next PUBLISH put into the outbox is a copy of a spooled record
+ *
+ * Such a message is not spilled when evicted: the spool still has it.
+ * Kept per task and consumed by the enqueue like the lane.
+ */
+void mqtt_outbox_pool_set_spooled(bool spooled);
+
+/**
+ * @brief Set where evicted messages go (NULL: they are dropped)
+ */
+void mqtt_outbox_pool_set_spill_cb(mqtt_outbox_spill_cb_t cb);
+
+/**
+ * @brief Reason for the MQTT_EVENT_DELETED of msg_id
+ *
+ * Call once per event, from the event handler: the evicted ids are kept
+ * until asked for, as many as the client's event queue holds.
+ */
+mqtt_outbox_delete_reason_t mqtt_outbox_pool_delete_reason(int msg_id);
+
+/**
+ * @brief Snapshot of the memory pressure counters
+ */
+void mqtt_outbox_pool_get_pressure(mqtt_outbox_pressure_t *pressure);
+
+#else
+
+static inline void mqtt_outbox_pool_connected(void) {}
+static inline void mqtt_outbox_pool_get_rtt(mqtt_outbox_rtt_t *rtt) { *rtt = (mqtt_outbox_rtt_t){0}; }
+static inline void mqtt_outbox_pool_set_lane(mqtt_outbox_lane_t lane) {}
+static inline void mqtt_outbox_pool_set_spooled(bool spooled) {}
+static inline void mqtt_outbox_pool_set_spill_cb(mqtt_outbox_spill_cb_t cb) {}
+static inline mqtt_outbox_delete_reason_t mqtt_outbox_pool_delete_reason(int msg_id) { return MQTT_OUTBOX_DELETED_EXPIRED; }
+static inline void mqtt_outbox_pool_get_pressure(mqtt_outbox_pressure_t *pressure) { *pressure = (mqtt_outbox_pressure_t){0}; }
+
+#endif // CONFIG_MQTT_CUSTOM_OUTBOX
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_OUTBOX_POOL_H
@@ -0,0 +1,199 @@
+/* MQTT Latency Probe Implementation
+ *
+ * The payload is the 32-bit sequence number of the probe, which only
+ * this device reads, so no clock leaves it. One probe is outstanding at a
+ * time: a returning sequence number other than the awaited one is late
+ * and ignored. The send time is taken before the publish call, as the
+ * message can come back before the call returns.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "mqtt_probe.h"
+
+#if CONFIG_APP_MQTT_PROBE
+
+#include "mqtt_handler.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "mqtt_probe";
+
+#define TOPIC_MAX   80
+
+enum { HIST_SEND, HIST_RTT, HISTS };
+
+typedef struct {
+    uint32_t count;
+    uint32_t max;
+    uint32_t bucket[MQTT_PROBE_BUCKETS];
+} hist_t;
+
+static const char *const s_hist_names[HISTS] = { "send", "rtt" };
+
+static hist_t s_hist[HISTS];
+static uint32_t s_sent = 0;
+static uint32_t s_returned = 0;
+static uint32_t s_lost = 0;
+static uint32_t s_last_rtt_us = 0;
+static uint32_t s_awaited = 0;      // Sequence number in flight, 0 if none
+static int64_t s_sent_us = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t s_task = NULL;
+static char s_topic[TOPIC_MAX];
+
+/**
+ * @brief Add a sample, lock held
+ */
+static void record(int hist, int64_t us)
+{
+    uint32_t v = us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    int b = 31 - __builtin_clz(v | 1);
+    hist_t *h = &s_hist[hist];
+    h->count++;
+    h->bucket[b < MQTT_PROBE_BUCKETS ? b : MQTT_PROBE_BUCKETS - 1]++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static esp_err_t probe_message(const mqtt_handler_msg_t *msg, void *ctx)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t seq;
+    if (msg->offset != 0 || msg->len != sizeof(seq)) {
+        return ESP_OK;
+    }
+    memcpy(&seq, msg->data, sizeof(seq));
+
+    portENTER_CRITICAL(&s_lock);
+    if (seq != 0 && seq == s_awaited) {
+        s_awaited = 0;
+        s_returned++;
+        s_last_rtt_us = (uint32_t)(now - s_sent_us);
+        record(HIST_RTT, now - s_sent_us);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+static void probe_task(void *arg)
+{
+    uint32_t seq = 0;
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_APP_MQTT_PROBE_PERIOD_S * 1000));
+        if (!mqtt_handler_is_connected()) {
+            continue;
+        }
+
+        seq = seq == UINT32_MAX ? 1 : seq + 1;
+        portENTER_CRITICAL(&s_lock);
+        if (s_awaited != 0) {
+            s_lost++;
+        }
+        s_awaited = seq;
+        s_sent++;
+        s_sent_us = esp_timer_get_time();
+        int64_t start_us = s_sent_us;
+        portEXIT_CRITICAL(&s_lock);
+
+        esp_err_t err = mqtt_handler_publish(s_topic, (const char *)&seq, sizeof(seq), 0);
+        int64_t send_us = esp_timer_get_time() - start_us;
+
+        portENTER_CRITICAL(&s_lock);
+        if (err == ESP_OK) {
+            record(HIST_SEND, send_us);
+        } else {
+            s_sent--;
+            if (s_awaited == seq) {
+                s_awaited = 0;
+            }
+        }
+        portEXIT_CRITICAL(&s_lock);
+    }
+}
+
+esp_err_t mqtt_probe_start(const char *device_id)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    int n = snprintf(s_topic, sizeof(s_topic), "probe/%s", device_id);
+    if (n < 0 || (size_t)n >= sizeof(s_topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = mqtt_handler_subscribe(s_topic, 0, probe_message, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (xTaskCreate(probe_task, "mqtt_probe", 3072, NULL, tskIDLE_PRIORITY + 2, &s_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Probing %s every %d s", s_topic, CONFIG_APP_MQTT_PROBE_PERIOD_S);
+    return ESP_OK;
+}
+
+size_t mqtt_probe_to_json(char *buf, size_t size)
+{
+    size_t pos = 0;
+    int n;
+
+#define APPEND(...) do { \
+        n = snprintf(buf + pos, size - pos, __VA_ARGS__); \
+        if (n < 0 || (size_t)n >= size - pos) return 0; \
+        pos += n; \
+    } while (0)
+
+    hist_t hist[HISTS];
+    portENTER_CRITICAL(&s_lock);
+    memcpy(hist, s_hist, sizeof(hist));
+    uint32_t sent = s_sent;
+    uint32_t returned = s_returned;
+    uint32_t lost = s_lost;
+    uint32_t last_us = s_last_rtt_us;
+    portEXIT_CRITICAL(&s_lock);
+
+    APPEND(",\"probe\":{\"sent\":%lu,\"returned\":%lu,\"lost\":%lu,\"last_us\":%lu",
+           (unsigned long)sent, (unsigned long)returned, (unsigned long)lost, (unsigned long)last_us);
+    for (int i = 0; i < HISTS; i++) {
+        const hist_t *h = &hist[i];
+        // Buckets from the lowest to the highest non-empty one, "lo" being the first
+        int lo = 0;
+        int hi = MQTT_PROBE_BUCKETS - 1;
+        while (lo < hi && h->bucket[lo] == 0) {
+            lo++;
+        }
+        while (hi > lo && h->bucket[hi] == 0) {
+            hi--;
+        }
+        APPEND(",\"%s\":{\"n\":%lu,\"max\":%lu,\"lo\":%d,\"h\":[", s_hist_names[i],
+               (unsigned long)h->count, (unsigned long)h->max, lo);
+        for (int b = lo; b <= hi; b++) {
+            APPEND("%s%lu", b > lo ? "," : "", (unsigned long)h->bucket[b]);
+        }
+        APPEND("]}");
+    }
+    APPEND("}");
+
+#undef APPEND
+    return pos;
+}
+
+void mqtt_probe_to_cbor(cbor_writer_t *w)
+{
+    portENTER_CRITICAL(&s_lock);
+    uint32_t v[6] = {
+        s_sent, s_returned, s_lost, s_last_rtt_us, s_hist[HIST_RTT].max, s_hist[HIST_SEND].max,
+    };
+    portEXIT_CRITICAL(&s_lock);
+
+    cbor_put_array(w, 6);
+    for (int i = 0; i < 6; i++) {
+        cbor_put_uint(w, v[i]);
+    }
+}
+
+#endif // CONFIG_APP_MQTT_PROBE
@@ -0,0 +1,69 @@
+/* MQTT Latency Probe Header
+ *
+ * Measures device to broker to device latency in the field. Every
+ * CONFIG_APP_MQTT_PROBE_PERIOD_S the probe task publishes a sequence
+ * number at QoS 0 on probe/<device_id>, to which the device itself is
+ * subscribed, and times the message until it comes back. Two log2
+ * histograms of microseconds are kept:
+ *
+ *   send   the publish call: waiting for the client's API lock and the
+ *          TLS write into the socket, all on the device
+ *   rtt    publish call to the message arriving in the MQTT task
+ *
+ * rtt - send is the Wi-Fi and the broker. Set against the PUBACK round
+ * trip (srtt_ms in the MQTT stats), which includes no routing back out, a
+ * slow rtt with a fast PUBACK points at the broker's delivery. A probe
+ * that has not returned when the next one is sent counts as lost.
+ *
+ * Bucket b counts samples of 2^b to 2^(b+1) - 1 us. Reported under
+ * "probe" in GET /metrics and "pr" in the CBOR metrics. The broker must
+ * let the device subscribe to its own probe topic. Built only with
+ * CONFIG_APP_MQTT_PROBE.
+ */
+
+#ifndef MQTT_PROBE_H
+#define MQTT_PROBE_H
+
+#include "cbor_writer.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_PROBE_BUCKETS 24
+
+#if CONFIG_APP_MQTT_PROBE
+
+/**
+ * @brief Subscribe to probe/<device_id> and start the probe task
+ *
+ * Call once MQTT is up; repeated calls are no-ops.
+ *
+ * @param device_id Device ID for the topic
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for an ID too long, ESP_ERR_NO_MEM,
+ *         or a subscription error
+ */
+esp_err_t mqtt_probe_start(const char *device_id);
+
+/**
+ * @brief Append the counters and histograms as a JSON member (,"probe":{...}) to buf
+ *
+ * @return Length written (excluding NUL), or 0 if buf was too small
+ */
+size_t mqtt_probe_to_json(char *buf, size_t size);
+
+/**
+ * @brief Encode [sent, returned, lost, last rtt, max rtt, max send] (us) as a CBOR array
+ */
+void mqtt_probe_to_cbor(cbor_writer_t *w);
+
+#endif // CONFIG_APP_MQTT_PROBE
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_PROBE_H
@@ -0,0 +1,284 @@
+/* MQTT RPC Implementation
+ *
+ * Slots move between two queues of indices: the MQTT task takes a free
+ * one, fills it and hands it to the RPC task, which answers and returns
+ * it. The response buffer belongs to the RPC task alone. Answers are
+ * never published from the MQTT task: the client's API lock is held
+ * while it dispatches events, and the publish mutex may be held by a
+ * publisher waiting for that lock.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "mqtt_rpc.h"
+#include "sdkconfig.h"
+
+#if CONFIG_MQTT_RPC
+
+#include "mqtt_handler.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *TAG = "mqtt_rpc";
+
+#define TOPIC_MAX           80
+#define RESPONSE_TOPIC_MAX  128     // Including the terminator
+#define CORRELATION_MAX     64
+#define SLOTS               CONFIG_MQTT_RPC_QUEUE_LEN
+#define REQUEST_SIZE        CONFIG_MQTT_RPC_REQUEST_SIZE
+#define RESPONSE_SIZE       CONFIG_MQTT_RPC_RESPONSE_SIZE
+#define REBOOT_DELAY_MS     200     // Lets the answer leave the socket
+
+#define RESULT_HEAD         "{\"ok\":true,\"result\":"
+#define RESULT_TAIL         "}"
+
+typedef struct {
+    char name[MQTT_RPC_METHOD_LEN];
+    mqtt_rpc_method_t fn;
+    void *ctx;
+} rpc_method_t;
+
+typedef struct {
+    esp_err_t err;                  // Answered without running the method unless ESP_OK
+    uint8_t method;
+    uint8_t correlation_len;
+    uint16_t params_len;
+    char response_topic[RESPONSE_TOPIC_MAX];    // Empty: not answered
+    char correlation[CORRELATION_MAX];
+    char params[REQUEST_SIZE];
+} rpc_request_t;
+
+static rpc_method_t s_methods[MQTT_RPC_METHODS_MAX];
+static int s_method_count = 0;
+
+static rpc_request_t s_slots[SLOTS];
+static QueueHandle_t s_free = NULL;
+static QueueHandle_t s_ready = NULL;
+static TaskHandle_t s_task = NULL;
+static char s_response[RESPONSE_SIZE];
+static size_t s_prefix_len = 0;
+static uint32_t s_dropped = 0;
+static bool s_reboot = false;
+
+_Static_assert(SLOTS <= UINT8_MAX, "slot indices are bytes");
+_Static_assert(MQTT_RPC_METHODS_MAX <= UINT8_MAX, "method indices are bytes");
+_Static_assert(REQUEST_SIZE <= UINT16_MAX, "request lengths are 16-bit");
+
+static int method_find(const char *name)
+{
+    for (int i = 0; i < s_method_count; i++) {
+        if (strcmp(s_methods[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static esp_err_t rpc_message(const mqtt_handler_msg_t *msg, void *ctx)
+{
+    if (msg->offset != 0) {
+        return ESP_FAIL;            // Rest of an oversized request, already answered
+    }
+    if (msg->response_topic_len >= RESPONSE_TOPIC_MAX || msg->correlation_len > CORRELATION_MAX) {
+        ESP_LOGW(TAG, "Request on %s ignored: response topic or correlation data too long", msg->topic);
+        return ESP_FAIL;
+    }
+
+    uint8_t i;
+    if (xQueueReceive(s_free, &i, 0) != pdTRUE) {
+        s_dropped++;
+        ESP_LOGW(TAG, "Request on %s dropped: %d already queued (%lu dropped)",
+                 msg->topic, SLOTS, (unsigned long)s_dropped);
+        return ESP_FAIL;
+    }
+
+    rpc_request_t *req = &s_slots[i];
+    req->err = ESP_OK;
+    int method = method_find(msg->topic + s_prefix_len);
+    if (method < 0) {
+        req->err = ESP_ERR_NOT_FOUND;
+    } else if (msg->len != msg->total_len || msg->total_len > REQUEST_SIZE) {
+        req->err = ESP_ERR_INVALID_SIZE;
+    }
+    req->method = method < 0 ? 0 : (uint8_t)method;
+    req->params_len = req->err == ESP_OK ? (uint16_t)msg->len : 0;
+    memcpy(req->params, msg->data, req->params_len);
+    req->response_topic[0] = '\0';
+    if (msg->response_topic != NULL) {
+        memcpy(req->response_topic, msg->response_topic, msg->response_topic_len);
+        req->response_topic[msg->response_topic_len] = '\0';
+    }
+    req->correlation_len = msg->correlation != NULL ? (uint8_t)msg->correlation_len : 0;
+    memcpy(req->correlation, msg->correlation, req->correlation_len);
+
+    xQueueSend(s_ready, &i, 0);
+    // Fragments of an oversized request are not wanted
+    return msg->len == msg->total_len ? ESP_OK : ESP_FAIL;
+}
+
+static void answer(const rpc_request_t *req, esp_err_t err, size_t result_len)
+{
+    int len;
+    if (err == ESP_OK) {
+        const size_t head = sizeof(RESULT_HEAD) - 1;
+        if (result_len == 0) {
+            memcpy(s_response + head, "null", 4);
+            result_len = 4;
+        }
+        memcpy(s_response, RESULT_HEAD, head);
+        memcpy(s_response + head + result_len, RESULT_TAIL, sizeof(RESULT_TAIL) - 1);
+        len = (int)(head + result_len + sizeof(RESULT_TAIL) - 1);
+    } else {
+        len = snprintf(s_response, sizeof(s_response), "{\"ok\":false,\"error\":\"%s\"}", esp_err_to_name(err));
+    }
+
+    err = mqtt_handler_publish_response(req->response_topic, s_response, len, 0,
+                                        req->correlation_len > 0 ? req->correlation : NULL,
+                                        req->correlation_len);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Answer to %s not sent: %s", req->response_topic, esp_err_to_name(err));
+    }
+}
+
+static void rpc_task(void *arg)
+{
+    const size_t capacity = RESPONSE_SIZE - (sizeof(RESULT_HEAD) - 1) - (sizeof(RESULT_TAIL) - 1);
+    while (1) {
+        uint8_t i;
+        xQueueReceive(s_ready, &i, portMAX_DELAY);
+        const rpc_request_t *req = &s_slots[i];
+
+        esp_err_t err = req->err;
+        size_t len = 0;
+        if (err == ESP_OK) {
+            const rpc_method_t *m = &s_methods[req->method];
+            err = m->fn(req->params, req->params_len, s_response + sizeof(RESULT_HEAD) - 1,
+                        capacity, &len, m->ctx);
+            if (err == ESP_OK && len > capacity) {
+                err = ESP_ERR_INVALID_SIZE;
+            }
+        }
+        if (req->response_topic[0] != '\0') {
+            answer(req, err, len);
+        }
+        xQueueSend(s_free, &i, 0);
+
+        if (s_reboot) {
+            vTaskDelay(pdMS_TO_TICKS(REBOOT_DELAY_MS));
+            esp_restart();
+        }
+    }
+}
+
+static esp_err_t method_stats(const char *params, size_t params_len,
+                              char *result, size_t size, size_t *len, void *ctx)
+{
+    mqtt_handler_stats_t stats;
+    mqtt_handler_get_stats(&stats);
+    int n = snprintf(result, size,
+                     "{\"uptime_s\":%lld,\"heap_free\":%u,\"heap_min\":%u,\"connects\":%lu,"
+                     "\"published\":%lu,\"publish_failed\":%lu,\"dropped\":%lu,\"inflight\":%lu,"
+                     "\"srtt_ms\":%lu,\"rpc_dropped\":%lu}",
+                     (long long)(esp_timer_get_time() / 1000000),
+                     (unsigned)esp_get_free_heap_size(), (unsigned)esp_get_minimum_free_heap_size(),
+                     (unsigned long)stats.connects, (unsigned long)stats.published,
+                     (unsigned long)stats.publish_failed, (unsigned long)stats.dropped,
+                     (unsigned long)stats.inflight, (unsigned long)stats.srtt_ms,
+                     (unsigned long)s_dropped);
+    if (n < 0 || (size_t)n >= size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *len = n;
+    return ESP_OK;
+}
+
+static esp_err_t method_reboot(const char *params, size_t params_len,
+                               char *result, size_t size, size_t *len, void *ctx)
+{
+    ESP_LOGW(TAG, "Reboot requested");
+    s_reboot = true;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_rpc_register(const char *name, mqtt_rpc_method_t fn, void *ctx)
+{
+    if (s_task != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (name == NULL || fn == NULL || strlen(name) >= MQTT_RPC_METHOD_LEN || strchr(name, '/') != NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    int i = method_find(name);
+    if (i < 0) {
+        if (s_method_count == MQTT_RPC_METHODS_MAX) {
+            return ESP_ERR_NO_MEM;
+        }
+        i = s_method_count++;
+        strcpy(s_methods[i].name, name);
+    }
+    s_methods[i].fn = fn;
+    s_methods[i].ctx = ctx;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_rpc_start(const char *device_id)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    char topic[TOPIC_MAX];
+    int n = snprintf(topic, sizeof(topic), "rpc/%s/+", device_id);
+    if (n < 0 || (size_t)n >= sizeof(topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_prefix_len = n - 1;
+
+    if (method_find("stats") < 0) {
+        mqtt_rpc_register("stats", method_stats, NULL);
+    }
+    if (method_find("reboot") < 0) {
+        mqtt_rpc_register("reboot", method_reboot, NULL);
+    }
+
+    if (s_free == NULL) {
+        s_free = xQueueCreate(SLOTS, sizeof(uint8_t));
+        s_ready = xQueueCreate(SLOTS, sizeof(uint8_t));
+        if (s_free == NULL || s_ready == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        for (uint8_t i = 0; i < SLOTS; i++) {
+            xQueueSend(s_free, &i, 0);
+        }
+    }
+    // Requests arriving before the task exists wait in the ready queue
+    esp_err_t err = mqtt_handler_subscribe(topic, 1, rpc_message, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+    // Above the MQTT task, so a request is taken up as soon as it is queued
+    if (xTaskCreate(rpc_task, "mqtt_rpc", CONFIG_MQTT_RPC_TASK_STACK, NULL,
+                    tskIDLE_PRIORITY + 6, &s_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "%d methods on %s", s_method_count, topic);
+    return ESP_OK;
+}
+
+#else
+
+esp_err_t mqtt_rpc_register(const char *name, mqtt_rpc_method_t fn, void *ctx)
+{
+    return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t mqtt_rpc_start(const char *device_id)
+{
+    return ESP_OK;
+}
+
+#endif // CONFIG_MQTT_RPC
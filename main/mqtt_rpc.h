@@ -0,0 +1,83 @@
+/* MQTT RPC Header
+ *
+ * Request/response commands on MQTT 5. A request is published on
+ * rpc/<device_id>/<method> with a Response Topic and, optionally,
+ * Correlation Data; its payload holds the parameters of the method. The
+ * answer goes to the response topic at QoS 0, carrying the same
+ * correlation data:
+ *
+ *   {"ok":true,"result":<JSON written by the method>}
+ *   {"ok":false,"error":"<esp_err_t name>"}
+ *
+ * A request without a response topic is executed but not answered.
+ *
+ * Methods run in arrival order on one worker task, never on the MQTT
+ * task, so a slow method does not hold up the connection. Requests are
+ * copied into CONFIG_MQTT_RPC_QUEUE_LEN preallocated slots and answers
+ * are built in one static buffer: a call allocates nothing. A request
+ * that finds every slot taken is dropped unanswered and the caller's
+ * timeout applies.
+ *
+ * Built in are "stats" (connection counters and free heap) and "reboot"
+ * (answers, then restarts). Built only with CONFIG_MQTT_RPC, which needs
+ * CONFIG_MQTT_HANDLER_PROTOCOL_5.
+ */
+
+#ifndef MQTT_RPC_H
+#define MQTT_RPC_H
+
+#include "esp_err.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_RPC_METHODS_MAX    16
+#define MQTT_RPC_METHOD_LEN     24      // Including the terminator
+
+/**
+ * @brief Runs one request, called from the RPC task
+ *
+ * @param params Request payload, not NUL-terminated
+ * @param params_len Its length
+ * @param result Buffer for the JSON value of the answer
+ * @param size Its capacity
+ * @param len Bytes written to result; 0 answers null
+ * @param ctx Passed to mqtt_rpc_register()
+ * @return ESP_OK to answer with the result, an error to answer with its name
+ */
+typedef esp_err_t (*mqtt_rpc_method_t)(const char *params, size_t params_len,
+                                       char *result, size_t size, size_t *len, void *ctx);
+
+/**
+ * @brief Add a method to the table
+ *
+ * Register every method before mqtt_rpc_start(); the table is read
+ * without a lock afterwards.
+ *
+ * @param name Last topic level of its requests
+ * @param fn Method
+ * @param ctx Passed to fn
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for a name too long or with a '/',
+ *         ESP_ERR_NO_MEM if the table is full, ESP_ERR_INVALID_STATE once
+ *         started or without CONFIG_MQTT_RPC
+ */
+esp_err_t mqtt_rpc_register(const char *name, mqtt_rpc_method_t fn, void *ctx);
+
+/**
+ * @brief Create the RPC task and subscribe to rpc/<device_id>/+
+ *
+ * Call once MQTT is up; repeated calls are no-ops.
+ *
+ * @param device_id Device ID for the topics
+ * @return ESP_OK (also without CONFIG_MQTT_RPC), ESP_ERR_INVALID_ARG for
+ *         an ID too long, ESP_ERR_NO_MEM, or a subscription error
+ */
+esp_err_t mqtt_rpc_start(const char *device_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_RPC_H
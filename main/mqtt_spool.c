@@ -0,0 +1,515 @@
+/* MQTT Spool Implementation
+ *
+ * An append-only log on a dedicated data partition, split into segments of
+ * one flash sector. Segments are written round-robin, so erases are spread
+ * evenly over the partition. Each segment starts with a header carrying a
+ * sequence number; the highest one is the segment being written.
+ *
+ * Record layout (4-byte aligned):
+ *   u16 len | u8 topic_len | u8 qos | u32 crc32 | u32 state | topic | payload
+ * len is 0xFFFF in erased flash, which marks the end of a segment's data.
+ * state is programmed from 0xFFFFFFFF to 0 when the record is consumed,
+ * which needs no erase.
+ *
+ * Appends collect in a RAM buffer and reach flash in one write (batched
+ * commit). Segments whose records are all consumed are erased by the
+ * spool timer, one per tick, ahead of the writer (compaction). If the
+ * writer catches up with unconsumed data, the oldest segment is dropped.
+ */
+
+#include <string.h>
+#include "mqtt_spool.h"
+
+#if CONFIG_MQTT_SPOOL_ENABLE
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "mqtt_spool";
+
+#define SPOOL_SEGMENT_SIZE  4096
+#define SPOOL_SEG_HDR_SIZE  16
+#define SPOOL_MAGIC         0x4C4F5053      // "SPOL"
+#define SPOOL_LEN_ERASED    0xFFFF
+#define SPOOL_STATE_PENDING 0xFFFFFFFF
+#define SPOOL_STATE_DONE    0
+
+#define REC_SIZE(body_len)  ((MQTT_SPOOL_HDR_SIZE + (body_len) + 3) & ~3u)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t reserved[2];
+} spool_seg_hdr_t;
+
+typedef struct {
+    uint16_t len;                   // topic + payload bytes
+    uint8_t topic_len;
+    uint8_t qos;
+    uint32_t crc;                   // Over len..qos and the body
+    uint32_t state;
+} spool_rec_hdr_t;
+
+_Static_assert(sizeof(spool_rec_hdr_t) == MQTT_SPOOL_HDR_SIZE, "record header size");
+
+typedef struct {
+    uint32_t seg;
+    uint32_t off;
+} spool_pos_t;
+
+static const esp_partition_t *s_part = NULL;
+static uint32_t s_seg_count = 0;
+static uint32_t s_seq = 0;                  // Sequence number of the write segment
+static uint32_t s_oldest = 0;               // Oldest segment still holding data
+static spool_pos_t s_write;                 // End of committed data
+static spool_pos_t s_read;                  // Oldest pending record
+static spool_pos_t s_send;                  // Next record to hand out
+static uint32_t s_peeked_size = 0;          // Size of the record returned by peek
+static SemaphoreHandle_t s_mutex = NULL;
+static esp_timer_handle_t s_timer = NULL;
+static mqtt_spool_backlog_cb_t s_on_backlog = NULL;
+static mqtt_spool_stats_t s_stats = {0};
+
+// Batched commit: records for s_write, written to flash together
+static uint8_t s_wbuf[CONFIG_MQTT_SPOOL_COMMIT_SIZE];
+static uint32_t s_wbuf_len = 0;
+static int64_t s_wbuf_since_us = 0;
+
+static uint32_t pos_addr(spool_pos_t pos)
+{
+    return pos.seg * SPOOL_SEGMENT_SIZE + pos.off;
+}
+
+static uint32_t rec_crc(const spool_rec_hdr_t *hdr, const uint8_t *body)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)hdr, 4);
+    return esp_rom_crc32_le(crc, body, hdr->len);
+}
+
+static esp_err_t read_hdr(spool_pos_t pos, spool_rec_hdr_t *hdr)
+{
+    if (pos.off + MQTT_SPOOL_HDR_SIZE > SPOOL_SEGMENT_SIZE) {
+        hdr->len = SPOOL_LEN_ERASED;
+        return ESP_OK;
+    }
+    return esp_partition_read(s_part, pos_addr(pos), hdr, sizeof(*hdr));
+}
+
+/**
+ * @brief Move pos to the next record that exists in flash
+ *
+ * Skips consumed records when skip_done is set. Returns false when pos
+ * reached the end of committed data.
+ */
+static bool pos_settle(spool_pos_t *pos, spool_rec_hdr_t *hdr, bool skip_done)
+{
+    while (1) {
+        if (pos->seg == s_write.seg && pos->off >= s_write.off) {
+            return false;
+        }
+        if (read_hdr(*pos, hdr) != ESP_OK || hdr->len == SPOOL_LEN_ERASED ||
+            pos->off + REC_SIZE(hdr->len) > SPOOL_SEGMENT_SIZE) {
+            if (pos->seg == s_write.seg) {
+                return false;
+            }
+            pos->seg = (pos->seg + 1) % s_seg_count;
+            pos->off = SPOOL_SEG_HDR_SIZE;
+            continue;
+        }
+        if (skip_done && hdr->state == SPOOL_STATE_DONE) {
+            pos->off += REC_SIZE(hdr->len);
+            continue;
+        }
+        return true;
+    }
+}
+
+static esp_err_t commit_locked(void)
+{
+    if (s_wbuf_len == 0) {
+        return ESP_OK;
+    }
+    esp_err_t err = esp_partition_write(s_part, pos_addr(s_write), s_wbuf, s_wbuf_len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Commit of %lu bytes failed: %s", (unsigned long)s_wbuf_len, esp_err_to_name(err));
+    }
+    // On failure the area is left partly written; moving on keeps later records readable
+    s_write.off += s_wbuf_len;
+    s_wbuf_len = 0;
+    return err;
+}
+
+/**
+ * @brief Count the pending records of a segment about to be overwritten
+ */
+static uint32_t segment_pending(uint32_t seg)
+{
+    uint32_t pending = 0;
+    spool_rec_hdr_t hdr;
+    spool_pos_t pos = { .seg = seg, .off = SPOOL_SEG_HDR_SIZE };
+    while (read_hdr(pos, &hdr) == ESP_OK && hdr.len != SPOOL_LEN_ERASED &&
+           pos.off + REC_SIZE(hdr.len) <= SPOOL_SEGMENT_SIZE) {
+        if (hdr.state == SPOOL_STATE_PENDING) {
+            pending++;
+        }
+        pos.off += REC_SIZE(hdr.len);
+    }
+    return pending;
+}
+
+static esp_err_t segment_format(uint32_t seg, uint32_t seq)
+{
+    esp_err_t err = esp_partition_erase_range(s_part, seg * SPOOL_SEGMENT_SIZE, SPOOL_SEGMENT_SIZE);
+    if (err != ESP_OK) {
+        return err;
+    }
+    spool_seg_hdr_t hdr = {
+        .magic = SPOOL_MAGIC,
+        .seq = seq,
+        .reserved = { 0xFFFFFFFF, 0xFFFFFFFF },
+    };
+    return esp_partition_write(s_part, seg * SPOOL_SEGMENT_SIZE, &hdr, sizeof(hdr));
+}
+
+/**
+ * @brief Start writing the next segment, dropping its data if still pending
+ */
+static esp_err_t open_next_segment(void)
+{
+    uint32_t next = (s_write.seg + 1) % s_seg_count;
+
+    if (next == s_oldest) {
+        if (s_read.seg == next) {
+            uint32_t lost = segment_pending(next);
+            s_stats.dropped += lost;
+            s_stats.pending -= lost;
+            ESP_LOGW(TAG, "Spool full, dropped %lu oldest records", (unsigned long)lost);
+            s_read.seg = (next + 1) % s_seg_count;
+            s_read.off = SPOOL_SEG_HDR_SIZE;
+        }
+        if (s_send.seg == next) {
+            s_send = s_read;
+        }
+        s_oldest = (next + 1) % s_seg_count;
+    }
+
+    esp_err_t err = segment_format(next, s_seq + 1);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot format segment %lu: %s", (unsigned long)next, esp_err_to_name(err));
+        return err;
+    }
+    s_seq++;
+    s_write.seg = next;
+    s_write.off = SPOOL_SEG_HDR_SIZE;
+    return ESP_OK;
+}
+
+/**
+ * @brief Erase the oldest segment if all of its records were consumed
+ */
+static void compact_locked(void)
+{
+    if (s_oldest == s_read.seg || s_oldest == s_write.seg) {
+        return;
+    }
+    esp_err_t err = esp_partition_erase_range(s_part, s_oldest * SPOOL_SEGMENT_SIZE, SPOOL_SEGMENT_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Erase of segment %lu failed: %s", (unsigned long)s_oldest, esp_err_to_name(err));
+        return;
+    }
+    s_oldest = (s_oldest + 1) % s_seg_count;
+}
+
+static void spool_timer_cb(void *arg)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    if (s_wbuf_len > 0 && esp_timer_get_time() - s_wbuf_since_us >= (int64_t)CONFIG_MQTT_SPOOL_COMMIT_MS * 1000) {
+        commit_locked();
+    }
+    compact_locked();
+    bool backlog = s_stats.pending > 0;
+    xSemaphoreGive(s_mutex);
+
+    if (backlog && s_on_backlog != NULL) {
+        s_on_backlog();
+    }
+}
+
+/**
+ * @brief Rebuild the cursors from flash after boot
+ */
+static void recover(void)
+{
+    spool_seg_hdr_t seg_hdr;
+    bool found = false;
+
+    for (uint32_t seg = 0; seg < s_seg_count; seg++) {
+        if (esp_partition_read(s_part, seg * SPOOL_SEGMENT_SIZE, &seg_hdr, sizeof(seg_hdr)) == ESP_OK &&
+            seg_hdr.magic == SPOOL_MAGIC && (!found || seg_hdr.seq > s_seq)) {
+            s_seq = seg_hdr.seq;
+            s_write.seg = seg;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        ESP_LOGI(TAG, "Formatting empty spool");
+        if (segment_format(0, 1) != ESP_OK) {
+            s_part = NULL;
+            return;
+        }
+        s_seq = 1;
+        s_oldest = 0;
+        s_write.seg = 0;
+        s_write.off = SPOOL_SEG_HDR_SIZE;
+        s_read = s_send = s_write;
+        return;
+    }
+
+    // End of the write segment: first erased header or torn record
+    spool_rec_hdr_t hdr;
+    s_write.off = SPOOL_SEG_HDR_SIZE;
+    while (read_hdr(s_write, &hdr) == ESP_OK && hdr.len != SPOOL_LEN_ERASED) {
+        uint32_t size = REC_SIZE(hdr.len);
+        if (s_write.off + size > SPOOL_SEGMENT_SIZE || hdr.len > MQTT_SPOOL_RECORD_MAX ||
+            esp_partition_read(s_part, pos_addr(s_write) + MQTT_SPOOL_HDR_SIZE, s_wbuf, hdr.len) != ESP_OK ||
+            rec_crc(&hdr, s_wbuf) != hdr.crc) {
+            // Interrupted write: leave the rest of this segment alone
+            ESP_LOGW(TAG, "Torn record at 0x%lx, resuming in the next segment", (unsigned long)pos_addr(s_write));
+            s_write.off = SPOOL_SEGMENT_SIZE;
+            break;
+        }
+        s_write.off += size;
+    }
+
+    // Valid segments form a run ending at the write segment
+    s_oldest = s_write.seg;
+    for (uint32_t i = 1; i < s_seg_count; i++) {
+        uint32_t seg = (s_write.seg + i) % s_seg_count;
+        if (esp_partition_read(s_part, seg * SPOOL_SEGMENT_SIZE, &seg_hdr, sizeof(seg_hdr)) == ESP_OK &&
+            seg_hdr.magic == SPOOL_MAGIC) {
+            s_oldest = seg;
+            break;
+        }
+    }
+
+    s_read.seg = s_oldest;
+    s_read.off = SPOOL_SEG_HDR_SIZE;
+    pos_settle(&s_read, &hdr, true);
+    s_send = s_read;
+
+    spool_pos_t pos = s_read;
+    while (pos_settle(&pos, &hdr, true)) {
+        s_stats.pending++;
+        pos.off += REC_SIZE(hdr.len);
+    }
+    ESP_LOGI(TAG, "Spool mounted: %lu segments, %lu pending records",
+             (unsigned long)s_seg_count, (unsigned long)s_stats.pending);
+}
+
+esp_err_t mqtt_spool_init(mqtt_spool_backlog_cb_t on_backlog)
+{
+    if (s_part != NULL) {
+        return ESP_OK;
+    }
+
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                           CONFIG_MQTT_SPOOL_PARTITION);
+    if (part == NULL || part->size < 2 * SPOOL_SEGMENT_SIZE) {
+        ESP_LOGW(TAG, "No usable \"%s\" partition, offline messages stay in RAM", CONFIG_MQTT_SPOOL_PARTITION);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (s_mutex == NULL) {
+        s_mutex = xSemaphoreCreateMutex();
+        if (s_mutex == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    s_part = part;
+    s_seg_count = part->size / SPOOL_SEGMENT_SIZE;
+    recover();
+    xSemaphoreGive(s_mutex);
+    if (s_part == NULL) {
+        return ESP_FAIL;
+    }
+
+    s_on_backlog = on_backlog;
+    if (s_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = spool_timer_cb,
+            .name = "mqtt_spool",
+            .skip_unhandled_events = true,
+        };
+        if (esp_timer_create(&timer_args, &s_timer) == ESP_OK) {
+            esp_timer_start_periodic(s_timer, (uint64_t)CONFIG_MQTT_SPOOL_COMMIT_MS * 1000);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t mqtt_spool_append(const char *topic, const void *data, size_t len, int qos)
+{
+    size_t topic_len = strlen(topic);
+    if (s_part == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (topic_len >= MQTT_SPOOL_TOPIC_MAX || topic_len + len > MQTT_SPOOL_RECORD_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    spool_rec_hdr_t hdr = {
+        .len = topic_len + len,
+        .topic_len = topic_len,
+        .qos = qos,
+        .state = SPOOL_STATE_PENDING,
+    };
+    uint32_t size = REC_SIZE(hdr.len);
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+
+    if (s_wbuf_len + size > sizeof(s_wbuf)) {
+        commit_locked();
+    }
+    if (s_write.off + s_wbuf_len + size > SPOOL_SEGMENT_SIZE) {
+        commit_locked();
+        err = open_next_segment();
+        if (err != ESP_OK) {
+            goto cleanup;
+        }
+    }
+
+    uint8_t *rec = s_wbuf + s_wbuf_len;
+    memcpy(rec + MQTT_SPOOL_HDR_SIZE, topic, topic_len);
+    memcpy(rec + MQTT_SPOOL_HDR_SIZE + topic_len, data, len);
+    hdr.crc = rec_crc(&hdr, rec + MQTT_SPOOL_HDR_SIZE);
+    memcpy(rec, &hdr, sizeof(hdr));
+    memset(rec + MQTT_SPOOL_HDR_SIZE + hdr.len, 0xFF, size - MQTT_SPOOL_HDR_SIZE - hdr.len);
+
+    if (s_wbuf_len == 0) {
+        s_wbuf_since_us = esp_timer_get_time();
+    }
+    s_wbuf_len += size;
+    s_stats.pending++;
+
+cleanup:
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+esp_err_t mqtt_spool_commit(void)
+{
+    if (s_part == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    esp_err_t err = commit_locked();
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+esp_err_t mqtt_spool_peek(mqtt_spool_record_t *rec)
+{
+    if (s_part == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    spool_rec_hdr_t hdr;
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    while (1) {
+        if (!pos_settle(&s_send, &hdr, true)) {
+            if (s_wbuf_len == 0) {
+                break;
+            }
+            // Reader caught up with the RAM buffer
+            commit_locked();
+            continue;
+        }
+
+        uint32_t size = REC_SIZE(hdr.len);
+        if (hdr.len <= MQTT_SPOOL_RECORD_MAX && hdr.topic_len < MQTT_SPOOL_TOPIC_MAX && hdr.topic_len <= hdr.len &&
+            esp_partition_read(s_part, pos_addr(s_send) + MQTT_SPOOL_HDR_SIZE, rec->data, hdr.len) == ESP_OK &&
+            rec_crc(&hdr, rec->data) == hdr.crc) {
+            rec->addr = pos_addr(s_send);
+            rec->qos = hdr.qos;
+            memcpy(rec->topic, rec->data, hdr.topic_len);
+            rec->topic[hdr.topic_len] = '\0';
+            rec->len = hdr.len - hdr.topic_len;
+            memmove(rec->data, rec->data + hdr.topic_len, rec->len);
+            s_peeked_size = size;
+            err = ESP_OK;
+            break;
+        }
+
+        // Bad record: retire it so recovery does not trip over it again
+        ESP_LOGW(TAG, "Skipping corrupt record at 0x%lx", (unsigned long)pos_addr(s_send));
+        uint32_t done = SPOOL_STATE_DONE;
+        esp_partition_write(s_part, pos_addr(s_send) + offsetof(spool_rec_hdr_t, state), &done, sizeof(done));
+        s_stats.corrupt++;
+        s_stats.pending--;
+        s_send.off += size;
+        pos_settle(&s_read, &hdr, true);
+    }
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+void mqtt_spool_advance(void)
+{
+    if (s_part == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    s_send.off += s_peeked_size;
+    s_peeked_size = 0;
+    xSemaphoreGive(s_mutex);
+}
+
+void mqtt_spool_consume(uint32_t addr)
+{
+    if (s_part == NULL) {
+        return;
+    }
+
+    spool_rec_hdr_t hdr;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    if (pos_settle(&s_read, &hdr, true) && pos_addr(s_read) == addr) {
+        uint32_t done = SPOOL_STATE_DONE;
+        esp_partition_write(s_part, addr + offsetof(spool_rec_hdr_t, state), &done, sizeof(done));
+        s_stats.pending--;
+        s_read.off += REC_SIZE(hdr.len);
+        pos_settle(&s_read, &hdr, true);
+    }
+    xSemaphoreGive(s_mutex);
+}
+
+void mqtt_spool_rewind(void)
+{
+    if (s_part == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    s_send = s_read;
+    s_peeked_size = 0;
+    xSemaphoreGive(s_mutex);
+}
+
+uint32_t mqtt_spool_pending(void)
+{
+    return s_stats.pending;
+}
+
+void mqtt_spool_get_stats(mqtt_spool_stats_t *stats)
+{
+    *stats = s_stats;
+}
+
+#endif // CONFIG_MQTT_SPOOL_ENABLE
@@ -0,0 +1,137 @@
+/* MQTT Spool Header
+ *
+ * Flash-backed store for messages produced while the broker is
+ * unreachable. Survives Wi-Fi loss and resets; drained in order once the
+ * connection is back.
+ */
+
+#ifndef MQTT_SPOOL_H
+#define MQTT_SPOOL_H
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_SPOOL_TOPIC_MAX    72      // Including the terminator
+#define MQTT_SPOOL_HDR_SIZE     12
+#if CONFIG_MQTT_SPOOL_ENABLE
+#define MQTT_SPOOL_RECORD_MAX   (CONFIG_MQTT_SPOOL_COMMIT_SIZE - MQTT_SPOOL_HDR_SIZE)
+#else
+#define MQTT_SPOOL_RECORD_MAX   1
+#endif
+
+/**
+ * @brief A stored message, as returned by mqtt_spool_peek()
+ */
+typedef struct {
+    uint32_t addr;                      // Location in the partition, identifies the record
+    int qos;
+    size_t len;
+    char topic[MQTT_SPOOL_TOPIC_MAX];
+    uint8_t data[MQTT_SPOOL_RECORD_MAX];
+} mqtt_spool_record_t;
+
+/**
+ * @brief Spool counters
+ */
+typedef struct {
+    uint32_t pending;                   // Records not yet consumed (flash and RAM)
+    uint32_t dropped;                   // Records overwritten before they were sent
+    uint32_t corrupt;                   // Records skipped because of a bad CRC
+} mqtt_spool_stats_t;
+
+/**
+ * @brief Called from the spool timer while records are pending
+ */
+typedef void (*mqtt_spool_backlog_cb_t)(void);
+
+#if CONFIG_MQTT_SPOOL_ENABLE
+
+/**
+ * @brief Mount the spool partition and recover the log state
+ *
+ * Scans the segment headers and record states to find the write position
+ * and the oldest unconsumed record. Calling it again is a no-op.
+ *
+ * @param on_backlog Called periodically while records are pending (may be NULL)
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if the partition does not exist
+ */
+esp_err_t mqtt_spool_init(mqtt_spool_backlog_cb_t on_backlog);
+
+/**
+ * @brief Append a message
+ *
+ * The record goes to a RAM buffer that is written to flash when full,
+ * after CONFIG_MQTT_SPOOL_COMMIT_MS, or when the reader needs it. When
+ * the log is full the oldest segment is overwritten.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if the message cannot fit a record,
+ *         ESP_ERR_INVALID_STATE if the spool is not mounted
+ */
+esp_err_t mqtt_spool_append(const char *topic, const void *data, size_t len, int qos);
+
+/**
+ * @brief Write buffered records to flash now
+ */
+esp_err_t mqtt_spool_commit(void);
+
+/**
+ * @brief Read the next record that has not been handed out yet
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND when everything was handed out
+ */
+esp_err_t mqtt_spool_peek(mqtt_spool_record_t *rec);
+
+/**
+ * @brief Move past the record returned by the last mqtt_spool_peek()
+ */
+void mqtt_spool_advance(void);
+
+/**
+ * @brief Mark the oldest pending record as delivered
+ *
+ * Records are consumed in order; addr must be that of the oldest pending
+ * record, otherwise the call is ignored (the record was overwritten).
+ */
+void mqtt_spool_consume(uint32_t addr);
+
+/**
+ * @brief Hand out records again starting at the oldest pending one
+ */
+void mqtt_spool_rewind(void);
+
+/**
+ * @brief Number of records not yet consumed
+ */
+uint32_t mqtt_spool_pending(void);
+
+/**
+ * @brief Get spool counters
+ */
+void mqtt_spool_get_stats(mqtt_spool_stats_t *stats);
+
+#else
+
+static inline esp_err_t mqtt_spool_init(mqtt_spool_backlog_cb_t on_backlog) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t mqtt_spool_append(const char *topic, const void *data, size_t len, int qos) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t mqtt_spool_commit(void) { return ESP_OK; }
+static inline esp_err_t mqtt_spool_peek(mqtt_spool_record_t *rec) { return ESP_ERR_NOT_FOUND; }
+static inline void mqtt_spool_advance(void) {}
+static inline void mqtt_spool_consume(uint32_t addr) {}
+static inline void mqtt_spool_rewind(void) {}
+static inline uint32_t mqtt_spool_pending(void) { return 0; }
+static inline void mqtt_spool_get_stats(mqtt_spool_stats_t *stats) { *stats = (mqtt_spool_stats_t){0}; }
+
+#endif // CONFIG_MQTT_SPOOL_ENABLE
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_SPOOL_H
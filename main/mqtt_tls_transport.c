@@ -0,0 +1,1166 @@
+/* MQTT TLS Transport Implementation
+ *
+ * Minimal esp_transport over esp-tls. The only reason it exists is the
+ * client_session hook: the stock SSL transport inside the MQTT client does
+ * not expose it, so every reconnect would pay for a full handshake.
+ *
+ * Writes are also framed: the MQTT client sends a PUBLISH that does not fit
+ * its connection buffer as several writes (header and first bytes, then the
+ * rest of the payload in buffer-sized pieces), and each would become its
+ * own TLS record. When the fixed header announces a packet longer than the
+ * first write but small enough for one record, the pieces are collected
+ * and handed to esp-tls in a single write.
+ *
+ * Reads are buffered the other way round: the client parses the fixed
+ * header with one-byte reads, so small reads are served from a per
+ * connection buffer that is refilled with whatever mbedTLS has decrypted,
+ * and a burst of small packets costs one esp-tls read instead of three or
+ * more per packet.
+ *
+ * The client task sleeps in poll_read between loop passes. An eventfd in
+ * the same select() lets mqtt_tls_transport_wake() end that sleep, so an
+ * enqueued message goes out right away instead of after the poll timeout.
+ * With that, an idle client does not need the poll timeout at all: while
+ * the owner reports nothing pending, poll_read sleeps until the next
+ * keepalive ping is due.
+ *
+ * A connection that went half-open (NAT entry expired, AP gone without a
+ * word) would otherwise only be noticed when a keepalive ping goes
+ * unanswered. TCP keepalive probes close it from below; above that, a
+ * socket write that stalls or a PUBLISH the outbox has to retransmit
+ * makes the transport write a PINGREQ of its own between loop passes.
+ * If nothing at all arrives within the probe timeout, the next poll
+ * fails and the client drops the connection. The broker's PINGRESP is
+ * unsolicited for the client, which ignores it.
+ *
+ * Each connection gets the socket options of its TCP profile. Latency
+ * sets TCP_NODELAY: with every packet already one write, Nagle would
+ * only hold a PUBLISH behind an unacknowledged one, for up to a delayed
+ * ACK of the broker. Throughput leaves Nagle on, so a backlog of small
+ * packets drained after an outage shares full segments instead of
+ * costing one segment (and one Wi-Fi frame) each. Send buffer and window
+ * are LwIP-wide, not per socket: see sdkconfig.defaults.throughput.
+ *
+ * The first read-ahead of a connection holds the CONNACK. For MQTT 5 its
+ * Receive Maximum is picked out there, since the client keeps the broker's
+ * CONNACK properties to itself.
+ *
+ * For networks that only let HTTPS out, the same connection can carry MQTT
+ * as WebSocket binary frames (the "mqtt" subprotocol) after an HTTP
+ * Upgrade. Framing sits below the MQTT-aware layers, so a coalesced packet
+ * still leaves as one frame in one record and the read-ahead holds MQTT
+ * bytes only. The stock WebSocket transport cannot be stacked on this one
+ * for that reason: it writes frame headers the packet framing would take
+ * for MQTT. Pings are answered here; permessage-deflate is not offered,
+ * its 32 KB inflate window does not fit this device.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include "mqtt_tls_transport.h"
+#include "mqtt_loop_prof.h"
+#include "trace_marks.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "esp_vfs_eventfd.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/ssl.h"
+
+static const char *TAG = "mqtt_tls";
+
+#define MQTT_TLS_DEFAULT_PORT 8883
+
+#ifdef CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+#define MQTT_TLS_COALESCE_SIZE CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+#else
+#define MQTT_TLS_COALESCE_SIZE 4096
+#endif
+
+#define MQTT_TLS_RX_BUF_SIZE 512
+
+// WebSocket (RFC 6455)
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_TX_HEADER 8                  // Client frame header up to 64 KiB payload, mask included
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+#define WS_CONTROL_MAX 125
+
+typedef struct {
+    mqtt_tls_credentials_t creds;
+    esp_tls_t *tls;
+    char *coalesce;                 // Pieces of the current packet, allocated on first use
+    int coalesce_len;
+    bool coalescing;
+    int pkt_remaining;              // Bytes of the current MQTT packet still to come
+    int rx_pos;                     // Next unread byte in rx
+    int rx_len;
+    char rx[MQTT_TLS_RX_BUF_SIZE];  // Read-ahead for small reads
+    int wake_fd;                    // eventfd, -1 if unavailable
+    atomic_int wakes;               // Wakes not yet consumed by poll_read
+    int keepalive_ms;               // 0: poll timeouts are not extended
+    mqtt_tls_idle_cb_t idle;
+    int64_t ping_due_us;            // Half a keepalive after the last CONNECT/PINGREQ
+    tls_keep_alive_cfg_t tcp_keep_alive;
+    mqtt_tls_tcp_profile_t tcp_profile;
+    int probe_ms;                   // 0: no dead-link probes
+    int stall_ms;                   // Write time that is a stall
+    int64_t probe_sent_us;          // PINGREQ of the running probe, 0 if none
+    int64_t last_rx_us;             // Last bytes from the broker
+    bool connack_pending;           // The next read-ahead starts with the CONNACK
+    uint16_t receive_maximum;       // From the CONNACK, 0 if not announced
+    mqtt_tls_profile_t profile;
+    int ws_port;
+    const char *ws_path;            // Referenced, must outlive the transport
+    bool ws;                        // This connection is framed as WebSocket
+    char *ws_tx;                    // Outbound frame, allocated on connect
+    uint8_t ws_hdr[14];             // Inbound frame header read so far
+    int ws_hdr_len;
+    uint8_t ws_opcode;              // Of the inbound frame being read
+    uint64_t ws_payload;            // Its payload bytes still to come
+    uint8_t ws_ctrl[WS_CONTROL_MAX];    // Payload of an inbound ping
+    int ws_ctrl_len;
+} mqtt_tls_ctx_t;
+
+// Client task wakeups from poll_read, across transport instances
+static uint32_t s_polls = 0;
+
+// Socket write time, wait for send buffer space included, moving average (1/8)
+static uint32_t s_write_us = 0;
+
+// Session from the last successful connection, shared by all transport instances
+static esp_tls_client_session_t *s_session = NULL;
+static SemaphoreHandle_t s_session_mutex = NULL;
+
+// MQTT_TLS_PROFILE_AUTO: WebSocket worked last, so it is tried first
+static bool s_ws_preferred = false;
+
+// Sign of a dead link seen outside the client task, taken up by the next poll
+static atomic_bool s_suspect = false;
+static uint32_t s_probes = 0;
+static uint32_t s_dead_links = 0;
+
+static int tls_send(mqtt_tls_ctx_t *ctx, const char *buffer, int len, int timeout_ms);
+static int tls_recv(mqtt_tls_ctx_t *ctx, char *buffer, int len, int timeout_ms);
+static int conn_send(mqtt_tls_ctx_t *ctx, const char *buffer, int len, int timeout_ms);
+
+/**
+ * @brief Wait for the socket, and for a wake when wake_fd >= 0
+ *
+ * @return 1 if the socket is ready, 0 on timeout or wake, -1 on error
+ */
+static int wait_socket_or_wake(mqtt_tls_ctx_t *ctx, bool for_write, int wake_fd, int timeout_ms)
+{
+    int sockfd = -1;
+    if (ctx->tls == NULL || esp_tls_get_conn_sockfd(ctx->tls, &sockfd) != ESP_OK || sockfd < 0) {
+        return -1;
+    }
+
+    fd_set fds, errfds;
+    FD_ZERO(&fds);
+    FD_ZERO(&errfds);
+    FD_SET(sockfd, &fds);
+    FD_SET(sockfd, &errfds);
+    if (wake_fd >= 0) {
+        FD_SET(wake_fd, &fds);
+    }
+    int maxfd = wake_fd > sockfd ? wake_fd : sockfd;
+
+    struct timeval timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    int ret = select(maxfd + 1, for_write ? NULL : &fds, for_write ? &fds : NULL, &errfds,
+                     timeout_ms >= 0 ? &timeout : NULL);
+    if (ret > 0 && FD_ISSET(sockfd, &errfds)) {
+        return -1;
+    }
+    if (ret > 0 && wake_fd >= 0 && FD_ISSET(wake_fd, &fds)) {
+        uint64_t count;
+        read(wake_fd, &count, sizeof(count));
+        return FD_ISSET(sockfd, &fds) ? 1 : 0;
+    }
+    return ret > 0 ? 1 : ret;
+}
+
+static int wait_socket(mqtt_tls_ctx_t *ctx, bool for_write, int timeout_ms)
+{
+    return wait_socket_or_wake(ctx, for_write, -1, timeout_ms);
+}
+
+static int tls_open(mqtt_tls_ctx_t *ctx, const char *host, int port, int timeout_ms)
+{
+    ctx->tls = esp_tls_init();
+    if (ctx->tls == NULL) {
+        return -1;
+    }
+
+    esp_tls_cfg_t cfg = {
+        .cacert_buf = ctx->creds.ca_cert,
+        .cacert_bytes = ctx->creds.ca_cert_len,
+        .use_global_ca_store = (ctx->creds.ca_cert == NULL),
+        .clientcert_buf = ctx->creds.client_cert,
+        .clientcert_bytes = ctx->creds.client_cert_len,
+        .clientkey_buf = ctx->creds.client_key,
+        .clientkey_bytes = ctx->creds.client_key_len,
+        .ds_data = ctx->creds.ds_data,
+        .timeout_ms = timeout_ms,
+        .keep_alive_cfg = ctx->tcp_keep_alive.keep_alive_enable ? &ctx->tcp_keep_alive : NULL,
+    };
+
+    // esp-tls copies the session into the SSL context before the handshake
+    xSemaphoreTake(s_session_mutex, portMAX_DELAY);
+    cfg.client_session = s_session;
+    bool resuming = (s_session != NULL);
+    TRACE_SPAN_BEGIN(TRACE_ID_TLS_HANDSHAKE);
+    int ret = esp_tls_conn_new_sync(host, strlen(host), port, &cfg, ctx->tls);
+    TRACE_SPAN_END(TRACE_ID_TLS_HANDSHAKE);
+    if (ret <= 0 && resuming) {
+        // The broker may have refused the session: the retry starts afresh
+        esp_tls_free_client_session(s_session);
+        s_session = NULL;
+    }
+    if (ret <= 0) {
+        xSemaphoreGive(s_session_mutex);
+        ESP_LOGE(TAG, "TLS connection to %s:%d failed%s", host, port,
+                 resuming ? ", cached session dropped" : "");
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+        return -1;
+    }
+    xSemaphoreGive(s_session_mutex);
+
+    // After the handshake, whose flights are not small writes
+    int sockfd = -1;
+    int nodelay = ctx->tcp_profile == MQTT_TLS_TCP_LATENCY;
+    if (esp_tls_get_conn_sockfd(ctx->tls, &sockfd) != ESP_OK ||
+            setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) != 0) {
+        ESP_LOGW(TAG, "TCP_NODELAY not set");
+    }
+
+    ESP_LOGI(TAG, "TLS connected to %s:%d (%s)", host, port,
+             resuming ? "session offered for resumption" : "full handshake");
+    return 0;
+}
+
+/**
+ * @brief Find an HTTP header in a NUL-terminated response
+ *
+ * @return Start of its value, NULL if absent
+ */
+static const char *http_header(const char *resp, const char *name)
+{
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(resp, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Upgrade the TLS connection to a WebSocket for MQTT
+ *
+ * Uses the read-ahead buffer for the request and the response; nothing
+ * follows the response, since the broker waits for CONNECT.
+ */
+static int ws_handshake(mqtt_tls_ctx_t *ctx, const char *host, int port, int timeout_ms)
+{
+    uint8_t nonce[16];
+    char key[32];
+    size_t key_len;
+    esp_fill_random(nonce, sizeof(nonce));
+    mbedtls_base64_encode((unsigned char *)key, sizeof(key), &key_len, nonce, sizeof(nonce));
+
+    char *buf = ctx->rx;
+    int len = snprintf(buf, MQTT_TLS_RX_BUF_SIZE,
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s:%d\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: %s\r\n"
+                       "Sec-WebSocket-Version: 13\r\n"
+                       "Sec-WebSocket-Protocol: mqtt\r\n\r\n",
+                       ctx->ws_path, host, port, key);
+    if (len >= MQTT_TLS_RX_BUF_SIZE) {
+        ESP_LOGE(TAG, "WebSocket path or host too long");
+        return -1;
+    }
+    for (int sent = 0; sent < len;) {
+        int ret = tls_send(ctx, buf + sent, len - sent, timeout_ms);
+        if (ret <= 0) {
+            return -1;
+        }
+        sent += ret;
+    }
+
+    len = 0;
+    while (len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4) != 0) {
+        if (len == MQTT_TLS_RX_BUF_SIZE - 1) {
+            ESP_LOGE(TAG, "WebSocket upgrade response too long");
+            return -1;
+        }
+        // One byte at a time: whatever follows the headers is not ours to take
+        int ret = tls_recv(ctx, buf + len, 1, timeout_ms);
+        if (ret <= 0) {
+            ESP_LOGE(TAG, "No WebSocket upgrade response");
+            return -1;
+        }
+        len += ret;
+    }
+    buf[len] = '\0';
+    if (strncmp(buf, "HTTP/1.1 101", 12) != 0) {
+        ESP_LOGE(TAG, "WebSocket upgrade refused: %.*s", (int)strcspn(buf, "\r"), buf);
+        return -1;
+    }
+
+    char accept_in[64];
+    unsigned char digest[20];
+    char accept[32];
+    size_t accept_len;
+    snprintf(accept_in, sizeof(accept_in), "%s" WS_GUID, key);
+    mbedtls_sha1((const unsigned char *)accept_in, strlen(accept_in), digest);
+    mbedtls_base64_encode((unsigned char *)accept, sizeof(accept), &accept_len, digest, sizeof(digest));
+    const char *value = http_header(buf, "Sec-WebSocket-Accept");
+    if (value == NULL || strncmp(value, accept, accept_len) != 0) {
+        ESP_LOGE(TAG, "WebSocket upgrade not accepted");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open TLS, and the WebSocket inside it for ws
+ */
+static int connect_as(mqtt_tls_ctx_t *ctx, const char *host, int port, bool ws, int timeout_ms)
+{
+    if (ws) {
+        port = ctx->ws_port;
+        if (ctx->ws_tx == NULL) {
+            ctx->ws_tx = malloc(MQTT_TLS_COALESCE_SIZE);
+            if (ctx->ws_tx == NULL) {
+                return -1;
+            }
+        }
+    }
+    if (tls_open(ctx, host, port, timeout_ms) != 0) {
+        return -1;
+    }
+    if (ws && ws_handshake(ctx, host, port, timeout_ms) != 0) {
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+        return -1;
+    }
+    ctx->ws = ws;
+    ctx->ws_hdr_len = 0;
+    ctx->ws_payload = 0;
+    ctx->ws_ctrl_len = 0;
+    return 0;
+}
+
+static int tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+
+    mqtt_loop_prof_pass_end();
+
+    bool ws = ctx->profile == MQTT_TLS_PROFILE_WSS || (ctx->profile == MQTT_TLS_PROFILE_AUTO && s_ws_preferred);
+    int ret = connect_as(ctx, host, port, ws, timeout_ms);
+    if (ret != 0 && ctx->profile == MQTT_TLS_PROFILE_AUTO) {
+        ws = !ws;
+        ESP_LOGW(TAG, "Trying MQTT over %s instead", ws ? "WebSocket" : "TLS");
+        ret = connect_as(ctx, host, port, ws, timeout_ms);
+        if (ret == 0) {
+            s_ws_preferred = ws;
+        }
+    }
+    if (ret != 0) {
+        return -1;
+    }
+    ctx->connack_pending = true;
+    ctx->receive_maximum = 0;
+    return 0;
+}
+
+static bool rx_pending(mqtt_tls_ctx_t *ctx)
+{
+    // Read-ahead and records already decrypted by mbedTLS are not visible to select()
+    return ctx->rx_pos < ctx->rx_len || (ctx->tls != NULL && esp_tls_get_bytes_avail(ctx->tls) > 0);
+}
+
+/**
+ * @brief Poll timeout for an idle client: until the next ping is due
+ *
+ * The client pings half a keepalive after its last CONNACK/PINGRESP,
+ * slightly after ping_due_us; once that passed, its own timeout applies
+ * until the ping is written.
+ */
+static int idle_timeout(mqtt_tls_ctx_t *ctx, int timeout_ms)
+{
+    if (ctx->keepalive_ms == 0 || ctx->ping_due_us == 0 || timeout_ms < 0 || !ctx->idle()) {
+        return timeout_ms;
+    }
+    int64_t wait_ms = (ctx->ping_due_us - esp_timer_get_time()) / 1000;
+    if (wait_ms <= timeout_ms) {
+        return timeout_ms;
+    }
+    return wait_ms < ctx->keepalive_ms ? (int)wait_ms : ctx->keepalive_ms;
+}
+
+/**
+ * @brief Run the dead-link probe, between packets
+ *
+ * @param timeout_ms Poll timeout, capped to the probe deadline
+ * @return false if the link is dead
+ */
+static bool probe_step(mqtt_tls_ctx_t *ctx, int *timeout_ms)
+{
+    if (ctx->probe_ms == 0) {
+        atomic_store(&s_suspect, false);
+        return true;
+    }
+    int64_t now = esp_timer_get_time();
+    if (ctx->probe_sent_us == 0) {
+        if (!atomic_exchange(&s_suspect, false) || ctx->pkt_remaining != 0 || ctx->coalescing) {
+            return true;
+        }
+        static const char pingreq[] = { (char)0xC0, 0x00 };
+        s_probes++;
+        ctx->probe_sent_us = now;
+        if (conn_send(ctx, pingreq, sizeof(pingreq), ctx->probe_ms) != sizeof(pingreq)) {
+            ctx->probe_sent_us = 0;
+            s_dead_links++;
+            ESP_LOGW(TAG, "Link probe could not be written, dropping the connection");
+            return false;
+        }
+        ESP_LOGD(TAG, "Link probe sent");
+    } else if (ctx->last_rx_us >= ctx->probe_sent_us) {
+        ctx->probe_sent_us = 0;
+        return true;
+    }
+
+    int64_t left_ms = (ctx->probe_sent_us - now) / 1000 + ctx->probe_ms;
+    if (left_ms <= 0) {
+        ctx->probe_sent_us = 0;
+        s_dead_links++;
+        ESP_LOGW(TAG, "Nothing from the broker %d ms after a link probe, dropping the connection", ctx->probe_ms);
+        return false;
+    }
+    if (*timeout_ms < 0 || left_ms < *timeout_ms) {
+        *timeout_ms = (int)left_ms;
+    }
+    return true;
+}
+
+/**
+ * @brief Poll between client loop passes; a wake counts as a timeout
+ *
+ * Each mqtt_tls_transport_wake() ends one poll, so the client runs one
+ * loop pass (and sends one queued message) per wake.
+ */
+static int poll_pass(esp_transport_handle_t t, int timeout_ms)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+
+    if (rx_pending(ctx)) {
+        return 1;
+    }
+    int wait_ms = idle_timeout(ctx, timeout_ms);
+    if (!probe_step(ctx, &wait_ms)) {
+        return -1;
+    }
+    // Only the client task consumes wakes
+    if (atomic_load(&ctx->wakes) > 0) {
+        atomic_fetch_sub(&ctx->wakes, 1);
+        return 0;
+    }
+    int ret = wait_socket_or_wake(ctx, false, ctx->wake_fd, wait_ms);
+    s_polls++;
+    if (ret == 0 && atomic_load(&ctx->wakes) > 0) {
+        atomic_fetch_sub(&ctx->wakes, 1);
+    }
+    return ret;
+}
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    mqtt_loop_prof_pass_end();
+    int ret = poll_pass(t, timeout_ms);
+    mqtt_loop_prof_pass_begin();
+    return ret;
+}
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    return wait_socket(esp_transport_get_context_data(t), true, timeout_ms);
+}
+
+static int tls_recv(mqtt_tls_ctx_t *ctx, char *buffer, int len, int timeout_ms)
+{
+    int poll = rx_pending(ctx) ? 1 : wait_socket(ctx, false, timeout_ms);
+    if (poll == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    } else if (poll < 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    ssize_t ret = esp_tls_conn_read(ctx->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    } else if (ret == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    } else if (ret < 0) {
+        ESP_LOGE(TAG, "esp_tls_conn_read error: -0x%x", (unsigned int)-ret);
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    ctx->last_rx_us = esp_timer_get_time();
+    return ret;
+}
+
+/**
+ * @brief Send one masked WebSocket frame with up to len payload bytes
+ *
+ * The frame is written whole, so a short write cannot cut a header off
+ * its payload.
+ *
+ * @return Payload bytes sent, or a transport error
+ */
+static int ws_send_frame(mqtt_tls_ctx_t *ctx, uint8_t opcode, const char *buffer, int len, int timeout_ms)
+{
+    if (len > MQTT_TLS_COALESCE_SIZE - WS_TX_HEADER) {
+        len = MQTT_TLS_COALESCE_SIZE - WS_TX_HEADER;
+    }
+    uint8_t *frame = (uint8_t *)ctx->ws_tx;
+    int pos = 0;
+    frame[pos++] = 0x80 | opcode;   // FIN: MQTT does not care where frames end
+    if (len < 126) {
+        frame[pos++] = 0x80 | len;
+    } else {
+        frame[pos++] = 0x80 | 126;
+        frame[pos++] = len >> 8;
+        frame[pos++] = len & 0xFF;
+    }
+    uint32_t mask = esp_random();
+    memcpy(frame + pos, &mask, 4);
+    const uint8_t *key = frame + pos;
+    pos += 4;
+    for (int i = 0; i < len; i++) {
+        frame[pos + i] = (uint8_t)buffer[i] ^ key[i & 3];
+    }
+
+    for (int sent = 0; sent < pos + len;) {
+        int ret = tls_send(ctx, (const char *)frame + sent, pos + len - sent, timeout_ms);
+        if (ret <= 0) {
+            // Part of a frame is out: the stream cannot continue
+            return ret < 0 || sent > 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+        }
+        sent += ret;
+    }
+    return len;
+}
+
+/**
+ * @brief Read the header of the next inbound frame, resuming a partial one
+ *
+ * @return 1 once complete, otherwise what tls_recv() returned
+ */
+static int ws_read_header(mqtt_tls_ctx_t *ctx, int timeout_ms)
+{
+    for (;;) {
+        int need = 2;
+        if (ctx->ws_hdr_len >= 2) {
+            uint8_t len7 = ctx->ws_hdr[1] & 0x7F;
+            need += (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + (ctx->ws_hdr[1] & 0x80 ? 4 : 0);
+        }
+        if (ctx->ws_hdr_len == need) {
+            break;
+        }
+        int ret = tls_recv(ctx, (char *)ctx->ws_hdr + ctx->ws_hdr_len, need - ctx->ws_hdr_len, timeout_ms);
+        if (ret <= 0) {
+            return ret;
+        }
+        ctx->ws_hdr_len += ret;
+    }
+
+    const uint8_t *h = ctx->ws_hdr;
+    if (h[1] & 0x80) {
+        ESP_LOGE(TAG, "Masked frame from the broker");
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    uint64_t len = h[1] & 0x7F;
+    if (len == 126) {
+        len = (uint64_t)h[2] << 8 | h[3];
+    } else if (len == 127) {
+        len = 0;
+        for (int i = 2; i < 10; i++) {
+            len = len << 8 | h[i];
+        }
+    }
+    ctx->ws_opcode = h[0] & 0x0F;
+    ctx->ws_payload = len;
+    ctx->ws_hdr_len = 0;
+    ctx->ws_ctrl_len = 0;
+    if (ctx->ws_opcode >= WS_OP_CLOSE && len > WS_CONTROL_MAX) {
+        ESP_LOGE(TAG, "Oversized control frame");
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    return 1;
+}
+
+/**
+ * @brief Read MQTT bytes out of WebSocket data frames
+ *
+ * Control frames in between are consumed: a ping is answered with a pong
+ * carrying its payload, a close ends the connection.
+ */
+static int ws_recv(mqtt_tls_ctx_t *ctx, char *buffer, int len, int timeout_ms)
+{
+    for (;;) {
+        if (ctx->ws_payload == 0 && ctx->ws_opcode < WS_OP_CLOSE) {
+            int ret = ws_read_header(ctx, timeout_ms);
+            if (ret <= 0) {
+                return ret;
+            }
+        }
+
+        switch (ctx->ws_opcode) {
+        case WS_OP_CONTINUATION:
+        case WS_OP_TEXT:
+        case WS_OP_BINARY: {
+            if (ctx->ws_payload == 0) {
+                continue;
+            }
+            int n = ctx->ws_payload < (uint64_t)len ? (int)ctx->ws_payload : len;
+            int ret = tls_recv(ctx, buffer, n, timeout_ms);
+            if (ret > 0) {
+                ctx->ws_payload -= ret;
+            }
+            return ret;
+        }
+        case WS_OP_CLOSE:
+            ESP_LOGW(TAG, "Broker closed the WebSocket");
+            return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+        default:
+            // Ping or pong: collect the payload, answer a ping
+            while (ctx->ws_payload > 0) {
+                int ret = tls_recv(ctx, (char *)ctx->ws_ctrl + ctx->ws_ctrl_len, (int)ctx->ws_payload, timeout_ms);
+                if (ret <= 0) {
+                    return ret;
+                }
+                ctx->ws_ctrl_len += ret;
+                ctx->ws_payload -= ret;
+            }
+            if (ctx->ws_opcode == WS_OP_PING) {
+                int ret = ws_send_frame(ctx, WS_OP_PONG, (const char *)ctx->ws_ctrl, ctx->ws_ctrl_len, timeout_ms);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            ctx->ws_opcode = WS_OP_BINARY;
+            break;
+        }
+    }
+}
+
+static int conn_recv(mqtt_tls_ctx_t *ctx, char *buffer, int len, int timeout_ms)
+{
+    return ctx->ws ? ws_recv(ctx, buffer, len, timeout_ms) : tls_recv(ctx, buffer, len, timeout_ms);
+}
+
+static int conn_send(mqtt_tls_ctx_t *ctx, const char *buffer, int len, int timeout_ms)
+{
+    return ctx->ws ? ws_send_frame(ctx, WS_OP_BINARY, buffer, len, timeout_ms) : tls_send(ctx, buffer, len, timeout_ms);
+}
+
+/**
+ * @brief Decode an MQTT variable byte integer at *pos, -1 if malformed
+ */
+static int mqtt_varint(const uint8_t *buf, int end, int *pos)
+{
+    int value = 0;
+    for (int shift = 0; shift < 28 && *pos < end; shift += 7) {
+        uint8_t b = buf[(*pos)++];
+        value |= (b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return value;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Receive Maximum of an MQTT 5 CONNACK at the start of buf
+ *
+ * @return The broker's limit, or 0 for anything else: another packet, an
+ *         MQTT 3.1.1 CONNACK, no such property or a packet cut short
+ */
+static uint16_t connack_receive_maximum(const uint8_t *buf, int len)
+{
+    int pos = 1;
+    if (len < 2 || buf[0] != 0x20) {
+        return 0;
+    }
+    int remaining = mqtt_varint(buf, len, &pos);
+    if (remaining < 3 || pos + remaining > len) {
+        return 0;
+    }
+    pos += 2;   // Acknowledge flags, reason code
+    int props = mqtt_varint(buf, len, &pos);
+    if (props < 0 || pos + props > len) {
+        return 0;
+    }
+
+    int end = pos + props;
+    while (pos < end) {
+        uint8_t id = buf[pos++];
+        int skip;
+        switch (id) {
+        case 0x21:  // Receive Maximum
+            return pos + 2 <= end ? (uint16_t)(buf[pos] << 8 | buf[pos + 1]) : 0;
+        case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+            skip = 1;
+            break;
+        case 0x13: case 0x22: case 0x23:
+            skip = 2;
+            break;
+        case 0x02: case 0x11: case 0x18: case 0x27:
+            skip = 4;
+            break;
+        case 0x0B:
+            if (mqtt_varint(buf, end, &pos) < 0) {
+                return 0;
+            }
+            skip = 0;
+            break;
+        case 0x26:  // User property: two strings
+            if (pos + 2 > end) {
+                return 0;
+            }
+            pos += 2 + (buf[pos] << 8 | buf[pos + 1]);
+            // fall through
+        case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+            if (pos + 2 > end) {
+                return 0;
+            }
+            skip = 2 + (buf[pos] << 8 | buf[pos + 1]);
+            break;
+        default:
+            return 0;
+        }
+        pos += skip;
+    }
+    return 0;
+}
+
+static int tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+
+    mqtt_loop_prof_enter(MQTT_LOOP_PHASE_RECEIVE);
+
+    if (ctx->rx_pos == ctx->rx_len) {
+        if (len >= MQTT_TLS_RX_BUF_SIZE) {
+            return conn_recv(ctx, buffer, len, timeout_ms);
+        }
+        int ret = conn_recv(ctx, ctx->rx, MQTT_TLS_RX_BUF_SIZE, timeout_ms);
+        if (ret <= 0) {
+            return ret;
+        }
+        ctx->rx_pos = 0;
+        ctx->rx_len = ret;
+        if (ctx->connack_pending) {
+            ctx->connack_pending = false;
+            ctx->receive_maximum = connack_receive_maximum((const uint8_t *)ctx->rx, ret);
+        }
+    }
+
+    int n = ctx->rx_len - ctx->rx_pos;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buffer, ctx->rx + ctx->rx_pos, n);
+    ctx->rx_pos += n;
+    return n;
+}
+
+static int tls_send(mqtt_tls_ctx_t *ctx, const char *buffer, int len, int timeout_ms)
+{
+    int64_t start_us = esp_timer_get_time();
+    int poll = wait_socket(ctx, true, timeout_ms);
+    if (poll <= 0) {
+        return poll == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    ssize_t ret = esp_tls_conn_write(ctx->tls, buffer, len);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "esp_tls_conn_write error: -0x%x", (unsigned int)-ret);
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    int64_t us = esp_timer_get_time() - start_us;
+    uint32_t sample = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    s_write_us = s_write_us == 0 ? sample : s_write_us - s_write_us / 8 + sample / 8;
+    if (ctx->stall_ms > 0 && us >= (int64_t)ctx->stall_ms * 1000) {
+        // The send buffer is not draining: find out whether anyone is there
+        atomic_store(&s_suspect, true);
+    }
+    return ret;
+}
+
+/**
+ * @brief Total length of the MQTT packet starting at buf, -1 if the fixed
+ *        header is not complete
+ */
+static int mqtt_packet_length(const uint8_t *buf, int len)
+{
+    int remaining = 0;
+    int multiplier = 1;
+    for (int i = 1; i < len && i <= 4; i++) {
+        remaining += (buf[i] & 0x7F) * multiplier;
+        if ((buf[i] & 0x80) == 0) {
+            return 1 + i + remaining;
+        }
+        multiplier *= 128;
+    }
+    return -1;
+}
+
+static void coalesce_reset(mqtt_tls_ctx_t *ctx)
+{
+    ctx->coalesce_len = 0;
+    ctx->coalescing = false;
+    ctx->pkt_remaining = 0;
+}
+
+static int tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+
+    if (ctx->pkt_remaining == 0) {
+        uint8_t type = (uint8_t)buffer[0] & 0xF0;
+        if (type == 0x10 || type == 0xC0) {
+            // CONNECT or PINGREQ: the client pings again half a keepalive later
+            ctx->ping_due_us = esp_timer_get_time() + (int64_t)ctx->keepalive_ms * 500;
+        }
+        if (type == 0xC0) {
+            mqtt_loop_prof_enter(MQTT_LOOP_PHASE_KEEPALIVE);
+        }
+        int total = mqtt_packet_length((const uint8_t *)buffer, len);
+        ctx->pkt_remaining = total > 0 ? total : len;
+        if (total > len && total <= MQTT_TLS_COALESCE_SIZE) {
+            if (ctx->coalesce == NULL) {
+                ctx->coalesce = malloc(MQTT_TLS_COALESCE_SIZE);
+            }
+            // Without the buffer the pieces simply go out one by one
+            ctx->coalescing = (ctx->coalesce != NULL);
+        }
+    }
+
+    if (!ctx->coalescing) {
+        int ret = conn_send(ctx, buffer, len, timeout_ms);
+        if (ret > 0) {
+            ctx->pkt_remaining = ret < ctx->pkt_remaining ? ctx->pkt_remaining - ret : 0;
+        }
+        return ret;
+    }
+
+    int take = len < ctx->pkt_remaining ? len : ctx->pkt_remaining;
+    memcpy(ctx->coalesce + ctx->coalesce_len, buffer, take);
+    ctx->coalesce_len += take;
+    ctx->pkt_remaining -= take;
+    if (ctx->pkt_remaining > 0) {
+        return take;
+    }
+
+    // Last piece: the earlier ones were already reported as written
+    for (int sent = 0; sent < ctx->coalesce_len;) {
+        int ret = conn_send(ctx, ctx->coalesce + sent, ctx->coalesce_len - sent, timeout_ms);
+        if (ret <= 0) {
+            coalesce_reset(ctx);
+            return ret < 0 ? ret : ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+        }
+        sent += ret;
+    }
+    coalesce_reset(ctx);
+    return take;
+}
+
+static int tls_close(esp_transport_handle_t t)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+
+    mqtt_loop_prof_pass_end();
+
+    if (ctx->tls != NULL) {
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+    }
+    free(ctx->coalesce);
+    ctx->coalesce = NULL;
+    free(ctx->ws_tx);
+    ctx->ws_tx = NULL;
+    ctx->ws = false;
+    ctx->ws_opcode = WS_OP_BINARY;
+    coalesce_reset(ctx);
+    ctx->rx_pos = 0;
+    ctx->rx_len = 0;
+    ctx->ping_due_us = 0;
+    ctx->probe_sent_us = 0;
+    atomic_store(&s_suspect, false);
+    return 0;
+}
+
+static int tls_destroy(esp_transport_handle_t t)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    tls_close(t);
+    if (ctx->wake_fd >= 0) {
+        close(ctx->wake_fd);
+    }
+    free(ctx);
+    return 0;
+}
+
+esp_transport_handle_t mqtt_tls_transport_init(const mqtt_tls_credentials_t *creds)
+{
+    if (s_session_mutex == NULL) {
+        s_session_mutex = xSemaphoreCreateMutex();
+        if (s_session_mutex == NULL) {
+            return NULL;
+        }
+    }
+
+    mqtt_tls_ctx_t *ctx = calloc(1, sizeof(mqtt_tls_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->creds = *creds;
+
+    // ESP_ERR_INVALID_STATE: already registered by someone else
+    const esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_vfs_eventfd_register(&eventfd_config);
+    ctx->wake_fd = eventfd(0, 0);
+    if (ctx->wake_fd < 0) {
+        ESP_LOGW(TAG, "No eventfd, queued messages wait for the poll timeout");
+    }
+
+    esp_transport_handle_t t = esp_transport_init();
+    if (t == NULL) {
+        if (ctx->wake_fd >= 0) {
+            close(ctx->wake_fd);
+        }
+        free(ctx);
+        return NULL;
+    }
+
+    esp_transport_set_context_data(t, ctx);
+    esp_transport_set_default_port(t, MQTT_TLS_DEFAULT_PORT);
+    esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close,
+                           tls_poll_read, tls_poll_write, tls_destroy);
+    return t;
+}
+
+void mqtt_tls_transport_wake(esp_transport_handle_t t)
+{
+    mqtt_tls_ctx_t *ctx = t ? esp_transport_get_context_data(t) : NULL;
+    if (ctx == NULL) {
+        return;
+    }
+    atomic_fetch_add(&ctx->wakes, 1);
+    if (ctx->wake_fd >= 0) {
+        uint64_t one = 1;
+        write(ctx->wake_fd, &one, sizeof(one));
+    }
+}
+
+uint32_t mqtt_tls_transport_get_polls(void)
+{
+    return s_polls;
+}
+
+uint32_t mqtt_tls_transport_get_write_us(void)
+{
+    return s_write_us;
+}
+
+void mqtt_tls_transport_set_idle_wait(esp_transport_handle_t t, int keepalive_s, mqtt_tls_idle_cb_t idle)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    ctx->idle = idle;
+    ctx->keepalive_ms = idle != NULL && keepalive_s > 0 ? keepalive_s * 1000 : 0;
+}
+
+void mqtt_tls_transport_set_credentials(esp_transport_handle_t t, const mqtt_tls_credentials_t *creds)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    ctx->creds = *creds;
+}
+
+void mqtt_tls_transport_set_keep_alive(esp_transport_handle_t t, const esp_transport_keep_alive_t *cfg)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    ctx->tcp_keep_alive = (tls_keep_alive_cfg_t){
+        .keep_alive_enable = cfg->keep_alive_enable,
+        .keep_alive_idle = cfg->keep_alive_idle,
+        .keep_alive_interval = cfg->keep_alive_interval,
+        .keep_alive_count = cfg->keep_alive_count,
+    };
+}
+
+void mqtt_tls_transport_set_tcp_profile(esp_transport_handle_t t, mqtt_tls_tcp_profile_t profile)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    ctx->tcp_profile = profile;
+}
+
+mqtt_tls_tcp_profile_t mqtt_tls_transport_get_tcp_profile(esp_transport_handle_t t)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    return ctx->tcp_profile;
+}
+
+void mqtt_tls_transport_set_link_probe(esp_transport_handle_t t, int probe_ms, int stall_ms)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    ctx->probe_ms = probe_ms > 0 ? probe_ms : 0;
+    ctx->stall_ms = stall_ms > 0 ? stall_ms : 0;
+}
+
+void mqtt_tls_transport_suspect(void)
+{
+    atomic_store(&s_suspect, true);
+}
+
+void mqtt_tls_transport_get_link_stats(uint32_t *probes, uint32_t *dead)
+{
+    *probes = s_probes;
+    *dead = s_dead_links;
+}
+
+void mqtt_tls_transport_set_profile(esp_transport_handle_t t, mqtt_tls_profile_t profile, int ws_port, const char *ws_path)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    ctx->profile = profile;
+    ctx->ws_port = ws_port;
+    ctx->ws_path = ws_path;
+}
+
+bool mqtt_tls_transport_is_ws(esp_transport_handle_t t)
+{
+    mqtt_tls_ctx_t *ctx = t ? esp_transport_get_context_data(t) : NULL;
+    return ctx != NULL && ctx->ws;
+}
+
+uint16_t mqtt_tls_transport_get_receive_maximum(esp_transport_handle_t t)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    return ctx != NULL ? ctx->receive_maximum : 0;
+}
+
+void mqtt_tls_transport_save_session(esp_transport_handle_t t)
+{
+    mqtt_tls_ctx_t *ctx = esp_transport_get_context_data(t);
+    if (ctx == NULL || ctx->tls == NULL) {
+        return;
+    }
+
+    esp_tls_client_session_t *session = esp_tls_get_client_session(ctx->tls);
+    if (session == NULL) {
+        ESP_LOGW(TAG, "Broker did not provide a resumable session");
+        return;
+    }
+
+    xSemaphoreTake(s_session_mutex, portMAX_DELAY);
+    esp_tls_client_session_t *old = s_session;
+    s_session = session;
+    xSemaphoreGive(s_session_mutex);
+
+    if (old != NULL) {
+        esp_tls_free_client_session(old);
+    }
+    ESP_LOGI(TAG, "TLS session cached for the next reconnect");
+}
+
+void mqtt_tls_transport_forget_session(void)
+{
+    if (s_session_mutex == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(s_session_mutex, portMAX_DELAY);
+    esp_tls_client_session_t *old = s_session;
+    s_session = NULL;
+    xSemaphoreGive(s_session_mutex);
+
+    if (old != NULL) {
+        esp_tls_free_client_session(old);
+    }
+}
+
+esp_err_t mqtt_tls_transport_export_session(uint8_t *buf, size_t size, size_t *len)
+{
+    if (s_session_mutex == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(s_session_mutex, portMAX_DELAY);
+    if (s_session != NULL) {
+        err = mbedtls_ssl_session_save(&s_session->saved_session, buf, size, len) == 0 ? ESP_OK
+                                                                                      : ESP_ERR_INVALID_SIZE;
+    }
+    xSemaphoreGive(s_session_mutex);
+    return err;
+}
+
+esp_err_t mqtt_tls_transport_import_session(const uint8_t *buf, size_t len)
+{
+    if (s_session_mutex == NULL) {
+        s_session_mutex = xSemaphoreCreateMutex();
+        if (s_session_mutex == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    esp_tls_client_session_t *session = calloc(1, sizeof(esp_tls_client_session_t));
+    if (session == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    mbedtls_ssl_session_init(&session->saved_session);
+    int ret = mbedtls_ssl_session_load(&session->saved_session, buf, len);
+    if (ret != 0) {
+        ESP_LOGW(TAG, "Stored TLS session not usable (-0x%04x)", -ret);
+        esp_tls_free_client_session(session);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(s_session_mutex, portMAX_DELAY);
+    esp_tls_client_session_t *old = s_session;
+    s_session = session;
+    xSemaphoreGive(s_session_mutex);
+
+    if (old != NULL) {
+        esp_tls_free_client_session(old);
+    }
+    ESP_LOGI(TAG, "TLS session restored (%u bytes)", (unsigned)len);
+    return ESP_OK;
+}
@@ -0,0 +1,259 @@
+/* MQTT TLS Transport Header
+ *
+ * esp-tls based transport for the MQTT client that offers the TLS session
+ * from the previous connection, so reconnects resume the session instead of
+ * repeating the full RSA-2048 mutual-auth handshake. MQTT travels directly
+ * over TLS or, where only HTTPS gets out, in WebSocket frames (WSS).
+ */
+
+#ifndef MQTT_TLS_TRANSPORT_H
+#define MQTT_TLS_TRANSPORT_H
+
+#include "esp_err.h"
+#include "esp_transport.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief mTLS credentials used by the transport
+ *
+ * Buffers are referenced, not copied, and must outlive the transport.
+ * Each buffer may be DER or PEM; for PEM the length must include the NUL
+ * terminator.
+ */
+typedef struct {
+    const unsigned char *ca_cert;       // CA certificate used to verify the broker, NULL for the global store
+    size_t ca_cert_len;
+    const unsigned char *client_cert;   // Device certificate
+    size_t client_cert_len;
+    const unsigned char *client_key;    // Device private key, NULL when ds_data is set
+    size_t client_key_len;
+    void *ds_data;                      // DS peripheral context (esp_ds_data_ctx_t) or NULL
+} mqtt_tls_credentials_t;
+
+/**
+ * @brief How MQTT is carried over the TLS connection
+ */
+typedef enum {
+    MQTT_TLS_PROFILE_MQTTS,         // MQTT directly over TLS, on the broker URI's port
+    MQTT_TLS_PROFILE_WSS,           // MQTT in WebSocket frames, on the WebSocket port
+    MQTT_TLS_PROFILE_AUTO,          // Either, the other one when a connect fails
+} mqtt_tls_profile_t;
+
+/**
+ * @brief Socket tuning of the broker connection
+ */
+typedef enum {
+    MQTT_TLS_TCP_LATENCY,           // TCP_NODELAY: every packet leaves at once
+    MQTT_TLS_TCP_THROUGHPUT,        // Nagle: small packets share segments while data is unacknowledged
+} mqtt_tls_tcp_profile_t;
+
+/**
+ * @brief Reports whether the MQTT client has nothing to do until its next ping
+ *
+ * Called from the client task while it polls for inbound data.
+ */
+typedef bool (*mqtt_tls_idle_cb_t)(void);
+
+/**
+ * @brief Create the transport
+ *
+ * Pass the result as network.transport in esp_mqtt_client_config_t. The MQTT
+ * client takes ownership and destroys it in esp_mqtt_client_destroy().
+ *
+ * @param creds mTLS credentials
+ * @return Transport handle, NULL on allocation failure
+ */
+esp_transport_handle_t mqtt_tls_transport_init(const mqtt_tls_credentials_t *creds);
+
+/**
+ * @brief Replace the credentials, used from the next connect
+ *
+ * For a transport kept across a stopped client: call it while the client
+ * is stopped, before starting it again.
+ *
+ * @param t Transport handle
+ * @param creds mTLS credentials
+ */
+void mqtt_tls_transport_set_credentials(esp_transport_handle_t t, const mqtt_tls_credentials_t *creds);
+
+/**
+ * @brief End the client task's current wait for inbound data
+ *
+ * Call after handing the client work from another context (an enqueued
+ * message or a user event), so it is handled now rather than after the
+ * poll timeout. Each call lets the client run one loop pass.
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ */
+void mqtt_tls_transport_wake(esp_transport_handle_t t);
+
+/**
+ * @brief Let an idle client sleep until its next keepalive ping
+ *
+ * The client polls with MQTT_POLL_READ_TIMEOUT_MS between loop passes so
+ * it can retransmit and expire messages. While idle() returns true the
+ * transport stretches that wait to the next ping instead; new work must
+ * then be signalled with mqtt_tls_transport_wake().
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ * @param keepalive_s Keepalive configured in the MQTT client
+ * @param idle Idle check, NULL to keep the client's poll timeout
+ */
+void mqtt_tls_transport_set_idle_wait(esp_transport_handle_t t, int keepalive_s, mqtt_tls_idle_cb_t idle);
+
+/**
+ * @brief Number of times the client task returned from a blocking poll
+ *
+ * Counts every instance since boot; on an idle link it shows how often
+ * the task (and with power save the CPU and radio) woke up.
+ */
+uint32_t mqtt_tls_transport_get_polls(void);
+
+/**
+ * @brief Average time a socket write took, in microseconds
+ *
+ * Includes waiting for room in the TCP send buffer, so it grows when the
+ * link drains slower than the client writes. 0 before the first write.
+ */
+uint32_t mqtt_tls_transport_get_write_us(void);
+
+/**
+ * @brief TCP keepalive for the following connects
+ *
+ * The MQTT client applies network.tcp_keep_alive_cfg to its own
+ * transports only, so this one takes it here.
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ * @param cfg Idle time, probe interval (seconds) and probe count
+ */
+void mqtt_tls_transport_set_keep_alive(esp_transport_handle_t t, const esp_transport_keep_alive_t *cfg);
+
+/**
+ * @brief TCP profile for the following connects
+ *
+ * The default is MQTT_TLS_TCP_LATENCY. Call from the client task, e.g. on
+ * MQTT_EVENT_BEFORE_CONNECT; the open connection keeps its options.
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ * @param profile TCP profile
+ */
+void mqtt_tls_transport_set_tcp_profile(esp_transport_handle_t t, mqtt_tls_tcp_profile_t profile);
+
+/**
+ * @brief TCP profile of the current (or next) connection
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ */
+mqtt_tls_tcp_profile_t mqtt_tls_transport_get_tcp_profile(esp_transport_handle_t t);
+
+/**
+ * @brief Probe the link with a PINGREQ when it looks dead
+ *
+ * After a socket write of stall_ms or more, or mqtt_tls_transport_suspect(),
+ * the client task writes a PINGREQ before its next poll. If nothing arrives
+ * from the broker within probe_ms, that poll fails and the client drops the
+ * connection.
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ * @param probe_ms Time to wait for the broker, 0 to never probe
+ * @param stall_ms Write time that triggers a probe, 0 for none
+ */
+void mqtt_tls_transport_set_link_probe(esp_transport_handle_t t, int probe_ms, int stall_ms);
+
+/**
+ * @brief Report a sign of a dead link, e.g. an overdue acknowledgement
+ *
+ * Safe from any task; the probe runs in the client task.
+ */
+void mqtt_tls_transport_suspect(void);
+
+/**
+ * @brief Link probes sent and connections they found dead, since boot
+ */
+void mqtt_tls_transport_get_link_stats(uint32_t *probes, uint32_t *dead);
+
+/**
+ * @brief Choose how the following connects carry MQTT
+ *
+ * The default is MQTT_TLS_PROFILE_MQTTS. With MQTT_TLS_PROFILE_AUTO a
+ * connect that fails is retried at once the other way, and the way that
+ * last worked is tried first from then on. WebSocket connects go to the
+ * broker URI's host on ws_port and upgrade on ws_path.
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ * @param profile Transport profile
+ * @param ws_port TLS port of the WebSocket endpoint, usually 443
+ * @param ws_path Upgrade path, referenced, e.g. "/mqtt"
+ */
+void mqtt_tls_transport_set_profile(esp_transport_handle_t t, mqtt_tls_profile_t profile, int ws_port, const char *ws_path);
+
+/**
+ * @brief Whether the current connection is a WebSocket
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ */
+bool mqtt_tls_transport_is_ws(esp_transport_handle_t t);
+
+/**
+ * @brief Receive Maximum the broker announced in its MQTT 5 CONNACK
+ *
+ * Valid from MQTT_EVENT_CONNECTED until the next connect.
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ * @return QoS 1/2 publishes the broker accepts unacknowledged, 0 when the
+ *         CONNACK did not say (MQTT 3.1.1, or no limit)
+ */
+uint16_t mqtt_tls_transport_get_receive_maximum(esp_transport_handle_t t);
+
+/**
+ * @brief Capture the TLS session of the current connection
+ *
+ * Call after MQTT_EVENT_CONNECTED: by then a TLS 1.3 ticket sent after the
+ * handshake has also been received. The session is kept across transport
+ * instances and offered on the next connect.
+ *
+ * @param t Transport created by mqtt_tls_transport_init()
+ */
+void mqtt_tls_transport_save_session(esp_transport_handle_t t);
+
+/**
+ * @brief Drop the cached TLS session
+ *
+ * Forces the next connect to perform a full handshake, e.g. after the
+ * device certificate changed.
+ */
+void mqtt_tls_transport_forget_session(void);
+
+/**
+ * @brief Serialize the cached TLS session, e.g. to keep it through deep sleep
+ *
+ * @param buf Output buffer
+ * @param size Size of buf
+ * @param len Serialized length on success
+ * @return ESP_OK, ESP_ERR_NOT_FOUND without a cached session,
+ *         ESP_ERR_INVALID_SIZE if buf is too small
+ */
+esp_err_t mqtt_tls_transport_export_session(uint8_t *buf, size_t size, size_t *len);
+
+/**
+ * @brief Cache a session serialized by mqtt_tls_transport_export_session()
+ *
+ * Replaces the cached session. A blob from another mbedTLS build or
+ * configuration is refused, and the next connect does a full handshake.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for a blob that does not load,
+ *         ESP_ERR_NO_MEM
+ */
+esp_err_t mqtt_tls_transport_import_session(const uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_TLS_TRANSPORT_H
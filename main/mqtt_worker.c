@@ -0,0 +1,258 @@
+/* MQTT Worker Pool Implementation
+ *
+ * As in mqtt_rpc, slots move between queues of indices: the MQTT task
+ * takes a free one when a message starts, fills it chunk by chunk and
+ * hands it to the ready queue of the handler's worker, which runs the
+ * handler and returns it. A slot being filled belongs to its handler
+ * entry, so a message matched by two handlers takes two slots.
+ *
+ * Workers run just below the MQTT task: when a message is queued the
+ * MQTT task finishes its I/O first, and a handler blocked on flash or
+ * the publish mutex never keeps the connection from being served.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "mqtt_worker.h"
+
+#if CONFIG_MQTT_WORKER
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *TAG = "mqtt_worker";
+
+#define TOPIC_MAX           128     // Including the terminator, as received by mqtt_handler
+#define RESPONSE_TOPIC_MAX  128     // Including the terminator
+#define CORRELATION_MAX     64
+#define SLOTS               CONFIG_MQTT_WORKER_QUEUE_LEN
+#define WORKERS             CONFIG_MQTT_WORKER_COUNT
+#define MSG_SIZE            CONFIG_MQTT_WORKER_MSG_SIZE
+
+typedef struct {
+    mqtt_handler_msg_cb_t cb;
+    void *ctx;
+    int16_t filling;                // Slot the MQTT task is filling, -1 if none
+    uint8_t worker;
+} worker_handler_t;
+
+typedef struct {
+    int64_t queued_us;
+    uint8_t handler;
+    uint8_t correlation_len;
+    uint8_t response_topic_len;     // 0: no response topic
+    uint8_t topic_len;
+    uint16_t len;
+    char topic[TOPIC_MAX];
+    char response_topic[RESPONSE_TOPIC_MAX];
+    char correlation[CORRELATION_MAX];
+    char data[MSG_SIZE + 1];
+} worker_msg_t;
+
+static worker_handler_t s_handlers[MQTT_WORKER_HANDLERS_MAX];
+static int s_handler_count = 0;
+
+static worker_msg_t s_slots[SLOTS];
+static QueueHandle_t s_free = NULL;
+static QueueHandle_t s_ready[WORKERS];
+static int s_workers = 0;                   // Started, handlers are spread over these
+static mqtt_worker_stats_t s_stats;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+_Static_assert(SLOTS <= UINT8_MAX, "slot indices are bytes");
+_Static_assert(MSG_SIZE <= UINT16_MAX, "payload lengths are 16-bit");
+_Static_assert(TOPIC_MAX <= UINT8_MAX + 1, "topic lengths are bytes");
+
+static void release(int16_t slot)
+{
+    uint8_t i = (uint8_t)slot;
+    xQueueSend(s_free, &i, 0);
+}
+
+/**
+ * @brief Copy a message into a slot, called from the MQTT task
+ */
+static esp_err_t worker_message(const mqtt_handler_msg_t *msg, void *ctx)
+{
+    worker_handler_t *h = ctx;
+
+    if (msg->offset == 0) {
+        if (h->filling >= 0) {
+            release(h->filling);    // The client gave up on the previous message
+            h->filling = -1;
+        }
+        if (msg->total_len > MSG_SIZE || msg->response_topic_len >= RESPONSE_TOPIC_MAX ||
+            msg->correlation_len > CORRELATION_MAX) {
+            portENTER_CRITICAL(&s_lock);
+            s_stats.oversized++;
+            portEXIT_CRITICAL(&s_lock);
+            ESP_LOGW(TAG, "Message of %d bytes on %s ignored: too large for a slot", msg->total_len, msg->topic);
+            return ESP_FAIL;
+        }
+        uint8_t i;
+        if (xQueueReceive(s_free, &i, 0) != pdTRUE) {
+            portENTER_CRITICAL(&s_lock);
+            uint32_t dropped = ++s_stats.dropped;
+            portEXIT_CRITICAL(&s_lock);
+            ESP_LOGW(TAG, "Message on %s dropped: %d already queued (%lu dropped)",
+                     msg->topic, SLOTS, (unsigned long)dropped);
+            return ESP_FAIL;
+        }
+
+        worker_msg_t *m = &s_slots[i];
+        m->handler = (uint8_t)(h - s_handlers);
+        m->topic_len = msg->topic_len < TOPIC_MAX - 1 ? (uint8_t)msg->topic_len : TOPIC_MAX - 1;
+        memcpy(m->topic, msg->topic, m->topic_len);
+        m->topic[m->topic_len] = '\0';
+        m->response_topic_len = msg->response_topic != NULL ? (uint8_t)msg->response_topic_len : 0;
+        memcpy(m->response_topic, msg->response_topic, m->response_topic_len);
+        m->response_topic[m->response_topic_len] = '\0';
+        m->correlation_len = msg->correlation != NULL ? (uint8_t)msg->correlation_len : 0;
+        memcpy(m->correlation, msg->correlation, m->correlation_len);
+        m->len = (uint16_t)msg->total_len;
+        h->filling = i;
+    }
+    if (h->filling < 0) {
+        return ESP_FAIL;
+    }
+
+    worker_msg_t *m = &s_slots[h->filling];
+    if (msg->offset + msg->len > m->len) {
+        release(h->filling);
+        h->filling = -1;
+        return ESP_FAIL;
+    }
+    memcpy(m->data + msg->offset, msg->data, msg->len);
+    if (msg->offset + msg->len < m->len) {
+        return ESP_OK;
+    }
+
+    m->data[m->len] = '\0';
+    m->queued_us = esp_timer_get_time();
+    uint8_t i = (uint8_t)h->filling;
+    h->filling = -1;
+    xQueueSend(s_ready[h->worker], &i, 0);
+    return ESP_OK;
+}
+
+static void worker_task(void *arg)
+{
+    QueueHandle_t ready = s_ready[(intptr_t)arg];
+    while (1) {
+        uint8_t i;
+        xQueueReceive(ready, &i, portMAX_DELAY);
+        const worker_msg_t *m = &s_slots[i];
+        const worker_handler_t *h = &s_handlers[m->handler];
+
+        mqtt_handler_msg_t msg = {
+            .topic = m->topic,
+            .topic_len = m->topic_len,
+            .data = m->data,
+            .len = m->len,
+            .offset = 0,
+            .total_len = m->len,
+            .response_topic = m->response_topic_len > 0 ? m->response_topic : NULL,
+            .response_topic_len = m->response_topic_len,
+            .correlation = m->correlation_len > 0 ? m->correlation : NULL,
+            .correlation_len = m->correlation_len,
+        };
+        int64_t start = esp_timer_get_time();
+        uint32_t wait_us = (uint32_t)(start - m->queued_us);
+        h->cb(&msg, h->ctx);
+        uint32_t run_us = (uint32_t)(esp_timer_get_time() - start);
+        release(i);
+
+        portENTER_CRITICAL(&s_lock);
+        s_stats.handled++;
+        if (wait_us > s_stats.wait_max_us) {
+            s_stats.wait_max_us = wait_us;
+        }
+        if (run_us > s_stats.run_max_us) {
+            s_stats.run_max_us = run_us;
+        }
+        portEXIT_CRITICAL(&s_lock);
+    }
+}
+
+/**
+ * @brief Create the queues and as many of the workers as memory allows
+ */
+static esp_err_t start_workers(void)
+{
+    if (s_free == NULL) {
+        s_free = xQueueCreate(SLOTS, sizeof(uint8_t));
+        if (s_free == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        for (uint8_t i = 0; i < SLOTS; i++) {
+            xQueueSend(s_free, &i, 0);
+        }
+    }
+    while (s_workers < WORKERS) {
+        int w = s_workers;
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "mqtt_wk%d", w);
+        if (s_ready[w] == NULL) {
+            s_ready[w] = xQueueCreate(SLOTS, sizeof(uint8_t));
+        }
+        if (s_ready[w] == NULL ||
+            xTaskCreate(worker_task, name, CONFIG_MQTT_WORKER_TASK_STACK, (void *)(intptr_t)w,
+                        CONFIG_MQTT_HANDLER_TASK_PRIORITY - 1, NULL) != pdPASS) {
+            break;
+        }
+        s_workers++;
+    }
+    if (s_workers == 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (s_workers < WORKERS) {
+        ESP_LOGW(TAG, "Only %d of %d workers started", s_workers, WORKERS);
+    }
+    ESP_LOGI(TAG, "%d workers, %d slots of %d bytes", s_workers, SLOTS, MSG_SIZE);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_worker_subscribe(const char *topic, int qos, mqtt_handler_msg_cb_t cb, void *ctx)
+{
+    if (cb == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_handler_count == MQTT_WORKER_HANDLERS_MAX) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (s_workers == 0) {
+        esp_err_t err = start_workers();
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Workers not started: %s", esp_err_to_name(err));
+            return err;
+        }
+    }
+
+    worker_handler_t *h = &s_handlers[s_handler_count];
+    *h = (worker_handler_t){
+        .cb = cb,
+        .ctx = ctx,
+        .filling = -1,
+        .worker = (uint8_t)(s_handler_count % s_workers),
+    };
+    esp_err_t err = mqtt_handler_subscribe(topic, qos, worker_message, h);
+    if (err == ESP_OK) {
+        s_handler_count++;
+        ESP_LOGI(TAG, "%s handled on worker %d", topic, h->worker);
+    }
+    return err;
+}
+
+void mqtt_worker_get_stats(mqtt_worker_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+#endif // CONFIG_MQTT_WORKER
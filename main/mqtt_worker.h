@@ -0,0 +1,87 @@
+/* MQTT Worker Pool Header
+ *
+ * Inbound commands handled off the MQTT task. Subscription callbacks run
+ * on esp_mqtt_task with the client's API lock held, so a callback that
+ * writes NVS or publishes holds up receive, keepalive and the outbox for
+ * as long as it takes. A filter subscribed here instead gets a callback
+ * on the MQTT task that only copies the message into one of
+ * CONFIG_MQTT_WORKER_QUEUE_LEN preallocated slots and queues it; the
+ * handler then runs on one of CONFIG_MQTT_WORKER_COUNT worker tasks.
+ *
+ * The handler sees the whole message in one call (offset 0, len equal to
+ * total_len), NUL-terminated, with its MQTT 5 response topic and
+ * correlation data. Each handler always runs on the same worker, so its
+ * messages are handled one at a time and in arrival order; handlers on
+ * different workers do not wait for each other. A message that finds
+ * every slot taken, or is larger than CONFIG_MQTT_WORKER_MSG_SIZE, is
+ * dropped and counted.
+ *
+ * Without CONFIG_MQTT_WORKER the filters are subscribed with
+ * mqtt_handler_subscribe() and the handlers run on the MQTT task, chunk
+ * by chunk.
+ */
+
+#ifndef MQTT_WORKER_H
+#define MQTT_WORKER_H
+
+#include "esp_err.h"
+#include "mqtt_handler.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_WORKER_HANDLERS_MAX    8
+
+/**
+ * @brief Worker pool counters since boot
+ */
+typedef struct {
+    uint32_t handled;           // Messages run by a handler
+    uint32_t dropped;           // No free slot
+    uint32_t oversized;         // Payload, response topic or correlation data too long
+    uint32_t wait_max_us;       // Longest time a message waited for its worker
+    uint32_t run_max_us;        // Longest handler call
+} mqtt_worker_stats_t;
+
+#if CONFIG_MQTT_WORKER
+
+/**
+ * @brief Subscribe to a topic filter and handle its messages on a worker
+ *
+ * Same filters and reconnect behaviour as mqtt_handler_subscribe(). The
+ * workers are started by the first call. Registrations are never freed;
+ * call once per filter.
+ *
+ * @param topic Topic filter
+ * @param qos Quality of Service (0, 1, or 2)
+ * @param cb Handler, called on a worker task with the whole message
+ * @param ctx Passed to cb
+ * @return ESP_OK, ESP_ERR_NO_MEM if the registry is full or the workers
+ *         could not be started, or an error of mqtt_handler_subscribe()
+ */
+esp_err_t mqtt_worker_subscribe(const char *topic, int qos, mqtt_handler_msg_cb_t cb, void *ctx);
+
+/**
+ * @brief Snapshot of the counters
+ */
+void mqtt_worker_get_stats(mqtt_worker_stats_t *stats);
+
+#else
+
+static inline esp_err_t mqtt_worker_subscribe(const char *topic, int qos, mqtt_handler_msg_cb_t cb, void *ctx)
+{
+    return mqtt_handler_subscribe(topic, qos, cb, ctx);
+}
+
+static inline void mqtt_worker_get_stats(mqtt_worker_stats_t *stats) { *stats = (mqtt_worker_stats_t){0}; }
+
+#endif // CONFIG_MQTT_WORKER
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_WORKER_H
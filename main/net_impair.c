@@ -0,0 +1,284 @@
+/* Network Impairment Implementation
+ *
+ * Only the MQTT task does I/O on the transport, but the settings can be
+ * changed from anywhere: they, the generator and the counters are kept
+ * under one spinlock and copied out before sleeping. The TLS handshake
+ * runs inside the inner transport's connect, so a connect is charged
+ * CONNECT_RTTS round trips up front instead of per handshake record.
+ *
+ * Delays are timestamps, not sleeps. A write only waits while the link is
+ * busy at rate_kbps; its latency moves the time it reaches the far end.
+ * What the inner transport delivers is held back in s_hold until it would
+ * have arrived: no earlier than one latency after the last write reached
+ * the far end, and one latency after it really came. One inner read is
+ * one packet, charged once however the client splits it up (the header
+ * is read a byte at a time); until it is due, reads time out as on a
+ * slow link and the task can go on writing.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "net_impair.h"
+
+#if CONFIG_APP_NET_IMPAIR
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "net_impair";
+
+#define CONNECT_RTTS    3       // TCP handshake and a full TLS 1.2 handshake
+#define HOLD_LEN        1460    // One segment of inbound data held back
+
+static net_impair_cfg_t s_cfg = {
+    .latency_ms = CONFIG_APP_NET_IMPAIR_LATENCY_MS,
+    .jitter_ms = CONFIG_APP_NET_IMPAIR_JITTER_MS,
+    .rate_kbps = CONFIG_APP_NET_IMPAIR_RATE_KBPS,
+    .stall_permille = CONFIG_APP_NET_IMPAIR_STALL_PERMILLE,
+    .stall_ms = CONFIG_APP_NET_IMPAIR_STALL_MS,
+    .cut_permille = CONFIG_APP_NET_IMPAIR_CUT_PERMILLE,
+};
+static net_impair_stats_t s_stats;
+static uint32_t s_rng = CONFIG_APP_NET_IMPAIR_SEED;
+static int64_t s_link_free_us = 0;      // When the emulated link has sent everything so far
+static int64_t s_far_us = 0;            // When the last write reaches the far end
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Inbound packet not delivered yet (MQTT task only)
+static char s_hold[HOLD_LEN];
+static int s_hold_len = 0;
+static int s_hold_off = 0;
+static int64_t s_hold_due_us = 0;
+
+/**
+ * @brief xorshift32, lock held
+ */
+static uint32_t rng_next(void)
+{
+    uint32_t x = s_rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s_rng = x;
+    return x;
+}
+
+static bool chance(uint16_t permille)
+{
+    return permille > 0 && rng_next() % 1000 < permille;
+}
+
+static void sleep_ms(uint32_t ms)
+{
+    if (ms > 0) {
+        vTaskDelay((ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+    }
+}
+
+static void sleep_until(int64_t due_us)
+{
+    int64_t wait_us = due_us - esp_timer_get_time();
+    if (wait_us > 0) {
+        sleep_ms((uint32_t)((wait_us + 999) / 1000));
+    }
+}
+
+/**
+ * @brief Put one transfer of len bytes on the emulated link, lock held
+ *
+ * @param[out] start_us When the link is free for it: earlier transfers
+ *             in either direction go first at rate_kbps
+ * @return When it arrives at the other end: one latency and jitter after
+ *         it has left, plus a stall if one falls on it
+ */
+static int64_t transfer(int64_t now, int len, int64_t *start_us)
+{
+    int64_t start = s_link_free_us > now ? s_link_free_us : now;
+    int64_t done = start;
+    if (s_cfg.rate_kbps > 0 && len > 0) {
+        done += (int64_t)len * 8 * 1000 / s_cfg.rate_kbps;
+        s_link_free_us = done;
+    }
+    uint32_t ms = s_cfg.latency_ms + (s_cfg.jitter_ms ? rng_next() % (s_cfg.jitter_ms + 1) : 0);
+    if (chance(s_cfg.stall_permille)) {
+        s_stats.stalls++;
+        ms += s_cfg.stall_ms;
+    }
+    *start_us = start;
+    return done + (int64_t)ms * 1000;
+}
+
+static void hold_reset(void)
+{
+    s_hold_len = 0;
+    s_hold_off = 0;
+    portENTER_CRITICAL(&s_lock);
+    s_far_us = 0;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static int impair_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    esp_transport_handle_t inner = esp_transport_get_context_data(t);
+    portENTER_CRITICAL(&s_lock);
+    uint32_t ms = s_cfg.latency_ms * 2 * CONNECT_RTTS;
+    s_stats.delayed_ms += ms;
+    portEXIT_CRITICAL(&s_lock);
+    hold_reset();
+    sleep_ms(ms);
+    return esp_transport_connect(inner, host, port, timeout_ms);
+}
+
+/**
+ * @brief Wait up to timeout_ms for the held-back packet to be due
+ *
+ * @return Whether it is
+ */
+static bool hold_wait(int timeout_ms)
+{
+    int64_t now = esp_timer_get_time();
+    if (s_hold_due_us <= now) {
+        return true;
+    }
+    int64_t limit = now + (int64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000;
+    sleep_until(s_hold_due_us < limit ? s_hold_due_us : limit);
+    return s_hold_due_us <= esp_timer_get_time();
+}
+
+static int impair_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    esp_transport_handle_t inner = esp_transport_get_context_data(t);
+    if (s_hold_off == s_hold_len) {
+        int n = esp_transport_read(inner, s_hold, sizeof(s_hold), timeout_ms);
+        if (n <= 0) {
+            return n;
+        }
+        // Arrived now; on the emulated link it comes one latency later,
+        // and no answer before the far end has what it answers
+        int64_t now = esp_timer_get_time();
+        int64_t start;
+        portENTER_CRITICAL(&s_lock);
+        int64_t sent = s_far_us > now ? s_far_us : now;
+        s_hold_due_us = transfer(sent, n, &start);
+        s_stats.delayed_ms += (uint32_t)((s_hold_due_us - now) / 1000);
+        portEXIT_CRITICAL(&s_lock);
+        s_hold_len = n;
+        s_hold_off = 0;
+    }
+    if (!hold_wait(timeout_ms)) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    int n = s_hold_len - s_hold_off < len ? s_hold_len - s_hold_off : len;
+    memcpy(buffer, s_hold + s_hold_off, n);
+    s_hold_off += n;
+    return n;
+}
+
+static int impair_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    esp_transport_handle_t inner = esp_transport_get_context_data(t);
+    int64_t now = esp_timer_get_time();
+    int64_t start;
+    portENTER_CRITICAL(&s_lock);
+    int64_t far = transfer(now, len, &start);
+    if (far > s_far_us) {
+        s_far_us = far;
+    }
+    if (start > now) {
+        s_stats.delayed_ms += (uint32_t)((start - now) / 1000);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    // Only a busy link holds the sender back; the latency is the reader's
+    sleep_until(start);
+
+    portENTER_CRITICAL(&s_lock);
+    bool cut = len > 1 && chance(s_cfg.cut_permille);
+    int part = cut ? 1 + (int)(rng_next() % (uint32_t)(len - 1)) : len;
+    if (cut) {
+        s_stats.cuts++;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (!cut) {
+        return esp_transport_write(inner, buffer, len, timeout_ms);
+    }
+    ESP_LOGW(TAG, "Cutting the connection after %d of %d bytes", part, len);
+    esp_transport_write(inner, buffer, part, timeout_ms);
+    esp_transport_close(inner);
+    return -1;
+}
+
+static int impair_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    if (s_hold_off < s_hold_len) {
+        return hold_wait(timeout_ms) ? 1 : 0;
+    }
+    return esp_transport_poll_read(esp_transport_get_context_data(t), timeout_ms);
+}
+
+static int impair_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    return esp_transport_poll_write(esp_transport_get_context_data(t), timeout_ms);
+}
+
+static int impair_close(esp_transport_handle_t t)
+{
+    hold_reset();
+    return esp_transport_close(esp_transport_get_context_data(t));
+}
+
+static int impair_destroy(esp_transport_handle_t t)
+{
+    esp_transport_destroy(esp_transport_get_context_data(t));
+    return 0;
+}
+
+esp_transport_handle_t net_impair_wrap(esp_transport_handle_t inner)
+{
+    esp_transport_handle_t t = esp_transport_init();
+    if (t == NULL) {
+        ESP_LOGE(TAG, "No memory for the impairing transport, link left as is");
+        return inner;
+    }
+    esp_transport_set_context_data(t, inner);
+    esp_transport_set_default_port(t, esp_transport_get_default_port(inner));
+    esp_transport_set_func(t, impair_connect, impair_read, impair_write, impair_close,
+                           impair_poll_read, impair_poll_write, impair_destroy);
+
+    net_impair_cfg_t cfg;
+    net_impair_get(&cfg);
+    ESP_LOGW(TAG, "Link impaired: %lu+%lu ms, %lu kbit/s, stalls %u/1000 of %lu ms, cuts %u/1000",
+             (unsigned long)cfg.latency_ms, (unsigned long)cfg.jitter_ms, (unsigned long)cfg.rate_kbps,
+             cfg.stall_permille, (unsigned long)cfg.stall_ms, cfg.cut_permille);
+    return t;
+}
+
+void net_impair_set(const net_impair_cfg_t *cfg)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_cfg = *cfg;
+    s_cfg.stall_permille = cfg->stall_permille > 1000 ? 1000 : cfg->stall_permille;
+    s_cfg.cut_permille = cfg->cut_permille > 1000 ? 1000 : cfg->cut_permille;
+    s_rng = CONFIG_APP_NET_IMPAIR_SEED;
+    s_link_free_us = 0;
+    s_far_us = 0;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void net_impair_get(net_impair_cfg_t *cfg)
+{
+    portENTER_CRITICAL(&s_lock);
+    *cfg = s_cfg;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void net_impair_get_stats(net_impair_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+#endif // CONFIG_APP_NET_IMPAIR
@@ -0,0 +1,104 @@
+/* Network Impairment Header
+ *
+ * Bad-link emulation for benchmark and resilience builds. The transport
+ * handed to the MQTT client is wrapped in one that adds, on top of the
+ * real link:
+ *
+ *   latency     one-way delay per packet and direction, plus a uniform
+ *               jitter of up to jitter_ms; inbound data is held back
+ *               until due, and a reply never comes before the request
+ *               it answers has reached the far end
+ *   bandwidth   both directions share a link of rate_kbps; a transfer
+ *               waits until the previous ones would have left it, and
+ *               only this holds a writer back
+ *   stalls      with probability stall_permille per transfer, stall_ms
+ *               more on its way, as when TCP waits out a retransmission
+ *               timeout
+ *   cuts        with probability cut_permille per write, only part of the
+ *               buffer is written and the connection is closed, so the
+ *               broker sees a packet end mid-way
+ *
+ * The random decisions come from a generator seeded with
+ * CONFIG_APP_NET_IMPAIR_SEED on every net_impair_set(), so a run with the
+ * same traffic sees the same impairments. Reconnect time, retransmissions
+ * and outbox growth under them show in the MQTT stats and the bench
+ * reports. The wrapper only uses the esp_transport API, so it also runs
+ * on the linux target. Built only with CONFIG_APP_NET_IMPAIR.
+ */
+
+#ifndef NET_IMPAIR_H
+#define NET_IMPAIR_H
+
+#include "esp_transport.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Impairments applied to the wrapped transport
+ */
+typedef struct {
+    uint32_t latency_ms;        // One-way delay per transfer
+    uint32_t jitter_ms;         // Up to this much more, uniform
+    uint32_t rate_kbps;         // Link rate, 0 unlimited
+    uint16_t stall_permille;    // Transfers followed by a stall
+    uint32_t stall_ms;          // Length of a stall
+    uint16_t cut_permille;      // Writes that end the connection mid-packet
+} net_impair_cfg_t;
+
+/**
+ * @brief Impairment counters since boot
+ */
+typedef struct {
+    uint32_t delayed_ms;        // Time added by latency, jitter and the rate cap
+    uint32_t stalls;
+    uint32_t cuts;
+} net_impair_stats_t;
+
+#if CONFIG_APP_NET_IMPAIR
+
+/**
+ * @brief Wrap a transport in the impairing one
+ *
+ * The MQTT client owns the result; destroying it destroys inner. Set up
+ * with the Kconfig defaults the first time.
+ *
+ * @param inner Transport doing the real I/O
+ * @return The wrapper, or inner if it could not be allocated
+ */
+esp_transport_handle_t net_impair_wrap(esp_transport_handle_t inner);
+
+/**
+ * @brief Change the impairments and reseed the generator
+ *
+ * Applies from the next transfer.
+ */
+void net_impair_set(const net_impair_cfg_t *cfg);
+
+/**
+ * @brief Current impairments
+ */
+void net_impair_get(net_impair_cfg_t *cfg);
+
+/**
+ * @brief Snapshot of the counters
+ */
+void net_impair_get_stats(net_impair_stats_t *stats);
+
+#else
+
+static inline esp_transport_handle_t net_impair_wrap(esp_transport_handle_t inner) { return inner; }
+static inline void net_impair_set(const net_impair_cfg_t *cfg) {}
+static inline void net_impair_get(net_impair_cfg_t *cfg) { *cfg = (net_impair_cfg_t){0}; }
+static inline void net_impair_get_stats(net_impair_stats_t *stats) { *stats = (net_impair_stats_t){0}; }
+
+#endif // CONFIG_APP_NET_IMPAIR
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NET_IMPAIR_H
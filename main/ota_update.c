@@ -0,0 +1,854 @@
+/* OTA Update Implementation
+ *
+ * The producer (the HTTPS download on the ota task, or the MQTT task for
+ * a pushed image) copies into one buffer while the writer task erases and
+ * writes the other; buffer indices travel through two queues. The writer
+ * also hashes what it writes, so the download itself only copies.
+ *
+ * The MQTT task never waits for the writer: a pushed chunk that finds both
+ * buffers taken is cut where the data stopped fitting, and the ota task
+ * asks the sender to resend from there once a buffer is free again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include "ota_update.h"
+#include "backend_client.h"
+#include "certificate_manager.h"
+#include "json_view.h"
+#include "mqtt_handler.h"
+#include "mqtt_worker.h"
+#include "remote_config.h"
+#include "esp_app_desc.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mbedtls/sha256.h"
+#include "sdkconfig.h"
+#if CONFIG_APP_OTA_SIGNED
+#include "mbedtls/base64.h"
+#include "mbedtls/pk.h"
+#endif
+#if CONFIG_APP_OTA_DELTA
+#include "esp_delta_ota.h"
+#endif
+
+#if CONFIG_APP_OTA
+
+static const char *TAG = "ota_update";
+
+#define OTA_BUF_SIZE        CONFIG_APP_OTA_BUF_SIZE
+#define OTA_BUFS            2
+#define OTA_END             (-1)        // Writer queue sentinel
+#define OTA_URL_MAX         REMOTE_CONFIG_STR_MAX
+#define OTA_VERSION_MAX     32
+#define OTA_TOPIC_MAX       96
+#define OTA_HEADER_LEN      4           // Image offset in front of each pushed message
+#define STREAM_TIMEOUT_MS   (CONFIG_APP_OTA_STREAM_TIMEOUT_S * 1000)
+#define CMD_TOKENS          16
+#define OTA_SIG_MAX         384         // RSA-3072, or a DER ECDSA signature
+#define RESEND_HOLDOFF_US   (2 * 1000000)
+
+typedef struct {
+    bool push;                          // Image arrives over MQTT instead of HTTPS
+    bool delta;                         // A detools patch against the running image
+    char url[OTA_URL_MAX];
+    char version[OTA_VERSION_MAX];
+    uint32_t size;                      // Bytes transferred, 0 when unknown (HTTPS only)
+    uint8_t sha256[32];                 // Of the resulting image, also for a patch
+#if CONFIG_APP_OTA_SIGNED
+    uint8_t sig[OTA_SIG_MAX];           // Over sha256, checked against the embedded key
+    size_t sig_len;
+#endif
+} ota_job_t;
+
+static ota_job_t s_job;
+static volatile bool s_busy = false;    // A job owns the pipeline
+static char s_status_topic[OTA_TOPIC_MAX];
+
+// Pipeline, valid while s_busy
+static uint8_t *s_buf[OTA_BUFS];
+static size_t s_len[OTA_BUFS];
+static QueueHandle_t s_free_q = NULL;   // Buffers the producer may fill
+static QueueHandle_t s_full_q = NULL;   // Buffers for the writer, then OTA_END
+static SemaphoreHandle_t s_write_done = NULL;
+static SemaphoreHandle_t s_push_done = NULL;    // Pushed image complete or failed
+static SemaphoreHandle_t s_feed_lock = NULL;    // Producer side: MQTT task vs. ota task
+static int s_fill = -1;                 // Buffer being filled, -1 for none
+static uint32_t s_received = 0;
+static bool s_accepting = false;        // Pushed chunks are taken (under s_feed_lock)
+static uint32_t s_skip = 0;             // Bytes of the current pushed message already received
+static volatile bool s_resend = false;  // Pushed data was dropped, ask for it from s_received
+static volatile esp_err_t s_write_err = ESP_OK;
+static volatile esp_err_t s_stream_err = ESP_OK;
+static esp_ota_handle_t s_ota = 0;
+static mbedtls_sha256_context s_sha;
+
+#if CONFIG_APP_OTA_DELTA
+static const esp_partition_t *s_source = NULL;  // Patch base
+static esp_delta_ota_handle_t s_delta = NULL;
+#endif
+
+static bool s_pending = false;          // Running image not yet accepted
+static esp_timer_handle_t s_verify_timer = NULL;
+
+#if CONFIG_APP_OTA_SIGNED
+// CONFIG_APP_OTA_SIGNING_KEY, embedded by main/CMakeLists.txt (NUL-terminated)
+extern const uint8_t ota_signing_key_start[] asm("_binary_ota_signing_key_pem_start");
+extern const uint8_t ota_signing_key_end[] asm("_binary_ota_signing_key_pem_end");
+#endif
+
+static void publish_status(const char *state, esp_err_t err)
+{
+    char body[160];
+    int len;
+    if (err != ESP_OK) {
+        len = snprintf(body, sizeof(body), "{\"state\":\"%s\",\"version\":\"%s\",\"error\":\"%s\"}",
+                       state, s_job.version, esp_err_to_name(err));
+    } else {
+        len = snprintf(body, sizeof(body), "{\"state\":\"%s\",\"version\":\"%s\"}", state, s_job.version);
+    }
+    if (len > 0 && (size_t)len < sizeof(body)) {
+        mqtt_handler_publish(s_status_topic, body, len, 1);
+    }
+}
+
+static void publish_resend(uint32_t offset)
+{
+    char body[96];
+    int len = snprintf(body, sizeof(body), "{\"state\":\"resend\",\"version\":\"%s\",\"offset\":%lu}",
+                       s_job.version, (unsigned long)offset);
+    if (len > 0 && (size_t)len < sizeof(body)) {
+        mqtt_handler_publish(s_status_topic, body, len, 1);
+    }
+}
+
+/**
+ * @brief Copy into the fill buffer, handing full buffers to the writer
+ *
+ * Waits up to wait for the writer to give a buffer back, which holds an
+ * HTTPS download back to the speed of the flash. On ESP_ERR_TIMEOUT what
+ * fit has been taken; s_received says how much.
+ */
+static esp_err_t pipe_feed(const uint8_t *data, size_t len, TickType_t wait)
+{
+    while (len > 0) {
+        if (s_write_err != ESP_OK) {
+            return s_write_err;
+        }
+        if (s_fill < 0) {
+            if (xQueueReceive(s_free_q, &s_fill, wait) != pdTRUE) {
+                s_fill = -1;
+                return ESP_ERR_TIMEOUT;
+            }
+            s_len[s_fill] = 0;
+        }
+        size_t n = MIN(len, OTA_BUF_SIZE - s_len[s_fill]);
+        memcpy(s_buf[s_fill] + s_len[s_fill], data, n);
+        s_len[s_fill] += n;
+        s_received += n;
+        data += n;
+        len -= n;
+        if (s_len[s_fill] == OTA_BUF_SIZE) {
+            xQueueSend(s_full_q, &s_fill, portMAX_DELAY);  // Never full: OTA_BUFS + 1 slots
+            s_fill = -1;
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Hand over the partial buffer and wait for the writer to finish
+ */
+static esp_err_t pipe_close(void)
+{
+    if (s_fill >= 0 && s_len[s_fill] > 0) {
+        xQueueSend(s_full_q, &s_fill, portMAX_DELAY);
+    }
+    s_fill = -1;
+    int end = OTA_END;
+    xQueueSend(s_full_q, &end, portMAX_DELAY);
+    xSemaphoreTake(s_write_done, portMAX_DELAY);
+    return s_write_err;
+}
+
+/**
+ * @brief Write image data to the passive slot and hash it
+ *
+ * Sequential writes: each sector is erased as the write reaches it.
+ */
+static esp_err_t image_write(const uint8_t *data, size_t len)
+{
+    esp_err_t err = esp_ota_write(s_ota, data, len);
+    if (err == ESP_OK) {
+        mbedtls_sha256_update(&s_sha, data, len);
+    }
+    return err;
+}
+
+#if CONFIG_APP_OTA_DELTA
+static esp_err_t delta_read(uint8_t *buf, size_t size, int offset)
+{
+    return esp_partition_read(s_source, offset, buf, size);
+}
+
+static esp_err_t delta_write(const uint8_t *buf, size_t size, void *user_data)
+{
+    return image_write(buf, size);
+}
+#endif
+
+static void writer_task(void *arg)
+{
+    int idx;
+    while (xQueueReceive(s_full_q, &idx, portMAX_DELAY) == pdTRUE && idx != OTA_END) {
+        if (s_write_err == ESP_OK) {
+#if CONFIG_APP_OTA_DELTA
+            // The patch is decoded here too, so decoding overlaps the download
+            if (s_delta != NULL) {
+                s_write_err = esp_delta_ota_feed_patch(s_delta, s_buf[idx], s_len[idx]);
+            } else
+#endif
+            {
+                s_write_err = image_write(s_buf[idx], s_len[idx]);
+            }
+        }
+        xQueueSend(s_free_q, &idx, 0);
+    }
+#if CONFIG_APP_OTA_DELTA
+    if (s_delta != NULL && s_write_err == ESP_OK) {
+        s_write_err = esp_delta_ota_finalize(s_delta);
+    }
+#endif
+    xSemaphoreGive(s_write_done);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t pipe_create(void)
+{
+    s_free_q = xQueueCreate(OTA_BUFS, sizeof(int));
+    s_full_q = xQueueCreate(OTA_BUFS + 1, sizeof(int));
+    s_write_done = xSemaphoreCreateBinary();
+    s_push_done = xSemaphoreCreateBinary();
+    if (s_free_q == NULL || s_full_q == NULL || s_write_done == NULL || s_push_done == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < OTA_BUFS; i++) {
+        s_buf[i] = malloc(OTA_BUF_SIZE);
+        if (s_buf[i] == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        xQueueSend(s_free_q, &i, 0);
+    }
+    s_fill = -1;
+    s_received = 0;
+    s_skip = 0;
+    s_resend = false;
+    s_write_err = ESP_OK;
+    s_stream_err = ESP_OK;
+    return ESP_OK;
+}
+
+static void pipe_free(void)
+{
+    for (int i = 0; i < OTA_BUFS; i++) {
+        free(s_buf[i]);
+        s_buf[i] = NULL;
+    }
+    if (s_free_q != NULL) {
+        vQueueDelete(s_free_q);
+        s_free_q = NULL;
+    }
+    if (s_full_q != NULL) {
+        vQueueDelete(s_full_q);
+        s_full_q = NULL;
+    }
+    if (s_write_done != NULL) {
+        vSemaphoreDelete(s_write_done);
+        s_write_done = NULL;
+    }
+    if (s_push_done != NULL) {
+        vSemaphoreDelete(s_push_done);
+        s_push_done = NULL;
+    }
+#if CONFIG_APP_OTA_DELTA
+    if (s_delta != NULL) {
+        esp_delta_ota_deinit(s_delta);
+        s_delta = NULL;
+    }
+#endif
+}
+
+static esp_err_t http_event_handler(esp_http_client_event_t *evt)
+{
+    if (evt->event_id != HTTP_EVENT_ON_DATA || s_stream_err != ESP_OK) {
+        return ESP_OK;
+    }
+    if (esp_http_client_get_status_code(evt->client) != 200) {
+        return ESP_OK;      // Error body, reported by status
+    }
+    if (s_job.size != 0 && s_received + evt->data_len > s_job.size) {
+        s_stream_err = ESP_ERR_INVALID_SIZE;
+        return ESP_OK;
+    }
+    // A failed write is reported after the request, the rest is drained
+    s_stream_err = pipe_feed(evt->data, evt->data_len, pdMS_TO_TICKS(STREAM_TIMEOUT_MS));
+    return ESP_OK;
+}
+
+static esp_err_t download(void)
+{
+    char url[OTA_URL_MAX + 32];
+    if (s_job.url[0] == '/') {
+        char backend_url[REMOTE_CONFIG_STR_MAX];
+        remote_config_get_str(REMOTE_CONFIG_BACKEND_URL, backend_url, sizeof(backend_url));
+        snprintf(url, sizeof(url), "%s%s", backend_url, s_job.url);
+    } else {
+        strlcpy(url, s_job.url, sizeof(url));
+    }
+
+    backend_request_t request = {
+        .url = url,
+        .method = HTTP_METHOD_GET,
+        .use_global_ca_store = certificate_manager_init_ca_store() == ESP_OK,
+        .timeout_ms = STREAM_TIMEOUT_MS,
+        .event_handler = http_event_handler,
+    };
+#ifdef CONFIG_ESP_TLS_SKIP_SERVER_CERT_VERIFY
+    request.skip_cert_common_name_check = true;
+#endif
+
+    int status = 0;
+    esp_err_t err = backend_client_perform(&request, &status, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (status != 200) {
+        ESP_LOGE(TAG, "Image download failed with status %d", status);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return s_stream_err;
+}
+
+/**
+ * @brief Wait for a pushed image, asking for dropped data again, giving up when it stalls
+ */
+static esp_err_t receive_push(void)
+{
+    uint32_t seen = 0;
+    int64_t progress_us = esp_timer_get_time();
+    uint32_t asked = UINT32_MAX;        // Offset of the last resend request
+    int64_t asked_us = 0;
+    for (;;) {
+        xSemaphoreTake(s_push_done, pdMS_TO_TICKS(STREAM_TIMEOUT_MS));
+        if (s_resend) {
+            // Ask again once the writer has a buffer back, not while it is still full
+            int idx;
+            xQueuePeek(s_free_q, &idx, pdMS_TO_TICKS(STREAM_TIMEOUT_MS));
+        }
+        xSemaphoreTake(s_feed_lock, portMAX_DELAY);
+        uint32_t received = s_received;
+        esp_err_t err = s_stream_err;
+        bool resend = s_resend;
+        s_resend = false;
+        int64_t now = esp_timer_get_time();
+        if (received != seen) {
+            seen = received;
+            progress_us = now;
+        }
+        bool stalled = now - progress_us >= (int64_t)STREAM_TIMEOUT_MS * 1000;
+        if (err != ESP_OK || received >= s_job.size || stalled) {
+            s_accepting = false;
+        }
+        xSemaphoreGive(s_feed_lock);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (received >= s_job.size) {
+            return ESP_OK;
+        }
+        if (stalled) {
+            ESP_LOGE(TAG, "Pushed image stalled at %lu of %lu bytes", (unsigned long)received,
+                     (unsigned long)s_job.size);
+            return ESP_ERR_TIMEOUT;
+        }
+        // Messages still in flight from before a request each ask again: once per offset and holdoff
+        if (resend && (received != asked || now - asked_us >= RESEND_HOLDOFF_US)) {
+            ESP_LOGD(TAG, "Asking for the image again from %lu", (unsigned long)received);
+            publish_resend(received);
+            asked = received;
+            asked_us = now;
+        }
+    }
+}
+
+#if CONFIG_APP_OTA_SIGNED
+/**
+ * @brief Check the command's signature over the image digest with the embedded key
+ */
+static esp_err_t verify_signature(const uint8_t *digest)
+{
+    mbedtls_pk_context pk;
+    mbedtls_pk_init(&pk);
+    int ret = mbedtls_pk_parse_public_key(&pk, ota_signing_key_start, ota_signing_key_end - ota_signing_key_start);
+    if (ret == 0) {
+        ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, 32, s_job.sig, s_job.sig_len);
+    }
+    mbedtls_pk_free(&pk);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Image signature rejected: -0x%04x", (unsigned)-ret);
+        return ESP_ERR_NOT_ALLOWED;
+    }
+    return ESP_OK;
+}
+#endif
+
+static esp_err_t run_update(void)
+{
+    const esp_partition_t *part = esp_ota_get_next_update_partition(NULL);
+    if (part == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (s_job.size > part->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t err = pipe_create();
+    if (err != ESP_OK) {
+        return err;
+    }
+    // Only the first sector is erased here, the rest as the writes arrive
+    err = esp_ota_begin(part, OTA_WITH_SEQUENTIAL_WRITES, &s_ota);
+    if (err != ESP_OK) {
+        return err;
+    }
+#if CONFIG_APP_OTA_DELTA
+    if (s_job.delta) {
+        s_source = esp_ota_get_running_partition();
+        esp_delta_ota_cfg_t cfg = {
+            .read_cb = delta_read,
+            .write_cb_with_user_data = delta_write,
+        };
+        s_delta = esp_delta_ota_init(&cfg);
+        if (s_delta == NULL) {
+            esp_ota_abort(s_ota);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+#endif
+    mbedtls_sha256_init(&s_sha);
+    mbedtls_sha256_starts(&s_sha, 0);
+    if (xTaskCreate(writer_task, "ota_write", CONFIG_APP_OTA_WRITE_STACK, NULL, tskIDLE_PRIORITY + 3, NULL) != pdPASS) {
+        esp_ota_abort(s_ota);
+        mbedtls_sha256_free(&s_sha);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Updating %s to %s from %s%s", part->label, s_job.version, s_job.push ? "MQTT" : s_job.url,
+             s_job.delta ? " (patch)" : "");
+    publish_status("downloading", ESP_OK);
+    int64_t start_us = esp_timer_get_time();
+
+    if (s_job.push) {
+        xSemaphoreTake(s_feed_lock, portMAX_DELAY);
+        s_accepting = true;
+        xSemaphoreGive(s_feed_lock);
+        err = receive_push();
+        xSemaphoreTake(s_feed_lock, portMAX_DELAY);     // Lets a chunk in progress finish
+    } else {
+        err = download();
+    }
+    esp_err_t close_err = pipe_close();
+    if (s_job.push) {
+        xSemaphoreGive(s_feed_lock);
+    }
+    if (err == ESP_OK) {
+        err = close_err;
+    }
+    if (err == ESP_OK && s_job.size != 0 && s_received != s_job.size) {
+        ESP_LOGE(TAG, "Image is %lu bytes, expected %lu", (unsigned long)s_received, (unsigned long)s_job.size);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&s_sha, digest);
+    mbedtls_sha256_free(&s_sha);
+    if (err == ESP_OK && memcmp(digest, s_job.sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "Image SHA-256 mismatch");
+        err = ESP_ERR_INVALID_CRC;
+    }
+#if CONFIG_APP_OTA_SIGNED
+    if (err == ESP_OK) {
+        err = verify_signature(digest);
+    }
+#endif
+
+    if (err != ESP_OK) {
+        esp_ota_abort(s_ota);
+        return err;
+    }
+    // Checks the image header, segments and, with SECURE_SIGNED_ON_UPDATE, the app signature
+    err = esp_ota_end(s_ota);
+    if (err == ESP_OK) {
+        err = esp_ota_set_boot_partition(part);
+    }
+    if (err == ESP_OK) {
+        int64_t ms = (esp_timer_get_time() - start_us) / 1000;
+        ESP_LOGI(TAG, "Received %lu bytes in %lld ms (%lld KB/s)", (unsigned long)s_received, ms,
+                 ms > 0 ? (long long)s_received / ms : 0);
+    }
+    return err;
+}
+
+static void ota_task(void *arg)
+{
+    esp_err_t err = run_update();
+    pipe_free();
+    if (err == ESP_OK) {
+        ESP_LOGW(TAG, "Update to %s written, restarting", s_job.version);
+        publish_status("rebooting", ESP_OK);
+        vTaskDelay(pdMS_TO_TICKS(1000));    // Let the status go out
+        esp_restart();
+    }
+    ESP_LOGE(TAG, "Update to %s failed: %s", s_job.version, esp_err_to_name(err));
+    publish_status("failed", err);
+    s_busy = false;
+    vTaskDelete(NULL);
+}
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Host of an absolute URL, as a span of url (without port or userinfo cut off)
+ */
+static bool url_host(const char *url, const char **host, size_t *len)
+{
+    const char *p = strstr(url, "://");
+    if (p == NULL) {
+        return false;
+    }
+    *host = p + 3;
+    *len = strcspn(*host, ":/?#");
+    return *len > 0;
+}
+
+/**
+ * @brief Whether an update URL may be fetched
+ *
+ * A path goes to the backend. An absolute URL must be https:// and name
+ * the backend's host or one of CONFIG_APP_OTA_URL_HOSTS; "user@host" never
+ * matches.
+ */
+static bool url_allowed(const char *url)
+{
+    if (url[0] == '/') {
+        return true;
+    }
+    const char *host;
+    size_t len;
+    if (strncmp(url, "https://", 8) != 0 || !url_host(url, &host, &len)) {
+        return false;
+    }
+
+    char backend[REMOTE_CONFIG_STR_MAX];
+    const char *b;
+    size_t blen;
+    if (remote_config_get_str(REMOTE_CONFIG_BACKEND_URL, backend, sizeof(backend)) == ESP_OK &&
+        url_host(backend, &b, &blen) && blen == len && strncasecmp(b, host, len) == 0) {
+        return true;
+    }
+    for (const char *p = CONFIG_APP_OTA_URL_HOSTS; *p != '\0'; ) {
+        size_t n = strcspn(p, ",");
+        if (n == len && strncasecmp(p, host, len) == 0) {
+            return true;
+        }
+        p += n;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return false;
+}
+
+static bool parse_sha256(const char *hex, uint8_t *out)
+{
+    if (strlen(hex) != 64) {
+        return false;
+    }
+    for (int i = 0; i < 32; i++) {
+        int hi = hex_nibble(hex[2 * i]);
+        int lo = hex_nibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
+
+static esp_err_t cmd_message(const mqtt_handler_msg_t *msg, void *ctx)
+{
+    if (msg->offset != 0 || msg->len != msg->total_len) {
+        ESP_LOGW(TAG, "Command of %d bytes ignored", msg->total_len);
+        return ESP_FAIL;
+    }
+    json_view_tok_t toks[CMD_TOKENS];
+    json_view_t view;
+    if (json_view_parse(&view, msg->data, msg->len, toks, CMD_TOKENS) != ESP_OK) {
+        ESP_LOGW(TAG, "Malformed command ignored");
+        return ESP_OK;
+    }
+    if (s_busy) {
+        ESP_LOGW(TAG, "Update to %s in progress, command ignored", s_job.version);
+        return ESP_OK;
+    }
+
+    ota_job_t job = {0};
+    char sha[72] = {0};
+    int64_t size = 0;
+    int tok = json_view_get(&view, 0, "version");
+    if (tok < 0 || json_view_str_copy(&view, tok, job.version, sizeof(job.version)) < 0) {
+        ESP_LOGW(TAG, "Command without version ignored");
+        return ESP_OK;
+    }
+    tok = json_view_get(&view, 0, "sha256");
+    if (tok < 0 || json_view_str_copy(&view, tok, sha, sizeof(sha)) < 0 || !parse_sha256(sha, job.sha256)) {
+        ESP_LOGW(TAG, "Command without a valid sha256 ignored");
+        return ESP_OK;
+    }
+#if CONFIG_APP_OTA_SIGNED
+    char sig[(OTA_SIG_MAX + 2) / 3 * 4 + 1];
+    tok = json_view_get(&view, 0, "sig");
+    int sig_len = tok < 0 ? -1 : json_view_str_copy(&view, tok, sig, sizeof(sig));
+    if (sig_len <= 0 || mbedtls_base64_decode(job.sig, sizeof(job.sig), &job.sig_len,
+                                              (const unsigned char *)sig, sig_len) != 0) {
+        ESP_LOGW(TAG, "Command without a valid sig ignored");
+        return ESP_OK;
+    }
+#endif
+    tok = json_view_get(&view, 0, "size");
+    if (tok >= 0 && (json_view_int(&view, tok, &size) != ESP_OK || size <= 0 || size > UINT32_MAX)) {
+        ESP_LOGW(TAG, "Command with invalid size ignored");
+        return ESP_OK;
+    }
+    job.size = (uint32_t)size;
+    tok = json_view_get(&view, 0, "url");
+    if (tok >= 0) {
+        if (json_view_str_copy(&view, tok, job.url, sizeof(job.url)) <= 0) {
+            ESP_LOGW(TAG, "Command with invalid url ignored");
+            return ESP_OK;
+        }
+        if (!url_allowed(job.url)) {
+            ESP_LOGW(TAG, "Update URL %s is not on an allowed host", job.url);
+            s_job = job;
+            publish_status("failed", ESP_ERR_NOT_ALLOWED);
+            return ESP_OK;
+        }
+    } else if (job.size == 0) {
+        ESP_LOGW(TAG, "Pushed update without size ignored");
+        return ESP_OK;
+    } else {
+        job.push = true;
+    }
+
+    bool delta = false;
+    tok = json_view_get(&view, 0, "delta");
+    if (tok >= 0 && json_view_bool(&view, tok, &delta) != ESP_OK) {
+        ESP_LOGW(TAG, "Command with invalid delta ignored");
+        return ESP_OK;
+    }
+    job.delta = delta;
+
+    const char *running = esp_app_get_description()->version;
+    if (strcmp(job.version, running) == 0) {
+        ESP_LOGI(TAG, "Already running %s", job.version);
+        s_job = job;
+        publish_status("current", ESP_OK);
+        return ESP_OK;
+    }
+    if (job.delta) {
+        // A patch only applies to the exact image it was made from
+        tok = json_view_get(&view, 0, "from");
+        esp_err_t err = ESP_OK;
+#if CONFIG_APP_OTA_DELTA
+        if (tok < 0 || !json_view_str_eq(&view, tok, running)) {
+            err = ESP_ERR_INVALID_VERSION;
+        }
+#else
+        err = ESP_ERR_NOT_SUPPORTED;
+#endif
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Patch to %s does not apply to %s", job.version, running);
+            s_job = job;
+            publish_status("failed", err);
+            return ESP_OK;
+        }
+    }
+
+    s_job = job;
+    s_busy = true;
+    if (xTaskCreate(ota_task, "ota", CONFIG_APP_OTA_TASK_STACK, NULL, tskIDLE_PRIORITY + 2, NULL) != pdPASS) {
+        s_busy = false;
+        publish_status("failed", ESP_ERR_NO_MEM);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Take a pushed chunk on the MQTT task
+ *
+ * Never blocks: with the lock or both buffers taken, the chunk is dropped
+ * from where it stopped fitting and the ota task asks for it again. Data
+ * the device already has (QoS 1 redelivery, a resend overlapping what was
+ * taken) is skipped, and a message starting past s_received, one sent
+ * before the resend request arrived, is dropped the same way.
+ */
+static esp_err_t image_message(const mqtt_handler_msg_t *msg, void *ctx)
+{
+    const uint8_t *data = (const uint8_t *)msg->data;
+    size_t len = msg->len;
+    esp_err_t err = ESP_OK;
+
+    if (xSemaphoreTake(s_feed_lock, 0) != pdTRUE) {
+        if (s_accepting) {
+            s_resend = true;
+            xSemaphoreGive(s_push_done);
+        }
+        return ESP_FAIL;
+    }
+    if (!s_busy || !s_job.push || !s_accepting || s_stream_err != ESP_OK) {
+        err = ESP_FAIL;     // Not expecting an image: drop the rest of the message
+        goto out;
+    }
+    if (msg->offset == 0) {
+        if (len < OTA_HEADER_LEN) {
+            s_stream_err = err = ESP_ERR_INVALID_SIZE;
+            goto out;
+        }
+        uint32_t at = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+        data += OTA_HEADER_LEN;
+        len -= OTA_HEADER_LEN;
+        if (at > s_received) {
+            ESP_LOGD(TAG, "Chunk at %lu, expected %lu", (unsigned long)at, (unsigned long)s_received);
+            s_resend = true;
+            err = ESP_FAIL;
+            goto out;
+        }
+        s_skip = s_received - at;
+    }
+    if (s_skip >= len) {
+        s_skip -= len;
+        goto out;
+    }
+    data += s_skip;
+    len -= s_skip;
+    s_skip = 0;
+    if (s_received + len > s_job.size) {
+        s_stream_err = err = ESP_ERR_INVALID_SIZE;
+        goto out;
+    }
+    err = pipe_feed(data, len, 0);
+    if (err == ESP_ERR_TIMEOUT) {
+        s_resend = true;
+        err = ESP_FAIL;
+    } else if (err != ESP_OK) {
+        s_stream_err = err;
+    }
+out:
+    if (s_accepting && (s_stream_err != ESP_OK || s_received == s_job.size || s_resend)) {
+        xSemaphoreGive(s_push_done);
+    }
+    xSemaphoreGive(s_feed_lock);
+    return err;
+}
+
+static void verify_timeout(void *arg)
+{
+    ESP_LOGE(TAG, "New image did not reach the broker in %d s, rolling back", CONFIG_APP_OTA_VERIFY_TIMEOUT_S);
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+
+esp_err_t ota_update_init(void)
+{
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY) {
+        return ESP_OK;
+    }
+
+    s_pending = true;
+    ESP_LOGW(TAG, "Running %s from %s on probation", esp_app_get_description()->version, running->label);
+    const esp_timer_create_args_t args = {
+        .callback = verify_timeout,
+        .name = "ota_verify",
+    };
+    esp_err_t err = esp_timer_create(&args, &s_verify_timer);
+    if (err == ESP_OK) {
+        err = esp_timer_start_once(s_verify_timer, (uint64_t)CONFIG_APP_OTA_VERIFY_TIMEOUT_S * 1000000);
+    }
+    return err;
+}
+
+void ota_update_mark_valid(void)
+{
+    if (!s_pending) {
+        return;
+    }
+    s_pending = false;
+    if (s_verify_timer != NULL) {
+        esp_timer_stop(s_verify_timer);
+        esp_timer_delete(s_verify_timer);
+        s_verify_timer = NULL;
+    }
+    if (esp_ota_mark_app_valid_cancel_rollback() == ESP_OK) {
+        ESP_LOGI(TAG, "Image %s marked valid", esp_app_get_description()->version);
+    }
+}
+
+esp_err_t ota_update_start_remote(const char *device_id)
+{
+    if (s_feed_lock != NULL) {
+        return ESP_OK;
+    }
+    char cmd_topic[OTA_TOPIC_MAX];
+    char image_topic[OTA_TOPIC_MAX];
+    int n = snprintf(s_status_topic, sizeof(s_status_topic), "ota/%s/status", device_id);
+    if (n < 0 || (size_t)n >= sizeof(s_status_topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    snprintf(cmd_topic, sizeof(cmd_topic), "ota/%s", device_id);
+    snprintf(image_topic, sizeof(image_topic), "ota/%s/image", device_id);
+
+    s_feed_lock = xSemaphoreCreateMutex();
+    if (s_feed_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    // Commands publish a status, so they run on a worker; image chunks
+    // stream straight off the MQTT task into the pipeline
+    esp_err_t err = mqtt_worker_subscribe(cmd_topic, 1, cmd_message, NULL);
+    if (err == ESP_OK) {
+        err = mqtt_handler_subscribe(image_topic, 1, image_message, NULL);
+    }
+    if (err != ESP_OK) {
+        mqtt_handler_unsubscribe(cmd_topic);
+        vSemaphoreDelete(s_feed_lock);
+        s_feed_lock = NULL;
+    }
+    return err;
+}
+
+#endif // CONFIG_APP_OTA
@@ -0,0 +1,81 @@
+/* OTA Update Header
+ *
+ * Firmware updates into the passive slot of the two-slot layout in
+ * partitions.csv, triggered by a JSON command on ota/<device_id>:
+ *
+ *   {"version":"1.4.0","sha256":"<64 hex>","sig":"<base64>","url":"https://..."}
+ *   {"version":"1.4.0","sha256":"<64 hex>","sig":"<base64>","size":1003520}
+ *
+ * With CONFIG_APP_OTA_SIGNED "sig" is required: the signature of the image
+ * SHA-256 under CONFIG_APP_OTA_SIGNING_KEY, checked before the new slot is
+ * made bootable.
+ *
+ * With "url" the image is downloaded over HTTPS on the backend client (a
+ * path starting with "/" is taken relative to the backend URL; absolute
+ * URLs must be https:// on the backend host or one of
+ * CONFIG_APP_OTA_URL_HOSTS). Without it the image is pushed over MQTT on
+ * ota/<device_id>/image, in messages that each start with the 4-byte
+ * big-endian image offset of their data. Data the device already has is
+ * skipped. The MQTT task does not wait for the flash: what does not fit in
+ * a free buffer is dropped, and the status topic gets
+ * {"state":"resend","offset":N} asking for the image from N again. "size"
+ * is required for the MQTT push.
+ *
+ * With "delta":true the transfer is a detools patch (heatshrink
+ * compressed) against the running image, whose version must equal "from";
+ * it is decoded on the fly into the passive slot, reading the base from the
+ * running slot, so neither image is held in RAM. "size" then counts patch
+ * bytes and "sha256" is still that of the resulting image.
+ *
+ * Download and flash writes overlap: two CONFIG_APP_OTA_BUF_SIZE buffers
+ * alternate between the network and a writer task, so a sector is erased
+ * and written while the next one is received. The image is checked against
+ * "sha256", "sig" and by esp_ota_end() before it is made bootable. Progress and
+ * the outcome are published on ota/<device_id>/status.
+ *
+ * A new image boots pending verification and is marked valid once it
+ * reaches the broker. If it resets before that, or does not get there
+ * within CONFIG_APP_OTA_VERIFY_TIMEOUT_S, the bootloader returns to the
+ * previous image.
+ *
+ * Built only with CONFIG_APP_OTA.
+ */
+
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Arm the rollback timer when the running image is on probation
+ *
+ * Call once at boot, before the network comes up.
+ */
+esp_err_t ota_update_init(void);
+
+/**
+ * @brief Subscribe to update commands and pushed images for a device ID
+ *
+ * Repeated calls are no-ops.
+ *
+ * @return ESP_OK, or the error from mqtt_handler_subscribe()
+ */
+esp_err_t ota_update_start_remote(const char *device_id);
+
+/**
+ * @brief Accept the running image and cancel the rollback
+ *
+ * Call when the application is known to work (connected to the broker).
+ * Does nothing for an image that is already valid.
+ */
+void ota_update_mark_valid(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // OTA_UPDATE_H
@@ -0,0 +1,143 @@
+/* Payload Compression Implementation
+ *
+ * Stream format (heatshrink): bits are written MSB first. A literal is a
+ * 1 bit followed by the byte; a back-reference is a 0 bit, the distance
+ * minus one in W bits and the length minus one in L bits. The last byte
+ * is padded with zero bits, which the decoder ignores because a
+ * back-reference needs more than 7 bits.
+ *
+ * Matches are found through hash chains over the last 2^W positions, as
+ * in deflate: s_head holds the newest position for each 2-byte hash and
+ * s_prev links a position to the previous one with the same hash.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "payload_compress.h"
+
+#if CONFIG_MQTT_BATCH_COMPRESS
+
+#define WINDOW_BITS PAYLOAD_COMPRESS_WINDOW_BITS
+#define LOOKAHEAD_BITS PAYLOAD_COMPRESS_LOOKAHEAD_BITS
+#define WINDOW_SIZE (1u << WINDOW_BITS)
+#define MATCH_MAX (1u << LOOKAHEAD_BITS)
+
+#if LOOKAHEAD_BITS >= WINDOW_BITS
+#error "CONFIG_MQTT_COMPRESS_LOOKAHEAD_BITS must be smaller than CONFIG_MQTT_COMPRESS_WINDOW_BITS"
+#endif
+
+// A back-reference costs 1 + W + L bits, a literal 9 bits per byte
+#define MATCH_MIN ((1 + WINDOW_BITS + LOOKAHEAD_BITS) / 9 + 1)
+
+#define HASH_BITS 10
+#define HASH_SIZE (1u << HASH_BITS)
+#define CHAIN_MAX 32                // Candidates tried per position
+
+// Positions are stored + 1 so that 0 means "none"
+static uint16_t s_head[HASH_SIZE];
+static uint16_t s_prev[WINDOW_SIZE];
+
+typedef struct {
+    uint8_t *out;
+    size_t size;
+    size_t len;
+    uint32_t bits;                  // Pending bits, the low `count` ones are valid
+    int count;
+    bool overflow;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *w, uint32_t value, int n)
+{
+    w->bits = (w->bits << n) | (value & ((1u << n) - 1));
+    w->count += n;
+    while (w->count >= 8) {
+        w->count -= 8;
+        if (w->len < w->size) {
+            w->out[w->len++] = (uint8_t)(w->bits >> w->count);
+        } else {
+            w->overflow = true;
+        }
+    }
+    w->bits &= (1u << w->count) - 1;
+}
+
+static inline uint32_t hash2(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 2 ^ p[1]) & (HASH_SIZE - 1);
+}
+
+static inline void insert(const uint8_t *in, size_t pos)
+{
+    uint32_t h = hash2(in + pos);
+    s_prev[pos & (WINDOW_SIZE - 1)] = s_head[h];
+    s_head[h] = (uint16_t)(pos + 1);
+}
+
+esp_err_t payload_compress(const uint8_t *in, size_t len, uint8_t *out, size_t out_size, size_t *out_len)
+{
+    if (in == NULL || out == NULL || out_len == NULL || len >= UINT16_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(s_head, 0, sizeof(s_head));
+    bit_writer_t w = { .out = out, .size = out_size };
+
+    size_t i = 0;
+    while (i < len && !w.overflow) {
+        size_t best_len = 0;
+        size_t best_dist = 0;
+
+        if (i + MATCH_MIN <= len) {
+            size_t max = len - i < MATCH_MAX ? len - i : MATCH_MAX;
+            uint32_t cand = s_head[hash2(in + i)];
+            for (int steps = 0; cand != 0 && steps < CHAIN_MAX; steps++) {
+                size_t pos = cand - 1;
+                size_t dist = i - pos;
+                if (dist > WINDOW_SIZE) {
+                    break;
+                }
+                // May run into the bytes being encoded; the decoder copies byte by byte
+                size_t n = 0;
+                while (n < max && in[pos + n] == in[i + n]) {
+                    n++;
+                }
+                if (n > best_len) {
+                    best_len = n;
+                    best_dist = dist;
+                    if (n == max) {
+                        break;
+                    }
+                }
+                cand = s_prev[pos & (WINDOW_SIZE - 1)];
+            }
+        }
+
+        size_t step = 1;
+        if (best_len >= MATCH_MIN) {
+            put_bits(&w, 0, 1);
+            put_bits(&w, best_dist - 1, WINDOW_BITS);
+            put_bits(&w, best_len - 1, LOOKAHEAD_BITS);
+            step = best_len;
+        } else {
+            put_bits(&w, 1, 1);
+            put_bits(&w, in[i], 8);
+        }
+
+        for (size_t end = i + step; i < end; i++) {
+            if (i + 1 < len) {
+                insert(in, i);
+            }
+        }
+    }
+
+    if (w.count > 0) {
+        put_bits(&w, 0, 8 - w.count);
+    }
+    if (w.overflow) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *out_len = w.len;
+    return ESP_OK;
+}
+
+#endif // CONFIG_MQTT_BATCH_COMPRESS
@@ -0,0 +1,43 @@
+/* Payload Compression Header
+ *
+ * LZSS encoder producing a heatshrink stream (window 2^W, lookahead 2^L),
+ * so the receiver can use the stock heatshrink decoder with the same
+ * -w/-l parameters. The whole payload is compressed in one call; the
+ * match index lives in a static workspace, so nothing is allocated.
+ *
+ * Not reentrant: callers must serialize (the batcher holds its mutex).
+ */
+
+#ifndef PAYLOAD_COMPRESS_H
+#define PAYLOAD_COMPRESS_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PAYLOAD_COMPRESS_WINDOW_BITS CONFIG_MQTT_COMPRESS_WINDOW_BITS
+#define PAYLOAD_COMPRESS_LOOKAHEAD_BITS CONFIG_MQTT_COMPRESS_LOOKAHEAD_BITS
+
+/**
+ * @brief Compress in into out
+ *
+ * @param in Payload, shorter than 65535 bytes
+ * @param len Payload length
+ * @param out Output buffer
+ * @param out_size Size of out
+ * @param out_len Compressed length on success
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if the output would not fit in
+ *         out_size (the payload does not compress; send it as is)
+ */
+esp_err_t payload_compress(const uint8_t *in, size_t len, uint8_t *out, size_t out_size, size_t *out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PAYLOAD_COMPRESS_H
@@ -0,0 +1,537 @@
+/* Provisioning Relay Implementation
+ *
+ * One task owns ESP-NOW and plays whichever role the state machine last
+ * asked for; the receive callback only filters and queues. Messages start
+ * with "PR", the protocol version and the type:
+ *
+ *   request (broadcast):  header | nonce[16]
+ *   offer (unicast):      header | iv[12] | sealed fields | tag[16]
+ *
+ * The offer's additional data is its header, the requester's MAC and the
+ * request nonce. The sealed fields are SSID, password, provisioning token
+ * and bearer token, each a 16-bit little-endian length and the bytes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "prov_relay.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_PROV_RELAY
+
+#include "device_config.h"
+#include "wifi_provisioning.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_now.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/platform_util.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *TAG = "prov_relay";
+
+#define NVS_KEY_WIFI_SSID "wifi_ssid"
+#define NVS_KEY_WIFI_PASS "wifi_pass"
+#define NVS_KEY_PROV_TOKEN "prov_token"
+#define NVS_KEY_BEARER_TOKEN "bearer_token"
+
+#define RELAY_VERSION       1
+#define MSG_REQUEST         1
+#define MSG_OFFER           2
+#define HDR_LEN             4
+#define NONCE_LEN           16
+#define IV_LEN              12
+#define TAG_LEN             16
+#define KEY_LEN             16
+#define REQUEST_LEN         (HDR_LEN + NONCE_LEN)
+
+#ifdef ESP_NOW_MAX_DATA_LEN_V2
+#define MSG_MAX             ESP_NOW_MAX_DATA_LEN_V2
+#else
+#define MSG_MAX             ESP_NOW_MAX_DATA_LEN
+#endif
+#define SEALED_MAX          (MSG_MAX - HDR_LEN - IV_LEN - TAG_LEN)
+
+#define CHANNEL_DWELL_MS    150     // Wait for an offer after each request
+#define WALK_PAUSE_MS       5000    // Between channel walks
+#define OFFER_MIN_GAP_US    1000000         // Any two offers
+#define OFFER_REPEAT_US     10000000        // Two offers to the same requester
+#define RX_QUEUE_LEN        2
+
+typedef enum {
+    ROLE_IDLE,
+    ROLE_REQUEST,
+    ROLE_SERVE,
+} relay_role_t;
+
+typedef struct {
+    uint8_t mac[6];
+    uint16_t len;
+    uint8_t data[MSG_MAX];
+} relay_msg_t;
+
+static const uint8_t s_broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+static uint8_t s_key[KEY_LEN];
+static TaskHandle_t s_task = NULL;
+static QueueHandle_t s_rx_queue = NULL;
+static volatile relay_role_t s_role = ROLE_IDLE;
+static bool s_espnow_up = false;
+static bool s_serve_opened = false;
+static int64_t s_serve_until_us = 0;
+static wifi_ps_type_t s_saved_ps = WIFI_PS_MIN_MODEM;
+
+// Requester: nonce of the walk in progress
+static uint8_t s_nonce[NONCE_LEN];
+
+// Serving: rate limit
+static uint8_t s_last_mac[6];
+static int64_t s_last_offer_us = 0;
+
+// Task-owned buffers; the callback stages in its own (WiFi task)
+static relay_msg_t s_rx_stage;
+static relay_msg_t s_msg;
+static uint8_t s_out[MSG_MAX];
+static uint8_t s_plain[SEALED_MAX];
+
+// Requester: fields of an accepted offer
+static char s_ssid[33];
+static char s_password[65];
+static char s_prov_token[1025];
+static char s_bearer[256];
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static esp_err_t parse_key(const char *hex)
+{
+    if (strlen(hex) != KEY_LEN * 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < KEY_LEN; i++) {
+        int hi = hex_nibble(hex[2 * i]);
+        int lo = hex_nibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        s_key[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return ESP_OK;
+}
+
+static void put_header(uint8_t *out, uint8_t type)
+{
+    out[0] = 'P';
+    out[1] = 'R';
+    out[2] = RELAY_VERSION;
+    out[3] = type;
+}
+
+/**
+ * @brief Additional data of an offer: header, requester MAC, request nonce
+ */
+static void offer_aad(uint8_t aad[HDR_LEN + 6 + NONCE_LEN], const uint8_t *mac, const uint8_t *nonce)
+{
+    put_header(aad, MSG_OFFER);
+    memcpy(aad + HDR_LEN, mac, 6);
+    memcpy(aad + HDR_LEN + 6, nonce, NONCE_LEN);
+}
+
+static void recv_cb(const esp_now_recv_info_t *info, const uint8_t *data, int len)
+{
+    relay_role_t role = s_role;
+    uint8_t want = role == ROLE_SERVE ? MSG_REQUEST : role == ROLE_REQUEST ? MSG_OFFER : 0;
+    if (want == 0 || len < HDR_LEN || len > MSG_MAX ||
+            data[0] != 'P' || data[1] != 'R' || data[2] != RELAY_VERSION || data[3] != want) {
+        return;
+    }
+    memcpy(s_rx_stage.mac, info->src_addr, sizeof(s_rx_stage.mac));
+    s_rx_stage.len = (uint16_t)len;
+    memcpy(s_rx_stage.data, data, len);
+    xQueueSend(s_rx_queue, &s_rx_stage, 0);
+}
+
+static esp_err_t add_peer(const uint8_t *mac)
+{
+    if (esp_now_is_peer_exist(mac)) {
+        return ESP_OK;
+    }
+    // Channel 0: whatever the station is on
+    esp_now_peer_info_t peer = {
+        .channel = 0,
+        .ifidx = WIFI_IF_STA,
+        .encrypt = false,
+    };
+    memcpy(peer.peer_addr, mac, sizeof(peer.peer_addr));
+    return esp_now_add_peer(&peer);
+}
+
+static esp_err_t espnow_up(void)
+{
+    if (s_espnow_up) {
+        return ESP_OK;
+    }
+    esp_err_t err = esp_now_init();
+    if (err == ESP_OK) {
+        err = esp_now_register_recv_cb(recv_cb);
+    }
+    if (err == ESP_OK) {
+        err = add_peer(s_broadcast);
+    }
+    if (err != ESP_OK) {
+        esp_now_deinit();
+        return err;
+    }
+    s_espnow_up = true;
+    return ESP_OK;
+}
+
+static void espnow_down(void)
+{
+    if (!s_espnow_up) {
+        return;
+    }
+    esp_now_unregister_recv_cb();
+    esp_now_deinit();
+    s_espnow_up = false;
+}
+
+static void wipe_secrets(void)
+{
+    mbedtls_platform_zeroize(s_plain, sizeof(s_plain));
+    mbedtls_platform_zeroize(s_msg.data, sizeof(s_msg.data));
+    mbedtls_platform_zeroize(s_password, sizeof(s_password));
+    mbedtls_platform_zeroize(s_prov_token, sizeof(s_prov_token));
+    mbedtls_platform_zeroize(s_bearer, sizeof(s_bearer));
+}
+
+/* ---- Serving ---- */
+
+/**
+ * @brief Append one stored string as a length-prefixed field
+ *
+ * @return New position, or 0 if it is missing (and required) or does not fit
+ */
+static size_t put_field(size_t pos, const char *key, bool required)
+{
+    if (pos + 2 > sizeof(s_plain)) {
+        return 0;
+    }
+    char *dst = (char *)s_plain + pos + 2;
+    size_t len = sizeof(s_plain) - pos - 2;
+    esp_err_t err = device_config_get_str(key, dst, &len);
+    if (err == ESP_ERR_NVS_NOT_FOUND && !required) {
+        len = 0;
+    } else if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot relay %s: %s", key, esp_err_to_name(err));
+        return 0;
+    } else {
+        len = strlen(dst);
+    }
+    s_plain[pos] = (uint8_t)(len & 0xff);
+    s_plain[pos + 1] = (uint8_t)(len >> 8);
+    return pos + 2 + len;
+}
+
+static void send_offer(const uint8_t *mac, const uint8_t *nonce)
+{
+    size_t len = put_field(0, NVS_KEY_WIFI_SSID, true);
+    len = len ? put_field(len, NVS_KEY_WIFI_PASS, false) : 0;
+    len = len ? put_field(len, NVS_KEY_PROV_TOKEN, true) : 0;
+    len = len ? put_field(len, NVS_KEY_BEARER_TOKEN, false) : 0;
+    if (len == 0) {
+        wipe_secrets();
+        return;
+    }
+
+    uint8_t aad[HDR_LEN + 6 + NONCE_LEN];
+    offer_aad(aad, mac, nonce);
+    put_header(s_out, MSG_OFFER);
+    uint8_t *iv = s_out + HDR_LEN;
+    esp_fill_random(iv, IV_LEN);
+
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, s_key, KEY_LEN * 8);
+    if (ret == 0) {
+        ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, len, iv, IV_LEN, aad, sizeof(aad),
+                                        s_plain, s_out + HDR_LEN + IV_LEN, TAG_LEN,
+                                        s_out + HDR_LEN + IV_LEN + len);
+    }
+    mbedtls_gcm_free(&gcm);
+    wipe_secrets();
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Sealing the offer failed (-0x%04x)", -ret);
+        return;
+    }
+
+    esp_err_t err = add_peer(mac);
+    if (err == ESP_OK) {
+        err = esp_now_send(mac, s_out, HDR_LEN + IV_LEN + len + TAG_LEN);
+        esp_now_del_peer(mac);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Offer to "MACSTR" not sent: %s", MAC2STR(mac), esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Credentials relayed to "MACSTR, MAC2STR(mac));
+}
+
+static void serve_wait(void)
+{
+    int64_t now = esp_timer_get_time();
+    if (now >= s_serve_until_us) {
+        ESP_LOGI(TAG, "Relay window closed");
+        if (s_role == ROLE_SERVE) {
+            s_role = ROLE_IDLE;
+        }
+        return;
+    }
+
+    // Wake at least every second to follow role changes
+    int64_t wait_ms = (s_serve_until_us - now) / 1000;
+    if (xQueueReceive(s_rx_queue, &s_msg, pdMS_TO_TICKS(wait_ms < 1000 ? wait_ms : 1000) + 1) != pdTRUE ||
+            s_msg.len != REQUEST_LEN) {
+        return;
+    }
+
+    now = esp_timer_get_time();
+    bool repeat = memcmp(s_msg.mac, s_last_mac, sizeof(s_last_mac)) == 0;
+    if (now - s_last_offer_us < (repeat ? OFFER_REPEAT_US : OFFER_MIN_GAP_US)) {
+        return;
+    }
+    memcpy(s_last_mac, s_msg.mac, sizeof(s_last_mac));
+    s_last_offer_us = now;
+    send_offer(s_msg.mac, s_msg.data + HDR_LEN);
+}
+
+/* ---- Requesting ---- */
+
+/**
+ * @brief Take one length-prefixed field out of the opened offer
+ *
+ * @return New position, or 0 if it is malformed or too long for dst
+ */
+static size_t get_field(size_t pos, size_t end, char *dst, size_t size)
+{
+    if (pos + 2 > end) {
+        return 0;
+    }
+    size_t len = s_plain[pos] | (size_t)s_plain[pos + 1] << 8;
+    pos += 2;
+    if (len >= size || pos + len > end) {
+        return 0;
+    }
+    memcpy(dst, s_plain + pos, len);
+    dst[len] = '\0';
+    return pos + len;
+}
+
+/**
+ * @brief Open an offer for this walk and provision with it
+ *
+ * @return true once provisioned
+ */
+static bool accept_offer(const relay_msg_t *msg)
+{
+    if (msg->len < HDR_LEN + IV_LEN + TAG_LEN) {
+        return false;
+    }
+    size_t len = msg->len - HDR_LEN - IV_LEN - TAG_LEN;
+    const uint8_t *iv = msg->data + HDR_LEN;
+    const uint8_t *sealed = iv + IV_LEN;
+
+    uint8_t mac[6];
+    esp_wifi_get_mac(WIFI_IF_STA, mac);
+    uint8_t aad[HDR_LEN + 6 + NONCE_LEN];
+    offer_aad(aad, mac, s_nonce);
+
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, s_key, KEY_LEN * 8);
+    if (ret == 0) {
+        ret = mbedtls_gcm_auth_decrypt(&gcm, len, iv, IV_LEN, aad, sizeof(aad), sealed + len, TAG_LEN,
+                                       sealed, s_plain);
+    }
+    mbedtls_gcm_free(&gcm);
+    if (ret != 0) {
+        // Another fleet's key, a stale walk, or tampering
+        ESP_LOGW(TAG, "Offer from "MACSTR" rejected", MAC2STR(msg->mac));
+        wipe_secrets();
+        return false;
+    }
+
+    size_t pos = get_field(0, len, s_ssid, sizeof(s_ssid));
+    pos = pos ? get_field(pos, len, s_password, sizeof(s_password)) : 0;
+    pos = pos ? get_field(pos, len, s_prov_token, sizeof(s_prov_token)) : 0;
+    pos = pos ? get_field(pos, len, s_bearer, sizeof(s_bearer)) : 0;
+    if (pos != len || s_ssid[0] == '\0') {
+        ESP_LOGW(TAG, "Malformed offer from "MACSTR, MAC2STR(msg->mac));
+        wipe_secrets();
+        return false;
+    }
+
+    char device_id[PROVISION_DEVICE_ID_MAX + 1];
+    snprintf(device_id, sizeof(device_id), "%s%02x%02x%02x%02x%02x%02x", CONFIG_APP_PROV_RELAY_ID_PREFIX,
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    ESP_LOGI(TAG, "Offer from "MACSTR" for %s", MAC2STR(msg->mac), s_ssid);
+    esp_err_t err = wifi_provisioning_submit(s_ssid, s_password, device_id, s_prov_token, s_bearer);
+    wipe_secrets();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Relayed credentials not usable here: %s", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+static bool ap_has_clients(void)
+{
+    wifi_sta_list_t list;
+    return esp_wifi_ap_get_sta_list(&list) == ESP_OK && list.num > 0;
+}
+
+/**
+ * @brief Broadcast a request on every channel and wait briefly on each
+ *
+ * @return true once provisioned
+ */
+static bool request_walk(void)
+{
+    uint8_t first = 1;
+    uint8_t last = 13;
+    wifi_country_t country;
+    if (esp_wifi_get_country(&country) == ESP_OK && country.nchan > 0) {
+        first = country.schan;
+        last = country.schan + country.nchan - 1;
+    }
+
+    uint8_t req[REQUEST_LEN];
+    put_header(req, MSG_REQUEST);
+    esp_fill_random(s_nonce, sizeof(s_nonce));
+    memcpy(req + HDR_LEN, s_nonce, sizeof(s_nonce));
+
+    for (uint8_t ch = first; ch <= last && s_role == ROLE_REQUEST; ch++) {
+        // The AP moves with the channel; never pull it away from an installer
+        if (ap_has_clients()) {
+            return false;
+        }
+        if (esp_wifi_set_channel(ch, WIFI_SECOND_CHAN_NONE) != ESP_OK) {
+            continue;   // Scan or credential test holds the radio
+        }
+        if (esp_now_send(s_broadcast, req, sizeof(req)) != ESP_OK) {
+            continue;
+        }
+        int64_t until_us = esp_timer_get_time() + CHANNEL_DWELL_MS * 1000;
+        int64_t left_us;
+        while ((left_us = until_us - esp_timer_get_time()) > 0 &&
+                xQueueReceive(s_rx_queue, &s_msg, pdMS_TO_TICKS(left_us / 1000) + 1) == pdTRUE) {
+            if (s_msg.len > REQUEST_LEN && accept_offer(&s_msg)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void relay_task(void *arg)
+{
+    relay_role_t active = ROLE_IDLE;
+
+    while (1) {
+        relay_role_t role = s_role;
+        if (role != active) {
+            if (active == ROLE_SERVE) {
+                esp_wifi_set_ps(s_saved_ps);
+            }
+            espnow_down();
+            xQueueReset(s_rx_queue);
+            if (role != ROLE_IDLE) {
+                esp_err_t err = espnow_up();
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "ESP-NOW unavailable: %s", esp_err_to_name(err));
+                    s_role = role = ROLE_IDLE;
+                }
+            }
+            if (role == ROLE_SERVE) {
+                // A sleeping station misses most broadcasts
+                esp_wifi_get_ps(&s_saved_ps);
+                esp_wifi_set_ps(WIFI_PS_NONE);
+            }
+            active = role;
+        }
+
+        switch (role) {
+        case ROLE_REQUEST:
+            if (wifi_provisioning_is_provisioned() || request_walk()) {
+                if (s_role == ROLE_REQUEST) {
+                    s_role = ROLE_IDLE;
+                }
+                break;
+            }
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(WALK_PAUSE_MS));
+            break;
+        case ROLE_SERVE:
+            serve_wait();
+            break;
+        default:
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            break;
+        }
+    }
+}
+
+esp_err_t prov_relay_init(void)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    esp_err_t err = parse_key(CONFIG_APP_PROV_RELAY_KEY);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "CONFIG_APP_PROV_RELAY_KEY must be %d hex digits", KEY_LEN * 2);
+        return err;
+    }
+    s_rx_queue = xQueueCreate(RX_QUEUE_LEN, sizeof(relay_msg_t));
+    if (s_rx_queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(relay_task, "prov_relay", CONFIG_APP_PROV_RELAY_STACK, NULL, tskIDLE_PRIORITY + 1, &s_task) != pdPASS) {
+        vQueueDelete(s_rx_queue);
+        s_rx_queue = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void prov_relay_request_start(void)
+{
+    if (s_task == NULL || s_role == ROLE_REQUEST) {
+        return;
+    }
+    ESP_LOGI(TAG, "Asking nearby devices for credentials");
+    s_role = ROLE_REQUEST;
+    xTaskNotifyGive(s_task);
+}
+
+void prov_relay_serve_start(void)
+{
+    if (s_task == NULL || s_serve_opened) {
+        return;
+    }
+    s_serve_opened = true;
+    s_serve_until_us = esp_timer_get_time() + (int64_t)CONFIG_APP_PROV_RELAY_WINDOW_S * 1000000;
+    ESP_LOGI(TAG, "Relaying credentials for %d s", CONFIG_APP_PROV_RELAY_WINDOW_S);
+    s_role = ROLE_SERVE;
+    xTaskNotifyGive(s_task);
+}
+
+#endif // CONFIG_APP_PROV_RELAY
@@ -0,0 +1,61 @@
+/* Provisioning Relay Header
+ *
+ * Bulk provisioning over ESP-NOW. A device that has joined the site
+ * network answers requests from unprovisioned neighbours for
+ * CONFIG_APP_PROV_RELAY_WINDOW_S with the WiFi credentials, provisioning
+ * token and bearer token it was provisioned with; the neighbour feeds them
+ * through wifi_provisioning_submit(), the same checks, credential test and
+ * save as POST /provision, and becomes a relay itself. Each provisioned
+ * generation roughly doubles the devices serving, so a site needs one
+ * manual /provision and a number of rounds logarithmic in its size.
+ *
+ * An unprovisioned device walks the channels while no client is on its
+ * provisioning AP and broadcasts a request with a fresh nonce on each.
+ * The answer is sealed with AES-128-GCM under the fleet key
+ * CONFIG_APP_PROV_RELAY_KEY and bound to the requester's MAC and nonce, so
+ * it is useless to anyone without the key and cannot be replayed to
+ * another device. The relayed device's ID is CONFIG_APP_PROV_RELAY_ID_PREFIX
+ * followed by its STA MAC in hex.
+ *
+ * Built only with CONFIG_APP_PROV_RELAY.
+ */
+
+#ifndef PROV_RELAY_H
+#define PROV_RELAY_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Check the fleet key and create the relay task
+ *
+ * Call once after wifi_conn_init().
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for a malformed key, ESP_ERR_NO_MEM
+ */
+esp_err_t prov_relay_init(void);
+
+/**
+ * @brief Ask neighbours for credentials while provisioning is active
+ *
+ * Call after wifi_provisioning_start(); the requests stop by themselves
+ * once the device is provisioned. Repeated calls are no-ops.
+ */
+void prov_relay_request_start(void);
+
+/**
+ * @brief Answer neighbours' requests for CONFIG_APP_PROV_RELAY_WINDOW_S
+ *
+ * Call once the station has verified internet access. Only the first call
+ * after boot opens the window.
+ */
+void prov_relay_serve_start(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROV_RELAY_H
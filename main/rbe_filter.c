@@ -0,0 +1,52 @@
+/* Report-by-Exception Filter Implementation
+ *
+ * Differences are taken in 64 bits, so int32 metrics of any range compare
+ * without overflow. The rate check is cross-multiplied rather than
+ * divided: |delta| * 1000 > roc_per_s * elapsed_ms.
+ */
+
+#include "rbe_filter.h"
+
+static int64_t abs64(int64_t v)
+{
+    return v < 0 ? -v : v;
+}
+
+void rbe_filter_init(rbe_filter_t *f, const rbe_filter_cfg_t *cfg)
+{
+    *f = (rbe_filter_t){ .cfg = *cfg };
+}
+
+void rbe_filter_sample(rbe_filter_t *f, int32_t value, uint32_t now_ms)
+{
+    if (f->primed && !f->significant) {
+        int64_t band = f->cfg.deadband;
+        int64_t pct = abs64(f->ref) * f->cfg.deadband_pct / 100;
+        if (pct > band) {
+            band = pct;
+        }
+        if (band > 0 && abs64((int64_t)value - f->ref) > band) {
+            f->significant = true;
+        }
+    }
+    if (f->has_prev && f->cfg.roc_per_s > 0 && now_ms != f->prev_ms &&
+        abs64((int64_t)value - f->prev) * 1000 > (int64_t)f->cfg.roc_per_s * (uint32_t)(now_ms - f->prev_ms)) {
+        f->significant = true;
+    }
+    f->prev = value;
+    f->prev_ms = now_ms;
+    f->has_prev = true;
+}
+
+bool rbe_filter_report(rbe_filter_t *f, int32_t value, uint32_t now_ms)
+{
+    bool heartbeat = f->cfg.heartbeat_s > 0 && now_ms - f->report_ms >= (uint32_t)f->cfg.heartbeat_s * 1000;
+    if (f->primed && !f->significant && !heartbeat) {
+        return false;
+    }
+    f->ref = value;
+    f->report_ms = now_ms;
+    f->primed = true;
+    f->significant = false;
+    return true;
+}
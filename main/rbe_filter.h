@@ -0,0 +1,81 @@
+/* Report-by-Exception Filter Header
+ *
+ * Decides whether a periodic report of a metric is worth sending. Each
+ * sample is held against the last reported value (the reference) and the
+ * previous sample:
+ *
+ *   deadband    the sample leaves the reference by more than deadband, or
+ *               deadband_pct percent of the reference, whichever is larger
+ *   rate        it moved from the previous sample faster than roc_per_s
+ *               units per second
+ *
+ * Either marks the filter; the next report goes out and becomes the new
+ * reference. An unmarked report is suppressed unless heartbeat_s passed
+ * since the last one went out, so a flat signal is still heard from. The
+ * first report always goes out. A zero setting disables its trigger.
+ *
+ * Constant time and no allocation per call. The filter is a plain value:
+ * the owner keeps it under the lock that guards the metric.
+ */
+
+#ifndef RBE_FILTER_H
+#define RBE_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Thresholds, in the metric's own unit
+ */
+typedef struct {
+    int32_t deadband;           // Absolute band around the reference
+    uint16_t deadband_pct;      // Band as a percentage of the reference
+    int32_t roc_per_s;          // Rate of change that triggers a report
+    uint16_t heartbeat_s;       // Longest silence, 0: none
+} rbe_filter_cfg_t;
+
+/**
+ * @brief Filter state
+ */
+typedef struct {
+    rbe_filter_cfg_t cfg;
+    int32_t ref;                // Last reported value
+    int32_t prev;               // Previous sample
+    uint32_t prev_ms;
+    uint32_t report_ms;         // When the reference was reported
+    bool primed;                // A report went out
+    bool has_prev;
+    bool significant;           // A sample since then crossed a threshold
+} rbe_filter_t;
+
+/**
+ * @brief Start a filter; the first report after this always goes out
+ */
+void rbe_filter_init(rbe_filter_t *f, const rbe_filter_cfg_t *cfg);
+
+/**
+ * @brief Hold one sample against the thresholds
+ *
+ * @param now_ms Monotonic time of the sample
+ */
+void rbe_filter_sample(rbe_filter_t *f, int32_t value, uint32_t now_ms);
+
+/**
+ * @brief Whether a report of value should go out now
+ *
+ * When it should, value becomes the reference.
+ *
+ * @param value Reported value (a window mean, say)
+ * @param now_ms Monotonic time of the report
+ */
+bool rbe_filter_report(rbe_filter_t *f, int32_t value, uint32_t now_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RBE_FILTER_H
@@ -0,0 +1,489 @@
+/* Remote Configuration Implementation
+ *
+ * The effective configuration is one flat cJSON object holding every key
+ * in schema order. A patch is validated against the schema before
+ * anything changes: unknown keys, wrong types and out-of-range values
+ * reject the whole patch. It is then merged into a copy of the document
+ * with cJSONUtils_MergePatchCaseSensitive(); the copy is rebuilt in
+ * schema order with defaults for removed keys, the changed keys are
+ * written in one device_config transaction, and only then does the copy
+ * replace the live document.
+ *
+ * Applying the same patch twice (a retained message after a reconnect)
+ * writes nothing.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "remote_config.h"
+#include "device_config.h"
+#include "json_emit.h"
+#include "mqtt_handler.h"
+#include "mqtt_worker.h"
+#include "cJSON.h"
+#include "cJSON_Utils.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "remote_config";
+
+#define PATCH_MAX_LEN 1024
+
+#if CONFIG_MQTT_TCP_PROFILE_THROUGHPUT
+#define TCP_PROFILE_DEFAULT 1
+#else
+#define TCP_PROFILE_DEFAULT 0
+#endif
+#define TOPIC_MAX_LEN 96
+
+typedef enum {
+    RC_STRING,
+    RC_INT,
+} rc_type_t;
+
+typedef struct {
+    const char *key;
+    const char *nvs_key;            // At most 15 characters
+    rc_type_t type;
+    const char *def_str;
+    int def_int;
+    int min;
+    int max;
+    bool (*check)(const char *value);   // Extra check of a string value, or NULL
+} rc_entry_t;
+
+static bool broker_uri_valid(const char *value);
+static bool broker_list_valid(const char *value);
+
+static const rc_entry_t s_schema[] = {
+    { REMOTE_CONFIG_BROKER_URI, "rc_broker", RC_STRING, CONFIG_MQTT_BROKER_URI,
+      .check = broker_uri_valid },
+    { REMOTE_CONFIG_BROKER_FALLBACKS, "rc_broker_fb", RC_STRING, CONFIG_MQTT_BROKER_FALLBACK_URIS,
+      .check = broker_list_valid },
+    { REMOTE_CONFIG_BACKEND_URL, "rc_backend", RC_STRING, CONFIG_BACKEND_URL },
+    { REMOTE_CONFIG_METRICS_INTERVAL, "rc_metrics_s", RC_INT, NULL,
+      CONFIG_APP_METRICS_INTERVAL_S, 0, 86400 },
+    { REMOTE_CONFIG_TCP_PROFILE, "rc_tcp_profile", RC_INT, NULL,
+      TCP_PROFILE_DEFAULT, 0, 1 },
+};
+
+#define SCHEMA_LEN (sizeof(s_schema) / sizeof(s_schema[0]))
+
+static cJSON *s_doc = NULL;
+static uint32_t s_version = 0;
+static SemaphoreHandle_t s_mutex = NULL;
+
+static char s_state_topic[TOPIC_MAX_LEN];
+
+// Reassembly of a chunked patch, only touched by the task config_message() runs on
+static char s_patch[PATCH_MAX_LEN];
+static bool s_patch_skip = false;
+
+static const rc_entry_t *schema_find(const char *key)
+{
+    for (size_t i = 0; i < SCHEMA_LEN; i++) {
+        if (strcmp(s_schema[i].key, key) == 0) {
+            return &s_schema[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check one broker URI of len characters
+ *
+ * Only TLS transports are accepted, since the client always presents its
+ * certificate: mqtts:// or wss://, then a host name or bracketed IPv6
+ * address, an optional port from 1 to 65535 and an optional path.
+ */
+static bool broker_uri_span_valid(const char *uri, size_t len)
+{
+    const char *end = uri + len;
+    const char *p;
+    if (len > 8 && strncmp(uri, "mqtts://", 8) == 0) {
+        p = uri + 8;
+    } else if (len > 6 && strncmp(uri, "wss://", 6) == 0) {
+        p = uri + 6;
+    } else {
+        return false;
+    }
+
+    const char *host = p;
+    if (*p == '[') {
+        p = memchr(p, ']', end - p);
+        if (p == NULL || p - host < 2) {
+            return false;
+        }
+        p++;
+    } else {
+        while (p < end && *p != ':' && *p != '/') {
+            if (*p == ' ' || *p == '@' || *p == '?' || *p == '#') {
+                return false;
+            }
+            p++;
+        }
+        if (p == host) {
+            return false;
+        }
+    }
+
+    if (p < end && *p == ':') {
+        const char *digits = ++p;
+        long port = 0;
+        while (p < end && *p >= '0' && *p <= '9' && port <= 65535) {
+            port = port * 10 + (*p - '0');
+            p++;
+        }
+        if (p == digits || port < 1 || port > 65535) {
+            return false;
+        }
+    }
+    return p == end || *p == '/';
+}
+
+static bool broker_uri_valid(const char *value)
+{
+    return broker_uri_span_valid(value, strlen(value));
+}
+
+/**
+ * @brief Check a comma-separated list of broker URIs, split as broker_race does
+ */
+static bool broker_list_valid(const char *value)
+{
+    for (const char *p = value; *p != '\0'; ) {
+        size_t len = strcspn(p, ",");
+        const char *uri = p;
+        size_t n = len;
+        while (n > 0 && *uri == ' ') {
+            uri++;
+            n--;
+        }
+        while (n > 0 && uri[n - 1] == ' ') {
+            n--;
+        }
+        if (n > 0 && !broker_uri_span_valid(uri, n)) {
+            return false;
+        }
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Check one value against its entry
+ */
+static bool value_valid(const rc_entry_t *e, const cJSON *value)
+{
+    if (e->type == RC_STRING) {
+        return cJSON_IsString(value) && strlen(value->valuestring) < REMOTE_CONFIG_STR_MAX &&
+               (e->check == NULL || e->check(value->valuestring));
+    }
+    if (!cJSON_IsNumber(value)) {
+        return false;
+    }
+    double d = value->valuedouble;
+    return d >= e->min && d <= e->max && d == (double)(int)d;
+}
+
+static cJSON *value_default(const rc_entry_t *e)
+{
+    return e->type == RC_STRING ? cJSON_CreateString(e->def_str) : cJSON_CreateNumber(e->def_int);
+}
+
+static bool value_is_default(const rc_entry_t *e, const cJSON *value)
+{
+    if (e->type == RC_STRING) {
+        return strcmp(value->valuestring, e->def_str) == 0;
+    }
+    return value->valueint == e->def_int;
+}
+
+/**
+ * @brief Rebuild src in schema order, filling missing or invalid keys with defaults
+ */
+static cJSON *doc_normalize(const cJSON *src)
+{
+    cJSON *doc = cJSON_CreateObject();
+    if (doc == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < SCHEMA_LEN; i++) {
+        const rc_entry_t *e = &s_schema[i];
+        const cJSON *value = cJSON_GetObjectItemCaseSensitive(src, e->key);
+        cJSON *item = value_valid(e, value) ? cJSON_Duplicate(value, false) : value_default(e);
+        if (item == NULL || !cJSON_AddItemToObject(doc, e->key, item)) {
+            cJSON_Delete(item);
+            cJSON_Delete(doc);
+            return NULL;
+        }
+    }
+    return doc;
+}
+
+static uint32_t doc_version(const cJSON *doc)
+{
+    char scratch[384];
+    char *json = json_emit(doc, scratch, sizeof(scratch));
+    if (json == NULL) {
+        return 0;
+    }
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)json, strlen(json));
+    json_emit_free(json, scratch);
+    return crc;
+}
+
+/**
+ * @brief Read the overrides stored in NVS into an object
+ */
+static void doc_load(cJSON *stored)
+{
+    for (size_t i = 0; i < SCHEMA_LEN; i++) {
+        const rc_entry_t *e = &s_schema[i];
+        if (e->type == RC_STRING) {
+            char value[REMOTE_CONFIG_STR_MAX];
+            size_t len = sizeof(value);
+            if (device_config_get_str(e->nvs_key, value, &len) == ESP_OK) {
+                cJSON_AddStringToObject(stored, e->key, value);
+            }
+        } else {
+            int32_t value;
+            size_t len = sizeof(value);
+            if (device_config_get_blob(e->nvs_key, &value, &len) == ESP_OK && len == sizeof(value)) {
+                cJSON_AddNumberToObject(stored, e->key, value);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Write the keys that differ between from and to
+ *
+ * @return Number of keys written or erased, or -1 if the commit failed
+ */
+static int doc_persist(const cJSON *from, const cJSON *to)
+{
+    int changed = 0;
+    device_config_begin();
+    for (size_t i = 0; i < SCHEMA_LEN; i++) {
+        const rc_entry_t *e = &s_schema[i];
+        const cJSON *old = cJSON_GetObjectItemCaseSensitive(from, e->key);
+        const cJSON *updated = cJSON_GetObjectItemCaseSensitive(to, e->key);
+        if (cJSON_Compare(old, updated, true)) {
+            continue;
+        }
+        changed++;
+        if (value_is_default(e, updated)) {
+            device_config_erase(e->nvs_key);
+        } else if (e->type == RC_STRING) {
+            device_config_set_str(e->nvs_key, updated->valuestring);
+        } else {
+            int32_t value = updated->valueint;
+            device_config_set_blob(e->nvs_key, &value, sizeof(value));
+        }
+    }
+    esp_err_t err = device_config_commit();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to persist configuration: %s", esp_err_to_name(err));
+        return -1;
+    }
+    return changed;
+}
+
+/**
+ * @brief Validate, merge and persist one patch
+ */
+static esp_err_t patch_apply(const char *json, size_t len)
+{
+    cJSON *patch = cJSON_ParseWithLength(json, len);
+    if (!cJSON_IsObject(patch)) {
+        ESP_LOGW(TAG, "Patch is not a JSON object");
+        cJSON_Delete(patch);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_OK;
+    cJSON *merged = NULL;
+    cJSON *next = NULL;
+
+    const cJSON *item = NULL;
+    cJSON_ArrayForEach(item, patch) {
+        const rc_entry_t *e = schema_find(item->string);
+        if (e == NULL) {
+            ESP_LOGW(TAG, "Unknown key \"%s\"", item->string);
+            err = ESP_ERR_NOT_FOUND;
+            goto cleanup;
+        }
+        if (!cJSON_IsNull(item) && !value_valid(e, item)) {
+            ESP_LOGW(TAG, "Invalid value for \"%s\"", item->string);
+            err = ESP_ERR_INVALID_ARG;
+            goto cleanup;
+        }
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    // A failed copy must not be merged: it would reset every key to its default
+    merged = cJSON_Duplicate(s_doc, true);
+    if (merged != NULL) {
+        merged = cJSONUtils_MergePatchCaseSensitive(merged, patch);
+    }
+    next = merged != NULL ? doc_normalize(merged) : NULL;
+    if (next == NULL) {
+        xSemaphoreGive(s_mutex);
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+
+    int changed = doc_persist(s_doc, next);
+    if (changed < 0) {
+        xSemaphoreGive(s_mutex);
+        err = ESP_FAIL;
+        goto cleanup;
+    }
+    if (changed > 0) {
+        cJSON *old = s_doc;
+        s_doc = next;
+        next = old;
+        s_version = doc_version(s_doc);
+    }
+    uint32_t version = s_version;
+    xSemaphoreGive(s_mutex);
+
+    ESP_LOGI(TAG, "Patch applied: %d key(s) changed, version %08lx", changed, (unsigned long)version);
+
+cleanup:
+    cJSON_Delete(next);
+    cJSON_Delete(merged);
+    cJSON_Delete(patch);
+    return err;
+}
+
+static esp_err_t config_message(const mqtt_handler_msg_t *msg, void *ctx)
+{
+    if (msg->offset == 0) {
+        s_patch_skip = msg->total_len > PATCH_MAX_LEN;
+        if (s_patch_skip) {
+            ESP_LOGW(TAG, "Patch of %d bytes exceeds %d, ignored", msg->total_len, PATCH_MAX_LEN);
+        }
+    }
+    if (s_patch_skip) {
+        return ESP_FAIL;
+    }
+    if (msg->offset + msg->len > PATCH_MAX_LEN) {
+        return ESP_FAIL;
+    }
+    memcpy(s_patch + msg->offset, msg->data, msg->len);
+    if (msg->offset + msg->len < msg->total_len) {
+        return ESP_OK;
+    }
+
+    patch_apply(s_patch, msg->total_len);
+    // Report rejected patches too, so the sender sees the version did not move
+    remote_config_report();
+    return ESP_OK;
+}
+
+esp_err_t remote_config_init(void)
+{
+    if (s_mutex != NULL) {
+        return ESP_OK;
+    }
+
+    cJSON *stored = cJSON_CreateObject();
+    if (stored == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    doc_load(stored);
+    s_doc = doc_normalize(stored);
+    cJSON_Delete(stored);
+    if (s_doc == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    s_mutex = xSemaphoreCreateMutex();
+    if (s_mutex == NULL) {
+        cJSON_Delete(s_doc);
+        s_doc = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    s_version = doc_version(s_doc);
+    ESP_LOGI(TAG, "Configuration version %08lx", (unsigned long)s_version);
+    return ESP_OK;
+}
+
+void remote_config_erase_stored(void)
+{
+    device_config_begin();
+    for (size_t i = 0; i < SCHEMA_LEN; i++) {
+        device_config_erase(s_schema[i].nvs_key);
+    }
+    device_config_commit();
+}
+
+esp_err_t remote_config_start(const char *device_id)
+{
+#if CONFIG_APP_REMOTE_CONFIG
+    if (s_state_topic[0] != '\0') {
+        return ESP_OK;
+    }
+    char topic[TOPIC_MAX_LEN];
+    int n = snprintf(topic, sizeof(topic), "config/%s", device_id);
+    if (n < 0 || (size_t)n + sizeof("/state") > sizeof(topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    snprintf(s_state_topic, sizeof(s_state_topic), "%s/state", topic);
+    // Patches write NVS and publish the state: not on the MQTT task
+    return mqtt_worker_subscribe(topic, 1, config_message, NULL);
+#else
+    return ESP_OK;
+#endif
+}
+
+esp_err_t remote_config_report(void)
+{
+    if (s_state_topic[0] == '\0') {
+        return ESP_ERR_INVALID_STATE;
+    }
+    char body[32];
+    int len = snprintf(body, sizeof(body), "{\"version\":\"%08lx\"}", (unsigned long)remote_config_version());
+    return mqtt_handler_publish(s_state_topic, body, len, 1);
+}
+
+esp_err_t remote_config_get_str(const char *key, char *out, size_t size)
+{
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    const cJSON *item = cJSON_GetObjectItemCaseSensitive(s_doc, key);
+    if (!cJSON_IsString(item)) {
+        err = ESP_ERR_NOT_FOUND;
+    } else if (strlcpy(out, item->valuestring, size) >= size) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    xSemaphoreGive(s_mutex);
+    return err;
+}
+
+int remote_config_get_int(const char *key)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    const cJSON *item = cJSON_GetObjectItemCaseSensitive(s_doc, key);
+    int value = cJSON_IsNumber(item) ? item->valueint : 0;
+    xSemaphoreGive(s_mutex);
+    return value;
+}
+
+uint32_t remote_config_version(void)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    uint32_t version = s_version;
+    xSemaphoreGive(s_mutex);
+    return version;
+}
@@ -0,0 +1,94 @@
+/* Remote Configuration Header
+ *
+ * Runtime settings that used to be compile-time only. Each key starts at
+ * its Kconfig default, is overridden from NVS at boot and can be changed
+ * over MQTT with an RFC 7396 JSON Merge Patch published to
+ * "config/<device_id>". Only keys the patch changes are written to NVS;
+ * a key set back to its default (or to null) is erased. After every patch
+ * the version of the effective document is published to
+ * "config/<device_id>/state".
+ */
+
+#ifndef REMOTE_CONFIG_H
+#define REMOTE_CONFIG_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define REMOTE_CONFIG_STR_MAX 128   // Including the terminator
+
+// Keys of the document
+#define REMOTE_CONFIG_BROKER_URI        "broker_uri"            // Next MQTT connect, mqtts:// or wss://
+#define REMOTE_CONFIG_BROKER_FALLBACKS  "broker_fallbacks"      // Next MQTT client, comma-separated URIs
+#define REMOTE_CONFIG_BACKEND_URL       "backend_url"           // Next backend request
+#define REMOTE_CONFIG_METRICS_INTERVAL  "metrics_interval_s"    // Next heartbeat
+#define REMOTE_CONFIG_TCP_PROFILE       "tcp_profile"           // Next MQTT connect, 0 latency, 1 throughput
+
+/**
+ * @brief Build the document from the defaults and the values in NVS
+ *
+ * Call once after device_config_init(), before any getter is used.
+ *
+ * @return ESP_OK, or ESP_ERR_NO_MEM
+ */
+esp_err_t remote_config_init(void);
+
+/**
+ * @brief Subscribe to "config/<device_id>"
+ *
+ * May be called before MQTT connects; the subscription is made on connect.
+ * Later calls are no-ops, as is every call without CONFIG_APP_REMOTE_CONFIG.
+ *
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t remote_config_start(const char *device_id);
+
+/**
+ * @brief Publish the current version to "config/<device_id>/state"
+ *
+ * Lets the backend see whether a device missed a patch, e.g. after a
+ * reconnect. Requires remote_config_start().
+ *
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t remote_config_report(void);
+
+/**
+ * @brief Copy a string value
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND for an unknown or non-string key,
+ *         ESP_ERR_INVALID_SIZE if out is too small
+ */
+esp_err_t remote_config_get_str(const char *key, char *out, size_t size);
+
+/**
+ * @brief Read an integer value
+ *
+ * @return The value, or 0 for an unknown or non-integer key
+ */
+int remote_config_get_int(const char *key);
+
+/**
+ * @brief Erase every stored override; the defaults apply from the next boot
+ *
+ * Joins the caller's device_config transaction, if any.
+ */
+void remote_config_erase_stored(void);
+
+/**
+ * @brief CRC-32 of the compact effective document
+ *
+ * Equal documents have equal versions: keys are always in schema order.
+ */
+uint32_t remote_config_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // REMOTE_CONFIG_H
@@ -0,0 +1,82 @@
+/* Retry Policy Implementation
+ *
+ * xorshift64* is plenty for spreading retries and cheap enough to call from
+ * the MQTT event handler; the hardware RNG only seeds it.
+ */
+
+#include "retry_policy.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "freertos/FreeRTOS.h"
+
+#define HINT_MAX_MS     3600000     // Retry-After beyond an hour is taken as an hour
+
+static uint64_t s_state = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void seed(void)
+{
+    uint8_t mac[6] = {0};
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+
+    uint64_t s = ((uint64_t)esp_random() << 32) | esp_random();
+    for (int i = 0; i < 6; i++) {
+        s ^= (uint64_t)mac[i] << (8 * i);
+    }
+    s_state = s != 0 ? s : 0x9e3779b97f4a7c15ULL;
+}
+
+/**
+ * @brief Uniform draw from [lo, hi]
+ */
+static uint32_t draw(uint32_t lo, uint32_t hi)
+{
+    if (s_state == 0) {
+        seed();     // Outside the lock: reads the MAC from eFuse
+    }
+    portENTER_CRITICAL(&s_lock);
+    s_state ^= s_state >> 12;
+    s_state ^= s_state << 25;
+    s_state ^= s_state >> 27;
+    uint64_t r = s_state * 0x2545f4914f6cdd1dULL;
+    portEXIT_CRITICAL(&s_lock);
+
+    uint64_t span = (uint64_t)hi - lo + 1;
+    return lo + (uint32_t)((r >> 32) % span);
+}
+
+uint32_t retry_policy_next(retry_policy_t *p)
+{
+    uint64_t hi = (uint64_t)(p->prev_ms > p->base_ms ? p->prev_ms : p->base_ms) * 3;
+    if (hi > p->cap_ms) {
+        hi = p->cap_ms;
+    }
+    if (hi < p->base_ms) {
+        hi = p->base_ms;
+    }
+    p->prev_ms = draw(p->base_ms, (uint32_t)hi);
+    p->attempts++;
+    return p->prev_ms;
+}
+
+uint32_t retry_policy_next_hint(retry_policy_t *p, uint32_t floor_ms)
+{
+    uint32_t delay = retry_policy_next(p);
+    if (floor_ms == 0) {
+        return delay;
+    }
+    if (floor_ms > HINT_MAX_MS) {
+        floor_ms = HINT_MAX_MS;
+    }
+    if (delay < floor_ms) {
+        delay = draw(floor_ms, floor_ms + floor_ms / 4);
+        p->prev_ms = delay;
+    }
+    return delay;
+}
+
+void retry_policy_reset(retry_policy_t *p)
+{
+    p->prev_ms = 0;
+    p->attempts = 0;
+}
@@ -0,0 +1,59 @@
+/* Retry Policy Header
+ *
+ * Decorrelated-jitter exponential backoff for the retries that hit shared
+ * infrastructure: CSR signing, internet verification and MQTT reconnects.
+ * Each delay is drawn uniformly from [base, 3 * previous delay] and capped,
+ * so a site whose devices all fail at the same instant (a power restore, a
+ * broker restart) spreads out after the first retry instead of coming back
+ * in waves. The generator is seeded per device from the STA MAC and the
+ * hardware RNG, so devices that boot in lockstep still draw differently.
+ *
+ * A server's own hint (HTTP Retry-After, an MQTT "server busy" reason) is a
+ * floor for the next delay; up to a quarter of it is added as jitter, so a
+ * fleet given the same Retry-After does not return in step either.
+ *
+ * A policy is owned by one task or callback; only the generator is shared.
+ */
+
+#ifndef RETRY_POLICY_H
+#define RETRY_POLICY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t base_ms;       // Shortest delay
+    uint32_t cap_ms;        // Longest delay without a server hint
+    uint32_t prev_ms;       // Last delay, 0 after a reset
+    uint32_t attempts;      // Delays drawn since the last reset
+} retry_policy_t;
+
+#define RETRY_POLICY_INIT(base, cap) { .base_ms = (base), .cap_ms = (cap), .prev_ms = 0, .attempts = 0 }
+
+/**
+ * @brief Draw the next delay
+ */
+uint32_t retry_policy_next(retry_policy_t *p);
+
+/**
+ * @brief Draw the next delay, but not less than a server-provided floor
+ *
+ * The floor may exceed cap_ms; later draws continue from the delay returned.
+ *
+ * @param floor_ms Delay the server asked for, 0 for none
+ */
+uint32_t retry_policy_next_hint(retry_policy_t *p, uint32_t floor_ms);
+
+/**
+ * @brief Start over from base_ms after a success
+ */
+void retry_policy_reset(retry_policy_t *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RETRY_POLICY_H
@@ -0,0 +1,130 @@
+/* Sampling Scheduler Implementation
+ *
+ * The deadline of each source is tracked next to its timer: the callback
+ * compares the read time with it to measure lateness and count periods
+ * the esp_timer task skipped, then advances it by whole periods.
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include "sampler.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "sampler";
+
+typedef struct {
+    esp_timer_handle_t timer;
+    sampler_read_t read;            // NULL: not registered
+    void *ctx;
+    int64_t period_us;
+    int64_t next_us;                // Deadline of the next read
+    sampler_stats_t stats;          // Written by the timer callback only
+    atomic_uint head;               // Written by the timer callback only
+    atomic_uint tail;               // Written by the consumer only
+    sampler_sample_t ring[SAMPLER_RING_LEN];
+} source_t;
+
+_Static_assert((SAMPLER_RING_LEN & (SAMPLER_RING_LEN - 1)) == 0, "SAMPLER_RING_LEN must be a power of two");
+
+static source_t s_sources[SAMPLER_MAX_SOURCES];
+
+static void sample_cb(void *arg)
+{
+    source_t *src = arg;
+    int64_t now = esp_timer_get_time();
+
+    int64_t late = now - src->next_us;
+    if (late > 0) {
+        // skip_unhandled_events drops the alarms of a stalled timer task
+        int64_t skipped = late / src->period_us;
+        src->stats.missed += (uint32_t)skipped;
+        src->next_us += skipped * src->period_us;
+        late -= skipped * src->period_us;
+        if (late > src->stats.late_max_us) {
+            src->stats.late_max_us = (uint32_t)late;
+        }
+    }
+    src->next_us += src->period_us;
+
+    int32_t value;
+    if (!src->read(src->ctx, &value)) {
+        return;
+    }
+    unsigned int head = atomic_load_explicit(&src->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&src->tail, memory_order_acquire);
+    if (head - tail >= SAMPLER_RING_LEN) {
+        src->stats.dropped++;
+        return;
+    }
+    sampler_sample_t *slot = &src->ring[head % SAMPLER_RING_LEN];
+    slot->t_us = now;
+    slot->value = value;
+    atomic_store_explicit(&src->head, head + 1, memory_order_release);
+    src->stats.samples++;
+}
+
+esp_err_t sampler_register(uint8_t id, const char *name, uint32_t period_ms, sampler_read_t read, void *ctx)
+{
+    if (id >= SAMPLER_MAX_SOURCES || name == NULL || period_ms == 0 || read == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    source_t *src = &s_sources[id];
+    if (src->read != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = sample_cb,
+        .arg = src,
+        .name = name,
+        .skip_unhandled_events = true,
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &src->timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+    src->ctx = ctx;
+    src->period_us = (int64_t)period_ms * 1000;
+    memset(&src->stats, 0, sizeof(src->stats));
+    atomic_store(&src->head, 0);
+    atomic_store(&src->tail, 0);
+    src->read = read;
+
+    src->next_us = esp_timer_get_time() + src->period_us;
+    err = esp_timer_start_periodic(src->timer, (uint64_t)src->period_us);
+    if (err != ESP_OK) {
+        esp_timer_delete(src->timer);
+        src->timer = NULL;
+        src->read = NULL;
+        return err;
+    }
+    ESP_LOGI(TAG, "Sampling %s every %lu ms", name, (unsigned long)period_ms);
+    return ESP_OK;
+}
+
+bool sampler_pop(uint8_t id, sampler_sample_t *out)
+{
+    if (id >= SAMPLER_MAX_SOURCES || s_sources[id].read == NULL) {
+        return false;
+    }
+    source_t *src = &s_sources[id];
+    unsigned int tail = atomic_load_explicit(&src->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&src->head, memory_order_acquire);
+    if (tail == head) {
+        return false;
+    }
+    *out = src->ring[tail % SAMPLER_RING_LEN];
+    atomic_store_explicit(&src->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+esp_err_t sampler_get_stats(uint8_t id, sampler_stats_t *out)
+{
+    if (id >= SAMPLER_MAX_SOURCES || s_sources[id].read == NULL || out == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    // Word-sized counters: each one is consistent, the set may be a tick apart
+    *out = s_sources[id].stats;
+    return ESP_OK;
+}
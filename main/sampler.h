@@ -0,0 +1,88 @@
+/* Sampling Scheduler Header
+ *
+ * Reads registered sources at fixed periods, independent of the
+ * application state machine. Each source has its own periodic esp_timer,
+ * whose alarms are absolute, so a late read does not push the next one
+ * back and the period does not drift. Reads run in the esp_timer task,
+ * above every application task, so TLS handshakes or HTTP requests do not
+ * delay them; only flash writes, which stall all code outside IRAM, do,
+ * and those show up in the lateness counters.
+ *
+ * Every sample is stamped with esp_timer_get_time() at the read and
+ * pushed into the source's single-producer/single-consumer ring, which
+ * the consumer (usually the aggregation engine, see
+ * stats_agg_bind_source()) drains at its own pace.
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SAMPLER_MAX_SOURCES CONFIG_APP_SAMPLER_MAX_SOURCES
+#define SAMPLER_RING_LEN 32             // Power of two: samples a consumer may fall behind
+
+/**
+ * @brief Read one value of a source
+ *
+ * Called from the esp_timer task; must not block.
+ *
+ * @param ctx Context given to sampler_register()
+ * @param value Sample to record
+ * @return false to skip this period (e.g. source unavailable)
+ */
+typedef bool (*sampler_read_t)(void *ctx, int32_t *value);
+
+typedef struct {
+    int64_t t_us;                   // esp_timer_get_time() at the read
+    int32_t value;
+} sampler_sample_t;
+
+typedef struct {
+    uint32_t samples;               // Pushed into the ring
+    uint32_t dropped;               // Lost because the ring was full
+    uint32_t missed;                // Periods skipped entirely (timer task stalled)
+    uint32_t late_max_us;           // Largest delay of a read after its deadline
+} sampler_stats_t;
+
+/**
+ * @brief Register a source and start sampling it
+ *
+ * @param id 0 to SAMPLER_MAX_SOURCES - 1, chosen by the caller
+ * @param name Static string, used as the timer name
+ * @param period_ms Sampling period
+ * @param read Called once per period
+ * @param ctx Passed to read
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_INVALID_STATE if the ID is
+ *         taken, or an esp_timer error
+ */
+esp_err_t sampler_register(uint8_t id, const char *name, uint32_t period_ms, sampler_read_t read, void *ctx);
+
+/**
+ * @brief Take the oldest sample of a source
+ *
+ * Single consumer per source.
+ *
+ * @return false if the ring is empty or the source is not registered
+ */
+bool sampler_pop(uint8_t id, sampler_sample_t *out);
+
+/**
+ * @brief Timing and ring counters of a source
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND for an unregistered ID
+ */
+esp_err_t sampler_get_stats(uint8_t id, sampler_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SAMPLER_H
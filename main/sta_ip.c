@@ -0,0 +1,120 @@
+/* STA IP Configuration Implementation
+ *
+ * The settings are one NVS blob next to the WiFi credentials. A static
+ * address stops the DHCP client; esp_netif then posts IP_EVENT_STA_GOT_IP
+ * as soon as the station associates, so the state machine sees the same
+ * event either way.
+ */
+
+#include <string.h>
+#include "sta_ip.h"
+#include "device_config.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "lwip/inet.h"
+
+static const char *TAG = "sta_ip";
+
+#define NVS_KEY_STA_IP "sta_ip"
+
+static esp_netif_t *s_netif = NULL;
+
+static bool parse_addr(const char *str, uint32_t *out)
+{
+    esp_ip4_addr_t addr;
+    if (str == NULL || str[0] == '\0' || esp_netif_str_to_ip4(str, &addr) != ESP_OK) {
+        return false;
+    }
+    *out = addr.addr;
+    return true;
+}
+
+esp_err_t sta_ip_parse(const char *ip, const char *netmask, const char *gw, const char *dns,
+                       sta_ip_static_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (ip == NULL || ip[0] == '\0') {
+        return ESP_OK;
+    }
+    if (!parse_addr(ip, &out->ip) || !parse_addr(netmask, &out->netmask) || !parse_addr(gw, &out->gw)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (dns != NULL && dns[0] != '\0' && !parse_addr(dns, &out->dns)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t mask = ntohl(out->netmask);
+    bool contiguous = mask != 0 && (~mask & (~mask + 1)) == 0;
+    if (!contiguous || out->ip == 0 || (out->ip & out->netmask) != (out->gw & out->netmask) ||
+        out->ip == out->gw) {
+        memset(out, 0, sizeof(*out));
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+esp_err_t sta_ip_save(const sta_ip_static_t *cfg)
+{
+    if (cfg == NULL || cfg->ip == 0) {
+        return device_config_erase(NVS_KEY_STA_IP);
+    }
+    return device_config_set_blob(NVS_KEY_STA_IP, cfg, sizeof(*cfg));
+}
+
+esp_err_t sta_ip_init(void)
+{
+    if (s_netif != NULL) {
+        return ESP_OK;
+    }
+    s_netif = esp_netif_create_default_wifi_sta();
+    return s_netif != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t sta_ip_apply(void)
+{
+    sta_ip_static_t cfg = {0};
+    size_t len = sizeof(cfg);
+    if (device_config_get_blob(NVS_KEY_STA_IP, &cfg, &len) != ESP_OK || len != sizeof(cfg)) {
+        cfg.ip = 0;
+    }
+    return sta_ip_apply_config(&cfg);
+}
+
+esp_err_t sta_ip_apply_config(const sta_ip_static_t *cfg)
+{
+    esp_netif_t *netif = s_netif;
+    if (netif == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err;
+    if (cfg == NULL || cfg->ip == 0) {
+        // The last lease is requested again by lwIP's own restore logic
+        err = esp_netif_dhcpc_start(netif);
+        return err == ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED ? ESP_OK : err;
+    }
+
+    err = esp_netif_dhcpc_stop(netif);
+    if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED) {
+        return err;
+    }
+    const esp_netif_ip_info_t info = {
+        .ip.addr = cfg->ip,
+        .netmask.addr = cfg->netmask,
+        .gw.addr = cfg->gw,
+    };
+    err = esp_netif_set_ip_info(netif, &info);
+    if (err != ESP_OK) {
+        return err;
+    }
+    esp_netif_dns_info_t dns = {
+        .ip.u_addr.ip4.addr = cfg->dns != 0 ? cfg->dns : cfg->gw,
+        .ip.type = ESP_IPADDR_TYPE_V4,
+    };
+    err = esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns);
+    if (err != ESP_OK) {
+        return err;
+    }
+    ESP_LOGI(TAG, "Static IP " IPSTR ", gateway " IPSTR, IP2STR(&info.ip), IP2STR(&info.gw));
+    return ESP_OK;
+}
@@ -0,0 +1,84 @@
+/* STA IP Configuration Header
+ *
+ * Chooses how the station interface gets its address before each connect:
+ * a static address, gateway and DNS server delivered in /provision for
+ * sites that assign them, or DHCP. With DHCP, lwIP restores the last
+ * lease (CONFIG_LWIP_DHCP_RESTORE_LAST_IP) and asks for it again with a
+ * single REQUEST (INIT-REBOOT) instead of a full DISCOVER round.
+ */
+
+#ifndef STA_IP_H
+#define STA_IP_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STA_IP_STR_MAX 16               // Dotted quad with terminator
+
+/**
+ * @brief Static IPv4 settings, addresses in network byte order
+ */
+typedef struct {
+    uint32_t ip;                        // 0: use DHCP
+    uint32_t netmask;
+    uint32_t gw;
+    uint32_t dns;                       // 0: ask the gateway
+} sta_ip_static_t;
+
+/**
+ * @brief Parse static settings from dotted quads
+ *
+ * @param ip Address, or NULL/empty for DHCP (the other fields are ignored)
+ * @param netmask Required with an address; must be contiguous
+ * @param gw Required with an address; must be on the same subnet
+ * @param dns Optional, NULL or empty to use the gateway
+ * @param out Parsed settings
+ * @return ESP_OK, or ESP_ERR_INVALID_ARG for a malformed or inconsistent set
+ */
+esp_err_t sta_ip_parse(const char *ip, const char *netmask, const char *gw, const char *dns,
+                       sta_ip_static_t *out);
+
+/**
+ * @brief Store the settings for the next connects
+ *
+ * Joins an open device_config transaction.
+ *
+ * @param cfg Settings, or NULL (or an address of 0) to go back to DHCP
+ */
+esp_err_t sta_ip_save(const sta_ip_static_t *cfg);
+
+/**
+ * @brief Create the default STA interface
+ *
+ * Call after esp_netif_init() and the default event loop, before WiFi
+ * starts, so the interface is attached when the station comes up.
+ *
+ * @return ESP_OK or ESP_ERR_NO_MEM
+ */
+esp_err_t sta_ip_init(void);
+
+/**
+ * @brief Configure the station interface; call before esp_wifi_connect()
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_STATE before sta_ip_init(), or an
+ *         esp_netif error
+ */
+esp_err_t sta_ip_apply(void);
+
+/**
+ * @brief Configure the station interface with settings that are not stored
+ *
+ * @param cfg Settings, or NULL (or an address of 0) for DHCP
+ * @return As sta_ip_apply()
+ */
+esp_err_t sta_ip_apply_config(const sta_ip_static_t *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STA_IP_H
@@ -0,0 +1,204 @@
+/* Task Stack Profiler Implementation
+ *
+ * The high-water mark is kept by FreeRTOS for the life of a task, so a
+ * sample only has to land before the task is deleted; a one-second period
+ * covers everything but tasks that live for less than that. Sampling runs
+ * on the esp_timer task; the table is shared with stack_prof_report()
+ * callers under a mutex.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "stack_prof.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_STACK_PROFILE
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+static const char *TAG = "stack_prof";
+
+#define PROF_MAX_TASKS      40
+#define PROF_SAMPLE_US      1000000
+#define PROF_MIN_HEADROOM   512
+#define PROF_ROUND          256
+
+/**
+ * @brief Tasks whose stack size is a Kconfig option
+ */
+typedef struct {
+    const char *task;
+    const char *key;
+    uint32_t size;
+} stack_budget_t;
+
+static const stack_budget_t s_budgets[] = {
+    {"app_state_machine", "CONFIG_APP_STATE_TASK_STACK", CONFIG_APP_STATE_TASK_STACK},
+    {"startup_prep", "CONFIG_APP_PREP_TASK_STACK", CONFIG_APP_PREP_TASK_STACK},
+    {"mqtt_task", "CONFIG_MQTT_HANDLER_TASK_STACK", CONFIG_MQTT_HANDLER_TASK_STACK},
+    {"httpd", "CONFIG_APP_HTTPD_STACK", CONFIG_APP_HTTPD_STACK},
+#if CONFIG_APP_HTTPD_ASYNC_PROVISION
+    {"prov_worker", "CONFIG_APP_PROV_WORKER_STACK", CONFIG_APP_PROV_WORKER_STACK},
+#endif
+#if CONFIG_APP_PROV_RELAY
+    {"prov_relay", "CONFIG_APP_PROV_RELAY_STACK", CONFIG_APP_PROV_RELAY_STACK},
+#endif
+#if CONFIG_APP_OTA
+    {"ota", "CONFIG_APP_OTA_TASK_STACK", CONFIG_APP_OTA_TASK_STACK},
+    {"ota_write", "CONFIG_APP_OTA_WRITE_STACK", CONFIG_APP_OTA_WRITE_STACK},
+#endif
+    {"main", "CONFIG_ESP_MAIN_TASK_STACK_SIZE", CONFIG_ESP_MAIN_TASK_STACK_SIZE},
+    {"sys_evt", "CONFIG_ESP_SYSTEM_EVENT_TASK_STACK_SIZE", CONFIG_ESP_SYSTEM_EVENT_TASK_STACK_SIZE},
+    {"esp_timer", "CONFIG_ESP_TIMER_TASK_STACK_SIZE", CONFIG_ESP_TIMER_TASK_STACK_SIZE},
+    {"tiT", "CONFIG_LWIP_TCPIP_TASK_STACK_SIZE", CONFIG_LWIP_TCPIP_TASK_STACK_SIZE},
+    {"Tmr Svc", "CONFIG_FREERTOS_TIMER_TASK_STACK_DEPTH", CONFIG_FREERTOS_TIMER_TASK_STACK_DEPTH},
+};
+
+typedef struct {
+    char name[configMAX_TASK_NAME_LEN];
+    uint32_t free_min;      // Bytes never touched, lowest over all samples
+} stack_entry_t;
+
+static stack_entry_t s_entries[PROF_MAX_TASKS];
+static int s_entry_count = 0;
+static TaskStatus_t s_status[PROF_MAX_TASKS];
+static SemaphoreHandle_t s_lock = NULL;
+static esp_timer_handle_t s_timer = NULL;
+static uint32_t s_samples = 0;
+
+/**
+ * @brief Task names are truncated to configMAX_TASK_NAME_LEN - 1 characters
+ */
+static bool name_matches(const char *task_name, const char *name)
+{
+    return strncmp(task_name, name, configMAX_TASK_NAME_LEN - 1) == 0;
+}
+
+static stack_entry_t *entry_for(const char *name)
+{
+    for (int i = 0; i < s_entry_count; i++) {
+        if (name_matches(s_entries[i].name, name)) {
+            return &s_entries[i];
+        }
+    }
+    if (s_entry_count == PROF_MAX_TASKS) {
+        return NULL;
+    }
+    stack_entry_t *e = &s_entries[s_entry_count++];
+    strlcpy(e->name, name, sizeof(e->name));
+    e->free_min = UINT32_MAX;
+    return e;
+}
+
+static void sample_locked(void)
+{
+    UBaseType_t count = uxTaskGetSystemState(s_status, PROF_MAX_TASKS, NULL);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %d tasks, sample skipped", PROF_MAX_TASKS);
+        return;
+    }
+    for (UBaseType_t i = 0; i < count; i++) {
+        stack_entry_t *e = entry_for(s_status[i].pcTaskName);
+        // The high-water mark is in bytes on ESP-IDF (StackType_t is uint8_t)
+        uint32_t free_bytes = s_status[i].usStackHighWaterMark;
+        if (e != NULL && free_bytes < e->free_min) {
+            e->free_min = free_bytes;
+        }
+    }
+    s_samples++;
+}
+
+static const stack_budget_t *budget_for(const char *name)
+{
+    for (size_t i = 0; i < sizeof(s_budgets) / sizeof(s_budgets[0]); i++) {
+        if (name_matches(name, s_budgets[i].task)) {
+            return &s_budgets[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t suggest(uint32_t used)
+{
+    uint32_t headroom = used * CONFIG_APP_STACK_PROFILE_MARGIN_PCT / 100;
+    if (headroom < PROF_MIN_HEADROOM) {
+        headroom = PROF_MIN_HEADROOM;
+    }
+    return (used + headroom + PROF_ROUND - 1) / PROF_ROUND * PROF_ROUND;
+}
+
+static void report_locked(void)
+{
+    uint32_t budgeted = 0;
+    uint32_t suggested = 0;
+    for (int i = 0; i < s_entry_count; i++) {
+        const stack_entry_t *e = &s_entries[i];
+        const stack_budget_t *b = budget_for(e->name);
+        if (b == NULL || e->free_min > b->size) {
+            printf("STACK {\"task\":\"%s\",\"free_min\":%lu}\n", e->name, (unsigned long)e->free_min);
+            continue;
+        }
+        uint32_t used = b->size - e->free_min;
+        uint32_t s = suggest(used);
+        printf("STACK {\"task\":\"%s\",\"free_min\":%lu,\"size\":%lu,\"used\":%lu,\"suggest\":%lu,"
+               "\"key\":\"%s\"}\n", e->name, (unsigned long)e->free_min, (unsigned long)b->size,
+               (unsigned long)used, (unsigned long)s, b->key);
+        budgeted += b->size;
+        suggested += s;
+    }
+    printf("STACK {\"event\":\"summary\",\"samples\":%lu,\"tasks\":%d,\"budgeted\":%lu,\"suggested\":%lu,"
+           "\"reclaimable\":%ld}\n", (unsigned long)s_samples, s_entry_count, (unsigned long)budgeted,
+           (unsigned long)suggested, (long)budgeted - (long)suggested);
+}
+
+static void timer_cb(void *arg)
+{
+    static uint32_t ticks = 0;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    sample_locked();
+    if (++ticks >= CONFIG_APP_STACK_PROFILE_REPORT_S) {
+        ticks = 0;
+        report_locked();
+    }
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t stack_prof_start(void)
+{
+    if (s_timer != NULL) {
+        return ESP_OK;
+    }
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = timer_cb,
+        .name = "stack_prof",
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &s_timer);
+    if (err == ESP_OK) {
+        err = esp_timer_start_periodic(s_timer, PROF_SAMPLE_US);
+    }
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Sampling task stacks, report every %d s", CONFIG_APP_STACK_PROFILE_REPORT_S);
+    }
+    return err;
+}
+
+void stack_prof_report(void)
+{
+    if (s_lock == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    sample_locked();
+    report_locked();
+    xSemaphoreGive(s_lock);
+}
+
+#endif // CONFIG_APP_STACK_PROFILE
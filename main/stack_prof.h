@@ -0,0 +1,41 @@
+/* Task Stack Profiler Header
+ *
+ * Samples the stack high-water mark of every FreeRTOS task on a timer and
+ * keeps the lowest value seen per task name, so tasks that come and go
+ * (the provisioning HTTP server, the startup preparation task) are still
+ * counted after they are deleted. The report prints one "STACK " JSON line
+ * per task and, for the tasks whose stack is set in Kconfig, a suggested
+ * value: the measured peak plus CONFIG_APP_STACK_PROFILE_MARGIN_PCT
+ * (at least 512 bytes), rounded up to 256 bytes.
+ *
+ * The numbers are only as good as the workload: profile a build that
+ * goes through provisioning, a CSR round trip and the APP_BENCH_E2E load
+ * before shrinking anything. Built only with CONFIG_APP_STACK_PROFILE.
+ */
+
+#ifndef STACK_PROF_H
+#define STACK_PROF_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Start sampling; reports every CONFIG_APP_STACK_PROFILE_REPORT_S
+ *
+ * @return ESP_OK or an esp_timer error
+ */
+esp_err_t stack_prof_start(void);
+
+/**
+ * @brief Take a sample and print the report now
+ */
+void stack_prof_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STACK_PROF_H
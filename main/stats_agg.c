@@ -0,0 +1,515 @@
+/* Stats Aggregation Implementation
+ *
+ * Accumulators are kept as struct-of-arrays indexed [metric][pane], so
+ * recording touches four adjacent words per field array and a window
+ * summary walks one contiguous row. A sliding window is the merge of its
+ * panes; when a pane's slide_s elapses the window is summarized, the
+ * oldest pane is cleared and becomes the one receiving samples.
+ *
+ * Metrics with quantiles enabled also get one KLL sketch per pane, taken
+ * from a static pool. An update now and then sorts and halves a level, so
+ * the sketches are guarded by a mutex of their own and only the
+ * accumulators by the spinlock; a recorder takes the mutex first, so it
+ * sees the same pane index under both. A window's sketch is the merge of
+ * its panes' sketches, built outside both locks from copies taken one pane
+ * at a time. The encoded sketch rides in the summary record when that
+ * still fits a batch, and in a record of its own otherwise.
+ *
+ * Report-by-exception filters see each sample under the same lock as the
+ * accumulators, one compare and one rate check, and decide at the
+ * summary whether it is queued.
+ *
+ * The one-second tick runs in the esp_timer task. Summaries are handed to
+ * the telemetry batcher, so the tick never waits for the network.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "stats_agg.h"
+#include "agg_kernels.h"
+#include "kll_sketch.h"
+#include "mqtt_handler.h"
+#include "sampler.h"
+#include "telemetry.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mbedtls/base64.h"
+
+static const char *TAG = "stats_agg";
+
+#define METRICS STATS_AGG_MAX_METRICS
+#define PANES STATS_AGG_MAX_PANES
+#define SKETCHES CONFIG_APP_AGG_QUANTILE_SKETCHES
+#define SUMMARY_JSON_MAX (TELEMETRY_AGG_SUMMARY_JSON_MAX + 3 * 18)     // Record, then p50/p95/p99
+
+// Configuration and pane position, per metric
+static const char *s_name[METRICS];
+static stats_agg_poll_t s_poll[METRICS];
+static int8_t s_source[METRICS];            // Sampler source drained each tick, -1: none
+static uint16_t s_window_s[METRICS];
+static uint16_t s_slide_s[METRICS];
+static uint8_t s_panes[METRICS];            // 0: not registered
+static uint8_t s_pane[METRICS];             // Pane receiving samples
+static uint16_t s_elapsed_s[METRICS];       // Seconds into that pane
+static rbe_filter_t s_filter[METRICS];
+static bool s_filtered[METRICS];            // s_filter[id] decides which summaries go out
+static uint32_t s_suppressed = 0;
+
+// Pane accumulators
+static uint32_t s_count[METRICS][PANES];
+static int64_t s_sum[METRICS][PANES];
+static int32_t s_min[METRICS][PANES];
+static int32_t s_max[METRICS][PANES];
+
+#if SKETCHES > 0
+// Quantile sketches: s_sketch[id] points at s_panes[id] consecutive pool entries
+static kll_sketch_t s_sketch_pool[SKETCHES];
+static int s_sketch_used = 0;
+static kll_sketch_t *s_sketch[METRICS];
+static SemaphoreHandle_t s_sketch_mutex = NULL;
+static StaticSemaphore_t s_sketch_mutex_buf;
+
+// Tick scratch: the merged window and the pane being merged into it
+static kll_sketch_t s_window_sketch;
+static kll_sketch_t s_pane_copy;
+
+static const float s_quantiles[] = { 0.5f, 0.95f, 0.99f };
+static uint8_t s_sketch_bin[KLL_SKETCH_ENCODED_MAX];
+static char s_json[SUMMARY_JSON_MAX + (KLL_SKETCH_ENCODED_MAX + 2) / 3 * 4 + 1];
+#endif
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t s_timer = NULL;
+static const char *s_topic = NULL;
+
+static void pane_clear(int id, int pane)
+{
+    s_count[id][pane] = 0;
+    s_sum[id][pane] = 0;
+    s_min[id][pane] = INT32_MAX;
+    s_max[id][pane] = INT32_MIN;
+}
+
+static void rotate_locked(int id)
+{
+    s_pane[id] = (s_pane[id] + 1) % s_panes[id];
+    pane_clear(id, s_pane[id]);
+}
+
+static void summarize_locked(int id, stats_agg_summary_t *out)
+{
+    out->count = 0;
+    out->sum = 0;
+    out->min = INT32_MAX;
+    out->max = INT32_MIN;
+    for (int p = 0; p < s_panes[id]; p++) {
+        out->count += s_count[id][p];
+        out->sum += s_sum[id][p];
+        if (s_min[id][p] < out->min) {
+            out->min = s_min[id][p];
+        }
+        if (s_max[id][p] > out->max) {
+            out->max = s_max[id][p];
+        }
+    }
+}
+
+#if SKETCHES > 0
+/**
+ * @brief Merge the panes' sketches into s_window_sketch
+ *
+ * Each pane is copied under the sketch mutex and merged outside it, so
+ * recorders are held off for a memcpy at a time.
+ */
+static void window_sketch(int id)
+{
+    kll_sketch_init(&s_window_sketch);
+    for (int p = 0; p < s_panes[id]; p++) {
+        xSemaphoreTake(s_sketch_mutex, portMAX_DELAY);
+        memcpy(&s_pane_copy, &s_sketch[id][p], sizeof(s_pane_copy));
+        xSemaphoreGive(s_sketch_mutex);
+        kll_sketch_merge(&s_window_sketch, &s_pane_copy);
+    }
+}
+
+/**
+ * @brief Move to the next pane and clear its sketch
+ */
+static void rotate_sketched(int id)
+{
+    xSemaphoreTake(s_sketch_mutex, portMAX_DELAY);
+    portENTER_CRITICAL(&s_lock);
+    rotate_locked(id);
+    int p = s_pane[id];
+    portEXIT_CRITICAL(&s_lock);
+    kll_sketch_init(&s_sketch[id][p]);
+    xSemaphoreGive(s_sketch_mutex);
+}
+
+/**
+ * @brief Append p50/p95/p99 to a summary
+ */
+static int append_quantiles(char *json, size_t size, int len)
+{
+    int32_t q[sizeof(s_quantiles) / sizeof(s_quantiles[0])];
+    if (kll_sketch_quantiles(&s_window_sketch, s_quantiles, sizeof(q) / sizeof(q[0]), q) != ESP_OK) {
+        return len;
+    }
+    int n = snprintf(json + len, size - len, ",\"p50\":%ld,\"p95\":%ld,\"p99\":%ld",
+                     (long)q[0], (long)q[1], (long)q[2]);
+    if (n < 0 || n >= (int)(size - len)) {
+        return -1;
+    }
+    return len + n;
+}
+
+/**
+ * @brief Append the base64 window sketch as "kll"
+ *
+ * @return New length, or len unchanged if the sketch does not fit
+ */
+static int append_sketch(char *json, size_t size, int len)
+{
+    size_t bin_len;
+    size_t b64_len;
+    static const char key[] = ",\"kll\":\"";
+    if (kll_sketch_encode(&s_window_sketch, s_sketch_bin, sizeof(s_sketch_bin), &bin_len) == ESP_OK &&
+        len + sizeof(key) - 1 < size &&
+        mbedtls_base64_encode((unsigned char *)json + len + sizeof(key) - 1, size - len - (sizeof(key) - 1) - 1,
+                              &b64_len, s_sketch_bin, bin_len) == 0) {
+        memcpy(json + len, key, sizeof(key) - 1);
+        len += sizeof(key) - 1 + b64_len;
+        json[len++] = '"';
+    }
+    return len;
+}
+#endif
+
+static void publish_summary(int id, const stats_agg_summary_t *sum, bool quantiles)
+{
+    const telemetry_agg_summary_t rec = {
+        .m = s_name[id],
+        .t = (uint32_t)(esp_timer_get_time() / 1000000),
+        .w = s_window_s[id],
+        .n = sum->count,
+        .sum = sum->sum,
+        .min = sum->min,
+        .max = sum->max,
+        .mean = (double)sum->sum / sum->count,
+    };
+
+#if SKETCHES > 0
+    char *json = s_json;
+    size_t size = sizeof(s_json);
+#else
+    char json[SUMMARY_JSON_MAX];
+    size_t size = sizeof(json);
+#endif
+    // Closing brace included, a record must stay within what one batch takes
+    int max = mqtt_handler_batch_sample_max();
+    int len = (int)telemetry_agg_summary_to_json(&rec, json, false);
+#if SKETCHES > 0
+    bool split = false;
+    if (quantiles) {
+        len = append_quantiles(json, size, len);
+        if (len >= 0) {
+            int full = append_sketch(json, size, len);
+            split = full == len || full + 1 > max;
+            if (!split) {
+                len = full;
+            }
+        }
+    }
+#endif
+    if (len < 0 || len + 1 >= (int)size) {
+        return;
+    }
+    json[len++] = '}';
+    esp_err_t err = mqtt_handler_batch_add(s_topic, json, len, 0);
+    if (err != ESP_OK) {
+        ESP_LOGD(TAG, "Summary for %s not queued: %s", s_name[id], esp_err_to_name(err));
+        return;
+    }
+
+#if SKETCHES > 0
+    if (!split) {
+        return;
+    }
+    // The sketch on a line of its own, keyed like the summary it belongs to
+    len = snprintf(json, size, "{\"m\":\"%s\",\"t\":%lu,\"w\":%u",
+                   rec.m, (unsigned long)rec.t, (unsigned)rec.w);
+    int full = (len > 0 && len < (int)size) ? append_sketch(json, size, len) : len;
+    if (full == len || full + 1 > max || full + 1 >= (int)size) {
+        ESP_LOGD(TAG, "Sketch for %s does not fit a batch, left out", s_name[id]);
+        return;
+    }
+    json[full++] = '}';
+    err = mqtt_handler_batch_add(s_topic, json, full, 0);
+    if (err != ESP_OK) {
+        ESP_LOGD(TAG, "Sketch for %s not queued: %s", s_name[id], esp_err_to_name(err));
+    }
+#endif
+}
+
+static void tick_cb(void *arg)
+{
+    for (int id = 0; id < METRICS; id++) {
+        if (s_panes[id] == 0) {
+            continue;
+        }
+        int32_t value;
+        if (s_poll[id] != NULL && s_poll[id](&value)) {
+            stats_agg_record(id, value);
+        }
+        sampler_sample_t sample;
+        while (s_source[id] >= 0 && sampler_pop(s_source[id], &sample)) {
+            stats_agg_record(id, sample.value);
+        }
+
+        stats_agg_summary_t sum;
+        bool due = false;
+        bool quantiles = false;
+        uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+        portENTER_CRITICAL(&s_lock);
+        if (++s_elapsed_s[id] >= s_slide_s[id]) {
+            summarize_locked(id, &sum);
+            s_elapsed_s[id] = 0;
+            due = sum.count > 0;
+            if (due && s_filtered[id] && !rbe_filter_report(&s_filter[id], (int32_t)(sum.sum / sum.count), now_ms)) {
+                due = false;
+                s_suppressed++;
+            }
+#if SKETCHES > 0
+            quantiles = s_sketch[id] != NULL;
+#endif
+            // A window with a sketch rotates once the sketch is merged
+            if (!quantiles) {
+                rotate_locked(id);
+            }
+        }
+        portEXIT_CRITICAL(&s_lock);
+
+#if SKETCHES > 0
+        if (quantiles) {
+            window_sketch(id);
+            rotate_sketched(id);
+        }
+#endif
+        if (due) {
+            publish_summary(id, &sum, quantiles);
+        }
+    }
+}
+
+esp_err_t stats_agg_init(const char *topic)
+{
+    if (s_timer != NULL) {
+        return ESP_OK;
+    }
+    s_topic = topic;
+#if SKETCHES > 0
+    if (s_sketch_mutex == NULL) {
+        s_sketch_mutex = xSemaphoreCreateMutexStatic(&s_sketch_mutex_buf);
+    }
+#endif
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = tick_cb,
+        .name = "stats_agg",
+        .skip_unhandled_events = true,
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &s_timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = esp_timer_start_periodic(s_timer, 1000000);
+    if (err != ESP_OK) {
+        esp_timer_delete(s_timer);
+        s_timer = NULL;
+    }
+    return err;
+}
+
+esp_err_t stats_agg_register(uint8_t id, const char *name, uint16_t window_s, uint16_t slide_s,
+                             stats_agg_poll_t poll)
+{
+    if (id >= METRICS || name == NULL || slide_s == 0 || window_s % slide_s != 0 ||
+        window_s / slide_s == 0 || window_s / slide_s > PANES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_OK;
+    portENTER_CRITICAL(&s_lock);
+    if (s_panes[id] != 0) {
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        s_name[id] = name;
+        s_poll[id] = poll;
+        s_source[id] = -1;
+        s_window_s[id] = window_s;
+        s_slide_s[id] = slide_s;
+        s_pane[id] = 0;
+        s_elapsed_s[id] = 0;
+        for (int p = 0; p < PANES; p++) {
+            pane_clear(id, p);
+        }
+        // Published last: the tick and recorders skip the ID until then
+        s_panes[id] = window_s / slide_s;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return err;
+}
+
+void stats_agg_record(uint8_t id, int32_t value)
+{
+    if (id >= METRICS || s_panes[id] == 0) {
+        return;
+    }
+    uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+#if SKETCHES > 0
+    bool sketched = s_sketch[id] != NULL;
+    if (sketched) {
+        xSemaphoreTake(s_sketch_mutex, portMAX_DELAY);
+    }
+#endif
+    portENTER_CRITICAL(&s_lock);
+    if (s_filtered[id]) {
+        rbe_filter_sample(&s_filter[id], value, now_ms);
+    }
+    int p = s_pane[id];
+    s_count[id][p]++;
+    s_sum[id][p] += value;
+    if (value < s_min[id][p]) {
+        s_min[id][p] = value;
+    }
+    if (value > s_max[id][p]) {
+        s_max[id][p] = value;
+    }
+    portEXIT_CRITICAL(&s_lock);
+#if SKETCHES > 0
+    if (sketched) {
+        kll_sketch_update(&s_sketch[id][p], value);
+        xSemaphoreGive(s_sketch_mutex);
+    }
+#endif
+}
+
+void stats_agg_record_block(uint8_t id, const int32_t *values, size_t n)
+{
+    if (id >= METRICS || s_panes[id] == 0 || values == NULL || n == 0) {
+        return;
+    }
+
+    // Reduce outside the lock, merge inside it
+    int64_t sum;
+    int32_t min;
+    int32_t max;
+    agg_reduce_s32(values, n, &sum, &min, &max);
+    uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+
+#if SKETCHES > 0
+    bool sketched = s_sketch[id] != NULL;
+    if (sketched) {
+        xSemaphoreTake(s_sketch_mutex, portMAX_DELAY);
+    }
+#endif
+    portENTER_CRITICAL(&s_lock);
+    if (s_filtered[id]) {
+        // The extremes decide the deadband; the rate is seen across blocks
+        rbe_filter_sample(&s_filter[id], min, now_ms);
+        rbe_filter_sample(&s_filter[id], max, now_ms);
+    }
+    int p = s_pane[id];
+    s_count[id][p] += n;
+    s_sum[id][p] += sum;
+    if (min < s_min[id][p]) {
+        s_min[id][p] = min;
+    }
+    if (max > s_max[id][p]) {
+        s_max[id][p] = max;
+    }
+    portEXIT_CRITICAL(&s_lock);
+#if SKETCHES > 0
+    if (sketched) {
+        for (size_t i = 0; i < n; i++) {
+            kll_sketch_update(&s_sketch[id][p], values[i]);
+        }
+        xSemaphoreGive(s_sketch_mutex);
+    }
+#endif
+}
+
+esp_err_t stats_agg_bind_source(uint8_t id, uint8_t source)
+{
+    if (id >= METRICS || s_panes[id] == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (source >= SAMPLER_MAX_SOURCES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_source[id] = (int8_t)source;
+    return ESP_OK;
+}
+
+esp_err_t stats_agg_enable_quantiles(uint8_t id)
+{
+#if SKETCHES > 0
+    if (id >= METRICS || s_panes[id] == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (s_sketch_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = ESP_OK;
+    portENTER_CRITICAL(&s_lock);
+    if (s_sketch[id] == NULL) {
+        if (s_sketch_used + s_panes[id] > SKETCHES) {
+            err = ESP_ERR_NO_MEM;
+        } else {
+            kll_sketch_t *sk = &s_sketch_pool[s_sketch_used];
+            for (int p = 0; p < s_panes[id]; p++) {
+                kll_sketch_init(&sk[p]);
+            }
+            s_sketch_used += s_panes[id];
+            s_sketch[id] = sk;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t stats_agg_set_filter(uint8_t id, const rbe_filter_cfg_t *cfg)
+{
+    if (id >= METRICS || s_panes[id] == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    portENTER_CRITICAL(&s_lock);
+    if (cfg != NULL) {
+        rbe_filter_init(&s_filter[id], cfg);
+    }
+    s_filtered[id] = cfg != NULL;
+    portEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+uint32_t stats_agg_suppressed(void)
+{
+    return s_suppressed;
+}
+
+esp_err_t stats_agg_get(uint8_t id, stats_agg_summary_t *out)
+{
+    if (id >= METRICS || s_panes[id] == 0 || out == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    portENTER_CRITICAL(&s_lock);
+    summarize_locked(id, out);
+    portEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
@@ -0,0 +1,158 @@
+/* Stats Aggregation Header
+ *
+ * Reduces high-rate samples on the device and publishes only window
+ * summaries (count, sum, min, max, mean). Metrics are registered by a
+ * small integer ID; each has a window of `window_s` seconds that advances
+ * every `slide_s` seconds. slide_s == window_s gives tumbling windows,
+ * a smaller slide gives sliding windows made of window_s / slide_s panes.
+ *
+ * Values are int32 in the metric's own fixed-point unit (e.g. dBm,
+ * microseconds, bytes). Recording is a handful of stores under a spinlock
+ * and may be called from any task, but not from an ISR.
+ *
+ * Latency-style metrics can also carry p50/p95/p99 from a fixed-size KLL
+ * sketch (see kll_sketch.h), published with the summary so the backend can
+ * merge windows and devices.
+ *
+ * A metric can be reported by exception (see rbe_filter.h): every sample
+ * is checked against deadband and rate thresholds as it is recorded, and
+ * a window summary is only queued if one was crossed or the heartbeat is
+ * due. Flat signals then cost one summary per heartbeat.
+ */
+
+#ifndef STATS_AGG_H
+#define STATS_AGG_H
+
+#include "esp_err.h"
+#include "rbe_filter.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATS_AGG_MAX_METRICS CONFIG_APP_AGG_MAX_METRICS
+#define STATS_AGG_MAX_PANES 8           // Sliding windows: window_s / slide_s
+
+/**
+ * @brief Polled once per second for gauge-style metrics
+ *
+ * Called from the esp_timer task; must not block.
+ *
+ * @param value Sample to record
+ * @return false to record nothing this second (e.g. source unavailable)
+ */
+typedef bool (*stats_agg_poll_t)(int32_t *value);
+
+/**
+ * @brief Summary of one window
+ */
+typedef struct {
+    uint32_t count;
+    int64_t sum;
+    int32_t min;                    // Only meaningful when count > 0
+    int32_t max;
+} stats_agg_summary_t;
+
+/**
+ * @brief Start the one-second roll-up timer
+ *
+ * Window summaries are queued with mqtt_handler_batch_add() on `topic`,
+ * one JSON object per window that saw at least one sample.
+ *
+ * @param topic Topic for the summaries (kept by reference)
+ * @return ESP_OK, or an esp_timer error
+ */
+esp_err_t stats_agg_init(const char *topic);
+
+/**
+ * @brief Register a metric
+ *
+ * @param id 0 to STATS_AGG_MAX_METRICS - 1, chosen by the caller
+ * @param name Static string used in the summaries
+ * @param window_s Window length in seconds
+ * @param slide_s Seconds between summaries; must divide window_s into at
+ *                most STATS_AGG_MAX_PANES panes
+ * @param poll Sampled every second, or NULL for metrics fed by
+ *             stats_agg_record() or stats_agg_bind_source()
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for a bad ID or window,
+ *         ESP_ERR_INVALID_STATE if the ID is taken
+ */
+esp_err_t stats_agg_register(uint8_t id, const char *name, uint16_t window_s, uint16_t slide_s,
+                             stats_agg_poll_t poll);
+
+/**
+ * @brief Add one sample; unknown IDs are ignored
+ */
+void stats_agg_record(uint8_t id, int32_t value);
+
+/**
+ * @brief Add n samples at once, taking the lock once
+ */
+void stats_agg_record_block(uint8_t id, const int32_t *values, size_t n);
+
+/**
+ * @brief Feed a metric from a sampler source
+ *
+ * The one-second tick drains the source's ring (see sampler.h) into the
+ * metric, so the samples keep the sampler's period whatever the tick's
+ * jitter. One consumer per source.
+ *
+ * @param source Sampler source ID
+ * @return ESP_OK, ESP_ERR_NOT_FOUND for an unregistered metric,
+ *         ESP_ERR_INVALID_ARG for a bad source ID
+ */
+esp_err_t stats_agg_bind_source(uint8_t id, uint8_t source);
+
+/**
+ * @brief Add p50/p95/p99 and the encoded sketch to a metric's summaries
+ *
+ * Takes one sketch per pane from the CONFIG_APP_AGG_QUANTILE_SKETCHES
+ * pool; samples recorded before the call are not in the sketch. Each
+ * sample then also costs a sketch update, which now and then sorts and
+ * halves one level; that runs under a mutex of the sketches, not the
+ * accumulator spinlock. Summaries gain "p50", "p95" and "p99", and "kll"
+ * with the base64 sketch. A sketch that would push the summary past
+ * mqtt_handler_batch_sample_max() follows it as a record of its own with
+ * only "m", "t", "w" and "kll".
+ *
+ * @return ESP_OK (also if already enabled), ESP_ERR_NOT_FOUND for an
+ *         unregistered ID, ESP_ERR_NO_MEM if the pool is used up,
+ *         ESP_ERR_NOT_SUPPORTED when the pool size is 0,
+ *         ESP_ERR_INVALID_STATE before stats_agg_init()
+ */
+esp_err_t stats_agg_enable_quantiles(uint8_t id);
+
+/**
+ * @brief Report a metric by exception
+ *
+ * Summaries of the metric are queued only when a sample crossed a
+ * threshold of cfg since the last one went out, or cfg->heartbeat_s has
+ * passed; the mean of a queued summary becomes the new reference. The
+ * first summary after the call always goes out.
+ *
+ * @param cfg Thresholds, or NULL to queue every summary again
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND for an unregistered ID
+ */
+esp_err_t stats_agg_set_filter(uint8_t id, const rbe_filter_cfg_t *cfg);
+
+/**
+ * @brief Summaries held back by stats_agg_set_filter() filters, since boot
+ */
+uint32_t stats_agg_suppressed(void);
+
+/**
+ * @brief Summary of the current, still open window
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND for an unregistered ID
+ */
+esp_err_t stats_agg_get(uint8_t id, stats_agg_summary_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STATS_AGG_H
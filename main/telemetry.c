@@ -0,0 +1,136 @@
+/* Telemetry Records Implementation
+ *
+ * The encoders are expanded from the field lists: each field becomes one
+ * call to the put helper of its kind, which stores the value and returns
+ * the advanced pointer. The targets are little-endian, so doubles are
+ * copied as they are.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "telemetry.h"
+#include "mqtt_handler.h"
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+static inline uint8_t *bin_le(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+    return p + bytes;
+}
+
+static inline uint8_t *bin_U8(uint8_t *p, uint8_t v) { *p = v; return p + 1; }
+static inline uint8_t *bin_U16(uint8_t *p, uint16_t v) { return bin_le(p, v, 2); }
+static inline uint8_t *bin_U32(uint8_t *p, uint32_t v) { return bin_le(p, v, 4); }
+static inline uint8_t *bin_I32(uint8_t *p, int32_t v) { return bin_le(p, (uint32_t)v, 4); }
+static inline uint8_t *bin_I64(uint8_t *p, int64_t v) { return bin_le(p, (uint64_t)v, 8); }
+
+static inline uint8_t *bin_F64(uint8_t *p, double v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static inline uint8_t *bin_STR(uint8_t *p, const char *v)
+{
+    if (v == NULL) {
+        v = "";
+    }
+    size_t len = strnlen(v, TELEMETRY_STR_MAX);
+    *p++ = (uint8_t)len;
+    memcpy(p, v, len);
+    return p + len;
+}
+
+static char *json_u64(char *p, uint64_t v)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+static char *json_i64(char *p, int64_t v)
+{
+    if (v < 0) {
+        *p++ = '-';
+        return json_u64(p, 0 - (uint64_t)v);
+    }
+    return json_u64(p, (uint64_t)v);
+}
+
+static inline char *json_U8(char *p, uint8_t v) { return json_u64(p, v); }
+static inline char *json_U16(char *p, uint16_t v) { return json_u64(p, v); }
+static inline char *json_U32(char *p, uint32_t v) { return json_u64(p, v); }
+static inline char *json_I32(char *p, int32_t v) { return json_i64(p, v); }
+static inline char *json_I64(char *p, int64_t v) { return json_i64(p, v); }
+static inline char *json_F64(char *p, double v) { return p + json_number_format(v, p); }
+
+static inline char *json_STR(char *p, const char *v)
+{
+    if (v == NULL) {
+        v = "";
+    }
+    size_t len = strnlen(v, TELEMETRY_STR_MAX);
+    *p++ = '"';
+    memcpy(p, v, len);
+    p += len;
+    *p++ = '"';
+    return p;
+}
+
+#define BIN_PUT(kind, name) p = bin_##kind(p, rec->name);
+
+#define JSON_PUT(kind, name)                                                \
+    memcpy(p, TELEMETRY_KEY(name), sizeof(TELEMETRY_KEY(name)) - 1);        \
+    p = json_##kind(p + sizeof(TELEMETRY_KEY(name)) - 1, rec->name);
+
+#define DEFINE_ENCODERS(name, FIELDS, id)                                   \
+    size_t telemetry_##name##_encode(const telemetry_##name##_t *rec, uint8_t *out) \
+    {                                                                       \
+        uint8_t *p = out;                                                   \
+        *p++ = id;                                                          \
+        *p++ = TELEMETRY_SCHEMA_VERSION;                                    \
+        TELEMETRY_##FIELDS(BIN_PUT)                                         \
+        return (size_t)(p - out);                                           \
+    }                                                                       \
+                                                                            \
+    size_t telemetry_##name##_to_json(const telemetry_##name##_t *rec, char *out, bool close) \
+    {                                                                       \
+        char *p = out;                                                      \
+        TELEMETRY_##FIELDS(JSON_PUT)                                        \
+        out[0] = '{';                                                       \
+        if (close) {                                                        \
+            *p++ = '}';                                                     \
+        }                                                                   \
+        *p = '\0';                                                          \
+        return (size_t)(p - out);                                           \
+    }
+
+TELEMETRY_RECORDS(DEFINE_ENCODERS)
+
+#define SCHEMA_FIELD(kind, name) " " #name ":" #kind
+#define SCHEMA_RECORD(name, FIELDS, id) #name " " STRINGIFY(id) TELEMETRY_##FIELDS(SCHEMA_FIELD) "\n"
+
+const char telemetry_schema_text[] =
+    "v" STRINGIFY(TELEMETRY_SCHEMA_VERSION) "\n"
+    TELEMETRY_RECORDS(SCHEMA_RECORD);
+
+esp_err_t telemetry_publish_schema(const char *topic)
+{
+    char full_topic[96];
+    int n = snprintf(full_topic, sizeof(full_topic), "%s" TELEMETRY_SCHEMA_TOPIC_SUFFIX, topic);
+    if (n < 0 || n >= (int)sizeof(full_topic)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return mqtt_handler_publish(full_topic, telemetry_schema_text, (int)sizeof(telemetry_schema_text) - 1, 1);
+}
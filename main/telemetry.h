@@ -0,0 +1,108 @@
+/* Telemetry Records Header
+ *
+ * Types and encoders generated from telemetry_schema.h. For each record
+ * R(name, FIELDS, id) the lists below declare:
+ *
+ *   telemetry_<name>_t                 the record, one member per field
+ *   TELEMETRY_<FIELDS>_ID              its id on the wire
+ *   TELEMETRY_<FIELDS>_BIN_MAX         longest binary encoding
+ *   TELEMETRY_<FIELDS>_JSON_MAX        longest JSON object, with the terminator
+ *   telemetry_<name>_encode()          binary encoder
+ *   telemetry_<name>_to_json()         JSON encoder
+ *
+ * The encoders are straight-line code over the fields, with the keys as
+ * precomputed literals; the caller provides a buffer of the _MAX size and
+ * nothing is checked at run time.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "esp_err.h"
+#include "json_number.h"
+#include "telemetry_schema.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TELEMETRY_SCHEMA_TOPIC_SUFFIX "/schema"
+
+#define TELEMETRY_CTYPE_U8      uint8_t
+#define TELEMETRY_CTYPE_U16     uint16_t
+#define TELEMETRY_CTYPE_U32     uint32_t
+#define TELEMETRY_CTYPE_I32     int32_t
+#define TELEMETRY_CTYPE_I64     int64_t
+#define TELEMETRY_CTYPE_F64     double
+#define TELEMETRY_CTYPE_STR     const char *
+
+#define TELEMETRY_BIN_U8        1
+#define TELEMETRY_BIN_U16       2
+#define TELEMETRY_BIN_U32       4
+#define TELEMETRY_BIN_I32       4
+#define TELEMETRY_BIN_I64       8
+#define TELEMETRY_BIN_F64       8
+#define TELEMETRY_BIN_STR       (1 + TELEMETRY_STR_MAX)
+
+#define TELEMETRY_JSON_U8       3
+#define TELEMETRY_JSON_U16      5
+#define TELEMETRY_JSON_U32      10
+#define TELEMETRY_JSON_I32      11
+#define TELEMETRY_JSON_I64      20
+#define TELEMETRY_JSON_F64      (JSON_NUMBER_MAX - 1)
+#define TELEMETRY_JSON_STR      (2 + TELEMETRY_STR_MAX)
+
+// ,"name": -- the opening brace takes the place of the first comma
+#define TELEMETRY_KEY(name)     ",\"" #name "\":"
+
+#define TELEMETRY_MEMBER_(kind, name)    TELEMETRY_CTYPE_##kind name;
+#define TELEMETRY_BIN_SIZE_(kind, name)  + TELEMETRY_BIN_##kind
+#define TELEMETRY_JSON_SIZE_(kind, name) + (sizeof(TELEMETRY_KEY(name)) - 1) + TELEMETRY_JSON_##kind
+
+#define TELEMETRY_DECLARE_(name, FIELDS, id)                                              \
+    typedef struct {                                                                      \
+        TELEMETRY_##FIELDS(TELEMETRY_MEMBER_)                                             \
+    } telemetry_##name##_t;                                                               \
+    enum {                                                                                \
+        TELEMETRY_##FIELDS##_ID = id,                                                     \
+        TELEMETRY_##FIELDS##_BIN_MAX = 2 TELEMETRY_##FIELDS(TELEMETRY_BIN_SIZE_),         \
+        TELEMETRY_##FIELDS##_JSON_MAX = 2 TELEMETRY_##FIELDS(TELEMETRY_JSON_SIZE_),       \
+    };                                                                                    \
+    size_t telemetry_##name##_encode(const telemetry_##name##_t *rec, uint8_t *out);      \
+    size_t telemetry_##name##_to_json(const telemetry_##name##_t *rec, char *out, bool close);
+
+/*
+ * telemetry_<name>_encode(rec, out): writes the binary record to out, at
+ * least _BIN_MAX bytes, and returns its length.
+ *
+ * telemetry_<name>_to_json(rec, out, close): writes the JSON object to
+ * out, at least _JSON_MAX bytes, NUL-terminated, and returns its length.
+ * With close false the closing brace is left off, so the caller can
+ * append members of its own before adding it.
+ */
+TELEMETRY_RECORDS(TELEMETRY_DECLARE_)
+
+/**
+ * @brief Schema text, one line per record
+ *
+ * "v<version>" on the first line, then "<name> <id> <field>:<kind> ..."
+ * for each record, in the order of telemetry_schema.h.
+ */
+extern const char telemetry_schema_text[];
+
+/**
+ * @brief Announce the schema at QoS 1
+ *
+ * @param topic Base topic, TELEMETRY_SCHEMA_TOPIC_SUFFIX is appended
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for a topic too long, or the publish error
+ */
+esp_err_t telemetry_publish_schema(const char *topic);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TELEMETRY_H
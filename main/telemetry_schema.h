@@ -0,0 +1,86 @@
+/* Telemetry Schema
+ *
+ * Every fixed-layout record the device publishes is declared here, once.
+ * telemetry.h expands the field lists into the C struct, the binary and
+ * JSON encoders and their size bounds, and telemetry.c into the schema
+ * text the device announces, so the firmware and the backend decoders
+ * cannot drift apart. Changing a record means editing its list here and
+ * bumping TELEMETRY_SCHEMA_VERSION.
+ *
+ * A field is F(kind, name); kind is one of U8 U16 U32 I32 I64 F64 STR. The
+ * name is both the C member and the JSON key. STR fields hold identifiers
+ * (metric names and the like): they are copied without JSON escaping and
+ * cut at TELEMETRY_STR_MAX bytes.
+ *
+ * Binary layout: u8 record id, u8 schema version, then the fields in list
+ * order, integers and doubles little-endian, STR as a u8 length and the
+ * bytes.
+ */
+
+#ifndef TELEMETRY_SCHEMA_H
+#define TELEMETRY_SCHEMA_H
+
+#define TELEMETRY_SCHEMA_VERSION    1
+#define TELEMETRY_STR_MAX           32
+
+// Window summary of the aggregation engine, on CONFIG_APP_AGG_TOPIC. In JSON,
+// p50, p95, p99 and the base64 sketch "kll" follow for metrics with a sketch;
+// a sketch too large for one batch comes next as {"m","t","w","kll"} instead.
+#define TELEMETRY_AGG_SUMMARY(F)                                            \
+    F(STR, m)       /* Metric name */                                       \
+    F(U32, t)       /* Uptime at the end of the window, s */                \
+    F(U16, w)       /* Window length, s */                                  \
+    F(U32, n)       /* Samples in the window */                             \
+    F(I64, sum)                                                             \
+    F(I32, min)                                                             \
+    F(I32, max)                                                             \
+    F(F64, mean)
+
+// Duty-cycle counters, kept through deep sleep (duty_cycle.h)
+#define TELEMETRY_DUTY_STATS(F)                                             \
+    F(U32, cycles)          /* Wakes since the last full boot */            \
+    F(U32, reports)         /* Reporting wakes that got everything acknowledged */ \
+    F(U32, report_failed)   /* Reporting wakes that ran out of time */      \
+    F(U32, dropped)         /* Samples lost while reports were failing */   \
+    F(U32, last_awake_ms)   /* Previous wake, application start to sleep */ \
+    F(U32, last_radio_ms)   /* Previous reporting wake, WiFi start to sleep */ \
+    F(U32, radio_avg_ms)    /* Average over all reporting wakes */          \
+    F(U32, awake_permille)  /* Share of the time since the last full boot spent awake */
+
+// System health sample, on CONFIG_APP_HEALTH_TOPIC (health.h)
+#define TELEMETRY_HEALTH(F)                                                 \
+    F(U32, t)               /* Uptime, s */                                 \
+    F(U16, cpu0)            /* Core 0 busy since the last sample, permille */ \
+    F(U16, cpu1)            /* Core 1 busy, permille */                     \
+    F(U32, heap)            /* Internal heap free, bytes */                 \
+    F(U32, heap_min)        /* Internal heap low-water mark */              \
+    F(U32, heap_big)        /* Largest free internal block */               \
+    F(U32, dma)             /* DMA-capable heap free */                     \
+    F(U32, psram)           /* PSRAM free, 0 without */                     \
+    F(I32, rssi)            /* dBm, 0 without an AP */                      \
+    F(U8, phy)              /* Negotiated wifi_phy_mode_t */                \
+    F(U32, reconnects)      /* Wi-Fi reconnect attempts since boot */       \
+    F(U16, socks)           /* LwIP netconns in use, with CONFIG_LWIP_STATS */ \
+    F(U16, tcp)             /* TCP PCBs in use, same */                     \
+    F(U16, pbufs)           /* Referenced pbufs in use, same */             \
+    F(U32, outbox)          /* MQTT outbox, bytes */                        \
+    F(U32, inflight)        /* MQTT QoS 1/2 awaiting acknowledgement */     \
+    F(U8, tasks)            /* Task records that follow */                  \
+    F(U16, cost_us)         /* Time taken by the previous sample */
+
+// One per task after each health sample
+#define TELEMETRY_HEALTH_TASK(F)                                            \
+    F(STR, name)                                                            \
+    F(U8, core)             /* Affinity, 255 for none */                    \
+    F(U8, prio)                                                             \
+    F(U16, cpu)             /* Share of one core since the last sample, permille */ \
+    F(U32, stack)           /* Stack never touched, bytes */
+
+// R(name, FIELDS, id): ids go on the wire and are never reused
+#define TELEMETRY_RECORDS(R)                                                \
+    R(agg_summary, AGG_SUMMARY, 1)                                          \
+    R(duty_stats, DUTY_STATS, 2)                                            \
+    R(health, HEALTH, 3)                                                    \
+    R(health_task, HEALTH_TASK, 4)
+
+#endif // TELEMETRY_SCHEMA_H
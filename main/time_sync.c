@@ -0,0 +1,134 @@
+/* Time Sync Implementation
+ *
+ * The drift is the rate error of the esp_timer clock in parts per billion
+ * (positive: the local clock runs slow). It is the error SNTP corrected,
+ * divided by the time since the previous update, averaged with the
+ * previous estimate. Updates closer together than DRIFT_MIN_INTERVAL_US
+ * are too short for the SNTP jitter to average out and only move the base.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "time_sync.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_netif_sntp.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "time_sync";
+
+#define RTC_MAGIC               0x54494d31      // "TIM1"
+#define DRIFT_MIN_INTERVAL_US   (10LL * 60 * 1000000)
+#define DRIFT_MAX_PPB           500000          // 500 ppm, beyond that a sample is an outlier
+
+typedef struct {
+    uint32_t magic;
+    int32_t drift_ppb;
+    int64_t synced_utc_us;              // UTC of the last SNTP update
+    uint32_t crc;
+} rtc_image_t;
+
+// Survives every reset and deep sleep, but not power loss
+RTC_NOINIT_ATTR static rtc_image_t s_rtc;
+
+static int64_t s_base_mono_us = 0;
+static int64_t s_base_utc_us = 0;
+static int32_t s_drift_ppb = 0;
+static bool s_valid = false;
+static bool s_synced = false;           // The base comes from SNTP on this boot
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t image_crc(const rtc_image_t *img)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)img, offsetof(rtc_image_t, crc));
+}
+
+static int64_t utc_locked(int64_t mono_us)
+{
+    int64_t elapsed = mono_us - s_base_mono_us;
+    return s_base_utc_us + elapsed + elapsed / 1000 * s_drift_ppb / 1000000;
+}
+
+static void sync_cb(struct timeval *tv)
+{
+    int64_t mono = esp_timer_get_time();
+    int64_t utc = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+    portENTER_CRITICAL(&s_lock);
+    int64_t elapsed = mono - s_base_mono_us;
+    int64_t error_us = s_synced ? utc - utc_locked(mono) : 0;
+    if (s_synced && elapsed >= DRIFT_MIN_INTERVAL_US) {
+        int64_t sample = s_drift_ppb + error_us * 1000000 / (elapsed / 1000);
+        if (sample > -DRIFT_MAX_PPB && sample < DRIFT_MAX_PPB) {
+            s_drift_ppb = (int32_t)((s_drift_ppb + sample) / 2);
+        }
+    }
+    s_base_mono_us = mono;
+    s_base_utc_us = utc;
+    s_valid = true;
+    s_synced = true;
+    int32_t drift = s_drift_ppb;
+    portEXIT_CRITICAL(&s_lock);
+
+    s_rtc.magic = RTC_MAGIC;
+    s_rtc.drift_ppb = drift;
+    s_rtc.synced_utc_us = utc;
+    s_rtc.crc = image_crc(&s_rtc);
+    ESP_LOGI(TAG, "SNTP update, corrected %lld ms, drift %+ld ppb", error_us / 1000, (long)drift);
+}
+
+void time_sync_init(void)
+{
+    if (s_rtc.magic != RTC_MAGIC || s_rtc.crc != image_crc(&s_rtc)) {
+        return;
+    }
+    s_drift_ppb = s_rtc.drift_ppb;
+
+    // The RTC timer kept the system clock through the reset or sleep
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec < TIME_SYNC_VALID_AFTER || (int64_t)tv.tv_sec * 1000000 < s_rtc.synced_utc_us) {
+        return;
+    }
+    s_base_mono_us = esp_timer_get_time();
+    s_base_utc_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    s_valid = true;
+    ESP_LOGI(TAG, "Clock restored, last SNTP update %lld s ago, drift %+ld ppb",
+             (s_base_utc_us - s_rtc.synced_utc_us) / 1000000, (long)s_drift_ppb);
+}
+
+void time_sync_start(void)
+{
+    static bool started = false;
+    if (started) {
+        return;
+    }
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_APP_SNTP_SERVER);
+    config.sync_cb = sync_cb;
+    if (esp_netif_sntp_init(&config) == ESP_OK) {
+        started = true;
+    }
+}
+
+bool time_sync_valid(void)
+{
+    return s_valid;
+}
+
+int64_t time_sync_utc_ms(int64_t mono_us)
+{
+    portENTER_CRITICAL(&s_lock);
+    int64_t utc = s_valid ? utc_locked(mono_us) / 1000 : 0;
+    portEXIT_CRITICAL(&s_lock);
+    return utc;
+}
+
+int64_t time_sync_now_ms(void)
+{
+    return time_sync_utc_ms(esp_timer_get_time());
+}
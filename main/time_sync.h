@@ -0,0 +1,60 @@
+/* Time Sync Header
+ *
+ * Wall-clock time for timestamps taken at the source. SNTP runs from the
+ * first connection on; each update records a base pair (esp_timer time,
+ * UTC), and the mapping of a later esp_timer reading adds the elapsed time
+ * corrected by the clock drift measured between two updates. The drift and
+ * the last update survive resets and deep sleep in RTC memory, so after a
+ * wake the system clock (kept by the RTC timer) is trusted right away and
+ * SNTP only refines it.
+ */
+
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Clock readings before this (2023-11-14) mean the time was never set
+#define TIME_SYNC_VALID_AFTER 1700000000
+
+/**
+ * @brief Restore the mapping kept in RTC memory
+ *
+ * Call once at boot, before anything asks for timestamps.
+ */
+void time_sync_init(void);
+
+/**
+ * @brief Start SNTP; repeated calls are no-ops
+ *
+ * Call once the station has an IP address.
+ */
+void time_sync_start(void);
+
+/**
+ * @brief Whether UTC is known, from SNTP on this boot or restored
+ */
+bool time_sync_valid(void);
+
+/**
+ * @brief UTC in milliseconds for an esp_timer_get_time() reading
+ *
+ * @return Unix time in ms, 0 while time_sync_valid() is false
+ */
+int64_t time_sync_utc_ms(int64_t mono_us);
+
+/**
+ * @brief Current UTC in milliseconds, 0 while time_sync_valid() is false
+ */
+int64_t time_sync_now_ms(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TIME_SYNC_H
@@ -0,0 +1,55 @@
+/* Trace Markers Header
+ *
+ * SystemView markers on the events that explain a timeline: application
+ * state changes, TLS handshakes, outbox enqueues and broker
+ * acknowledgements, provisioning HTTP requests and NVS commits. Recorded
+ * through app_trace alongside the FreeRTOS scheduling events, so stalls
+ * and cross-core interference can be read off one trace.
+ *
+ * Spans are MarkStart/MarkStop pairs, points single Marks; the ids are
+ * below. With CONFIG_APP_TRACE_MARKERS off every macro compiles to
+ * nothing.
+ */
+
+#ifndef TRACE_MARKS_H
+#define TRACE_MARKS_H
+
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_ID_TLS_HANDSHAKE  1       // Span: esp-tls connect of the MQTT transport
+#define TRACE_ID_OUTBOX_ENQUEUE 2       // Point: message put into the MQTT outbox
+#define TRACE_ID_PUBACK         3       // Point: PUBACK/PUBREC removed a PUBLISH from the outbox
+#define TRACE_ID_HTTP           4       // Span: provisioning HTTP handler, the URI is printed at entry
+#define TRACE_ID_NVS_COMMIT     5       // Span: nvs_commit() of the device configuration
+#define TRACE_ID_STATE(state)   (0x10 + (state))    // Span: time in one app_state_t
+
+#if CONFIG_APP_TRACE_MARKERS
+
+#if !__has_include("SEGGER_SYSVIEW.h")
+#error "CONFIG_APP_TRACE_MARKERS needs the esp_sysview component (idf.py add-dependency espressif/esp_sysview)"
+#endif
+#include "SEGGER_SYSVIEW.h"
+
+#define TRACE_MARK(id)          SEGGER_SYSVIEW_Mark(id)
+#define TRACE_SPAN_BEGIN(id)    SEGGER_SYSVIEW_MarkStart(id)
+#define TRACE_SPAN_END(id)      SEGGER_SYSVIEW_MarkStop(id)
+#define TRACE_PRINT(text)       SEGGER_SYSVIEW_Print(text)
+
+#else
+
+#define TRACE_MARK(id)          do { } while (0)
+#define TRACE_SPAN_BEGIN(id)    do { } while (0)
+#define TRACE_SPAN_END(id)      do { } while (0)
+#define TRACE_PRINT(text)       do { } while (0)
+
+#endif // CONFIG_APP_TRACE_MARKERS
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TRACE_MARKS_H
@@ -0,0 +1,175 @@
+/* Time-Series Block Implementation
+ *
+ * The encoder writes into the caller's buffer front to back and stops at
+ * its end; no state outside the block and the bit writer is kept.
+ */
+
+#include <string.h>
+#include "ts_block.h"
+
+#define HEADER_LEN 8
+
+typedef struct {
+    uint8_t *out;
+    size_t size;
+    size_t len;
+    uint64_t bits;                  // Pending bits, the low `count` ones are valid
+    int count;
+    bool overflow;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *w, uint32_t value, int n)
+{
+    w->bits = (w->bits << n) | (n < 32 ? value & ((1u << n) - 1) : value);
+    w->count += n;
+    while (w->count >= 8) {
+        w->count -= 8;
+        if (w->len < w->size) {
+            w->out[w->len++] = (uint8_t)(w->bits >> w->count);
+        } else {
+            w->overflow = true;
+        }
+    }
+    w->bits &= (1u << w->count) - 1;
+}
+
+/**
+ * @brief Delta-of-delta in the buckets of the Gorilla paper
+ */
+static void put_dod(bit_writer_t *w, int32_t dod)
+{
+    if (dod == 0) {
+        put_bits(w, 0x0, 1);
+    } else if (dod >= -64 && dod <= 63) {
+        put_bits(w, 0x2, 2);
+        put_bits(w, (uint32_t)dod, 7);
+    } else if (dod >= -256 && dod <= 255) {
+        put_bits(w, 0x6, 3);
+        put_bits(w, (uint32_t)dod, 9);
+    } else if (dod >= -2048 && dod <= 2047) {
+        put_bits(w, 0xE, 4);
+        put_bits(w, (uint32_t)dod, 12);
+    } else {
+        put_bits(w, 0xF, 4);
+        put_bits(w, (uint32_t)dod, 32);
+    }
+}
+
+static void put_delta_column(bit_writer_t *w, const uint32_t *v, int n)
+{
+    uint32_t delta = 0;
+    for (int i = 1; i < n; i++) {
+        uint32_t d = v[i] - v[i - 1];
+        put_dod(w, (int32_t)(d - delta));
+        delta = d;
+    }
+}
+
+static void put_xor_column(bit_writer_t *w, const uint32_t *v, int n)
+{
+    // No window until the first non-zero XOR
+    int lead = -1;
+    int trail = 0;
+    for (int i = 1; i < n; i++) {
+        uint32_t x = v[i] ^ v[i - 1];
+        if (x == 0) {
+            put_bits(w, 0x0, 1);
+            continue;
+        }
+        int l = __builtin_clz(x);
+        int t = __builtin_ctz(x);
+        if (lead >= 0 && l >= lead && t >= trail) {
+            put_bits(w, 0x2, 2);
+            put_bits(w, x >> trail, 32 - lead - trail);
+        } else {
+            int bits = 32 - l - t;
+            put_bits(w, 0x3, 2);
+            put_bits(w, l, 5);
+            put_bits(w, bits - 1, 5);
+            put_bits(w, x >> t, bits);
+            lead = l;
+            trail = t;
+        }
+    }
+}
+
+esp_err_t ts_block_init(ts_block_t *b, uint8_t series, uint8_t capacity, const ts_block_enc_t *enc)
+{
+    if (b == NULL || enc == NULL || series == 0 || series > TS_BLOCK_MAX_SERIES ||
+        capacity < 2 || capacity > TS_BLOCK_MAX_SAMPLES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(b, 0, sizeof(*b));
+    b->series = series;
+    b->capacity = capacity;
+    for (int i = 0; i < series; i++) {
+        if (enc[i] == TS_BLOCK_XOR) {
+            b->xor_mask |= 1u << i;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t ts_block_add(ts_block_t *b, uint32_t t, const uint32_t *values)
+{
+    if (ts_block_full(b)) {
+        return ESP_ERR_NO_MEM;
+    }
+    b->t[b->samples] = t;
+    for (int i = 0; i < b->series; i++) {
+        b->v[i][b->samples] = values[i];
+    }
+    b->samples++;
+    return ESP_OK;
+}
+
+bool ts_block_full(const ts_block_t *b)
+{
+    return b->samples >= b->capacity;
+}
+
+esp_err_t ts_block_encode(const ts_block_t *b, uint8_t *out, size_t size, size_t *len)
+{
+    if (b->samples == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    size_t mask_len = (b->series + 7) / 8;
+    if (size < HEADER_LEN + mask_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    out[0] = TS_BLOCK_VERSION;
+    out[1] = b->series;
+    out[2] = b->samples;
+    out[3] = b->flags;
+    for (int i = 0; i < 4; i++) {
+        out[4 + i] = (uint8_t)(b->t[0] >> (8 * i));
+    }
+    for (size_t i = 0; i < mask_len; i++) {
+        out[HEADER_LEN + i] = (uint8_t)(b->xor_mask >> (8 * i));
+    }
+
+    bit_writer_t w = { .out = out, .size = size, .len = HEADER_LEN + mask_len };
+    put_delta_column(&w, b->t, b->samples);
+    for (int i = 0; i < b->series; i++) {
+        put_bits(&w, b->v[i][0], 32);
+        if (b->xor_mask & (1u << i)) {
+            put_xor_column(&w, b->v[i], b->samples);
+        } else {
+            put_delta_column(&w, b->v[i], b->samples);
+        }
+    }
+    if (w.count > 0) {
+        put_bits(&w, 0, 8 - w.count);
+    }
+    if (w.overflow) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *len = w.len;
+    return ESP_OK;
+}
+
+void ts_block_reset(ts_block_t *b)
+{
+    b->samples = 0;
+}
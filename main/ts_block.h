@@ -0,0 +1,119 @@
+/* Time-Series Block Header
+ *
+ * Columnar encoder for metrics sampled on a roughly fixed period, after
+ * Facebook's Gorilla: timestamps as delta-of-delta, each series either as
+ * delta-of-delta (counters) or as the XOR with its previous value
+ * (gauges). N samples of M series are packed into one bit stream, so a
+ * counter that moves at a steady rate, or not at all, costs a bit per
+ * sample.
+ *
+ * Block layout, multi-byte fields little-endian:
+ *   u8 version (1) | u8 series | u8 samples | u8 flags | u32 t0 |
+ *   ceil(series / 8) bytes, bit i set = series i is XOR-encoded |
+ *   bit stream, MSB first, zero-padded to a byte:
+ *     timestamps t1..tn-1 as delta-of-delta (the delta before t0 is 0)
+ *     per series: first value in 32 bits, then samples-1 encoded values
+ *
+ * Flags: TS_BLOCK_FLAG_UTC = timestamps are Unix seconds, otherwise
+ * seconds since boot.
+ *
+ * Delta-of-delta, in modulo 2^32 arithmetic:
+ *   '0' = 0 | '10' + 7 bits | '110' + 9 bits | '1110' + 12 bits |
+ *   '1111' + 32 bits, two's complement
+ * XOR with the previous value:
+ *   '0' = same value | '10' + bits inside the previous leading/trailing
+ *   zero window | '11' + 5 bits leading zeros + 5 bits (length - 1) + bits
+ */
+
+#ifndef TS_BLOCK_H
+#define TS_BLOCK_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Appended to the topic of encoded blocks, like CBOR_TOPIC_SUFFIX
+#define TS_BLOCK_TOPIC_SUFFIX "/ts"
+
+#define TS_BLOCK_VERSION 1
+#define TS_BLOCK_MAX_SERIES 16
+#define TS_BLOCK_MAX_SAMPLES 32
+
+#define TS_BLOCK_FLAG_UTC 0x01
+
+// Worst case encoded size: 36 bits per timestamp, 44 bits per XOR value
+#define TS_BLOCK_ENCODED_MAX(series, samples) \
+    (8 + ((series) + 7) / 8 + ((samples) * 36 + (series) * (32 + (samples) * 44)) / 8 + 1)
+
+typedef enum {
+    TS_BLOCK_DELTA,                 // Counters and other steady ramps
+    TS_BLOCK_XOR,                   // Gauges that hover around a value
+} ts_block_enc_t;
+
+/**
+ * @brief Samples collected for one block
+ *
+ * Kept as plain values until ts_block_encode(), which walks them column
+ * by column.
+ */
+typedef struct {
+    uint8_t series;
+    uint8_t samples;
+    uint8_t capacity;
+    uint16_t xor_mask;              // Bit i set: series i is XOR-encoded
+    uint8_t flags;                  // TS_BLOCK_FLAG_*, copied into the header
+    uint32_t t[TS_BLOCK_MAX_SAMPLES];
+    uint32_t v[TS_BLOCK_MAX_SERIES][TS_BLOCK_MAX_SAMPLES];
+} ts_block_t;
+
+/**
+ * @brief Set up an empty block
+ *
+ * @param b Block
+ * @param series Number of series (at most TS_BLOCK_MAX_SERIES)
+ * @param capacity Samples per block (2 to TS_BLOCK_MAX_SAMPLES)
+ * @param enc Encoding of each series
+ * @return ESP_OK, or ESP_ERR_INVALID_ARG
+ */
+esp_err_t ts_block_init(ts_block_t *b, uint8_t series, uint8_t capacity, const ts_block_enc_t *enc);
+
+/**
+ * @brief Append one sample of every series
+ *
+ * @param t Timestamp in seconds, of the kind named by flags
+ * @param values One value per series
+ * @return ESP_OK, or ESP_ERR_NO_MEM if the block is full
+ */
+esp_err_t ts_block_add(ts_block_t *b, uint32_t t, const uint32_t *values);
+
+/**
+ * @brief True once the block holds its capacity of samples
+ */
+bool ts_block_full(const ts_block_t *b);
+
+/**
+ * @brief Pack the collected samples into out
+ *
+ * @param out Output buffer; TS_BLOCK_ENCODED_MAX() bytes always suffice
+ * @param size Size of out
+ * @param len Encoded length on success
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if the block is empty,
+ *         ESP_ERR_INVALID_SIZE if out is too small
+ */
+esp_err_t ts_block_encode(const ts_block_t *b, uint8_t *out, size_t size, size_t *len);
+
+/**
+ * @brief Drop the samples, keeping the series layout and flags
+ */
+void ts_block_reset(ts_block_t *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TS_BLOCK_H
@@ -0,0 +1,59 @@
+/* ULP Sampler Program
+ *
+ * Runs on the ULP-RISC-V coprocessor, started by the ULP timer every
+ * CONFIG_APP_ULP_PERIOD_MS while the main cores sleep (and while they
+ * run). Each run reads one ADC1 conversion into a ring in RTC slow memory
+ * and wakes the main cores once wake_threshold samples are pending, or at
+ * once when a sample leaves [alarm_low, alarm_high] after being inside.
+ *
+ * The ring is single-producer/single-consumer: only this program writes
+ * head, only the main cores write tail, and both are free-running
+ * counters. A sample that finds the ring full is counted in overruns and
+ * dropped.
+ *
+ * Built as its own binary by ulp_embed_binary(); the main cores see every
+ * global here as ulp_<name> (see ulp_sampler.h in main/).
+ */
+
+#include <stdint.h>
+#include "ulp_riscv_utils.h"
+#include "ulp_riscv_adc_ulp_core.h"
+#include "sdkconfig.h"
+
+#define RING_LEN 128            // Power of two, ULP_SAMPLER_RING_LEN on the main side
+
+volatile uint32_t ring[RING_LEN];
+volatile uint32_t head;
+volatile uint32_t tail;
+volatile uint32_t wake_threshold;
+volatile int32_t alarm_low;
+volatile int32_t alarm_high;
+volatile uint32_t alarm;        // Set here, cleared by the main cores
+volatile uint32_t in_range;     // Last sample was inside the alarm range
+volatile uint32_t overruns;
+
+int main(void)
+{
+    int32_t v = ulp_riscv_adc_read_channel(ADC_UNIT_1, CONFIG_APP_ULP_ADC_CHANNEL);
+
+    uint32_t pending = head - tail;
+    if (pending < RING_LEN) {
+        ring[head % RING_LEN] = (uint32_t)v;
+        head = head + 1;
+        pending++;
+    } else {
+        overruns = overruns + 1;
+    }
+
+    // Edge-triggered: a reading that stays out of range wakes the main cores once
+    uint32_t inside = (v >= alarm_low && v <= alarm_high);
+    if (!inside && in_range) {
+        alarm = 1;
+    }
+    in_range = inside;
+
+    if (alarm || pending >= wake_threshold) {
+        ulp_riscv_wakeup_main_processor();
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+/* ULP Sampler Implementation
+ *
+ * The ULP program's globals are linked into RTC slow memory and appear
+ * here as ulp_<name> through the header generated by ulp_embed_binary().
+ * Loading the binary clears them, which is why it only happens after a
+ * full boot: on a deep-sleep wake the ring holds the samples this wake is
+ * for.
+ */
+
+#include "ulp_sampler.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_ULP_SAMPLER
+
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "ulp_adc.h"
+#include "ulp_riscv.h"
+#include "ulp_main.h"
+
+static const char *TAG = "ulp_sampler";
+
+extern const uint8_t ulp_main_bin_start[] asm("_binary_ulp_main_bin_start");
+extern const uint8_t ulp_main_bin_end[] asm("_binary_ulp_main_bin_end");
+
+_Static_assert(CONFIG_APP_ULP_WAKE_SAMPLES <= ULP_SAMPLER_RING_LEN, "ULP wake threshold beyond the ring");
+
+static esp_err_t ulp_load_and_run(void)
+{
+    const ulp_adc_cfg_t adc_cfg = {
+        .adc_n = ADC_UNIT_1,
+        .channel = CONFIG_APP_ULP_ADC_CHANNEL,
+        .atten = ADC_ATTEN_DB_12,
+        .width = ADC_BITWIDTH_DEFAULT,
+        .ulp_mode = ADC_ULP_MODE_RISCV,
+    };
+    esp_err_t err = ulp_adc_init(&adc_cfg);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = ulp_riscv_load_binary(ulp_main_bin_start, ulp_main_bin_end - ulp_main_bin_start);
+    if (err != ESP_OK) {
+        return err;
+    }
+    ulp_wake_threshold = CONFIG_APP_ULP_WAKE_SAMPLES;
+    ulp_alarm_low = CONFIG_APP_ULP_ALARM_LOW;
+    ulp_alarm_high = CONFIG_APP_ULP_ALARM_HIGH;
+    ulp_in_range = 1;
+    err = ulp_set_wakeup_period(0, CONFIG_APP_ULP_PERIOD_MS * 1000);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return ulp_riscv_run();
+}
+
+esp_err_t ulp_sampler_init(void)
+{
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP) {
+        esp_err_t err = ulp_load_and_run();
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "ULP not started: %s", esp_err_to_name(err));
+            return err;
+        }
+        ESP_LOGI(TAG, "ULP sampling ADC1 channel %d every %d ms, waking every %d samples",
+                 CONFIG_APP_ULP_ADC_CHANNEL, CONFIG_APP_ULP_PERIOD_MS, CONFIG_APP_ULP_WAKE_SAMPLES);
+    }
+    return esp_sleep_enable_ulp_wakeup();
+}
+
+size_t ulp_sampler_drain(int32_t *out, size_t max, bool *alarm)
+{
+    // Snapshot head once: the ULP may append while this runs
+    uint32_t head = ulp_head;
+    uint32_t tail = ulp_tail;
+    size_t n = 0;
+    while (tail != head && n < max) {
+        out[n++] = (int32_t)(&ulp_ring)[tail % ULP_SAMPLER_RING_LEN];
+        tail++;
+    }
+    ulp_tail = tail;
+
+    *alarm = (ulp_alarm != 0);
+    ulp_alarm = 0;
+    return n;
+}
+
+uint32_t ulp_sampler_overruns(void)
+{
+    return ulp_overruns;
+}
+
+#endif // CONFIG_APP_ULP_SAMPLER
@@ -0,0 +1,58 @@
+/* ULP Sampler Header
+ *
+ * Sampling on the ULP-RISC-V coprocessor while the main cores are in deep
+ * sleep (program in ulp/ulp_sampler.c). The ULP reads ADC1 channel
+ * CONFIG_APP_ULP_ADC_CHANNEL every CONFIG_APP_ULP_PERIOD_MS into a ring in
+ * RTC memory and wakes the main cores when CONFIG_APP_ULP_WAKE_SAMPLES
+ * are pending, or when a reading leaves the range CONFIG_APP_ULP_ALARM_LOW
+ * to CONFIG_APP_ULP_ALARM_HIGH. One main-core wake then takes the whole
+ * block instead of one wake per sample.
+ *
+ * Built only with CONFIG_APP_ULP_SAMPLER.
+ */
+
+#ifndef ULP_SAMPLER_H
+#define ULP_SAMPLER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ULP_SAMPLER_RING_LEN 128    // RING_LEN of the ULP program
+
+/**
+ * @brief Start the ULP after a full boot and arm it as a deep-sleep wake source
+ *
+ * On a wake from deep sleep the program is already running with its ring
+ * and is left alone. Call on every boot, before the first sleep.
+ *
+ * @return ESP_OK, or the error from loading or starting the ULP
+ */
+esp_err_t ulp_sampler_init(void);
+
+/**
+ * @brief Take the pending samples out of the ring, oldest first
+ *
+ * @param out Raw ADC readings
+ * @param max Capacity of out; ULP_SAMPLER_RING_LEN takes everything
+ * @param alarm Output: a reading left the alarm range since the last call
+ *              (cleared by this call)
+ * @return Number of samples written to out
+ */
+size_t ulp_sampler_drain(int32_t *out, size_t max, bool *alarm);
+
+/**
+ * @brief Samples the ULP dropped because the ring was full, since the full boot
+ */
+uint32_t ulp_sampler_overruns(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ULP_SAMPLER_H
@@ -0,0 +1,121 @@
+/* Warm Boot Cache Implementation
+ *
+ * Stores the last good AP (BSSID + channel) and a "clean session" marker in
+ * NVS. The marker is consumed at boot and re-armed once MQTT connects, so
+ * only a boot that made it all the way to the broker enables the warm path.
+ */
+
+#include <string.h>
+#include "warm_boot.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_system.h"
+#include "esp_wifi.h"
+#include "device_config.h"
+
+static const char *TAG = "warm_boot";
+
+// NVS keys
+#define NVS_KEY_WB_AP "wb_ap"
+#define NVS_KEY_WB_CLEAN "wb_clean"
+
+// Last AP written to NVS, used to avoid rewriting an unchanged blob
+static warm_boot_ap_t s_cached_ap = {0};
+static bool s_cached_ap_valid = false;
+
+/**
+ * @brief Check whether the reset reason allows trusting the previous session
+ */
+static bool reset_reason_is_clean(void)
+{
+    switch (esp_reset_reason()) {
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_BROWNOUT:
+        return false;
+    default:
+        return true;
+    }
+}
+
+bool warm_boot_begin(warm_boot_ap_t *ap)
+{
+    uint8_t clean = 0;
+    size_t required_size = sizeof(s_cached_ap);
+
+    s_cached_ap_valid = (device_config_get_blob(NVS_KEY_WB_AP, &s_cached_ap, &required_size) == ESP_OK &&
+                         required_size == sizeof(s_cached_ap));
+    device_config_get_u8(NVS_KEY_WB_CLEAN, &clean);
+
+    // Consume the marker: it is re-armed by warm_boot_mark_clean()
+    if (clean) {
+        device_config_erase(NVS_KEY_WB_CLEAN);
+    }
+
+    if (!s_cached_ap_valid || !clean) {
+        ESP_LOGI(TAG, "No clean previous session, using full connection path");
+        return false;
+    }
+
+    if (!reset_reason_is_clean()) {
+        ESP_LOGW(TAG, "Previous session ended abnormally (reset reason %d), using full connection path",
+                 esp_reset_reason());
+        return false;
+    }
+
+    if (ap) {
+        *ap = s_cached_ap;
+    }
+    ESP_LOGI(TAG, "Warm boot: AP " MACSTR " on channel %d", MAC2STR(s_cached_ap.bssid), s_cached_ap.channel);
+    return true;
+}
+
+esp_err_t warm_boot_mark_clean(void)
+{
+    wifi_ap_record_t ap_info;
+    esp_err_t err = esp_wifi_sta_get_ap_info(&ap_info);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Not associated, cannot record AP: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    warm_boot_ap_t ap = {0};
+    memcpy(ap.bssid, ap_info.bssid, sizeof(ap.bssid));
+    ap.channel = ap_info.primary;
+
+    device_config_begin();
+    if (!s_cached_ap_valid || memcmp(&ap, &s_cached_ap, sizeof(ap)) != 0) {
+        err = device_config_set_blob(NVS_KEY_WB_AP, &ap, sizeof(ap));
+        if (err == ESP_OK) {
+            s_cached_ap = ap;
+            s_cached_ap_valid = true;
+        }
+    }
+    if (err == ESP_OK) {
+        err = device_config_set_u8(NVS_KEY_WB_CLEAN, 1);
+    }
+    esp_err_t commit_err = device_config_commit();
+    if (err == ESP_OK) {
+        err = commit_err;
+    }
+
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Session recorded for warm boot (AP " MACSTR ", channel %d)",
+                 MAC2STR(ap.bssid), ap.channel);
+    } else {
+        ESP_LOGE(TAG, "Failed to record session: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+void warm_boot_invalidate(void)
+{
+    s_cached_ap_valid = false;
+
+    device_config_begin();
+    device_config_erase(NVS_KEY_WB_AP);
+    device_config_erase(NVS_KEY_WB_CLEAN);
+    device_config_commit();
+}
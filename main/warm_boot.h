@@ -0,0 +1,60 @@
+/* Warm Boot Cache Header
+ *
+ * Remembers the access point a provisioned device last reached the broker
+ * through, so the next boot can skip the full channel scan and the internet
+ * verification probe.
+ */
+
+#ifndef WARM_BOOT_H
+#define WARM_BOOT_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Access point details persisted after the last good session
+ */
+typedef struct {
+    uint8_t bssid[6];   // BSSID of the AP the session ran through
+    uint8_t channel;    // Primary channel of that AP
+} warm_boot_ap_t;
+
+/**
+ * @brief Start a boot attempt and decide whether the warm path may be used
+ *
+ * Loads the cached AP and consumes the "clean session" marker, so a boot that
+ * never reaches MQTT_CONNECTED falls back to the full path next time. The warm
+ * path is refused after a panic, watchdog or brownout reset.
+ *
+ * @param ap Output for the cached AP (valid only when true is returned)
+ * @return true if the previous session ended cleanly and an AP is cached
+ */
+bool warm_boot_begin(warm_boot_ap_t *ap);
+
+/**
+ * @brief Record the current session as good
+ *
+ * Stores the BSSID/channel of the associated AP together with the clean
+ * session marker in a single NVS commit. Call once MQTT is connected.
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t warm_boot_mark_clean(void);
+
+/**
+ * @brief Forget the cached AP and clean session marker
+ *
+ * Called when credentials are cleared or a warm connection attempt fails.
+ */
+void warm_boot_invalidate(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WARM_BOOT_H
@@ -0,0 +1,527 @@
+/* WiFi Connectivity Manager Implementation
+ *
+ * Handlers run in the default event loop task and never block: retries
+ * are scheduled on an esp_timer, and rejected credentials are handed to
+ * the state machine, which tears down the station and restarts
+ * provisioning from its own task.
+ *
+ * wifi_conn_try() shares the handlers: while a try is pending, the first
+ * address or disconnect completes it instead of driving reconnects.
+ *
+ * With several stored networks a failing one is left for the next of the
+ * wifi_networks ranking after NETWORK_ATTEMPTS reconnects, or after
+ * AUTH_FAIL_LIMIT rejections; the credentials are only given up once
+ * every network rejected them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "wifi_conn.h"
+#include "app_events.h"
+#include "sta_ip.h"
+#include "wifi_networks.h"
+#include "wifi_roam.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "wifi_conn";
+
+#define BACKOFF_MIN_MS CONFIG_APP_WIFI_RECONNECT_MIN_MS
+#define BACKOFF_MAX_MS CONFIG_APP_WIFI_RECONNECT_MAX_MS
+#define AUTH_FAIL_LIMIT 3               // Consecutive rejections before the credentials are given up
+#define NETWORK_ATTEMPTS 3              // Reconnects before another stored network is tried
+
+static esp_timer_handle_t s_retry_timer = NULL;
+static volatile bool s_active = false;
+static uint32_t s_backoff_ms = BACKOFF_MIN_MS;
+static uint8_t s_auth_failures = 0;
+static uint32_t s_attempts = 0;             // Reconnects since the last address
+static uint32_t s_network_attempts = 0;     // Of those, to the current network
+static uint32_t s_rejected = 0;             // Ranking positions whose AP rejected the credentials
+static uint32_t s_reconnects = 0;           // Reconnects since boot
+static char s_ip[16] = {0};             // Empty while there is no address
+static volatile uint32_t s_generation = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// wifi_conn_try() in flight, and the connection it leaves for wifi_conn_start()
+static SemaphoreHandle_t s_try_done = NULL;
+static volatile bool s_try_pending = false;
+static volatile bool s_try_associated = false;
+static wifi_conn_try_result_t s_try_result;
+static uint8_t s_try_reason;
+static char s_try_ssid[33] = {0};       // Empty unless a tried connection is up
+
+/**
+ * @brief Disconnect reasons that mean the AP rejected the credentials
+ */
+static bool is_auth_failure(uint8_t reason)
+{
+    switch (reason) {
+    case WIFI_REASON_AUTH_FAIL:
+    case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_802_1X_AUTH_FAILED:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static wifi_conn_try_result_t try_result_for(uint8_t reason)
+{
+    if (is_auth_failure(reason)) {
+        return WIFI_CONN_TRY_AUTH_FAILED;
+    }
+    switch (reason) {
+    case WIFI_REASON_NO_AP_FOUND:
+    case WIFI_REASON_NO_AP_FOUND_W_COMPATIBLE_SECURITY:
+    case WIFI_REASON_NO_AP_FOUND_IN_AUTHMODE_THRESHOLD:
+    case WIFI_REASON_NO_AP_FOUND_IN_RSSI_THRESHOLD:
+        return WIFI_CONN_TRY_NO_AP;
+    default:
+        return WIFI_CONN_TRY_FAILED;
+    }
+}
+
+/**
+ * @brief Complete the pending wifi_conn_try(), if any
+ */
+static void try_complete(wifi_conn_try_result_t result, uint8_t reason)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool pending = s_try_pending;
+    if (pending) {
+        s_try_pending = false;
+        s_try_result = result;
+        s_try_reason = reason;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    if (pending) {
+        xSemaphoreGive(s_try_done);
+    }
+}
+
+static void set_ip(const char *ip)
+{
+    portENTER_CRITICAL(&s_lock);
+    strlcpy(s_ip, ip, sizeof(s_ip));
+    s_generation++;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void retry_timer_cb(void *arg)
+{
+    if (!s_active) {
+        return;
+    }
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Reconnect failed to start: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * @brief Schedule the next reconnect; the delay is drawn from [backoff/2, backoff]
+ */
+static void schedule_retry(void)
+{
+    uint32_t half = s_backoff_ms / 2;
+    uint32_t delay_ms = half + esp_random() % (half + 1);
+
+    esp_timer_stop(s_retry_timer);
+    esp_err_t err = esp_timer_start_once(s_retry_timer, (uint64_t)delay_ms * 1000);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to schedule reconnect: %s", esp_err_to_name(err));
+        return;
+    }
+    s_attempts++;
+    s_reconnects++;
+    ESP_LOGI(TAG, "Reconnecting in %lu ms (attempt %lu)", (unsigned long)delay_ms, (unsigned long)s_attempts);
+
+    s_backoff_ms = (s_backoff_ms >= BACKOFF_MAX_MS / 2) ? BACKOFF_MAX_MS : s_backoff_ms * 2;
+}
+
+/**
+ * @brief Let the next connect scan for any AP of the SSID
+ */
+static void drop_fixed_bssid(void)
+{
+    wifi_config_t cfg;
+    if (esp_wifi_get_config(WIFI_IF_STA, &cfg) != ESP_OK || !cfg.sta.bssid_set) {
+        return;
+    }
+    ESP_LOGI(TAG, "Known AP unreachable, scanning on the next attempt");
+    cfg.sta.bssid_set = false;
+    cfg.sta.channel = 0;
+#if CONFIG_APP_WIFI_ROAM
+    wifi_roam_configure(&cfg);
+#endif
+    esp_wifi_set_config(WIFI_IF_STA, &cfg);
+}
+
+/**
+ * @brief Station configuration shared by wifi_conn_start() and wifi_conn_try()
+ */
+static void sta_config(wifi_config_t *cfg, const char *ssid, const char *password, const warm_boot_ap_t *ap)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    strncpy((char*)cfg->sta.ssid, ssid, sizeof(cfg->sta.ssid) - 1);
+    strncpy((char*)cfg->sta.password, password, sizeof(cfg->sta.password) - 1);
+    if (ap) {
+        cfg->sta.bssid_set = true;
+        memcpy(cfg->sta.bssid, ap->bssid, sizeof(cfg->sta.bssid));
+        cfg->sta.channel = ap->channel;
+    }
+#if CONFIG_APP_LOW_POWER
+    cfg->sta.listen_interval = CONFIG_APP_WIFI_LISTEN_INTERVAL;
+#endif
+#if CONFIG_APP_WIFI_ROAM
+    wifi_roam_configure(cfg);
+#endif
+}
+
+/**
+ * @brief Point the station at the next stored network
+ *
+ * @return false with a single network
+ */
+static bool switch_network(void)
+{
+    wifi_network_pick_t pick;
+    if (!wifi_networks_next(&pick)) {
+        return false;
+    }
+    wifi_config_t cfg;
+    sta_config(&cfg, pick.cred.ssid, pick.cred.password, pick.ap_set ? &pick.ap : NULL);
+    esp_wifi_set_config(WIFI_IF_STA, &cfg);
+    s_network_attempts = 0;
+    s_auth_failures = 0;
+    ESP_LOGW(TAG, "Trying stored network %d of %d: %s", wifi_networks_position() + 1,
+             wifi_networks_count(), pick.cred.ssid);
+    return true;
+}
+
+static void on_disconnected(const wifi_event_sta_disconnected_t *event)
+{
+    ESP_LOGI(TAG, "WiFi STA disconnected, reason: %d", event->reason);
+    set_ip("");
+    app_events_post(APP_EVENT_WIFI_DISCONNECTED);
+
+    portENTER_CRITICAL(&s_lock);
+    s_try_ssid[0] = '\0';
+    portEXIT_CRITICAL(&s_lock);
+    if (s_try_pending) {
+        try_complete(try_result_for(event->reason), event->reason);
+        return;
+    }
+
+    if (!s_active) {
+        return;
+    }
+    if (event->reason == WIFI_REASON_ROAMING) {
+        return;     // The supplicant is already joining the next AP
+    }
+
+    if (is_auth_failure(event->reason)) {
+        if (++s_auth_failures >= AUTH_FAIL_LIMIT) {
+            s_rejected |= 1u << wifi_networks_position();
+        }
+        uint32_t all = (1u << wifi_networks_count()) - 1;
+        if (s_auth_failures >= AUTH_FAIL_LIMIT && (s_rejected & all) != all && switch_network()) {
+            schedule_retry();
+            return;
+        }
+        if (s_auth_failures >= AUTH_FAIL_LIMIT) {
+            ESP_LOGE(TAG, "========================================");
+            ESP_LOGE(TAG, "✗ WiFi Authentication Failed!");
+            ESP_LOGE(TAG, "✗ Reason Code: %d", event->reason);
+            ESP_LOGE(TAG, "✗ Incorrect WiFi credentials provided");
+            ESP_LOGE(TAG, "========================================");
+            s_active = false;
+            esp_timer_stop(s_retry_timer);
+            app_events_post(APP_EVENT_WIFI_AUTH_FAILED);
+            return;
+        }
+    } else {
+        s_auth_failures = 0;
+    }
+
+    if (++s_network_attempts < NETWORK_ATTEMPTS || !switch_network()) {
+        drop_fixed_bssid();
+    }
+    schedule_retry();
+}
+
+static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    if (event_base == WIFI_EVENT) {
+        switch (event_id) {
+        case WIFI_EVENT_STA_START:
+            ESP_LOGI(TAG, "WiFi STA started");
+            break;
+        case WIFI_EVENT_STA_CONNECTED:
+            ESP_LOGI(TAG, "WiFi STA connected");
+            s_auth_failures = 0;
+            s_try_associated = true;
+            break;
+        case WIFI_EVENT_STA_DISCONNECTED:
+            on_disconnected(event_data);
+            break;
+        default:
+            break;
+        }
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        const ip_event_got_ip_t *event = event_data;
+        char ip[16];
+        snprintf(ip, sizeof(ip), IPSTR, IP2STR(&event->ip_info.ip));
+        ESP_LOGI(TAG, "Got IP: %s%s", ip, s_attempts > 0 ? " (reconnected)" : "");
+        set_ip(ip);
+        s_backoff_ms = BACKOFF_MIN_MS;
+        s_attempts = 0;
+        s_network_attempts = 0;
+        s_rejected = 0;
+        app_events_post(APP_EVENT_WIFI_GOT_IP);
+        try_complete(WIFI_CONN_TRY_OK, 0);
+    }
+}
+
+/**
+ * @brief Take over the connection of a successful try to ssid, if it is still up
+ */
+static bool take_over_try(const char *ssid)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool up = s_try_ssid[0] != '\0' && strcmp(s_try_ssid, ssid) == 0 && s_ip[0] != '\0';
+    s_try_ssid[0] = '\0';
+    if (up) {
+        // Set together with the check, so a disconnect right after is retried
+        s_active = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return up;
+}
+
+esp_err_t wifi_conn_init(void)
+{
+    if (s_retry_timer != NULL) {
+        return ESP_OK;
+    }
+
+    // Before the driver starts, so the interface is attached when the station comes up
+    esp_err_t err = sta_ip_init();
+    if (err != ESP_OK) {
+        return err;
+    }
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    err = esp_wifi_init(&cfg);
+    if (err != ESP_OK) {
+        return err;
+    }
+#if CONFIG_APP_WIFI_ROAM
+    err = wifi_roam_init();
+    if (err != ESP_OK) {
+        return err;
+    }
+#endif
+
+    s_try_done = xSemaphoreCreateBinary();
+    if (s_try_done == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = retry_timer_cb,
+        .name = "wifi_retry",
+    };
+    err = esp_timer_create(&timer_args, &s_retry_timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL, NULL);
+    if (err == ESP_OK) {
+        err = esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL, NULL);
+    }
+    return err;
+}
+
+esp_err_t wifi_conn_start(const warm_boot_ap_t *ap)
+{
+    // A known AP belongs to the network that succeeded last
+    wifi_network_pick_t pick;
+    if (wifi_networks_load() == 0 || wifi_networks_preferred(&pick) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const char *ssid = pick.cred.ssid;
+
+    s_backoff_ms = BACKOFF_MIN_MS;
+    s_auth_failures = 0;
+    s_attempts = 0;
+    s_network_attempts = 0;
+    s_rejected = 0;
+    app_events_clear(APP_EVENT_WIFI_GOT_IP | APP_EVENT_WIFI_DISCONNECTED | APP_EVENT_WIFI_AUTH_FAILED);
+
+    if (take_over_try(ssid)) {
+        // The credential test is still connected; only the AP goes away
+        ESP_LOGI(TAG, "Keeping the tested connection to %s", ssid);
+        esp_wifi_set_mode(WIFI_MODE_STA);
+#if CONFIG_APP_LOW_POWER
+        esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+#endif
+        app_events_post(APP_EVENT_WIFI_GOT_IP);
+        return ESP_OK;
+    }
+
+    esp_err_t err = sta_ip_apply();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "STA IP configuration failed: %s", esp_err_to_name(err));
+    }
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    if (ap == NULL && wifi_networks_count() > 1) {
+        // One scan of the networks' channels picks the network and its AP
+        esp_wifi_start();
+        if (wifi_networks_scan(&pick) == ESP_OK) {
+            ap = &pick.ap;
+        }
+    }
+
+    // Configure and connect to WiFi
+    wifi_config_t wifi_config;
+    sta_config(&wifi_config, ssid, pick.cred.password, ap);
+    if (ap) {
+        ESP_LOGI(TAG, "Connecting to WiFi: %s (known AP, channel %d)", ssid, ap->channel);
+    } else {
+        ESP_LOGI(TAG, "Connecting to WiFi: %s", ssid);
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    esp_wifi_start();
+#if CONFIG_APP_LOW_POWER
+    // Sleep between listen intervals rather than waking for every DTIM
+    esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+#endif
+
+    s_active = true;
+    err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        s_active = false;
+    }
+    return err;
+}
+
+esp_err_t wifi_conn_try(const char *ssid, const char *password, const sta_ip_static_t *static_ip,
+                        const warm_boot_ap_t *ap, uint32_t timeout_ms,
+                        wifi_conn_try_result_t *result, uint8_t *reason)
+{
+    if (s_active || s_try_done == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    wifi_config_t cfg;
+    sta_config(&cfg, ssid, password, ap);
+    esp_err_t err = sta_ip_apply_config(static_ip);
+    if (err == ESP_OK) {
+        err = esp_wifi_set_config(WIFI_IF_STA, &cfg);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    xSemaphoreTake(s_try_done, 0);      // Completion of an earlier try that timed out
+    portENTER_CRITICAL(&s_lock);
+    strlcpy(s_try_ssid, ssid, sizeof(s_try_ssid));
+    s_try_associated = false;
+    s_try_pending = true;
+    portEXIT_CRITICAL(&s_lock);
+
+    ESP_LOGI(TAG, "Testing credentials for %s", ssid);
+    int64_t start_us = esp_timer_get_time();
+    err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        portENTER_CRITICAL(&s_lock);
+        s_try_pending = false;
+        s_try_ssid[0] = '\0';
+        portEXIT_CRITICAL(&s_lock);
+        return err;
+    }
+
+    if (xSemaphoreTake(s_try_done, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+        // Completed by nobody in time: an association without a lease, or silence
+        try_complete(s_try_associated ? WIFI_CONN_TRY_NO_IP : WIFI_CONN_TRY_NO_AP, 0);
+        xSemaphoreTake(s_try_done, 0);
+    }
+    if (s_try_result != WIFI_CONN_TRY_OK) {
+        wifi_conn_try_discard();
+    }
+    ESP_LOGI(TAG, "Credential test for %s: %s (reason %d, %lld ms)", ssid, wifi_conn_try_name(s_try_result),
+             s_try_reason, (long long)((esp_timer_get_time() - start_us) / 1000));
+
+    *result = s_try_result;
+    if (reason != NULL) {
+        *reason = s_try_reason;
+    }
+    return ESP_OK;
+}
+
+void wifi_conn_try_discard(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_try_ssid[0] = '\0';
+    portEXIT_CRITICAL(&s_lock);
+    if (!s_active) {
+        esp_wifi_disconnect();
+    }
+}
+
+const char *wifi_conn_try_name(wifi_conn_try_result_t result)
+{
+    switch (result) {
+    case WIFI_CONN_TRY_OK:
+        return "ok";
+    case WIFI_CONN_TRY_AUTH_FAILED:
+        return "wifi_auth_failed";
+    case WIFI_CONN_TRY_NO_AP:
+        return "wifi_not_found";
+    case WIFI_CONN_TRY_NO_IP:
+        return "wifi_no_ip";
+    default:
+        return "wifi_connect_failed";
+    }
+}
+
+void wifi_conn_stop(void)
+{
+    s_active = false;
+    if (s_retry_timer != NULL) {
+        esp_timer_stop(s_retry_timer);
+    }
+}
+
+bool wifi_conn_is_active(void)
+{
+    return s_active;
+}
+
+bool wifi_conn_get_ip(char *ip, size_t len)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool has_ip = s_ip[0] != '\0';
+    if (has_ip && ip != NULL && len > 0) {
+        strlcpy(ip, s_ip, len);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return has_ip;
+}
+
+uint32_t wifi_conn_generation(void)
+{
+    return s_generation;
+}
+
+uint32_t wifi_conn_reconnects(void)
+{
+    return s_reconnects;
+}
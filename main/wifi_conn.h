@@ -0,0 +1,137 @@
+/* WiFi Connectivity Manager Header
+ *
+ * Owns the station side of WiFi: driver initialisation, the STA interface,
+ * the WIFI_EVENT/IP_EVENT station handlers and reconnection. It posts
+ * APP_EVENT_WIFI_GOT_IP, APP_EVENT_WIFI_DISCONNECTED and
+ * APP_EVENT_WIFI_AUTH_FAILED to the state machine, which decides what a
+ * connection is for; the manager only keeps one up.
+ *
+ * After a disconnect the station reconnects on its own, first after
+ * CONFIG_APP_WIFI_RECONNECT_MIN_MS and then with exponential backoff with
+ * jitter up to CONFIG_APP_WIFI_RECONNECT_MAX_MS, so a short AP outage
+ * costs about as long as the AP is gone. A fixed BSSID (warm boot or the
+ * provisioning hint) is dropped at the first failure, so the retry scans.
+ * With several stored networks (wifi_networks.h) the first connect picks
+ * one with a single scan, and a network that keeps failing is left for
+ * the next.
+ *
+ * wifi_conn_try() joins a network once without storing anything, for
+ * checking credentials while the provisioning AP stays up.
+ */
+
+#ifndef WIFI_CONN_H
+#define WIFI_CONN_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sta_ip.h"
+#include "warm_boot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Outcome of wifi_conn_try()
+ */
+typedef enum {
+    WIFI_CONN_TRY_OK = 0,           // Associated and addressed
+    WIFI_CONN_TRY_AUTH_FAILED,      // The AP rejected the password
+    WIFI_CONN_TRY_NO_AP,            // No AP of the SSID (with a usable security mode) answered
+    WIFI_CONN_TRY_NO_IP,            // Associated, but no address before the timeout
+    WIFI_CONN_TRY_FAILED,           // Disconnected for another reason
+} wifi_conn_try_result_t;
+
+/**
+ * @brief Initialise the WiFi driver and the STA interface, register the handlers
+ *
+ * Call once after esp_netif_init(), the default event loop and
+ * app_events_init().
+ *
+ * @return ESP_OK or the first failing esp_wifi/esp_netif/esp_event error
+ */
+esp_err_t wifi_conn_init(void);
+
+/**
+ * @brief Connect with the stored credentials and keep the connection up
+ *
+ * Blocks for the network choice scan when more than one network is stored
+ * and ap is NULL.
+ *
+ * @param ap Known AP of the network that succeeded last, to join directly
+ *           on its channel (no scan), or NULL for a regular connection
+ * @return ESP_OK if a connection attempt was started, ESP_ERR_NOT_FOUND
+ *         when no credentials are stored
+ */
+esp_err_t wifi_conn_start(const warm_boot_ap_t *ap);
+
+/**
+ * @brief Join a network once, without storing or retrying anything
+ *
+ * WiFi must already be started in APSTA (or STA) mode with no scan in
+ * progress, and wifi_conn_start() must not be in effect. Blocks the
+ * calling task until the station has an address, is disconnected, or
+ * timeout_ms passes. A successful connection is left up: the next
+ * wifi_conn_start() for the same SSID takes it over instead of
+ * reconnecting, and wifi_conn_try_discard() drops it.
+ *
+ * @param static_ip Static settings to test, or NULL for DHCP
+ * @param ap AP to join without a scan, or NULL
+ * @param result Outcome
+ * @param reason Disconnect reason of a failure, 0 on timeout; may be NULL
+ * @return ESP_OK with *result set, ESP_ERR_INVALID_STATE while connected
+ *         through wifi_conn_start(), or an esp_wifi/esp_netif error
+ */
+esp_err_t wifi_conn_try(const char *ssid, const char *password, const sta_ip_static_t *static_ip,
+                        const warm_boot_ap_t *ap, uint32_t timeout_ms,
+                        wifi_conn_try_result_t *result, uint8_t *reason);
+
+/**
+ * @brief Disconnect the station left up by a successful wifi_conn_try()
+ */
+void wifi_conn_try_discard(void);
+
+/**
+ * @brief Short name of a result, as used in /provision error bodies
+ */
+const char *wifi_conn_try_name(wifi_conn_try_result_t result);
+
+/**
+ * @brief Stop reconnecting; the caller takes over the driver (e.g. AP mode)
+ */
+void wifi_conn_stop(void);
+
+/**
+ * @brief Whether wifi_conn_start() is in effect
+ */
+bool wifi_conn_is_active(void);
+
+/**
+ * @brief Current STA address
+ *
+ * @param ip Output for the dotted quad (16 bytes fit any address)
+ * @param len Size of ip
+ * @return true if the station has an address
+ */
+bool wifi_conn_get_ip(char *ip, size_t len);
+
+/**
+ * @brief Counter bumped on every address or association change
+ *
+ * Lets views of the connection state (e.g. /status) re-render only when
+ * something changed.
+ */
+uint32_t wifi_conn_generation(void);
+
+/**
+ * @brief Reconnect attempts scheduled since boot
+ */
+uint32_t wifi_conn_reconnects(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WIFI_CONN_H
@@ -0,0 +1,453 @@
+/* WiFi Network Store Implementation
+ *
+ * Blob layout (little endian), one record per network after the header:
+ *
+ *   u8 version, u8 count, u32 success sequence
+ *   u8 ssid_len, ssid, u8 pass_len, password,
+ *   u32 last_ok, u8 channel, u8 failures, i8 rssi[WIFI_NETWORKS_RSSI_LEN]
+ *
+ * so a typical network takes about 30 bytes. The ranking and the failure
+ * counts change from the event loop (wifi_networks_next()) and the state
+ * machine task; they are kept under a spinlock, NVS is only touched from
+ * the state machine and provisioning.
+ */
+
+#include <string.h>
+#include "wifi_networks.h"
+#include "device_config.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "wifi_networks";
+
+#define NVS_KEY_WIFI_NETS   "wifi_nets"
+#define NVS_KEY_WIFI_SSID   "wifi_ssid"
+#define NVS_KEY_WIFI_PASS   "wifi_pass"
+
+#define BLOB_VERSION    1
+#define BLOB_HEAD       6
+#define BLOB_RECORD_MAX (1 + 32 + 1 + 64 + 4 + 1 + 1 + WIFI_NETWORKS_RSSI_LEN)
+#define BLOB_MAX        (BLOB_HEAD + WIFI_NETWORKS_MAX * BLOB_RECORD_MAX)
+
+#define STICKY_DB       6       // Bonus of the network that succeeded last, against flapping
+#define FAIL_DB         10      // Penalty per recent failure
+#define FAIL_COUNTED    3       // Failures beyond this cost nothing more
+
+typedef struct {
+    wifi_network_cred_t cred;
+    uint32_t last_ok;           // Success sequence number, 0: never
+    uint8_t channel;            // Joined on last, 0: not known
+    uint8_t failures;           // Failed connects since the last success
+    int8_t rssi[WIFI_NETWORKS_RSSI_LEN];    // Newest first, 0: empty
+} network_t;
+
+static network_t s_nets[WIFI_NETWORKS_MAX];
+static int s_count = 0;
+static uint32_t s_seq = 0;                  // Highest last_ok handed out
+
+// Ranking of the last selection, and the AP the scan saw for each network
+static uint8_t s_rank[WIFI_NETWORKS_MAX];
+static int s_pos = 0;
+static warm_boot_ap_t s_seen_ap[WIFI_NETWORKS_MAX];
+static bool s_seen[WIFI_NETWORKS_MAX];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static size_t encode(const network_t *nets, int count, uint32_t seq, uint8_t *out)
+{
+    out[0] = BLOB_VERSION;
+    out[1] = (uint8_t)count;
+    put_u32(out + 2, seq);
+    size_t pos = BLOB_HEAD;
+    for (int i = 0; i < count; i++) {
+        const network_t *n = &nets[i];
+        size_t ssid_len = strlen(n->cred.ssid);
+        size_t pass_len = strlen(n->cred.password);
+        out[pos++] = (uint8_t)ssid_len;
+        memcpy(out + pos, n->cred.ssid, ssid_len);
+        pos += ssid_len;
+        out[pos++] = (uint8_t)pass_len;
+        memcpy(out + pos, n->cred.password, pass_len);
+        pos += pass_len;
+        put_u32(out + pos, n->last_ok);
+        pos += 4;
+        out[pos++] = n->channel;
+        out[pos++] = n->failures;
+        memcpy(out + pos, n->rssi, WIFI_NETWORKS_RSSI_LEN);
+        pos += WIFI_NETWORKS_RSSI_LEN;
+    }
+    return pos;
+}
+
+/**
+ * @brief Parse a blob into nets
+ *
+ * @return Networks decoded, -1 if the blob is malformed
+ */
+static int decode(const uint8_t *in, size_t len, network_t *nets, uint32_t *seq)
+{
+    if (len < BLOB_HEAD || in[0] != BLOB_VERSION || in[1] == 0 || in[1] > WIFI_NETWORKS_MAX) {
+        return -1;
+    }
+    int count = in[1];
+    *seq = get_u32(in + 2);
+    size_t pos = BLOB_HEAD;
+    for (int i = 0; i < count; i++) {
+        network_t *n = &nets[i];
+        memset(n, 0, sizeof(*n));
+        if (pos >= len || in[pos] == 0 || in[pos] > sizeof(n->cred.ssid) - 1 || pos + 1 + in[pos] >= len) {
+            return -1;
+        }
+        size_t ssid_len = in[pos++];
+        memcpy(n->cred.ssid, in + pos, ssid_len);
+        pos += ssid_len;
+        size_t pass_len = in[pos++];
+        if (pass_len > sizeof(n->cred.password) - 1 || pos + pass_len + 6 + WIFI_NETWORKS_RSSI_LEN > len) {
+            return -1;
+        }
+        memcpy(n->cred.password, in + pos, pass_len);
+        pos += pass_len;
+        n->last_ok = get_u32(in + pos);
+        pos += 4;
+        n->channel = in[pos++];
+        n->failures = in[pos++];
+        memcpy(n->rssi, in + pos, WIFI_NETWORKS_RSSI_LEN);
+        pos += WIFI_NETWORKS_RSSI_LEN;
+    }
+    return count;
+}
+
+static esp_err_t persist(void)
+{
+    uint8_t blob[BLOB_MAX];
+    portENTER_CRITICAL(&s_lock);
+    size_t len = encode(s_nets, s_count, s_seq, blob);
+    portEXIT_CRITICAL(&s_lock);
+    return device_config_set_blob(NVS_KEY_WIFI_NETS, blob, len);
+}
+
+static int find(const network_t *nets, int count, const char *ssid)
+{
+    for (int i = 0; i < count; i++) {
+        if (strcmp(nets[i].cred.ssid, ssid) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Rank by history: latest success first, then provisioning order; lock held
+ */
+static void rank_by_history(void)
+{
+    for (int i = 0; i < s_count; i++) {
+        s_rank[i] = (uint8_t)i;
+        s_seen[i] = false;
+    }
+    for (int i = 1; i < s_count; i++) {
+        uint8_t r = s_rank[i];
+        int j = i;
+        while (j > 0 && s_nets[s_rank[j - 1]].last_ok < s_nets[r].last_ok) {
+            s_rank[j] = s_rank[j - 1];
+            j--;
+        }
+        s_rank[j] = r;
+    }
+    s_pos = 0;
+}
+
+/**
+ * @brief Signal to rank a scanned network by: the scan, steadied by its history
+ */
+static int rank_rssi(const network_t *n, int scanned)
+{
+    int sum = 0;
+    int samples = 0;
+    for (int i = 0; i < WIFI_NETWORKS_RSSI_LEN && n->rssi[i] != 0; i++) {
+        sum += n->rssi[i];
+        samples++;
+    }
+    return samples > 0 ? (3 * scanned + sum / samples) / 4 : scanned;
+}
+
+static void fill_pick(wifi_network_pick_t *pick, int net)
+{
+    pick->cred = s_nets[net].cred;
+    pick->ap_set = s_seen[net];
+    pick->ap = s_seen_ap[net];
+}
+
+esp_err_t wifi_networks_save(const wifi_network_cred_t *nets, int count)
+{
+    if (nets == NULL || count <= 0 || nets[0].ssid[0] == '\0') {
+        return ESP_ERR_INVALID_ARG;
+    }
+    wifi_networks_load();
+
+    network_t next[WIFI_NETWORKS_MAX];
+    int n = 0;
+    int given = 0;
+    for (int i = 0; i < count; i++) {
+        if (nets[i].ssid[0] == '\0') {
+            continue;
+        }
+        given++;
+        if (n == WIFI_NETWORKS_MAX || find(next, n, nets[i].ssid) >= 0) {
+            continue;
+        }
+        network_t *cur = &next[n++];
+        memset(cur, 0, sizeof(*cur));
+        cur->cred = nets[i];
+        int old = find(s_nets, s_count, nets[i].ssid);
+        if (old >= 0) {
+            cur->channel = s_nets[old].channel;
+            memcpy(cur->rssi, s_nets[old].rssi, sizeof(cur->rssi));
+        }
+    }
+    if (given > n) {
+        ESP_LOGW(TAG, "%d of %d networks stored (duplicates or over %d)", n, given, WIFI_NETWORKS_MAX);
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    memcpy(s_nets, next, sizeof(next[0]) * n);
+    s_count = n;
+    rank_by_history();
+    portEXIT_CRITICAL(&s_lock);
+    esp_err_t err = persist();
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "%d network(s) stored, primary %s", n, next[0].cred.ssid);
+    }
+    return err;
+}
+
+int wifi_networks_load(void)
+{
+    network_t nets[WIFI_NETWORKS_MAX];
+    uint32_t seq = 0;
+    int count = -1;
+
+    uint8_t blob[BLOB_MAX];
+    size_t len = sizeof(blob);
+    if (device_config_get_blob(NVS_KEY_WIFI_NETS, blob, &len) == ESP_OK) {
+        count = decode(blob, len, nets, &seq);
+        if (count < 0) {
+            ESP_LOGW(TAG, "Stored network list is malformed, using the primary only");
+        }
+    }
+    if (count < 0) {
+        // Provisioned before the list, or the list is unreadable
+        memset(&nets[0], 0, sizeof(nets[0]));
+        size_t ssid_len = sizeof(nets[0].cred.ssid);
+        size_t pass_len = sizeof(nets[0].cred.password);
+        count = 0;
+        if (device_config_get_str(NVS_KEY_WIFI_SSID, nets[0].cred.ssid, &ssid_len) == ESP_OK &&
+            nets[0].cred.ssid[0] != '\0') {
+            device_config_get_str(NVS_KEY_WIFI_PASS, nets[0].cred.password, &pass_len);
+            count = 1;
+        }
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    memcpy(s_nets, nets, sizeof(nets[0]) * count);
+    s_count = count;
+    s_seq = seq;
+    rank_by_history();
+    portEXIT_CRITICAL(&s_lock);
+    return count;
+}
+
+int wifi_networks_count(void)
+{
+    return s_count;
+}
+
+esp_err_t wifi_networks_preferred(wifi_network_pick_t *pick)
+{
+    portENTER_CRITICAL(&s_lock);
+    int count = s_count;
+    if (count > 0) {
+        rank_by_history();
+        fill_pick(pick, s_rank[0]);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return count > 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t wifi_networks_scan(wifi_network_pick_t *pick)
+{
+    esp_err_t err = wifi_networks_preferred(pick);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    wifi_scan_config_t scan = {
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .scan_time = {
+            .active = {
+                .min = 50,
+                .max = 120
+            }
+        },
+    };
+    int channels = 0;
+    bool all = false;
+    for (int i = 0; i < s_count; i++) {
+        uint8_t ch = s_nets[i].channel;
+        if (ch == 0 || ch > 14) {
+            all = true;
+        } else if ((scan.channel_bitmap.ghz_2_channels & (1 << ch)) == 0) {
+            scan.channel_bitmap.ghz_2_channels |= (uint16_t)(1 << ch);
+            channels++;
+        }
+    }
+    if (all) {
+        scan.channel_bitmap.ghz_2_channels = 0;     // Every channel
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    err = esp_wifi_scan_start(&scan, true);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Scan failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    int8_t best_rssi[WIFI_NETWORKS_MAX];
+    bool seen[WIFI_NETWORKS_MAX] = {0};
+    warm_boot_ap_t seen_ap[WIFI_NETWORKS_MAX];
+    uint16_t records = 0;
+    esp_wifi_scan_get_ap_num(&records);
+    for (uint16_t r = 0; r < records; r++) {
+        wifi_ap_record_t rec;
+        if (esp_wifi_scan_get_ap_record(&rec) != ESP_OK) {
+            break;
+        }
+        int i = find(s_nets, s_count, (const char *)rec.ssid);
+        if (i < 0 || (seen[i] && rec.rssi <= best_rssi[i])) {
+            continue;
+        }
+        seen[i] = true;
+        best_rssi[i] = rec.rssi;
+        memcpy(seen_ap[i].bssid, rec.bssid, sizeof(seen_ap[i].bssid));
+        seen_ap[i].channel = rec.primary;
+    }
+    esp_wifi_clear_ap_list();
+
+    portENTER_CRITICAL(&s_lock);
+    int last = s_nets[s_rank[0]].last_ok > 0 ? s_rank[0] : -1;
+    int score[WIFI_NETWORKS_MAX];
+    int n_seen = 0;
+    for (int i = 0; i < s_count; i++) {
+        s_seen[i] = seen[i];
+        s_seen_ap[i] = seen_ap[i];
+        if (seen[i]) {
+            int failures = s_nets[i].failures < FAIL_COUNTED ? s_nets[i].failures : FAIL_COUNTED;
+            score[i] = rank_rssi(&s_nets[i], best_rssi[i]) + (i == last ? STICKY_DB : 0) - FAIL_DB * failures;
+            n_seen++;
+        }
+    }
+    // Stable insertion by score keeps the history order among equals and
+    // puts every network the scan missed after those it saw
+    for (int i = 1; i < s_count; i++) {
+        uint8_t r = s_rank[i];
+        int j = i;
+        while (j > 0 && seen[r] && (!seen[s_rank[j - 1]] || score[s_rank[j - 1]] < score[r])) {
+            s_rank[j] = s_rank[j - 1];
+            j--;
+        }
+        s_rank[j] = r;
+    }
+    s_pos = 0;
+    fill_pick(pick, s_rank[0]);
+    portEXIT_CRITICAL(&s_lock);
+
+    ESP_LOGI(TAG, "Scanned %s%d channel(s) in %lld ms: %d of %d networks seen",
+             all ? "all " : "", all ? 0 : channels, (long long)((esp_timer_get_time() - start_us) / 1000),
+             n_seen, s_count);
+    if (!pick->ap_set) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    ESP_LOGI(TAG, "Best: %s on channel %d (RSSI %d)", pick->cred.ssid, pick->ap.channel, best_rssi[s_rank[0]]);
+    return ESP_OK;
+}
+
+bool wifi_networks_next(wifi_network_pick_t *pick)
+{
+    portENTER_CRITICAL(&s_lock);
+    int count = s_count;
+    if (count > 0) {
+        network_t *cur = &s_nets[s_rank[s_pos]];
+        if (cur->failures < UINT8_MAX) {
+            cur->failures++;
+        }
+    }
+    if (count > 1) {
+        s_pos = (s_pos + 1) % count;
+        fill_pick(pick, s_rank[s_pos]);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return count > 1;
+}
+
+int wifi_networks_position(void)
+{
+    return s_pos;
+}
+
+esp_err_t wifi_networks_mark_success(void)
+{
+    wifi_ap_record_t info;
+    esp_err_t err = esp_wifi_sta_get_ap_info(&info);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    int i = find(s_nets, s_count, (const char *)info.ssid);
+    if (i >= 0) {
+        network_t *n = &s_nets[i];
+        n->last_ok = ++s_seq;
+        n->channel = info.primary;
+        n->failures = 0;
+        memmove(n->rssi + 1, n->rssi, WIFI_NETWORKS_RSSI_LEN - 1);
+        n->rssi[0] = info.rssi != 0 ? info.rssi : -1;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    if (i < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    device_config_begin();
+    err = persist();
+    esp_err_t commit_err = device_config_commit();
+    if (err == ESP_OK) {
+        err = commit_err;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to record %s: %s", (const char *)info.ssid, esp_err_to_name(err));
+    }
+    return err;
+}
+
+void wifi_networks_erase(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_count = 0;
+    s_pos = 0;
+    portEXIT_CRITICAL(&s_lock);
+    device_config_erase(NVS_KEY_WIFI_NETS);
+}
@@ -0,0 +1,138 @@
+/* WiFi Network Store Header
+ *
+ * Up to WIFI_NETWORKS_MAX provisioned networks, in one compact NVS blob
+ * next to the primary's wifi_ssid/wifi_pass keys. Each network carries a
+ * short history: the session sequence number of its last success (a
+ * session that reached the broker), the channel it was joined on and the
+ * RSSI of its last few successes.
+ *
+ * Choosing a network costs at most one scan. With a single network, or a
+ * warm boot (wifi_networks_preferred()), none: the network that succeeded
+ * last is joined directly. Otherwise wifi_networks_scan() probes only the
+ * channels the networks were last joined on (all channels if one is not
+ * known yet) and ranks what it saw by RSSI, with a bonus for the network
+ * that succeeded last and a penalty for recent failures; networks it did
+ * not see follow by recency. The pick carries the BSSID and channel, so
+ * the connect itself does not scan again. wifi_networks_next() walks the
+ * rest of the ranking when the chosen network fails.
+ *
+ * Devices provisioned before the list existed have only the two keys:
+ * they load as a list of one.
+ */
+
+#ifndef WIFI_NETWORKS_H
+#define WIFI_NETWORKS_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "warm_boot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WIFI_NETWORKS_MAX       4
+#define WIFI_NETWORKS_RSSI_LEN  4       // Successes whose RSSI is kept per network
+
+/**
+ * @brief Credentials of one network, as provisioned
+ */
+typedef struct {
+    char ssid[33];
+    char password[65];
+} wifi_network_cred_t;
+
+/**
+ * @brief Network chosen to connect to
+ */
+typedef struct {
+    wifi_network_cred_t cred;
+    bool ap_set;                // ap holds the BSSID and channel to join directly
+    warm_boot_ap_t ap;
+} wifi_network_pick_t;
+
+/**
+ * @brief Replace the stored list; call inside a device_config transaction
+ *
+ * The first network is the primary. The RSSI and channel history of
+ * networks already stored is kept, but their success order is not: the
+ * new list is ranked in the order given until its networks prove
+ * themselves, so the provisioning hint belongs to the preferred network.
+ *
+ * @param nets Networks, primary first; entries with an empty or duplicate SSID are skipped
+ * @param count Entries in nets, at most WIFI_NETWORKS_MAX are stored
+ * @return ESP_OK, ESP_ERR_INVALID_ARG without a network, or the NVS error
+ */
+esp_err_t wifi_networks_save(const wifi_network_cred_t *nets, int count);
+
+/**
+ * @brief Load the stored list into RAM
+ *
+ * @return Networks stored, 0 if none
+ */
+int wifi_networks_load(void);
+
+/**
+ * @brief Networks loaded by wifi_networks_load()
+ */
+int wifi_networks_count(void);
+
+/**
+ * @brief The network that succeeded last (the primary if none has), with no scan
+ *
+ * Makes it the start of the ranking walked by wifi_networks_next().
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND with no network loaded
+ */
+esp_err_t wifi_networks_preferred(wifi_network_pick_t *pick);
+
+/**
+ * @brief Rank the networks with one scan of their known channels and pick the best
+ *
+ * Blocks for the scan. The station must be started and not connecting.
+ *
+ * @return ESP_OK with pick->ap set, ESP_ERR_NOT_FOUND if the scan saw none
+ *         (pick is then the preferred network, without an AP), or the
+ *         esp_wifi error of the scan (pick as for ESP_ERR_NOT_FOUND)
+ */
+esp_err_t wifi_networks_scan(wifi_network_pick_t *pick);
+
+/**
+ * @brief Move to the next network of the ranking, wrapping around
+ *
+ * Counts a failure against the current network. Safe from the event loop:
+ * no NVS access.
+ *
+ * @param pick Next network, with ap set if the last scan saw it
+ * @return false if there is no other network
+ */
+bool wifi_networks_next(wifi_network_pick_t *pick);
+
+/**
+ * @brief Position of the current network in the ranking, 0 for the first
+ */
+int wifi_networks_position(void);
+
+/**
+ * @brief Record the associated network as good
+ *
+ * Bumps its success sequence, stores the channel and RSSI of the current
+ * AP, clears its failures and persists the list. Call once the session
+ * reached the broker, next to warm_boot_mark_clean().
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if the associated SSID is not stored,
+ *         or the esp_wifi/NVS error
+ */
+esp_err_t wifi_networks_mark_success(void);
+
+/**
+ * @brief Erase the stored list; call inside a device_config transaction
+ */
+void wifi_networks_erase(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WIFI_NETWORKS_H
@@ -2,31 +2,78 @@
  *
  * Handles WiFi Access Point mode for device provisioning.
  * Provides HTTP endpoints for WiFi scan and credential submission.
+ *
+ * A session owns its buffers (s_ctx), event handlers, worker and server;
+ * wifi_provisioning_stop() returns all of them, so a provisioned device
+ * keeps none of that RAM. Only the AP netif and the RTC scan image stay.
  */
 
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include "wifi_provisioning.h"
+#include "app_events.h"
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_http_server.h"
-#include "nvs_flash.h"
-#include "nvs.h"
-#include "cJSON.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_rtc_time.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "device_config.h"
+#include "certificate_manager.h"
+#include "sta_ip.h"
+#include "wifi_conn.h"
+#include "wifi_networks.h"
+#include "json_stream.h"
+#include "diag_log.h"
+#include "log_defer.h"
+#include "metrics.h"
+#include "trace_marks.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 
 static const char *TAG = "wifi_prov";
 
 // WiFi scan cache configuration
 #define WIFI_SCAN_MAX_APS        20     // Maximum APs to cache
+#define SCAN_CHANNELS_PER_PASS   3      // Background scan: channels per pass
+#define SCAN_HOME_DWELL_MS       60     // Time back on the AP channel between scanned channels
+
+// Pre-rendered /local-wifi body; ~75 bytes per AP with a typical SSID
+#define SCAN_JSON_SIZE           2560
+
+// Last scan kept across AP restarts and resets, reused while younger than this
+#define SCAN_CACHE_MAGIC         0x53434e31     // "SCN1"
+#define SCAN_CACHE_MAX_AGE_US    ((uint64_t)CONFIG_APP_PROV_SCAN_CACHE_MAX_S * 1000000)
+
+// Response rendering buffer for /metrics (the heap diagnostics add ~100 bytes per state)
+#if CONFIG_APP_HEAP_DIAG
+#define JSON_SCRATCH_SIZE        4096
+#else
+#define JSON_SCRATCH_SIZE        2048
+#endif
+
+// /provision body: read in chunks, fields extracted while it arrives
+#define PROVISION_BODY_MAX       4096   // Larger bodies get 413
+#define PROVISION_RECV_CHUNK     256
+#define PROVISION_RECV_RETRIES   3      // Receive timeouts tolerated per request
+#define PROVISION_QUEUE_LEN      1      // Requests waiting for the worker; more get 503
+
+// Where the session buffers (prov_ctx_t) come from
+#if CONFIG_APP_PROV_CTX_PSRAM
+#define PROV_CTX_CAPS            (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define PROV_CTX_CAPS            (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
 
 // NVS keys
-#define NVS_NAMESPACE "device_config"
 #define NVS_KEY_WIFI_SSID "wifi_ssid"
 #define NVS_KEY_WIFI_PASS "wifi_pass"
 #define NVS_KEY_DEVICE_ID "device_id"
@@ -41,14 +88,133 @@ static const char *TAG = "wifi_prov";
 // Global variables
 static httpd_handle_t s_httpd = NULL;
 static bool s_provisioning_active = false;
-static bool s_wifi_connected = false;
-static char s_sta_ip[16] = {0};
 
-// WiFi scan cache (for instant /local-wifi responses)
-static wifi_ap_record_t s_cached_networks[WIFI_SCAN_MAX_APS];
+// /status body and ETag, re-rendered by the httpd task when s_status_gen
+// moves past s_status_rendered. Bumped wherever the fields above change.
+static volatile uint32_t s_status_gen = 1;
+static uint32_t s_status_rendered = 0;
+static uint32_t s_status_boot_id = 0;       // Keeps ETags unique across reboots
+static char s_status_body[96];
+static char s_status_etag[24];
+
+// WiFi scan cache (for instant /local-wifi responses). Scans fill the other
+// half of s_ctx->networks, which is swapped in when the scan completes.
+static wifi_ap_record_t *s_cached_networks = NULL;
 static uint16_t s_cached_network_count = 0;
+static uint16_t s_scan_accum_count = 0;     // Records merged by the scan in flight
+static uint8_t s_scan_next_channel = 0;     // Next channel of the background scan
+static uint8_t s_scan_last_channel = 0;
+
+// Where the provisioned SSID was seen, for the STA connect that follows
+static uint8_t s_hint_bssid[6];
+static uint8_t s_hint_channel = 0;
+static bool s_hint_valid = false;
 static SemaphoreHandle_t s_cache_mutex = NULL;
 static bool s_initial_scan_done = false;
+static uint64_t s_scan_taken_us = 0;        // RTC time of the cached scan
+
+// The fields of a record the cache is rendered and checked from
+typedef struct {
+    uint8_t ssid[33];
+    uint8_t bssid[6];
+    uint8_t primary;
+    int8_t rssi;
+    uint8_t authmode;
+} scan_rtc_ap_t;
+
+typedef struct {
+    uint32_t magic;
+    uint64_t taken_us;                      // esp_rtc_get_time_us(), which runs on through resets
+    uint16_t count;
+    scan_rtc_ap_t aps[WIFI_SCAN_MAX_APS];
+    uint32_t crc;
+} scan_rtc_image_t;
+
+// Survives every reset but power loss
+RTC_NOINIT_ATTR static scan_rtc_image_t s_scan_rtc;
+
+// /local-wifi body rendered once per scan, without the trailing flags.
+// Rendered into the back buffer of s_ctx->scan_json, then swapped in under
+// s_cache_mutex.
+static const char *s_scan_body = NULL;
+static size_t s_scan_body_len = 0;
+static volatile bool s_scan_in_progress = false;   // Background scan running
+
+// /provision request fields, in the order of s_prov_paths; the required ones first
+enum {
+    PROV_SSID, PROV_PASSWORD, PROV_DEVICE_ID, PROV_TOKEN, PROV_REQUIRED_COUNT,
+    PROV_NET_IP = PROV_REQUIRED_COUNT, PROV_NET_NETMASK, PROV_NET_GATEWAY, PROV_NET_DNS,
+    PROV_LIST,                                          // ssid, password of each "networks" entry
+    PROV_LIST_OVER = PROV_LIST + 2 * WIFI_NETWORKS_MAX, // ssid of an entry past the last one kept
+    PROV_FIELD_COUNT
+};
+
+static const char *const s_prov_paths[PROV_FIELD_COUNT] = {
+    "ssid", "password", "device_id", "provisioning_token",
+    "network.ip", "network.netmask", "network.gateway", "network.dns",
+    "networks.0.ssid", "networks.0.password", "networks.1.ssid", "networks.1.password",
+    "networks.2.ssid", "networks.2.password", "networks.3.ssid", "networks.3.password",
+    "networks.4.ssid",
+};
+_Static_assert(WIFI_NETWORKS_MAX == 4, "one pair of s_prov_paths per listed network");
+
+typedef struct {
+    char *data;
+    size_t cap;             // Including the terminator
+    size_t len;
+    bool complete;          // Closing quote seen; later duplicates are ignored
+} prov_value_t;
+
+// Buffers only a provisioning session uses, allocated by
+// wifi_provisioning_start() and freed by wifi_provisioning_stop()
+typedef struct {
+    wifi_ap_record_t networks[2][WIFI_SCAN_MAX_APS];
+    char scan_json[2][SCAN_JSON_SIZE];
+    char json_scratch[JSON_SCRATCH_SIZE];   // Handlers run in the single httpd task, so they share it
+    char ssid[33];
+    char password[65];
+    char device_id[PROVISION_DEVICE_ID_MAX + 1];
+    char token[PROVISION_TOKEN_MAX + 1];
+    char net[PROV_LIST - PROV_NET_IP][STA_IP_STR_MAX];  // Optional static IP settings
+    wifi_network_cred_t wifi_list[1 + WIFI_NETWORKS_MAX];  // Primary, then the "networks" entries
+    char list_over[33];                     // Only seen, never stored
+    prov_value_t values[PROV_FIELD_COUNT];
+    char error[192];                        // missing_fields body
+} prov_ctx_t;
+
+static prov_ctx_t *s_ctx = NULL;
+#define PROV_NET(field) s_ctx->net[(field) - PROV_NET_IP]
+static int s_prov_too_long = -1;    // Field that overflowed, -1 if none
+static esp_event_handler_instance_t s_wifi_handler = NULL;
+static esp_event_handler_instance_t s_ip_handler = NULL;
+static SemaphoreHandle_t s_commit_lock = NULL;   // One credential set tested and saved at a time
+#if CONFIG_APP_PROV_WIFI_TEST
+static const char *s_prov_last_error = NULL;  // Failed credential test of this session, for /status
+#endif
+
+#if CONFIG_APP_HTTPD_ASYNC_PROVISION
+// /provision requests handed from the server task to the worker, which
+// lives as long as the session; NULL in the queue makes it exit
+static QueueHandle_t s_prov_queue = NULL;
+static TaskHandle_t s_prov_worker = NULL;
+static SemaphoreHandle_t s_prov_worker_done = NULL;   // Given by each worker as it exits
+static bool s_prov_worker_unjoined = false;     // The last worker's give is not taken yet
+#endif
+
+// Error bodies for /provision
+static const char PROV_ERR_INVALID_REQUEST[] = "{\"error\":\"invalid_request\"}";
+static const char PROV_ERR_BODY_TOO_LARGE[] = "{\"error\":\"body_too_large\"}";
+static const char PROV_ERR_INVALID_JSON[] = "{\"error\":\"invalid_json\"}";
+static const char PROV_ERR_FIELD_TOO_LONG[] = "{\"error\":\"field_too_long\"}";
+static const char PROV_ERR_SAVE_FAILED[] = "{\"error\":\"save_failed\"}";
+static const char PROV_ERR_INVALID_NETWORK[] = "{\"error\":\"invalid_network\"}";
+static const char PROV_ERR_TOO_MANY_NETWORKS[] = "{\"error\":\"too_many_networks\"}";
+static const char PROV_ERR_MISSING_HEAD[] =
+    "{\"error\":\"missing_fields\",\"message\":\"One or more required fields are missing\","
+    "\"missing_fields\":[";
+static const char PROV_ERR_CACHE_BUSY[] = "{\"error\":\"cache_busy\"}";
+static const char PROV_ERR_BUSY[] = "{\"error\":\"busy\"}";
+static const char PROV_OK[] = "{\"status\":\"ok\",\"message\":\"Credentials saved\"}";
 
 // Forward declarations
 static esp_err_t scan_handler(httpd_req_t *req);
@@ -64,17 +230,18 @@ static void log_outgoing_response(const char *method, const char *uri, int statu
 
 /**
  * @brief Log incoming HTTP request details
+ *
+ * Verbose lines go through the deferred log so the httpd task does not
+ * wait on the UART.
  */
 static void log_incoming_request(httpd_req_t *req)
 {
+    diag_log_record("http> %d %s", req->method, req->uri);
+
+#if CONFIG_APP_DIAG_VERBOSE
     // Reduced stack usage - use smaller, reusable buffer
     char buf[128] = {0};  // Single buffer for all header reads (reduced from 512)
-    
-    ESP_LOGI(TAG, "");
-    ESP_LOGI(TAG, "========================================");
-    ESP_LOGI(TAG, ">>> INCOMING HTTP REQUEST");
-    ESP_LOGI(TAG, "========================================");
-    
+
     // Log method
     const char *method_str = "UNKNOWN";
     if (req->method == HTTP_GET) {
@@ -86,72 +253,32 @@ static void log_incoming_request(httpd_req_t *req)
     } else if (req->method == HTTP_DELETE) {
         method_str = "DELETE";
     }
-    ESP_LOGI(TAG, "Method: %s", method_str);
-    
-    // Log URI
-    ESP_LOGI(TAG, "URI: %s", req->uri);
-    
+    size_t content_len = httpd_req_get_hdr_value_len(req, "Content-Length");
+    ESP_LOGI(TAG, ">>> %s %s (Content-Length %u)", method_str, req->uri, (unsigned)content_len);
+
     // Log query string if present
     size_t query_len = httpd_req_get_url_query_len(req) + 1;
     if (query_len > 1 && query_len <= sizeof(buf)) {
         if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
-            ESP_LOGI(TAG, "Query String: %s", buf);
-            buf[0] = '\0';  // Clear for reuse
-        }
-    }
-    
-    // Log content length
-    size_t content_len = httpd_req_get_hdr_value_len(req, "Content-Length");
-    if (content_len > 0) {
-        ESP_LOGI(TAG, "Content-Length: %d", content_len);
-    } else {
-        ESP_LOGI(TAG, "Content-Length: 0 (no body)");
-    }
-    
-    // User-Agent
-    size_t ua_len = httpd_req_get_hdr_value_len(req, "User-Agent") + 1;
-    if (ua_len > 1 && ua_len <= sizeof(buf)) {
-        if (httpd_req_get_hdr_value_str(req, "User-Agent", buf, sizeof(buf)) == ESP_OK) {
-            ESP_LOGI(TAG, "User-Agent: %s", buf);
-            buf[0] = '\0';
+            ESP_LOGI(TAG, "    Query String: %s", buf);
         }
     }
-    
-    // Authorization header (truncated for security)
-    size_t auth_len = httpd_req_get_hdr_value_len(req, "Authorization") + 1;
-    if (auth_len > 1 && auth_len <= sizeof(buf)) {
-        if (httpd_req_get_hdr_value_str(req, "Authorization", buf, sizeof(buf)) == ESP_OK) {
-            if (strlen(buf) > 50) {
+
+    // One line per header that is present and fits the buffer
+    static const char *const headers[] = { "User-Agent", "Content-Type", "Host", "Authorization" };
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        size_t len = httpd_req_get_hdr_value_len(req, headers[i]) + 1;
+        if (len > 1 && len <= sizeof(buf) &&
+                httpd_req_get_hdr_value_str(req, headers[i], buf, sizeof(buf)) == ESP_OK) {
+            // Authorization truncated for security
+            bool cut = strcmp(headers[i], "Authorization") == 0 && strlen(buf) > 50;
+            if (cut) {
                 buf[50] = '\0';
-                ESP_LOGI(TAG, "Authorization: %s...", buf);
-            } else {
-                ESP_LOGI(TAG, "Authorization: %s", buf);
             }
-            buf[0] = '\0';
-        }
-    } else {
-        ESP_LOGI(TAG, "Authorization: (not present)");
-    }
-    
-    // Content-Type
-    size_t content_type_len = httpd_req_get_hdr_value_len(req, "Content-Type") + 1;
-    if (content_type_len > 1 && content_type_len <= sizeof(buf)) {
-        if (httpd_req_get_hdr_value_str(req, "Content-Type", buf, sizeof(buf)) == ESP_OK) {
-            ESP_LOGI(TAG, "Content-Type: %s", buf);
-            buf[0] = '\0';
+            ESP_LOGI(TAG, "    %s: %s%s", headers[i], buf, cut ? "..." : "");
         }
     }
-    
-    // Host
-    size_t host_len = httpd_req_get_hdr_value_len(req, "Host") + 1;
-    if (host_len > 1 && host_len <= sizeof(buf)) {
-        if (httpd_req_get_hdr_value_str(req, "Host", buf, sizeof(buf)) == ESP_OK) {
-            ESP_LOGI(TAG, "Host: %s", buf);
-        }
-    }
-    
-    ESP_LOGI(TAG, "========================================");
-    ESP_LOGI(TAG, "");
+#endif
 }
 
 /**
@@ -159,155 +286,556 @@ static void log_incoming_request(httpd_req_t *req)
  */
 static void log_outgoing_response(const char *method, const char *uri, int status_code, const char *response_body)
 {
-    ESP_LOGI(TAG, "");
-    ESP_LOGI(TAG, "========================================");
-    ESP_LOGI(TAG, "<<< OUTGOING HTTP RESPONSE");
-    ESP_LOGI(TAG, "========================================");
-    ESP_LOGI(TAG, "Method: %s", method);
-    ESP_LOGI(TAG, "URI: %s", uri);
-    ESP_LOGI(TAG, "HTTP Status: %d", status_code);
-    
+    diag_log_record("http< %s %s %d", method, uri, status_code);
+
+#if CONFIG_APP_DIAG_VERBOSE
     // Status code description
     const char *status_desc = "";
     if (status_code == 200) status_desc = "OK";
     else if (status_code == 201) status_desc = "Created";
+    else if (status_code == 304) status_desc = "Not Modified";
     else if (status_code == 400) status_desc = "Bad Request";
     else if (status_code == 401) status_desc = "Unauthorized";
     else if (status_code == 404) status_desc = "Not Found";
+    else if (status_code == 413) status_desc = "Payload Too Large";
     else if (status_code == 500) status_desc = "Internal Server Error";
-    ESP_LOGI(TAG, "Status Description: %s", status_desc);
-    
-    if (response_body) {
-        size_t body_len = strlen(response_body);
-        ESP_LOGI(TAG, "Response Body Length: %d bytes", body_len);
-        
-        // Log response body (truncate if too long)
-        if (body_len > 500) {
-            char truncated[510] = {0};
-            strncpy(truncated, response_body, 500);
-            strcat(truncated, "...");
-            ESP_LOGI(TAG, "Response Body (first 500 chars): %s", truncated);
-            ESP_LOGI(TAG, "Response Body (full): [See ESP_LOGD for full body]");
-            ESP_LOGD(TAG, "Full Response Body: %s", response_body);
+    else if (status_code == 503) status_desc = "Service Unavailable";
+
+    size_t body_len = response_body ? strlen(response_body) : 0;
+    ESP_LOGI(TAG, "<<< %s %s: %d %s (%u bytes)", method, uri, status_code, status_desc,
+             (unsigned)body_len);
+    if (body_len > 0) {
+        // Long bodies are truncated in the deferred log
+        ESP_LOGI(TAG, "    %s", response_body);
+        ESP_LOGD(TAG, "Full Response Body: %s", response_body);
+    }
+#else
+    (void)response_body;
+#endif
+}
+
+/**
+ * @brief Append s to out as a JSON string literal
+ */
+static size_t json_put_string(char *out, size_t size, size_t pos, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    if (pos < size) {
+        out[pos] = '"';
+    }
+    pos++;
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        char esc = 0;
+        if (*p == '"' || *p == '\\') {
+            esc = *p;
+        } else if (*p == '\n') {
+            esc = 'n';
+        } else if (*p < 0x20) {
+            if (pos + 6 <= size) {
+                memcpy(out + pos, "\\u00", 4);
+                out[pos + 4] = hex[*p >> 4];
+                out[pos + 5] = hex[*p & 0xf];
+            }
+            pos += 6;
+            continue;
+        }
+        if (esc) {
+            if (pos + 2 <= size) {
+                out[pos] = '\\';
+                out[pos + 1] = esc;
+            }
+            pos += 2;
         } else {
-            ESP_LOGI(TAG, "Response Body: %s", response_body);
+            if (pos < size) {
+                out[pos] = *p;
+            }
+            pos++;
         }
-    } else {
-        ESP_LOGI(TAG, "Response Body: (empty)");
     }
-    
-    ESP_LOGI(TAG, "========================================");
-    ESP_LOGI(TAG, "");
+    if (pos < size) {
+        out[pos] = '"';
+    }
+    return pos + 1;
 }
 
 /**
- * @brief Perform WiFi scan and update cache
- * 
- * This is called ONCE during provisioning startup (before any client connects)
- * and optionally on-demand via /local-wifi?refresh=true
- * 
- * NO background scanning = stable AP connection for connected clients
+ * @brief Render the cached networks as the /local-wifi body
+ *
+ * Produces {"networks":[...],"count":N without the closing part, which
+ * depends on the request. Networks that do not fit are left out.
+ *
+ * @return Body length
  */
-static esp_err_t perform_wifi_scan_and_cache(void)
+static size_t render_scan_json(char *out, size_t size, const wifi_ap_record_t *aps, uint16_t count)
 {
-    ESP_LOGI(TAG, "Performing WiFi scan...");
-    
-    // Create mutex if not exists
-    if (s_cache_mutex == NULL) {
-        s_cache_mutex = xSemaphoreCreateMutex();
-        if (s_cache_mutex == NULL) {
-            ESP_LOGE(TAG, "Failed to create cache mutex");
-            return ESP_ERR_NO_MEM;
+    const size_t tail_room = 16;  // ],"count":NN
+    size_t pos = strlcpy(out, "{\"networks\":[", size);
+    int emitted = 0;
+
+    for (int i = 0; i < count; i++) {
+        char entry[96];
+        size_t start = pos;
+
+        if (emitted > 0) {
+            out[pos++] = ',';
+        }
+        pos += strlcpy(out + pos, "{\"ssid\":", size - pos);
+        pos = json_put_string(out, size - tail_room, pos, (const char *)aps[i].ssid);
+        int n = snprintf(entry, sizeof(entry), ",\"rssi\":%d,\"channel\":%d,\"secure\":%s}",
+                         aps[i].rssi, aps[i].primary,
+                         aps[i].authmode != WIFI_AUTH_OPEN ? "true" : "false");
+        if (pos + n + tail_room > size) {
+            // Out of room: drop this network and everything after it
+            pos = start;
+            ESP_LOGW(TAG, "Scan body full, listing %d of %d networks", emitted, count);
+            break;
         }
+        memcpy(out + pos, entry, n);
+        pos += n;
+        emitted++;
     }
-    
+
+    pos += snprintf(out + pos, size - pos, "],\"count\":%d", emitted);
+    return pos;
+}
+
+/**
+ * @brief Records being filled by the scan in flight (the unpublished half)
+ */
+static wifi_ap_record_t *scan_back_records(void)
+{
+    return (s_cached_networks == s_ctx->networks[0]) ? s_ctx->networks[1] : s_ctx->networks[0];
+}
+
+/**
+ * @brief Merge the results of one scan pass into the back records
+ *
+ * One AP appears once (strongest sighting wins); when the table is full a
+ * stronger AP replaces the weakest.
+ */
+static void scan_merge_pass(void)
+{
+    wifi_ap_record_t *accum = scan_back_records();
+    wifi_ap_record_t rec;
+
+    while (esp_wifi_scan_get_ap_record(&rec) == ESP_OK) {
+        int slot = -1;
+        int weakest = 0;
+        for (int i = 0; i < s_scan_accum_count; i++) {
+            if (memcmp(accum[i].bssid, rec.bssid, sizeof(rec.bssid)) == 0) {
+                slot = i;
+                break;
+            }
+            if (accum[i].rssi < accum[weakest].rssi) {
+                weakest = i;
+            }
+        }
+
+        if (slot >= 0) {
+            if (rec.rssi > accum[slot].rssi) {
+                accum[slot] = rec;
+            }
+        } else if (s_scan_accum_count < WIFI_SCAN_MAX_APS) {
+            accum[s_scan_accum_count++] = rec;
+        } else if (rec.rssi > accum[weakest].rssi) {
+            accum[weakest] = rec;
+        }
+    }
+    esp_wifi_clear_ap_list();
+}
+
+/**
+ * @brief Keep a published scan in RTC memory for the next AP start
+ */
+static void scan_rtc_save(const wifi_ap_record_t *records, uint16_t count)
+{
+    scan_rtc_image_t *img = &s_scan_rtc;
+    memset(img, 0, sizeof(*img));
+    for (int i = 0; i < count; i++) {
+        memcpy(img->aps[i].ssid, records[i].ssid, sizeof(img->aps[i].ssid));
+        memcpy(img->aps[i].bssid, records[i].bssid, sizeof(img->aps[i].bssid));
+        img->aps[i].primary = records[i].primary;
+        img->aps[i].rssi = records[i].rssi;
+        img->aps[i].authmode = (uint8_t)records[i].authmode;
+    }
+    img->count = count;
+    img->taken_us = s_scan_taken_us;
+    img->magic = SCAN_CACHE_MAGIC;
+    img->crc = esp_rom_crc32_le(0, (const uint8_t *)img, offsetof(scan_rtc_image_t, crc));
+}
+
+/**
+ * @brief Publish the back records and a freshly rendered body
+ *
+ * Runs in the event task when the last background pass finishes. Only one scan is ever in flight, and new scans
+ * are started from the httpd task, so at most one swap can happen while a
+ * handler is sending the front buffer.
+ */
+static esp_err_t scan_publish(void)
+{
+    wifi_ap_record_t *records = scan_back_records();
+
+    // Render outside the lock; readers only ever see the front buffer
+    char *back = (s_scan_body == s_ctx->scan_json[0]) ? s_ctx->scan_json[1] : s_ctx->scan_json[0];
+    size_t len = render_scan_json(back, SCAN_JSON_SIZE, records, s_scan_accum_count);
+
+    if (xSemaphoreTake(s_cache_mutex, pdMS_TO_TICKS(5000)) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to acquire mutex for cache update");
+        return ESP_ERR_TIMEOUT;
+    }
+    s_cached_networks = records;
+    s_cached_network_count = s_scan_accum_count;
+    s_scan_body = back;
+    s_scan_body_len = len;
+    s_initial_scan_done = true;
+    s_scan_taken_us = esp_rtc_get_time_us();
+    xSemaphoreGive(s_cache_mutex);
+
+    scan_rtc_save(records, s_scan_accum_count);
+    ESP_LOGI(TAG, "WiFi scan completed: %d networks cached", s_scan_accum_count);
+    return ESP_OK;
+}
+
+/**
+ * @brief Serve the last scan of this or an earlier boot, while it is recent
+ *
+ * Run before the HTTP server starts. A cache too old is dropped, and the
+ * first /local-wifi after that reports no networks until the background
+ * scan finishes.
+ */
+static void scan_cache_restore(void)
+{
+    uint64_t now = esp_rtc_get_time_us();
+    if (s_scan_body != NULL && now - s_scan_taken_us <= SCAN_CACHE_MAX_AGE_US) {
+        return;
+    }
+    s_scan_body = NULL;
+    s_scan_body_len = 0;
+    s_cached_network_count = 0;
+    s_initial_scan_done = false;
+
+    const scan_rtc_image_t *img = &s_scan_rtc;
+    if (img->magic != SCAN_CACHE_MAGIC || img->count > WIFI_SCAN_MAX_APS ||
+        img->crc != esp_rom_crc32_le(0, (const uint8_t *)img, offsetof(scan_rtc_image_t, crc)) ||
+        img->taken_us > now || now - img->taken_us > SCAN_CACHE_MAX_AGE_US) {
+        return;
+    }
+
+    wifi_ap_record_t *records = s_ctx->networks[0];
+    memset(records, 0, sizeof(s_ctx->networks[0]));
+    for (int i = 0; i < img->count; i++) {
+        memcpy(records[i].ssid, img->aps[i].ssid, sizeof(records[i].ssid));
+        memcpy(records[i].bssid, img->aps[i].bssid, sizeof(records[i].bssid));
+        records[i].primary = img->aps[i].primary;
+        records[i].rssi = img->aps[i].rssi;
+        records[i].authmode = img->aps[i].authmode;
+    }
+    s_cached_networks = records;
+    s_cached_network_count = img->count;
+    s_scan_body = s_ctx->scan_json[0];
+    s_scan_body_len = render_scan_json(s_ctx->scan_json[0], SCAN_JSON_SIZE, records, img->count);
+    s_scan_taken_us = img->taken_us;
+    s_initial_scan_done = true;
+    ESP_LOGI(TAG, "Serving %d networks from a scan %llu s ago", img->count,
+             (unsigned long long)((now - img->taken_us) / 1000000));
+}
+
+/**
+ * @brief Start the next pass of a background scan
+ *
+ * A pass covers SCAN_CHANNELS_PER_PASS channels and returns to the AP
+ * channel for SCAN_HOME_DWELL_MS between them, so phones on the soft-AP
+ * keep receiving beacons and traffic.
+ */
+static esp_err_t scan_start_pass(void)
+{
     wifi_scan_config_t scan_config = {
         .show_hidden = false,
         .scan_type = WIFI_SCAN_TYPE_ACTIVE,
         .scan_time = {
             .active = {
-                .min = 100,
-                .max = 300
+                .min = 50,
+                .max = 120
             }
-        }
+        },
+        .home_chan_dwell_time = SCAN_HOME_DWELL_MS,
     };
-    
-    // Perform WiFi scan (blocking)
-    esp_err_t ret = esp_wifi_scan_start(&scan_config, true);
+
+    uint8_t first = s_scan_next_channel;
+    uint8_t last = first + SCAN_CHANNELS_PER_PASS - 1;
+    if (last > s_scan_last_channel) {
+        last = s_scan_last_channel;
+    }
+    for (uint8_t ch = first; ch <= last; ch++) {
+        scan_config.channel_bitmap.ghz_2_channels |= (uint16_t)(1 << ch);
+    }
+    s_scan_next_channel = last + 1;
+
+    ESP_LOGD(TAG, "Background scan pass: channels %d-%d", first, last);
+    return esp_wifi_scan_start(&scan_config, false);
+}
+
+/**
+ * @brief Perform WiFi scan and update cache
+ *
+ * Runs in the background as a sequence of short passes, at every AP start
+ * and on /local-wifi?refresh=true; the results are published after the
+ * last pass and the handler keeps serving the previous cache meanwhile.
+ */
+static esp_err_t perform_wifi_scan_and_cache(void)
+{
+    ESP_LOGI(TAG, "Performing WiFi scan (background)...");
+
+    if (s_scan_in_progress) {
+        return ESP_OK;
+    }
+    s_scan_accum_count = 0;
+
+    wifi_country_t country;
+    s_scan_next_channel = 1;
+    s_scan_last_channel = 13;
+    if (esp_wifi_get_country(&country) == ESP_OK && country.nchan > 0) {
+        s_scan_next_channel = country.schan;
+        s_scan_last_channel = country.schan + country.nchan - 1;
+    }
+
+    // Set first: SCAN_DONE can fire before esp_wifi_scan_start() returns
+    s_scan_in_progress = true;
+    esp_err_t ret = scan_start_pass();
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "WiFi scan failed: %s", esp_err_to_name(ret));
-        return ret;
+        s_scan_in_progress = false;
     }
-    
-    // Get scan results
-    uint16_t ap_count = 0;
-    esp_wifi_scan_get_ap_num(&ap_count);
-    if (ap_count > WIFI_SCAN_MAX_APS) {
-        ap_count = WIFI_SCAN_MAX_APS;
+    return ret;
+}
+
+/**
+ * @brief WIFI_EVENT_SCAN_DONE for a background pass
+ */
+static void scan_pass_done(const wifi_event_sta_scan_done_t *event)
+{
+    if (event->status == 0) {
+        scan_merge_pass();
+    } else {
+        ESP_LOGW(TAG, "Background scan pass failed (status %d)", (int)event->status);
+        esp_wifi_clear_ap_list();
     }
-    
-    // Update cache with mutex protection
-    if (xSemaphoreTake(s_cache_mutex, pdMS_TO_TICKS(5000)) == pdTRUE) {
-        s_cached_network_count = ap_count;
-        if (ap_count > 0) {
-            esp_wifi_scan_get_ap_records(&s_cached_network_count, s_cached_networks);
+
+    if (s_scan_next_channel <= s_scan_last_channel && scan_start_pass() == ESP_OK) {
+        return;
+    }
+
+    // Last pass (or the next one could not start): publish what we have
+    scan_publish();
+    s_scan_in_progress = false;
+}
+
+/**
+ * @brief Strongest cached record of ssid
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if the last scan did not see it, or
+ *         ESP_ERR_INVALID_STATE if there is no scan to go by (none
+ *         completed, or the cache is busy)
+ */
+static esp_err_t scan_lookup(const char *ssid, wifi_ap_record_t *out)
+{
+    if (s_cache_mutex == NULL || xSemaphoreTake(s_cache_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int best = -1;
+    for (int i = 0; i < s_cached_network_count; i++) {
+        if (strcmp((const char *)s_cached_networks[i].ssid, ssid) == 0 &&
+            (best < 0 || s_cached_networks[i].rssi > s_cached_networks[best].rssi)) {
+            best = i;
         }
-        s_initial_scan_done = true;
-        xSemaphoreGive(s_cache_mutex);
-        
-        ESP_LOGI(TAG, "WiFi scan completed: %d networks cached", s_cached_network_count);
-    } else {
-        ESP_LOGE(TAG, "Failed to acquire mutex for cache update");
-        return ESP_ERR_TIMEOUT;
     }
-    
+    esp_err_t err = s_cached_network_count == 0 ? ESP_ERR_INVALID_STATE : ESP_ERR_NOT_FOUND;
+    if (best >= 0) {
+        *out = s_cached_networks[best];
+        err = ESP_OK;
+    }
+    xSemaphoreGive(s_cache_mutex);
+    return err;
+}
+
+static bool is_hex(const char *str, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        char c = str[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Whether a password of this form can work with the advertised security
+ */
+static bool password_fits(wifi_auth_mode_t authmode, const char *password)
+{
+    size_t len = strlen(password);
+
+    switch (authmode) {
+    case WIFI_AUTH_OPEN:
+    case WIFI_AUTH_OWE:
+        return len == 0;
+    case WIFI_AUTH_WEP:
+        return len == 5 || len == 13 || ((len == 10 || len == 26) && is_hex(password, len));
+    case WIFI_AUTH_WPA3_PSK:
+        // SAE has no minimum length
+        return len > 0;
+    default:
+        // WPA/WPA2 passphrase, or the PSK itself as 64 hex digits
+        return (len >= 8 && len <= 63) || (len == 64 && is_hex(password, len));
+    }
+}
+
+static bool is_enterprise(wifi_auth_mode_t authmode)
+{
+    switch (authmode) {
+    case WIFI_AUTH_WPA2_ENTERPRISE:
+    case WIFI_AUTH_WPA3_ENTERPRISE:
+    case WIFI_AUTH_WPA2_WPA3_ENTERPRISE:
+    case WIFI_AUTH_WPA3_ENT_192:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Check the request against the cached scan before connecting
+ *
+ * Rejects SSIDs the last scan did not see, passwords that cannot match the
+ * network's security mode, enterprise networks (no EAP credentials are
+ * provisioned) and signals below CONFIG_APP_PROV_MIN_RSSI. A network that
+ * passes is remembered as the connect hint, so the connect that follows
+ * goes to its BSSID and channel without a full scan.
+ *
+ * @param ap Filled with the network's BSSID and channel on ESP_OK
+ * @return ESP_OK, ESP_ERR_NOT_FOUND when there is nothing to check against
+ *         (the connect then scans), or ESP_FAIL with the body in s_ctx->error
+ */
+static esp_err_t provision_preflight(const char *ssid, const char *password, warm_boot_ap_t *ap)
+{
+    s_hint_valid = false;
+
+    wifi_ap_record_t rec;
+    esp_err_t err = scan_lookup(ssid, &rec);
+    if (err == ESP_ERR_NOT_FOUND) {
+#if CONFIG_APP_PROV_ALLOW_HIDDEN
+        ESP_LOGW(TAG, "%s not in the scan, assuming a hidden network", ssid);
+        return ESP_ERR_NOT_FOUND;
+#else
+        ESP_LOGE(TAG, "%s not in the scan", ssid);
+        strlcpy(s_ctx->error, "{\"error\":\"wifi_not_in_range\"}", sizeof(s_ctx->error));
+        return ESP_FAIL;
+#endif
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No scan results to check %s against", ssid);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const char *error = NULL;
+    if (is_enterprise(rec.authmode)) {
+        error = "wifi_auth_unsupported";
+    } else if (!password_fits(rec.authmode, password)) {
+        error = "wifi_password_invalid";
+    } else if (rec.rssi < CONFIG_APP_PROV_MIN_RSSI) {
+        error = "wifi_signal_weak";
+    }
+    if (error != NULL) {
+        ESP_LOGE(TAG, "%s rejected: %s (authmode %d, RSSI %d)", ssid, error, rec.authmode, rec.rssi);
+        snprintf(s_ctx->error, sizeof(s_ctx->error), "{\"error\":\"%s\",\"authmode\":%d,\"rssi\":%d}",
+                 error, rec.authmode, rec.rssi);
+        return ESP_FAIL;
+    }
+
+    memcpy(ap->bssid, rec.bssid, sizeof(ap->bssid));
+    ap->channel = rec.primary;
+    memcpy(s_hint_bssid, rec.bssid, sizeof(s_hint_bssid));
+    s_hint_channel = rec.primary;
+    s_hint_valid = true;
+    ESP_LOGI(TAG, "Connect hint: %s on channel %d (RSSI %d)", ssid, s_hint_channel, rec.rssi);
     return ESP_OK;
 }
 
 /**
  * @brief Save WiFi credentials to NVS
+ *
+ * @param nets Network list for wifi_networks_save(), primary first; NULL
+ *        stores the primary alone
  */
 static esp_err_t save_wifi_credentials(const char *ssid, const char *password,
+                                       const wifi_network_cred_t *nets, int net_count,
                                        const char *device_id, const char *prov_token,
-                                       const char *bearer_token)
+                                       const char *bearer_token, const sta_ip_static_t *static_ip)
 {
-    nvs_handle_t nvs_handle;
     esp_err_t err;
+    char stored_id[65];
+    size_t stored_len = sizeof(stored_id);
+    wifi_network_cred_t primary;
+
+    if (nets == NULL) {
+        strlcpy(primary.ssid, ssid, sizeof(primary.ssid));
+        strlcpy(primary.password, password, sizeof(primary.password));
+        nets = &primary;
+        net_count = 1;
+    }
 
-    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
-        return err;
+    // All or nothing, with a single commit
+    device_config_begin();
+
+    // Certificates outlive a network change but belong to one device ID
+    if (device_config_get_str(NVS_KEY_DEVICE_ID, stored_id, &stored_len) == ESP_OK &&
+            strcmp(stored_id, device_id) != 0) {
+        ESP_LOGI(TAG, "Device ID changed from %s, dropping its certificates", stored_id);
+        err = certificate_manager_erase();
+        if (err != ESP_OK) goto cleanup;
     }
 
-    err = nvs_set_str(nvs_handle, NVS_KEY_WIFI_SSID, ssid);
+    err = device_config_set_str(NVS_KEY_WIFI_SSID, ssid);
+    if (err != ESP_OK) goto cleanup;
+
+    err = device_config_set_str(NVS_KEY_WIFI_PASS, password);
     if (err != ESP_OK) goto cleanup;
 
-    err = nvs_set_str(nvs_handle, NVS_KEY_WIFI_PASS, password);
+    err = wifi_networks_save(nets, net_count);
     if (err != ESP_OK) goto cleanup;
 
-    err = nvs_set_str(nvs_handle, NVS_KEY_DEVICE_ID, device_id);
+    err = device_config_set_str(NVS_KEY_DEVICE_ID, device_id);
     if (err != ESP_OK) goto cleanup;
 
-    err = nvs_set_str(nvs_handle, NVS_KEY_PROV_TOKEN, prov_token);
+    err = device_config_set_str(NVS_KEY_PROV_TOKEN, prov_token);
     if (err != ESP_OK) goto cleanup;
 
     // Save Bearer token if provided
     if (bearer_token != NULL && strlen(bearer_token) > 0) {
-        err = nvs_set_str(nvs_handle, NVS_KEY_BEARER_TOKEN, bearer_token);
+        err = device_config_set_str(NVS_KEY_BEARER_TOKEN, bearer_token);
         if (err != ESP_OK) goto cleanup;
         ESP_LOGI(TAG, "Bearer token saved to NVS");
     } else {
         ESP_LOGW(TAG, "No Bearer token provided");
     }
 
-    err = nvs_set_u8(nvs_handle, NVS_KEY_PROVISIONED, 1);
+    // No "network" object means DHCP, also for a device that had static settings
+    err = sta_ip_save(static_ip);
     if (err != ESP_OK) goto cleanup;
 
-    err = nvs_commit(nvs_handle);
+    // Written last: the flag marks the set as complete
+    err = device_config_set_u8(NVS_KEY_PROVISIONED, 1);
 
 cleanup:
-    nvs_close(nvs_handle);
+    {
+        esp_err_t commit_err = device_config_commit();
+        if (err == ESP_OK) {
+            err = commit_err;
+        }
+    }
     return err;
 }
 
@@ -315,12 +843,14 @@ cleanup:
  * @brief HTTP GET handler for /local-wifi endpoint
  * 
  * Returns cached WiFi scan results instantly (low latency UX).
- * Cache is populated ONCE at startup. No background scanning = stable AP.
+ * Cache is populated at startup before clients connect.
  * 
- * Optional: /local-wifi?refresh=true to force a new scan (will briefly disrupt connection)
+ * Optional: /local-wifi?refresh=true starts a background scan and returns
+ * the current cache with scan_in_progress set; poll again for the results.
  */
 static esp_err_t scan_handler(httpd_req_t *req)
 {
+#if CONFIG_APP_DIAG_VERBOSE
     // Immediate logging - this should appear FIRST
     // Using multiple log levels to ensure visibility
     ESP_LOGE(TAG, "========================================");
@@ -330,6 +860,7 @@ static esp_err_t scan_handler(httpd_req_t *req)
     ESP_LOGI(TAG, "*** SCAN_HANDLER CALLED ***");
     ESP_LOGI(TAG, "URI: %s", req->uri ? req->uri : "NULL");
     ESP_LOGI(TAG, "Method: %d (1=GET, 3=POST)", req->method);
+#endif
     
     // Log incoming request
     log_incoming_request(req);
@@ -343,95 +874,247 @@ static esp_err_t scan_handler(httpd_req_t *req)
         if (httpd_query_key_value(query, "refresh", param, sizeof(param)) == ESP_OK) {
             if (strcmp(param, "true") == 0 || strcmp(param, "1") == 0) {
                 force_refresh = true;
-                ESP_LOGW(TAG, "Force refresh requested - this will briefly disrupt WiFi");
+                ESP_LOGW(TAG, "Force refresh requested - AP clients may see a brief hiccup");
             }
         }
     }
 
-    // If cache is empty or force refresh requested, do a scan
+    // If cache is empty or force refresh requested, start a background scan;
+    // this request is answered from the current cache right away
     if (!s_initial_scan_done || force_refresh) {
-        ESP_LOGI(TAG, "Performing WiFi scan (cache %s)...", 
+        ESP_LOGI(TAG, "Starting WiFi scan (cache %s)...", 
                  force_refresh ? "refresh requested" : "empty");
-        
-        esp_err_t ret = perform_wifi_scan_and_cache();
-        if (ret != ESP_OK && !s_initial_scan_done) {
-            // Only fail if we have no cached data at all
-            const char *error_response = "{\"error\":\"scan_failed\",\"message\":\"No cached data available\"}";
-            httpd_resp_set_status(req, "500 Internal Server Error");
-            httpd_resp_set_type(req, "application/json");
-            log_outgoing_response("GET", req->uri, 500, error_response);
-            httpd_resp_sendstr(req, error_response);
-            return ESP_FAIL;
-        }
+        perform_wifi_scan_and_cache();
     }
 
     // Take mutex to safely read cache
     if (s_cache_mutex == NULL || xSemaphoreTake(s_cache_mutex, pdMS_TO_TICKS(1000)) != pdTRUE) {
         ESP_LOGE(TAG, "Failed to acquire cache mutex");
-        const char *error_response = "{\"error\":\"cache_busy\"}";
         httpd_resp_set_status(req, "500 Internal Server Error");
         httpd_resp_set_type(req, "application/json");
-        log_outgoing_response("GET", req->uri, 500, error_response);
-        httpd_resp_sendstr(req, error_response);
+        log_outgoing_response("GET", req->uri, 500, PROV_ERR_CACHE_BUSY);
+        httpd_resp_sendstr(req, PROV_ERR_CACHE_BUSY);
         return ESP_FAIL;
     }
 
-    // Build JSON response from cached data
-    cJSON *root = cJSON_CreateObject();
-    cJSON *networks = cJSON_CreateArray();
-
-    for (int i = 0; i < s_cached_network_count; i++) {
-        cJSON *network = cJSON_CreateObject();
-        cJSON_AddStringToObject(network, "ssid", (char*)s_cached_networks[i].ssid);
-        cJSON_AddNumberToObject(network, "rssi", s_cached_networks[i].rssi);
-        cJSON_AddNumberToObject(network, "channel", s_cached_networks[i].primary);
-        cJSON_AddBoolToObject(network, "secure", s_cached_networks[i].authmode != WIFI_AUTH_OPEN);
-        cJSON_AddItemToArray(networks, network);
-    }
-
-    uint16_t count = s_cached_network_count;
-    
-    // Release mutex after reading
+    // Only the pointer is read under the lock
+    const char *body = s_scan_body;
+    size_t body_len = s_scan_body_len;
+    uint64_t taken_us = s_scan_taken_us;
     xSemaphoreGive(s_cache_mutex);
 
-    cJSON_AddItemToObject(root, "networks", networks);
-    cJSON_AddNumberToObject(root, "count", count);
-    cJSON_AddBoolToObject(root, "cached", !force_refresh);  // false if just refreshed
-
-    char *json_string = cJSON_Print(root);
-    if (json_string == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON string");
-        const char *error_response = "{\"error\":\"json_error\"}";
-        httpd_resp_set_status(req, "500 Internal Server Error");
-        httpd_resp_set_type(req, "application/json");
-        log_outgoing_response("GET", req->uri, 500, error_response);
-        httpd_resp_sendstr(req, error_response);
-        cJSON_Delete(root);
-        return ESP_FAIL;
+    bool cached = (body != NULL);
+    if (!cached) {
+        // No scan has finished yet; the client polls again
+        body = "{\"networks\":[],\"count\":0";
+        body_len = strlen(body);
     }
 
+    char tail[80];
+    snprintf(tail, sizeof(tail), ",\"cached\":%s,\"age_s\":%lu,\"scan_in_progress\":%s}",
+             cached ? "true" : "false",
+             cached ? (unsigned long)((esp_rtc_get_time_us() - taken_us) / 1000000) : 0UL,
+             s_scan_in_progress ? "true" : "false");
+
     httpd_resp_set_type(req, "application/json");
     
     // Log outgoing response
-    log_outgoing_response("GET", req->uri, 200, json_string);
+    log_outgoing_response("GET", req->uri, 200, body);
     
-    httpd_resp_sendstr(req, json_string);
+    httpd_resp_send_chunk(req, body, body_len);
+    httpd_resp_send_chunk(req, tail, strlen(tail));
+    httpd_resp_send_chunk(req, NULL, 0);
+
+    ESP_LOGI(TAG, "Returned cached networks (%d bytes, instant response)", body_len + strlen(tail));
 
-    ESP_LOGI(TAG, "Returned %d networks (instant response)", count);
+    return ESP_OK;
+}
 
-    free(json_string);
-    cJSON_Delete(root);
+static esp_err_t provision_send_error(httpd_req_t *req, const char *status, int code, const char *body)
+{
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "application/json");
+    log_outgoing_response("POST", req->uri, code, body);
+    httpd_resp_sendstr(req, body);
+    return ESP_FAIL;
+}
 
+static esp_err_t provision_field_cb(void *ctx, int field, const char *data, size_t len, bool done)
+{
+    prov_value_t *v = &s_ctx->values[field];
+
+    if (v->complete) {
+        return ESP_OK;      // Duplicate key, the first value wins
+    }
+    if (done) {
+        v->complete = true;
+        return ESP_OK;
+    }
+    if (v->len + len + 1 > v->cap) {
+        s_prov_too_long = field;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(v->data + v->len, data, len);
+    v->len += len;
+    v->data[v->len] = '\0';
     return ESP_OK;
 }
 
 /**
- * @brief HTTP POST handler for /provision endpoint
+ * @brief Receive the /provision body and extract its fields
+ *
+ * The body is fed to the extractor as it arrives, so no copy of it is
+ * kept and its length is only bounded by PROVISION_BODY_MAX.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if the body or a field is too
+ *         long (s_prov_too_long tells which), ESP_ERR_INVALID_RESPONSE
+ *         for malformed JSON, ESP_FAIL if the body could not be read
  */
-static esp_err_t provision_handler(httpd_req_t *req)
+static esp_err_t provision_read_body(httpd_req_t *req)
+{
+    char *bufs[PROV_FIELD_COUNT] = {
+        s_ctx->ssid, s_ctx->password, s_ctx->device_id, s_ctx->token,
+        PROV_NET(PROV_NET_IP), PROV_NET(PROV_NET_NETMASK), PROV_NET(PROV_NET_GATEWAY), PROV_NET(PROV_NET_DNS),
+    };
+    size_t caps[PROV_FIELD_COUNT] = {
+        sizeof(s_ctx->ssid), sizeof(s_ctx->password), sizeof(s_ctx->device_id), sizeof(s_ctx->token),
+        STA_IP_STR_MAX, STA_IP_STR_MAX, STA_IP_STR_MAX, STA_IP_STR_MAX,
+    };
+    for (int i = 0; i < WIFI_NETWORKS_MAX; i++) {
+        wifi_network_cred_t *cred = &s_ctx->wifi_list[1 + i];
+        bufs[PROV_LIST + 2 * i] = cred->ssid;
+        caps[PROV_LIST + 2 * i] = sizeof(cred->ssid);
+        bufs[PROV_LIST + 2 * i + 1] = cred->password;
+        caps[PROV_LIST + 2 * i + 1] = sizeof(cred->password);
+    }
+    bufs[PROV_LIST_OVER] = s_ctx->list_over;
+    caps[PROV_LIST_OVER] = sizeof(s_ctx->list_over);
+    for (int i = 0; i < PROV_FIELD_COUNT; i++) {
+        s_ctx->values[i] = (prov_value_t){ .data = bufs[i], .cap = caps[i] };
+        bufs[i][0] = '\0';
+    }
+    s_prov_too_long = -1;
+
+    size_t remaining = req->content_len;
+    if (remaining == 0) {
+        return ESP_FAIL;
+    }
+    if (remaining > PROVISION_BODY_MAX) {
+        ESP_LOGE(TAG, "Body of %u bytes exceeds %d", (unsigned)remaining, PROVISION_BODY_MAX);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    json_stream_t js;
+    json_stream_init(&js, s_prov_paths, PROV_FIELD_COUNT, provision_field_cb, NULL);
+
+    char chunk[PROVISION_RECV_CHUNK];
+    int retries = 0;
+    while (remaining > 0) {
+        int n = httpd_req_recv(req, chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk));
+        if (n == HTTPD_SOCK_ERR_TIMEOUT && ++retries <= PROVISION_RECV_RETRIES) {
+            continue;
+        }
+        if (n <= 0) {
+            ESP_LOGE(TAG, "Body receive failed (%d), %u bytes missing", n, (unsigned)remaining);
+            return ESP_FAIL;
+        }
+        esp_err_t err = json_stream_feed(&js, chunk, n);
+        if (err != ESP_OK) {
+            return err;
+        }
+        remaining -= n;
+    }
+    return json_stream_finish(&js);
+}
+
+#if CONFIG_APP_PROV_WIFI_TEST
+/**
+ * @brief Join the requested network with the AP still up
+ *
+ * The credentials are only saved when this succeeds. On failure the error
+ * body is left in s_ctx->error.
+ */
+static esp_err_t provision_test_wifi(const char *ssid, const char *password, const sta_ip_static_t *static_ip,
+                                     const warm_boot_ap_t *ap)
+{
+    // The station cannot associate while a scan holds the radio
+    if (s_scan_in_progress) {
+        esp_wifi_scan_stop();
+        s_scan_in_progress = false;
+    }
+
+    wifi_conn_try_result_t result = WIFI_CONN_TRY_FAILED;
+    uint8_t reason = 0;
+    esp_err_t err = wifi_conn_try(ssid, password, static_ip, ap, CONFIG_APP_PROV_WIFI_TEST_TIMEOUT_MS,
+                                  &result, &reason);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Credential test failed to start: %s", esp_err_to_name(err));
+        result = WIFI_CONN_TRY_FAILED;
+    }
+
+    // The AP follows the station's channel, so clients may have to
+    // rejoin and read the outcome from /status instead of the response
+    s_prov_last_error = result == WIFI_CONN_TRY_OK ? NULL : wifi_conn_try_name(result);
+    s_status_gen++;
+    if (result == WIFI_CONN_TRY_OK) {
+        return ESP_OK;
+    }
+    snprintf(s_ctx->error, sizeof(s_ctx->error), "{\"error\":\"%s\",\"reason\":%d}",
+             s_prov_last_error, reason);
+    return ESP_FAIL;
+}
+#endif
+
+/**
+ * @brief Check, test and save a credential set; the caller holds s_commit_lock
+ *
+ * Only the primary network is checked and tested: the others may belong
+ * to sites out of reach.
+ *
+ * @param nets Network list, primary first, or NULL for the primary alone
+ * @return ESP_OK once saved, ESP_FAIL if the network check or test failed
+ *         (422 body in s_ctx->error), or the NVS error
+ */
+static esp_err_t provision_commit(const char *ssid, const char *password,
+                                  const wifi_network_cred_t *nets, int net_count, const char *device_id,
+                                  const char *prov_token, const char *bearer_token,
+                                  const sta_ip_static_t *static_ip)
+{
+    // Cheap checks against the scan first, so a hopeless request costs no connect
+    warm_boot_ap_t ap;
+    esp_err_t err = provision_preflight(ssid, password, &ap);
+    if (err == ESP_FAIL) {
+        return ESP_FAIL;
+    }
+
+#if CONFIG_APP_PROV_WIFI_TEST
+    if (provision_test_wifi(ssid, password, static_ip, err == ESP_OK ? &ap : NULL) != ESP_OK) {
+        return ESP_FAIL;
+    }
+#endif
+
+    err = save_wifi_credentials(ssid, password, nets, net_count, device_id, prov_token, bearer_token,
+                                static_ip);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save credentials: %s", esp_err_to_name(err));
+#if CONFIG_APP_PROV_WIFI_TEST
+        wifi_conn_try_discard();
+#endif
+    }
+    return err;
+}
+
+/**
+ * @brief Read, validate and save a /provision request and send the response
+ *
+ * @return ESP_OK once the credentials are saved and acknowledged
+ */
+static esp_err_t provision_process(httpd_req_t *req)
 {
+#if CONFIG_APP_DIAG_VERBOSE
     // Immediate logging
     ESP_LOGI(TAG, "[PROVISION_HANDLER] Request received for URI: %s", req->uri ? req->uri : "NULL");
+#endif
     // Log incoming request (reduced stack usage version)
     log_incoming_request(req);
 
@@ -458,196 +1141,342 @@ static esp_err_t provision_handler(httpd_req_t *req)
         ESP_LOGW(TAG, "No Authorization header provided");
     }
 
-    // Read request body - use smaller buffer and allocate larger if needed
-    char content[384];  // Reduced from 512 to save stack
-    int ret = httpd_req_recv(req, content, sizeof(content) - 1);
-    if (ret <= 0) {
-        const char *error_response = "{\"error\":\"invalid_request\"}";
-        httpd_resp_set_status(req, "400 Bad Request");
-        httpd_resp_set_type(req, "application/json");
-        log_outgoing_response("POST", req->uri, 400, error_response);
-        httpd_resp_sendstr(req, error_response);
-        return ESP_FAIL;
+    esp_err_t err = provision_read_body(req);
+    if (err == ESP_ERR_INVALID_SIZE && s_prov_too_long < 0) {
+        return provision_send_error(req, "413 Payload Too Large", 413, PROV_ERR_BODY_TOO_LARGE);
     }
-    content[ret] = '\0';
-    
-    // Log request body (already logged in log_incoming_request, but add here too for clarity)
-    ESP_LOGI(TAG, "Request Body: %s", content);
-
-    // Parse JSON
-    cJSON *root = cJSON_Parse(content);
-    if (root == NULL) {
+    if (err == ESP_ERR_INVALID_SIZE) {
+        ESP_LOGE(TAG, "Field too long: %s", s_prov_paths[s_prov_too_long]);
+        return provision_send_error(req, "400 Bad Request", 400, PROV_ERR_FIELD_TOO_LONG);
+    }
+    if (err == ESP_ERR_INVALID_RESPONSE) {
         ESP_LOGE(TAG, "Failed to parse JSON");
-        const char *error_response = "{\"error\":\"invalid_json\"}";
-        httpd_resp_set_status(req, "400 Bad Request");
-        httpd_resp_set_type(req, "application/json");
-        log_outgoing_response("POST", req->uri, 400, error_response);
-        httpd_resp_sendstr(req, error_response);
-        return ESP_FAIL;
+        return provision_send_error(req, "400 Bad Request", 400, PROV_ERR_INVALID_JSON);
+    }
+    if (err != ESP_OK) {
+        return provision_send_error(req, "400 Bad Request", 400, PROV_ERR_INVALID_REQUEST);
     }
 
-    cJSON *ssid_json = cJSON_GetObjectItem(root, "ssid");
-    cJSON *password_json = cJSON_GetObjectItem(root, "password");
-    cJSON *device_id_json = cJSON_GetObjectItem(root, "device_id");
-    cJSON *token_json = cJSON_GetObjectItem(root, "provisioning_token");
-
-    // Check which fields are missing and build detailed error response
-    cJSON *error_obj = NULL;
-    cJSON *missing_array = NULL;
-    bool has_error = false;
-    
-    // Check each required field
-    if (!cJSON_IsString(ssid_json)) {
-        if (error_obj == NULL) {
-            error_obj = cJSON_CreateObject();
-            cJSON_AddStringToObject(error_obj, "error", "missing_fields");
-            cJSON_AddStringToObject(error_obj, "message", "One or more required fields are missing");
-            missing_array = cJSON_CreateArray();
-            cJSON_AddItemToObject(error_obj, "missing_fields", missing_array);
-        }
-        cJSON_AddItemToArray(missing_array, cJSON_CreateString("ssid"));
-        has_error = true;
-        ESP_LOGE(TAG, "Missing required field: ssid");
+    // Without a top-level pair the first listed network is the primary
+    bool primary_listed = !s_ctx->values[PROV_SSID].complete && !s_ctx->values[PROV_PASSWORD].complete &&
+                          s_ctx->values[PROV_LIST].complete;
+    if (primary_listed) {
+        strlcpy(s_ctx->ssid, s_ctx->wifi_list[1].ssid, sizeof(s_ctx->ssid));
+        strlcpy(s_ctx->password, s_ctx->wifi_list[1].password, sizeof(s_ctx->password));
+        s_ctx->values[PROV_SSID].complete = true;
+        s_ctx->values[PROV_PASSWORD].complete = true;
+        s_ctx->values[PROV_LIST].complete = false;
     }
-    
-    if (!cJSON_IsString(password_json)) {
-        if (error_obj == NULL) {
-            error_obj = cJSON_CreateObject();
-            cJSON_AddStringToObject(error_obj, "error", "missing_fields");
-            cJSON_AddStringToObject(error_obj, "message", "One or more required fields are missing");
-            missing_array = cJSON_CreateArray();
-            cJSON_AddItemToObject(error_obj, "missing_fields", missing_array);
-        }
-        cJSON_AddItemToArray(missing_array, cJSON_CreateString("password"));
-        has_error = true;
-        ESP_LOGE(TAG, "Missing required field: password");
+
+    // The primary and the list together are at most WIFI_NETWORKS_MAX:
+    // refused rather than saving some and dropping the rest
+    if (s_ctx->values[PROV_LIST_OVER].len > 0 || s_ctx->values[PROV_LIST_OVER].complete ||
+        (!primary_listed && s_ctx->values[PROV_LIST + 2 * (WIFI_NETWORKS_MAX - 1)].complete)) {
+        ESP_LOGE(TAG, "More than %d networks", WIFI_NETWORKS_MAX);
+        return provision_send_error(req, "400 Bad Request", 400, PROV_ERR_TOO_MANY_NETWORKS);
     }
-    
-    if (!cJSON_IsString(device_id_json)) {
-        if (error_obj == NULL) {
-            error_obj = cJSON_CreateObject();
-            cJSON_AddStringToObject(error_obj, "error", "missing_fields");
-            cJSON_AddStringToObject(error_obj, "message", "One or more required fields are missing");
-            missing_array = cJSON_CreateArray();
-            cJSON_AddItemToObject(error_obj, "missing_fields", missing_array);
+
+    // Required fields missing or not strings: list them, in field order
+    size_t len = strlcpy(s_ctx->error, PROV_ERR_MISSING_HEAD, sizeof(s_ctx->error));
+    bool missing = false;
+    for (int i = 0; i < PROV_REQUIRED_COUNT; i++) {
+        if (s_ctx->values[i].complete) {
+            continue;
         }
-        cJSON_AddItemToArray(missing_array, cJSON_CreateString("device_id"));
-        has_error = true;
-        ESP_LOGE(TAG, "Missing required field: device_id");
+        ESP_LOGE(TAG, "Missing required field: %s", s_prov_paths[i]);
+        len += snprintf(s_ctx->error + len, sizeof(s_ctx->error) - len, "%s\"%s\"",
+                        missing ? "," : "", s_prov_paths[i]);
+        missing = true;
     }
-    
-    if (!cJSON_IsString(token_json)) {
-        if (error_obj == NULL) {
-            error_obj = cJSON_CreateObject();
-            cJSON_AddStringToObject(error_obj, "error", "missing_fields");
-            cJSON_AddStringToObject(error_obj, "message", "One or more required fields are missing");
-            missing_array = cJSON_CreateArray();
-            cJSON_AddItemToObject(error_obj, "missing_fields", missing_array);
-        }
-        cJSON_AddItemToArray(missing_array, cJSON_CreateString("provisioning_token"));
-        has_error = true;
-        ESP_LOGE(TAG, "Missing required field: provisioning_token");
+    if (missing) {
+        strlcat(s_ctx->error, "]}", sizeof(s_ctx->error));
+        return provision_send_error(req, "400 Bad Request", 400, s_ctx->error);
     }
-    
-    if (has_error) {
-        char *error_json = cJSON_Print(error_obj);
-        if (error_json) {
-            ESP_LOGE(TAG, "Missing required fields response: %s", error_json);
-            cJSON_Delete(root);
-            cJSON_Delete(error_obj);
-            httpd_resp_set_status(req, "400 Bad Request");
-            httpd_resp_set_type(req, "application/json");
-            log_outgoing_response("POST", req->uri, 400, error_json);
-            httpd_resp_sendstr(req, error_json);
-            free(error_json);
-            return ESP_FAIL;
+
+    const char *ssid = s_ctx->ssid;
+    const char *password = s_ctx->password;
+    const char *device_id = s_ctx->device_id;
+    const char *prov_token = s_ctx->token;
+
+    ESP_LOGI(TAG, "Received credentials - SSID: %s, Device ID: %s", ssid, device_id);
+
+    // Entries without a complete SSID are left empty and skipped on save
+    wifi_network_cred_t *nets = s_ctx->wifi_list;
+    nets[0] = (wifi_network_cred_t){0};
+    strlcpy(nets[0].ssid, ssid, sizeof(nets[0].ssid));
+    strlcpy(nets[0].password, password, sizeof(nets[0].password));
+    for (int i = 0; i < WIFI_NETWORKS_MAX; i++) {
+        if (!s_ctx->values[PROV_LIST + 2 * i].complete) {
+            nets[1 + i].ssid[0] = '\0';
         } else {
-            ESP_LOGE(TAG, "Failed to create error JSON response");
-            cJSON_Delete(root);
-            cJSON_Delete(error_obj);
-            const char *fallback_error = "{\"error\":\"missing_fields\",\"message\":\"Failed to generate detailed error\"}";
-            httpd_resp_set_status(req, "400 Bad Request");
-            httpd_resp_set_type(req, "application/json");
-            log_outgoing_response("POST", req->uri, 400, fallback_error);
-            httpd_resp_sendstr(req, fallback_error);
-            return ESP_FAIL;
+            ESP_LOGI(TAG, "Additional network: %s", nets[1 + i].ssid);
         }
     }
 
-    const char *ssid = ssid_json->valuestring;
-    const char *password = password_json->valuestring;
-    const char *device_id = device_id_json->valuestring;
-    const char *prov_token = token_json->valuestring;
-
-    ESP_LOGI(TAG, "Received credentials - SSID: %s, Device ID: %s", ssid, device_id);
+    sta_ip_static_t static_ip;
+    if (sta_ip_parse(PROV_NET(PROV_NET_IP), PROV_NET(PROV_NET_NETMASK), PROV_NET(PROV_NET_GATEWAY),
+                     PROV_NET(PROV_NET_DNS), &static_ip) != ESP_OK) {
+        ESP_LOGE(TAG, "Invalid static network settings");
+        return provision_send_error(req, "400 Bad Request", 400, PROV_ERR_INVALID_NETWORK);
+    }
+    if (static_ip.ip != 0) {
+        ESP_LOGI(TAG, "Static IP requested: %s", PROV_NET(PROV_NET_IP));
+    }
 
+    if (xSemaphoreTake(s_commit_lock, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Credentials already being applied");
+        return provision_send_error(req, "503 Service Unavailable", 503, PROV_ERR_BUSY);
+    }
     // Save credentials to NVS (including Bearer token from Authorization header)
-    esp_err_t err = save_wifi_credentials(ssid, password, device_id, prov_token, bearer_token);
+    err = provision_commit(ssid, password, nets, 1 + WIFI_NETWORKS_MAX, device_id, prov_token, bearer_token,
+                           &static_ip);
+    xSemaphoreGive(s_commit_lock);
+    if (err == ESP_FAIL) {
+        return provision_send_error(req, "422 Unprocessable Entity", 422, s_ctx->error);
+    }
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to save credentials: %s", esp_err_to_name(err));
-        cJSON_Delete(root);
-        const char *error_response = "{\"error\":\"save_failed\"}";
-        httpd_resp_set_status(req, "500 Internal Server Error");
-        httpd_resp_set_type(req, "application/json");
-        log_outgoing_response("POST", req->uri, 500, error_response);
-        httpd_resp_sendstr(req, error_response);
-        return ESP_FAIL;
+        return provision_send_error(req, "500 Internal Server Error", 500, PROV_ERR_SAVE_FAILED);
     }
 
-    cJSON_Delete(root);
-
     // Send success response first
-    const char *success_response = "{\"status\":\"ok\",\"message\":\"Credentials saved\"}";
     httpd_resp_set_type(req, "application/json");
-    log_outgoing_response("POST", req->uri, 200, success_response);
-    httpd_resp_sendstr(req, success_response);
+    log_outgoing_response("POST", req->uri, 200, PROV_OK);
+    httpd_resp_sendstr(req, PROV_OK);
+    return ESP_OK;
+}
 
+/**
+ * @brief Leave provisioning after a successful /provision
+ *
+ * Runs after the response is sent and the request is released, since it
+ * stops the HTTP server.
+ */
+static void provision_finish(void)
+{
     // Stop provisioning (this stops HTTP server and marks provisioning as inactive)
-    // Do this after sending response but before returning
     ESP_LOGI(TAG, "Stopping provisioning and preparing for WiFi connection...");
     wifi_provisioning_stop();
 
-    // Note: WiFi connection will be handled by the state machine in main.c
-    // which checks wifi_provisioning_is_provisioned() and transitions to WIFI_CONNECTING
-    // The state machine will then call wifi_provisioning_connect_to_wifi()
+    // Wake the state machine in main.c, which transitions to WIFI_CONNECTING
+    app_events_post(APP_EVENT_PROVISIONED);
     
     ESP_LOGI(TAG, "Credentials saved. State machine will handle WiFi connection.");
+}
 
-    return ESP_OK;
+#if CONFIG_APP_HTTPD_ASYNC_PROVISION
+/**
+ * @brief Worker for /provision
+ *
+ * The body receive and the NVS commit run here, so a slow or stalled
+ * installer does not hold up /status and /local-wifi for other clients.
+ * One worker also keeps the request buffers of s_ctx single-owner. It
+ * exits, deleting its queue, on NULL or once provision_finish() has
+ * ended the session.
+ */
+static void provision_worker(void *arg)
+{
+    QueueHandle_t queue = arg;
+    httpd_req_t *req = NULL;
+
+    while (xQueueReceive(queue, &req, portMAX_DELAY) == pdTRUE && req != NULL) {
+        esp_err_t err = provision_process(req);
+        httpd_req_async_handler_complete(req);
+        if (err == ESP_OK) {
+            provision_finish();
+        }
+        if (s_prov_queue != queue) {
+            break;
+        }
+    }
+    vQueueDelete(queue);
+    s_prov_worker = NULL;
+    xSemaphoreGive(s_prov_worker_done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief End the worker, after the request it is on
+ */
+static void provision_worker_stop(void)
+{
+    QueueHandle_t queue = s_prov_queue;
+    if (queue == NULL) {
+        return;
+    }
+    s_prov_queue = NULL;
+    if (xTaskGetCurrentTaskHandle() == s_prov_worker) {
+        return;     // Called from provision_finish(): the worker leaves when back in its loop
+    }
+    httpd_req_t *none = NULL;
+    xQueueSend(queue, &none, portMAX_DELAY);
+    xSemaphoreTake(s_prov_worker_done, portMAX_DELAY);
+    s_prov_worker_unjoined = false;
+}
+
+/**
+ * @brief Wait for a worker that ended its own session to be gone
+ *
+ * Its give would otherwise be taken by the next session's stop, before
+ * that session's worker has exited.
+ */
+static void provision_worker_join(void)
+{
+    if (s_prov_worker_unjoined) {
+        xSemaphoreTake(s_prov_worker_done, portMAX_DELAY);
+        s_prov_worker_unjoined = false;
+    }
+}
+#endif
+
+/**
+ * @brief HTTP POST handler for /provision endpoint
+ *
+ * With CONFIG_APP_HTTPD_ASYNC_PROVISION the request is handed to the
+ * worker and the server task returns to other clients at once.
+ */
+static esp_err_t provision_handler(httpd_req_t *req)
+{
+#if CONFIG_APP_HTTPD_ASYNC_PROVISION
+    httpd_req_t *async_req = NULL;
+    if (s_prov_queue != NULL && httpd_req_async_handler_begin(req, &async_req) == ESP_OK) {
+        if (xQueueSend(s_prov_queue, &async_req, 0) == pdTRUE) {
+            return ESP_OK;
+        }
+        // The connection now belongs to async_req: answer on it before letting it go
+        ESP_LOGW(TAG, "Provisioning worker busy");
+        esp_err_t err = provision_send_error(async_req, "503 Service Unavailable", 503, PROV_ERR_BUSY);
+        httpd_req_async_handler_complete(async_req);
+        return err;
+    }
+#endif
+    esp_err_t err = provision_process(req);
+    if (err == ESP_OK) {
+        provision_finish();
+    }
+    return err;
 }
 
 /**
  * @brief HTTP GET handler for /status endpoint
+ *
+ * The body is rendered once per state change and carries an ETag, so a
+ * polling app mostly gets 304s.
  */
 static esp_err_t status_handler(httpd_req_t *req)
 {
+#if CONFIG_APP_DIAG_VERBOSE
     ESP_LOGI(TAG, "[STATUS_HANDLER] Request received for URI: %s", req->uri);
+#endif
     // Log incoming request
     log_incoming_request(req);
     
-    cJSON *root = cJSON_CreateObject();
-
-    if (s_wifi_connected) {
-        cJSON_AddStringToObject(root, "status", "connected");
-        cJSON_AddStringToObject(root, "ip", s_sta_ip);
-    } else if (s_provisioning_active) {
-        cJSON_AddStringToObject(root, "status", "provisioning");
-        cJSON_AddStringToObject(root, "ip", "192.168.4.1");
-    } else {
-        cJSON_AddStringToObject(root, "status", "disconnected");
+    // The STA side bumps its own counter; the sum changes with either
+    uint32_t gen = s_status_gen + wifi_conn_generation();
+    char sta_ip[16];
+    if (gen != s_status_rendered) {
+        if (wifi_conn_get_ip(sta_ip, sizeof(sta_ip))) {
+            snprintf(s_status_body, sizeof(s_status_body), "{\"status\":\"connected\",\"ip\":\"%s\"}", sta_ip);
+#if CONFIG_APP_PROV_WIFI_TEST
+        } else if (s_provisioning_active && s_prov_last_error != NULL) {
+            snprintf(s_status_body, sizeof(s_status_body),
+                     "{\"status\":\"provisioning\",\"ip\":\"192.168.4.1\",\"last_error\":\"%s\"}",
+                     s_prov_last_error);
+#endif
+        } else if (s_provisioning_active) {
+            strlcpy(s_status_body, "{\"status\":\"provisioning\",\"ip\":\"192.168.4.1\"}", sizeof(s_status_body));
+        } else {
+            strlcpy(s_status_body, "{\"status\":\"disconnected\"}", sizeof(s_status_body));
+        }
+        if (s_status_boot_id == 0) {
+            s_status_boot_id = esp_random();
+        }
+        snprintf(s_status_etag, sizeof(s_status_etag), "\"%08lx-%lu\"",
+                 (unsigned long)s_status_boot_id, (unsigned long)gen);
+        s_status_rendered = gen;
+    }
+
+    // Pollers send the last ETag back and get an empty 304 until the state changes
+    httpd_resp_set_hdr(req, "ETag", s_status_etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    char if_none_match[sizeof(s_status_etag)];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+            strcmp(if_none_match, s_status_etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        log_outgoing_response("GET", req->uri, 304, NULL);
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
     }
 
-    char *json_string = cJSON_Print(root);
     httpd_resp_set_type(req, "application/json");
     
     // Log outgoing response
-    log_outgoing_response("GET", req->uri, 200, json_string);
+    log_outgoing_response("GET", req->uri, 200, s_status_body);
     
-    httpd_resp_sendstr(req, json_string);
+    httpd_resp_sendstr(req, s_status_body);
+
+    return ESP_OK;
+}
 
-    free(json_string);
-    cJSON_Delete(root);
+#if CONFIG_APP_DIAG_RING_SIZE > 0
+/**
+ * @brief HTTP GET handler for /diag endpoint
+ *
+ * Returns the diagnostic ring as plain text, oldest record first.
+ */
+static esp_err_t diag_handler(httpd_req_t *req)
+{
+    char *buf = malloc(CONFIG_APP_DIAG_RING_SIZE + 1);
+    if (buf == NULL) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
 
+    size_t len = diag_log_read(buf, CONFIG_APP_DIAG_RING_SIZE + 1);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, buf, len);
+    free(buf);
+    return ESP_OK;
+}
+#endif
+
+#if CONFIG_APP_LOG_RING_SIZE > 0
+/**
+ * @brief HTTP GET handler for /logs endpoint
+ *
+ * Streams the retained console lines as plain text, oldest first, one
+ * chunk per line.
+ */
+static esp_err_t logs_handler(httpd_req_t *req)
+{
+    char line[LOG_DEFER_LINE_MAX];
+    uint32_t seq = 0;
+
+    httpd_resp_set_type(req, "text/plain");
+    while (log_defer_next(&seq, line, sizeof(line))) {
+        if (httpd_resp_sendstr_chunk(req, line) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+#endif
+
+/**
+ * @brief HTTP GET handler for /metrics endpoint
+ *
+ * Returns state timings, boot timeline, MQTT counters and memory
+ * watermarks as JSON.
+ */
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+    size_t len = metrics_to_json(s_ctx->json_scratch, sizeof(s_ctx->json_scratch));
+    if (len == 0) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, s_ctx->json_scratch, len);
     return ESP_OK;
 }
 
@@ -673,46 +1502,9 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                          MAC2STR(event->mac), event->aid, event->reason);
             }
             break;
-        case WIFI_EVENT_STA_START:
-            ESP_LOGI(TAG, "WiFi STA started");
-            break;
-        case WIFI_EVENT_STA_CONNECTED:
-            ESP_LOGI(TAG, "WiFi STA connected");
-            break;
-        case WIFI_EVENT_STA_DISCONNECTED:
-            {
-                wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
-                ESP_LOGI(TAG, "WiFi STA disconnected, reason: %d", event->reason);
-                s_wifi_connected = false;
-                memset(s_sta_ip, 0, sizeof(s_sta_ip));
-                
-                // Check for authentication failures
-                // Common auth failure reason codes:
-                // 15 = WIFI_REASON_AUTH_FAIL
-                // 201 = WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT
-                // 202 = WIFI_REASON_GROUP_KEY_UPDATE_TIMEOUT
-                // 203 = WIFI_REASON_IE_IN_4WAY_DIFFERS
-                // 204 = WIFI_REASON_GROUP_CIPHER_INVALID
-                // 205 = WIFI_REASON_PAIRWISE_CIPHER_INVALID
-                // 206 = WIFI_REASON_AKMP_INVALID
-                // 207 = WIFI_REASON_UNSUPP_RSN_IE_VERSION
-                // 208 = WIFI_REASON_INVALID_RSN_IE_CAP
-                // 209 = WIFI_REASON_802_1X_AUTH_FAILED
-                if (event->reason == 15 || (event->reason >= 201 && event->reason <= 209)) {
-                    ESP_LOGE(TAG, "========================================");
-                    ESP_LOGE(TAG, "✗ WiFi Authentication Failed!");
-                    ESP_LOGE(TAG, "✗ Reason Code: %d", event->reason);
-                    ESP_LOGE(TAG, "✗ Incorrect WiFi credentials provided");
-                    ESP_LOGE(TAG, "========================================");
-                    ESP_LOGI(TAG, "Clearing invalid credentials...");
-                    ESP_LOGI(TAG, "Returning to AP mode...");
-                    ESP_LOGI(TAG, "Please send new credentials via HTTP POST /provision");
-                    
-                    // Clear credentials and return to AP mode
-                    wifi_provisioning_clear_and_restart();
-                } else {
-                    ESP_LOGW(TAG, "WiFi disconnected (reason: %d) - may retry", event->reason);
-                }
+        case WIFI_EVENT_SCAN_DONE:
+            if (s_scan_in_progress) {
+                scan_pass_done((wifi_event_sta_scan_done_t *) event_data);
             }
             break;
         default:
@@ -735,20 +1527,30 @@ static void ip_event_handler(void* arg, esp_event_base_t event_base,
                 ESP_LOGI(TAG, "AP assigned IP " IPSTR " to station", IP2STR(&event->ip));
             }
             break;
-        case IP_EVENT_STA_GOT_IP:
-            {
-                ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-                snprintf(s_sta_ip, sizeof(s_sta_ip), IPSTR, IP2STR(&event->ip_info.ip));
-                ESP_LOGI(TAG, "Got IP: %s", s_sta_ip);
-                s_wifi_connected = true;
-            }
-            break;
         default:
             break;
         }
     }
 }
 
+#if CONFIG_APP_TRACE_MARKERS
+/**
+ * @brief Run the handler kept in user_ctx inside a TRACE_ID_HTTP span
+ */
+static esp_err_t traced_handler(httpd_req_t *req)
+{
+    esp_err_t (*handler)(httpd_req_t *) = (esp_err_t (*)(httpd_req_t *))req->user_ctx;
+    TRACE_SPAN_BEGIN(TRACE_ID_HTTP);
+    TRACE_PRINT(req->uri);
+    esp_err_t err = handler(req);
+    TRACE_SPAN_END(TRACE_ID_HTTP);
+    return err;
+}
+#define URI_HANDLER(fn) .handler = traced_handler, .user_ctx = (void *)(fn)
+#else
+#define URI_HANDLER(fn) .handler = (fn)
+#endif
+
 /**
  * @brief Start HTTP server
  */
@@ -758,39 +1560,85 @@ static httpd_handle_t start_http_server(void)
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.server_port = 80;
     config.lru_purge_enable = true;
+    config.core_id = CONFIG_APP_HTTPD_CORE < 0 ? tskNO_AFFINITY : CONFIG_APP_HTTPD_CORE;
     
-    // Increase timeouts for long-running operations like WiFi scan (15-20 seconds)
-    config.recv_wait_timeout = 30;  // 30 seconds receive timeout
-    config.send_wait_timeout = 30;  // 30 seconds send timeout
+    // Scans run in the background and /provision on its worker, so no
+    // handler needs long timeouts; a slow client is cut off quickly
+    config.recv_wait_timeout = CONFIG_APP_HTTPD_TIMEOUT_S;
+    config.send_wait_timeout = CONFIG_APP_HTTPD_TIMEOUT_S;
     
-    // Increase stack size to prevent stack overflow in handlers (default is often 4096)
-    config.stack_size = 8192;  // 8KB stack for HTTP server task
+    // The default 4096 is too small for the handlers; see APP_STACK_PROFILE
+    config.stack_size = CONFIG_APP_HTTPD_STACK;
 
     ESP_LOGI(TAG, "Starting HTTP server on port %d (stack: %d bytes)", config.server_port, config.stack_size);
 
+#if CONFIG_APP_HTTPD_ASYNC_PROVISION
+    // One worker per session; its stack is returned by wifi_provisioning_stop()
+    if (s_prov_queue == NULL && s_prov_worker_done != NULL) {
+        QueueHandle_t queue = xQueueCreate(PROVISION_QUEUE_LEN, sizeof(httpd_req_t *));
+        if (queue != NULL &&
+                xTaskCreate(provision_worker, "prov_worker", CONFIG_APP_PROV_WORKER_STACK, queue, config.task_priority,
+                            &s_prov_worker) == pdPASS) {
+            s_prov_queue = queue;
+            s_prov_worker_unjoined = true;
+        } else {
+            // /provision then runs on the server task
+            ESP_LOGW(TAG, "No provisioning worker, handling /provision inline");
+            if (queue != NULL) {
+                vQueueDelete(queue);
+            }
+        }
+    }
+#endif
+
     if (httpd_start(&server, &config) == ESP_OK) {
         // Register URI handlers
         httpd_uri_t scan_uri = {
             .uri = "/local-wifi",
             .method = HTTP_GET,
-            .handler = scan_handler,
+            URI_HANDLER(scan_handler),
         };
         httpd_register_uri_handler(server, &scan_uri);
 
         httpd_uri_t provision_uri = {
             .uri = "/provision",
             .method = HTTP_POST,
-            .handler = provision_handler,
+            URI_HANDLER(provision_handler),
         };
         httpd_register_uri_handler(server, &provision_uri);
 
         httpd_uri_t status_uri = {
             .uri = "/status",
             .method = HTTP_GET,
-            .handler = status_handler,
+            URI_HANDLER(status_handler),
         };
         httpd_register_uri_handler(server, &status_uri);
 
+#if CONFIG_APP_DIAG_RING_SIZE > 0
+        httpd_uri_t diag_uri = {
+            .uri = "/diag",
+            .method = HTTP_GET,
+            URI_HANDLER(diag_handler),
+        };
+        httpd_register_uri_handler(server, &diag_uri);
+#endif
+
+#if CONFIG_APP_LOG_RING_SIZE > 0
+        httpd_uri_t logs_uri = {
+            .uri = "/logs",
+            .method = HTTP_GET,
+            URI_HANDLER(logs_handler),
+        };
+        httpd_register_uri_handler(server, &logs_uri);
+#endif
+
+        httpd_uri_t metrics_uri = {
+            .uri = "/metrics",
+            .method = HTTP_GET,
+            URI_HANDLER(metrics_handler),
+        };
+        httpd_register_uri_handler(server, &metrics_uri);
+
         ESP_LOGI(TAG, "HTTP server started");
         return server;
     }
@@ -804,23 +1652,26 @@ static httpd_handle_t start_http_server(void)
  */
 static esp_err_t wifi_init_ap(void)
 {
-    // Create default WiFi AP netif
-    esp_netif_create_default_wifi_ap();
-
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-    // Register event handlers
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &wifi_event_handler,
-                                                        NULL,
-                                                        NULL));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &ip_event_handler,
-                                                        NULL,
-                                                        NULL));
+    // The driver is initialised by wifi_conn_init(); the AP interface
+    // outlives a provisioning session, so it is created once. The handlers
+    // are the session's and go with wifi_provisioning_stop().
+    static bool ap_ready = false;
+    if (!ap_ready) {
+        esp_netif_create_default_wifi_ap();
+        ap_ready = true;
+    }
+    if (s_wifi_handler == NULL) {
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                            ESP_EVENT_ANY_ID,
+                                                            &wifi_event_handler,
+                                                            NULL,
+                                                            &s_wifi_handler));
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                            ESP_EVENT_ANY_ID,
+                                                            &ip_event_handler,
+                                                            NULL,
+                                                            &s_ip_handler));
+    }
 
     // Configure AP
     wifi_config_t wifi_config = {
@@ -839,7 +1690,9 @@ static esp_err_t wifi_init_ap(void)
     }
 
     // Start in APSTA mode so we can scan without stopping WiFi
-    // This prevents connection resets when /local-wifi endpoint is called
+    // This prevents connection resets when /local-wifi endpoint is called.
+    // After a station session the driver is still running and the mode
+    // switch alone brings the AP up; esp_wifi_start() is then a no-op
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
@@ -848,6 +1701,34 @@ static esp_err_t wifi_init_ap(void)
     return ESP_OK;
 }
 
+/**
+ * @brief Return what a session holds: handlers, cache lock and buffers
+ *
+ * Call with the HTTP server and the worker gone. Unregistering waits for
+ * a handler the event task is running, so no scan pass can still write
+ * to the buffers. The scan itself survives in RTC memory.
+ */
+static void provision_release(void)
+{
+    if (s_wifi_handler != NULL) {
+        esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, s_wifi_handler);
+        esp_event_handler_instance_unregister(IP_EVENT, ESP_EVENT_ANY_ID, s_ip_handler);
+        s_wifi_handler = NULL;
+        s_ip_handler = NULL;
+    }
+    if (s_cache_mutex != NULL) {
+        vSemaphoreDelete(s_cache_mutex);
+        s_cache_mutex = NULL;
+    }
+    s_cached_networks = NULL;
+    s_cached_network_count = 0;
+    s_scan_body = NULL;
+    s_scan_body_len = 0;
+    s_initial_scan_done = false;
+    heap_caps_free(s_ctx);
+    s_ctx = NULL;
+}
+
 // Public API implementation
 
 esp_err_t wifi_provisioning_start(void)
@@ -873,33 +1754,62 @@ esp_err_t wifi_provisioning_start(void)
         return ret;
     }
 
+    if (s_commit_lock == NULL) {
+        s_commit_lock = xSemaphoreCreateMutex();
+        if (s_commit_lock == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+#if CONFIG_APP_HTTPD_ASYNC_PROVISION
+    if (s_prov_worker_done == NULL) {
+        s_prov_worker_done = xSemaphoreCreateBinary();
+    }
+    provision_worker_join();
+#endif
+
+    // Session buffers, returned to the heap when provisioning ends
+    s_ctx = heap_caps_calloc(1, sizeof(prov_ctx_t), PROV_CTX_CAPS);
+    s_cache_mutex = xSemaphoreCreateMutex();
+    if (s_ctx == NULL || s_cache_mutex == NULL) {
+        ESP_LOGE(TAG, "No memory for the provisioning session (%u bytes)", (unsigned)sizeof(prov_ctx_t));
+        provision_release();
+        return ESP_ERR_NO_MEM;
+    }
+
     // Initialize WiFi AP
     ret = wifi_init_ap();
     if (ret != ESP_OK) {
+        provision_release();
         return ret;
     }
 
-    // Perform initial WiFi scan BEFORE starting HTTP server
-    // This ensures cache is populated before any client connects
-    ESP_LOGI(TAG, "Performing initial WiFi scan (before clients connect)...");
-    esp_err_t scan_ret = perform_wifi_scan_and_cache();
-    if (scan_ret != ESP_OK) {
-        ESP_LOGW(TAG, "Initial scan failed, will retry on first /local-wifi request");
-    }
+    // Serve the last scan right away and refresh it in the background
+    scan_cache_restore();
 
-    // Start HTTP server (clients can now connect with stable AP)
     s_httpd = start_http_server();
     if (s_httpd == NULL) {
-        esp_wifi_stop();
+        // Take the AP down again but keep the driver for the retry
+        esp_wifi_set_mode(WIFI_MODE_STA);
+#if CONFIG_APP_HTTPD_ASYNC_PROVISION
+        provision_worker_stop();
+#endif
+        provision_release();
         return ESP_FAIL;
     }
 
+    if (perform_wifi_scan_and_cache() != ESP_OK) {
+        ESP_LOGW(TAG, "Initial scan failed, will retry on first /local-wifi request");
+    }
+
     s_provisioning_active = true;
+#if CONFIG_APP_PROV_WIFI_TEST
+    s_prov_last_error = NULL;
+#endif
+    s_status_gen++;
     ESP_LOGI(TAG, "========================================");
     ESP_LOGI(TAG, "WiFi provisioning started successfully");
-    ESP_LOGI(TAG, "AP is stable - no background scanning");
     ESP_LOGI(TAG, "/local-wifi returns cached results instantly");
-    ESP_LOGI(TAG, "Use /local-wifi?refresh=true to rescan");
+    ESP_LOGI(TAG, "Use /local-wifi?refresh=true to rescan in the background");
     ESP_LOGI(TAG, "========================================");
     return ESP_OK;
 }
@@ -912,43 +1822,67 @@ esp_err_t wifi_provisioning_stop(void)
 
     ESP_LOGI(TAG, "Stopping WiFi provisioning");
 
+#if CONFIG_APP_HTTPD_ASYNC_PROVISION
+    // Lets a request the worker is on finish while the server is still up
+    provision_worker_stop();
+#endif
+
     // Stop HTTP server
     if (s_httpd) {
         httpd_stop(s_httpd);
         s_httpd = NULL;
     }
 
-    // Reset scan cache state
-    s_initial_scan_done = false;
-    s_cached_network_count = 0;
+    // The STA connect that follows cannot run alongside a scan
+    if (s_scan_in_progress) {
+        esp_wifi_scan_stop();
+        s_scan_in_progress = false;
+    }
 
+    // The scan cache stays in RTC memory: a later AP start serves it while it is recent.
+    // A wifi_provisioning_submit() still in its commit keeps the buffers until done.
+    xSemaphoreTake(s_commit_lock, portMAX_DELAY);
+    provision_release();
     s_provisioning_active = false;
+    xSemaphoreGive(s_commit_lock);
+    s_status_gen++;
     return ESP_OK;
 }
 
-bool wifi_provisioning_is_provisioned(void)
+esp_err_t wifi_provisioning_submit(const char *ssid, const char *password, const char *device_id,
+                                   const char *prov_token, const char *bearer_token)
 {
-    nvs_handle_t nvs_handle;
-    uint8_t provisioned = 0;
-
-    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
-        return false;
+    if (s_commit_lock == NULL || xSemaphoreTake(s_commit_lock, 0) != pdTRUE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // Checked under the lock: wifi_provisioning_stop() frees s_ctx with it held
+    if (!s_provisioning_active || s_ctx == NULL) {
+        xSemaphoreGive(s_commit_lock);
+        return ESP_ERR_INVALID_STATE;
     }
+    ESP_LOGI(TAG, "Credentials submitted - SSID: %s, Device ID: %s", ssid, device_id);
+    esp_err_t err = provision_commit(ssid, password, NULL, 0, device_id, prov_token, bearer_token, NULL);
+    xSemaphoreGive(s_commit_lock);
+    if (err == ESP_OK) {
+        provision_finish();
+    }
+    return err;
+}
 
-    nvs_get_u8(nvs_handle, NVS_KEY_PROVISIONED, &provisioned);
-    nvs_close(nvs_handle);
+bool wifi_provisioning_is_provisioned(void)
+{
+    uint8_t provisioned = 0;
 
+    device_config_get_u8(NVS_KEY_PROVISIONED, &provisioned);
     return provisioned == 1;
 }
 
 bool wifi_provisioning_get_status(char *ip_addr, size_t ip_len)
 {
-    if (s_wifi_connected && ip_addr && ip_len > 0) {
-        strncpy(ip_addr, s_sta_ip, ip_len - 1);
-        ip_addr[ip_len - 1] = '\0';
-        return true;
+    if (ip_addr == NULL || ip_len == 0) {
+        return false;
     }
-    return false;
+    return wifi_conn_get_ip(ip_addr, ip_len);
 }
 
 esp_err_t wifi_provisioning_get_bearer_token(char *token, size_t token_len)
@@ -957,17 +1891,8 @@ esp_err_t wifi_provisioning_get_bearer_token(char *token, size_t token_len)
         return ESP_ERR_INVALID_ARG;
     }
 
-    nvs_handle_t nvs_handle;
     size_t required_size = token_len;
-
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
-        return err;
-    }
-
-    err = nvs_get_str(nvs_handle, NVS_KEY_BEARER_TOKEN, token, &required_size);
-    nvs_close(nvs_handle);
+    esp_err_t err = device_config_get_str(NVS_KEY_BEARER_TOKEN, token, &required_size);
 
     if (err == ESP_OK) {
         ESP_LOGI(TAG, "Bearer token retrieved from NVS (%d bytes)", required_size);
@@ -980,6 +1905,17 @@ esp_err_t wifi_provisioning_get_bearer_token(char *token, size_t token_len)
     return err;
 }
 
+bool wifi_provisioning_get_connect_hint(uint8_t bssid[6], uint8_t *channel)
+{
+    if (!s_hint_valid) {
+        return false;
+    }
+    memcpy(bssid, s_hint_bssid, sizeof(s_hint_bssid));
+    *channel = s_hint_channel;
+    s_hint_valid = false;
+    return true;
+}
+
 esp_err_t wifi_provisioning_clear_and_restart(void)
 {
     ESP_LOGI(TAG, "========================================");
@@ -987,46 +1923,32 @@ esp_err_t wifi_provisioning_clear_and_restart(void)
     ESP_LOGI(TAG, "Returning to AP mode for new credentials");
     ESP_LOGI(TAG, "========================================");
 
-    // Stop HTTP server if running
-    if (s_httpd) {
-        httpd_stop(s_httpd);
-        s_httpd = NULL;
-    }
-    
-    // Reset scan cache state
-    s_initial_scan_done = false;
-    s_cached_network_count = 0;
-    
-    // Reset provisioning active flag
-    s_provisioning_active = false;
-
-    // Clear all provisioning data from NVS
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    // End a session still running; the scan cache is kept for the restarted AP
+    wifi_provisioning_stop();
+    s_hint_valid = false;
+
+    // Clear the network credentials. The identity (device ID, tokens,
+    // certificates) stays, so the next network connects without a CSR.
+    ESP_LOGI(TAG, "Erasing WiFi credentials from NVS...");
+    device_config_begin();
+    // The flag goes first: a partial erase must not look provisioned
+    device_config_erase(NVS_KEY_PROVISIONED);
+    device_config_erase(NVS_KEY_WIFI_SSID);
+    device_config_erase(NVS_KEY_WIFI_PASS);
+    wifi_networks_erase();
+    sta_ip_save(NULL);
+    esp_err_t err = device_config_commit();
     if (err == ESP_OK) {
-        ESP_LOGI(TAG, "Erasing provisioning data from NVS...");
-        
-        nvs_erase_key(nvs_handle, NVS_KEY_PROVISIONED);
-        nvs_erase_key(nvs_handle, NVS_KEY_WIFI_SSID);
-        nvs_erase_key(nvs_handle, NVS_KEY_WIFI_PASS);
-        nvs_erase_key(nvs_handle, NVS_KEY_DEVICE_ID);
-        nvs_erase_key(nvs_handle, NVS_KEY_PROV_TOKEN);
-        nvs_erase_key(nvs_handle, NVS_KEY_BEARER_TOKEN);
-        
-        nvs_commit(nvs_handle);
-        nvs_close(nvs_handle);
-        ESP_LOGI(TAG, "✓ Provisioning data cleared");
+        ESP_LOGI(TAG, "✓ WiFi credentials cleared");
     } else {
-        ESP_LOGW(TAG, "Failed to open NVS for clearing: %s", esp_err_to_name(err));
+        ESP_LOGW(TAG, "Failed to clear provisioning data: %s", esp_err_to_name(err));
     }
+    app_events_post(APP_EVENT_PROVISIONING_RESET);
 
-    // Stop WiFi STA mode
-    esp_wifi_stop();
-    s_wifi_connected = false;
-    memset(s_sta_ip, 0, sizeof(s_sta_ip));
-    
-    // Restart provisioning AP
-    vTaskDelay(pdMS_TO_TICKS(1000)); // Give time for WiFi to stop
+    // Drop the station and bring the AP up on the running driver: a mode
+    // switch needs no stop/start cycle and nothing to wait for
+    wifi_conn_stop();
+    esp_wifi_disconnect();
     err = wifi_provisioning_start();
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to restart provisioning AP: %s", esp_err_to_name(err));
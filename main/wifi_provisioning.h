@@ -9,11 +9,16 @@
 
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Longest device ID and provisioning token /provision accepts (excluding NUL)
+#define PROVISION_DEVICE_ID_MAX  64
+#define PROVISION_TOKEN_MAX      1024
+
 /**
  * @brief Start WiFi provisioning in AP mode with HTTP server
  * 
@@ -22,19 +27,35 @@ extern "C" {
  * - POST /provision - Accepts WiFi credentials and provisioning token
  * - GET /status - Returns current provisioning status
  * 
- * @return ESP_OK on success
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the session buffers
+ *         cannot be allocated
  */
 esp_err_t wifi_provisioning_start(void);
 
 /**
  * @brief Stop WiFi provisioning and HTTP server
  * 
- * Stops the HTTP server and switches WiFi to STA mode.
+ * Stops the HTTP server and switches WiFi to STA mode. Frees the
+ * session's buffers, worker task and event handlers.
  * 
  * @return ESP_OK on success
  */
 esp_err_t wifi_provisioning_stop(void);
 
+/**
+ * @brief Provision from a source other than POST /provision (e.g. a relay)
+ *
+ * Runs the same checks, credential test and save as /provision and, on
+ * success, ends provisioning. The station uses DHCP. Blocks for up to the
+ * credential test timeout.
+ *
+ * @return ESP_OK once saved, ESP_FAIL if the network was rejected or the
+ *         test failed, ESP_ERR_INVALID_STATE when provisioning is not
+ *         active or another set is being applied, or an NVS error
+ */
+esp_err_t wifi_provisioning_submit(const char *ssid, const char *password, const char *device_id,
+                                   const char *prov_token, const char *bearer_token);
+
 /**
  * @brief Check if device is already provisioned
  * 
@@ -62,12 +83,27 @@ bool wifi_provisioning_get_status(char *ip_addr, size_t ip_len);
  */
 esp_err_t wifi_provisioning_get_bearer_token(char *token, size_t token_len);
 
+/**
+ * @brief Get where the just-provisioned network was seen during scanning
+ *
+ * The hint is taken from the /local-wifi scan cache when credentials are
+ * submitted and can be read once. Connecting with bssid and channel set
+ * skips the full channel scan.
+ *
+ * @param bssid Output: BSSID of the strongest AP with the provisioned SSID
+ * @param channel Output: primary channel of that AP
+ * @return true if a hint was available
+ */
+bool wifi_provisioning_get_connect_hint(uint8_t bssid[6], uint8_t *channel);
+
 /**
  * @brief Clear provisioning credentials and return to AP mode
  * 
  * Clears all stored WiFi credentials from NVS and restarts the provisioning AP.
  * This is called when WiFi connection fails or internet verification fails,
  * allowing the device to wait for new credentials via HTTP POST.
+ * The device ID, tokens and certificates are kept: once the new network
+ * is up the device connects to MQTT without another CSR.
  * 
  * @return ESP_OK on success
  */
@@ -0,0 +1,214 @@
+/* WiFi Roaming Implementation
+ *
+ * Everything runs in the default event loop task. The RSSI trigger fires
+ * once per arming; it is re-armed on every association and, while the
+ * station stays on a weak AP, after CONFIG_APP_WIFI_ROAM_COOLDOWN_S, so a
+ * device parked at the edge of coverage does not scan continuously. On
+ * an AP with BSS Transition Management the first attempt is a BTM query,
+ * answered by a request the supplicant acts on by itself; when that does
+ * not move the station, the next attempt scans.
+ */
+
+#include <string.h>
+#include "wifi_roam.h"
+#include "sdkconfig.h"
+
+#if CONFIG_APP_WIFI_ROAM
+
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#if CONFIG_ESP_WIFI_11KV_SUPPORT
+#include "esp_wnm.h"
+#endif
+
+static const char *TAG = "wifi_roam";
+
+#define SCAN_MAX_APS 8
+#define COOLDOWN_US ((uint64_t)CONFIG_APP_WIFI_ROAM_COOLDOWN_S * 1000000)
+
+static esp_timer_handle_t s_rearm_timer = NULL;
+static volatile bool s_roaming = false;     // Left the AP, not associated to the next one yet
+static bool s_connected = false;
+static bool s_scanning = false;
+static bool s_btm_tried = false;            // BTM query sent on the current AP
+static uint32_t s_roams = 0;
+
+void wifi_roam_configure(wifi_config_t *cfg)
+{
+    cfg->sta.rm_enabled = 1;
+    cfg->sta.btm_enabled = 1;
+#if CONFIG_ESP_WIFI_11R_SUPPORT
+    cfg->sta.ft_enabled = 1;
+#endif
+    if (!cfg->sta.bssid_set) {
+        cfg->sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        cfg->sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    }
+}
+
+bool wifi_roam_in_progress(void)
+{
+    return s_roaming;
+}
+
+static void arm(void)
+{
+    esp_err_t err = esp_wifi_set_rssi_threshold(CONFIG_APP_WIFI_ROAM_RSSI);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot arm RSSI trigger: %s", esp_err_to_name(err));
+    }
+}
+
+static void rearm_cb(void *arg)
+{
+    if (s_connected && !s_roaming) {
+        arm();
+    }
+}
+
+static void start_scan(void)
+{
+    wifi_config_t cfg;
+    if (esp_wifi_get_config(WIFI_IF_STA, &cfg) != ESP_OK) {
+        return;
+    }
+    const wifi_scan_config_t scan = {
+        .ssid = cfg.sta.ssid,
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+    };
+    esp_err_t err = esp_wifi_scan_start(&scan, false);
+    if (err == ESP_OK) {
+        s_scanning = true;
+    } else {
+        ESP_LOGW(TAG, "Roaming scan failed to start: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * @brief Reassociate to the strongest scanned BSS if it clearly beats the current one
+ */
+static void scan_done(void)
+{
+    s_scanning = false;
+    wifi_ap_record_t current;
+    wifi_ap_record_t aps[SCAN_MAX_APS];
+    uint16_t count = SCAN_MAX_APS;
+    if (esp_wifi_scan_get_ap_records(&count, aps) != ESP_OK || esp_wifi_sta_get_ap_info(&current) != ESP_OK) {
+        esp_wifi_clear_ap_list();
+        return;
+    }
+
+    const wifi_ap_record_t *best = NULL;
+    for (int i = 0; i < count; i++) {
+        if (memcmp(aps[i].bssid, current.bssid, sizeof(current.bssid)) != 0 &&
+            (best == NULL || aps[i].rssi > best->rssi)) {
+            best = &aps[i];
+        }
+    }
+    if (best == NULL || best->rssi < current.rssi + CONFIG_APP_WIFI_ROAM_GAIN_DB) {
+        ESP_LOGI(TAG, "No better AP (current %d dBm, best other %d dBm)",
+                 current.rssi, best ? best->rssi : -128);
+        return;
+    }
+
+    wifi_config_t cfg;
+    if (esp_wifi_get_config(WIFI_IF_STA, &cfg) != ESP_OK) {
+        return;
+    }
+    cfg.sta.bssid_set = true;
+    memcpy(cfg.sta.bssid, best->bssid, sizeof(cfg.sta.bssid));
+    cfg.sta.channel = best->primary;
+    ESP_LOGI(TAG, "Roaming from " MACSTR " (%d dBm) to " MACSTR " (%d dBm, channel %d)",
+             MAC2STR(current.bssid), current.rssi, MAC2STR(best->bssid), best->rssi, best->primary);
+    s_roaming = true;
+    if (esp_wifi_set_config(WIFI_IF_STA, &cfg) != ESP_OK || esp_wifi_connect() != ESP_OK) {
+        s_roaming = false;
+    }
+}
+
+static void rssi_low(int32_t rssi)
+{
+    ESP_LOGI(TAG, "Signal at %ld dBm, looking for a better AP", (long)rssi);
+    esp_timer_stop(s_rearm_timer);
+    esp_timer_start_once(s_rearm_timer, COOLDOWN_US);
+
+#if CONFIG_ESP_WIFI_11KV_SUPPORT
+    if (!s_btm_tried && esp_wnm_is_btm_supported_connection()) {
+        s_btm_tried = true;
+        if (esp_wnm_send_bss_transition_mgmt_query(REASON_RSSI, NULL, 0) == 0) {
+            return;
+        }
+    }
+#endif
+    if (!s_scanning) {
+        start_scan();
+    }
+}
+
+static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    switch (event_id) {
+    case WIFI_EVENT_STA_CONNECTED:
+        if (s_roaming) {
+            s_roams++;
+            ESP_LOGI(TAG, "Roam complete (%lu so far)", (unsigned long)s_roams);
+        }
+        s_roaming = false;
+        s_connected = true;
+        s_btm_tried = false;
+        arm();
+        break;
+
+    case WIFI_EVENT_STA_DISCONNECTED: {
+        const wifi_event_sta_disconnected_t *event = event_data;
+        bool was_roaming = s_roaming;
+        s_connected = false;
+        s_scanning = false;
+        esp_timer_stop(s_rearm_timer);
+        if (event->reason == WIFI_REASON_ROAMING) {
+            // Supplicant-driven move (BTM or our reassociation); the next CONNECTED ends it
+            s_roaming = true;
+        } else if (was_roaming) {
+            // wifi_conn drops the target BSSID and reconnects to any AP
+            ESP_LOGW(TAG, "Roam failed (reason %d)", event->reason);
+            s_roaming = false;
+        }
+        break;
+    }
+
+    case WIFI_EVENT_STA_BSS_RSSI_LOW:
+        if (s_connected && !s_roaming) {
+            rssi_low(((const wifi_event_bss_rssi_low_t *)event_data)->rssi);
+        }
+        break;
+
+    case WIFI_EVENT_SCAN_DONE:
+        if (s_scanning) {
+            scan_done();
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+esp_err_t wifi_roam_init(void)
+{
+    if (s_rearm_timer != NULL) {
+        return ESP_OK;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = rearm_cb,
+        .name = "wifi_roam",
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &s_rearm_timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL, NULL);
+}
+
+#endif // CONFIG_APP_WIFI_ROAM
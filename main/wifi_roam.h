@@ -0,0 +1,55 @@
+/* WiFi Roaming Header
+ *
+ * Moves the station to a stronger access point of the same SSID before
+ * the current one fades out. The driver raises WIFI_EVENT_STA_BSS_RSSI_LOW
+ * once the signal drops below CONFIG_APP_WIFI_ROAM_RSSI; the AP is then
+ * asked for a BSS transition (802.11v) when it supports it, and otherwise
+ * the channels are scanned for the SSID and the station reassociates to
+ * the best BSS that beats the current one by CONFIG_APP_WIFI_ROAM_GAIN_DB.
+ * 802.11k radio measurements and 802.11r fast transitions are enabled in
+ * the STA configuration, so APs that use them get a shorter handover.
+ *
+ * A failed reassociation is recovered by wifi_conn like any other
+ * disconnect. A roam keeps the IP address, so lwIP keeps the MQTT TCP connection and
+ * at most a few segments are retransmitted; the MQTT client is left
+ * running throughout.
+ */
+
+#ifndef WIFI_ROAM_H
+#define WIFI_ROAM_H
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Add the roaming flags to a STA configuration before connecting
+ *
+ * Without a fixed BSSID the connect also scans all channels and picks the
+ * strongest AP instead of the first one found.
+ */
+void wifi_roam_configure(wifi_config_t *cfg);
+
+/**
+ * @brief Register the event handlers; call once after the default event loop
+ *
+ * @return ESP_OK or an esp_event/esp_timer error
+ */
+esp_err_t wifi_roam_init(void);
+
+/**
+ * @brief Whether the station is between leaving one AP and joining the next
+ *
+ * Connections failing in this window are not the remote end's fault.
+ */
+bool wifi_roam_in_progress(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WIFI_ROAM_H
@@ -0,0 +1,349 @@
+#!/usr/bin/env python3
+"""Fleet simulator: many virtual devices against the real backend and broker.
+
+Each virtual device runs the sequence of the firmware's state machine
+(main.c), with the same requests on the wire:
+
+  provisioning   the AP hand-over, Wi-Fi join and internet check, here a
+                 pause of --prov-ms with --jitter-ms of jitter
+  csr            a P-256 key and a CSR with CN=<device_id>, POSTed to
+                 <backend>/api/v1/sign-csr as {"device_id","csr",
+                 "provisioning_token"}; certificate.content and
+                 ca_certificate.content are taken from the answer. Failures
+                 are retried with the firmware's decorrelated jitter
+                 (retry_policy.h), Retry-After acting as a floor.
+  connect        mTLS MQTT with the signed certificate, client ID
+                 <device_id>, keepalive --keepalive
+  publish        the schema once on <agg topic>/schema at QoS 1, then a
+                 --payload-bytes metrics record on <metrics topic>/cbor
+                 every --interval seconds at --qos
+
+Devices are started at --rate per second, one thread each. Every --report-s
+one line of counters and latencies (ms, p50/p95/p99) goes to stderr; the
+final summary is one JSON object on stdout.
+
+Requires: pip install cryptography paho-mqtt
+"""
+
+import argparse
+import json
+import os
+import random
+import ssl
+import sys
+import tempfile
+import threading
+import time
+import urllib.error
+import urllib.request
+from urllib.parse import urlparse
+
+from cryptography import x509
+from cryptography.hazmat.primitives import hashes, serialization
+from cryptography.hazmat.primitives.asymmetric import ec
+from cryptography.x509.oid import NameOID
+import paho.mqtt.client as mqtt
+
+# Firmware defaults (Kconfig.projbuild)
+CSR_RETRY_MIN_MS = 5000
+CSR_RETRY_MAX_MS = 300000
+SCHEMA_TOPIC_SUFFIX = "/schema"
+CBOR_TOPIC_SUFFIX = "/cbor"
+
+
+class RetryPolicy:
+    """Decorrelated-jitter backoff, as in retry_policy.c."""
+
+    def __init__(self, base_ms, cap_ms):
+        self.base_ms = base_ms
+        self.cap_ms = cap_ms
+        self.prev_ms = 0
+
+    def next(self, hint_ms=0):
+        upper = max(self.base_ms, 3 * self.prev_ms)
+        delay = min(random.uniform(self.base_ms, upper), self.cap_ms)
+        if hint_ms > delay:
+            delay = hint_ms + random.uniform(0, hint_ms / 4)
+        self.prev_ms = delay
+        return delay / 1000.0
+
+
+class Stats:
+    """Counters and latency samples shared by all devices."""
+
+    PHASES = ("csr", "connect", "puback")
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.counts = {k: 0 for k in ("started", "csr_ok", "csr_failed", "csr_retries",
+                                       "connected", "connect_failed", "disconnects",
+                                       "published", "acked", "publish_failed")}
+        self.samples = {p: [] for p in self.PHASES}
+        self.window = {p: [] for p in self.PHASES}
+
+    def count(self, key, n=1):
+        with self.lock:
+            self.counts[key] += n
+
+    def sample(self, phase, seconds):
+        ms = seconds * 1000.0
+        with self.lock:
+            self.samples[phase].append(ms)
+            self.window[phase].append(ms)
+
+    @staticmethod
+    def quantiles(values):
+        if not values:
+            return None
+        values = sorted(values)
+        pick = lambda q: round(values[min(len(values) - 1, int(q * len(values)))], 1)
+        return {"n": len(values), "p50": pick(0.50), "p95": pick(0.95), "p99": pick(0.99),
+                "max": round(values[-1], 1)}
+
+    def snapshot(self, window=False):
+        with self.lock:
+            counts = dict(self.counts)
+            source = self.window if window else self.samples
+            latency = {p: self.quantiles(v) for p, v in source.items()}
+            if window:
+                self.window = {p: [] for p in self.PHASES}
+        return counts, latency
+
+
+def make_csr(device_id):
+    key = ec.generate_private_key(ec.SECP256R1())
+    csr = (x509.CertificateSigningRequestBuilder()
+           .subject_name(x509.Name([x509.NameAttribute(NameOID.COMMON_NAME, device_id)]))
+           .sign(key, hashes.SHA256()))
+    key_pem = key.private_bytes(serialization.Encoding.PEM, serialization.PrivateFormat.PKCS8,
+                                serialization.NoEncryption())
+    return key_pem, csr.public_bytes(serialization.Encoding.PEM).decode()
+
+
+def sign_csr(args, ctx, device_id, csr_pem):
+    """One sign-csr request; returns (cert, ca) or raises with the Retry-After hint."""
+    body = json.dumps({"device_id": device_id, "csr": csr_pem,
+                       "provisioning_token": args.token}).encode()
+    req = urllib.request.Request(args.backend.rstrip("/") + "/api/v1/sign-csr", data=body,
+                                 headers={"Content-Type": "application/json"}, method="POST")
+    try:
+        with urllib.request.urlopen(req, timeout=30, context=ctx) as resp:
+            answer = json.load(resp)
+    except urllib.error.HTTPError as e:
+        retry_after = e.headers.get("Retry-After", "")
+        e.hint_ms = min(int(retry_after), 3600) * 1000 if retry_after.isdigit() else 0
+        raise
+    return answer["certificate"]["content"], answer["ca_certificate"]["content"]
+
+
+class Device(threading.Thread):
+    def __init__(self, index, args, stats, stop, http_ctx):
+        super().__init__(daemon=True, name="dev%d" % index)
+        self.device_id = "%s%04d" % (args.prefix, index)
+        self.args = args
+        self.stats = stats
+        self.stop = stop
+        self.http_ctx = http_ctx
+        self.pending = {}           # mid -> publish time
+        self.early = {}             # mid -> ack time, for acks that beat publish() back
+        self.pending_lock = threading.Lock()
+        self.connected = threading.Event()
+
+    def pause(self, base_ms):
+        self.stop.wait(max(0.0, base_ms + random.uniform(-self.args.jitter_ms, self.args.jitter_ms)) / 1000.0)
+
+    def run(self):
+        self.stats.count("started")
+        self.pause(self.args.prov_ms)
+        creds = self.provision()
+        if creds is not None and not self.stop.is_set():
+            self.mqtt_session(*creds)
+
+    def provision(self):
+        key_pem, csr_pem = make_csr(self.device_id)
+        retry = RetryPolicy(self.args.csr_retry_min_ms, CSR_RETRY_MAX_MS)
+        for attempt in range(self.args.csr_attempts):
+            if self.stop.is_set():
+                return None
+            start = time.monotonic()
+            try:
+                cert, ca = sign_csr(self.args, self.http_ctx, self.device_id, csr_pem)
+            except Exception as e:
+                hint_ms = getattr(e, "hint_ms", 0)
+                if attempt + 1 < self.args.csr_attempts:
+                    self.stats.count("csr_retries")
+                    self.stop.wait(retry.next(hint_ms))
+                continue
+            self.stats.sample("csr", time.monotonic() - start)
+            self.stats.count("csr_ok")
+            return key_pem, cert, ca
+        self.stats.count("csr_failed")
+        return None
+
+    def on_connect(self, client, userdata, flags, reason, properties=None):
+        if reason == 0:
+            self.stats.sample("connect", time.monotonic() - self.connect_start)
+            self.stats.count("connected")
+            self.connected.set()
+        else:
+            self.stats.count("connect_failed")
+
+    def on_disconnect(self, client, userdata, flags, reason=None, properties=None):
+        if self.connected.is_set():
+            self.stats.count("disconnects")
+        self.connected.clear()
+        # paho reconnects on its own; the next CONNACK is timed from here
+        self.connect_start = time.monotonic()
+
+    def acked(self, sent, now):
+        self.stats.sample("puback", now - sent)
+        self.stats.count("acked")
+
+    def on_publish(self, client, userdata, mid, reason=None, properties=None):
+        now = time.monotonic()
+        with self.pending_lock:
+            sent = self.pending.pop(mid, None)
+            if sent is None and self.args.qos > 0:
+                self.early[mid] = now
+        if sent is not None:
+            self.acked(sent, now)
+
+    def publish(self, client, topic, payload, qos):
+        # Not under pending_lock: paho may call on_publish with its own locks held
+        sent = time.monotonic()
+        info = client.publish(topic, payload, qos=qos)
+        if info.rc != mqtt.MQTT_ERR_SUCCESS:
+            self.stats.count("publish_failed")
+            return
+        self.stats.count("published")
+        if qos == 0:
+            return
+        with self.pending_lock:
+            now = self.early.pop(info.mid, None)
+            if now is None:
+                self.pending[info.mid] = sent
+        if now is not None:
+            self.acked(sent, now)
+
+    def mqtt_session(self, key_pem, cert, ca):
+        broker = urlparse(self.args.broker)
+        with tempfile.TemporaryDirectory(prefix=self.device_id) as tmp:
+            paths = {}
+            for name, data in (("key", key_pem.decode()), ("cert", cert), ("ca", self.broker_ca(ca))):
+                paths[name] = os.path.join(tmp, name + ".pem")
+                with open(paths[name], "w") as f:
+                    f.write(data)
+
+            client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=self.device_id)
+            client.tls_set(ca_certs=paths["ca"], certfile=paths["cert"], keyfile=paths["key"])
+            if self.args.insecure:
+                client.tls_insecure_set(True)
+            client.on_connect = self.on_connect
+            client.on_disconnect = self.on_disconnect
+            client.on_publish = self.on_publish
+            client.reconnect_delay_set(1, 30)
+
+            self.connect_start = time.monotonic()
+            try:
+                client.connect(broker.hostname, broker.port or 8883, keepalive=self.args.keepalive)
+            except Exception:
+                self.stats.count("connect_failed")
+                return
+            client.loop_start()
+            try:
+                if not self.connected.wait(30):
+                    self.stats.count("connect_failed")
+                    return
+                self.publish(client, self.args.agg_topic + SCHEMA_TOPIC_SUFFIX, b"v1\n", 1)
+                topic = self.args.metrics_topic + CBOR_TOPIC_SUFFIX
+                while not self.stop.is_set():
+                    if self.connected.is_set():
+                        self.publish(client, topic, os.urandom(self.args.payload_bytes), self.args.qos)
+                    self.pause(self.args.interval * 1000.0)
+            finally:
+                client.disconnect()
+                client.loop_stop()
+
+    def broker_ca(self, ca):
+        # The broker may be signed by another CA than the device certificates
+        if self.args.broker_ca:
+            with open(self.args.broker_ca) as f:
+                return f.read()
+        return ca
+
+
+def report(stats, elapsed, window_s):
+    counts, latency = stats.snapshot(window=True)
+    parts = ["t=%ds" % elapsed]
+    parts += ["%s=%d" % (k, v) for k, v in counts.items()]
+    parts.append("msgs/s=%.1f" % (counts["published"] / elapsed if elapsed else 0.0))
+    for phase, q in latency.items():
+        if q is not None:
+            parts.append("%s[%d]=%s/%s/%s" % (phase, q["n"], q["p50"], q["p95"], q["p99"]))
+    print(" ".join(parts), file=sys.stderr, flush=True)
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    p.add_argument("--backend", required=True, help="Backend base URL, as CONFIG_APP_BACKEND_URL")
+    p.add_argument("--broker", required=True, help="mqtts://host:port")
+    p.add_argument("--token", required=True, help="Provisioning token for every device")
+    p.add_argument("--devices", type=int, default=100)
+    p.add_argument("--prefix", default="sim_", help="Device ID prefix; IDs are <prefix>NNNN")
+    p.add_argument("--rate", type=float, default=10.0, help="Devices started per second")
+    p.add_argument("--prov-ms", type=float, default=3000.0, help="Provisioning and Wi-Fi join time")
+    p.add_argument("--jitter-ms", type=float, default=1000.0, help="Jitter of every pause, +/-")
+    p.add_argument("--csr-attempts", type=int, default=5)
+    p.add_argument("--csr-retry-min-ms", type=int, default=CSR_RETRY_MIN_MS)
+    p.add_argument("--interval", type=float, default=30.0, help="Seconds between publishes")
+    p.add_argument("--payload-bytes", type=int, default=200)
+    p.add_argument("--qos", type=int, choices=(0, 1), default=1)
+    p.add_argument("--keepalive", type=int, default=120)
+    p.add_argument("--agg-topic", default="statsclient/agg")
+    p.add_argument("--metrics-topic", default="statsclient/metrics")
+    p.add_argument("--duration", type=float, default=300.0, help="Seconds to run after the first start")
+    p.add_argument("--report-s", type=float, default=10.0)
+    p.add_argument("--backend-ca", help="CA bundle for the backend instead of the system one")
+    p.add_argument("--broker-ca", help="CA for the broker instead of the one sign-csr returns")
+    p.add_argument("--insecure", action="store_true", help="Skip host name checks (test setups)")
+    args = p.parse_args()
+
+    http_ctx = ssl.create_default_context(cafile=args.backend_ca)
+    if args.insecure:
+        http_ctx.check_hostname = False
+        http_ctx.verify_mode = ssl.CERT_NONE
+
+    threading.stack_size(512 * 1024)
+    stats = Stats()
+    stop = threading.Event()
+    start = time.monotonic()
+    devices = []
+    next_report = start + args.report_s
+    try:
+        while time.monotonic() - start < args.duration:
+            now = time.monotonic()
+            due = min(args.devices, int((now - start) * args.rate) + 1)
+            while len(devices) < due:
+                d = Device(len(devices), args, stats, stop, http_ctx)
+                d.start()
+                devices.append(d)
+            if now >= next_report:
+                report(stats, now - start, args.report_s)
+                next_report += args.report_s
+            time.sleep(0.05)
+    except KeyboardInterrupt:
+        pass
+    stop.set()
+    for d in devices:
+        d.join(timeout=5)
+
+    elapsed = time.monotonic() - start
+    counts, latency = stats.snapshot()
+    json.dump({"devices": len(devices), "elapsed_s": round(elapsed, 1),
+               "msgs_per_s": round(counts["published"] / elapsed, 2) if elapsed else 0.0,
+               "counts": counts, "latency_ms": latency}, sys.stdout)
+    print()
+
+
+if __name__ == "__main__":
+    main()